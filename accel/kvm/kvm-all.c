@@ -44,6 +44,7 @@
 #include "sysemu/reset.h"
 #include "qemu/guest-random.h"
 #include "sysemu/hw_accel.h"
+#include "sysemu/dirtylimit.h"
 #include "kvm-cpus.h"
 
 #include "hw/boards.h"
@@ -743,6 +744,7 @@ static uint32_t kvm_dirty_ring_reap_one(KVMState *s, CPUState *cpu)
         count++;
     }
     cpu->kvm_fetch_index = fetch;
+    cpu->dirty_pages += count;
 
     return count;
 }
@@ -2923,6 +2925,7 @@ int kvm_cpu_exec(CPUState *cpu)
             qemu_mutex_lock_iothread();
             kvm_dirty_ring_reap(kvm_state);
             qemu_mutex_unlock_iothread();
+            dirtylimit_vcpu_execute(cpu);
             ret = 0;
             break;
         case KVM_EXIT_SYSTEM_EVENT:
@@ -3090,6 +3093,16 @@ int kvm_device_access(int fd, int group, uint64_t attr,
     return err;
 }
 
+bool kvm_dirty_ring_enabled(void)
+{
+    return kvm_state->kvm_dirty_ring_size ? true : false;
+}
+
+uint32_t kvm_dirty_ring_size(void)
+{
+    return kvm_state->kvm_dirty_ring_size;
+}
+
 bool kvm_has_sync_mmu(void)
 {
     return kvm_state->sync_mmu;
@@ -624,6 +624,11 @@ static inline void cpu_handle_debug_exception(CPUState *cpu)
     }
 }
 
+static inline void tcg_profile_count(size_t *counter)
+{
+    qatomic_set(counter, *counter + 1);
+}
+
 static inline bool cpu_handle_exception(CPUState *cpu, int *ret)
 {
     if (cpu->exception_index < 0) {
@@ -645,6 +650,7 @@ static inline bool cpu_handle_exception(CPUState *cpu, int *ret)
         cpu->exception_index = -1;
         return true;
     } else {
+        tcg_profile_count(&cpu->tcg_profile->exceptions);
 #if defined(CONFIG_USER_ONLY)
         /* if user mode only, we simulate a fake exception
            which will be handled outside the cpu execution
@@ -761,6 +767,7 @@ static inline bool cpu_handle_interrupt(CPUState *cpu,
         else {
             if (cc->tcg_ops->cpu_exec_interrupt &&
                 cc->tcg_ops->cpu_exec_interrupt(cpu, interrupt_request)) {
+                tcg_profile_count(&cpu->tcg_profile->interrupts);
                 if (need_replay_interrupt(interrupt_request)) {
                     replay_interrupt();
                 }
@@ -811,10 +818,13 @@ static inline void cpu_loop_exec_tb(CPUState *cpu, TranslationBlock *tb,
     trace_exec_tb(tb, tb->pc);
     tb = cpu_tb_exec(cpu, tb, tb_exit);
     if (*tb_exit != TB_EXIT_REQUESTED) {
+        tcg_profile_count(tb ? &cpu->tcg_profile->exit_goto_tb
+                             : &cpu->tcg_profile->exit_unchained);
         *last_tb = tb;
         return;
     }
 
+    tcg_profile_count(&cpu->tcg_profile->exit_requested);
     *last_tb = NULL;
     insns_left = qatomic_read(&cpu_neg(cpu)->icount_decr.u32);
     if (insns_left < 0) {
@@ -981,6 +991,25 @@ int cpu_exec(CPUState *cpu)
     return ret;
 }
 
+static void tcg_profile_init(CPUState *cpu)
+{
+    TCGCPUProfile *prof = g_new0(TCGCPUProfile, 1);
+
+    qemu_mutex_init(&prof->lock);
+    prof->helpers = g_hash_table_new(g_str_hash, g_str_equal);
+    cpu->tcg_profile = prof;
+}
+
+static void tcg_profile_destroy(CPUState *cpu)
+{
+    TCGCPUProfile *prof = cpu->tcg_profile;
+
+    g_hash_table_destroy(prof->helpers);
+    qemu_mutex_destroy(&prof->lock);
+    g_free(prof);
+    cpu->tcg_profile = NULL;
+}
+
 void tcg_exec_realizefn(CPUState *cpu, Error **errp)
 {
     static bool tcg_target_initialized;
@@ -991,6 +1020,7 @@ void tcg_exec_realizefn(CPUState *cpu, Error **errp)
         tcg_target_initialized = true;
     }
     tlb_init(cpu);
+    tcg_profile_init(cpu);
     qemu_plugin_vcpu_init_hook(cpu);
 
 #ifndef CONFIG_USER_ONLY
@@ -1006,6 +1036,7 @@ void tcg_exec_unrealizefn(CPUState *cpu)
 #endif /* !CONFIG_USER_ONLY */
 
     qemu_plugin_vcpu_exit_hook(cpu);
+    tcg_profile_destroy(cpu);
     tlb_destroy(cpu);
 }
 
@@ -26,6 +26,7 @@
 #include "exec/cputlb.h"
 #include "exec/memory-internal.h"
 #include "exec/ram_addr.h"
+#include "sysemu/tcg.h"
 #include "tcg/tcg.h"
 #include "qemu/error-report.h"
 #include "exec/log.h"
@@ -91,11 +92,29 @@ static inline size_t sizeof_tlb(CPUTLBDescFast *fast)
     return fast->mask + (1 << CPU_TLB_ENTRY_BITS);
 }
 
+static inline size_t tlb_l2_n_entries(CPUTLBDesc *desc)
+{
+    return (desc->l2_mask + 1) * CPU_TLB_L2_WAYS;
+}
+
+/* Return true if the second-level entries tagged @asid can be used now */
+static inline bool tlb_l2_asid_match(CPUTLBDesc *desc, uint32_t asid)
+{
+    return asid == desc->asid || asid == CPU_TLB_ASID_GLOBAL;
+}
+
+/* Return the index of the first way of the set for @page */
+static inline size_t tlb_l2_index(CPUTLBDesc *desc, target_ulong page)
+{
+    return ((page >> TARGET_PAGE_BITS) & desc->l2_mask) * CPU_TLB_L2_WAYS;
+}
+
 static void tlb_window_reset(CPUTLBDesc *desc, int64_t ns,
                              size_t max_entries)
 {
     desc->window_begin_ns = ns;
     desc->window_max_entries = max_entries;
+    desc->window_max_fills = 0;
 }
 
 static void tb_jmp_cache_clear_page(CPUState *cpu, target_ulong page_addr)
@@ -115,6 +134,52 @@ static void tb_flush_jmp_cache(CPUState *cpu, target_ulong addr)
     tb_jmp_cache_clear_page(cpu, addr);
 }
 
+static void tlb_l2_alloc(CPUTLBDesc *desc, size_t n_sets)
+{
+    desc->l2_mask = n_sets - 1;
+    desc->l2table = g_new(CPUTLBEntry, n_sets * CPU_TLB_L2_WAYS);
+    desc->l2iotlb = g_new(CPUIOTLBEntry, n_sets * CPU_TLB_L2_WAYS);
+    desc->l2asid = g_new(uint32_t, n_sets * CPU_TLB_L2_WAYS);
+}
+
+/**
+ * tlb_l2_resize_locked() - resize the second-level TLB if necessary
+ * @desc: The CPUTLBDesc portion of the TLB
+ * @window_expired: whether the resize window of @desc has expired
+ *
+ * Called with tlb_lock_held, before flushing the TLB.
+ *
+ * The fills since the last flush are the misses that neither the main,
+ * victim nor second-level TLB could serve.  When there are more of them
+ * than the second-level TLB can hold, the working set of the guest does
+ * not fit and the second-level TLB doubles in size.  Since it is flushed
+ * together with the main TLB, it is halved again when the fills stay
+ * well below its size for a whole window.
+ */
+static void tlb_l2_resize_locked(CPUTLBDesc *desc, bool window_expired)
+{
+    size_t old_sets = desc->l2_mask + 1;
+    size_t n_entries = old_sets * CPU_TLB_L2_WAYS;
+    size_t new_sets = old_sets;
+
+    if (desc->n_fills > desc->window_max_fills) {
+        desc->window_max_fills = desc->n_fills;
+    }
+
+    if (desc->n_fills > n_entries) {
+        new_sets = MIN(old_sets << 1, 1 << CPU_TLB_L2_MAX_BITS);
+    } else if (window_expired && desc->window_max_fills < n_entries / 4) {
+        new_sets = MAX(old_sets >> 1, 1 << CPU_TLB_L2_MIN_BITS);
+    }
+
+    if (new_sets != old_sets) {
+        g_free(desc->l2table);
+        g_free(desc->l2iotlb);
+        g_free(desc->l2asid);
+        tlb_l2_alloc(desc, new_sets);
+    }
+}
+
 /**
  * tlb_mmu_resize_locked() - perform TLB resize bookkeeping; resize if necessary
  * @desc: The CPUTLBDesc portion of the TLB
@@ -165,6 +230,8 @@ static void tlb_mmu_resize_locked(CPUTLBDesc *desc, CPUTLBDescFast *fast,
     int64_t window_len_ns = window_len_ms * 1000 * 1000;
     bool window_expired = now > desc->window_begin_ns + window_len_ns;
 
+    tlb_l2_resize_locked(desc, window_expired);
+
     if (desc->n_used_entries > desc->window_max_entries) {
         desc->window_max_entries = desc->n_used_entries;
     }
@@ -195,6 +262,7 @@ static void tlb_mmu_resize_locked(CPUTLBDesc *desc, CPUTLBDescFast *fast,
     if (new_size == old_size) {
         if (window_expired) {
             tlb_window_reset(desc, now, desc->n_used_entries);
+            desc->window_max_fills = desc->n_fills;
         }
         return;
     }
@@ -230,16 +298,41 @@ static void tlb_mmu_resize_locked(CPUTLBDesc *desc, CPUTLBDescFast *fast,
     }
 }
 
-static void tlb_mmu_flush_locked(CPUTLBDesc *desc, CPUTLBDescFast *fast)
+/*
+ * Flush the main and victim tlb, but keep the second-level tlb and the
+ * large page region, which also covers the second-level entries.
+ */
+static void tlb_mmu_flush_main_locked(CPUTLBDesc *desc, CPUTLBDescFast *fast)
 {
+    if (desc->n_used_entries > desc->window_max_entries) {
+        desc->window_max_entries = desc->n_used_entries;
+    }
     desc->n_used_entries = 0;
-    desc->large_page_addr = -1;
-    desc->large_page_mask = -1;
     desc->vindex = 0;
     memset(fast->table, -1, sizeof_tlb(fast));
     memset(desc->vtable, -1, sizeof(desc->vtable));
 }
 
+/* Called with tlb_c.lock held */
+static void tlb_flush_walk_locked(CPUTLBDesc *desc)
+{
+    desc->windex = 0;
+    memset(desc->wtable, -1, sizeof(desc->wtable));
+}
+
+static void tlb_mmu_flush_locked(CPUTLBDesc *desc, CPUTLBDescFast *fast)
+{
+    tlb_mmu_flush_main_locked(desc, fast);
+    desc->large_page_addr = -1;
+    desc->large_page_mask = -1;
+    desc->l2_index = 0;
+    desc->n_fills = 0;
+    desc->lindex = 0;
+    memset(desc->l2table, -1, tlb_l2_n_entries(desc) * sizeof(CPUTLBEntry));
+    memset(desc->ltable, -1, sizeof(desc->ltable));
+    tlb_flush_walk_locked(desc);
+}
+
 static void tlb_flush_one_mmuidx_locked(CPUArchState *env, int mmu_idx,
                                         int64_t now)
 {
@@ -259,6 +352,8 @@ static void tlb_mmu_init(CPUTLBDesc *desc, CPUTLBDescFast *fast, int64_t now)
     fast->mask = (n_entries - 1) << CPU_TLB_ENTRY_BITS;
     fast->table = g_new(CPUTLBEntry, n_entries);
     desc->iotlb = g_new(CPUIOTLBEntry, n_entries);
+    tlb_l2_alloc(desc, 1 << CPU_TLB_L2_DEFAULT_BITS);
+    desc->asid = CPU_TLB_ASID_UNKNOWN;
     tlb_mmu_flush_locked(desc, fast);
 }
 
@@ -300,6 +395,9 @@ void tlb_destroy(CPUState *cpu)
 
         g_free(fast->table);
         g_free(desc->iotlb);
+        g_free(desc->l2table);
+        g_free(desc->l2iotlb);
+        g_free(desc->l2asid);
     }
 }
 
@@ -339,6 +437,24 @@ void tlb_flush_counts(size_t *pfull, size_t *ppart, size_t *pelide)
     *pelide = elide;
 }
 
+void tlb_cpu_stats(CPUState *cpu, TLBStats *stats)
+{
+    CPUArchState *env = cpu->env_ptr;
+    CPUTLBCommon *c = &env_tlb(env)->c;
+
+    stats->full_flush = qatomic_read(&c->full_flush_count);
+    stats->part_flush = qatomic_read(&c->part_flush_count);
+    stats->elide_flush = qatomic_read(&c->elide_flush_count);
+    stats->miss = qatomic_read(&c->miss_count);
+    stats->vtlb_hit = qatomic_read(&c->vtlb_hit_count);
+    stats->l2_hit = qatomic_read(&c->l2_hit_count);
+    stats->large_hit = qatomic_read(&c->large_hit_count);
+    stats->walk_hit = qatomic_read(&c->walk_hit_count);
+    stats->fill = qatomic_read(&c->fill_count);
+    stats->asid_switch = qatomic_read(&c->asid_switch_count);
+    stats->asid_flush = qatomic_read(&c->asid_flush_count);
+}
+
 static void tlb_flush_by_mmuidx_async_work(CPUState *cpu, run_on_cpu_data data)
 {
     CPUArchState *env = cpu->env_ptr;
@@ -362,6 +478,11 @@ static void tlb_flush_by_mmuidx_async_work(CPUState *cpu, run_on_cpu_data data)
         tlb_flush_one_mmuidx_locked(env, mmu_idx, now);
     }
 
+    /* The target has to tell us the address space again */
+    for (work = asked & ALL_MMUIDX_BITS; work != 0; work &= work - 1) {
+        env_tlb(env)->d[ctz32(work)].asid = CPU_TLB_ASID_UNKNOWN;
+    }
+
     qemu_spin_unlock(&env_tlb(env)->c.lock);
 
     cpu_tb_jmp_cache_clear(cpu);
@@ -427,6 +548,156 @@ void tlb_flush_all_cpus_synced(CPUState *src_cpu)
     tlb_flush_by_mmuidx_all_cpus_synced(src_cpu, ALL_MMUIDX_BITS);
 }
 
+/*
+ * Drop the second-level entries, the large pages and the page walk
+ * cache entries tagged @asid.  Called with tlb_c.lock held.
+ */
+static void tlb_flush_asid_tag_locked(CPUTLBDesc *desc, uint32_t asid)
+{
+    size_t i, n = tlb_l2_n_entries(desc);
+
+    for (i = 0; i < n; i++) {
+        if (desc->l2asid[i] == asid) {
+            memset(&desc->l2table[i], -1, sizeof(CPUTLBEntry));
+        }
+    }
+    for (i = 0; i < CPU_TLB_LARGE_SIZE; i++) {
+        if (desc->ltable[i].asid == asid) {
+            memset(&desc->ltable[i], -1, sizeof(CPUTLBLargePage));
+        }
+    }
+    for (i = 0; i < CPU_TLB_WALK_SIZE; i++) {
+        if (desc->wtable[i].asid == asid) {
+            memset(&desc->wtable[i], -1, sizeof(CPUTLBWalkEntry));
+        }
+    }
+}
+
+/*
+ * The address space switch and flush work items pack the mmu_idx bitmap
+ * and the ASID into a single argument.
+ */
+static inline run_on_cpu_data tlb_asid_data(uint16_t idxmap, uint16_t asid)
+{
+    return RUN_ON_CPU_HOST_ULONG(idxmap | (unsigned long)asid << 16);
+}
+
+static void tlb_set_asid_by_mmuidx_async_work(CPUState *cpu,
+                                              run_on_cpu_data data)
+{
+    CPUArchState *env = cpu->env_ptr;
+    uint16_t idxmap = data.host_ulong;
+    uint32_t asid = (uint16_t)(data.host_ulong >> 16);
+    bool switched = false;
+    int mmu_idx;
+
+    assert_cpu_is_self(cpu);
+
+    tlb_debug("asid: %" PRIu32 " mmu_idx: 0x%04" PRIx16 "\n", asid, idxmap);
+
+    qemu_spin_lock(&env_tlb(env)->c.lock);
+    for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+        CPUTLBDesc *desc = &env_tlb(env)->d[mmu_idx];
+
+        if (!((idxmap >> mmu_idx) & 1) || desc->asid == asid) {
+            continue;
+        }
+        /*
+         * Entries filled before the address space was known can belong
+         * to any address space, so they cannot be kept.
+         */
+        if (desc->asid == CPU_TLB_ASID_UNKNOWN) {
+            tlb_flush_asid_tag_locked(desc, CPU_TLB_ASID_UNKNOWN);
+        }
+        tlb_mmu_flush_main_locked(desc, &env_tlb(env)->f[mmu_idx]);
+        desc->asid = asid;
+        switched = true;
+    }
+    qemu_spin_unlock(&env_tlb(env)->c.lock);
+
+    if (switched) {
+        cpu_tb_jmp_cache_clear(cpu);
+        qatomic_set(&env_tlb(env)->c.asid_switch_count,
+                    env_tlb(env)->c.asid_switch_count + 1);
+    }
+}
+
+void tlb_set_asid_by_mmuidx(CPUState *cpu, uint16_t idxmap, uint16_t asid)
+{
+    /* Without TCG, e.g. with KVM, the TLB is never initialized */
+    if (!tcg_enabled()) {
+        return;
+    }
+
+    if (cpu->created && !qemu_cpu_is_self(cpu)) {
+        async_run_on_cpu(cpu, tlb_set_asid_by_mmuidx_async_work,
+                         tlb_asid_data(idxmap, asid));
+    } else {
+        tlb_set_asid_by_mmuidx_async_work(cpu, tlb_asid_data(idxmap, asid));
+    }
+}
+
+static void tlb_flush_asid_by_mmuidx_async_work(CPUState *cpu,
+                                                run_on_cpu_data data)
+{
+    CPUArchState *env = cpu->env_ptr;
+    uint16_t idxmap = data.host_ulong;
+    uint32_t asid = (uint16_t)(data.host_ulong >> 16);
+    bool flushed = false;
+    int mmu_idx;
+
+    assert_cpu_is_self(cpu);
+
+    tlb_debug("asid: %" PRIu32 " mmu_idx: 0x%04" PRIx16 "\n", asid, idxmap);
+
+    qemu_spin_lock(&env_tlb(env)->c.lock);
+    for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+        CPUTLBDesc *desc = &env_tlb(env)->d[mmu_idx];
+
+        if (!((idxmap >> mmu_idx) & 1)) {
+            continue;
+        }
+        tlb_flush_asid_tag_locked(desc, asid);
+        if (desc->asid == CPU_TLB_ASID_UNKNOWN) {
+            tlb_flush_asid_tag_locked(desc, CPU_TLB_ASID_UNKNOWN);
+        } else if (desc->asid != asid) {
+            continue;
+        }
+        tlb_mmu_flush_main_locked(desc, &env_tlb(env)->f[mmu_idx]);
+        flushed = true;
+    }
+    qemu_spin_unlock(&env_tlb(env)->c.lock);
+
+    if (flushed) {
+        cpu_tb_jmp_cache_clear(cpu);
+    }
+    qatomic_set(&env_tlb(env)->c.asid_flush_count,
+                env_tlb(env)->c.asid_flush_count + 1);
+}
+
+void tlb_flush_asid_by_mmuidx(CPUState *cpu, uint16_t idxmap, uint16_t asid)
+{
+    if (!tcg_enabled()) {
+        return;
+    }
+
+    if (cpu->created && !qemu_cpu_is_self(cpu)) {
+        async_run_on_cpu(cpu, tlb_flush_asid_by_mmuidx_async_work,
+                         tlb_asid_data(idxmap, asid));
+    } else {
+        tlb_flush_asid_by_mmuidx_async_work(cpu, tlb_asid_data(idxmap, asid));
+    }
+}
+
+void tlb_flush_asid_by_mmuidx_all_cpus_synced(CPUState *src_cpu,
+                                              uint16_t idxmap, uint16_t asid)
+{
+    const run_on_cpu_func fn = tlb_flush_asid_by_mmuidx_async_work;
+
+    flush_all_helper(src_cpu, fn, tlb_asid_data(idxmap, asid));
+    async_safe_run_on_cpu(src_cpu, fn, tlb_asid_data(idxmap, asid));
+}
+
 static bool tlb_hit_page_mask_anyprot(CPUTLBEntry *tlb_entry,
                                       target_ulong page, target_ulong mask)
 {
@@ -493,6 +764,20 @@ static inline void tlb_flush_vtlb_page_locked(CPUArchState *env, int mmu_idx,
     tlb_flush_vtlb_page_mask_locked(env, mmu_idx, page, -1);
 }
 
+/* Called with tlb_c.lock held */
+static void tlb_flush_l2_page_mask_locked(CPUArchState *env, int mmu_idx,
+                                          target_ulong page,
+                                          target_ulong mask)
+{
+    CPUTLBDesc *d = &env_tlb(env)->d[mmu_idx];
+    size_t base = tlb_l2_index(d, page);
+    int k;
+
+    for (k = 0; k < CPU_TLB_L2_WAYS; k++) {
+        tlb_flush_entry_mask_locked(&d->l2table[base + k], page, mask);
+    }
+}
+
 static void tlb_flush_page_locked(CPUArchState *env, int midx,
                                   target_ulong page)
 {
@@ -510,6 +795,13 @@ static void tlb_flush_page_locked(CPUArchState *env, int midx,
             tlb_n_used_entries_dec(env, midx);
         }
         tlb_flush_vtlb_page_locked(env, midx, page);
+        tlb_flush_l2_page_mask_locked(env, midx, page, -1);
+        /*
+         * The page tables may have been changed or freed along with the
+         * page, and the range that each of them translates is unknown
+         * here.
+         */
+        tlb_flush_walk_locked(&env_tlb(env)->d[midx]);
     }
 }
 
@@ -714,6 +1006,7 @@ static void tlb_flush_range_locked(CPUArchState *env, int midx,
     CPUTLBDesc *d = &env_tlb(env)->d[midx];
     CPUTLBDescFast *f = &env_tlb(env)->f[midx];
     target_ulong mask = MAKE_64BIT_MASK(0, bits);
+    bool mask_l2 = true;
 
     /*
      * If @bits is smaller than the tlb size, there may be multiple entries
@@ -746,6 +1039,16 @@ static void tlb_flush_range_locked(CPUArchState *env, int midx,
         return;
     }
 
+    /*
+     * Likewise, addresses that match under @mask can be in any set of
+     * the second-level tlb if @mask does not cover the set index.
+     */
+    if ((mask >> TARGET_PAGE_BITS) < d->l2_mask) {
+        memset(d->l2table, -1, tlb_l2_n_entries(d) * sizeof(CPUTLBEntry));
+        mask_l2 = false;
+    }
+    tlb_flush_walk_locked(d);
+
     for (target_ulong i = 0; i < len; i += TARGET_PAGE_SIZE) {
         target_ulong page = addr + i;
         CPUTLBEntry *entry = tlb_entry(env, midx, page);
@@ -754,6 +1057,9 @@ static void tlb_flush_range_locked(CPUArchState *env, int midx,
             tlb_n_used_entries_dec(env, midx);
         }
         tlb_flush_vtlb_page_mask_locked(env, midx, page, mask);
+        if (mask_l2) {
+            tlb_flush_l2_page_mask_locked(env, midx, page, mask);
+        }
     }
 }
 
@@ -1025,6 +1331,12 @@ void tlb_reset_dirty(CPUState *cpu, ram_addr_t start1, ram_addr_t length)
             tlb_reset_dirty_range_locked(&env_tlb(env)->d[mmu_idx].vtable[i],
                                          start1, length);
         }
+
+        n = tlb_l2_n_entries(&env_tlb(env)->d[mmu_idx]);
+        for (i = 0; i < n; i++) {
+            tlb_reset_dirty_range_locked(&env_tlb(env)->d[mmu_idx].l2table[i],
+                                         start1, length);
+        }
     }
     qemu_spin_unlock(&env_tlb(env)->c.lock);
 }
@@ -1054,9 +1366,15 @@ void tlb_set_dirty(CPUState *cpu, target_ulong vaddr)
     }
 
     for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+        CPUTLBDesc *d = &env_tlb(env)->d[mmu_idx];
+        size_t base = tlb_l2_index(d, vaddr);
         int k;
+
         for (k = 0; k < CPU_VTLB_SIZE; k++) {
-            tlb_set_dirty1_locked(&env_tlb(env)->d[mmu_idx].vtable[k], vaddr);
+            tlb_set_dirty1_locked(&d->vtable[k], vaddr);
+        }
+        for (k = 0; k < CPU_TLB_L2_WAYS; k++) {
+            tlb_set_dirty1_locked(&d->l2table[base + k], vaddr);
         }
     }
     qemu_spin_unlock(&env_tlb(env)->c.lock);
@@ -1086,6 +1404,43 @@ static void tlb_add_large_page(CPUArchState *env, int mmu_idx,
     env_tlb(env)->d[mmu_idx].large_page_mask = lp_mask;
 }
 
+/*
+ * Record a new TLB entry in the second-level tlb, tagged with @asid.  It
+ * replaces the entry for the same page in the current address space if
+ * there is one, otherwise an empty way, otherwise the ways of a full set
+ * are replaced in turn.
+ *
+ * Called with tlb_c.lock held.
+ */
+static void tlb_l2_insert_locked(CPUTLBDesc *desc, target_ulong vaddr_page,
+                                 const CPUTLBEntry *te,
+                                 const CPUIOTLBEntry *io, uint32_t asid)
+{
+    size_t base = tlb_l2_index(desc, vaddr_page);
+    size_t way = CPU_TLB_L2_WAYS;
+    size_t k;
+
+    for (k = 0; k < CPU_TLB_L2_WAYS; k++) {
+        CPUTLBEntry *e = &desc->l2table[base + k];
+
+        if (tlb_hit_page_anyprot(e, vaddr_page) &&
+            tlb_l2_asid_match(desc, desc->l2asid[base + k])) {
+            way = k;
+            break;
+        }
+        if (way == CPU_TLB_L2_WAYS && tlb_entry_is_empty(e)) {
+            way = k;
+        }
+    }
+    if (way == CPU_TLB_L2_WAYS) {
+        way = desc->l2_index++ % CPU_TLB_L2_WAYS;
+    }
+
+    copy_tlb_helper_locked(&desc->l2table[base + way], te);
+    desc->l2iotlb[base + way] = *io;
+    desc->l2asid[base + way] = asid;
+}
+
 /* Add a new TLB entry. At most one entry for a given virtual address
  * is permitted. Only a single TARGET_PAGE_SIZE region is mapped, the
  * supplied size is only used by tlb_flush_page.
@@ -1260,6 +1615,61 @@ void tlb_set_page_with_attrs(CPUState *cpu, target_ulong vaddr,
 
     copy_tlb_helper_locked(te, &tn);
     tlb_n_used_entries_inc(env, mmu_idx);
+
+    /* Entries that must be refilled on every access are not worth keeping */
+    if (!(address & TLB_INVALID_MASK)) {
+        tlb_l2_insert_locked(desc, vaddr_page, &tn, &desc->iotlb[index],
+                             prot & PAGE_GLOBAL ? CPU_TLB_ASID_GLOBAL
+                                                : desc->asid);
+    }
+    desc->n_fills++;
+    qemu_spin_unlock(&tlb->c.lock);
+
+    qatomic_set(&tlb->c.fill_count, tlb->c.fill_count + 1);
+}
+
+void tlb_set_large_page_with_attrs(CPUState *cpu, target_ulong vaddr,
+                                   hwaddr paddr, MemTxAttrs attrs,
+                                   int prot, int mmu_idx, target_ulong size)
+{
+    CPUArchState *env = cpu->env_ptr;
+    CPUTLB *tlb = env_tlb(env);
+    CPUTLBDesc *desc = &tlb->d[mmu_idx];
+    target_ulong mask = ~(size - 1);
+    CPUTLBLargePage *lp = NULL;
+    size_t i;
+
+    tlb_set_page_with_attrs(cpu, vaddr, paddr, attrs, prot, mmu_idx, size);
+
+    /* Entries that must be refilled on every access are not worth keeping */
+    if (size <= TARGET_PAGE_SIZE || (prot & PAGE_WRITE_INV)) {
+        return;
+    }
+    assert(is_power_of_2(size));
+
+    vaddr &= TARGET_PAGE_MASK;
+    paddr &= TARGET_PAGE_MASK;
+
+    qemu_spin_lock(&tlb->c.lock);
+
+    /* Refills of the same large page, e.g. once it is dirty, replace it */
+    for (i = 0; i < CPU_TLB_LARGE_SIZE; i++) {
+        if (desc->ltable[i].vaddr == (vaddr & mask) &&
+            tlb_l2_asid_match(desc, desc->ltable[i].asid)) {
+            lp = &desc->ltable[i];
+            break;
+        }
+    }
+    if (!lp) {
+        lp = &desc->ltable[desc->lindex++ % CPU_TLB_LARGE_SIZE];
+    }
+
+    lp->vaddr = vaddr & mask;
+    lp->mask = mask;
+    lp->paddr = paddr - (vaddr & ~mask);
+    lp->attrs = attrs;
+    lp->prot = prot;
+    lp->asid = prot & PAGE_GLOBAL ? CPU_TLB_ASID_GLOBAL : desc->asid;
     qemu_spin_unlock(&tlb->c.lock);
 }
 
@@ -1274,6 +1684,55 @@ void tlb_set_page(CPUState *cpu, target_ulong vaddr,
                             prot, mmu_idx, size);
 }
 
+void tlb_walk_cache_insert(CPUState *cpu, target_ulong vaddr, int mmu_idx,
+                           target_ulong size, uint64_t table, uint64_t attrs)
+{
+    CPUArchState *env = cpu->env_ptr;
+    CPUTLB *tlb = env_tlb(env);
+    CPUTLBDesc *desc = &tlb->d[mmu_idx];
+    CPUTLBWalkEntry *we;
+
+    assert_cpu_is_self(cpu);
+    assert(is_power_of_2(size));
+
+    qemu_spin_lock(&tlb->c.lock);
+    we = &desc->wtable[desc->windex++ % CPU_TLB_WALK_SIZE];
+    we->mask = ~(size - 1);
+    we->vaddr = vaddr & we->mask;
+    we->table = table;
+    we->attrs = attrs;
+    we->asid = desc->asid;
+    /* So that a flush of @mmu_idx does not skip it */
+    tlb->c.dirty |= 1 << mmu_idx;
+    qemu_spin_unlock(&tlb->c.lock);
+}
+
+bool tlb_walk_cache_lookup(CPUState *cpu, target_ulong vaddr, int mmu_idx,
+                           uint64_t *table, uint64_t *attrs)
+{
+    CPUArchState *env = cpu->env_ptr;
+    CPUTLBDesc *desc = &env_tlb(env)->d[mmu_idx];
+    size_t i;
+
+    assert_cpu_is_self(cpu);
+
+    /* The page-aligned address never matches an unused entry */
+    vaddr &= TARGET_PAGE_MASK;
+    for (i = 0; i < CPU_TLB_WALK_SIZE; i++) {
+        CPUTLBWalkEntry *we = &desc->wtable[i];
+
+        if ((vaddr & we->mask) == we->vaddr &&
+            tlb_l2_asid_match(desc, we->asid)) {
+            *table = we->table;
+            *attrs = we->attrs;
+            qatomic_set(&env_tlb(env)->c.walk_hit_count,
+                        env_tlb(env)->c.walk_hit_count + 1);
+            return true;
+        }
+    }
+    return false;
+}
+
 static inline ram_addr_t qemu_ram_addr_from_host_nofail(void *ptr)
 {
     ram_addr_t ram_addr;
@@ -1352,7 +1811,7 @@ static uint64_t io_readx(CPUArchState *env, CPUIOTLBEntry *iotlbentry,
         cpu_io_recompile(cpu, retaddr);
     }
 
-    if (!qemu_mutex_iothread_locked()) {
+    if (mr->global_locking && !qemu_mutex_iothread_locked()) {
         qemu_mutex_lock_iothread();
         locked = true;
     }
@@ -1413,7 +1872,7 @@ static void io_writex(CPUArchState *env, CPUIOTLBEntry *iotlbentry,
      */
     save_iotlb_data(cpu, iotlbentry->addr, section, mr_offset);
 
-    if (!qemu_mutex_iothread_locked()) {
+    if (mr->global_locking && !qemu_mutex_iothread_locked()) {
         qemu_mutex_lock_iothread();
         locked = true;
     }
@@ -1442,14 +1901,95 @@ static inline target_ulong tlb_read_ofs(CPUTLBEntry *entry, size_t ofs)
 #endif
 }
 
-/* Return true if ADDR is present in the victim tlb, and has been copied
-   back to the main tlb.  */
+/*
+ * Return true if ADDR is present in the second-level tlb, and has been
+ * copied to the main tlb.  The entry that it replaces moves to the
+ * victim tlb.
+ */
+static bool tlb_l2_hit(CPUArchState *env, size_t mmu_idx, size_t index,
+                       size_t elt_ofs, target_ulong page)
+{
+    CPUTLB *tlb = env_tlb(env);
+    CPUTLBDesc *desc = &tlb->d[mmu_idx];
+    CPUTLBEntry *te = &tlb->f[mmu_idx].table[index];
+    size_t base = tlb_l2_index(desc, page);
+    size_t k;
+
+    for (k = 0; k < CPU_TLB_L2_WAYS; k++) {
+        CPUTLBEntry *l2 = &desc->l2table[base + k];
+
+        if (!tlb_hit_page(tlb_read_ofs(l2, elt_ofs), page) ||
+            !tlb_l2_asid_match(desc, desc->l2asid[base + k])) {
+            continue;
+        }
+
+        qemu_spin_lock(&tlb->c.lock);
+        if (tlb_entry_is_empty(te)) {
+            tlb_n_used_entries_inc(env, mmu_idx);
+        } else {
+            unsigned vidx = desc->vindex++ % CPU_VTLB_SIZE;
+
+            copy_tlb_helper_locked(&desc->vtable[vidx], te);
+            desc->viotlb[vidx] = desc->iotlb[index];
+        }
+        copy_tlb_helper_locked(te, l2);
+        desc->iotlb[index] = desc->l2iotlb[base + k];
+        qemu_spin_unlock(&tlb->c.lock);
+
+        qatomic_set(&tlb->c.l2_hit_count, tlb->c.l2_hit_count + 1);
+        return true;
+    }
+    return false;
+}
+
+/*
+ * Return true if ADDR is within one of the large pages, and a new entry
+ * for it has been added to the main tlb.
+ */
+static bool tlb_large_page_hit(CPUArchState *env, size_t mmu_idx,
+                               size_t elt_ofs, target_ulong page)
+{
+    CPUTLBDesc *desc = &env_tlb(env)->d[mmu_idx];
+    int access;
+    size_t i;
+
+    if (elt_ofs == offsetof(CPUTLBEntry, addr_code)) {
+        access = PAGE_EXEC;
+    } else if (elt_ofs == offsetof(CPUTLBEntry, addr_write)) {
+        access = PAGE_WRITE;
+    } else {
+        access = PAGE_READ;
+    }
+
+    for (i = 0; i < CPU_TLB_LARGE_SIZE; i++) {
+        CPUTLBLargePage *lp = &desc->ltable[i];
+
+        if ((page & lp->mask) != lp->vaddr || !(lp->prot & access) ||
+            !tlb_l2_asid_match(desc, lp->asid)) {
+            continue;
+        }
+
+        tlb_set_page_with_attrs(env_cpu(env), page,
+                                lp->paddr + (page & ~lp->mask), lp->attrs,
+                                lp->prot, mmu_idx, ~lp->mask + 1);
+        qatomic_set(&env_tlb(env)->c.large_hit_count,
+                    env_tlb(env)->c.large_hit_count + 1);
+        return true;
+    }
+    return false;
+}
+
+/*
+ * Return true if ADDR is present in the victim or second-level tlb, or
+ * within a large page, and has been copied back to the main tlb.
+ */
 static bool victim_tlb_hit(CPUArchState *env, size_t mmu_idx, size_t index,
                            size_t elt_ofs, target_ulong page)
 {
     size_t vidx;
 
     assert_cpu_is_self(env_cpu(env));
+    qatomic_set(&env_tlb(env)->c.miss_count, env_tlb(env)->c.miss_count + 1);
     for (vidx = 0; vidx < CPU_VTLB_SIZE; ++vidx) {
         CPUTLBEntry *vtlb = &env_tlb(env)->d[mmu_idx].vtable[vidx];
         target_ulong cmp;
@@ -1474,10 +2014,14 @@ static bool victim_tlb_hit(CPUArchState *env, size_t mmu_idx, size_t index,
             CPUIOTLBEntry tmpio, *io = &env_tlb(env)->d[mmu_idx].iotlb[index];
             CPUIOTLBEntry *vio = &env_tlb(env)->d[mmu_idx].viotlb[vidx];
             tmpio = *io; *io = *vio; *vio = tmpio;
+
+            qatomic_set(&env_tlb(env)->c.vtlb_hit_count,
+                        env_tlb(env)->c.vtlb_hit_count + 1);
             return true;
         }
     }
-    return false;
+    return tlb_l2_hit(env, mmu_idx, index, elt_ofs, page) ||
+           tlb_large_page_hit(env, mmu_idx, elt_ofs, page);
 }
 
 /* Macro to call the above, with local variables from the use context.  */
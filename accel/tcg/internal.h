@@ -11,6 +11,40 @@
 
 #include "exec/exec-all.h"
 
+/*
+ * JIT statistics of a vCPU, reported by x-query-jit-profile.  Only the
+ * thread of the vCPU writes them.
+ */
+typedef struct TCGCPUProfile {
+    /* Translation statistics, updated with qatomic_set_u64 */
+    uint64_t translations;
+    uint64_t frontend_ns;
+    uint64_t backend_ns;
+    uint64_t ops_before_opt;
+    uint64_t ops_after_opt;
+    uint64_t guest_insns;
+    uint64_t guest_bytes;
+    uint64_t host_bytes;
+
+    /* Protects @helpers */
+    QemuMutex lock;
+    /* helper name -> number of call sites, while tb_exec_count_enabled */
+    GHashTable *helpers;
+
+    /* Returns to the execution loop, updated with qatomic_set */
+    size_t exit_goto_tb;
+    size_t exit_unchained;
+    size_t exit_requested;
+    size_t exceptions;
+    size_t interrupts;
+} TCGCPUProfile;
+
+/*
+ * Written with a tb_flush, so that all the TBs agree with it.  Also
+ * enables the count of helper call sites in TCGCPUProfile.
+ */
+extern bool tb_exec_count_enabled;
+
 TranslationBlock *tb_gen_code(CPUState *cpu, target_ulong pc,
                               target_ulong cs_base, uint32_t flags,
                               int cflags);
@@ -0,0 +1,175 @@
+/*
+ * QMP commands for the TCG accelerator
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "qapi/qapi-commands-machine.h"
+#include "exec/exec-all.h"
+#include "hw/core/cpu.h"
+#include "sysemu/tcg.h"
+#include "tcg/tcg.h"
+#include "internal.h"
+
+static gint jit_profile_helper_cmp(gconstpointer a, gconstpointer b)
+{
+    const JitProfileHelper *ha = *(JitProfileHelper * const *)a;
+    const JitProfileHelper *hb = *(JitProfileHelper * const *)b;
+
+    if (ha->call_sites != hb->call_sites) {
+        return ha->call_sites > hb->call_sites ? -1 : 1;
+    }
+    return strcmp(ha->name, hb->name);
+}
+
+/* Called with prof->lock held */
+static JitProfileHelperList *jit_profile_helpers(TCGCPUProfile *prof)
+{
+    g_autoptr(GPtrArray) helpers = g_ptr_array_new();
+    JitProfileHelperList *head = NULL, **tail = &head;
+    GHashTableIter iter;
+    gpointer name, count;
+    guint i;
+
+    g_hash_table_iter_init(&iter, prof->helpers);
+    while (g_hash_table_iter_next(&iter, &name, &count)) {
+        JitProfileHelper *helper = g_new0(JitProfileHelper, 1);
+
+        helper->name = g_strdup(name);
+        helper->call_sites = GPOINTER_TO_SIZE(count);
+        g_ptr_array_add(helpers, helper);
+    }
+    g_ptr_array_sort(helpers, jit_profile_helper_cmp);
+
+    for (i = 0; i < helpers->len; i++) {
+        QAPI_LIST_APPEND(tail, g_ptr_array_index(helpers, i));
+    }
+    return head;
+}
+
+static JitProfileVCPU *jit_profile_vcpu(CPUState *cpu)
+{
+    TCGCPUProfile *prof = cpu->tcg_profile;
+    JitProfileVCPU *vcpu = g_new0(JitProfileVCPU, 1);
+
+    vcpu->cpu_index = cpu->cpu_index;
+
+    vcpu->translations = qatomic_read_u64(&prof->translations);
+    vcpu->frontend_ns = qatomic_read_u64(&prof->frontend_ns);
+    vcpu->backend_ns = qatomic_read_u64(&prof->backend_ns);
+    vcpu->ops_before_opt = qatomic_read_u64(&prof->ops_before_opt);
+    vcpu->ops_after_opt = qatomic_read_u64(&prof->ops_after_opt);
+    vcpu->guest_insns = qatomic_read_u64(&prof->guest_insns);
+    vcpu->guest_bytes = qatomic_read_u64(&prof->guest_bytes);
+    vcpu->host_bytes = qatomic_read_u64(&prof->host_bytes);
+
+    qemu_mutex_lock(&prof->lock);
+    vcpu->helpers = jit_profile_helpers(prof);
+    qemu_mutex_unlock(&prof->lock);
+
+    vcpu->exit_goto_tb = qatomic_read(&prof->exit_goto_tb);
+    vcpu->exit_unchained = qatomic_read(&prof->exit_unchained);
+    vcpu->exit_requested = qatomic_read(&prof->exit_requested);
+    vcpu->exceptions = qatomic_read(&prof->exceptions);
+    vcpu->interrupts = qatomic_read(&prof->interrupts);
+    return vcpu;
+}
+
+/* Called with the region tree locks held, see tcg_tb_foreach */
+static gboolean jit_profile_tb(gpointer key, gpointer value, gpointer data)
+{
+    const TranslationBlock *tb = value;
+    uint32_t exec_count = qatomic_read(&tb->exec_count);
+    GArray *tbs = data;
+    JitProfileTB entry;
+
+    /* Approximate, the TBs increment the count without atomics */
+    if (!exec_count || (tb_cflags(tb) & CF_INVALID)) {
+        return false;
+    }
+
+    entry = (JitProfileTB) {
+        .pc = tb->pc,
+        .flags = tb->flags,
+        .guest_insns = tb->icount,
+        .guest_bytes = tb->size,
+        .host_bytes = tb->tc.size,
+        .exec_count = exec_count,
+    };
+    g_array_append_val(tbs, entry);
+    return false;
+}
+
+static gint jit_profile_tb_cmp(gconstpointer a, gconstpointer b)
+{
+    const JitProfileTB *ea = a;
+    const JitProfileTB *eb = b;
+
+    if (ea->exec_count != eb->exec_count) {
+        return ea->exec_count > eb->exec_count ? -1 : 1;
+    }
+    return 0;
+}
+
+static JitProfileTBList *jit_profile_hot_tbs(int64_t top)
+{
+    g_autoptr(GArray) tbs = g_array_new(false, false, sizeof(JitProfileTB));
+    JitProfileTBList *head = NULL, **tail = &head;
+    guint i;
+
+    tcg_tb_foreach(jit_profile_tb, tbs);
+    g_array_sort(tbs, jit_profile_tb_cmp);
+
+    for (i = 0; i < tbs->len && i < top; i++) {
+        QAPI_LIST_APPEND(tail, g_memdup(&g_array_index(tbs, JitProfileTB, i),
+                                        sizeof(JitProfileTB)));
+    }
+    return head;
+}
+
+JitProfile *qmp_x_query_jit_profile(bool has_top, int64_t top, Error **errp)
+{
+    JitProfile *profile;
+    JitProfileVCPUList **tail;
+    CPUState *cpu;
+
+    if (!tcg_enabled()) {
+        error_setg(errp, "JIT information is only available with accel=tcg");
+        return NULL;
+    }
+    if (!has_top) {
+        top = 10;
+    } else if (top < 0) {
+        error_setg(errp, "Parameter 'top' must not be negative");
+        return NULL;
+    }
+
+    profile = g_new0(JitProfile, 1);
+    tail = &profile->vcpus;
+    CPU_FOREACH(cpu) {
+        QAPI_LIST_APPEND(tail, jit_profile_vcpu(cpu));
+    }
+
+    profile->tb_exec_count = qatomic_read(&tb_exec_count_enabled);
+    if (profile->tb_exec_count) {
+        profile->hot_tbs = jit_profile_hot_tbs(top);
+    }
+    return profile;
+}
+
+void qmp_x_jit_set_tb_exec_count(bool enable, Error **errp)
+{
+    if (!tcg_enabled()) {
+        error_setg(errp, "JIT information is only available with accel=tcg");
+        return;
+    }
+    if (enable == qatomic_read(&tb_exec_count_enabled)) {
+        return;
+    }
+
+    /* Retranslate, so that all the TBs agree with the new setting */
+    qatomic_set(&tb_exec_count_enabled, enable);
+    tb_flush(first_cpu);
+}
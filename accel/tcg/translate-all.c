@@ -220,6 +220,8 @@ static void *l1_map[V_L1_MAX_SIZE];
 
 TBContext tb_ctx;
 
+bool tb_exec_count_enabled;
+
 static void page_table_config_init(void)
 {
     uint32_t v_l1_bits;
@@ -1184,11 +1186,14 @@ static void do_tb_phys_invalidate(TranslationBlock *tb, bool rm_from_page_list)
     qatomic_set(&tb->cflags, tb->cflags | CF_INVALID);
     qemu_spin_unlock(&tb->jmp_lock);
 
-    /* remove the TB from the hash list */
+    /*
+     * remove the TB from the hash list; temporary TBs were never added,
+     * and are invalidated only once, when their region is recycled
+     */
     phys_pc = tb->page_addr[0] + (tb->pc & ~TARGET_PAGE_MASK);
     h = tb_hash_func(phys_pc, tb->pc, tb->flags, orig_cflags,
                      tb->trace_vcpu_dstate);
-    if (!qht_remove(&tb_ctx.htable, tb, h)) {
+    if (!qht_remove(&tb_ctx.htable, tb, h) && tb->page_addr[0] != -1) {
         return;
     }
 
@@ -1400,6 +1405,47 @@ tb_link_page(TranslationBlock *tb, tb_page_addr_t phys_pc,
     return tb;
 }
 
+static void tb_profile_helper_call(const char *name, void *opaque)
+{
+    GHashTable *helpers = opaque;
+    size_t count = GPOINTER_TO_SIZE(g_hash_table_lookup(helpers, name));
+
+    g_hash_table_insert(helpers, (gpointer)name, GSIZE_TO_POINTER(count + 1));
+}
+
+static inline void tb_profile_add(uint64_t *counter, uint64_t value)
+{
+    qatomic_set_u64(counter, *counter + value);
+}
+
+/*
+ * Account a translation to the JIT statistics of @cpu.  Walking the ops
+ * for the helper calls takes a lock and updates a hash table, so it only
+ * happens while tb_exec_count_enabled is set.
+ */
+static void tb_gen_code_profile(CPUState *cpu, TranslationBlock *tb,
+                                int ops_before_opt, int64_t frontend_ns,
+                                int64_t backend_ns, bool helpers)
+{
+    TCGCPUProfile *prof = cpu->tcg_profile;
+
+    tb_profile_add(&prof->translations, 1);
+    tb_profile_add(&prof->frontend_ns, frontend_ns);
+    tb_profile_add(&prof->backend_ns, backend_ns);
+    tb_profile_add(&prof->ops_before_opt, ops_before_opt);
+    tb_profile_add(&prof->ops_after_opt, tcg_ctx->nb_ops);
+    tb_profile_add(&prof->guest_insns, tb->icount);
+    tb_profile_add(&prof->guest_bytes, tb->size);
+    tb_profile_add(&prof->host_bytes, tb->tc.size);
+
+    if (helpers) {
+        qemu_mutex_lock(&prof->lock);
+        tcg_foreach_helper_call(tcg_ctx, tb_profile_helper_call,
+                                prof->helpers);
+        qemu_mutex_unlock(&prof->lock);
+    }
+}
+
 /* Called with mmap_lock held for user mode emulation.  */
 TranslationBlock *tb_gen_code(CPUState *cpu,
                               target_ulong pc, target_ulong cs_base,
@@ -1410,7 +1456,8 @@ TranslationBlock *tb_gen_code(CPUState *cpu,
     tb_page_addr_t phys_pc, phys_page2;
     target_ulong virt_page2;
     tcg_insn_unit *gen_code_buf;
-    int gen_code_size, search_size, max_insns;
+    int gen_code_size, search_size, max_insns, nb_ops;
+    int64_t t0, t1;
 #ifdef CONFIG_PROFILER
     TCGProfile *prof = &tcg_ctx->prof;
     int64_t ti;
@@ -1435,7 +1482,7 @@ TranslationBlock *tb_gen_code(CPUState *cpu,
  buffer_overflow:
     tb = tcg_tb_alloc(tcg_ctx);
     if (unlikely(!tb)) {
-        /* flush must be done */
+        /* no region could be recycled in time, flush must be done */
         tb_flush(cpu);
         mmap_unlock();
         /* Make the execution loop process the flush as soon as possible.  */
@@ -1450,8 +1497,10 @@ TranslationBlock *tb_gen_code(CPUState *cpu,
     tb->flags = flags;
     tb->cflags = cflags;
     tb->trace_vcpu_dstate = *cpu->trace_dstate;
+    tb->exec_count = 0;
     tcg_ctx->tb_cflags = cflags;
  tb_overflow:
+    t0 = get_clock();
 
 #ifdef CONFIG_PROFILER
     /* includes aborted translations because of exceptions */
@@ -1493,6 +1542,8 @@ TranslationBlock *tb_gen_code(CPUState *cpu,
     ti = profile_getclock();
 #endif
 
+    nb_ops = tcg_ctx->nb_ops;
+    t1 = get_clock();
     gen_code_size = tcg_gen_code(tcg_ctx, tb);
     if (unlikely(gen_code_size < 0)) {
  error_return:
@@ -1539,6 +1590,8 @@ TranslationBlock *tb_gen_code(CPUState *cpu,
         goto buffer_overflow;
     }
     tb->tc.size = gen_code_size;
+    tb_gen_code_profile(cpu, tb, nb_ops, t1 - t0, get_clock() - t1,
+                        qatomic_read(&tb_exec_count_enabled));
 
 #ifdef CONFIG_PROFILER
     qatomic_set(&prof->code_time, prof->code_time + profile_getclock() - ti);
@@ -1636,6 +1689,14 @@ TranslationBlock *tb_gen_code(CPUState *cpu,
         tb_reset_jump(tb, 1);
     }
 
+    /*
+     * Insert TB into the corresponding region tree before publishing it
+     * through QHT. Otherwise rewinding happened in the TB might fail to
+     * lookup itself using host PC.  Temporary TBs are inserted as well,
+     * so that recycling their region finds them and unlinks their jumps.
+     */
+    tcg_tb_insert(tb);
+
     /*
      * If the TB is not associated with a physical RAM page then
      * it must be a temporary one-insn TB, and we have nothing to do
@@ -1647,13 +1708,6 @@ TranslationBlock *tb_gen_code(CPUState *cpu,
         return tb;
     }
 
-    /*
-     * Insert TB into the corresponding region tree before publishing it
-     * through QHT. Otherwise rewinding happened in the TB might fail to
-     * lookup itself using host PC.
-     */
-    tcg_tb_insert(tb);
-
     /* check next page if needed */
     virt_page2 = (pc + tb->size - 1) & TARGET_PAGE_MASK;
     phys_page2 = -1;
@@ -2089,6 +2143,7 @@ void dump_exec_info(void)
     struct tb_tree_stats tst = {};
     struct qht_stats hst;
     size_t nb_tbs, flush_full, flush_part, flush_elide;
+    CPUState *cpu;
 
     tcg_tb_foreach(tb_tree_stats_iter, &tst);
     nb_tbs = tst.nb_tbs;
@@ -2125,11 +2180,33 @@ void dump_exec_info(void)
                 qatomic_read(&tb_ctx.tb_flush_count));
     qemu_printf("TB invalidate count %u\n",
                 qatomic_read(&tb_ctx.tb_phys_invalidate_count));
+    qemu_printf("TB regions recycled %zu\n", tcg_region_recycle_count());
 
     tlb_flush_counts(&flush_full, &flush_part, &flush_elide);
     qemu_printf("TLB full flushes    %zu\n", flush_full);
     qemu_printf("TLB partial flushes %zu\n", flush_part);
     qemu_printf("TLB elided flushes  %zu\n", flush_elide);
+
+    CPU_FOREACH(cpu) {
+        TLBStats st;
+
+        tlb_cpu_stats(cpu, &st);
+        qemu_printf("\nCPU %d TLB:\n", cpu->cpu_index);
+        qemu_printf("misses              %zu\n", st.miss);
+        qemu_printf("victim hits         %zu (%zu%%)\n", st.vtlb_hit,
+                    st.miss ? st.vtlb_hit * 100 / st.miss : 0);
+        qemu_printf("second-level hits   %zu (%zu%%)\n", st.l2_hit,
+                    st.miss ? st.l2_hit * 100 / st.miss : 0);
+        qemu_printf("large page hits     %zu (%zu%%)\n", st.large_hit,
+                    st.miss ? st.large_hit * 100 / st.miss : 0);
+        qemu_printf("fills               %zu\n", st.fill);
+        qemu_printf("walk cache hits     %zu\n", st.walk_hit);
+        qemu_printf("flushes             %zu full, %zu partial, "
+                    "%zu elided\n",
+                    st.full_flush, st.part_flush, st.elide_flush);
+        qemu_printf("ASID switches       %zu, %zu flushes\n",
+                    st.asid_switch, st.asid_flush);
+    }
     tcg_dump_info();
 }
 
@@ -17,6 +17,7 @@
 #include "exec/translator.h"
 #include "exec/plugin-gen.h"
 #include "sysemu/replay.h"
+#include "internal.h"
 
 /* Pairs with tcg_clear_temp_count.
    To be called by #TranslatorOps.{translate_insn,tb_stop} if
@@ -42,6 +43,25 @@ bool translator_use_goto_tb(DisasContextBase *db, target_ulong dest)
     return ((db->pc_first ^ dest) & TARGET_PAGE_MASK) == 0;
 }
 
+/*
+ * Count the executions of @tb, for the hot TBs of x-query-jit-profile.
+ * The TCG atomic operations only take guest addresses, so this is a plain
+ * 32-bit increment: vCPUs running the same TB may lose counts, but the
+ * count is never torn, even on 32-bit hosts.
+ */
+static void gen_tb_exec_count(TranslationBlock *tb)
+{
+    TCGv_ptr ptr = tcg_const_ptr(&tb->exec_count);
+    TCGv_i32 count = tcg_temp_new_i32();
+
+    tcg_gen_ld_i32(count, ptr, 0);
+    tcg_gen_addi_i32(count, count, 1);
+    tcg_gen_st_i32(count, ptr, 0);
+
+    tcg_temp_free_i32(count);
+    tcg_temp_free_ptr(ptr);
+}
+
 void translator_loop(const TranslatorOps *ops, DisasContextBase *db,
                      CPUState *cpu, TranslationBlock *tb, int max_insns)
 {
@@ -65,6 +85,9 @@ void translator_loop(const TranslatorOps *ops, DisasContextBase *db,
 
     /* Start translating.  */
     gen_tb_start(db->tb);
+    if (qatomic_read(&tb_exec_count_enabled)) {
+        gen_tb_exec_count(tb);
+    }
     ops->tb_start(db, cpu);
     tcg_debug_assert(db->is_jmp == DISAS_NEXT);  /* no early exit */
 
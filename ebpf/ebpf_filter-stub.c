@@ -0,0 +1,14 @@
+/*
+ * eBPF packet filter stub file
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * later.  See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "ebpf/ebpf_filter.h"
+
+int ebpf_filter_load(const struct EBPFFilterRule *rules, int nr_rules)
+{
+    return -1;
+}
@@ -0,0 +1,201 @@
+/*
+ * eBPF packet filter
+ *
+ * Compiles a list of drop rules into a socket filter program, which tap
+ * runs in the kernel before queueing packets for QEMU.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * later.  See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/error-report.h"
+
+#include <bpf/bpf.h>
+#include <linux/filter.h>
+
+#include "net/eth.h"
+#include "ebpf/ebpf_filter.h"
+#include "trace.h"
+
+#define INSN(c, d, s, o, i)                             \
+    ((struct bpf_insn) {                                \
+        .code = (c), .dst_reg = (d), .src_reg = (s),    \
+        .off = (o), .imm = (i)                          \
+    })
+
+#define MOV64_REG(d, s)         INSN(BPF_ALU64 | BPF_MOV | BPF_X, d, s, 0, 0)
+#define MOV64_IMM(d, i)         INSN(BPF_ALU64 | BPF_MOV | BPF_K, d, 0, 0, i)
+#define ALU64_IMM(op, d, i)     INSN(BPF_ALU64 | (op) | BPF_K, d, 0, 0, i)
+#define LD_ABS(sz, i)           INSN(BPF_LD | (sz) | BPF_ABS, 0, 0, 0, i)
+#define LD_IND(sz, s, i)        INSN(BPF_LD | (sz) | BPF_IND, 0, s, 0, i)
+#define LDX_MEM(sz, d, s, o)    INSN(BPF_LDX | (sz) | BPF_MEM, d, s, o, 0)
+#define JMP_IMM(op, d, i)       INSN(BPF_JMP | (op) | BPF_K, d, 0, 0, i)
+#define JMP_REG(op, d, s)       INSN(BPF_JMP | (op) | BPF_X, d, s, 0, 0)
+#define JMP_A()                 INSN(BPF_JMP | BPF_JA, 0, 0, 0, 0)
+#define EXIT()                  INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0)
+
+/* Packet offsets relative to the Ethernet header */
+#define L2(off)                 (SKF_LL_OFF + (off))
+#define L3(off)                 L2(ETH_HLEN + (off))
+
+/* Header parsing, plus at most five instructions per rule */
+#define EBPF_FILTER_MAX_INSNS   (48 + 5 * EBPF_FILTER_MAX_RULES)
+
+enum {
+    LABEL_IPV4,
+    LABEL_L4,
+    LABEL_PORT,
+    LABEL_RULES,
+    LABEL_MAX,
+};
+
+typedef struct EBPFFilterProg {
+    struct bpf_insn insns[EBPF_FILTER_MAX_INSNS];
+    int len;
+    int labels[LABEL_MAX];
+    /* Jumps to the labels, patched once the labels are known */
+    int fixups[EBPF_FILTER_MAX_INSNS];
+    int fixup_label[EBPF_FILTER_MAX_INSNS];
+    int nr_fixups;
+} EBPFFilterProg;
+
+static void emit(EBPFFilterProg *p, struct bpf_insn insn)
+{
+    assert(p->len < EBPF_FILTER_MAX_INSNS);
+    p->insns[p->len++] = insn;
+}
+
+static void emit_jump(EBPFFilterProg *p, struct bpf_insn insn, int label)
+{
+    p->fixups[p->nr_fixups] = p->len;
+    p->fixup_label[p->nr_fixups++] = label;
+    emit(p, insn);
+}
+
+static void set_label(EBPFFilterProg *p, int label)
+{
+    p->labels[label] = p->len;
+}
+
+/* Go straight to the rules if the packet is shorter than @len bytes */
+static void emit_check_len(EBPFFilterProg *p, int len)
+{
+    emit(p, LDX_MEM(BPF_W, BPF_REG_0, BPF_REG_6,
+                    offsetof(struct __sk_buff, len)));
+    emit_jump(p, JMP_IMM(BPF_JLT, BPF_REG_0, len), LABEL_RULES);
+}
+
+/*
+ * Leave the ethertype in r7, the IP protocol in r8 and the TCP/UDP
+ * destination port in r9, or 0 when the packet has none.  r6 holds the
+ * context for the packet loads, which clobber r0-r5.  A load past the
+ * end of the packet would end the program and drop the packet, so the
+ * length is checked first: a field missing from a truncated packet is
+ * 0, and only rules that do not look at it can match.
+ */
+static void emit_parse(EBPFFilterProg *p)
+{
+    emit(p, MOV64_REG(BPF_REG_6, BPF_REG_1));
+    emit(p, MOV64_IMM(BPF_REG_7, 0));
+    emit(p, MOV64_IMM(BPF_REG_8, 0));
+    emit(p, MOV64_IMM(BPF_REG_9, 0));
+    emit_check_len(p, ETH_HLEN);
+    emit(p, LD_ABS(BPF_H, L2(12)));
+    emit(p, MOV64_REG(BPF_REG_7, BPF_REG_0));
+    emit_jump(p, JMP_IMM(BPF_JEQ, BPF_REG_7, ETH_P_IP), LABEL_IPV4);
+    emit_jump(p, JMP_IMM(BPF_JNE, BPF_REG_7, ETH_P_IPV6), LABEL_RULES);
+
+    /* IPv6, without extension headers */
+    emit_check_len(p, ETH_HLEN + 7);
+    emit(p, LD_ABS(BPF_B, L3(6)));
+    emit(p, MOV64_REG(BPF_REG_8, BPF_REG_0));
+    emit(p, MOV64_IMM(BPF_REG_2, sizeof(struct ip6_header)));
+    emit_jump(p, JMP_A(), LABEL_L4);
+
+    /* IPv4, only the first fragment has the ports */
+    set_label(p, LABEL_IPV4);
+    emit_check_len(p, ETH_HLEN + 10);
+    emit(p, LD_ABS(BPF_B, L3(9)));
+    emit(p, MOV64_REG(BPF_REG_8, BPF_REG_0));
+    emit(p, LD_ABS(BPF_H, L3(6)));
+    emit_jump(p, JMP_IMM(BPF_JSET, BPF_REG_0, IP_OFFMASK), LABEL_RULES);
+    emit(p, LD_ABS(BPF_B, L3(0)));
+    emit(p, ALU64_IMM(BPF_AND, BPF_REG_0, 0xf));
+    emit(p, ALU64_IMM(BPF_LSH, BPF_REG_0, 2));
+    emit(p, MOV64_REG(BPF_REG_2, BPF_REG_0));
+
+    /* r2 is the length of the IP header */
+    set_label(p, LABEL_L4);
+    emit_jump(p, JMP_IMM(BPF_JEQ, BPF_REG_8, IP_PROTO_TCP), LABEL_PORT);
+    emit_jump(p, JMP_IMM(BPF_JNE, BPF_REG_8, IP_PROTO_UDP), LABEL_RULES);
+    set_label(p, LABEL_PORT);
+    emit(p, MOV64_REG(BPF_REG_1, BPF_REG_2));
+    emit(p, ALU64_IMM(BPF_ADD, BPF_REG_1, ETH_HLEN + 4));
+    emit(p, LDX_MEM(BPF_W, BPF_REG_0, BPF_REG_6,
+                    offsetof(struct __sk_buff, len)));
+    emit_jump(p, JMP_REG(BPF_JGT, BPF_REG_1, BPF_REG_0), LABEL_RULES);
+    emit(p, LD_IND(BPF_H, BPF_REG_2, L3(2)));
+    emit(p, MOV64_REG(BPF_REG_9, BPF_REG_0));
+}
+
+static void emit_rule(EBPFFilterProg *p, const struct EBPFFilterRule *rule)
+{
+    struct bpf_insn tests[3];
+    int i, n = 0;
+
+    if (rule->ethertype) {
+        tests[n++] = JMP_IMM(BPF_JNE, BPF_REG_7, rule->ethertype);
+    }
+    if (rule->ip_proto) {
+        tests[n++] = JMP_IMM(BPF_JNE, BPF_REG_8, rule->ip_proto);
+    }
+    if (rule->dst_port) {
+        tests[n++] = JMP_IMM(BPF_JNE, BPF_REG_9, rule->dst_port);
+    }
+
+    /* Skip to the next rule on the first mismatch, otherwise drop */
+    for (i = 0; i < n; i++) {
+        tests[i].off = n - i - 1 + 2;
+        emit(p, tests[i]);
+    }
+    emit(p, MOV64_IMM(BPF_REG_0, 0));
+    emit(p, EXIT());
+}
+
+int ebpf_filter_load(const struct EBPFFilterRule *rules, int nr_rules)
+{
+    g_autofree EBPFFilterProg *p = g_new0(EBPFFilterProg, 1);
+    int i, fd;
+
+    if (nr_rules > EBPF_FILTER_MAX_RULES) {
+        trace_ebpf_error("eBPF filter", "too many rules");
+        return -1;
+    }
+
+    emit_parse(p);
+    set_label(p, LABEL_RULES);
+    for (i = 0; i < nr_rules; i++) {
+        emit_rule(p, &rules[i]);
+    }
+
+    /* Keep the whole packet */
+    emit(p, LDX_MEM(BPF_W, BPF_REG_0, BPF_REG_6,
+                    offsetof(struct __sk_buff, len)));
+    emit(p, EXIT());
+
+    for (i = 0; i < p->nr_fixups; i++) {
+        int insn = p->fixups[i];
+
+        p->insns[insn].off = p->labels[p->fixup_label[i]] - (insn + 1);
+    }
+
+    fd = bpf_load_program(BPF_PROG_TYPE_SOCKET_FILTER, p->insns, p->len,
+                          "GPL", 0, NULL, 0);
+    if (fd < 0) {
+        trace_ebpf_error("eBPF filter", "can not load filter program");
+        return -1;
+    }
+
+    return fd;
+}
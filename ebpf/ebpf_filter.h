@@ -0,0 +1,32 @@
+/*
+ * eBPF packet filter header
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * later.  See the COPYING file in the top-level directory.
+ */
+
+#ifndef QEMU_EBPF_FILTER_H
+#define QEMU_EBPF_FILTER_H
+
+/* Maximum number of rules of a filter program */
+#define EBPF_FILTER_MAX_RULES 32
+
+/*
+ * Packets matching all the non-zero fields of a rule are dropped.
+ * The IP protocol matches IPv4 and IPv6 packets; the port is the
+ * destination port of TCP and UDP packets.  Fields that a truncated
+ * packet lacks are 0.
+ */
+struct EBPFFilterRule {
+    uint16_t ethertype;
+    uint8_t ip_proto;
+    uint16_t dst_port;
+};
+
+/*
+ * Build a socket filter program from the rules and load it into the
+ * kernel.  Returns the file descriptor of the program, or -1.
+ */
+int ebpf_filter_load(const struct EBPFFilterRule *rules, int nr_rules);
+
+#endif /* QEMU_EBPF_FILTER_H */
@@ -265,7 +265,8 @@ ERST
 
 SRST
   ``info mtree``
-    Show memory tree.
+    Show memory tree, followed by how many memory topology commits ran,
+    the FlatViews and address spaces they updated, and their latency.
 ERST
 
 #if defined(CONFIG_TCG)
@@ -440,6 +440,7 @@ static AddressSpace *smmu_find_add_as(PCIBus *bus, void *opaque, int devfn)
         memory_region_init_iommu(&sdev->iommu, sizeof(sdev->iommu),
                                  s->mrtypename,
                                  OBJECT(s), name, 1ULL << SMMU_MAX_VA_BITS);
+        memory_region_iommu_enable_iotlb_cache(&sdev->iommu, &error_abort);
         address_space_init(&sdev->as,
                            MEMORY_REGION(&sdev->iommu), name);
         trace_smmu_add_mr(name);
@@ -531,6 +532,7 @@ static void smmu_base_reset(DeviceState *dev)
 
     g_hash_table_remove_all(s->configs);
     g_hash_table_remove_all(s->iotlb);
+    smmu_inv_notifiers_all(s);
 }
 
 static Property smmu_dev_properties[] = {
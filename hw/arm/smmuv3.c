@@ -619,6 +619,8 @@ static void smmuv3_flush_config(SMMUDevice *sdev)
 
     trace_smmuv3_config_cache_inv(smmu_get_sid(sdev));
     g_hash_table_remove(bc->configs, sdev);
+    /* The translations may have used the old configuration */
+    smmu_inv_notifiers_mr(&sdev->iommu);
 }
 
 static IOMMUTLBEntry smmuv3_translate(IOMMUMemoryRegion *mr, hwaddr addr,
@@ -910,6 +912,7 @@ smmuv3_invalidate_ste(gpointer key, gpointer value, gpointer user_data)
         return false;
     }
     trace_smmuv3_config_cache_inv(sid);
+    smmu_inv_notifiers_mr(&sdev->iommu);
     return true;
 }
 
@@ -1125,6 +1128,10 @@ static MemTxResult smmu_writel(SMMUv3State *s, hwaddr offset,
 {
     switch (offset) {
     case A_CR0:
+        if ((s->cr[0] ^ data) & R_CR0_SMMU_ENABLE_MASK) {
+            /* Translations switch from or to bypass */
+            smmu_inv_notifiers_all(&s->smmu_state);
+        }
         s->cr[0] = data;
         s->cr0ack = data & ~SMMU_CR0_RESERVED;
         /* in case the command queue has been enabled */
@@ -1481,6 +1481,17 @@ static int vtd_sync_shadow_page_table(VTDAddressSpace *vtd_as)
         return 0;
     }
 
+    if (!vtd_as_has_map_notifier(vtd_as)) {
+        /*
+         * There is no shadow page table to sync for UNMAP-only
+         * notifiers, just drop whatever they have cached.
+         */
+        IOMMU_NOTIFIER_FOREACH(n, &vtd_as->iommu) {
+            vtd_address_space_unmap(vtd_as, n);
+        }
+        return 0;
+    }
+
     ret = vtd_dev_to_context_entry(vtd_as->iommu_state,
                                    pci_bus_num(vtd_as->bus),
                                    vtd_as->devfn, &ce);
@@ -1572,6 +1583,9 @@ static bool vtd_switch_address_space(VTDAddressSpace *as)
         qemu_mutex_lock_iothread();
     }
 
+    /* Translations cached while the other side was in use may be stale */
+    memory_region_iommu_flush_iotlb_cache(&as->iommu);
+
     /* Turn off first then on the other */
     if (use_iommu) {
         memory_region_set_enabled(&as->nodmar, false);
@@ -3449,6 +3463,8 @@ VTDAddressSpace *vtd_find_add_as(IntelIOMMUState *s, PCIBus *bus, int devfn)
         memory_region_add_subregion_overlap(&vtd_dev_as->root, 0,
                                             &vtd_dev_as->nodmar, 0);
 
+        memory_region_iommu_enable_iotlb_cache(&vtd_dev_as->iommu,
+                                               &error_abort);
         vtd_switch_address_space(vtd_dev_as);
     }
     return vtd_dev_as;
@@ -18,6 +18,8 @@
  */
 #include "qemu/osdep.h"
 #include "qemu/thread.h"
+#include "qemu/lockable.h"
+#include "qemu/main-loop.h"
 #include "hw/i386/apic_internal.h"
 #include "hw/i386/apic.h"
 #include "hw/i386/ioapic.h"
@@ -630,10 +632,75 @@ static void apic_timer(void *opaque)
 {
     APICCommonState *s = opaque;
 
+    QEMU_LOCK_GUARD(&s->timer_lock);
     apic_local_deliver(s, APIC_LVT_TIMER);
     apic_timer_update(s, s->next_time);
 }
 
+/*
+ * The timer registers only need timer_lock, so that the guest can program
+ * the timer without taking the BQL.  The other registers interact with
+ * interrupt delivery and are accessed with the BQL held.
+ */
+static bool apic_is_timer_reg(int index)
+{
+    switch (index) {
+    case 0x32 + APIC_LVT_TIMER:
+    case 0x38:
+    case 0x39:
+    case 0x3e:
+        return true;
+    default:
+        return false;
+    }
+}
+
+static uint32_t apic_timer_reg_read(APICCommonState *s, int index)
+{
+    QEMU_LOCK_GUARD(&s->timer_lock);
+
+    switch (index) {
+    case 0x32 + APIC_LVT_TIMER:
+        return s->lvt[APIC_LVT_TIMER];
+    case 0x38:
+        return s->initial_count;
+    case 0x39:
+        return apic_get_current_count(s);
+    case 0x3e:
+        return s->divide_conf;
+    default:
+        g_assert_not_reached();
+    }
+}
+
+static void apic_timer_reg_write(APICCommonState *s, int index, uint32_t val)
+{
+    int v;
+
+    QEMU_LOCK_GUARD(&s->timer_lock);
+
+    switch (index) {
+    case 0x32 + APIC_LVT_TIMER:
+        s->lvt[APIC_LVT_TIMER] = val;
+        apic_timer_update(s, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL));
+        break;
+    case 0x38:
+        s->initial_count = val;
+        s->initial_count_load_time = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+        apic_timer_update(s, s->initial_count_load_time);
+        break;
+    case 0x39:
+        break;
+    case 0x3e:
+        s->divide_conf = val & 0xb;
+        v = (s->divide_conf & 3) | ((s->divide_conf >> 1) & 4);
+        s->count_shift = (v + 1) & 7;
+        break;
+    default:
+        g_assert_not_reached();
+    }
+}
+
 static uint64_t apic_mem_read(void *opaque, hwaddr addr, unsigned size)
 {
     DeviceState *dev;
@@ -652,6 +719,13 @@ static uint64_t apic_mem_read(void *opaque, hwaddr addr, unsigned size)
     s = APIC(dev);
 
     index = (addr >> 4) & 0xff;
+    if (apic_is_timer_reg(index)) {
+        val = apic_timer_reg_read(s, index);
+        trace_apic_mem_readl(addr, val);
+        return val;
+    }
+
+    QEMU_IOTHREAD_LOCK_GUARD();
     switch(index) {
     case 0x02: /* id */
         val = s->id << 24;
@@ -704,15 +778,6 @@ static uint64_t apic_mem_read(void *opaque, hwaddr addr, unsigned size)
     case 0x32 ... 0x37:
         val = s->lvt[index - 0x32];
         break;
-    case 0x38:
-        val = s->initial_count;
-        break;
-    case 0x39:
-        val = apic_get_current_count(s);
-        break;
-    case 0x3e:
-        val = s->divide_conf;
-        break;
     default:
         s->esr |= APIC_ESR_ILLEGAL_ADDRESS;
         val = 0;
@@ -753,6 +818,7 @@ static void apic_mem_write(void *opaque, hwaddr addr, uint64_t val,
          * Mapping them on the global bus happens to work because
          * MSI registers are reserved in APIC MMIO and vice versa. */
         MSIMessage msi = { .address = addr, .data = val };
+        QEMU_IOTHREAD_LOCK_GUARD();
         apic_send_msi(&msi);
         return;
     }
@@ -765,6 +831,12 @@ static void apic_mem_write(void *opaque, hwaddr addr, uint64_t val,
 
     trace_apic_mem_writel(addr, val);
 
+    if (apic_is_timer_reg(index)) {
+        apic_timer_reg_write(s, index, val);
+        return;
+    }
+
+    QEMU_IOTHREAD_LOCK_GUARD();
     switch(index) {
     case 0x02:
         s->id = (val >> 24);
@@ -813,28 +885,11 @@ static void apic_mem_write(void *opaque, hwaddr addr, uint64_t val,
         {
             int n = index - 0x32;
             s->lvt[n] = val;
-            if (n == APIC_LVT_TIMER) {
-                apic_timer_update(s, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL));
-            } else if (n == APIC_LVT_LINT0 && apic_check_pic(s)) {
+            if (n == APIC_LVT_LINT0 && apic_check_pic(s)) {
                 apic_update_irq(s);
             }
         }
         break;
-    case 0x38:
-        s->initial_count = val;
-        s->initial_count_load_time = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
-        apic_timer_update(s, s->initial_count_load_time);
-        break;
-    case 0x39:
-        break;
-    case 0x3e:
-        {
-            int v;
-            s->divide_conf = val & 0xb;
-            v = (s->divide_conf & 3) | ((s->divide_conf >> 1) & 4);
-            s->count_shift = (v + 1) & 7;
-        }
-        break;
     default:
         s->esr |= APIC_ESR_ILLEGAL_ADDRESS;
         break;
@@ -882,6 +937,8 @@ static void apic_realize(DeviceState *dev, Error **errp)
 
     memory_region_init_io(&s->io_memory, OBJECT(s), &apic_io_ops, s, "apic-msi",
                           APIC_SPACE_SIZE);
+    memory_region_clear_global_locking(&s->io_memory);
+    qemu_mutex_init(&s->timer_lock);
 
     s->timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, apic_timer, s);
     local_apics[s->id] = s;
@@ -894,6 +951,7 @@ static void apic_unrealize(DeviceState *dev)
     APICCommonState *s = APIC(dev);
 
     timer_free(s->timer);
+    qemu_mutex_destroy(&s->timer_lock);
     local_apics[s->id] = NULL;
 }
 
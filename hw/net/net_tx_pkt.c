@@ -19,6 +19,7 @@
 #include "net_tx_pkt.h"
 #include "net/eth.h"
 #include "net/checksum.h"
+#include "net/gso.h"
 #include "net/tap.h"
 #include "net/net.h"
 #include "hw/pci/pci.h"
@@ -45,6 +46,9 @@ struct NetTxPkt {
 
     uint8_t l2_hdr[ETH_MAX_L2_HDR_LEN];
     uint8_t l3_hdr[ETH_MAX_IP_DGRAM_LEN];
+    /* Payload copied by the software checksum, grown on demand */
+    uint8_t *payload_buf;
+    uint32_t payload_buf_size;
 
     uint32_t payload_len;
 
@@ -56,6 +60,9 @@ struct NetTxPkt {
     uint8_t l4proto;
 
     bool is_loopback;
+
+    /* Allocated on the first TSO packet sent to a backend without vnet_hdr */
+    NetGsoBatch *gso_batch;
 };
 
 void net_tx_pkt_init(struct NetTxPkt **pkt, PCIDevice *pci_dev,
@@ -86,6 +93,8 @@ void net_tx_pkt_uninit(struct NetTxPkt *pkt)
     if (pkt) {
         g_free(pkt->vec);
         g_free(pkt->raw);
+        g_free(pkt->gso_batch);
+        g_free(pkt->payload_buf);
         g_free(pkt);
     }
 }
@@ -475,9 +484,8 @@ static void net_tx_pkt_do_sw_csum(struct NetTxPkt *pkt)
     uint16_t csl;
     size_t csum_offset = pkt->virt_hdr.csum_start + pkt->virt_hdr.csum_offset;
     uint16_t l3_proto = eth_get_l3_proto(iov, 1, iov->iov_len);
-
-    /* Put zero to checksum field */
-    iov_from_buf(iov, iov_len, csum_offset, &csum, sizeof csum);
+    struct iovec *pl = &pkt->vec[NET_TX_PKT_PL_START_FRAG];
+    size_t pl_csum_offset = csum_offset - pkt->hdr_len;
 
     /* Calculate L4 TCP/UDP checksum */
     csl = pkt->payload_len;
@@ -495,6 +503,42 @@ static void net_tx_pkt_do_sw_csum(struct NetTxPkt *pkt)
                 csl, pkt->l4proto, &cso);
     }
 
+    /*
+     * Copy the payload while summing it, and put the checksum in the copy
+     * rather than in the guest buffers.  This reads the payload once, and
+     * what is sent is what was summed even if the guest changes it.
+     */
+    if (pkt->virt_hdr.csum_start == pkt->hdr_len &&
+        pl_csum_offset + sizeof(csum) <= csl &&
+        csl <= ETH_MAX_IP_DGRAM_LEN &&
+        pl->iov_base != pkt->payload_buf) {
+        if (pkt->payload_buf_size < csl) {
+            g_free(pkt->payload_buf);
+            pkt->payload_buf = g_malloc(csl);
+            pkt->payload_buf_size = csl;
+        }
+        csum_cntr += net_checksum_iov_to_buf(pl, pkt->payload_frags, 0,
+                                             pkt->payload_buf,
+                                             pl_csum_offset, cso);
+        memset(pkt->payload_buf + pl_csum_offset, 0, sizeof(csum));
+        csum_cntr += net_checksum_iov_to_buf(pl, pkt->payload_frags,
+                        pl_csum_offset + sizeof(csum),
+                        pkt->payload_buf + pl_csum_offset + sizeof(csum),
+                        csl - pl_csum_offset - sizeof(csum),
+                        cso + pl_csum_offset + sizeof(csum));
+
+        pl->iov_base = pkt->payload_buf;
+        pl->iov_len = csl;
+        pkt->payload_frags = 1;
+
+        csum = cpu_to_be16(net_checksum_finish_nozero(csum_cntr));
+        memcpy(pkt->payload_buf + pl_csum_offset, &csum, sizeof(csum));
+        return;
+    }
+
+    /* Put zero to checksum field */
+    iov_from_buf(iov, iov_len, csum_offset, &csum, sizeof csum);
+
     /* data checksum */
     csum_cntr +=
         net_checksum_add_iov(iov, iov_len, pkt->virt_hdr.csum_start, csl, cso);
@@ -608,12 +652,61 @@ static bool net_tx_pkt_do_sw_fragmentation(struct NetTxPkt *pkt,
     return true;
 }
 
+typedef struct NetTxPktSegments {
+    struct NetTxPkt *pkt;
+    NetClientState *nc;
+} NetTxPktSegments;
+
+static void net_tx_pkt_send_segments(NetGsoBatch *batch, bool last,
+                                     void *opaque)
+{
+    NetTxPktSegments *s = opaque;
+    int i = 0;
+
+    if (!s->pkt->is_loopback) {
+        i = qemu_sendv_packet_batch(s->nc, batch->pkts, batch->npkts);
+    }
+    for (; i < batch->npkts; i++) {
+        net_tx_pkt_sendv(s->pkt, s->nc, batch->pkts[i].iov,
+                         batch->pkts[i].iovcnt);
+    }
+}
+
+static bool net_tx_pkt_do_sw_segmentation(struct NetTxPkt *pkt,
+    NetClientState *nc)
+{
+    NetTxPktSegments s = { .pkt = pkt, .nc = nc };
+
+    if (!pkt->gso_batch) {
+        pkt->gso_batch = g_new(NetGsoBatch, 1);
+    }
+
+    return net_gso_segment(pkt->gso_batch, &pkt->virt_hdr,
+                           &pkt->vec[NET_TX_PKT_L2HDR_FRAG],
+                           pkt->payload_frags + NET_TX_PKT_PL_START_FRAG -
+                           NET_TX_PKT_L2HDR_FRAG,
+                           net_tx_pkt_send_segments, &s) >= 0;
+}
+
+static bool net_tx_pkt_is_tcp_gso(struct NetTxPkt *pkt)
+{
+    switch (pkt->virt_hdr.gso_type & ~VIRTIO_NET_HDR_GSO_ECN) {
+    case VIRTIO_NET_HDR_GSO_TCPV4:
+    case VIRTIO_NET_HDR_GSO_TCPV6:
+        return true;
+    default:
+        return false;
+    }
+}
+
 bool net_tx_pkt_send(struct NetTxPkt *pkt, NetClientState *nc)
 {
     assert(pkt);
 
+    /* Segmentation computes the checksum of each segment itself */
     if (!pkt->has_virt_hdr &&
-        pkt->virt_hdr.flags & VIRTIO_NET_HDR_F_NEEDS_CSUM) {
+        pkt->virt_hdr.flags & VIRTIO_NET_HDR_F_NEEDS_CSUM &&
+        !net_tx_pkt_is_tcp_gso(pkt)) {
         net_tx_pkt_do_sw_csum(pkt);
     }
 
@@ -637,6 +730,10 @@ bool net_tx_pkt_send(struct NetTxPkt *pkt, NetClientState *nc)
         return true;
     }
 
+    if (net_tx_pkt_is_tcp_gso(pkt)) {
+        return net_tx_pkt_do_sw_segmentation(pkt, nc);
+    }
+
     return net_tx_pkt_do_sw_fragmentation(pkt, nc);
 }
 
@@ -44,12 +44,10 @@
 #include "hw/pci/pci.h"
 #include "net_rx_pkt.h"
 #include "hw/virtio/vhost.h"
+#include "block/aio-wait.h"
 
 #define VIRTIO_NET_VM_VERSION    11
 
-#define MAC_TABLE_ENTRIES    64
-#define MAX_VLAN    (1 << 12)   /* Per 802.1Q definition */
-
 /* previously fixed value */
 #define VIRTIO_NET_RX_QUEUE_DEFAULT_SIZE 256
 #define VIRTIO_NET_TX_QUEUE_DEFAULT_SIZE 256
@@ -58,6 +56,9 @@
 #define VIRTIO_NET_RX_QUEUE_MIN_SIZE VIRTIO_NET_RX_QUEUE_DEFAULT_SIZE
 #define VIRTIO_NET_TX_QUEUE_MIN_SIZE VIRTIO_NET_TX_QUEUE_DEFAULT_SIZE
 
+/* Packets handed to the backend at once, and completed with one notify */
+#define VIRTIO_NET_TX_BATCH 64
+
 #define VIRTIO_NET_IP4_ADDR_SIZE   8        /* ipv4 saddr + daddr */
 
 #define VIRTIO_NET_TCP_FLAG         0x3F
@@ -201,6 +202,28 @@ static bool virtio_net_started(VirtIONet *n, uint8_t status)
         (n->status & VIRTIO_NET_S_LINK_UP) && vdev->vm_running;
 }
 
+/*
+ * Lock out the IOThreads that service the queue pairs, for code that
+ * runs in the main loop and touches the datapath state.
+ */
+static void virtio_net_dataplane_acquire(VirtIONet *n)
+{
+    int i;
+
+    for (i = 0; i < n->num_iothreads; i++) {
+        aio_context_acquire(iothread_get_aio_context(n->iothreads[i]));
+    }
+}
+
+static void virtio_net_dataplane_release(VirtIONet *n)
+{
+    int i;
+
+    for (i = n->num_iothreads - 1; i >= 0; i--) {
+        aio_context_release(iothread_get_aio_context(n->iothreads[i]));
+    }
+}
+
 static void virtio_net_announce_notify(VirtIONet *net)
 {
     VirtIODevice *vdev = VIRTIO_DEVICE(net);
@@ -215,8 +238,10 @@ static void virtio_net_announce_timer(void *opaque)
     VirtIONet *n = opaque;
     trace_virtio_net_announce_timer(n->announce_timer.round);
 
+    virtio_net_dataplane_acquire(n);
     n->announce_timer.round--;
     virtio_net_announce_notify(n);
+    virtio_net_dataplane_release(n);
 }
 
 static void virtio_net_announce(NetClientState *nc)
@@ -235,7 +260,9 @@ static void virtio_net_announce(NetClientState *nc)
 
     if (virtio_vdev_has_feature(vdev, VIRTIO_NET_F_GUEST_ANNOUNCE) &&
         virtio_vdev_has_feature(vdev, VIRTIO_NET_F_CTRL_VQ)) {
+            virtio_net_dataplane_acquire(n);
             virtio_net_announce_notify(n);
+            virtio_net_dataplane_release(n);
     }
 }
 
@@ -244,6 +271,8 @@ static void virtio_net_vhost_status(VirtIONet *n, uint8_t status)
     VirtIODevice *vdev = VIRTIO_DEVICE(n);
     NetClientState *nc = qemu_get_queue(n->nic);
     int queues = n->multiqueue ? n->max_queues : 1;
+    int cvq = virtio_vdev_has_feature(vdev, VIRTIO_NET_F_CTRL_VQ) ?
+              n->max_ncs - n->max_queues : 0;
 
     if (!get_vhost_net(nc->peer)) {
         return;
@@ -285,14 +314,14 @@ static void virtio_net_vhost_status(VirtIONet *n, uint8_t status)
         }
 
         n->vhost_started = 1;
-        r = vhost_net_start(vdev, n->nic->ncs, queues);
+        r = vhost_net_start(vdev, n->nic->ncs, queues, cvq);
         if (r < 0) {
             error_report("unable to start vhost net: %d: "
                          "falling back on userspace virtio", -r);
             n->vhost_started = 0;
         }
     } else {
-        vhost_net_stop(vdev, n->nic->ncs, queues);
+        vhost_net_stop(vdev, n->nic->ncs, queues, cvq);
         n->vhost_started = 0;
     }
 }
@@ -350,6 +379,22 @@ static void virtio_net_vnet_endian_status(VirtIONet *n, uint8_t status)
     }
 }
 
+/*
+ * Notify the guest about a data virtqueue.  Once the queue pairs run in
+ * IOThreads the interrupt is raised through its irqfd, as it does not
+ * need the BQL.
+ */
+static void virtio_net_notify(VirtIONet *n, VirtQueue *vq)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(n);
+
+    if (n->dataplane_started) {
+        virtio_notify_irqfd(vdev, vq);
+    } else {
+        virtio_notify(vdev, vq);
+    }
+}
+
 static void virtio_net_drop_tx_queue_data(VirtIODevice *vdev, VirtQueue *vq)
 {
     unsigned int dropped = virtqueue_drop_all(vq);
@@ -365,6 +410,7 @@ static void virtio_net_set_status(struct VirtIODevice *vdev, uint8_t status)
     int i;
     uint8_t queue_status;
 
+    virtio_net_dataplane_acquire(n);
     virtio_net_vnet_endian_status(n, status);
     virtio_net_vhost_status(n, status);
 
@@ -413,6 +459,7 @@ static void virtio_net_set_status(struct VirtIODevice *vdev, uint8_t status)
             }
         }
     }
+    virtio_net_dataplane_release(n);
 }
 
 static void virtio_net_set_link_status(NetClientState *nc)
@@ -421,6 +468,7 @@ static void virtio_net_set_link_status(NetClientState *nc)
     VirtIODevice *vdev = VIRTIO_DEVICE(n);
     uint16_t old_status = n->status;
 
+    virtio_net_dataplane_acquire(n);
     if (nc->link_down)
         n->status &= ~VIRTIO_NET_S_LINK_UP;
     else
@@ -430,6 +478,7 @@ static void virtio_net_set_link_status(NetClientState *nc)
         virtio_notify_config(vdev);
 
     virtio_net_set_status(vdev, vdev->status);
+    virtio_net_dataplane_release(n);
 }
 
 static void rxfilter_notify(NetClientState *nc)
@@ -563,6 +612,10 @@ static void virtio_net_reset(VirtIODevice *vdev)
             qemu_flush_or_purge_queued_packets(nc->peer, true);
             assert(!virtio_net_get_subqueue(nc)->async_tx.elem);
         }
+        if (n->vqs[i].gro) {
+            net_gro_drop(n->vqs[i].gro);
+            n->vqs[i].gro_blocked = false;
+        }
     }
 }
 
@@ -715,15 +768,20 @@ static uint64_t virtio_net_get_features(VirtIODevice *vdev, uint64_t features,
     virtio_add_feature(&features, VIRTIO_NET_F_MAC);
 
     if (!peer_has_vnet_hdr(n)) {
-        virtio_clear_feature(&features, VIRTIO_NET_F_CSUM);
-        virtio_clear_feature(&features, VIRTIO_NET_F_HOST_TSO4);
-        virtio_clear_feature(&features, VIRTIO_NET_F_HOST_TSO6);
-        virtio_clear_feature(&features, VIRTIO_NET_F_HOST_ECN);
-
-        virtio_clear_feature(&features, VIRTIO_NET_F_GUEST_CSUM);
-        virtio_clear_feature(&features, VIRTIO_NET_F_GUEST_TSO4);
-        virtio_clear_feature(&features, VIRTIO_NET_F_GUEST_TSO6);
-        virtio_clear_feature(&features, VIRTIO_NET_F_GUEST_ECN);
+        if (n->sw_gso) {
+            /* Segmented and coalesced in software, but not RSC */
+            virtio_clear_feature(&features, VIRTIO_NET_F_RSC_EXT);
+        } else {
+            virtio_clear_feature(&features, VIRTIO_NET_F_CSUM);
+            virtio_clear_feature(&features, VIRTIO_NET_F_HOST_TSO4);
+            virtio_clear_feature(&features, VIRTIO_NET_F_HOST_TSO6);
+            virtio_clear_feature(&features, VIRTIO_NET_F_HOST_ECN);
+
+            virtio_clear_feature(&features, VIRTIO_NET_F_GUEST_CSUM);
+            virtio_clear_feature(&features, VIRTIO_NET_F_GUEST_TSO4);
+            virtio_clear_feature(&features, VIRTIO_NET_F_GUEST_TSO6);
+            virtio_clear_feature(&features, VIRTIO_NET_F_GUEST_ECN);
+        }
 
         virtio_clear_feature(&features, VIRTIO_NET_F_HASH_REPORT);
     }
@@ -913,6 +971,10 @@ static void virtio_net_set_features(VirtIODevice *vdev, uint64_t features)
     n->rsc6_enabled = virtio_has_feature(features, VIRTIO_NET_F_RSC_EXT) &&
         virtio_has_feature(features, VIRTIO_NET_F_GUEST_TSO6);
     n->rss_data.redirect = virtio_has_feature(features, VIRTIO_NET_F_RSS);
+    n->gro_enabled = n->sw_gso && !n->has_vnet_hdr &&
+        virtio_has_feature(features, VIRTIO_NET_F_GUEST_CSUM) &&
+        virtio_has_feature(features, VIRTIO_NET_F_GUEST_TSO4) &&
+        virtio_has_feature(features, VIRTIO_NET_F_GUEST_TSO6);
 
     if (n->has_vnet_hdr) {
         n->curr_guest_offloads =
@@ -920,7 +982,7 @@ static void virtio_net_set_features(VirtIODevice *vdev, uint64_t features)
         virtio_net_apply_guest_offloads(n);
     }
 
-    for (i = 0;  i < n->max_queues; i++) {
+    for (i = 0;  i < n->max_ncs; i++) {
         NetClientState *nc = qemu_get_subqueue(n->nic, i);
 
         if (!get_vhost_net(nc->peer)) {
@@ -1425,57 +1487,81 @@ static int virtio_net_handle_mq(VirtIONet *n, uint8_t cmd,
     return VIRTIO_NET_OK;
 }
 
-static void virtio_net_handle_ctrl(VirtIODevice *vdev, VirtQueue *vq)
+/*
+ * Run the control command in @out_sg and write its status to @in_sg.
+ * Returns the number of bytes written to @in_sg, or 0 if the buffers are
+ * malformed.
+ */
+size_t virtio_net_handle_ctrl_iov(VirtIODevice *vdev,
+                                  const struct iovec *in_sg, unsigned in_num,
+                                  const struct iovec *out_sg,
+                                  unsigned out_num)
 {
     VirtIONet *n = VIRTIO_NET(vdev);
     struct virtio_net_ctrl_hdr ctrl;
     virtio_net_ctrl_ack status = VIRTIO_NET_ERR;
-    VirtQueueElement *elem;
     size_t s;
     struct iovec *iov, *iov2;
-    unsigned int iov_cnt;
 
+    if (iov_size(in_sg, in_num) < sizeof(status) ||
+        iov_size(out_sg, out_num) < sizeof(ctrl)) {
+        virtio_error(vdev, "virtio-net ctrl missing headers");
+        return 0;
+    }
+
+    iov2 = iov = g_memdup(out_sg, sizeof(struct iovec) * out_num);
+    s = iov_to_buf(iov, out_num, 0, &ctrl, sizeof(ctrl));
+    iov_discard_front(&iov, &out_num, sizeof(ctrl));
+    if (s != sizeof(ctrl)) {
+        status = VIRTIO_NET_ERR;
+    } else if (ctrl.class == VIRTIO_NET_CTRL_RX) {
+        status = virtio_net_handle_rx_mode(n, ctrl.cmd, iov, out_num);
+    } else if (ctrl.class == VIRTIO_NET_CTRL_MAC) {
+        status = virtio_net_handle_mac(n, ctrl.cmd, iov, out_num);
+    } else if (ctrl.class == VIRTIO_NET_CTRL_VLAN) {
+        status = virtio_net_handle_vlan_table(n, ctrl.cmd, iov, out_num);
+    } else if (ctrl.class == VIRTIO_NET_CTRL_ANNOUNCE) {
+        status = virtio_net_handle_announce(n, ctrl.cmd, iov, out_num);
+    } else if (ctrl.class == VIRTIO_NET_CTRL_MQ) {
+        status = virtio_net_handle_mq(n, ctrl.cmd, iov, out_num);
+    } else if (ctrl.class == VIRTIO_NET_CTRL_GUEST_OFFLOADS) {
+        status = virtio_net_handle_offloads(n, ctrl.cmd, iov, out_num);
+    }
+
+    s = iov_from_buf(in_sg, in_num, 0, &status, sizeof(status));
+    assert(s == sizeof(status));
+
+    g_free(iov2);
+    return sizeof(status);
+}
+
+static void virtio_net_handle_ctrl(VirtIODevice *vdev, VirtQueue *vq)
+{
+    VirtIONet *n = VIRTIO_NET(vdev);
+    VirtQueueElement *elem;
+
+    virtio_net_dataplane_acquire(n);
     for (;;) {
+        size_t written;
+
         elem = virtqueue_pop(vq, sizeof(VirtQueueElement));
         if (!elem) {
             break;
         }
-        if (iov_size(elem->in_sg, elem->in_num) < sizeof(status) ||
-            iov_size(elem->out_sg, elem->out_num) < sizeof(ctrl)) {
-            virtio_error(vdev, "virtio-net ctrl missing headers");
+
+        written = virtio_net_handle_ctrl_iov(vdev, elem->in_sg, elem->in_num,
+                                             elem->out_sg, elem->out_num);
+        if (written > 0) {
+            virtqueue_push(vq, elem, written);
+            virtio_notify(vdev, vq);
+            g_free(elem);
+        } else {
             virtqueue_detach_element(vq, elem, 0);
             g_free(elem);
             break;
         }
-
-        iov_cnt = elem->out_num;
-        iov2 = iov = g_memdup(elem->out_sg, sizeof(struct iovec) * elem->out_num);
-        s = iov_to_buf(iov, iov_cnt, 0, &ctrl, sizeof(ctrl));
-        iov_discard_front(&iov, &iov_cnt, sizeof(ctrl));
-        if (s != sizeof(ctrl)) {
-            status = VIRTIO_NET_ERR;
-        } else if (ctrl.class == VIRTIO_NET_CTRL_RX) {
-            status = virtio_net_handle_rx_mode(n, ctrl.cmd, iov, iov_cnt);
-        } else if (ctrl.class == VIRTIO_NET_CTRL_MAC) {
-            status = virtio_net_handle_mac(n, ctrl.cmd, iov, iov_cnt);
-        } else if (ctrl.class == VIRTIO_NET_CTRL_VLAN) {
-            status = virtio_net_handle_vlan_table(n, ctrl.cmd, iov, iov_cnt);
-        } else if (ctrl.class == VIRTIO_NET_CTRL_ANNOUNCE) {
-            status = virtio_net_handle_announce(n, ctrl.cmd, iov, iov_cnt);
-        } else if (ctrl.class == VIRTIO_NET_CTRL_MQ) {
-            status = virtio_net_handle_mq(n, ctrl.cmd, iov, iov_cnt);
-        } else if (ctrl.class == VIRTIO_NET_CTRL_GUEST_OFFLOADS) {
-            status = virtio_net_handle_offloads(n, ctrl.cmd, iov, iov_cnt);
-        }
-
-        s = iov_from_buf(elem->in_sg, elem->in_num, 0, &status, sizeof(status));
-        assert(s == sizeof(status));
-
-        virtqueue_push(vq, elem, sizeof(status));
-        virtio_notify(vdev, vq);
-        g_free(iov2);
-        g_free(elem);
     }
+    virtio_net_dataplane_release(n);
 }
 
 /* RX */
@@ -1484,7 +1570,17 @@ static void virtio_net_handle_rx(VirtIODevice *vdev, VirtQueue *vq)
 {
     VirtIONet *n = VIRTIO_NET(vdev);
     int queue_index = vq2q(virtio_get_queue_index(vq));
+    VirtIONetQueue *q = &n->vqs[queue_index];
 
+    /*
+     * Coalesced packets that found no rx buffer are older than those in
+     * the queue; the bottom half delivers them first, then the queue.
+     */
+    if (q->gro && net_gro_pending(q->gro)) {
+        qemu_bh_schedule(q->gro_bh);
+        return;
+    }
+    q->gro_blocked = false;
     qemu_flush_queued_packets(qemu_get_subqueue(n->nic, queue_index));
 }
 
@@ -1555,21 +1651,30 @@ static void virtio_net_hdr_swap(VirtIODevice *vdev, struct virtio_net_hdr *hdr)
  * we should provide a mechanism to disable it to avoid polluting the host
  * cache.
  */
+/* Only looks at the first 36 bytes of @buf */
+static bool is_broken_dhclient_packet(struct virtio_net_hdr *hdr,
+                                      uint8_t *buf, size_t size)
+{
+    return (hdr->flags & VIRTIO_NET_HDR_F_NEEDS_CSUM) && /* missing csum */
+           (size > 27 && size < 1500) && /* normal sized MTU */
+           (buf[12] == 0x08 && buf[13] == 0x00) && /* ethertype == IPv4 */
+           (buf[23] == 17) && /* ip.protocol == UDP */
+           (buf[34] == 0 && buf[35] == 67); /* udp.srcport == bootps */
+}
+
 static void work_around_broken_dhclient(struct virtio_net_hdr *hdr,
                                         uint8_t *buf, size_t size)
 {
-    if ((hdr->flags & VIRTIO_NET_HDR_F_NEEDS_CSUM) && /* missing csum */
-        (size > 27 && size < 1500) && /* normal sized MTU */
-        (buf[12] == 0x08 && buf[13] == 0x00) && /* ethertype == IPv4 */
-        (buf[23] == 17) && /* ip.protocol == UDP */
-        (buf[34] == 0 && buf[35] == 67)) { /* udp.srcport == bootps */
+    if (is_broken_dhclient_packet(hdr, buf, size)) {
         net_checksum_calculate(buf, size, CSUM_UDP);
         hdr->flags &= ~VIRTIO_NET_HDR_F_NEEDS_CSUM;
     }
 }
 
+/* @gso describes packets coalesced in software, in host endianness */
 static void receive_header(VirtIONet *n, const struct iovec *iov, int iov_cnt,
-                           const void *buf, size_t size)
+                           const void *buf, size_t size,
+                           const struct virtio_net_hdr *gso)
 {
     if (n->has_vnet_hdr) {
         /* FIXME this cast is evil */
@@ -1586,6 +1691,11 @@ static void receive_header(VirtIONet *n, const struct iovec *iov, int iov_cnt,
             .flags = 0,
             .gso_type = VIRTIO_NET_HDR_GSO_NONE
         };
+
+        if (gso) {
+            hdr = *gso;
+            virtio_net_hdr_swap(VIRTIO_DEVICE(n), &hdr);
+        }
         iov_from_buf(iov, iov_cnt, 0, &hdr, sizeof hdr);
     }
 }
@@ -1741,7 +1851,8 @@ static int virtio_net_process_rss(NetClientState *nc, const uint8_t *buf,
 }
 
 static ssize_t virtio_net_receive_rcu(NetClientState *nc, const uint8_t *buf,
-                                      size_t size, bool no_rss)
+                                      size_t size, bool no_rss,
+                                      const struct virtio_net_hdr *gso)
 {
     VirtIONet *n = qemu_get_nic_opaque(nc);
     VirtIONetQueue *q = virtio_net_get_subqueue(nc);
@@ -1759,7 +1870,7 @@ static ssize_t virtio_net_receive_rcu(NetClientState *nc, const uint8_t *buf,
         int index = virtio_net_process_rss(nc, buf, size);
         if (index >= 0) {
             NetClientState *nc2 = qemu_get_subqueue(n->nic, index);
-            return virtio_net_receive_rcu(nc2, buf, size, true);
+            return virtio_net_receive_rcu(nc2, buf, size, true, NULL);
         }
     }
 
@@ -1812,7 +1923,7 @@ static ssize_t virtio_net_receive_rcu(NetClientState *nc, const uint8_t *buf,
                                     sizeof(mhdr.num_buffers));
             }
 
-            receive_header(n, sg, elem->in_num, buf, size);
+            receive_header(n, sg, elem->in_num, buf, size, gso);
             if (n->rss_data.populate_hash) {
                 offset = sizeof(mhdr);
                 iov_from_buf(sg, elem->in_num, offset,
@@ -1852,7 +1963,7 @@ static ssize_t virtio_net_receive_rcu(NetClientState *nc, const uint8_t *buf,
     }
 
     virtqueue_flush(q->rx_vq, i);
-    virtio_notify(vdev, q->rx_vq);
+    virtio_net_notify(n, q->rx_vq);
 
     return size;
 }
@@ -1862,7 +1973,187 @@ static ssize_t virtio_net_do_receive(NetClientState *nc, const uint8_t *buf,
 {
     RCU_READ_LOCK_GUARD();
 
-    return virtio_net_receive_rcu(nc, buf, size, false);
+    return virtio_net_receive_rcu(nc, buf, size, false, NULL);
+}
+
+/*
+ * Zero-copy receive: lend the first guest buffer of the rx queue to the
+ * peer, which reads the packet with its vnet header straight into it.
+ * Whatever needs to look at the packet before it reaches the guest makes
+ * us fall back to virtio_net_receive(), which bounces the packet.  That
+ * includes the rx filter: outside promiscuous mode, a packet could be
+ * dropped after its bytes reached the guest buffer.
+ *
+ * The vnet header and the start of the packet go to zerocopy_rx.head
+ * rather than to the guest, for the dhclient fixup and in case the guest
+ * leaves promiscuous mode while the peer is reading.
+ */
+static int virtio_net_rx_buf_get(NetClientState *nc, struct iovec *iov,
+                                 int iovcnt)
+{
+    VirtIONet *n = qemu_get_nic_opaque(nc);
+    VirtIONetQueue *q = virtio_net_get_subqueue(nc);
+    size_t head_len = n->host_hdr_len + VIRTIO_NET_ZEROCOPY_HEAD;
+    VirtQueueElement *elem;
+    int cnt;
+
+    if (!n->rx_zerocopy || !n->has_vnet_hdr || !n->promisc ||
+        n->host_hdr_len != n->guest_hdr_len ||
+        (n->rss_data.enabled && n->rss_data.enabled_software_rss) ||
+        n->rsc4_enabled || n->rsc6_enabled) {
+        return 0;
+    }
+
+    RCU_READ_LOCK_GUARD();
+
+    if (!virtio_net_can_receive(nc) ||
+        !virtio_net_has_buffers(q, n->guest_hdr_len + ETH_ZLEN)) {
+        return 0;
+    }
+
+    elem = virtqueue_pop(q->rx_vq, sizeof(VirtQueueElement));
+    if (!elem) {
+        return 0;
+    }
+    if (elem->in_num < 1 || elem->in_num >= iovcnt ||
+        iov_size(elem->in_sg, elem->in_num) < head_len) {
+        /* Let virtio_net_receive() deal with it */
+        virtqueue_unpop(q->rx_vq, elem, 0);
+        g_free(elem);
+        return 0;
+    }
+
+    assert(!q->zerocopy_rx.elem);
+    q->zerocopy_rx.elem = elem;
+    memset(q->zerocopy_rx.head, 0, sizeof(q->zerocopy_rx.head));
+    iov[0].iov_base = q->zerocopy_rx.head;
+    iov[0].iov_len = head_len;
+    cnt = iov_copy(iov + 1, iovcnt - 1, elem->in_sg, elem->in_num,
+                   head_len, SIZE_MAX);
+    return cnt + 1;
+}
+
+/*
+ * Give the rx buffer of a dropped packet back to the guest.  The packet
+ * was accepted by the rx filter when the buffer was lent, but scrub the
+ * @size bytes that the peer wrote past the head anyway.
+ */
+static void virtio_net_rx_buf_drop(VirtIONetQueue *q, VirtQueueElement *elem,
+                                   size_t head_len, size_t size)
+{
+    if (size > head_len) {
+        iov_memset(elem->in_sg, elem->in_num, head_len, 0, size - head_len);
+    }
+    virtqueue_unpop(q->rx_vq, elem, 0);
+    g_free(elem);
+}
+
+/*
+ * Fix up the vnet header, and the packet if it fits in @elem: @size is
+ * its length, or 0 when it spans several buffers (a DHCP reply never does).
+ */
+static void virtio_net_rx_buf_fixup(VirtIONet *n, VirtQueueElement *elem,
+                                    struct virtio_net_hdr *hdr, size_t size)
+{
+    uint8_t *pkt = (uint8_t *)hdr + n->host_hdr_len;
+
+    if (size && is_broken_dhclient_packet(hdr, pkt, size - n->host_hdr_len)) {
+        /* Rare and small, just bounce it */
+        g_autofree uint8_t *buf = g_malloc(size);
+
+        iov_to_buf(elem->in_sg, elem->in_num, 0, buf, size);
+        work_around_broken_dhclient((struct virtio_net_hdr *)buf,
+                                    buf + n->host_hdr_len,
+                                    size - n->host_hdr_len);
+        iov_from_buf(elem->in_sg, elem->in_num, 0, buf, size);
+        memcpy(hdr, buf, sizeof(*hdr));
+    }
+
+    if (n->needs_vnet_hdr_swap) {
+        virtio_net_hdr_swap(VIRTIO_DEVICE(n), hdr);
+        iov_from_buf(elem->in_sg, elem->in_num, 0, hdr, sizeof(*hdr));
+    }
+}
+
+static ssize_t virtio_net_rx_buf_put(NetClientState *nc, size_t size,
+                                     const uint8_t *tail, size_t tail_len)
+{
+    VirtIONet *n = qemu_get_nic_opaque(nc);
+    VirtIONetQueue *q = virtio_net_get_subqueue(nc);
+    VirtIODevice *vdev = VIRTIO_DEVICE(n);
+    VirtQueueElement *elem = q->zerocopy_rx.elem;
+    struct virtio_net_hdr *hdr = (void *)q->zerocopy_rx.head;
+    size_t head_len = n->host_hdr_len + VIRTIO_NET_ZEROCOPY_HEAD;
+    struct iovec mhdr_sg[VIRTQUEUE_MAX_SIZE];
+    struct virtio_net_hdr_mrg_rxbuf mhdr;
+    unsigned mhdr_cnt = 0;
+    size_t offset, i;
+
+    RCU_READ_LOCK_GUARD();
+
+    assert(elem);
+    q->zerocopy_rx.elem = NULL;
+
+    if (size <= n->host_hdr_len) {
+        virtio_net_rx_buf_drop(q, elem, head_len, size);
+        return size;
+    }
+
+    /*
+     * Drop packets that the guest filtered out, packets too big for a
+     * buffer that cannot be merged, and packets that do not fit in the
+     * remaining buffers.
+     */
+    if (!receive_filter(n, q->zerocopy_rx.head, size + tail_len) ||
+        (tail_len && (!n->mergeable_rx_bufs ||
+                      !virtio_net_has_buffers(q, tail_len)))) {
+        virtio_net_rx_buf_drop(q, elem, head_len, size);
+        return size + tail_len;
+    }
+
+    iov_from_buf(elem->in_sg, elem->in_num, 0, q->zerocopy_rx.head,
+                 MIN(size, head_len));
+    virtio_net_rx_buf_fixup(n, elem, hdr, tail_len ? 0 : size);
+
+    if (n->mergeable_rx_bufs) {
+        mhdr_cnt = iov_copy(mhdr_sg, ARRAY_SIZE(mhdr_sg),
+                            elem->in_sg, elem->in_num,
+                            offsetof(typeof(mhdr), num_buffers),
+                            sizeof(mhdr.num_buffers));
+    }
+
+    virtqueue_fill(q->rx_vq, elem, size, 0);
+    g_free(elem);
+    i = 1;
+
+    /* Copy what did not fit in the first buffer */
+    for (offset = 0; offset < tail_len; i++) {
+        size_t len;
+
+        elem = virtqueue_pop(q->rx_vq, sizeof(VirtQueueElement));
+        if (!elem || elem->in_num < 1) {
+            virtio_error(vdev, "virtio-net unexpected empty queue: "
+                         "i %zd offset %zd, tail %zd", i, offset, tail_len);
+            g_free(elem);
+            return -1;
+        }
+        len = iov_from_buf(elem->in_sg, elem->in_num, 0,
+                           tail + offset, tail_len - offset);
+        offset += len;
+        virtqueue_fill(q->rx_vq, elem, len, i);
+        g_free(elem);
+    }
+
+    if (mhdr_cnt) {
+        virtio_stw_p(vdev, &mhdr.num_buffers, i);
+        iov_from_buf(mhdr_sg, mhdr_cnt, 0,
+                     &mhdr.num_buffers, sizeof mhdr.num_buffers);
+    }
+
+    virtqueue_flush(q->rx_vq, i);
+    virtio_net_notify(n, q->rx_vq);
+
+    return size + tail_len;
 }
 
 static void virtio_net_rsc_extract_unit4(VirtioNetRscChain *chain,
@@ -2458,12 +2749,82 @@ static ssize_t virtio_net_rsc_receive(NetClientState *nc,
     return virtio_net_do_receive(nc, buf, size);
 }
 
+/* Without rx buffers, the flow stays held until virtio_net_handle_rx() */
+static bool virtio_net_gro_deliver(const struct virtio_net_hdr *hdr,
+                                   const uint8_t *buf, size_t size,
+                                   void *opaque)
+{
+    VirtIONetQueue *q = opaque;
+    VirtIONet *n = q->n;
+
+    RCU_READ_LOCK_GUARD();
+
+    if (!virtio_net_receive_rcu(qemu_get_subqueue(n->nic, q - n->vqs),
+                                buf, size, true, hdr)) {
+        q->gro_blocked = true;
+        return false;
+    }
+    return true;
+}
+
+static void virtio_net_gro_bh(void *opaque)
+{
+    VirtIONetQueue *q = opaque;
+    VirtIONet *n = q->n;
+
+    net_gro_flush(q->gro);
+    /* Then the packets queued while the flows waited for rx buffers */
+    if (!net_gro_pending(q->gro)) {
+        q->gro_blocked = false;
+        qemu_flush_queued_packets(qemu_get_subqueue(n->nic, q - n->vqs));
+    }
+}
+
+/*
+ * Coalesce the frames of a peer without vnet_hdr into TSO packets for the
+ * guest.  They are held until the end of the current burst from the peer,
+ * when the bottom half runs, or until the guest adds rx buffers if there
+ * are none left then.  Meanwhile, the frames that are not coalesced go to
+ * the queue of the net client, so that they do not overtake the flows.
+ */
+static ssize_t virtio_net_gro_receive(NetClientState *nc, const uint8_t *buf,
+                                      size_t size)
+{
+    VirtIONet *n = qemu_get_nic_opaque(nc);
+    VirtIONetQueue *q = virtio_net_get_subqueue(nc);
+
+    if (q->gro_blocked) {
+        return 0;
+    }
+
+    WITH_RCU_READ_LOCK_GUARD() {
+        if (!(n->rss_data.enabled && n->rss_data.enabled_software_rss) &&
+            virtio_net_can_receive(nc) &&
+            virtio_net_has_buffers(q, n->guest_hdr_len + NET_GSO_MAX_SIZE)) {
+            if (net_gro_receive(q->gro, buf, size)) {
+                qemu_bh_schedule(q->gro_bh);
+                return size;
+            }
+        } else {
+            /* Keep the flows in order */
+            net_gro_flush(q->gro);
+        }
+        if (q->gro_blocked) {
+            return 0;
+        }
+    }
+
+    return virtio_net_do_receive(nc, buf, size);
+}
+
 static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf,
                                   size_t size)
 {
     VirtIONet *n = qemu_get_nic_opaque(nc);
     if ((n->rsc4_enabled || n->rsc6_enabled)) {
         return virtio_net_rsc_receive(nc, buf, size);
+    } else if (n->gro_enabled) {
+        return virtio_net_gro_receive(nc, buf, size);
     } else {
         return virtio_net_do_receive(nc, buf, size);
     }
@@ -2475,10 +2836,9 @@ static void virtio_net_tx_complete(NetClientState *nc, ssize_t len)
 {
     VirtIONet *n = qemu_get_nic_opaque(nc);
     VirtIONetQueue *q = virtio_net_get_subqueue(nc);
-    VirtIODevice *vdev = VIRTIO_DEVICE(n);
 
     virtqueue_push(q->tx_vq, q->async_tx.elem, 0);
-    virtio_notify(vdev, q->tx_vq);
+    virtio_net_notify(n, q->tx_vq);
 
     g_free(q->async_tx.elem);
     q->async_tx.elem = NULL;
@@ -2487,7 +2847,140 @@ static void virtio_net_tx_complete(NetClientState *nc, ssize_t len)
     virtio_net_flush_tx(q);
 }
 
+/* The element is completed once the peer has sent all of its segments */
+static void virtio_net_tx_segment_sent(NetClientState *nc, ssize_t len)
+{
+    VirtIONetQueue *q = virtio_net_get_subqueue(nc);
+
+    assert(q->async_tx.segments);
+    if (!--q->async_tx.segments && q->async_tx.elem) {
+        virtio_net_tx_complete(nc, len);
+    }
+}
+
+static void virtio_net_tx_segments(NetGsoBatch *batch, bool last,
+                                   void *opaque)
+{
+    NetClientState *nc = opaque;
+    VirtIONetQueue *q = virtio_net_get_subqueue(nc);
+    int i = qemu_sendv_packet_batch(nc, batch->pkts, batch->npkts);
+
+    for (; i < batch->npkts; i++) {
+        if (!qemu_sendv_packet_async(nc, batch->pkts[i].iov,
+                                     batch->pkts[i].iovcnt,
+                                     virtio_net_tx_segment_sent)) {
+            q->async_tx.segments++;
+        }
+    }
+}
+
+/*
+ * A peer without vnet_hdr only takes plain frames: complete the checksum
+ * and segment the packet as the guest header asks.  Returns 0 if the peer
+ * queued some segments, and virtio_net_tx_complete() will be called once
+ * it has sent them all.
+ */
+static ssize_t virtio_net_tx_sw_gso(VirtIONetQueue *q, NetClientState *nc,
+                                    VirtQueueElement *elem)
+{
+    VirtIONet *n = q->n;
+    struct iovec sg[VIRTQUEUE_MAX_SIZE];
+    struct virtio_net_hdr hdr;
+    unsigned sg_num;
+
+    if (iov_size(elem->out_sg, elem->out_num) < n->guest_hdr_len) {
+        return -EINVAL;
+    }
+    iov_to_buf(elem->out_sg, elem->out_num, 0, &hdr, sizeof(hdr));
+    virtio_net_hdr_swap(VIRTIO_DEVICE(n), &hdr);
+
+    sg_num = iov_copy(sg, ARRAY_SIZE(sg), elem->out_sg, elem->out_num,
+                      n->guest_hdr_len, -1);
+    if (!q->gso_batch) {
+        q->gso_batch = g_new(NetGsoBatch, 1);
+    }
+    /* Malformed packets are dropped */
+    net_gso_segment(q->gso_batch, &hdr, sg, sg_num, virtio_net_tx_segments,
+                    nc);
+    return q->async_tx.segments ? 0 : 1;
+}
+
 /* TX */
+/*
+ * Transmit path for when the buffers of the guest can be sent as they are:
+ * packets are handed to the backend VIRTIO_NET_TX_BATCH at a time, and
+ * the guest is notified once for each batch.
+ */
+static int32_t virtio_net_flush_tx_batch(VirtIONetQueue *q, NetClientState *nc)
+{
+    VirtIONet *n = q->n;
+    VirtIODevice *vdev = VIRTIO_DEVICE(n);
+    VirtQueueElement *elems[VIRTIO_NET_TX_BATCH];
+    NetPacketIOV pkts[VIRTIO_NET_TX_BATCH];
+    int32_t num_packets = 0;
+
+    while (num_packets < n->tx_burst) {
+        int npkts = 0, sent, i, j;
+        VirtQueueElement *elem;
+
+        while (npkts < VIRTIO_NET_TX_BATCH &&
+               num_packets + npkts < n->tx_burst) {
+            elem = virtqueue_pop(q->tx_vq, sizeof(VirtQueueElement));
+            if (!elem) {
+                break;
+            }
+            if (elem->out_num < 1 ||
+                iov_size(elem->out_sg, elem->out_num) < n->guest_hdr_len) {
+                virtio_error(vdev, elem->out_num < 1 ?
+                             "virtio-net header not in first element" :
+                             "virtio-net header incorrect");
+                virtqueue_detach_element(q->tx_vq, elem, 0);
+                g_free(elem);
+                for (i = 0; i < npkts; i++) {
+                    virtqueue_detach_element(q->tx_vq, elems[i], 0);
+                    g_free(elems[i]);
+                }
+                return -EINVAL;
+            }
+            elems[npkts] = elem;
+            pkts[npkts].iov = elem->out_sg;
+            pkts[npkts].iovcnt = elem->out_num;
+            npkts++;
+        }
+        if (!npkts) {
+            break;
+        }
+
+        sent = qemu_sendv_packet_batch(nc, pkts, npkts);
+        for (i = sent; i < npkts; i++) {
+            if (!qemu_sendv_packet_async(nc, pkts[i].iov, pkts[i].iovcnt,
+                                         virtio_net_tx_complete)) {
+                break;
+            }
+        }
+
+        for (j = 0; j < i; j++) {
+            virtqueue_fill(q->tx_vq, elems[j], 0, j);
+            g_free(elems[j]);
+        }
+        virtqueue_flush(q->tx_vq, i);
+        virtio_net_notify(n, q->tx_vq);
+        num_packets += i;
+
+        if (i < npkts) {
+            /* Give back what was not sent, last popped first */
+            for (j = npkts - 1; j > i; j--) {
+                virtqueue_unpop(q->tx_vq, elems[j], 0);
+                g_free(elems[j]);
+            }
+            virtio_queue_set_notification(q->tx_vq, 0);
+            q->async_tx.elem = elems[i];
+            return -EBUSY;
+        }
+    }
+    return num_packets;
+}
+
 static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
 {
     VirtIONet *n = q->n;
@@ -2504,6 +2997,18 @@ static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
         return num_packets;
     }
 
+    /*
+     * Neither the byte order nor the size of the header need fixing.
+     * Unsent packets are given back with virtqueue_unpop(), which only
+     * rewinds packed rings by one descriptor.
+     */
+    if (n->has_vnet_hdr && !n->needs_vnet_hdr_swap &&
+        n->host_hdr_len == n->guest_hdr_len &&
+        !virtio_vdev_has_feature(vdev, VIRTIO_F_RING_PACKED)) {
+        return virtio_net_flush_tx_batch(q, qemu_get_subqueue(n->nic,
+                                                              queue_index));
+    }
+
     for (;;) {
         ssize_t ret;
         unsigned int out_num;
@@ -2524,6 +3029,19 @@ static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
             return -EINVAL;
         }
 
+        if (!n->has_vnet_hdr && n->sw_gso) {
+            ret = virtio_net_tx_sw_gso(q, qemu_get_subqueue(n->nic,
+                                                            queue_index),
+                                       elem);
+            if (ret == -EINVAL) {
+                virtio_error(vdev, "virtio-net header incorrect");
+                virtqueue_detach_element(q->tx_vq, elem, 0);
+                g_free(elem);
+                return -EINVAL;
+            }
+            goto sent;
+        }
+
         if (n->has_vnet_hdr) {
             if (iov_to_buf(out_sg, out_num, 0, &mhdr, n->guest_hdr_len) <
                 n->guest_hdr_len) {
@@ -2565,6 +3083,7 @@ static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
 
         ret = qemu_sendv_packet_async(qemu_get_subqueue(n->nic, queue_index),
                                       out_sg, out_num, virtio_net_tx_complete);
+sent:
         if (ret == 0) {
             virtio_queue_set_notification(q->tx_vq, 0);
             q->async_tx.elem = elem;
@@ -2573,7 +3092,7 @@ static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
 
 drop:
         virtqueue_push(q->tx_vq, elem, 0);
-        virtio_notify(vdev, q->tx_vq);
+        virtio_net_notify(n, q->tx_vq);
         g_free(elem);
 
         if (++num_packets >= n->tx_burst) {
@@ -2729,6 +3248,18 @@ static void virtio_net_add_queue(VirtIONet *n, int index)
         n->vqs[index].tx_bh = qemu_bh_new(virtio_net_tx_bh, &n->vqs[index]);
     }
 
+    if (n->sw_gso) {
+        n->vqs[index].gro = net_gro_new(virtio_net_gro_deliver,
+                                        &n->vqs[index]);
+        n->vqs[index].gro_bh = qemu_bh_new(virtio_net_gro_bh, &n->vqs[index]);
+    }
+
+    if (n->num_iothreads) {
+        IOThread *iothread = n->iothreads[index % n->num_iothreads];
+
+        n->vqs[index].ctx = iothread_get_aio_context(iothread);
+    }
+
     n->vqs[index].tx_waiting = 0;
     n->vqs[index].n = n;
 }
@@ -2751,6 +3282,279 @@ static void virtio_net_del_queue(VirtIONet *n, int index)
     }
     q->tx_waiting = 0;
     virtio_del_queue(vdev, index * 2 + 1);
+
+    if (q->gro_bh) {
+        qemu_bh_delete(q->gro_bh);
+        q->gro_bh = NULL;
+    }
+    net_gro_free(q->gro);
+    q->gro = NULL;
+    g_free(q->gso_batch);
+    q->gso_batch = NULL;
+    q->ctx = NULL;
+}
+
+/* Dataplane: queue pairs serviced by IOThreads (iothreads=) */
+
+/* Context: IOThread */
+static bool virtio_net_dataplane_handle_rx(VirtIODevice *vdev, VirtQueue *vq)
+{
+    VirtIONet *n = VIRTIO_NET(vdev);
+    VirtIONetQueue *q = &n->vqs[vq2q(virtio_get_queue_index(vq))];
+
+    aio_context_acquire(q->ctx);
+    virtio_net_handle_rx(vdev, vq);
+    aio_context_release(q->ctx);
+
+    /* Buffers posted by the guest are no work to poll for */
+    return false;
+}
+
+/* Context: IOThread */
+static bool virtio_net_dataplane_handle_tx(VirtIODevice *vdev, VirtQueue *vq)
+{
+    VirtIONet *n = VIRTIO_NET(vdev);
+    VirtIONetQueue *q = &n->vqs[vq2q(virtio_get_queue_index(vq))];
+
+    aio_context_acquire(q->ctx);
+    virtio_net_handle_tx_bh(vdev, vq);
+    aio_context_release(q->ctx);
+    return true;
+}
+
+/* Context: BH in IOThread */
+static void virtio_net_dataplane_tx_bh(void *opaque)
+{
+    VirtIONetQueue *q = opaque;
+
+    aio_context_acquire(q->ctx);
+    virtio_net_tx_bh(q);
+    aio_context_release(q->ctx);
+}
+
+/* Context: BH in IOThread */
+static void virtio_net_dataplane_gro_bh(void *opaque)
+{
+    VirtIONetQueue *q = opaque;
+
+    aio_context_acquire(q->ctx);
+    virtio_net_gro_bh(q);
+    aio_context_release(q->ctx);
+}
+
+/*
+ * Move the bottom halves and the net clients of a queue pair to @ctx,
+ * or back to the main loop if @ctx is NULL.
+ *
+ * Context: QEMU global mutex held, and the IOThread of the queue pair
+ */
+static void virtio_net_queue_set_aio_context(VirtIONet *n, int index,
+                                             AioContext *ctx)
+{
+    VirtIONetQueue *q = &n->vqs[index];
+    NetClientState *nc = qemu_get_subqueue(n->nic, index);
+
+    qemu_bh_delete(q->tx_bh);
+    if (ctx) {
+        q->tx_bh = aio_bh_new(ctx, virtio_net_dataplane_tx_bh, q);
+    } else {
+        q->tx_bh = qemu_bh_new(virtio_net_tx_bh, q);
+    }
+    if (q->tx_waiting) {
+        qemu_bh_schedule(q->tx_bh);
+    }
+
+    if (q->gro_bh) {
+        qemu_bh_delete(q->gro_bh);
+        if (ctx) {
+            q->gro_bh = aio_bh_new(ctx, virtio_net_dataplane_gro_bh, q);
+        } else {
+            q->gro_bh = qemu_bh_new(virtio_net_gro_bh, q);
+        }
+        if (net_gro_pending(q->gro)) {
+            qemu_bh_schedule(q->gro_bh);
+        }
+    }
+
+    qemu_net_set_aio_context(nc, ctx);
+    if (nc->peer && qemu_net_set_aio_context(nc->peer, ctx) < 0) {
+        error_report("virtio-net: netdev '%s' cannot run in an IOThread",
+                     nc->peer->name);
+    }
+}
+
+/* Context: QEMU global mutex held */
+static void virtio_net_dataplane_start(VirtIONet *n)
+{
+    BusState *qbus = qdev_get_parent_bus(DEVICE(n));
+    VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+    int queues = n->multiqueue ? n->max_queues : 1;
+    int i, r;
+
+    /* Set up guest notifiers (irqfd) for the data and control queues */
+    r = k->set_guest_notifiers(qbus->parent, queues * 2 + 1, true);
+    if (r != 0) {
+        error_report("virtio-net failed to set guest notifiers (%d), "
+                     "servicing the queues in the main loop", r);
+        return;
+    }
+
+    n->dataplane_started = true;
+    for (i = 0; i < queues; i++) {
+        VirtIONetQueue *q = &n->vqs[i];
+        VirtQueue *vqs[] = { q->rx_vq, q->tx_vq };
+        VirtIOHandleAIOOutput handlers[] = {
+            virtio_net_dataplane_handle_rx, virtio_net_dataplane_handle_tx
+        };
+        int j;
+
+        aio_context_acquire(q->ctx);
+        virtio_net_queue_set_aio_context(n, i, q->ctx);
+        for (j = 0; j < ARRAY_SIZE(vqs); j++) {
+            EventNotifier *notifier = virtio_queue_get_host_notifier(vqs[j]);
+
+            event_notifier_set_handler(notifier, NULL);
+            virtio_queue_aio_set_host_notifier_handler(vqs[j], q->ctx,
+                                                       handlers[j]);
+            /* Pick up kicks that the main loop has not handled yet */
+            event_notifier_set(notifier);
+        }
+        aio_context_release(q->ctx);
+    }
+}
+
+/* Context: BH in IOThread */
+static void virtio_net_dataplane_stop_bh(void *opaque)
+{
+    VirtIONetQueue *q = opaque;
+
+    virtio_queue_aio_set_host_notifier_handler(q->rx_vq, q->ctx, NULL);
+    virtio_queue_aio_set_host_notifier_handler(q->tx_vq, q->ctx, NULL);
+}
+
+/* Context: QEMU global mutex held */
+static void virtio_net_dataplane_stop(VirtIONet *n)
+{
+    BusState *qbus = qdev_get_parent_bus(DEVICE(n));
+    VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+    int queues = n->multiqueue ? n->max_queues : 1;
+    int i;
+
+    if (!n->dataplane_started) {
+        return;
+    }
+
+    for (i = 0; i < queues; i++) {
+        VirtIONetQueue *q = &n->vqs[i];
+
+        aio_context_acquire(q->ctx);
+        aio_wait_bh_oneshot(q->ctx, virtio_net_dataplane_stop_bh, q);
+        virtio_net_queue_set_aio_context(n, i, NULL);
+        aio_context_release(q->ctx);
+    }
+    n->dataplane_started = false;
+
+    k->set_guest_notifiers(qbus->parent, queues * 2 + 1, false);
+}
+
+/*
+ * The transport starts ioeventfd once the driver is ready and the VM
+ * runs, and stops it before anything else touches the queues: that is
+ * when the queue pairs move to their IOThreads and back.
+ */
+static int virtio_net_start_ioeventfd(VirtIODevice *vdev)
+{
+    VirtIONet *n = VIRTIO_NET(vdev);
+    VirtioDeviceClass *vdc =
+        VIRTIO_DEVICE_CLASS(object_class_by_name(TYPE_VIRTIO_DEVICE));
+    int r;
+
+    r = vdc->start_ioeventfd(vdev);
+    if (r == 0 && n->num_iothreads) {
+        virtio_net_dataplane_start(n);
+    }
+    return r;
+}
+
+static void virtio_net_stop_ioeventfd(VirtIODevice *vdev)
+{
+    VirtioDeviceClass *vdc =
+        VIRTIO_DEVICE_CLASS(object_class_by_name(TYPE_VIRTIO_DEVICE));
+
+    virtio_net_dataplane_stop(VIRTIO_NET(vdev));
+    vdc->stop_ioeventfd(vdev);
+}
+
+static bool virtio_net_iothreads_setup(VirtIONet *n, Error **errp)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(n);
+    BusState *qbus = qdev_get_parent_bus(DEVICE(n));
+    VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+    int i;
+
+    if (!n->num_iothreads) {
+        return true;
+    }
+    if (n->net_conf.tx && !strcmp(n->net_conf.tx, "timer")) {
+        error_setg(errp, "iothreads cannot be used with tx=timer");
+        return false;
+    }
+    if (virtio_has_feature(n->host_features, VIRTIO_NET_F_RSC_EXT)) {
+        /* The coalescing timers run in the main loop */
+        error_setg(errp, "iothreads cannot be used with guest_rsc_ext");
+        return false;
+    }
+    if (!k->set_guest_notifiers || !k->ioeventfd_assign) {
+        error_setg(errp, "device is incompatible with iothreads "
+                   "(transport does not support notifiers)");
+        return false;
+    }
+    if (!virtio_device_ioeventfd_enabled(vdev)) {
+        error_setg(errp, "ioeventfd is required for iothreads");
+        return false;
+    }
+    for (i = 0; i < n->nic_conf.peers.queues; i++) {
+        NetClientState *peer = n->nic_conf.peers.ncs[i];
+
+        if (get_vhost_net(peer) || !qemu_net_can_set_aio_context(peer)) {
+            error_setg(errp, "netdev '%s' cannot be used with iothreads",
+                       peer->name);
+            return false;
+        }
+    }
+
+    n->iothreads = g_new0(IOThread *, n->num_iothreads);
+    for (i = 0; i < n->num_iothreads; i++) {
+        n->iothreads[i] = iothread_by_id(n->iothread_ids[i]);
+        if (!n->iothreads[i]) {
+            error_setg(errp, "iothread '%s' not found", n->iothread_ids[i]);
+            goto fail;
+        }
+        object_ref(OBJECT(n->iothreads[i]));
+    }
+
+    /* Without vhost, the transport masks the irqfds itself */
+    vdev->use_guest_notifier_mask = false;
+    return true;
+
+fail:
+    while (--i >= 0) {
+        object_unref(OBJECT(n->iothreads[i]));
+    }
+    g_free(n->iothreads);
+    n->iothreads = NULL;
+    return false;
+}
+
+static void virtio_net_iothreads_cleanup(VirtIONet *n)
+{
+    int i;
+
+    for (i = 0; i < n->num_iothreads && n->iothreads; i++) {
+        object_unref(OBJECT(n->iothreads[i]));
+    }
+    g_free(n->iothreads);
+    n->iothreads = NULL;
 }
 
 static void virtio_net_change_num_queues(VirtIONet *n, int new_max_queues)
@@ -3145,12 +3949,26 @@ static NetClientInfo net_virtio_info = {
     .link_status_changed = virtio_net_set_link_status,
     .query_rx_filter = virtio_net_query_rxfilter,
     .announce = virtio_net_announce,
+    .rx_buf_get = virtio_net_rx_buf_get,
+    .rx_buf_put = virtio_net_rx_buf_put,
 };
 
+/* The subqueue whose peer runs virtqueue @idx with vhost */
+static NetClientState *virtio_net_vhost_subqueue(VirtIONet *n, int idx)
+{
+    int queues = n->multiqueue ? n->max_queues : 1;
+
+    if (idx == queues * 2) {
+        /* The control virtqueue, its peer comes after the datapath ones */
+        return qemu_get_subqueue(n->nic, n->max_queues);
+    }
+    return qemu_get_subqueue(n->nic, vq2q(idx));
+}
+
 static bool virtio_net_guest_notifier_pending(VirtIODevice *vdev, int idx)
 {
     VirtIONet *n = VIRTIO_NET(vdev);
-    NetClientState *nc = qemu_get_subqueue(n->nic, vq2q(idx));
+    NetClientState *nc = virtio_net_vhost_subqueue(n, idx);
     assert(n->vhost_started);
     return vhost_net_virtqueue_pending(get_vhost_net(nc->peer), idx);
 }
@@ -3159,7 +3977,7 @@ static void virtio_net_guest_notifier_mask(VirtIODevice *vdev, int idx,
                                            bool mask)
 {
     VirtIONet *n = VIRTIO_NET(vdev);
-    NetClientState *nc = qemu_get_subqueue(n->nic, vq2q(idx));
+    NetClientState *nc = virtio_net_vhost_subqueue(n, idx);
     assert(n->vhost_started);
     vhost_net_virtqueue_mask(get_vhost_net(nc->peer),
                              vdev, idx, mask);
@@ -3368,7 +4186,19 @@ static void virtio_net_device_realize(DeviceState *dev, Error **errp)
         return;
     }
 
-    n->max_queues = MAX(n->nic_conf.peers.queues, 1);
+    n->max_ncs = MAX(n->nic_conf.peers.queues, 1);
+
+    /*
+     * Figure out the datapath queue pairs since the backend could
+     * provide control queue via peers as well.
+     */
+    n->max_queues = 0;
+    for (i = 0; i < n->nic_conf.peers.queues; i++) {
+        if (n->nic_conf.peers.ncs[i]->is_datapath) {
+            ++n->max_queues;
+        }
+    }
+    n->max_queues = MAX(n->max_queues, 1);
     if (n->max_queues * 2 + 1 > VIRTIO_QUEUE_MAX) {
         error_setg(errp, "Invalid number of queues (= %" PRIu32 "), "
                    "must be a positive integer less than %d.",
@@ -3388,6 +4218,12 @@ static void virtio_net_device_realize(DeviceState *dev, Error **errp)
         error_printf("Defaulting to \"bh\"");
     }
 
+    if (!virtio_net_iothreads_setup(n, errp)) {
+        g_free(n->vqs);
+        virtio_cleanup(vdev);
+        return;
+    }
+
     n->net_conf.tx_queue_size = MIN(virtio_net_max_tx_queue_size(n),
                                     n->net_conf.tx_queue_size);
 
@@ -3494,6 +4330,7 @@ static void virtio_net_device_unrealize(DeviceState *dev)
     qemu_announce_timer_del(&n->announce_timer, false);
     g_free(n->vqs);
     qemu_del_nic(n->nic);
+    virtio_net_iothreads_cleanup(n);
     virtio_net_rsc_cleanup(n);
     g_free(n->rss_data.indirections_table);
     net_rx_pkt_uninit(n->rx_pkt);
@@ -3625,6 +4462,10 @@ static Property virtio_net_properties[] = {
     DEFINE_PROP_INT32("speed", VirtIONet, net_conf.speed, SPEED_UNKNOWN),
     DEFINE_PROP_STRING("duplex", VirtIONet, net_conf.duplex_str),
     DEFINE_PROP_BOOL("failover", VirtIONet, failover, false),
+    DEFINE_PROP_BOOL("x-rx-zerocopy", VirtIONet, rx_zerocopy, true),
+    DEFINE_PROP_BOOL("x-sw-gso", VirtIONet, sw_gso, false),
+    DEFINE_PROP_ARRAY("iothreads", VirtIONet, num_iothreads, iothread_ids,
+                      qdev_prop_string, char *),
     DEFINE_PROP_END_OF_LIST(),
 };
 
@@ -3651,6 +4492,8 @@ static void virtio_net_class_init(ObjectClass *klass, void *data)
     vdc->post_load = virtio_net_post_load_virtio;
     vdc->vmsd = &vmstate_virtio_net_device;
     vdc->primary_unplug_pending = primary_unplug_pending;
+    vdc->start_ioeventfd = virtio_net_start_ioeventfd;
+    vdc->stop_ioeventfd = virtio_net_stop_ioeventfd;
 }
 
 static const TypeInfo virtio_net_info = {
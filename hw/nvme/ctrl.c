@@ -152,7 +152,9 @@
 #include "qemu/osdep.h"
 #include "qemu/cutils.h"
 #include "qemu/error-report.h"
+#include "qemu/lockable.h"
 #include "qemu/log.h"
+#include "qemu/main-loop.h"
 #include "qemu/units.h"
 #include "qapi/error.h"
 #include "qapi/visitor.h"
@@ -434,7 +436,8 @@ static uint8_t nvme_cq_full(NvmeCQueue *cq)
 
 static uint8_t nvme_sq_empty(NvmeSQueue *sq)
 {
-    return sq->head == sq->tail;
+    /* Pairs with the release in the doorbell writes */
+    return sq->head == qatomic_load_acquire(&sq->tail);
 }
 
 static void nvme_irq_check(NvmeCtrl *n)
@@ -3925,7 +3928,9 @@ static uint16_t nvme_io_cmd(NvmeCtrl *n, NvmeRequest *req)
 
 static void nvme_free_sq(NvmeSQueue *sq, NvmeCtrl *n)
 {
-    n->sq[sq->sqid] = NULL;
+    WITH_QEMU_LOCK_GUARD(&n->db_lock) {
+        n->sq[sq->sqid] = NULL;
+    }
     timer_free(sq->timer);
     g_free(sq->io_req);
     if (sq->sqid) {
@@ -3999,7 +4004,10 @@ static void nvme_init_sq(NvmeSQueue *sq, NvmeCtrl *n, uint64_t dma_addr,
     assert(n->cq[cqid]);
     cq = n->cq[cqid];
     QTAILQ_INSERT_TAIL(&(cq->sq_list), sq, entry);
+
+    qemu_mutex_lock(&n->db_lock);
     n->sq[sqid] = sq;
+    qemu_mutex_unlock(&n->db_lock);
 }
 
 static uint16_t nvme_create_sq(NvmeCtrl *n, NvmeRequest *req)
@@ -5983,6 +5991,8 @@ static uint64_t nvme_mmio_read(void *opaque, hwaddr addr, unsigned size)
     NvmeCtrl *n = (NvmeCtrl *)opaque;
     uint8_t *ptr = (uint8_t *)&n->bar;
 
+    QEMU_IOTHREAD_LOCK_GUARD();
+
     trace_pci_nvme_mmio_read(addr, size);
 
     if (unlikely(addr & (sizeof(uint32_t) - 1))) {
@@ -6142,11 +6152,48 @@ static void nvme_process_db(NvmeCtrl *n, hwaddr addr, int val)
 
         trace_pci_nvme_mmio_doorbell_sq(sq->sqid, new_tail);
 
-        sq->tail = new_tail;
+        qatomic_store_release(&sq->tail, new_tail);
         timer_mod(sq->timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + 500);
     }
 }
 
+/*
+ * Called without the BQL.  Valid submission queue doorbell writes only
+ * need to update the tail and kick the queue, which db_lock keeps alive.
+ * Returns false if the write must go through nvme_process_db() instead.
+ */
+static bool nvme_process_sq_db_lockless(NvmeCtrl *n, hwaddr addr, int val)
+{
+    uint16_t new_tail = val & 0xffff;
+    uint32_t qid = (addr - 0x1000) >> 3;
+    NvmeSQueue *sq;
+
+    if (unlikely(addr & ((1 << 2) - 1)) || (((addr - 0x1000) >> 2) & 1)) {
+        return false;
+    }
+
+    QEMU_LOCK_GUARD(&n->db_lock);
+
+    if (unlikely(!n->sq || nvme_check_sqid(n, qid))) {
+        return false;
+    }
+
+    sq = n->sq[qid];
+    if (unlikely(new_tail >= sq->size)) {
+        return false;
+    }
+
+    trace_pci_nvme_mmio_doorbell_sq(sq->sqid, new_tail);
+
+    /*
+     * The guest wrote the entries before ringing the doorbell; publish
+     * them along with the tail to the thread that processes the queue.
+     */
+    qatomic_store_release(&sq->tail, new_tail);
+    timer_mod(sq->timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + 500);
+    return true;
+}
+
 static void nvme_mmio_write(void *opaque, hwaddr addr, uint64_t data,
                             unsigned size)
 {
@@ -6154,6 +6201,12 @@ static void nvme_mmio_write(void *opaque, hwaddr addr, uint64_t data,
 
     trace_pci_nvme_mmio_write(addr, data, size);
 
+    if (addr >= sizeof(n->bar) &&
+        nvme_process_sq_db_lockless(n, addr, data)) {
+        return;
+    }
+
+    QEMU_IOTHREAD_LOCK_GUARD();
     if (addr < sizeof(n->bar)) {
         nvme_write_bar(n, addr, data, size);
     } else {
@@ -6350,6 +6403,7 @@ static int nvme_init_pci(NvmeCtrl *n, PCIDevice *pci_dev, Error **errp)
     memory_region_init(&n->bar0, OBJECT(n), "nvme-bar0", bar_size);
     memory_region_init_io(&n->iomem, OBJECT(n), &nvme_mmio_ops, n, "nvme",
                           n->reg_size);
+    memory_region_clear_global_locking(&n->iomem);
     memory_region_add_subregion(&n->bar0, 0, &n->iomem);
 
     pci_register_bar(pci_dev, 0, PCI_BASE_ADDRESS_SPACE_MEMORY |
@@ -6577,7 +6631,10 @@ static void nvme_exit(PCIDevice *pci_dev)
     }
 
     g_free(n->cq);
-    g_free(n->sq);
+    WITH_QEMU_LOCK_GUARD(&n->db_lock) {
+        g_free(n->sq);
+        n->sq = NULL;
+    }
     g_free(n->aer_reqs);
 
     if (n->params.cmb_size_mb) {
@@ -6688,6 +6745,15 @@ static void nvme_instance_init(Object *obj)
     object_property_add(obj, "smart_critical_warning", "uint8",
                         nvme_get_smart_warning,
                         nvme_set_smart_warning, NULL, NULL);
+
+    qemu_mutex_init(&n->db_lock);
+}
+
+static void nvme_instance_finalize(Object *obj)
+{
+    NvmeCtrl *n = NVME(obj);
+
+    qemu_mutex_destroy(&n->db_lock);
 }
 
 static const TypeInfo nvme_info = {
@@ -6695,6 +6761,7 @@ static const TypeInfo nvme_info = {
     .parent        = TYPE_PCI_DEVICE,
     .instance_size = sizeof(NvmeCtrl),
     .instance_init = nvme_instance_init,
+    .instance_finalize = nvme_instance_finalize,
     .class_init    = nvme_class_init,
     .interfaces = (InterfaceInfo[]) {
         { INTERFACE_PCIE_DEVICE },
@@ -447,7 +447,9 @@ typedef struct NvmeCtrl {
 
     NvmeNamespace   namespace;
     NvmeNamespace   *namespaces[NVME_MAX_NAMESPACES + 1];
-    NvmeSQueue      **sq;
+    /* Submission queue doorbells are written without the BQL */
+    QemuMutex       db_lock;
+    NvmeSQueue      **sq; /* protected by db_lock and the BQL */
     NvmeCQueue      **cq;
     NvmeSQueue      admin_sq;
     NvmeCQueue      admin_cq;
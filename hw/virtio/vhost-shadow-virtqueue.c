@@ -0,0 +1,781 @@
+/*
+ * vhost shadow virtqueue
+ *
+ * Copyright(c) 2021 Red Hat, Inc.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include "qemu/osdep.h"
+#include "hw/virtio/vhost-shadow-virtqueue.h"
+
+#include <linux/vhost.h>
+
+#include "qemu/error-report.h"
+#include "qemu/log.h"
+#include "qemu/main-loop.h"
+#include "qemu/processor.h"
+#include "qemu/timer.h"
+#include "qapi/error.h"
+
+/*
+ * vhost_svq_poll() runs under the BQL: it spins for a short while, then
+ * sleeps on the call eventfd, and gives up on the device after
+ * SVQ_POLL_TIMEOUT_US.  Both are in microseconds.
+ */
+#define SVQ_POLL_SPIN_US    50
+#define SVQ_POLL_TIMEOUT_US G_USEC_PER_SEC
+
+/**
+ * Validate the transport device features that both guests can use with the
+ * SVQ and SVQs can use with the device.
+ *
+ * @features: The features
+ * @errp: Error pointer
+ */
+bool vhost_svq_valid_features(uint64_t features, Error **errp)
+{
+    /* The shadow vring is always little endian */
+    if (!virtio_has_feature(features, VIRTIO_F_VERSION_1)) {
+        error_setg(errp, "SVQ needs VIRTIO_F_VERSION_1");
+        return false;
+    }
+
+    /* The device must translate the addresses through the IOVA tree */
+    if (!virtio_has_feature(features, VIRTIO_F_ACCESS_PLATFORM)) {
+        error_setg(errp, "SVQ needs VIRTIO_F_ACCESS_PLATFORM");
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * Translate the addresses of a buffer from QEMU virtual addresses to the
+ * IOVA that the device uses.
+ *
+ * @svq: Shadow virtqueue
+ * @addrs: Translated IOVA addresses
+ * @iovec: QEMU virtual addresses of the buffer
+ * @num: Length of iovec and minimum length of addrs
+ */
+static bool vhost_svq_translate_addr(const VhostShadowVirtqueue *svq,
+                                     hwaddr *addrs, const struct iovec *iovec,
+                                     size_t num)
+{
+    size_t i;
+
+    for (i = 0; i < num; ++i) {
+        DMAMap needle = {
+            .translated_addr = (hwaddr)(uintptr_t)iovec[i].iov_base,
+            .size = iovec[i].iov_len ? iovec[i].iov_len - 1 : 0,
+        };
+        const DMAMap *map = iova_tree_find_iova(svq->iova_tree, &needle);
+        hwaddr off;
+
+        if (unlikely(!map)) {
+            qemu_log_mask(LOG_GUEST_ERROR,
+                          "Invalid address 0x%"HWADDR_PRIx" given by guest",
+                          needle.translated_addr);
+            return false;
+        }
+
+        /* Also catches a buffer that starts before the mapping */
+        off = needle.translated_addr - map->translated_addr;
+        if (unlikely(off > map->size || map->size - off < needle.size)) {
+            qemu_log_mask(LOG_GUEST_ERROR,
+                          "Guest buffer expands over iova range");
+            return false;
+        }
+
+        addrs[i] = map->iova + off;
+    }
+
+    return true;
+}
+
+static void vhost_svq_vring_write_descs(VhostShadowVirtqueue *svq,
+                                        const hwaddr *sg,
+                                        const struct iovec *iovec, size_t num,
+                                        bool more_descs, bool write)
+{
+    uint16_t i = svq->free_head, last = svq->free_head;
+    uint16_t flags = write ? cpu_to_le16(VRING_DESC_F_WRITE) : 0;
+    vring_desc_t *descs = svq->vring.desc;
+    size_t n;
+
+    if (num == 0) {
+        return;
+    }
+
+    for (n = 0; n < num; n++) {
+        if (more_descs || (n + 1 < num)) {
+            descs[i].flags = flags | cpu_to_le16(VRING_DESC_F_NEXT);
+        } else {
+            descs[i].flags = flags;
+        }
+        descs[i].addr = cpu_to_le64(sg[n]);
+        descs[i].len = cpu_to_le32(iovec[n].iov_len);
+
+        last = i;
+        i = le16_to_cpu(descs[i].next);
+    }
+
+    svq->free_head = le16_to_cpu(descs[last].next);
+}
+
+/*
+ * Make a buffer available in the shadow vring, without kicking the device.
+ * Returns -ENOSPC if it does not fit yet, -EINVAL if it never will.
+ */
+static int vhost_svq_add_split(VhostShadowVirtqueue *svq,
+                               const struct iovec *out_sg, size_t out_num,
+                               const struct iovec *in_sg, size_t in_num,
+                               VirtQueueElement *elem)
+{
+    size_t ndescs = out_num + in_num;
+    g_autofree hwaddr *sgs = NULL;
+    vring_avail_t *avail = svq->vring.avail;
+    uint16_t head, avail_idx;
+
+    if (unlikely(ndescs == 0 || ndescs > svq->vring.num)) {
+        qemu_log_mask(LOG_GUEST_ERROR,
+                      "Buffer of %zu descriptors in a %u size SVQ",
+                      ndescs, svq->vring.num);
+        return -EINVAL;
+    }
+    if (ndescs > svq->num_free) {
+        return -ENOSPC;
+    }
+
+    /* Translate everything first so a bad buffer leaves the vring alone */
+    sgs = g_new(hwaddr, ndescs);
+    if (!vhost_svq_translate_addr(svq, sgs, out_sg, out_num) ||
+        !vhost_svq_translate_addr(svq, sgs + out_num, in_sg, in_num)) {
+        return -EINVAL;
+    }
+
+    head = svq->free_head;
+    vhost_svq_vring_write_descs(svq, sgs, out_sg, out_num, in_num > 0, false);
+    vhost_svq_vring_write_descs(svq, sgs + out_num, in_sg, in_num, false,
+                                true);
+    svq->num_free -= ndescs;
+    svq->desc_state[head].elem = elem;
+    svq->desc_state[head].ndescs = ndescs;
+
+    /*
+     * Put the entry in the available array (but don't update avail->idx
+     * until they do sync).
+     */
+    avail_idx = svq->shadow_avail_idx % svq->vring.num;
+    avail->ring[avail_idx] = cpu_to_le16(head);
+    svq->shadow_avail_idx++;
+
+    /* Update the avail index after write the descriptor */
+    smp_wmb();
+    avail->idx = cpu_to_le16(svq->shadow_avail_idx);
+
+    return 0;
+}
+
+static void vhost_svq_kick(VhostShadowVirtqueue *svq)
+{
+    bool needs_kick;
+
+    /* Expose the new avail index before checking if the device wants it */
+    smp_mb();
+
+    if (svq->event_idx) {
+        uint16_t avail_event = le16_to_cpu(
+            *(uint16_t *)&svq->vring.used->ring[svq->vring.num]);
+
+        needs_kick = vring_need_event(avail_event, svq->shadow_avail_idx,
+                                      svq->kick_avail_idx);
+    } else {
+        needs_kick = !(svq->vring.used->flags &
+                       cpu_to_le16(VRING_USED_F_NO_NOTIFY));
+    }
+    svq->kick_avail_idx = svq->shadow_avail_idx;
+
+    if (needs_kick) {
+        event_notifier_set(&svq->hdev_kick);
+    }
+}
+
+/**
+ * Add a buffer to the shadow virtqueue and kick the device.
+ *
+ * @svq: The shadow virtqueue
+ * @out_sg: The device readable buffers, as QEMU virtual addresses
+ * @out_num: Number of device readable buffers
+ * @in_sg: The device writable buffers, as QEMU virtual addresses
+ * @in_num: Number of device writable buffers
+ * @elem: The guest element, or NULL if the buffer belongs to QEMU
+ *
+ * Return -ENOSPC if the queue is full, or another negative errno if the
+ * buffer can not be made available to the device.
+ */
+int vhost_svq_add(VhostShadowVirtqueue *svq, const struct iovec *out_sg,
+                  size_t out_num, const struct iovec *in_sg, size_t in_num,
+                  VirtQueueElement *elem)
+{
+    int r = vhost_svq_add_split(svq, out_sg, out_num, in_sg, in_num, elem);
+
+    if (r == 0) {
+        vhost_svq_kick(svq);
+    }
+    return r;
+}
+
+static void vhost_svq_notify_guest(VhostShadowVirtqueue *svq)
+{
+    bool needs_notify;
+
+    WITH_RCU_READ_LOCK_GUARD() {
+        needs_notify = virtio_should_notify(svq->vdev, svq->vq);
+    }
+
+    if (needs_notify) {
+        event_notifier_set(&svq->svq_call);
+    }
+}
+
+/**
+ * Return a buffer to the guest and notify it if it wants to.
+ *
+ * @svq: The shadow virtqueue
+ * @elem: The guest element
+ * @len: The number of bytes written to the device writable buffers
+ */
+void vhost_svq_push_elem(VhostShadowVirtqueue *svq,
+                         const VirtQueueElement *elem, uint32_t len)
+{
+    virtqueue_push(svq->vq, elem, len);
+    vhost_svq_notify_guest(svq);
+}
+
+/**
+ * Forward available buffers from the guest to the device.
+ *
+ * @svq: The shadow virtqueue
+ */
+static void vhost_handle_guest_kick(VhostShadowVirtqueue *svq)
+{
+    bool added = false;
+
+    do {
+        virtio_queue_set_notification(svq->vq, false);
+
+        while (true) {
+            VirtQueueElement *elem;
+            int r;
+
+            if (svq->next_guest_avail_elem) {
+                elem = g_steal_pointer(&svq->next_guest_avail_elem);
+            } else {
+                elem = virtqueue_pop(svq->vq, sizeof(*elem));
+            }
+
+            if (!elem) {
+                break;
+            }
+
+            if (svq->ops && svq->ops->avail_handler) {
+                r = svq->ops->avail_handler(svq, elem, svq->ops_opaque);
+                if (unlikely(r < 0)) {
+                    goto out;
+                }
+                continue;
+            }
+
+            r = vhost_svq_add_split(svq, elem->out_sg, elem->out_num,
+                                    elem->in_sg, elem->in_num, elem);
+            if (r == -ENOSPC) {
+                /*
+                 * The vring is full: wait for the device to use some
+                 * buffers.  vhost_svq_flush() calls us again then.
+                 */
+                svq->next_guest_avail_elem = elem;
+                goto out;
+            } else if (unlikely(r < 0)) {
+                /* The device can not reach the buffer, complete it empty */
+                vhost_svq_push_elem(svq, elem, 0);
+                g_free(elem);
+                continue;
+            }
+
+            added = true;
+        }
+
+        virtio_queue_set_notification(svq->vq, true);
+    } while (!virtio_queue_empty(svq->vq));
+
+out:
+    if (added) {
+        vhost_svq_kick(svq);
+    }
+}
+
+/**
+ * Handle guest's kick.
+ *
+ * @n: guest kick event notifier, the one that guest set to notify svq.
+ */
+static void vhost_handle_guest_kick_notifier(EventNotifier *n)
+{
+    VhostShadowVirtqueue *svq = container_of(n, VhostShadowVirtqueue,
+                                             svq_kick);
+    event_notifier_test_and_clear(n);
+    vhost_handle_guest_kick(svq);
+}
+
+static bool vhost_svq_more_used(VhostShadowVirtqueue *svq)
+{
+    if (svq->last_used_idx != svq->shadow_used_idx) {
+        return true;
+    }
+
+    svq->shadow_used_idx = le16_to_cpu(qatomic_read(&svq->vring.used->idx));
+
+    return svq->last_used_idx != svq->shadow_used_idx;
+}
+
+/**
+ * Enable vhost device calls after disable them.
+ *
+ * @svq: The svq
+ *
+ * It returns false if there are pending used buffers from the vhost device,
+ * avoiding the possible races between SVQ checking for more work and enabling
+ * callbacks. True if SVQ used vring has no more pending buffers.
+ */
+static bool vhost_svq_enable_notification(VhostShadowVirtqueue *svq)
+{
+    if (svq->event_idx) {
+        uint16_t *used_event =
+            (uint16_t *)&svq->vring.avail->ring[svq->vring.num];
+
+        *used_event = cpu_to_le16(svq->last_used_idx);
+    } else {
+        svq->vring.avail->flags &= ~cpu_to_le16(VRING_AVAIL_F_NO_INTERRUPT);
+    }
+
+    /* Make sure the device sees the change before checking the used idx */
+    smp_mb();
+    return !vhost_svq_more_used(svq);
+}
+
+static void vhost_svq_disable_notification(VhostShadowVirtqueue *svq)
+{
+    /*
+     * With event idx the used_event stays behind, so the device does not
+     * call again until it is moved.
+     */
+    if (!svq->event_idx) {
+        svq->vring.avail->flags |= cpu_to_le16(VRING_AVAIL_F_NO_INTERRUPT);
+    }
+}
+
+static uint16_t vhost_svq_last_desc_of_chain(const VhostShadowVirtqueue *svq,
+                                             uint16_t num, uint16_t i)
+{
+    for (uint16_t j = 0; j < (num - 1); ++j) {
+        i = le16_to_cpu(svq->vring.desc[i].next);
+    }
+
+    return i;
+}
+
+/*
+ * Get the next used buffer.  *elem is NULL for the buffers that QEMU added
+ * on its own.
+ */
+static bool vhost_svq_get_buf(VhostShadowVirtqueue *svq,
+                              VirtQueueElement **elem, uint32_t *len)
+{
+    const vring_used_t *used = svq->vring.used;
+    vring_used_elem_t used_elem;
+    uint16_t last_used, last_used_chain, num;
+
+    if (!vhost_svq_more_used(svq)) {
+        return false;
+    }
+
+    /* Only get used array entries after they have been exposed by dev */
+    smp_rmb();
+    last_used = svq->last_used_idx % svq->vring.num;
+    used_elem.id = le32_to_cpu(used->ring[last_used].id);
+    used_elem.len = le32_to_cpu(used->ring[last_used].len);
+    svq->last_used_idx++;
+
+    if (unlikely(used_elem.id >= svq->vring.num)) {
+        qemu_log_mask(LOG_GUEST_ERROR, "Device %s says index %u is used",
+                      svq->vdev->name, used_elem.id);
+        return false;
+    }
+
+    if (unlikely(!svq->desc_state[used_elem.id].ndescs)) {
+        qemu_log_mask(LOG_GUEST_ERROR,
+            "Device %s says index %u is used, but it was not available",
+            svq->vdev->name, used_elem.id);
+        return false;
+    }
+
+    num = svq->desc_state[used_elem.id].ndescs;
+    svq->desc_state[used_elem.id].ndescs = 0;
+    last_used_chain = vhost_svq_last_desc_of_chain(svq, num, used_elem.id);
+    svq->vring.desc[last_used_chain].next = cpu_to_le16(svq->free_head);
+    svq->free_head = used_elem.id;
+    svq->num_free += num;
+
+    *elem = g_steal_pointer(&svq->desc_state[used_elem.id].elem);
+    *len = used_elem.len;
+    return true;
+}
+
+/**
+ * Forward used buffers from the device to the guest.
+ *
+ * @svq: Shadow virtqueue
+ * @check_for_avail_queue: Make more guest buffers available if there are
+ *                         some waiting for room in the vring
+ */
+static void vhost_svq_flush(VhostShadowVirtqueue *svq,
+                            bool check_for_avail_queue)
+{
+    VirtQueue *vq = svq->vq;
+
+    /* Forward as many used buffers as possible. */
+    do {
+        VirtQueueElement *elem;
+        unsigned i = 0;
+        uint32_t len;
+
+        vhost_svq_disable_notification(svq);
+        while (vhost_svq_get_buf(svq, &elem, &len)) {
+            if (!elem) {
+                /* Claimed by vhost_svq_poll() */
+                continue;
+            }
+
+            virtqueue_fill(vq, elem, len, i++);
+            g_free(elem);
+            if (i == svq->vring.num) {
+                virtqueue_flush(vq, i);
+                i = 0;
+            }
+        }
+
+        if (i) {
+            virtqueue_flush(vq, i);
+            vhost_svq_notify_guest(svq);
+        }
+
+        if (check_for_avail_queue && svq->next_guest_avail_elem) {
+            /*
+             * The vring was full when vhost_svq_flush was called, so this
+             * is a good moment to make more descriptors available.
+             */
+            vhost_handle_guest_kick(svq);
+        }
+    } while (!vhost_svq_enable_notification(svq));
+}
+
+/**
+ * Wait for the device to use the buffer that QEMU added last, as the
+ * control virtqueue does for every command.  Only valid for shadow
+ * virtqueues where QEMU adds all the buffers.
+ *
+ * Return the length written by the device, or a negative errno.
+ */
+ssize_t vhost_svq_poll(VhostShadowVirtqueue *svq)
+{
+    int64_t start_us = g_get_monotonic_time();
+    int64_t elapsed_us;
+    VirtQueueElement *elem;
+    uint32_t len;
+
+    while (!vhost_svq_more_used(svq)) {
+        elapsed_us = g_get_monotonic_time() - start_us;
+        if (unlikely(elapsed_us > SVQ_POLL_TIMEOUT_US)) {
+            return -ETIMEDOUT;
+        }
+        if (elapsed_us < SVQ_POLL_SPIN_US) {
+            cpu_relax();
+            continue;
+        }
+
+        /*
+         * The buffer is reaped here, so vhost_svq_handle_call() need not
+         * see the call.
+         */
+        if (vhost_svq_enable_notification(svq)) {
+            GPollFD pfd = {
+                .fd = event_notifier_get_fd(&svq->hdev_call),
+                .events = G_IO_IN,
+            };
+
+            qemu_poll_ns(&pfd, 1,
+                         (SVQ_POLL_TIMEOUT_US - elapsed_us) * SCALE_US);
+            event_notifier_test_and_clear(&svq->hdev_call);
+        }
+    }
+
+    if (!vhost_svq_get_buf(svq, &elem, &len)) {
+        return -EIO;
+    }
+
+    assert(!elem);
+    return len;
+}
+
+/**
+ * Forward used buffers.
+ *
+ * @n: hdev call event notifier, the one that device set to notify svq.
+ */
+static void vhost_svq_handle_call(EventNotifier *n)
+{
+    VhostShadowVirtqueue *svq = container_of(n, VhostShadowVirtqueue,
+                                             hdev_call);
+    event_notifier_test_and_clear(n);
+    vhost_svq_flush(svq, true);
+}
+
+/**
+ * Set the call notifier for the SVQ to call the guest
+ *
+ * @svq: Shadow virtqueue
+ * @call_fd: call notifier
+ *
+ * Called on BQL context.
+ */
+void vhost_svq_set_svq_call_fd(VhostShadowVirtqueue *svq, int call_fd)
+{
+    event_notifier_init_fd(&svq->svq_call, call_fd);
+}
+
+/**
+ * Set a new file descriptor for the guest to kick the SVQ and notify for
+ * avail
+ *
+ * @svq: The svq
+ * @svq_kick_fd: The svq kick fd
+ *
+ * Note that the SVQ will never close the old file descriptor.
+ */
+void vhost_svq_set_svq_kick_fd(VhostShadowVirtqueue *svq, int svq_kick_fd)
+{
+    EventNotifier *svq_kick = &svq->svq_kick;
+    bool poll_stop = VHOST_FILE_UNBIND != event_notifier_get_fd(svq_kick);
+    bool poll_start = svq_kick_fd != VHOST_FILE_UNBIND;
+
+    if (poll_stop) {
+        event_notifier_set_handler(svq_kick, NULL);
+    }
+
+    event_notifier_init_fd(svq_kick, svq_kick_fd);
+
+    /*
+     * The guest may have kicked before the switch, so check for available
+     * buffers in the new file descriptor right away.  The handler is only
+     * installed once the SVQ has started.
+     */
+    if (poll_start && svq->vq) {
+        event_notifier_set(svq_kick);
+        event_notifier_set_handler(svq_kick, vhost_handle_guest_kick_notifier);
+    }
+}
+
+/**
+ * Get the shadow vq vring address, as QEMU virtual addresses.
+ *
+ * @svq: Shadow virtqueue
+ * @addr: Destination to store address
+ */
+void vhost_svq_get_vring_addr(const VhostShadowVirtqueue *svq,
+                              struct vhost_vring_addr *addr)
+{
+    addr->desc_user_addr = (uint64_t)(uintptr_t)svq->vring.desc;
+    addr->avail_user_addr = (uint64_t)(uintptr_t)svq->vring.avail;
+    addr->used_user_addr = (uint64_t)(uintptr_t)svq->vring.used;
+}
+
+/* Size of the descriptor table and avail ring, rounded up to pages */
+size_t vhost_svq_driver_area_size(const VhostShadowVirtqueue *svq)
+{
+    size_t desc_size = sizeof(vring_desc_t) * svq->vring.num;
+    size_t avail_size = offsetof(vring_avail_t, ring) +
+                        sizeof(uint16_t) * (svq->vring.num + 1);
+
+    return ROUND_UP(desc_size + avail_size, qemu_real_host_page_size);
+}
+
+/* Size of the used ring, rounded up to pages */
+size_t vhost_svq_device_area_size(const VhostShadowVirtqueue *svq)
+{
+    size_t used_size = offsetof(vring_used_t, ring) +
+                       sizeof(vring_used_elem_t) * svq->vring.num +
+                       sizeof(uint16_t);
+
+    return ROUND_UP(used_size, qemu_real_host_page_size);
+}
+
+/**
+ * Start the shadow virtqueue operation.
+ *
+ * @svq: Shadow Virtqueue
+ * @vdev: VirtIO device
+ * @vq: Virtqueue to shadow
+ */
+void vhost_svq_start(VhostShadowVirtqueue *svq, VirtIODevice *vdev,
+                     VirtQueue *vq)
+{
+    size_t desc_size, driver_size, device_size;
+    unsigned i;
+
+    event_notifier_set_handler(&svq->hdev_call, vhost_svq_handle_call);
+    svq->next_guest_avail_elem = NULL;
+    svq->shadow_avail_idx = 0;
+    svq->kick_avail_idx = 0;
+    svq->shadow_used_idx = 0;
+    svq->last_used_idx = 0;
+    svq->vdev = vdev;
+    svq->vq = vq;
+    svq->event_idx = virtio_vdev_has_feature(vdev, VIRTIO_RING_F_EVENT_IDX);
+
+    svq->vring.num = virtio_queue_get_num(vdev, virtio_get_queue_index(vq));
+    driver_size = vhost_svq_driver_area_size(svq);
+    device_size = vhost_svq_device_area_size(svq);
+    svq->vring.desc = qemu_memalign(qemu_real_host_page_size, driver_size);
+    desc_size = sizeof(vring_desc_t) * svq->vring.num;
+    svq->vring.avail = (void *)((char *)svq->vring.desc + desc_size);
+    memset(svq->vring.desc, 0, driver_size);
+    svq->vring.used = qemu_memalign(qemu_real_host_page_size, device_size);
+    memset(svq->vring.used, 0, device_size);
+
+    svq->desc_state = g_new0(SVQDescState, svq->vring.num);
+    for (i = 0; i < svq->vring.num - 1; i++) {
+        svq->vring.desc[i].next = cpu_to_le16(i + 1);
+    }
+    svq->free_head = 0;
+    svq->num_free = svq->vring.num;
+
+    if (event_notifier_get_fd(&svq->svq_kick) != VHOST_FILE_UNBIND) {
+        event_notifier_set(&svq->svq_kick);
+        event_notifier_set_handler(&svq->svq_kick,
+                                   vhost_handle_guest_kick_notifier);
+    }
+}
+
+/**
+ * Stop the shadow virtqueue operation.
+ *
+ * Forward the buffers that the device already used, and give the ones
+ * still in flight back to the guest virtqueue so they are processed again
+ * after the device restarts.
+ *
+ * @svq: Shadow Virtqueue
+ */
+void vhost_svq_stop(VhostShadowVirtqueue *svq)
+{
+    unsigned i;
+
+    vhost_svq_set_svq_kick_fd(svq, VHOST_FILE_UNBIND);
+    event_notifier_set_handler(&svq->hdev_call, NULL);
+
+    if (!svq->vq) {
+        return;
+    }
+
+    vhost_svq_flush(svq, false);
+
+    for (i = 0; i < svq->vring.num; ++i) {
+        g_autofree VirtQueueElement *elem = NULL;
+
+        elem = g_steal_pointer(&svq->desc_state[i].elem);
+        if (elem) {
+            virtqueue_unpop(svq->vq, elem, 0);
+        }
+    }
+
+    if (svq->next_guest_avail_elem) {
+        g_autofree VirtQueueElement *elem =
+            g_steal_pointer(&svq->next_guest_avail_elem);
+
+        virtqueue_unpop(svq->vq, elem, 0);
+    }
+
+    svq->vq = NULL;
+    g_free(svq->desc_state);
+    svq->desc_state = NULL;
+    qemu_vfree(svq->vring.desc);
+    qemu_vfree(svq->vring.used);
+    svq->vring.desc = NULL;
+    svq->vring.avail = NULL;
+    svq->vring.used = NULL;
+}
+
+/**
+ * Creates vhost shadow virtqueue, and instructs the vhost device to use the
+ * shadow methods and file descriptors.
+ *
+ * @iova_tree: Tree to translate QEMU virtual addresses to IOVA
+ * @ops: SVQ owner callbacks, may be NULL
+ * @ops_opaque: ops opaque pointer
+ *
+ * Returns the new virtqueue or NULL.
+ *
+ * In case of error, reason is reported through error_report.
+ */
+VhostShadowVirtqueue *vhost_svq_new(IOVATree *iova_tree,
+                                    const VhostShadowVirtqueueOps *ops,
+                                    void *ops_opaque)
+{
+    g_autofree VhostShadowVirtqueue *svq = g_new0(VhostShadowVirtqueue, 1);
+    int r;
+
+    r = event_notifier_init(&svq->hdev_kick, 0);
+    if (r != 0) {
+        error_report("Couldn't create kick event notifier: %s (%d)",
+                     g_strerror(errno), errno);
+        goto err_init_hdev_kick;
+    }
+
+    r = event_notifier_init(&svq->hdev_call, 0);
+    if (r != 0) {
+        error_report("Couldn't create call event notifier: %s (%d)",
+                     g_strerror(errno), errno);
+        goto err_init_hdev_call;
+    }
+
+    event_notifier_init_fd(&svq->svq_kick, VHOST_FILE_UNBIND);
+    event_notifier_init_fd(&svq->svq_call, VHOST_FILE_UNBIND);
+    svq->iova_tree = iova_tree;
+    svq->ops = ops;
+    svq->ops_opaque = ops_opaque;
+    return g_steal_pointer(&svq);
+
+err_init_hdev_call:
+    event_notifier_cleanup(&svq->hdev_kick);
+
+err_init_hdev_kick:
+    return NULL;
+}
+
+/**
+ * Free the resources of the shadow virtqueue.
+ *
+ * @pvq: gpointer to SVQ so it can be used by autofree functions.
+ */
+void vhost_svq_free(gpointer pvq)
+{
+    VhostShadowVirtqueue *vq = pvq;
+
+    vhost_svq_stop(vq);
+    event_notifier_cleanup(&vq->hdev_kick);
+    event_notifier_cleanup(&vq->hdev_call);
+    g_free(vq);
+}
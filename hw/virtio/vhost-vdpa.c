@@ -20,23 +20,85 @@
 #include "hw/virtio/vhost-vdpa.h"
 #include "exec/address-spaces.h"
 #include "qemu/main-loop.h"
+#include "qemu/units.h"
 #include "cpu.h"
 #include "trace.h"
 #include "qemu-common.h"
+#include "qapi/error.h"
 
-static bool vhost_vdpa_listener_skipped_section(MemoryRegionSection *section)
+/*
+ * Unless the guest memory is shadowed too, it is mapped at its GPA.  The
+ * buffers of the shadow virtqueues then go to the top of the IOVA range,
+ * which is kept out of the guest memory.
+ */
+#define VHOST_VDPA_SVQ_IOVA_WINDOW (1 * MiB)
+
+static void vhost_vdpa_svq_iova_window(const struct vhost_vdpa *v,
+                                       hwaddr *first, hwaddr *last)
 {
-    return (!memory_region_is_ram(section->mr) &&
-            !memory_region_is_iommu(section->mr)) ||
-           /* vhost-vDPA doesn't allow MMIO to be mapped  */
-            memory_region_is_ram_device(section->mr) ||
-           /*
-            * Sizing an enabled 64-bit BAR can cause spurious mappings to
-            * addresses in the upper part of the 64-bit address space.  These
-            * are never accessed by the CPU and beyond the address width of
-            * some IOMMU hardware.  TODO: VDPA should tell us the IOMMU width.
-            */
-           section->offset_within_address_space & (1ULL << 63);
+    *first = v->iova_range.first;
+    *last = v->iova_range.last;
+    if (!v->shadow_data &&
+        *last - *first >= VHOST_VDPA_SVQ_IOVA_WINDOW) {
+        *first = *last - VHOST_VDPA_SVQ_IOVA_WINDOW + 1;
+    }
+}
+
+/* Last address the guest memory can be mapped at, when mapped at its GPA */
+static hwaddr vhost_vdpa_gpa_last(const struct vhost_vdpa *v)
+{
+    hwaddr first, last;
+
+    if (!v->shadow_vqs_capable) {
+        return v->iova_range.last;
+    }
+
+    vhost_vdpa_svq_iova_window(v, &first, &last);
+    return first - 1;
+}
+
+static bool vhost_vdpa_listener_skipped_section(struct vhost_vdpa *v,
+                                                MemoryRegionSection *section)
+{
+    Int128 llend;
+
+    if ((!memory_region_is_ram(section->mr) &&
+         !memory_region_is_iommu(section->mr)) ||
+        /* vhost-vDPA doesn't allow MMIO to be mapped  */
+        memory_region_is_ram_device(section->mr) ||
+        /*
+         * Sizing an enabled 64-bit BAR can cause spurious mappings to
+         * addresses in the upper part of the 64-bit address space.  These
+         * are never accessed by the CPU and beyond the address width of
+         * some IOMMU hardware.  TODO: VDPA should tell us the IOMMU width.
+         */
+        section->offset_within_address_space & (1ULL << 63)) {
+        return true;
+    }
+
+    if (v->shadow_data) {
+        /* Mapped wherever iova_tree finds room */
+        return false;
+    }
+
+    if (section->offset_within_address_space < v->iova_range.first) {
+        error_report("RAM section out of device range (min=0x%" PRIx64
+                     ", addr=0x%" HWADDR_PRIx ")",
+                     v->iova_range.first, section->offset_within_address_space);
+        return true;
+    }
+
+    llend = int128_add(int128_make64(section->offset_within_address_space),
+                       section->size);
+    if (int128_gt(llend, int128_add(int128_make64(vhost_vdpa_gpa_last(v)),
+                                    int128_one()))) {
+        error_report("RAM section out of device range (max=0x%" HWADDR_PRIx
+                     ", end addr=0x%" PRIx64 ")",
+                     vhost_vdpa_gpa_last(v), int128_get64(llend));
+        return true;
+    }
+
+    return false;
 }
 
 static int vhost_vdpa_dma_map(struct vhost_vdpa *v, hwaddr iova, hwaddr size,
@@ -148,7 +210,7 @@ static void vhost_vdpa_listener_region_add(MemoryListener *listener,
     void *vaddr;
     int ret;
 
-    if (vhost_vdpa_listener_skipped_section(section)) {
+    if (vhost_vdpa_listener_skipped_section(v, section)) {
         return;
     }
 
@@ -179,12 +241,36 @@ static void vhost_vdpa_listener_region_add(MemoryListener *listener,
                                          vaddr, section->readonly);
 
     llsize = int128_sub(llend, int128_make64(iova));
+    if (v->shadow_data) {
+        DMAMap mem_region = {
+            .translated_addr = (hwaddr)(uintptr_t)vaddr,
+            .size = int128_get64(llsize) - 1,
+            .perm = IOMMU_ACCESS_FLAG(true, !section->readonly),
+        };
+
+        ret = iova_tree_alloc_map(v->iova_tree, &mem_region,
+                                  v->iova_range.first, v->iova_range.last);
+        if (unlikely(ret != IOVA_OK)) {
+            error_report("Can't allocate a mapping (%d)", ret);
+            goto fail;
+        }
+
+        iova = mem_region.iova;
+    }
 
     vhost_vdpa_iotlb_batch_begin_once(v);
     ret = vhost_vdpa_dma_map(v, iova, int128_get64(llsize),
                              vaddr, section->readonly);
     if (ret) {
         error_report("vhost vdpa map fail!");
+        if (v->shadow_data) {
+            DMAMap mem_region = {
+                .iova = iova,
+                .size = int128_get64(llsize) - 1,
+            };
+
+            iova_tree_remove(v->iova_tree, &mem_region);
+        }
         goto fail;
     }
 
@@ -209,7 +295,7 @@ static void vhost_vdpa_listener_region_del(MemoryListener *listener,
     Int128 llend, llsize;
     int ret;
 
-    if (vhost_vdpa_listener_skipped_section(section)) {
+    if (vhost_vdpa_listener_skipped_section(v, section)) {
         return;
     }
 
@@ -232,6 +318,26 @@ static void vhost_vdpa_listener_region_del(MemoryListener *listener,
 
     llsize = int128_sub(llend, int128_make64(iova));
 
+    if (v->shadow_data) {
+        const DMAMap *result;
+        void *vaddr = memory_region_get_ram_ptr(section->mr) +
+                      section->offset_within_region +
+                      (iova - section->offset_within_address_space);
+        DMAMap mem_region = {
+            .translated_addr = (hwaddr)(uintptr_t)vaddr,
+            .size = int128_get64(llsize) - 1,
+        };
+
+        result = iova_tree_find_iova(v->iova_tree, &mem_region);
+        if (!result) {
+            /* region_add could not map it */
+            return;
+        }
+        iova = result->iova;
+        mem_region = *result;
+        iova_tree_remove(v->iova_tree, &mem_region);
+    }
+
     vhost_vdpa_iotlb_batch_begin_once(v);
     ret = vhost_vdpa_dma_unmap(v, iova, int128_get64(llsize));
     if (ret) {
@@ -264,23 +370,74 @@ static int vhost_vdpa_call(struct vhost_dev *dev, unsigned long int request,
     return ret < 0 ? -errno : ret;
 }
 
-static void vhost_vdpa_add_status(struct vhost_dev *dev, uint8_t status)
+static int vhost_vdpa_add_status(struct vhost_dev *dev, uint8_t status)
 {
     uint8_t s;
+    int ret;
 
     trace_vhost_vdpa_add_status(dev, status);
-    if (vhost_vdpa_call(dev, VHOST_VDPA_GET_STATUS, &s)) {
-        return;
+    ret = vhost_vdpa_call(dev, VHOST_VDPA_GET_STATUS, &s);
+    if (ret < 0) {
+        return ret;
     }
 
     s |= status;
 
-    vhost_vdpa_call(dev, VHOST_VDPA_SET_STATUS, &s);
+    ret = vhost_vdpa_call(dev, VHOST_VDPA_SET_STATUS, &s);
+    if (ret < 0) {
+        return ret;
+    }
+
+    ret = vhost_vdpa_call(dev, VHOST_VDPA_GET_STATUS, &s);
+    if (ret < 0) {
+        return ret;
+    }
+
+    if (!(s & status)) {
+        return -EIO;
+    }
+
+    return 0;
+}
+
+/*
+ * The vhost_devs of the queue pairs and of the control virtqueue share the
+ * device, so the requests for the whole device are only sent by the first.
+ */
+static bool vhost_vdpa_one_time_request(struct vhost_dev *dev)
+{
+    struct vhost_vdpa *v = dev->opaque;
+
+    return v->index != 0;
+}
+
+static int vhost_vdpa_init_svq(struct vhost_dev *hdev, struct vhost_vdpa *v,
+                               Error **errp)
+{
+    g_autoptr(GPtrArray) shadow_vqs = NULL;
+    unsigned n;
+
+    shadow_vqs = g_ptr_array_new_full(hdev->nvqs, vhost_svq_free);
+    for (n = 0; n < hdev->nvqs; ++n) {
+        VhostShadowVirtqueue *svq;
+
+        svq = vhost_svq_new(v->iova_tree, v->shadow_vq_ops,
+                            v->shadow_vq_ops_opaque);
+        if (unlikely(!svq)) {
+            error_setg(errp, "Cannot create svq %u", n);
+            return -1;
+        }
+        g_ptr_array_add(shadow_vqs, svq);
+    }
+
+    v->shadow_vqs = g_steal_pointer(&shadow_vqs);
+    return 0;
 }
 
 static int vhost_vdpa_init(struct vhost_dev *dev, void *opaque, Error **errp)
 {
     struct vhost_vdpa *v;
+    int ret;
     assert(dev->vhost_ops->backend_type == VHOST_BACKEND_TYPE_VDPA);
     trace_vhost_vdpa_init(dev, opaque);
 
@@ -290,6 +447,17 @@ static int vhost_vdpa_init(struct vhost_dev *dev, void *opaque, Error **errp)
     v->listener = vhost_vdpa_memory_listener;
     v->msg_type = VHOST_IOTLB_MSG_V2;
 
+    if (v->shadow_vqs_capable) {
+        ret = vhost_vdpa_init_svq(dev, v, errp);
+        if (ret) {
+            return ret;
+        }
+    }
+
+    if (vhost_vdpa_one_time_request(dev)) {
+        return 0;
+    }
+
     vhost_vdpa_add_status(dev, VIRTIO_CONFIG_S_ACKNOWLEDGE |
                                VIRTIO_CONFIG_S_DRIVER);
 
@@ -318,7 +486,7 @@ static void vhost_vdpa_host_notifiers_uninit(struct vhost_dev *dev, int n)
 {
     int i;
 
-    for (i = 0; i < n; i++) {
+    for (i = dev->vq_index; i < dev->vq_index + n; i++) {
         vhost_vdpa_host_notifier_uninit(dev, i);
     }
 }
@@ -363,8 +531,14 @@ err:
 
 static void vhost_vdpa_host_notifiers_init(struct vhost_dev *dev)
 {
+    struct vhost_vdpa *v = dev->opaque;
     int i;
 
+    if (v->shadow_vqs_enabled) {
+        /* The guest kicks the shadow virtqueues, not the device */
+        return;
+    }
+
     for (i = dev->vq_index; i < dev->vq_index + dev->nvqs; i++) {
         if (vhost_vdpa_host_notifier_init(dev, i)) {
             goto err;
@@ -374,7 +548,7 @@ static void vhost_vdpa_host_notifiers_init(struct vhost_dev *dev)
     return;
 
 err:
-    vhost_vdpa_host_notifiers_uninit(dev, i);
+    vhost_vdpa_host_notifiers_uninit(dev, i - dev->vq_index);
     return;
 }
 
@@ -386,6 +560,10 @@ static int vhost_vdpa_cleanup(struct vhost_dev *dev)
     trace_vhost_vdpa_cleanup(dev, v);
     vhost_vdpa_host_notifiers_uninit(dev, dev->nvqs);
     memory_listener_unregister(&v->listener);
+    if (v->shadow_vqs) {
+        g_ptr_array_free(v->shadow_vqs, true);
+        v->shadow_vqs = NULL;
+    }
 
     dev->opaque = NULL;
     return 0;
@@ -400,6 +578,10 @@ static int vhost_vdpa_memslots_limit(struct vhost_dev *dev)
 static int vhost_vdpa_set_mem_table(struct vhost_dev *dev,
                                     struct vhost_memory *mem)
 {
+    if (vhost_vdpa_one_time_request(dev)) {
+        return 0;
+    }
+
     trace_vhost_vdpa_set_mem_table(dev, mem->nregions, mem->padding);
     if (trace_event_get_state_backends(TRACE_VHOST_VDPA_SET_MEM_TABLE) &&
         trace_event_get_state_backends(TRACE_VHOST_VDPA_DUMP_REGIONS)) {
@@ -422,17 +604,32 @@ static int vhost_vdpa_set_mem_table(struct vhost_dev *dev,
 static int vhost_vdpa_set_features(struct vhost_dev *dev,
                                    uint64_t features)
 {
+    struct vhost_vdpa *v = dev->opaque;
+    uint8_t status = 0;
     int ret;
+
+    if (vhost_vdpa_one_time_request(dev)) {
+        return 0;
+    }
+
+    /* The shadow virtqueues track the dirty memory, not the device */
+    features &= ~BIT_ULL(VHOST_F_LOG_ALL);
+
+    ret = vhost_vdpa_call(dev, VHOST_VDPA_GET_STATUS, &status);
+    if (ret == 0 && (status & VIRTIO_CONFIG_S_FEATURES_OK) &&
+        features == v->acked_features) {
+        /* Only the dirty log changed */
+        return 0;
+    }
+
     trace_vhost_vdpa_set_features(dev, features);
     ret = vhost_vdpa_call(dev, VHOST_SET_FEATURES, &features);
-    uint8_t status = 0;
     if (ret) {
         return ret;
     }
-    vhost_vdpa_add_status(dev, VIRTIO_CONFIG_S_FEATURES_OK);
-    vhost_vdpa_call(dev, VHOST_VDPA_GET_STATUS, &status);
+    v->acked_features = features;
 
-    return !(status & VIRTIO_CONFIG_S_FEATURES_OK);
+    return vhost_vdpa_add_status(dev, VIRTIO_CONFIG_S_FEATURES_OK);
 }
 
 static int vhost_vdpa_set_backend_cap(struct vhost_dev *dev)
@@ -447,9 +644,13 @@ static int vhost_vdpa_set_backend_cap(struct vhost_dev *dev)
     }
 
     features &= f;
-    r = vhost_vdpa_call(dev, VHOST_SET_BACKEND_FEATURES, &features);
-    if (r) {
-        return -EFAULT;
+
+    /* Every vhost_dev checks backend_cap, but only one sets it */
+    if (!vhost_vdpa_one_time_request(dev)) {
+        r = vhost_vdpa_call(dev, VHOST_SET_BACKEND_FEATURES, &features);
+        if (r) {
+            return -EFAULT;
+        }
     }
 
     dev->backend_cap = features;
@@ -480,8 +681,8 @@ static int vhost_vdpa_get_vq_index(struct vhost_dev *dev, int idx)
 {
     assert(idx >= dev->vq_index && idx < dev->vq_index + dev->nvqs);
 
-    trace_vhost_vdpa_get_vq_index(dev, idx, idx - dev->vq_index);
-    return idx - dev->vq_index;
+    trace_vhost_vdpa_get_vq_index(dev, idx, idx);
+    return idx;
 }
 
 static int vhost_vdpa_set_vring_ready(struct vhost_dev *dev)
@@ -554,26 +755,312 @@ static int vhost_vdpa_get_config(struct vhost_dev *dev, uint8_t *config,
     return ret;
  }
 
+static int vhost_vdpa_set_vring_dev_kick(struct vhost_dev *dev,
+                                         struct vhost_vring_file *file)
+{
+    trace_vhost_vdpa_set_vring_kick(dev, file->index, file->fd);
+    return vhost_vdpa_call(dev, VHOST_SET_VRING_KICK, file);
+}
+
+static int vhost_vdpa_set_vring_dev_call(struct vhost_dev *dev,
+                                         struct vhost_vring_file *file)
+{
+    trace_vhost_vdpa_set_vring_call(dev, file->index, file->fd);
+    return vhost_vdpa_call(dev, VHOST_SET_VRING_CALL, file);
+}
+
+static int vhost_vdpa_set_vring_dev_addr(struct vhost_dev *dev,
+                                         struct vhost_vring_addr *addr)
+{
+    trace_vhost_vdpa_set_vring_addr(dev, addr->index, addr->flags,
+                                    addr->desc_user_addr, addr->used_user_addr,
+                                    addr->avail_user_addr,
+                                    addr->log_guest_addr);
+    return vhost_vdpa_call(dev, VHOST_SET_VRING_ADDR, addr);
+}
+
+/*
+ * Map a buffer of QEMU to the device, in the IOVA range that the shadow
+ * virtqueues use.  @needle gets the allocated IOVA.
+ */
+static bool vhost_vdpa_svq_map_region(struct vhost_vdpa *v, DMAMap *needle,
+                                      Error **errp)
+{
+    hwaddr first, last;
+    int r;
+
+    vhost_vdpa_svq_iova_window(v, &first, &last);
+    r = iova_tree_alloc_map(v->iova_tree, needle, first, last);
+    if (unlikely(r != IOVA_OK)) {
+        error_setg(errp, "Cannot allocate iova (%d)", r);
+        return false;
+    }
+
+    r = vhost_vdpa_dma_map(v, needle->iova, needle->size + 1,
+                           (void *)(uintptr_t)needle->translated_addr,
+                           needle->perm == IOMMU_RO);
+    if (unlikely(r != 0)) {
+        error_setg_errno(errp, -r, "Cannot map region to device");
+        iova_tree_remove(v->iova_tree, needle);
+    }
+
+    return r == 0;
+}
+
+static void vhost_vdpa_svq_unmap_region(struct vhost_vdpa *v, hwaddr addr)
+{
+    DMAMap needle = {
+        .translated_addr = addr,
+    };
+    const DMAMap *result = iova_tree_find_iova(v->iova_tree, &needle);
+    int r;
+
+    if (unlikely(!result)) {
+        error_report("Unable to find SVQ address to unmap");
+        return;
+    }
+
+    needle = *result;
+    r = vhost_vdpa_dma_unmap(v, needle.iova, needle.size + 1);
+    if (unlikely(r != 0)) {
+        error_report("Unable to unmap SVQ vring: %s (%d)", g_strerror(-r), -r);
+        return;
+    }
+
+    iova_tree_remove(v->iova_tree, &needle);
+}
+
+int vhost_vdpa_svq_map_buf(struct vhost_vdpa *v, void *buf, size_t size,
+                           bool write)
+{
+    DMAMap map = {
+        .translated_addr = (hwaddr)(uintptr_t)buf,
+        .size = size - 1,
+        .perm = write ? IOMMU_RW : IOMMU_RO,
+    };
+    Error *err = NULL;
+
+    if (!vhost_vdpa_svq_map_region(v, &map, &err)) {
+        error_report_err(err);
+        return -ENOMEM;
+    }
+
+    return 0;
+}
+
+void vhost_vdpa_svq_unmap_buf(struct vhost_vdpa *v, void *buf)
+{
+    vhost_vdpa_svq_unmap_region(v, (hwaddr)(uintptr_t)buf);
+}
+
+static void vhost_vdpa_svq_unmap_rings(struct vhost_dev *dev,
+                                       const VhostShadowVirtqueue *svq)
+{
+    struct vhost_vdpa *v = dev->opaque;
+    struct vhost_vring_addr svq_addr;
+
+    vhost_svq_get_vring_addr(svq, &svq_addr);
+    vhost_vdpa_svq_unmap_region(v, svq_addr.desc_user_addr);
+    vhost_vdpa_svq_unmap_region(v, svq_addr.used_user_addr);
+}
+
+/*
+ * Map the shadow virtqueue rings to the device, and fill @addr with their
+ * IOVA.
+ */
+static bool vhost_vdpa_svq_map_rings(struct vhost_dev *dev,
+                                     const VhostShadowVirtqueue *svq,
+                                     struct vhost_vring_addr *addr,
+                                     Error **errp)
+{
+    struct vhost_vdpa *v = dev->opaque;
+    size_t device_size = vhost_svq_device_area_size(svq);
+    size_t driver_size = vhost_svq_driver_area_size(svq);
+    struct vhost_vring_addr svq_addr;
+    DMAMap driver_region, device_region;
+
+    vhost_svq_get_vring_addr(svq, &svq_addr);
+
+    driver_region = (DMAMap) {
+        .translated_addr = svq_addr.desc_user_addr,
+        .size = driver_size - 1,
+        .perm = IOMMU_RO,
+    };
+    if (!vhost_vdpa_svq_map_region(v, &driver_region, errp)) {
+        return false;
+    }
+    addr->desc_user_addr = driver_region.iova;
+    addr->avail_user_addr = driver_region.iova + svq_addr.avail_user_addr -
+                            svq_addr.desc_user_addr;
+
+    device_region = (DMAMap) {
+        .translated_addr = svq_addr.used_user_addr,
+        .size = device_size - 1,
+        .perm = IOMMU_RW,
+    };
+    if (!vhost_vdpa_svq_map_region(v, &device_region, errp)) {
+        vhost_vdpa_svq_unmap_region(v, svq_addr.desc_user_addr);
+        return false;
+    }
+    addr->used_user_addr = device_region.iova;
+
+    return true;
+}
+
+/* Point the device virtqueue @idx of @dev to its shadow virtqueue */
+static bool vhost_vdpa_svq_setup(struct vhost_dev *dev,
+                                 VhostShadowVirtqueue *svq, unsigned idx,
+                                 Error **errp)
+{
+    uint16_t vq_index = dev->vq_index + idx;
+    struct vhost_vring_state s = {
+        .index = vq_index,
+    };
+    struct vhost_vring_addr addr = {
+        .index = vq_index,
+    };
+    struct vhost_vring_file file = {
+        .index = vq_index,
+    };
+    int r;
+
+    r = vhost_vdpa_call(dev, VHOST_SET_VRING_BASE, &s);
+    if (unlikely(r)) {
+        error_setg_errno(errp, -r, "Cannot set vring base");
+        return false;
+    }
+
+    if (!vhost_vdpa_svq_map_rings(dev, svq, &addr, errp)) {
+        return false;
+    }
+
+    r = vhost_vdpa_set_vring_dev_addr(dev, &addr);
+    if (unlikely(r)) {
+        error_setg_errno(errp, -r, "Cannot set device address");
+        goto err;
+    }
+
+    file.fd = event_notifier_get_fd(&svq->hdev_kick);
+    r = vhost_vdpa_set_vring_dev_kick(dev, &file);
+    if (unlikely(r)) {
+        error_setg_errno(errp, -r, "Can't set device kick fd");
+        goto err;
+    }
+
+    file.fd = event_notifier_get_fd(&svq->hdev_call);
+    r = vhost_vdpa_set_vring_dev_call(dev, &file);
+    if (unlikely(r)) {
+        error_setg_errno(errp, -r, "Can't set device call fd");
+        goto err;
+    }
+
+    return true;
+
+err:
+    vhost_vdpa_svq_unmap_rings(dev, svq);
+    return false;
+}
+
+static bool vhost_vdpa_svqs_start(struct vhost_dev *dev)
+{
+    struct vhost_vdpa *v = dev->opaque;
+    VhostShadowVirtqueue *svq;
+    Error *err = NULL;
+    unsigned i;
+
+    if (!v->shadow_vqs_enabled) {
+        return true;
+    }
+
+    for (i = 0; i < v->shadow_vqs->len; ++i) {
+        VirtQueue *vq = virtio_get_queue(dev->vdev, dev->vq_index + i);
+
+        if (virtio_queue_get_desc_addr(dev->vdev, dev->vq_index + i) == 0) {
+            /* Queue might not be ready for start */
+            continue;
+        }
+
+        svq = g_ptr_array_index(v->shadow_vqs, i);
+        vhost_svq_start(svq, dev->vdev, vq);
+        if (unlikely(!vhost_vdpa_svq_setup(dev, svq, i, &err))) {
+            vhost_svq_stop(svq);
+            goto err;
+        }
+    }
+
+    return true;
+
+err:
+    error_reportf_err(err, "Cannot setup SVQ %u: ", i);
+    while (i--) {
+        svq = g_ptr_array_index(v->shadow_vqs, i);
+        if (svq->vq) {
+            vhost_vdpa_svq_unmap_rings(dev, svq);
+            vhost_svq_stop(svq);
+        }
+    }
+
+    return false;
+}
+
+static void vhost_vdpa_svqs_stop(struct vhost_dev *dev)
+{
+    struct vhost_vdpa *v = dev->opaque;
+    unsigned i;
+
+    if (!v->shadow_vqs_enabled) {
+        return;
+    }
+
+    for (i = 0; i < v->shadow_vqs->len; ++i) {
+        VhostShadowVirtqueue *svq = g_ptr_array_index(v->shadow_vqs, i);
+
+        if (!svq->vq) {
+            continue;
+        }
+        vhost_vdpa_svq_unmap_rings(dev, svq);
+        vhost_svq_stop(svq);
+    }
+}
+
 static int vhost_vdpa_dev_start(struct vhost_dev *dev, bool started)
 {
     struct vhost_vdpa *v = dev->opaque;
+
     trace_vhost_vdpa_dev_start(dev, started);
+
     if (started) {
-        uint8_t status = 0;
-        memory_listener_register(&v->listener, &address_space_memory);
         vhost_vdpa_host_notifiers_init(dev);
+        if (!vhost_vdpa_svqs_start(dev)) {
+            vhost_vdpa_host_notifiers_uninit(dev, dev->nvqs);
+            return -1;
+        }
         vhost_vdpa_set_vring_ready(dev);
-        vhost_vdpa_add_status(dev, VIRTIO_CONFIG_S_DRIVER_OK);
-        vhost_vdpa_call(dev, VHOST_VDPA_GET_STATUS, &status);
-
-        return !(status & VIRTIO_CONFIG_S_DRIVER_OK);
     } else {
-        vhost_vdpa_reset_device(dev);
-        vhost_vdpa_add_status(dev, VIRTIO_CONFIG_S_ACKNOWLEDGE |
-                                   VIRTIO_CONFIG_S_DRIVER);
+        if (dev->vq_index == 0) {
+            /*
+             * vDPA cannot suspend the device: reset it before the first
+             * vhost_dev stops, so it doesn't use the rings of the ones
+             * that stop next.
+             */
+            vhost_vdpa_reset_device(dev);
+            vhost_vdpa_add_status(dev, VIRTIO_CONFIG_S_ACKNOWLEDGE |
+                                       VIRTIO_CONFIG_S_DRIVER);
+        }
+        vhost_vdpa_svqs_stop(dev);
         vhost_vdpa_host_notifiers_uninit(dev, dev->nvqs);
-        memory_listener_unregister(&v->listener);
+    }
+
+    if (dev->vq_index + dev->nvqs != dev->vq_index_end) {
+        /* The device starts and stops with the last vhost_dev */
+        return 0;
+    }
 
+    if (started) {
+        memory_listener_register(&v->listener, &address_space_memory);
+        return vhost_vdpa_add_status(dev, VIRTIO_CONFIG_S_DRIVER_OK);
+    } else {
+        memory_listener_unregister(&v->listener);
         return 0;
     }
 }
@@ -581,6 +1068,13 @@ static int vhost_vdpa_dev_start(struct vhost_dev *dev, bool started)
 static int vhost_vdpa_set_log_base(struct vhost_dev *dev, uint64_t base,
                                      struct vhost_log *log)
 {
+    struct vhost_vdpa *v = dev->opaque;
+
+    if (v->shadow_vqs_capable) {
+        /* The shadow virtqueues track the dirty memory */
+        return 0;
+    }
+
     trace_vhost_vdpa_set_log_base(dev, base, log->size, log->refcnt, log->fd,
                                   log->log);
     return vhost_vdpa_call(dev, VHOST_SET_LOG_BASE, &base);
@@ -589,11 +1083,17 @@ static int vhost_vdpa_set_log_base(struct vhost_dev *dev, uint64_t base,
 static int vhost_vdpa_set_vring_addr(struct vhost_dev *dev,
                                        struct vhost_vring_addr *addr)
 {
-    trace_vhost_vdpa_set_vring_addr(dev, addr->index, addr->flags,
-                                    addr->desc_user_addr, addr->used_user_addr,
-                                    addr->avail_user_addr,
-                                    addr->log_guest_addr);
-    return vhost_vdpa_call(dev, VHOST_SET_VRING_ADDR, addr);
+    struct vhost_vdpa *v = dev->opaque;
+
+    if (v->shadow_vqs_enabled) {
+        /*
+         * Device vring addr was set at device start. SVQ base is handled by
+         * VirtQueue code.
+         */
+        return 0;
+    }
+
+    return vhost_vdpa_set_vring_dev_addr(dev, addr);
 }
 
 static int vhost_vdpa_set_vring_num(struct vhost_dev *dev,
@@ -606,6 +1106,16 @@ static int vhost_vdpa_set_vring_num(struct vhost_dev *dev,
 static int vhost_vdpa_set_vring_base(struct vhost_dev *dev,
                                        struct vhost_vring_state *ring)
 {
+    struct vhost_vdpa *v = dev->opaque;
+
+    if (v->shadow_vqs_enabled) {
+        /*
+         * Device vring base was set at device start. SVQ base is handled by
+         * VirtQueue code.
+         */
+        return 0;
+    }
+
     trace_vhost_vdpa_set_vring_base(dev, ring->index, ring->num);
     return vhost_vdpa_call(dev, VHOST_SET_VRING_BASE, ring);
 }
@@ -613,39 +1123,78 @@ static int vhost_vdpa_set_vring_base(struct vhost_dev *dev,
 static int vhost_vdpa_get_vring_base(struct vhost_dev *dev,
                                        struct vhost_vring_state *ring)
 {
-    int ret;
+    struct vhost_vdpa *v = dev->opaque;
 
-    ret = vhost_vdpa_call(dev, VHOST_GET_VRING_BASE, ring);
+    /*
+     * The device was reset when the first vhost_dev stopped, and vDPA has
+     * no way to suspend it before, so its avail index is gone.  Without
+     * in-flight buffers, the used index tells where it stopped.  The shadow
+     * virtqueues already gave their in-flight buffers back to the guest
+     * virtqueue, so its avail index is right as is.
+     */
+    if (!v->shadow_vqs_enabled) {
+        virtio_queue_restore_last_avail_idx(dev->vdev, ring->index);
+    }
+    ring->num = virtio_queue_get_last_avail_idx(dev->vdev, ring->index);
     trace_vhost_vdpa_get_vring_base(dev, ring->index, ring->num);
-    return ret;
+    return 0;
 }
 
 static int vhost_vdpa_set_vring_kick(struct vhost_dev *dev,
                                        struct vhost_vring_file *file)
 {
-    trace_vhost_vdpa_set_vring_kick(dev, file->index, file->fd);
-    return vhost_vdpa_call(dev, VHOST_SET_VRING_KICK, file);
+    struct vhost_vdpa *v = dev->opaque;
+    int vdpa_idx = file->index - dev->vq_index;
+
+    if (v->shadow_vqs_enabled) {
+        VhostShadowVirtqueue *svq = g_ptr_array_index(v->shadow_vqs, vdpa_idx);
+        vhost_svq_set_svq_kick_fd(svq, file->fd);
+        return 0;
+    } else {
+        return vhost_vdpa_set_vring_dev_kick(dev, file);
+    }
 }
 
 static int vhost_vdpa_set_vring_call(struct vhost_dev *dev,
                                        struct vhost_vring_file *file)
 {
-    trace_vhost_vdpa_set_vring_call(dev, file->index, file->fd);
-    return vhost_vdpa_call(dev, VHOST_SET_VRING_CALL, file);
+    struct vhost_vdpa *v = dev->opaque;
+    int vdpa_idx = file->index - dev->vq_index;
+
+    if (v->shadow_vqs_enabled) {
+        VhostShadowVirtqueue *svq = g_ptr_array_index(v->shadow_vqs, vdpa_idx);
+        vhost_svq_set_svq_call_fd(svq, file->fd);
+        return 0;
+    } else {
+        return vhost_vdpa_set_vring_dev_call(dev, file);
+    }
 }
 
 static int vhost_vdpa_get_features(struct vhost_dev *dev,
                                      uint64_t *features)
 {
+    struct vhost_vdpa *v = dev->opaque;
     int ret;
 
     ret = vhost_vdpa_call(dev, VHOST_GET_FEATURES, features);
+    if (ret == 0 && v->shadow_vqs_capable) {
+        /*
+         * The device migrates through shadow virtqueues, which track the
+         * dirty memory and only know about split rings.
+         */
+        *features |= BIT_ULL(VHOST_F_LOG_ALL);
+        *features &= ~BIT_ULL(VIRTIO_F_RING_PACKED);
+    }
     trace_vhost_vdpa_get_features(dev, *features);
     return ret;
 }
 
 static int vhost_vdpa_set_owner(struct vhost_dev *dev)
 {
+    if (vhost_vdpa_one_time_request(dev)) {
+        return 0;
+    }
+
     trace_vhost_vdpa_set_owner(dev);
     return vhost_vdpa_call(dev, VHOST_SET_OWNER, NULL);
 }
@@ -125,6 +125,24 @@ static gint interval_cmp(gconstpointer a, gconstpointer b, gpointer user_data)
     }
 }
 
+/* Drop the translations cached for all the endpoints */
+static void virtio_iommu_flush_iotlb_caches(VirtIOIOMMU *s)
+{
+    GHashTableIter iter;
+    IOMMUPciBus *iommu_pci_bus;
+    int i;
+
+    g_hash_table_iter_init(&iter, s->as_by_busptr);
+    while (g_hash_table_iter_next(&iter, NULL, (void **)&iommu_pci_bus)) {
+        for (i = 0; i < PCI_DEVFN_MAX; i++) {
+            if (iommu_pci_bus->pbdev[i]) {
+                memory_region_iommu_flush_iotlb_cache(
+                    &iommu_pci_bus->pbdev[i]->iommu_mr);
+            }
+        }
+    }
+}
+
 static void virtio_iommu_notify_map(IOMMUMemoryRegion *mr, hwaddr virt_start,
                                     hwaddr virt_end, hwaddr paddr,
                                     uint32_t flags)
@@ -321,6 +339,7 @@ static AddressSpace *virtio_iommu_find_add_as(PCIBus *bus, void *opaque,
                                  TYPE_VIRTIO_IOMMU_MEMORY_REGION,
                                  OBJECT(s), name,
                                  UINT64_MAX);
+        memory_region_iommu_enable_iotlb_cache(&sdev->iommu_mr, &error_abort);
         address_space_init(&sdev->as,
                            MEMORY_REGION(&sdev->iommu_mr), TYPE_VIRTIO_IOMMU);
         g_free(name);
@@ -360,6 +379,12 @@ static int virtio_iommu_attach(VirtIOIOMMU *s,
 
     ep->domain = domain;
 
+    /*
+     * Translations that bypassed the IOMMU while the endpoint was not
+     * attached are not covered by any unmap notification.
+     */
+    memory_region_iommu_flush_iotlb_cache(ep->iommu_mr);
+
     /* Replay domain mappings on the associated memory region */
     g_tree_foreach(domain->mappings, virtio_iommu_notify_map_cb,
                    ep->iommu_mr);
@@ -1042,6 +1067,8 @@ static void virtio_iommu_device_reset(VirtIODevice *vdev)
                                  NULL, NULL, virtio_iommu_put_domain);
     s->endpoints = g_tree_new_full((GCompareDataFunc)int_cmp,
                                    NULL, NULL, virtio_iommu_put_endpoint);
+    /* The bypass feature may change after reset */
+    virtio_iommu_flush_iotlb_caches(s);
 }
 
 static void virtio_iommu_set_status(VirtIODevice *vdev, uint8_t status)
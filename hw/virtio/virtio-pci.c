@@ -28,6 +28,8 @@
 #include "qapi/error.h"
 #include "qemu/error-report.h"
 #include "qemu/log.h"
+#include "qemu/lockable.h"
+#include "qemu/main-loop.h"
 #include "qemu/module.h"
 #include "hw/pci/msi.h"
 #include "hw/pci/msix.h"
@@ -245,6 +247,10 @@ static int virtio_pci_ioeventfd_assign(DeviceState *d, EventNotifier *notifier,
                          virtio_get_queue_index(vq);
     hwaddr legacy_addr = VIRTIO_PCI_QUEUE_NOTIFY;
 
+    WITH_QEMU_LOCK_GUARD(&proxy->notify_lock) {
+        proxy->vqs[n].notifier = assign ? notifier : NULL;
+    }
+
     if (assign) {
         if (modern) {
             if (fast_mmio) {
@@ -1370,30 +1376,47 @@ static uint64_t virtio_pci_notify_read(void *opaque, hwaddr addr,
     return 0;
 }
 
-static void virtio_pci_notify_write(void *opaque, hwaddr addr,
-                                    uint64_t val, unsigned size)
+/*
+ * Called without the BQL.  A kick only needs to signal the ioeventfd of
+ * the queue, if there is one; otherwise the virtqueue is processed under
+ * the BQL.
+ */
+static void virtio_pci_notify(VirtIOPCIProxy *proxy, unsigned queue)
 {
-    VirtIOPCIProxy *proxy = opaque;
-    VirtIODevice *vdev = virtio_bus_get_device(&proxy->bus);
+    VirtIODevice *vdev;
+
+    if (queue >= VIRTIO_QUEUE_MAX) {
+        return;
+    }
 
-    unsigned queue = addr / virtio_pci_queue_mem_mult(proxy);
+    WITH_QEMU_LOCK_GUARD(&proxy->notify_lock) {
+        if (proxy->vqs[queue].notifier) {
+            event_notifier_set(proxy->vqs[queue].notifier);
+            return;
+        }
+    }
 
-    if (vdev != NULL && queue < VIRTIO_QUEUE_MAX) {
+    QEMU_IOTHREAD_LOCK_GUARD();
+    vdev = virtio_bus_get_device(&proxy->bus);
+    if (vdev != NULL) {
         virtio_queue_notify(vdev, queue);
     }
 }
 
+static void virtio_pci_notify_write(void *opaque, hwaddr addr,
+                                    uint64_t val, unsigned size)
+{
+    VirtIOPCIProxy *proxy = opaque;
+
+    virtio_pci_notify(proxy, addr / virtio_pci_queue_mem_mult(proxy));
+}
+
 static void virtio_pci_notify_write_pio(void *opaque, hwaddr addr,
                                         uint64_t val, unsigned size)
 {
     VirtIOPCIProxy *proxy = opaque;
-    VirtIODevice *vdev = virtio_bus_get_device(&proxy->bus);
-
-    unsigned queue = val;
 
-    if (vdev != NULL && queue < VIRTIO_QUEUE_MAX) {
-        virtio_queue_notify(vdev, queue);
-    }
+    virtio_pci_notify(proxy, val);
 }
 
 static uint64_t virtio_pci_isr_read(void *opaque, hwaddr addr,
@@ -1552,6 +1575,9 @@ static void virtio_pci_modern_regions_init(VirtIOPCIProxy *proxy,
                           proxy,
                           name->str,
                           proxy->notify_pio.size);
+
+    memory_region_clear_global_locking(&proxy->notify.mr);
+    memory_region_clear_global_locking(&proxy->notify_pio.mr);
 }
 
 static void virtio_pci_modern_region_map(VirtIOPCIProxy *proxy,
@@ -2022,10 +2048,26 @@ static void virtio_pci_class_init(ObjectClass *klass, void *data)
     dc->reset = virtio_pci_reset;
 }
 
+static void virtio_pci_instance_init(Object *obj)
+{
+    VirtIOPCIProxy *proxy = VIRTIO_PCI(obj);
+
+    qemu_mutex_init(&proxy->notify_lock);
+}
+
+static void virtio_pci_instance_finalize(Object *obj)
+{
+    VirtIOPCIProxy *proxy = VIRTIO_PCI(obj);
+
+    qemu_mutex_destroy(&proxy->notify_lock);
+}
+
 static const TypeInfo virtio_pci_info = {
     .name          = TYPE_VIRTIO_PCI,
     .parent        = TYPE_PCI_DEVICE,
     .instance_size = sizeof(VirtIOPCIProxy),
+    .instance_init = virtio_pci_instance_init,
+    .instance_finalize = virtio_pci_instance_finalize,
     .class_init    = virtio_pci_class_init,
     .class_size    = sizeof(VirtioPCIClass),
     .abstract      = true,
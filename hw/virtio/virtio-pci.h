@@ -120,6 +120,8 @@ typedef struct VirtIOPCIQueue {
   uint32_t desc[2];
   uint32_t avail[2];
   uint32_t used[2];
+  /* The ioeventfd of the queue, protected by notify_lock */
+  EventNotifier *notifier;
 } VirtIOPCIQueue;
 
 struct VirtIOPCIProxy {
@@ -152,6 +154,8 @@ struct VirtIOPCIProxy {
     uint32_t gfselect;
     uint32_t guest_features[2];
     VirtIOPCIQueue vqs[VIRTIO_QUEUE_MAX];
+    /* The notification regions run without the BQL */
+    QemuMutex notify_lock;
 
     VirtIOIRQFD *vector_irqfd;
     int nvqs_with_notifiers;
@@ -12,6 +12,7 @@
  */
 
 #include "qemu/osdep.h"
+#include "qemu/units.h"
 #include "qapi/error.h"
 #include "cpu.h"
 #include "trace.h"
@@ -27,6 +28,7 @@
 #include "hw/virtio/virtio-access.h"
 #include "sysemu/dma.h"
 #include "sysemu/runstate.h"
+#include "sysemu/xen.h"
 #include "standard-headers/linux/virtio_ids.h"
 
 /*
@@ -71,11 +73,28 @@ typedef struct VRingUsed
     VRingUsedElem ring[];
 } VRingUsed;
 
+#define VRING_MAP_WINDOWS       4
+#define VRING_MAP_WINDOW_ALIGN  (2 * MiB)
+#define VRING_MAP_WINDOW_SIZE   (1 * GiB)
+
+/*
+ * Guest RAM recently used for indirect descriptor tables and buffers.
+ * A window is clamped to the RAM section that contains its start, so
+ * usually a few windows cover all the buffers of a queue.
+ */
+typedef struct VRingMapWindow {
+    hwaddr addr;
+    MemoryRegionCache cache;
+} VRingMapWindow;
+
 typedef struct VRingMemoryRegionCaches {
     struct rcu_head rcu;
     MemoryRegionCache desc;
     MemoryRegionCache avail;
     MemoryRegionCache used;
+    /* Only used by the thread that processes the queue */
+    VRingMapWindow windows[VRING_MAP_WINDOWS];
+    unsigned int next_window;
 } VRingMemoryRegionCaches;
 
 typedef struct VRing
@@ -136,10 +155,15 @@ struct VirtQueue
 /* Called within call_rcu().  */
 static void virtio_free_region_cache(VRingMemoryRegionCaches *caches)
 {
+    int i;
+
     assert(caches != NULL);
     address_space_cache_destroy(&caches->desc);
     address_space_cache_destroy(&caches->avail);
     address_space_cache_destroy(&caches->used);
+    for (i = 0; i < VRING_MAP_WINDOWS; i++) {
+        address_space_cache_destroy(&caches->windows[i].cache);
+    }
     g_free(caches);
 }
 
@@ -284,6 +308,75 @@ static VRingMemoryRegionCaches *vring_get_region_caches(struct VirtQueue *vq)
     return qatomic_rcu_read(&vq->vring.caches);
 }
 
+/*
+ * Return a window of @caches that may contain @addr, mapping a new one
+ * if none of them starts at or below it.  The caller still has to check
+ * the end of the range.  Windows are only used when the rings are in
+ * RAM, which excludes vIOMMUs, and only map RAM that contains @addr.
+ */
+static VRingMapWindow *vring_map_window_find(VirtIODevice *vdev,
+                                             VRingMemoryRegionCaches *caches,
+                                             hwaddr addr, hwaddr len)
+{
+    MemoryRegionSection section;
+    VRingMapWindow *w;
+    hwaddr start;
+    bool direct;
+    int i;
+
+    if (!caches->desc.ptr || xen_enabled()) {
+        return NULL;
+    }
+
+    for (i = 0; i < VRING_MAP_WINDOWS; i++) {
+        w = &caches->windows[i];
+        if (w->cache.mrs.mr && addr >= w->addr &&
+            addr - w->addr < w->cache.len &&
+            len <= w->cache.len - (addr - w->addr)) {
+            return w;
+        }
+    }
+
+    /*
+     * Do not let the aligned start fall in a hole or another region below
+     * @addr, and do not evict a window for something that is not RAM.
+     */
+    section = memory_region_find(vdev->dma_as->root, addr, 1);
+    if (!section.mr) {
+        return NULL;
+    }
+    direct = memory_access_is_direct(section.mr, true);
+    start = MAX(QEMU_ALIGN_DOWN(addr, VRING_MAP_WINDOW_ALIGN),
+                section.offset_within_address_space);
+    memory_region_unref(section.mr);
+    if (!direct) {
+        return NULL;
+    }
+
+    w = &caches->windows[caches->next_window];
+    caches->next_window = (caches->next_window + 1) % VRING_MAP_WINDOWS;
+    address_space_cache_destroy(&w->cache);
+    w->addr = start;
+    address_space_cache_init(&w->cache, vdev->dma_as, w->addr,
+                             VRING_MAP_WINDOW_SIZE, true);
+    return w;
+}
+
+/* Prepare @indirect to read an indirect descriptor table */
+static int64_t vring_indirect_cache_init(VirtIODevice *vdev,
+                                         VRingMemoryRegionCaches *caches,
+                                         MemoryRegionCache *indirect,
+                                         hwaddr addr, hwaddr len)
+{
+    VRingMapWindow *w = vring_map_window_find(vdev, caches, addr, len);
+
+    if (w && addr >= w->addr &&
+        address_space_cache_slice(indirect, &w->cache, addr - w->addr, len)) {
+        return len;
+    }
+    return address_space_cache_init(indirect, vdev->dma_as, addr, len, false);
+}
+
 /* Called within rcu_read_lock().  */
 static inline uint16_t vring_avail_flags(VirtQueue *vq)
 {
@@ -1034,9 +1127,9 @@ static void virtqueue_split_get_avail_bytes(VirtQueue *vq,
             }
 
             /* loop over the indirect descriptor table */
-            len = address_space_cache_init(&indirect_desc_cache,
-                                           vdev->dma_as,
-                                           desc.addr, desc.len, false);
+            len = vring_indirect_cache_init(vdev, caches,
+                                            &indirect_desc_cache,
+                                            desc.addr, desc.len);
             desc_cache = &indirect_desc_cache;
             if (len < desc.len) {
                 virtio_error(vdev, "Cannot map indirect buffer");
@@ -1175,9 +1268,9 @@ static void virtqueue_packed_get_avail_bytes(VirtQueue *vq,
             }
 
             /* loop over the indirect descriptor table */
-            len = address_space_cache_init(&indirect_desc_cache,
-                                           vdev->dma_as,
-                                           desc.addr, desc.len, false);
+            len = vring_indirect_cache_init(vdev, caches,
+                                            &indirect_desc_cache,
+                                            desc.addr, desc.len);
             desc_cache = &indirect_desc_cache;
             if (len < desc.len) {
                 virtio_error(vdev, "Cannot map indirect buffer");
@@ -1293,7 +1386,9 @@ int virtqueue_avail_bytes(VirtQueue *vq, unsigned int in_bytes,
     return in_bytes <= in_total && out_bytes <= out_total;
 }
 
-static bool virtqueue_map_desc(VirtIODevice *vdev, unsigned int *p_num_sg,
+static bool virtqueue_map_desc(VirtIODevice *vdev,
+                               VRingMemoryRegionCaches *caches,
+                               unsigned int *p_num_sg,
                                hwaddr *addr, struct iovec *iov,
                                unsigned int max_num_sg, bool is_write,
                                hwaddr pa, size_t sz)
@@ -1309,6 +1404,7 @@ static bool virtqueue_map_desc(VirtIODevice *vdev, unsigned int *p_num_sg,
 
     while (sz) {
         hwaddr len = sz;
+        VRingMapWindow *w;
 
         if (num_sg == max_num_sg) {
             virtio_error(vdev, "virtio: too many write descriptors in "
@@ -1316,10 +1412,20 @@ static bool virtqueue_map_desc(VirtIODevice *vdev, unsigned int *p_num_sg,
             goto out;
         }
 
-        iov[num_sg].iov_base = dma_memory_map(vdev->dma_as, pa, &len,
-                                              is_write ?
-                                              DMA_DIRECTION_FROM_DEVICE :
-                                              DMA_DIRECTION_TO_DEVICE);
+        w = vring_map_window_find(vdev, caches, pa, len);
+        if (w && pa >= w->addr) {
+            iov[num_sg].iov_base = address_space_map_cached(&w->cache,
+                                                            pa - w->addr, len,
+                                                            is_write);
+        } else {
+            iov[num_sg].iov_base = NULL;
+        }
+        if (!iov[num_sg].iov_base) {
+            iov[num_sg].iov_base = dma_memory_map(vdev->dma_as, pa, &len,
+                                                  is_write ?
+                                                  DMA_DIRECTION_FROM_DEVICE :
+                                                  DMA_DIRECTION_TO_DEVICE);
+        }
         if (!iov[num_sg].iov_base) {
             virtio_error(vdev, "virtio: bogus descriptor or out of resources");
             goto out;
@@ -1472,8 +1578,8 @@ static void *virtqueue_split_pop(VirtQueue *vq, size_t sz)
         }
 
         /* loop over the indirect descriptor table */
-        len = address_space_cache_init(&indirect_desc_cache, vdev->dma_as,
-                                       desc.addr, desc.len, false);
+        len = vring_indirect_cache_init(vdev, caches, &indirect_desc_cache,
+                                        desc.addr, desc.len);
         desc_cache = &indirect_desc_cache;
         if (len < desc.len) {
             virtio_error(vdev, "Cannot map indirect buffer");
@@ -1490,7 +1596,7 @@ static void *virtqueue_split_pop(VirtQueue *vq, size_t sz)
         bool map_ok;
 
         if (desc.flags & VRING_DESC_F_WRITE) {
-            map_ok = virtqueue_map_desc(vdev, &in_num, addr + out_num,
+            map_ok = virtqueue_map_desc(vdev, caches, &in_num, addr + out_num,
                                         iov + out_num,
                                         VIRTQUEUE_MAX_SIZE - out_num, true,
                                         desc.addr, desc.len);
@@ -1499,7 +1605,7 @@ static void *virtqueue_split_pop(VirtQueue *vq, size_t sz)
                 virtio_error(vdev, "Incorrect order for descriptors");
                 goto err_undo_map;
             }
-            map_ok = virtqueue_map_desc(vdev, &out_num, addr, iov,
+            map_ok = virtqueue_map_desc(vdev, caches, &out_num, addr, iov,
                                         VIRTQUEUE_MAX_SIZE, false,
                                         desc.addr, desc.len);
         }
@@ -1600,8 +1706,8 @@ static void *virtqueue_packed_pop(VirtQueue *vq, size_t sz)
         }
 
         /* loop over the indirect descriptor table */
-        len = address_space_cache_init(&indirect_desc_cache, vdev->dma_as,
-                                       desc.addr, desc.len, false);
+        len = vring_indirect_cache_init(vdev, caches, &indirect_desc_cache,
+                                        desc.addr, desc.len);
         desc_cache = &indirect_desc_cache;
         if (len < desc.len) {
             virtio_error(vdev, "Cannot map indirect buffer");
@@ -1618,7 +1724,7 @@ static void *virtqueue_packed_pop(VirtQueue *vq, size_t sz)
         bool map_ok;
 
         if (desc.flags & VRING_DESC_F_WRITE) {
-            map_ok = virtqueue_map_desc(vdev, &in_num, addr + out_num,
+            map_ok = virtqueue_map_desc(vdev, caches, &in_num, addr + out_num,
                                         iov + out_num,
                                         VIRTQUEUE_MAX_SIZE - out_num, true,
                                         desc.addr, desc.len);
@@ -1627,7 +1733,7 @@ static void *virtqueue_packed_pop(VirtQueue *vq, size_t sz)
                 virtio_error(vdev, "Incorrect order for descriptors");
                 goto err_undo_map;
             }
-            map_ok = virtqueue_map_desc(vdev, &out_num, addr, iov,
+            map_ok = virtqueue_map_desc(vdev, caches, &out_num, addr, iov,
                                         VIRTQUEUE_MAX_SIZE, false,
                                         desc.addr, desc.len);
         }
@@ -2514,7 +2620,7 @@ static bool virtio_packed_should_notify(VirtIODevice *vdev, VirtQueue *vq)
 }
 
 /* Called within rcu_read_lock().  */
-static bool virtio_should_notify(VirtIODevice *vdev, VirtQueue *vq)
+bool virtio_should_notify(VirtIODevice *vdev, VirtQueue *vq)
 {
     if (virtio_vdev_has_feature(vdev, VIRTIO_F_RING_PACKED)) {
         return virtio_packed_should_notify(vdev, vq);
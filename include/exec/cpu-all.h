@@ -270,6 +270,12 @@ extern intptr_t qemu_host_page_mask;
 /* Target-specific bits that will be used via page_get_flags().  */
 #define PAGE_TARGET_1  0x0200
 #define PAGE_TARGET_2  0x0400
+/*
+ * For use with tlb_set_page_with_attrs: the mapping is the same in all
+ * address spaces, and survives tlb_set_asid_by_mmuidx() and
+ * tlb_flush_asid_by_mmuidx().
+ */
+#define PAGE_GLOBAL    0x0800
 
 #if defined(CONFIG_USER_ONLY)
 void page_dump(FILE *f);
@@ -88,6 +88,29 @@ typedef uint64_t target_ulong;
 #define CPU_TLB_DYN_MIN_BITS 6
 #define CPU_TLB_DYN_DEFAULT_BITS 8
 
+/*
+ * The second-level tlb is 4-way set associative, with 2**4 to 2**10 sets,
+ * i.e. 64 to 4096 entries.
+ */
+#define CPU_TLB_L2_WAYS 4
+#define CPU_TLB_L2_MIN_BITS 4
+#define CPU_TLB_L2_DEFAULT_BITS 6
+#define CPU_TLB_L2_MAX_BITS 10
+
+/*
+ * Second-level tlb entries are tagged with the address space they belong
+ * to.  These tags are for global mappings, which belong to all address
+ * spaces, and for entries filled while the address space is not known.
+ */
+#define CPU_TLB_ASID_GLOBAL UINT32_MAX
+#define CPU_TLB_ASID_UNKNOWN (UINT32_MAX - 1)
+
+/* The number of large pages per MMU mode that fill misses without a walk */
+#define CPU_TLB_LARGE_SIZE 8
+
+/* The number of page tables per MMU mode that shorten guest page walks */
+#define CPU_TLB_WALK_SIZE 8
+
 # if HOST_LONG_BITS == 32
 /* Make sure we do not require a double-word shift for the TLB load */
 #  define CPU_TLB_DYN_MAX_BITS (32 - TARGET_PAGE_BITS)
@@ -150,6 +173,45 @@ typedef struct CPUIOTLBEntry {
     MemTxAttrs attrs;
 } CPUIOTLBEntry;
 
+/*
+ * A large page mapped by tlb_set_large_page_with_attrs().  Every page
+ * within it translates like the one that was filled, so a miss there
+ * installs a new entry without calling tlb_fill.
+ */
+typedef struct CPUTLBLargePage {
+    /* The virtual address of the large page, -1 if unused */
+    target_ulong vaddr;
+    /* The mask of the large page, i.e. ~(size - 1) */
+    target_ulong mask;
+    hwaddr paddr;
+    MemTxAttrs attrs;
+    int prot;
+    /* The address space, as for the second-level entries */
+    uint32_t asid;
+} CPUTLBLargePage;
+
+/*
+ * The last-level page table that translates a range of virtual
+ * addresses, as found by a guest page walk.  Like the paging-structure
+ * caches of hardware, it lets the next walk within the range read the
+ * leaf entry directly.  Recorded by tlb_walk_cache_insert().
+ */
+typedef struct CPUTLBWalkEntry {
+    /*
+     * The virtual address of the range, or -1 if unused, which no
+     * page-aligned address matches whatever the mask and the ASID
+     */
+    target_ulong vaddr;
+    /* The mask of the range, i.e. ~(size - 1) */
+    target_ulong mask;
+    /* The guest physical address of the table */
+    uint64_t table;
+    /* Target-specific attributes gathered by the upper levels */
+    uint64_t attrs;
+    /* The address space, as for the second-level entries */
+    uint32_t asid;
+} CPUTLBWalkEntry;
+
 /*
  * Data elements that are per MMU mode, minus the bits accessed by
  * the TCG fast path.
@@ -175,6 +237,39 @@ typedef struct CPUTLBDesc {
     CPUIOTLBEntry viotlb[CPU_VTLB_SIZE];
     /* The iotlb.  */
     CPUIOTLBEntry *iotlb;
+    /*
+     * The second-level tlb, in two parts.  Every fill is also recorded
+     * here, and misses in the victim tlb look it up before walking the
+     * guest page tables.  Set N holds entries N * CPU_TLB_L2_WAYS to
+     * (N + 1) * CPU_TLB_L2_WAYS - 1.
+     */
+    CPUTLBEntry *l2table;
+    CPUIOTLBEntry *l2iotlb;
+    /* The address space of each second-level entry */
+    uint32_t *l2asid;
+    /* The number of sets minus one */
+    size_t l2_mask;
+    /* The next way to replace in a full set */
+    size_t l2_index;
+    /* Fills since the last flush */
+    size_t n_fills;
+    /* maximum number of fills between two flushes observed in the window */
+    size_t window_max_fills;
+    /* The large pages, replaced in turn */
+    CPUTLBLargePage ltable[CPU_TLB_LARGE_SIZE];
+    size_t lindex;
+    /*
+     * The page walk cache, replaced in turn.  Any flush of a page in
+     * this mode empties it.
+     */
+    CPUTLBWalkEntry wtable[CPU_TLB_WALK_SIZE];
+    size_t windex;
+    /*
+     * The address space of the main and victim tlb entries, as set by
+     * tlb_set_asid_by_mmuidx(), or CPU_TLB_ASID_UNKNOWN.  A full flush
+     * resets it to CPU_TLB_ASID_UNKNOWN.
+     */
+    uint32_t asid;
 } CPUTLBDesc;
 
 /*
@@ -208,6 +303,16 @@ typedef struct CPUTLBCommon {
     size_t full_flush_count;
     size_t part_flush_count;
     size_t elide_flush_count;
+    /* Misses in the main tlb, and how they were resolved */
+    size_t miss_count;
+    size_t vtlb_hit_count;
+    size_t l2_hit_count;
+    size_t large_hit_count;
+    size_t walk_hit_count;
+    size_t fill_count;
+    /* Address space switches and flushes */
+    size_t asid_switch_count;
+    size_t asid_flush_count;
 } CPUTLBCommon;
 
 /*
@@ -27,5 +27,21 @@
 void tlb_protect_code(ram_addr_t ram_addr);
 void tlb_unprotect_code(ram_addr_t ram_addr);
 void tlb_flush_counts(size_t *full, size_t *part, size_t *elide);
+
+typedef struct TLBStats {
+    size_t full_flush;
+    size_t part_flush;
+    size_t elide_flush;
+    size_t miss;
+    size_t vtlb_hit;
+    size_t l2_hit;
+    size_t large_hit;
+    size_t walk_hit;
+    size_t fill;
+    size_t asid_switch;
+    size_t asid_flush;
+} TLBStats;
+
+void tlb_cpu_stats(CPUState *cpu, TLBStats *stats);
 #endif
 #endif
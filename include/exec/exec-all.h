@@ -242,6 +242,47 @@ void tlb_flush_by_mmuidx_all_cpus(CPUState *cpu, uint16_t idxmap);
  * depend on when the guests translation ends the TB.
  */
 void tlb_flush_by_mmuidx_all_cpus_synced(CPUState *cpu, uint16_t idxmap);
+/**
+ * tlb_set_asid_by_mmuidx:
+ * @cpu: CPU whose TLB should be switched
+ * @idxmap: bitmap of MMU indexes to switch
+ * @asid: the address space ID that is now in use
+ *
+ * Tell the TLB of the specified CPU that the specified MMU indexes now
+ * translate in the address space @asid, e.g. after a guest context
+ * switch.  Entries of other address spaces stay in the second-level
+ * TLB, and are reused when the guest switches back to them.  Entries
+ * that are mapped with PAGE_GLOBAL are used in all address spaces.
+ *
+ * A full flush of an MMU index forgets its address space, which must
+ * then be set again.  Until it is, the TLB does not know which entries
+ * belong to which address space and the target has to use full flushes
+ * on context switches.
+ */
+void tlb_set_asid_by_mmuidx(CPUState *cpu, uint16_t idxmap, uint16_t asid);
+/**
+ * tlb_flush_asid_by_mmuidx:
+ * @cpu: CPU whose TLB should be flushed
+ * @idxmap: bitmap of MMU indexes to flush
+ * @asid: address space ID to flush
+ *
+ * Flush all entries of the address space @asid from the TLB of the
+ * specified CPU, for the specified MMU indexes.  Entries mapped with
+ * PAGE_GLOBAL are kept.
+ */
+void tlb_flush_asid_by_mmuidx(CPUState *cpu, uint16_t idxmap, uint16_t asid);
+/**
+ * tlb_flush_asid_by_mmuidx_all_cpus_synced:
+ * @cpu: Originating CPU of the flush
+ * @idxmap: bitmap of MMU indexes to flush
+ * @asid: address space ID to flush
+ *
+ * Like tlb_flush_asid_by_mmuidx, but for all CPUs, and the source
+ * vCPU's work is scheduled as safe work like in
+ * tlb_flush_by_mmuidx_all_cpus_synced.
+ */
+void tlb_flush_asid_by_mmuidx_all_cpus_synced(CPUState *cpu, uint16_t idxmap,
+                                              uint16_t asid);
 
 /**
  * tlb_flush_page_bits_by_mmuidx
@@ -292,7 +333,8 @@ void tlb_flush_range_by_mmuidx_all_cpus_synced(CPUState *cpu,
  * @vaddr: virtual address of page to add entry for
  * @paddr: physical address of the page
  * @attrs: memory transaction attributes
- * @prot: access permissions (PAGE_READ/PAGE_WRITE/PAGE_EXEC bits)
+ * @prot: access permissions (PAGE_READ/PAGE_WRITE/PAGE_EXEC bits), and
+ *        PAGE_GLOBAL if the mapping is the same in all address spaces
  * @mmu_idx: MMU index to insert TLB entry for
  * @size: size of the page in bytes
  *
@@ -311,6 +353,28 @@ void tlb_flush_range_by_mmuidx_all_cpus_synced(CPUState *cpu,
 void tlb_set_page_with_attrs(CPUState *cpu, target_ulong vaddr,
                              hwaddr paddr, MemTxAttrs attrs,
                              int prot, int mmu_idx, target_ulong size);
+/**
+ * tlb_set_large_page_with_attrs:
+ * @cpu: CPU to add this TLB entry for
+ * @vaddr: virtual address of page to add entry for
+ * @paddr: physical address of the page
+ * @attrs: memory transaction attributes
+ * @prot: access permissions (PAGE_READ/PAGE_WRITE/PAGE_EXEC bits), and
+ *        PAGE_GLOBAL if the mapping is the same in all address spaces
+ * @mmu_idx: MMU index to insert TLB entry for
+ * @size: size of the page in bytes
+ *
+ * Like tlb_set_page_with_attrs(), but the caller guarantees that all of
+ * the naturally aligned @size bytes around @vaddr map to the physical
+ * addresses around @paddr, with the same @attrs and @prot.  Later misses
+ * within the page add their TLB entries without calling tlb_fill, until
+ * the page is flushed.  The target must not use this function for pages
+ * whose permissions depend on anything but the page table entry that
+ * maps them, unless a change of the other inputs flushes the TLB.
+ */
+void tlb_set_large_page_with_attrs(CPUState *cpu, target_ulong vaddr,
+                                   hwaddr paddr, MemTxAttrs attrs,
+                                   int prot, int mmu_idx, target_ulong size);
 /* tlb_set_page:
  *
  * This function is equivalent to calling tlb_set_page_with_attrs()
@@ -320,6 +384,41 @@ void tlb_set_page_with_attrs(CPUState *cpu, target_ulong vaddr,
 void tlb_set_page(CPUState *cpu, target_ulong vaddr,
                   hwaddr paddr, int prot,
                   int mmu_idx, target_ulong size);
+/**
+ * tlb_walk_cache_insert:
+ * @cpu: CPU whose page walk cache to update
+ * @vaddr: virtual address that was translated
+ * @mmu_idx: MMU index of the page walk
+ * @size: size of the virtual address range that the table translates
+ * @table: guest physical address of the last-level page table
+ * @attrs: target-specific attributes gathered by the upper levels
+ *
+ * Record the last-level page table found by a guest page walk for
+ * @vaddr, so that later walks for addresses within @size bytes of it
+ * can start from @table.  The entry stays valid until a flush of
+ * @mmu_idx, of any page in @mmu_idx, or of the current address space.
+ * The target must record only tables whose upper levels are present and
+ * already have their accessed flags set.
+ *
+ * The cache is looked up without a lock, so only the vCPU thread of @cpu
+ * may use it, from tlb_fill or address translation instructions.  Debug
+ * walks, e.g. from the gdbstub or the monitor, must not.
+ */
+void tlb_walk_cache_insert(CPUState *cpu, target_ulong vaddr, int mmu_idx,
+                           target_ulong size, uint64_t table, uint64_t attrs);
+/**
+ * tlb_walk_cache_lookup:
+ * @cpu: CPU whose page walk cache to look up
+ * @vaddr: virtual address to translate
+ * @mmu_idx: MMU index of the page walk
+ * @table: set to the guest physical address of the last-level page table
+ * @attrs: set to the attributes passed to tlb_walk_cache_insert()
+ *
+ * Return true if the page walk cache holds the last-level page table
+ * for @vaddr.
+ */
+bool tlb_walk_cache_lookup(CPUState *cpu, target_ulong vaddr, int mmu_idx,
+                           uint64_t *table, uint64_t *attrs);
 #else
 static inline void tlb_init(CPUState *cpu)
 {
@@ -372,6 +471,19 @@ static inline void tlb_flush_by_mmuidx_all_cpus_synced(CPUState *cpu,
                                                        uint16_t idxmap)
 {
 }
+static inline void tlb_set_asid_by_mmuidx(CPUState *cpu, uint16_t idxmap,
+                                          uint16_t asid)
+{
+}
+static inline void tlb_flush_asid_by_mmuidx(CPUState *cpu, uint16_t idxmap,
+                                            uint16_t asid)
+{
+}
+static inline void tlb_flush_asid_by_mmuidx_all_cpus_synced(CPUState *cpu,
+                                                            uint16_t idxmap,
+                                                            uint16_t asid)
+{
+}
 static inline void tlb_flush_page_bits_by_mmuidx(CPUState *cpu,
                                                  target_ulong addr,
                                                  uint16_t idxmap,
@@ -559,6 +671,14 @@ struct TranslationBlock {
     uintptr_t jmp_list_head;
     uintptr_t jmp_list_next[2];
     uintptr_t jmp_dest[2];
+
+    /*
+     * Approximate number of executions, incremented by the TB itself
+     * (without atomics, so concurrent vCPUs may lose counts) when it was
+     * translated with tb_exec_count_enabled.  It wraps around after 2^32
+     * executions.
+     */
+    uint32_t exec_count;
 };
 
 /* Hide the qatomic_read to make code a little easier on the eyes */
@@ -34,6 +34,7 @@ static inline AddressSpaceDispatch *address_space_to_dispatch(AddressSpace *as)
 }
 
 FlatView *address_space_get_flatview(AddressSpace *as);
+bool flatview_ref(FlatView *view);
 void flatview_unref(FlatView *view);
 
 extern const MemoryRegionOps unassigned_mem_ops;
@@ -47,6 +48,15 @@ AddressSpaceDispatch *address_space_dispatch_new(FlatView *fv);
 void address_space_dispatch_compact(AddressSpaceDispatch *d);
 void address_space_dispatch_free(AddressSpaceDispatch *d);
 
+bool memory_region_iommu_lookup_iotlb(IOMMUMemoryRegion *iommu_mr,
+                                      hwaddr addr, int iommu_idx,
+                                      bool is_write, IOMMUTLBEntry *iotlb,
+                                      uint64_t *gen);
+void memory_region_iommu_insert_iotlb(IOMMUMemoryRegion *iommu_mr,
+                                      hwaddr addr, int iommu_idx,
+                                      const IOMMUTLBEntry *iotlb,
+                                      uint64_t gen);
+
 void mtree_print_dispatch(struct AddressSpaceDispatch *d,
                           MemoryRegion *root);
 #endif
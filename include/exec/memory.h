@@ -39,6 +39,7 @@ DECLARE_INSTANCE_CHECKER(MemoryRegion, MEMORY_REGION,
 
 #define TYPE_IOMMU_MEMORY_REGION "iommu-memory-region"
 typedef struct IOMMUMemoryRegionClass IOMMUMemoryRegionClass;
+typedef struct IOMMUTLBCache IOMMUTLBCache;
 DECLARE_OBJ_CHECKERS(IOMMUMemoryRegion, IOMMUMemoryRegionClass,
                      IOMMU_MEMORY_REGION, TYPE_IOMMU_MEMORY_REGION)
 
@@ -61,7 +62,20 @@ static inline void fuzz_dma_read_cb(size_t addr,
 }
 #endif
 
-extern bool global_dirty_log;
+/* Possible bits for global_dirty_tracking */
+
+/* Dirty tracking enabled because migration is running */
+#define GLOBAL_DIRTY_MIGRATION  (1U << 0)
+
+/* Dirty tracking enabled because measuring dirty rate */
+#define GLOBAL_DIRTY_DIRTY_RATE (1U << 1)
+
+/* Dirty tracking enabled because dirty limit is in service */
+#define GLOBAL_DIRTY_LIMIT      (1U << 2)
+
+#define GLOBAL_DIRTY_MASK  (0x7)
+
+extern unsigned int global_dirty_tracking;
 
 typedef struct MemoryRegionOps MemoryRegionOps;
 
@@ -696,6 +710,7 @@ struct MemoryRegion {
     bool nonvolatile;
     bool rom_device;
     bool flush_coalesced_mmio;
+    bool global_locking;
     uint8_t dirty_log_mask;
     bool is_iommu;
     RAMBlock *ram_block;
@@ -718,11 +733,17 @@ struct MemoryRegion {
     int32_t priority;
     QTAILQ_HEAD(, MemoryRegion) subregions;
     QTAILQ_ENTRY(MemoryRegion) subregions_link;
+    /* The aliases of this region */
+    QTAILQ_HEAD(, MemoryRegion) alias_users;
+    QTAILQ_ENTRY(MemoryRegion) alias_users_link;
     QTAILQ_HEAD(, CoalescedMemoryRange) coalesced;
     const char *name;
     unsigned ioeventfd_nb;
     MemoryRegionIoeventfd *ioeventfds;
     RamDiscardManager *rdm; /* Only for RAM */
+    /* Last changes to the topology and the ioeventfds below this region */
+    uint64_t topology_stamp;
+    uint64_t ioeventfd_stamp;
 };
 
 struct IOMMUMemoryRegion {
@@ -730,6 +751,8 @@ struct IOMMUMemoryRegion {
 
     QLIST_HEAD(, IOMMUNotifier) iommu_notify;
     IOMMUNotifierFlag iommu_notify_flags;
+    /* Recent translations, see memory_region_iommu_enable_iotlb_cache() */
+    IOMMUTLBCache *iotlb_cache;
 };
 
 #define IOMMU_NOTIFIER_FOREACH(n, mr) \
@@ -1732,6 +1755,38 @@ int memory_region_iommu_set_page_size_mask(IOMMUMemoryRegion *iommu_mr,
                                            uint64_t page_size_mask,
                                            Error **errp);
 
+/**
+ * memory_region_iommu_enable_iotlb_cache: cache the translations of an
+ * IOMMU memory region
+ *
+ * DMA through @iommu_mr then looks up recently used translations in a
+ * small cache before calling the translate() callback.  The cache
+ * registers an UNMAP notifier on every IOMMU index to drop stale entries,
+ * so the IOMMU must send an UNMAP notification whenever a translation
+ * that translate() returned stops being valid, including when it changes
+ * its configuration.  Other changes must be followed by a call to
+ * memory_region_iommu_flush_iotlb_cache().  Failed translations are never
+ * cached.
+ *
+ * Returns 0 on success, or a negative errno otherwise.
+ *
+ * @iommu_mr: the IOMMU memory region
+ * @errp: pointer to Error*, to store an error if it happens.
+ */
+int memory_region_iommu_enable_iotlb_cache(IOMMUMemoryRegion *iommu_mr,
+                                           Error **errp);
+
+/**
+ * memory_region_iommu_flush_iotlb_cache: drop all the translations that
+ * are cached for an IOMMU memory region
+ *
+ * Does nothing if memory_region_iommu_enable_iotlb_cache() was not called
+ * for @iommu_mr.
+ *
+ * @iommu_mr: the IOMMU memory region
+ */
+void memory_region_iommu_flush_iotlb_cache(IOMMUMemoryRegion *iommu_mr);
+
 /**
  * memory_region_name: get a memory region's name
  *
@@ -2080,6 +2135,25 @@ void memory_region_set_flush_coalesced(MemoryRegion *mr);
  */
 void memory_region_clear_flush_coalesced(MemoryRegion *mr);
 
+/**
+ * memory_region_clear_global_locking: Dispatch accesses without the BQL.
+ *
+ * By default, accesses to I/O regions run with the BQL held.  Once this
+ * is called, the callbacks of @mr run without it, from whichever thread
+ * performed the access, so they must protect the device state with locks
+ * of their own.  The callbacks still run within an RCU critical section,
+ * which keeps @mr and its owner alive, and they may take the BQL for their
+ * slow paths (see QEMU_IOTHREAD_LOCK_GUARD) as long as they release it
+ * before returning.
+ *
+ * The eventfds that memory_region_add_eventfd() attaches to @mr are not
+ * signalled when accesses are dispatched to QEMU, because the eventfd list
+ * is protected by the BQL: the callbacks have to do that themselves.
+ *
+ * @mr: the memory region to be updated.
+ */
+void memory_region_clear_global_locking(MemoryRegion *mr);
+
 /**
  * memory_region_add_eventfd: Request an eventfd to be triggered when a word
  *                            is written to a location.
@@ -2367,13 +2441,17 @@ void memory_listener_unregister(MemoryListener *listener);
 
 /**
  * memory_global_dirty_log_start: begin dirty logging for all regions
+ *
+ * @flags: purpose of starting dirty log, migration or dirty rate
  */
-void memory_global_dirty_log_start(void);
+void memory_global_dirty_log_start(unsigned int flags);
 
 /**
  * memory_global_dirty_log_stop: end dirty logging for all regions
+ *
+ * @flags: purpose of stopping dirty log, migration or dirty rate
  */
-void memory_global_dirty_log_stop(void);
+void memory_global_dirty_log_stop(unsigned int flags);
 
 void mtree_info(bool flatview, bool dispatch_tree, bool owner, bool disabled);
 
@@ -2643,6 +2721,45 @@ void address_space_cache_invalidate(MemoryRegionCache *cache,
                                     hwaddr addr,
                                     hwaddr access_len);
 
+/**
+ * address_space_cache_slice: prepare for repeated access to a part of a
+ * #MemoryRegionCache
+ *
+ * Initialize @slice to access the @len bytes at @addr in @cache, without
+ * translating them again.  This only works if @cache maps RAM directly;
+ * otherwise, or if the range is not entirely in @cache, return %false
+ * and leave @slice untouched.  @slice must be freed with
+ * address_space_cache_destroy(), independent of @cache.
+ *
+ * @slice: #MemoryRegionCache to be filled
+ * @cache: #MemoryRegionCache that contains the range
+ * @addr: first address of the range, relative to @cache
+ * @len: length of the range
+ */
+bool address_space_cache_slice(MemoryRegionCache *slice,
+                               MemoryRegionCache *cache,
+                               hwaddr addr,
+                               hwaddr len);
+
+/**
+ * address_space_map_cached: map a part of a #MemoryRegionCache
+ *
+ * Like address_space_map(), but the @len bytes at @addr must all be in
+ * @cache, which must map RAM directly.  Returns %NULL otherwise, and the
+ * caller can fall back to address_space_map().  The mapping must be
+ * released with address_space_unmap().  Mapping for writing requires
+ * @cache to be initialized with @is_write set.
+ *
+ * @cache: #MemoryRegionCache that contains the range
+ * @addr: first address of the range, relative to @cache
+ * @len: length of the range
+ * @is_write: indicates the transfer direction
+ */
+void *address_space_map_cached(MemoryRegionCache *cache,
+                               hwaddr addr,
+                               hwaddr len,
+                               bool is_write);
+
 /**
  * address_space_cache_destroy: free a #MemoryRegionCache
  *
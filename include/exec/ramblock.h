@@ -69,6 +69,17 @@ struct RAMBlock {
      * could not have been valid on the source.
      */
     ram_addr_t postcopy_length;
+
+    /*
+     * With the mapped-ram capability each RAM block owns a fixed region
+     * of the migration file.  @file_bmap tracks which pages have been
+     * written at @pages_offset + page offset; it is saved at
+     * @bitmap_offset when migration completes.  Zero pages are never
+     * written and have their bit clear.
+     */
+    unsigned long *file_bmap;
+    off_t bitmap_offset;
+    off_t pages_offset;
 };
 #endif
 #endif
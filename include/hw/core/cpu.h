@@ -219,6 +219,7 @@ struct kvm_run;
 
 struct hax_vcpu_state;
 struct hvf_vcpu_state;
+struct TCGCPUProfile;
 
 #define TB_JMP_CACHE_BITS 12
 #define TB_JMP_CACHE_SIZE (1 << TB_JMP_CACHE_BITS)
@@ -301,6 +302,10 @@ struct qemu_work_item;
  *    ring is enabled.
  * @kvm_fetch_index: Keeps the index that we last fetched from the per-vCPU
  *    dirty ring structure.
+ * @dirty_pages: Number of pages this CPU dirtied, as collected from its
+ *    KVM dirty ring.
+ * @throttle_us_per_full: Time this CPU sleeps, in microseconds, every time
+ *    its KVM dirty ring gets full while a dirty limit is in service.
  *
  * State of one CPU core or thread.
  */
@@ -378,6 +383,8 @@ struct CPUState {
     struct kvm_run *kvm_run;
     struct kvm_dirty_gfn *kvm_dirty_gfns;
     uint32_t kvm_fetch_index;
+    uint64_t dirty_pages;
+    uint32_t throttle_us_per_full;
 
     /* Used for events with 'vcpu' and *without* the 'disabled' properties */
     DECLARE_BITMAP(trace_dstate_delayed, CPU_TRACE_DSTATE_MAX_EVENTS);
@@ -415,6 +422,9 @@ struct CPUState {
 
     /* track IOMMUs whose translations we've cached in the TCG TLB */
     GArray *iommu_notifiers;
+
+    /* JIT statistics, only used by TCG */
+    struct TCGCPUProfile *tcg_profile;
 };
 
 typedef QTAILQ_HEAD(CPUTailQ, CPUState) CPUTailQ;
@@ -180,6 +180,11 @@ struct APICCommonState {
     int64_t next_time;
     QEMUTimer *timer;
     int64_t timer_expiry;
+    /*
+     * Protects the timer state above, which the userspace APIC accesses
+     * without the BQL from the vCPU that owns it.
+     */
+    QemuMutex timer_lock;
     int sipi_vector;
     int wait_for_sipi;
 
@@ -0,0 +1,114 @@
+/*
+ * vhost shadow virtqueue
+ *
+ * Copyright(c) 2021 Red Hat, Inc.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#ifndef VHOST_SHADOW_VIRTQUEUE_H
+#define VHOST_SHADOW_VIRTQUEUE_H
+
+#include "qemu/event_notifier.h"
+#include "qemu/iova-tree.h"
+#include "hw/virtio/virtio.h"
+#include "standard-headers/linux/virtio_ring.h"
+
+typedef struct VhostShadowVirtqueue VhostShadowVirtqueue;
+struct vhost_vring_addr;
+
+/*
+ * Forward @elem, just popped from the guest virtqueue, to the device.
+ * The handler takes ownership of @elem.  Returns 0, or a negative errno
+ * to stop processing the guest kick.
+ */
+typedef int (*VirtQueueAvailCallback)(VhostShadowVirtqueue *svq,
+                                      VirtQueueElement *elem,
+                                      void *opaque);
+
+typedef struct VhostShadowVirtqueueOps {
+    VirtQueueAvailCallback avail_handler;
+} VhostShadowVirtqueueOps;
+
+typedef struct SVQDescState {
+    /* NULL for buffers that QEMU adds on its own */
+    VirtQueueElement *elem;
+    /* Descriptors used by the buffer in the shadow vring, 0 if free */
+    unsigned int ndescs;
+} SVQDescState;
+
+/*
+ * A shadow virtqueue sits between the guest virtqueue and the device:
+ * QEMU pops the guest buffers, translates their addresses to the IOVA
+ * that the device uses and exposes them in a vring of its own.  Used
+ * buffers travel back the same way.  Since QEMU sees every buffer, it
+ * can track the memory that the device writes, and inspect the buffers
+ * on the way.
+ */
+struct VhostShadowVirtqueue {
+    /* The vring that the device sees */
+    struct vring vring;
+
+    /* Kick the device */
+    EventNotifier hdev_kick;
+    /* The device signals used buffers */
+    EventNotifier hdev_call;
+    /* The guest kicks, i.e. the host notifier of the virtqueue */
+    EventNotifier svq_kick;
+    /* Signal used buffers to the guest, may be unset */
+    EventNotifier svq_call;
+
+    VirtIODevice *vdev;
+    VirtQueue *vq;
+
+    /* Translates QEMU virtual addresses to IOVA */
+    IOVATree *iova_tree;
+
+    SVQDescState *desc_state;
+    /* A guest buffer that did not fit in the vring yet */
+    VirtQueueElement *next_guest_avail_elem;
+
+    const VhostShadowVirtqueueOps *ops;
+    void *ops_opaque;
+
+    /* The device negotiated VIRTIO_RING_F_EVENT_IDX */
+    bool event_idx;
+
+    uint16_t free_head;
+    uint16_t num_free;
+    uint16_t shadow_avail_idx;
+    /* shadow_avail_idx at the last check for a device kick */
+    uint16_t kick_avail_idx;
+    uint16_t shadow_used_idx;
+    uint16_t last_used_idx;
+};
+
+bool vhost_svq_valid_features(uint64_t features, Error **errp);
+
+int vhost_svq_add(VhostShadowVirtqueue *svq, const struct iovec *out_sg,
+                  size_t out_num, const struct iovec *in_sg, size_t in_num,
+                  VirtQueueElement *elem);
+void vhost_svq_push_elem(VhostShadowVirtqueue *svq,
+                         const VirtQueueElement *elem, uint32_t len);
+ssize_t vhost_svq_poll(VhostShadowVirtqueue *svq);
+
+void vhost_svq_set_svq_kick_fd(VhostShadowVirtqueue *svq, int svq_kick_fd);
+void vhost_svq_set_svq_call_fd(VhostShadowVirtqueue *svq, int call_fd);
+void vhost_svq_get_vring_addr(const VhostShadowVirtqueue *svq,
+                              struct vhost_vring_addr *addr);
+size_t vhost_svq_driver_area_size(const VhostShadowVirtqueue *svq);
+size_t vhost_svq_device_area_size(const VhostShadowVirtqueue *svq);
+
+void vhost_svq_start(VhostShadowVirtqueue *svq, VirtIODevice *vdev,
+                     VirtQueue *vq);
+void vhost_svq_stop(VhostShadowVirtqueue *svq);
+
+VhostShadowVirtqueue *vhost_svq_new(IOVATree *iova_tree,
+                                    const VhostShadowVirtqueueOps *ops,
+                                    void *ops_opaque);
+void vhost_svq_free(gpointer vq);
+G_DEFINE_AUTOPTR_CLEANUP_FUNC(VhostShadowVirtqueue, vhost_svq_free);
+
+#endif
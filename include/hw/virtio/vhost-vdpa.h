@@ -12,7 +12,9 @@
 #ifndef HW_VIRTIO_VHOST_VDPA_H
 #define HW_VIRTIO_VHOST_VDPA_H
 
+#include "hw/virtio/vhost-shadow-virtqueue.h"
 #include "hw/virtio/virtio.h"
+#include "standard-headers/linux/vhost_types.h"
 
 typedef struct VhostVDPAHostNotifier {
     MemoryRegion mr;
@@ -21,11 +23,34 @@ typedef struct VhostVDPAHostNotifier {
 
 typedef struct vhost_vdpa {
     int device_fd;
+    /* Position of this vhost_dev among the ones sharing device_fd */
+    int index;
     uint32_t msg_type;
     bool iotlb_batch_begin_sent;
     MemoryListener listener;
+    struct vhost_vdpa_iova_range iova_range;
+    uint64_t acked_features;
+    /* The virtqueues of this vhost_dev go through shadow virtqueues */
+    bool shadow_vqs_enabled;
+    /*
+     * The guest memory is mapped at IOVA allocated in iova_tree instead of
+     * at its GPA, so that the datapath can be shadowed too.  Same value
+     * for all the vhost_dev of the device.
+     */
+    bool shadow_data;
+    /* The device can run with shadow virtqueues, so it can migrate */
+    bool shadow_vqs_capable;
+    /* IOVA mappings of QEMU virtual addresses, shared by the device */
+    IOVATree *iova_tree;
+    GPtrArray *shadow_vqs;
+    const VhostShadowVirtqueueOps *shadow_vq_ops;
+    void *shadow_vq_ops_opaque;
     struct vhost_dev *dev;
     VhostVDPAHostNotifier notifier[VIRTIO_QUEUE_MAX];
 } VhostVDPA;
 
+int vhost_vdpa_svq_map_buf(struct vhost_vdpa *v, void *buf, size_t size,
+                           bool write);
+void vhost_vdpa_svq_unmap_buf(struct vhost_vdpa *v, void *buf);
+
 #endif
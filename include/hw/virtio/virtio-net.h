@@ -18,8 +18,10 @@
 #include "standard-headers/linux/virtio_net.h"
 #include "hw/virtio/virtio.h"
 #include "net/announce.h"
+#include "net/gso.h"
 #include "qemu/option_int.h"
 #include "qom/object.h"
+#include "sysemu/iothread.h"
 
 #include "ebpf/ebpf_rss.h"
 
@@ -130,6 +132,12 @@ typedef struct VirtioNetRscChain {
 #define VIRTIO_NET_RSS_MAX_KEY_SIZE     40
 #define VIRTIO_NET_RSS_MAX_TABLE_LEN    128
 
+/* Bytes of a zero-copy packet checked by the rx filter and dhclient fixup */
+#define VIRTIO_NET_ZEROCOPY_HEAD 36
+
+#define MAC_TABLE_ENTRIES    64
+#define MAX_VLAN    (1 << 12)   /* Per 802.1Q definition */
+
 typedef struct VirtioNetRssData {
     bool    enabled;
     bool    enabled_software_rss;
@@ -150,7 +158,28 @@ typedef struct VirtIONetQueue {
     uint32_t tx_waiting;
     struct {
         VirtQueueElement *elem;
+        /* Segments of the packet queued by the peer and not sent yet */
+        unsigned int segments;
     } async_tx;
+    /* rx buffer lent to the peer by virtio_net_rx_buf_get() */
+    struct {
+        VirtQueueElement *elem;
+        /*
+         * The peer reads the vnet header and the start of the packet
+         * here, so that the rx filter runs before anything reaches
+         * guest memory.
+         */
+        uint8_t head[sizeof(struct virtio_net_hdr_mrg_rxbuf) +
+                     VIRTIO_NET_ZEROCOPY_HEAD];
+    } zerocopy_rx;
+    /* Offloads done in software for peers without vnet_hdr (x-sw-gso) */
+    NetGsoBatch *gso_batch;
+    NetGro *gro;
+    QEMUBH *gro_bh;
+    /* A coalesced packet found no rx buffer, later frames must wait */
+    bool gro_blocked;
+    /* IOThread servicing the queue pair, or NULL for the main loop */
+    AioContext *ctx;
     struct VirtIONet *n;
 } VirtIONetQueue;
 
@@ -194,8 +223,11 @@ struct VirtIONet {
     NICConf nic_conf;
     DeviceState *qdev;
     int multiqueue;
+    /* Datapath queue pairs */
     uint16_t max_queues;
     uint16_t curr_queues;
+    /* Peers, including the control virtqueue of a vhost backend */
+    uint16_t max_ncs;
     size_t config_size;
     char *netclient_name;
     char *netclient_type;
@@ -205,6 +237,15 @@ struct VirtIONet {
     AnnounceTimer announce_timer;
     bool needs_vnet_hdr_swap;
     bool mtu_bypass_backend;
+    bool rx_zerocopy;
+    bool sw_gso;
+    /* Coalesce received TCP segments for the guest in software */
+    bool gro_enabled;
+    /* Queue pairs are spread over these IOThreads in turn (iothreads=) */
+    uint32_t num_iothreads;
+    char **iothread_ids;
+    IOThread **iothreads;
+    bool dataplane_started;
     /* primary failover device is hidden*/
     bool failover_primary_hidden;
     bool failover;
@@ -217,5 +258,9 @@ struct VirtIONet {
 
 void virtio_net_set_netclient_name(VirtIONet *n, const char *name,
                                    const char *type);
+size_t virtio_net_handle_ctrl_iov(VirtIODevice *vdev,
+                                  const struct iovec *in_sg, unsigned in_num,
+                                  const struct iovec *out_sg,
+                                  unsigned out_num);
 
 #endif
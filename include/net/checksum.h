@@ -27,6 +27,8 @@ struct iovec;
 #define CSUM_ALL    (CSUM_IP | CSUM_TCP | CSUM_UDP)
 
 uint32_t net_checksum_add_cont(int len, uint8_t *buf, int seq);
+uint32_t net_checksum_copy_cont(uint8_t *dst, const uint8_t *src, int len,
+                                int seq);
 uint16_t net_checksum_finish(uint32_t sum);
 uint16_t net_checksum_tcpudp(uint16_t length, uint16_t proto,
                              uint8_t *addrs, uint8_t *buf);
@@ -64,6 +66,29 @@ uint32_t net_checksum_add_iov(const struct iovec *iov,
                               uint32_t iov_off, uint32_t size,
                               uint32_t csum_offset);
 
+/**
+ * net_checksum_iov_to_buf: copy a scatter-gather vector and checksum it
+ *
+ * Like net_checksum_add_iov(), but also copies the data to @buf, reading
+ * it only once.
+ *
+ * @iov: input scatter-gather array
+ * @iov_cnt: number of array elements
+ * @iov_off: starting iov offset for copying and checksumming
+ * @buf: destination, at least @size bytes
+ * @size: length of data to be copied and checksummed
+ * @csum_offset: offset of the checksum chunk
+ */
+uint32_t net_checksum_iov_to_buf(const struct iovec *iov,
+                                 const unsigned int iov_cnt,
+                                 uint32_t iov_off, uint8_t *buf,
+                                 uint32_t size, uint32_t csum_offset);
+
+/* Name of the checksum implementation in use, for tests and benchmarks */
+const char *net_checksum_accel_name(void);
+/* Switch to the next slower implementation; false if there is none */
+bool test_net_checksum_next_accel(void);
+
 typedef struct toeplitz_key_st {
     uint32_t leftmost_32_bits;
     uint8_t *next_byte;
@@ -35,6 +35,14 @@ typedef void (FilterStatusChanged) (NetFilterState *nf, Error **errp);
 
 typedef void (FilterHandleEvent) (NetFilterState *nf, int event, Error **errp);
 
+struct EBPFFilterRule;
+
+/*
+ * Return true if the filter drops exactly the packets matching @rule,
+ * which the netdev may then drop in the kernel
+ */
+typedef bool (FilterEBPFRule) (NetFilterState *nf, struct EBPFFilterRule *rule);
+
 struct NetFilterClass {
     ObjectClass parent_class;
 
@@ -43,6 +51,7 @@ struct NetFilterClass {
     FilterCleanup *cleanup;
     FilterStatusChanged *status_changed;
     FilterHandleEvent *handle_event;
+    FilterEBPFRule *ebpf_rule;
     /* mandatory */
     FilterReceiveIOV *receive_iov;
 };
@@ -59,6 +68,8 @@ struct NetFilterState {
     bool on;
     char *position;
     bool insert_before_flag;
+    /* The netdev drops the packets of this filter in the kernel */
+    bool offloaded;
     QTAILQ_ENTRY(NetFilterState) next;
 };
 
@@ -79,4 +90,6 @@ ssize_t qemu_netfilter_pass_to_next(NetClientState *sender,
 
 void colo_notify_filters_event(int event, Error **errp);
 
+void netfilter_update_ebpf(NetClientState *netdev);
+
 #endif /* QEMU_NET_FILTER_H */
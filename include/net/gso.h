@@ -0,0 +1,138 @@
+/*
+ * Software segmentation and coalescing of TCP/UDP super-packets
+ *
+ * NIC models and backends exchange packets as 64 KB super-packets
+ * described by a struct virtio_net_hdr.  When one side cannot handle
+ * them, the packet is segmented (GSO) on transmit or the MTU-sized
+ * frames are coalesced back (GRO) on receive, so that the rest of the
+ * path still works with few large packets.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef QEMU_NET_GSO_H
+#define QEMU_NET_GSO_H
+
+#include "net/eth.h"
+#include "net/net.h"
+#include "standard-headers/linux/virtio_net.h"
+
+/* Segments built before they are handed to the flush callback */
+#define NET_GSO_BATCH       64
+/* Longest L2 + L3 + L4 header of a segment */
+#define NET_GSO_MAX_HDR     256
+/* Payload vector entries of a segment; longer packets are linearized */
+#define NET_GSO_MAX_IOV     16
+/* Largest super-packet, including the L2 header */
+#define NET_GSO_MAX_SIZE    (ETH_MAX_IP_DGRAM_LEN + NET_GSO_MAX_HDR)
+
+typedef struct NetGsoBatch NetGsoBatch;
+
+/**
+ * NetGsoFlush:
+ * @batch: the segments built so far, in batch->pkts[0..batch->npkts)
+ * @last: true if these are the last segments of the packet
+ * @opaque: the opaque pointer passed to net_gso_segment()
+ *
+ * Send the segments.  They point into the original packet and into
+ * @batch, and stay valid only until the callback returns.
+ */
+typedef void (NetGsoFlush)(NetGsoBatch *batch, bool last, void *opaque);
+
+struct NetGsoBatch {
+    int npkts;
+    NetPacketIOV pkts[NET_GSO_BATCH];
+    /* Private */
+    struct iovec iov[NET_GSO_BATCH][NET_GSO_MAX_IOV + 1];
+    uint8_t hdr[NET_GSO_BATCH][NET_GSO_MAX_HDR];
+    uint8_t linear[NET_GSO_MAX_SIZE];
+};
+
+/**
+ * net_gso_segment:
+ * @batch: scratch space for the segments
+ * @vhdr: offload information of the packet, in host endianness
+ * @iov: the packet, starting with the Ethernet header
+ * @iovcnt: number of elements of @iov
+ * @flush: called with each batch of at most NET_GSO_BATCH segments
+ * @opaque: passed to @flush
+ *
+ * Split a TCPv4, TCPv6 or UDPv4 super-packet into frames no larger than
+ * the MTU it was built for, completing the checksums that @vhdr asks
+ * for.  TCP payloads are not copied; UDP datagrams are sent as IP
+ * fragments.  Packets that need no segmentation are passed to @flush
+ * as a single segment, with their checksum completed if needed.
+ *
+ * Returns: the number of segments, or -EINVAL if the packet is malformed
+ * or cannot be segmented (e.g. UDPv6); then @flush is not called.
+ */
+int net_gso_segment(NetGsoBatch *batch, const struct virtio_net_hdr *vhdr,
+                    const struct iovec *iov, int iovcnt,
+                    NetGsoFlush *flush, void *opaque);
+
+typedef struct NetGro NetGro;
+
+/**
+ * NetGroDeliver:
+ * @vhdr: offload information of the packet, in host endianness
+ * @buf: the packet, starting with the Ethernet header
+ * @size: length of @buf
+ * @opaque: the opaque pointer passed to net_gro_new()
+ *
+ * Deliver a packet coalesced by net_gro_receive().  A packet made of a
+ * single frame is delivered unchanged, with a zero @vhdr.
+ *
+ * Returns: false if the receiver has no room for the packet; its flow is
+ * then held until a later net_gro_flush() delivers it.
+ */
+typedef bool (NetGroDeliver)(const struct virtio_net_hdr *vhdr,
+                             const uint8_t *buf, size_t size, void *opaque);
+
+NetGro *net_gro_new(NetGroDeliver *deliver, void *opaque);
+void net_gro_free(NetGro *gro);
+
+/**
+ * net_gro_receive:
+ * @gro: the coalescing context
+ * @buf: a received frame, starting with the Ethernet header
+ * @size: length of @buf
+ *
+ * Coalesce @buf with the frames held for the same TCP flow.  Frames of
+ * a flow are held until net_gro_flush() is called, the flow stops being
+ * contiguous, or its packet would exceed 64 KB.  Only segments carrying
+ * data and a valid checksum are coalesced.
+ *
+ * Returns: true if @buf was taken over; otherwise the caller must deliver
+ * it itself.  Anything held for its flow has been delivered already,
+ * unless the receiver had no room for it: then the caller must not let
+ * @buf overtake it, e.g. by queueing @buf until net_gro_flush() succeeds.
+ */
+bool net_gro_receive(NetGro *gro, const uint8_t *buf, size_t size);
+
+/**
+ * net_gro_flush:
+ * @gro: the coalescing context
+ *
+ * Deliver all held packets.  Those that the receiver has no room for
+ * stay held, see net_gro_pending().
+ */
+void net_gro_flush(NetGro *gro);
+
+/**
+ * net_gro_drop:
+ * @gro: the coalescing context
+ *
+ * Discard all held packets without delivering them.
+ */
+void net_gro_drop(NetGro *gro);
+
+/**
+ * net_gro_pending:
+ * @gro: the coalescing context
+ *
+ * Returns: true if @gro holds packets that wait for net_gro_flush().
+ */
+bool net_gro_pending(NetGro *gro);
+
+#endif /* QEMU_NET_GSO_H */
@@ -46,6 +46,8 @@ typedef void (NetPoll)(NetClientState *, bool enable);
 typedef bool (NetCanReceive)(NetClientState *);
 typedef ssize_t (NetReceive)(NetClientState *, const uint8_t *, size_t);
 typedef ssize_t (NetReceiveIOV)(NetClientState *, const struct iovec *, int);
+typedef struct NetPacketIOV NetPacketIOV;
+typedef int (NetReceiveIOVBatch)(NetClientState *, const NetPacketIOV *, int);
 typedef void (NetCleanup) (NetClientState *);
 typedef void (LinkStatusChanged)(NetClientState *);
 typedef void (NetClientDestructor)(NetClientState *);
@@ -62,6 +64,14 @@ typedef struct SocketReadState SocketReadState;
 typedef void (SocketReadStateFinalize)(SocketReadState *rs);
 typedef void (NetAnnounce)(NetClientState *);
 typedef bool (SetSteeringEBPF)(NetClientState *, int);
+typedef bool (SetFilterEBPF)(NetClientState *, int);
+typedef int (NetRxBufGet)(NetClientState *, struct iovec *, int);
+typedef ssize_t (NetRxBufPut)(NetClientState *, size_t, const uint8_t *,
+                              size_t);
+typedef int (SetAioContext)(NetClientState *, AioContext *);
+typedef int (NetStart)(NetClientState *);
+typedef int (NetLoad)(NetClientState *);
+typedef void (NetStop)(NetClientState *);
 
 typedef struct NetClientInfo {
     NetClientDriver type;
@@ -69,6 +79,7 @@ typedef struct NetClientInfo {
     NetReceive *receive;
     NetReceive *receive_raw;
     NetReceiveIOV *receive_iov;
+    NetReceiveIOVBatch *receive_iov_batch;
     NetCanReceive *can_receive;
     NetCleanup *cleanup;
     LinkStatusChanged *link_status_changed;
@@ -84,6 +95,14 @@ typedef struct NetClientInfo {
     SetVnetBE *set_vnet_be;
     NetAnnounce *announce;
     SetSteeringEBPF *set_steering_ebpf;
+    SetFilterEBPF *set_filter_ebpf;
+    NetRxBufGet *rx_buf_get;
+    NetRxBufPut *rx_buf_put;
+    SetAioContext *set_aio_context;
+    /* vhost backends: before the device starts, once it runs, after stop */
+    NetStart *start;
+    NetLoad *load;
+    NetStop *stop;
 } NetClientInfo;
 
 struct NetClientState {
@@ -103,7 +122,22 @@ struct NetClientState {
     int vnet_hdr_len;
     bool is_netdev;
     bool do_not_pad; /* do not pad to the minimum ethernet frame length */
+    /* Bytes a netdev received, copied or read straight into the peer */
+    uint64_t rx_copied_bytes;
+    uint64_t rx_zerocopy_bytes;
+    /* IOThread running the datapath, or NULL for the main loop */
+    AioContext *aio_context;
     QTAILQ_HEAD(, NetFilterState) filters;
+    /* The netdev drops packets for the filters, see netfilter_update_ebpf() */
+    bool filter_ebpf;
+    /* False for the control virtqueue of a vhost backend */
+    bool is_datapath;
+};
+
+/* One packet of a batch passed to qemu_sendv_packet_batch() */
+struct NetPacketIOV {
+    const struct iovec *iov;
+    int iovcnt;
 };
 
 typedef struct NICState {
@@ -134,6 +168,10 @@ NetClientState *qemu_new_net_client(NetClientInfo *info,
                                     NetClientState *peer,
                                     const char *model,
                                     const char *name);
+NetClientState *qemu_new_net_control_client(NetClientInfo *info,
+                                            NetClientState *peer,
+                                            const char *model,
+                                            const char *name);
 NICState *qemu_new_nic(NetClientInfo *info,
                        NICConf *conf,
                        const char *model,
@@ -161,6 +199,11 @@ ssize_t qemu_receive_packet_iov(NetClientState *nc,
 ssize_t qemu_send_packet_raw(NetClientState *nc, const uint8_t *buf, int size);
 ssize_t qemu_send_packet_async(NetClientState *nc, const uint8_t *buf,
                                int size, NetPacketSent *sent_cb);
+int qemu_sendv_packet_batch(NetClientState *nc, const NetPacketIOV *pkts,
+                            int npkts);
+int qemu_net_rx_buf_get(NetClientState *nc, struct iovec *iov, int iovcnt);
+ssize_t qemu_net_rx_buf_put(NetClientState *nc, size_t size,
+                            const uint8_t *tail, size_t tail_len);
 void qemu_purge_queued_packets(NetClientState *nc);
 void qemu_flush_queued_packets(NetClientState *nc);
 void qemu_flush_or_purge_queued_packets(NetClientState *nc, bool purge);
@@ -174,6 +217,10 @@ void qemu_set_offload(NetClientState *nc, int csum, int tso4, int tso6,
 void qemu_set_vnet_hdr_len(NetClientState *nc, int len);
 int qemu_set_vnet_le(NetClientState *nc, bool is_le);
 int qemu_set_vnet_be(NetClientState *nc, bool is_be);
+bool qemu_net_can_set_aio_context(NetClientState *nc);
+int qemu_net_set_aio_context(NetClientState *nc, AioContext *ctx);
+void qemu_net_acquire(NetClientState *nc);
+void qemu_net_release(NetClientState *nc);
 void qemu_macaddr_default_if_unset(MACAddr *macaddr);
 int qemu_show_nic_models(const char *arg, const char *const *models);
 void qemu_check_nic_model(NICInfo *nd, const char *model);
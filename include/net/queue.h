@@ -30,6 +30,14 @@ typedef struct NetQueue NetQueue;
 
 typedef void (NetPacketSent) (NetClientState *sender, ssize_t ret);
 
+typedef struct NetQueueStats {
+    uint32_t len;           /* packets in the queue */
+    uint32_t peak;          /* highest number of packets in the queue */
+    uint64_t queued;        /* packets queued because the peer was busy */
+    uint64_t dropped;       /* packets dropped because the queue was full */
+    uint64_t allocated;     /* queued packets that did not fit the pool */
+} NetQueueStats;
+
 #define QEMU_NET_PACKET_FLAG_NONE  0
 #define QEMU_NET_PACKET_FLAG_RAW  (1<<0)
 
@@ -79,5 +87,7 @@ ssize_t qemu_net_queue_send_iov(NetQueue *queue,
 
 void qemu_net_queue_purge(NetQueue *queue, NetClientState *from);
 bool qemu_net_queue_flush(NetQueue *queue);
+bool qemu_net_queue_empty(NetQueue *queue);
+void qemu_net_queue_get_stats(NetQueue *queue, NetQueueStats *stats);
 
 #endif /* QEMU_NET_QUEUE_H */
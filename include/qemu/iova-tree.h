@@ -29,6 +29,7 @@
 #define  IOVA_OK           (0)
 #define  IOVA_ERR_INVALID  (-1) /* Invalid parameters */
 #define  IOVA_ERR_OVERLAP  (-2) /* IOVA range overlapped */
+#define  IOVA_ERR_NOMEM    (-3) /* Cannot allocate */
 
 typedef struct IOVATree IOVATree;
 typedef struct DMAMap {
@@ -107,6 +108,38 @@ DMAMap *iova_tree_find(IOVATree *tree, DMAMap *map);
  */
 DMAMap *iova_tree_find_address(IOVATree *tree, hwaddr iova);
 
+/**
+ * iova_tree_find_iova:
+ *
+ * @tree: the iova tree to search from
+ * @map: the mapping to search
+ *
+ * Search for a mapping in the iova tree whose translated range overlaps
+ * with the translated range of @map, i.e. the reverse of
+ * iova_tree_find().  The search is linear in the number of mappings.
+ *
+ * Return: same as iova_tree_find().
+ */
+DMAMap *iova_tree_find_iova(IOVATree *tree, DMAMap *map);
+
+/**
+ * iova_tree_alloc_map:
+ *
+ * @tree: the iova tree to allocate from
+ * @map: the new mapping; its size, translated address and permissions
+ *       must be set
+ * @iova_begin: the lowest iova that can be allocated
+ * @iova_last: the highest iova that can be allocated (inclusive)
+ *
+ * Find the lowest hole in [@iova_begin, @iova_last] that fits @map,
+ * store its start in map->iova and insert @map into the tree.
+ *
+ * Return: IOVA_OK if succeeded, or <0 if error.  IOVA_ERR_NOMEM means
+ * that there is no hole large enough.
+ */
+int iova_tree_alloc_map(IOVATree *tree, DMAMap *map, hwaddr iova_begin,
+                        hwaddr iova_last);
+
 /**
  * iova_tree_foreach:
  *
@@ -0,0 +1,79 @@
+/*
+ * Per-vCPU dirty page rate limit
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef SYSEMU_DIRTYLIMIT_H
+#define SYSEMU_DIRTYLIMIT_H
+
+#include "qapi/qapi-types-migration.h"
+
+/* Period of the dirty rate calculation while a dirty limit is in service */
+#define DIRTYLIMIT_CALC_TIME_MS         1000
+
+typedef struct VcpuStat {
+    int nvcpu;              /* number of vCPUs */
+    DirtyRateVcpu *rates;   /* dirty rate of each vCPU */
+} VcpuStat;
+
+/**
+ * vcpu_calculate_dirtyrate:
+ * @calc_time_ms: measurement period
+ * @stat: filled with the dirty rate of each vCPU, in MB/s; free
+ *        stat->rates with g_free()
+ * @flag: GLOBAL_DIRTY_* reason for dirty tracking
+ * @one_shot: start and stop dirty tracking for @flag around the
+ *            measurement; otherwise the caller keeps it enabled
+ *
+ * Count the pages each vCPU dirties during @calc_time_ms, using the
+ * KVM dirty ring.  Must be called without the iothread lock.
+ */
+void vcpu_calculate_dirtyrate(int64_t calc_time_ms, VcpuStat *stat,
+                              unsigned int flag, bool one_shot);
+
+/**
+ * dirtylimit_in_service:
+ *
+ * Returns: true if a dirty limit is in service.
+ */
+bool dirtylimit_in_service(void);
+
+/**
+ * dirtylimit_start:
+ * @quota: dirty page rate limit, in MB/s
+ *
+ * Limit the dirty page rate of every vCPU to @quota.  vCPUs dirtying
+ * memory more slowly than @quota are left alone, the others sleep every
+ * time their dirty ring gets full.  Calling it again while the limit is
+ * in service changes the quota.  Requires the KVM dirty ring and must be
+ * called with the iothread lock held.
+ */
+void dirtylimit_start(uint64_t quota);
+
+/**
+ * dirtylimit_stop:
+ *
+ * Stop throttling.  Must be called without the iothread lock.
+ */
+void dirtylimit_stop(void);
+
+/**
+ * dirtylimit_query_vcpu_rates:
+ *
+ * Returns: the dirty rate of each vCPU measured during the last period
+ * of the dirty limit, or NULL if it is not in service.
+ */
+DirtyRateVcpuList *dirtylimit_query_vcpu_rates(void);
+
+/**
+ * dirtylimit_vcpu_execute:
+ * @cpu: vCPU whose dirty ring just got full
+ *
+ * Called by the vCPU thread without the iothread lock; sleeps if @cpu is
+ * being throttled.
+ */
+void dirtylimit_vcpu_execute(CPUState *cpu);
+
+#endif
@@ -810,6 +810,7 @@ void tcg_region_reset_all(void);
 
 size_t tcg_code_size(void);
 size_t tcg_code_capacity(void);
+size_t tcg_region_recycle_count(void);
 
 void tcg_tb_insert(TranslationBlock *tb);
 void tcg_tb_remove(TranslationBlock *tb);
@@ -842,6 +843,9 @@ void tcg_prologue_init(TCGContext *s);
 void tcg_func_start(TCGContext *s);
 
 int tcg_gen_code(TCGContext *s, TranslationBlock *tb);
+void tcg_foreach_helper_call(TCGContext *s,
+                             void (*func)(const char *name, void *opaque),
+                             void *opaque);
 
 void tcg_set_frame(TCGContext *s, TCGReg reg, intptr_t start, intptr_t size);
 
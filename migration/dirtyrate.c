@@ -12,20 +12,29 @@
 
 #include "qemu/osdep.h"
 #include <zlib.h>
+#include "qemu/units.h"
 #include "qapi/error.h"
 #include "cpu.h"
 #include "exec/ramblock.h"
+#include "exec/ram_addr.h"
 #include "qemu/rcu_queue.h"
 #include "qapi/qapi-commands-migration.h"
 #include "ram.h"
+#include "migration.h"
 #include "trace.h"
 #include "dirtyrate.h"
 #include "monitor/hmp.h"
 #include "monitor/monitor.h"
 #include "qapi/qmp/qdict.h"
+#include "sysemu/kvm.h"
+#include "exec/memory.h"
 
 static int CalculatingState = DIRTY_RATE_STATUS_UNSTARTED;
 static struct DirtyRateStat DirtyStat;
+static DirtyRateMeasureMode dirtyrate_mode =
+                DIRTY_RATE_MEASURE_MODE_PAGE_SAMPLING;
+/* Set while a dirty-bitmap measurement owns the migration dirty bitmap */
+static bool dirty_bitmap_measuring;
 
 static int64_t set_sample_page_period(int64_t msec, int64_t initial_time)
 {
@@ -76,12 +85,39 @@ static struct DirtyRateInfo *query_dirty_rate_info(void)
     if (qatomic_read(&CalculatingState) == DIRTY_RATE_STATUS_MEASURED) {
         info->has_dirty_rate = true;
         info->dirty_rate = dirty_rate;
+
+        if (dirtyrate_mode == DIRTY_RATE_MEASURE_MODE_DIRTY_RING) {
+            DirtyRateVcpuList **tail = &info->vcpu_dirty_rate;
+            int i;
+
+            for (i = 0; i < DirtyStat.vcpu_stat.nvcpu; i++) {
+                DirtyRateVcpu *rate = g_new(DirtyRateVcpu, 1);
+
+                *rate = DirtyStat.vcpu_stat.rates[i];
+                QAPI_LIST_APPEND(tail, rate);
+            }
+            info->has_vcpu_dirty_rate = true;
+        } else if (dirtyrate_mode == DIRTY_RATE_MEASURE_MODE_DIRTY_BITMAP) {
+            DirtyRateRamBlockList **tail = &info->ramblock_dirty_rate;
+            DirtyRateRamBlockList *entry;
+
+            for (entry = DirtyStat.ramblock_rates; entry;
+                 entry = entry->next) {
+                DirtyRateRamBlock *rate = g_new(DirtyRateRamBlock, 1);
+
+                rate->id = g_strdup(entry->value->id);
+                rate->dirty_rate = entry->value->dirty_rate;
+                QAPI_LIST_APPEND(tail, rate);
+            }
+            info->has_ramblock_dirty_rate = true;
+        }
     }
 
     info->status = CalculatingState;
     info->start_time = DirtyStat.start_time;
     info->calc_time = DirtyStat.calc_time;
     info->sample_pages = DirtyStat.sample_pages;
+    info->mode = dirtyrate_mode;
 
     trace_query_dirty_rate_info(DirtyRateStatus_str(CalculatingState));
 
@@ -98,6 +134,11 @@ static void init_dirtyrate_stat(int64_t start_time, int64_t calc_time,
     DirtyStat.start_time = start_time;
     DirtyStat.calc_time = calc_time;
     DirtyStat.sample_pages = sample_pages;
+    g_free(DirtyStat.vcpu_stat.rates);
+    DirtyStat.vcpu_stat.rates = NULL;
+    DirtyStat.vcpu_stat.nvcpu = 0;
+    qapi_free_DirtyRateRamBlockList(DirtyStat.ramblock_rates);
+    DirtyStat.ramblock_rates = NULL;
 }
 
 static void update_dirtyrate_stat(struct RamblockDirtyInfo *info)
@@ -334,7 +375,90 @@ static bool compare_page_hash_info(struct RamblockDirtyInfo *info,
     return true;
 }
 
-static void calculate_dirtyrate(struct DirtyRateConfig config)
+static void calculate_dirtyrate_dirty_ring(struct DirtyRateConfig config)
+{
+    int64_t dirtyrate = 0;
+    int i;
+
+    DirtyStat.start_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME) / 1000;
+    vcpu_calculate_dirtyrate(config.sample_period_seconds * 1000,
+                             &DirtyStat.vcpu_stat,
+                             GLOBAL_DIRTY_DIRTY_RATE, true);
+
+    for (i = 0; i < DirtyStat.vcpu_stat.nvcpu; i++) {
+        DirtyRateVcpu *rate = &DirtyStat.vcpu_stat.rates[i];
+
+        trace_dirtyrate_do_calculate_vcpu(rate->id, rate->dirty_rate);
+        dirtyrate += rate->dirty_rate;
+    }
+    DirtyStat.dirty_rate = dirtyrate;
+}
+
+/*
+ * Clear the migration dirty bitmap of every RAMBlock.  Unless @rates is
+ * NULL, append to it the rate at which each block got dirty over @msec.
+ */
+static void dirty_bitmap_count_and_clear(DirtyRateRamBlockList ***rates,
+                                         int64_t msec)
+{
+    RAMBlock *block;
+
+    RAMBLOCK_FOREACH_MIGRATABLE(block) {
+        uint64_t pages;
+        DirtyRateRamBlock *rate;
+
+        pages = cpu_physical_memory_count_and_clear_dirty(
+                    block->offset, block->used_length, DIRTY_MEMORY_MIGRATION);
+        if (!rates) {
+            continue;
+        }
+
+        rate = g_new(DirtyRateRamBlock, 1);
+        rate->id = g_strdup(block->idstr);
+        rate->dirty_rate = pages * TARGET_PAGE_SIZE * 1000 / msec / MiB;
+        trace_dirtyrate_do_calculate_ramblock(block->idstr, pages,
+                                              rate->dirty_rate);
+        DirtyStat.dirty_rate += rate->dirty_rate;
+        QAPI_LIST_APPEND(*rates, rate);
+    }
+}
+
+static void calculate_dirtyrate_dirty_bitmap(struct DirtyRateConfig config)
+{
+    DirtyRateRamBlockList **tail = &DirtyStat.ramblock_rates;
+    int64_t msec, initial_time;
+
+    rcu_register_thread();
+
+    qemu_mutex_lock_iothread();
+    memory_global_dirty_log_start(GLOBAL_DIRTY_DIRTY_RATE);
+    /* Only count what gets dirtied from now on */
+    memory_global_dirty_log_sync();
+    WITH_RCU_READ_LOCK_GUARD() {
+        dirty_bitmap_count_and_clear(NULL, 0);
+    }
+    initial_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+    qemu_mutex_unlock_iothread();
+
+    msec = set_sample_page_period(config.sample_period_seconds * 1000,
+                                  initial_time);
+    DirtyStat.start_time = initial_time / 1000;
+    DirtyStat.calc_time = msec / 1000;
+    DirtyStat.dirty_rate = 0;
+
+    qemu_mutex_lock_iothread();
+    memory_global_dirty_log_sync();
+    WITH_RCU_READ_LOCK_GUARD() {
+        dirty_bitmap_count_and_clear(&tail, msec);
+    }
+    memory_global_dirty_log_stop(GLOBAL_DIRTY_DIRTY_RATE);
+    dirty_bitmap_measuring = false;
+    qemu_mutex_unlock_iothread();
+
+    rcu_unregister_thread();
+}
+
+static void calculate_dirtyrate_sample_vm(struct DirtyRateConfig config)
 {
     struct RamblockDirtyInfo *block_dinfo = NULL;
     int block_count = 0;
@@ -367,6 +491,19 @@ out:
     rcu_unregister_thread();
 }
 
+static void calculate_dirtyrate(struct DirtyRateConfig config)
+{
+    if (config.mode == DIRTY_RATE_MEASURE_MODE_DIRTY_RING) {
+        calculate_dirtyrate_dirty_ring(config);
+    } else if (config.mode == DIRTY_RATE_MEASURE_MODE_DIRTY_BITMAP) {
+        calculate_dirtyrate_dirty_bitmap(config);
+    } else {
+        calculate_dirtyrate_sample_vm(config);
+    }
+
+    trace_dirtyrate_calculate(DirtyStat.dirty_rate);
+}
+
 void *get_dirtyrate_thread(void *arg)
 {
     struct DirtyRateConfig config = *(struct DirtyRateConfig *)arg;
@@ -397,8 +534,12 @@ void *get_dirtyrate_thread(void *arg)
     return NULL;
 }
 
-void qmp_calc_dirty_rate(int64_t calc_time, bool has_sample_pages,
-                         int64_t sample_pages, Error **errp)
+void qmp_calc_dirty_rate(int64_t calc_time,
+                         bool has_sample_pages,
+                         int64_t sample_pages,
+                         bool has_mode,
+                         DirtyRateMeasureMode mode,
+                         Error **errp)
 {
     static struct DirtyRateConfig config;
     QemuThread thread;
@@ -419,6 +560,34 @@ void qmp_calc_dirty_rate(int64_t calc_time, bool has_sample_pages,
         return;
     }
 
+    if (!has_mode) {
+        mode = DIRTY_RATE_MEASURE_MODE_PAGE_SAMPLING;
+    }
+
+    if (has_sample_pages && mode != DIRTY_RATE_MEASURE_MODE_PAGE_SAMPLING) {
+        error_setg(errp, "sample-pages can only be specified with the "
+                         "page-sampling mode.");
+        return;
+    }
+
+    if (mode == DIRTY_RATE_MEASURE_MODE_DIRTY_RING &&
+        (!kvm_enabled() || !kvm_dirty_ring_enabled())) {
+        error_setg(errp, "dirty ring is disabled, use sample-pages method "
+                         "or remeasure later.");
+        return;
+    }
+
+    /*
+     * The dirty-bitmap mode consumes the bits that migration relies on to
+     * know which pages to resend.
+     */
+    if (mode == DIRTY_RATE_MEASURE_MODE_DIRTY_BITMAP &&
+        migration_is_running(migrate_get_current()->state)) {
+        error_setg(errp, "dirty-bitmap mode cannot be used while a "
+                         "migration is running.");
+        return;
+    }
+
     if (has_sample_pages) {
         if (!is_sample_pages_valid(sample_pages)) {
             error_setg(errp, "sample-pages is out of range[%d, %d].",
@@ -442,10 +611,18 @@ void qmp_calc_dirty_rate(int64_t calc_time, bool has_sample_pages,
 
     config.sample_period_seconds = calc_time;
     config.sample_pages_per_gigabytes = sample_pages;
+    config.mode = mode;
+    dirtyrate_mode = mode;
+    dirty_bitmap_measuring = (mode == DIRTY_RATE_MEASURE_MODE_DIRTY_BITMAP);
     qemu_thread_create(&thread, "get_dirtyrate", get_dirtyrate_thread,
                        (void *)&config, QEMU_THREAD_DETACHED);
 }
 
+bool dirtyrate_dirty_bitmap_measuring(void)
+{
+    return dirty_bitmap_measuring;
+}
+
 struct DirtyRateInfo *qmp_query_dirty_rate(Error **errp)
 {
     return query_dirty_rate_info();
@@ -459,17 +636,39 @@ void hmp_info_dirty_rate(Monitor *mon, const QDict *qdict)
                    DirtyRateStatus_str(info->status));
     monitor_printf(mon, "Start Time: %"PRIi64" (ms)\n",
                    info->start_time);
-    monitor_printf(mon, "Sample Pages: %"PRIu64" (per GB)\n",
-                   info->sample_pages);
+    monitor_printf(mon, "Mode: %s\n",
+                   DirtyRateMeasureMode_str(info->mode));
+    if (info->mode == DIRTY_RATE_MEASURE_MODE_PAGE_SAMPLING) {
+        monitor_printf(mon, "Sample Pages: %"PRIu64" (per GB)\n",
+                       info->sample_pages);
+    }
     monitor_printf(mon, "Period: %"PRIi64" (sec)\n",
                    info->calc_time);
     monitor_printf(mon, "Dirty rate: ");
     if (info->has_dirty_rate) {
         monitor_printf(mon, "%"PRIi64" (MB/s)\n", info->dirty_rate);
+        if (info->has_vcpu_dirty_rate) {
+            DirtyRateVcpuList *rate;
+
+            for (rate = info->vcpu_dirty_rate; rate; rate = rate->next) {
+                monitor_printf(mon, "vcpu[%"PRIi64"], Dirty rate: %"PRIi64
+                               " (MB/s)\n", rate->value->id,
+                               rate->value->dirty_rate);
+            }
+        }
+        if (info->has_ramblock_dirty_rate) {
+            DirtyRateRamBlockList *rate;
+
+            for (rate = info->ramblock_dirty_rate; rate; rate = rate->next) {
+                monitor_printf(mon, "ramblock %s, Dirty rate: %"PRIi64
+                               " (MB/s)\n", rate->value->id,
+                               rate->value->dirty_rate);
+            }
+        }
     } else {
         monitor_printf(mon, "(not ready)\n");
     }
-    g_free(info);
+    qapi_free_DirtyRateInfo(info);
 }
 
 void hmp_calc_dirty_rate(Monitor *mon, const QDict *qdict)
@@ -477,6 +676,9 @@ void hmp_calc_dirty_rate(Monitor *mon, const QDict *qdict)
     int64_t sec = qdict_get_try_int(qdict, "second", 0);
     int64_t sample_pages = qdict_get_try_int(qdict, "sample_pages_per_GB", -1);
     bool has_sample_pages = (sample_pages != -1);
+    bool dirty_ring = qdict_get_try_bool(qdict, "dirty_ring", false);
+    bool dirty_bitmap = qdict_get_try_bool(qdict, "dirty_bitmap", false);
+    DirtyRateMeasureMode mode = DIRTY_RATE_MEASURE_MODE_PAGE_SAMPLING;
     Error *err = NULL;
 
     if (!sec) {
@@ -484,7 +686,20 @@ void hmp_calc_dirty_rate(Monitor *mon, const QDict *qdict)
         return;
     }
 
-    qmp_calc_dirty_rate(sec, has_sample_pages, sample_pages, &err);
+    if (dirty_ring && dirty_bitmap) {
+        monitor_printf(mon, "Either dirty ring or dirty bitmap "
+                       "can be specified!\n");
+        return;
+    }
+
+    if (dirty_ring) {
+        mode = DIRTY_RATE_MEASURE_MODE_DIRTY_RING;
+    } else if (dirty_bitmap) {
+        mode = DIRTY_RATE_MEASURE_MODE_DIRTY_BITMAP;
+    }
+
+    qmp_calc_dirty_rate(sec, has_sample_pages, sample_pages, true,
+                        mode, &err);
     if (err) {
         hmp_handle_error(mon, err);
         return;
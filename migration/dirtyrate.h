@@ -13,6 +13,8 @@
 #ifndef QEMU_MIGRATION_DIRTYRATE_H
 #define QEMU_MIGRATION_DIRTYRATE_H
 
+#include "sysemu/dirtylimit.h"
+
 /*
  * Sample 512 pages per GB as default.
  */
@@ -43,6 +45,7 @@
 struct DirtyRateConfig {
     uint64_t sample_pages_per_gigabytes; /* sample pages per GB */
     int64_t sample_period_seconds; /* time duration between two sampling */
+    DirtyRateMeasureMode mode; /* mode of dirtyrate measurement */
 };
 
 /*
@@ -69,7 +72,16 @@ struct DirtyRateStat {
     int64_t start_time; /* calculation start time in units of second */
     int64_t calc_time; /* time duration of two sampling in units of second */
     uint64_t sample_pages; /* sample pages per GB */
+    VcpuStat vcpu_stat; /* per-vCPU dirty rates in dirty-ring mode */
+    /* per-RAMBlock dirty rates in dirty-bitmap mode */
+    DirtyRateRamBlockList *ramblock_rates;
 };
 
 void *get_dirtyrate_thread(void *arg);
+
+/*
+ * True while a dirty-bitmap measurement is clearing the migration dirty
+ * bitmap; migration must not start meanwhile.  Called with the BQL held.
+ */
+bool dirtyrate_dirty_bitmap_measuring(void);
 #endif
@@ -45,6 +45,15 @@ struct PostcopyBlocktimeContext;
  */
 #define CLEAR_BITMAP_SHIFT_MAX            31
 
+/*
+ * The dirty bitmap syncs split the RAM blocks in chunks of 1 << N guest
+ * pages.  The minimum keeps the chunks aligned to a bitmap word, so that
+ * the sync threads never share one; the default is 1G with 4K pages.
+ */
+#define BITMAP_SYNC_CHUNK_SHIFT_MIN        6
+#define BITMAP_SYNC_CHUNK_SHIFT_DEFAULT   18
+#define BITMAP_SYNC_CHUNK_SHIFT_MAX       31
+
 /* State for the incoming migration */
 struct MigrationIncomingState {
     QEMUFile *from_src_file;
@@ -126,10 +135,22 @@ struct MigrationIncomingState {
      * contains valid information.
      */
     QemuMutex page_request_mutex;
+
+    /*
+     * Lazy restore: guest RAM is being loaded from a mapped-ram file on
+     * demand by the fault thread and in the background by
+     * lazy_restore_thread.  lazy_restore_mutex serializes the two.
+     */
+    bool lazy_restore_active;
+    /* The device state is loaded, completion waits for guest RAM */
+    bool lazy_restore_pending_completion;
+    QemuThread lazy_restore_thread;
+    QemuMutex lazy_restore_mutex;
 };
 
 MigrationIncomingState *migration_incoming_get_current(void);
 void migration_incoming_state_destroy(void);
+void migration_incoming_lazy_restore_done(MigrationIncomingState *mis);
 /*
  * Functions to work with blocktime context
  */
@@ -292,6 +313,13 @@ struct MigrationState {
      */
     uint8_t clear_bitmap_shift;
 
+    /*
+     * Size of the chunks that the dirty bitmap sync threads pick up, as
+     * a shift of the guest page size.  Smaller chunks let tests exercise
+     * the parallel sync with small guests.
+     */
+    uint8_t bitmap_sync_chunk_shift;
+
     /*
      * This save hostname when out-going migration starts
      */
@@ -358,6 +386,12 @@ int migrate_decompress_threads(void);
 bool migrate_use_events(void);
 bool migrate_postcopy_blocktime(void);
 bool migrate_background_snapshot(void);
+int migrate_bitmap_sync_threads(void);
+uint64_t migrate_vcpu_dirty_limit(void);
+bool migrate_mapped_ram(void);
+bool migrate_lazy_restore(void);
+bool migrate_dirty_limit(void);
+int migrate_mapped_ram_threads(void);
 
 /* Sending on the return path - generic and then for each message type */
 void migrate_send_rp_shut(MigrationIncomingState *mis,
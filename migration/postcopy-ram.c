@@ -525,6 +525,27 @@ int postcopy_ram_incoming_init(MigrationIncomingState *mis)
     return 0;
 }
 
+static void postcopy_ram_fault_thread_stop(MigrationIncomingState *mis)
+{
+    /* Let the fault thread quit */
+    qatomic_set(&mis->fault_thread_quit, 1);
+    postcopy_fault_thread_notify(mis);
+    trace_postcopy_ram_incoming_cleanup_join();
+    qemu_thread_join(&mis->fault_thread);
+}
+
+static void postcopy_ram_free_tmp_pages(MigrationIncomingState *mis)
+{
+    if (mis->postcopy_tmp_page) {
+        munmap(mis->postcopy_tmp_page, mis->largest_page_size);
+        mis->postcopy_tmp_page = NULL;
+    }
+    if (mis->postcopy_tmp_zero_page) {
+        munmap(mis->postcopy_tmp_zero_page, mis->largest_page_size);
+        mis->postcopy_tmp_zero_page = NULL;
+    }
+}
+
 /*
  * At the end of a migration where postcopy_ram_incoming_init was called.
  */
@@ -535,11 +556,7 @@ int postcopy_ram_incoming_cleanup(MigrationIncomingState *mis)
     if (mis->have_fault_thread) {
         Error *local_err = NULL;
 
-        /* Let the fault thread quit */
-        qatomic_set(&mis->fault_thread_quit, 1);
-        postcopy_fault_thread_notify(mis);
-        trace_postcopy_ram_incoming_cleanup_join();
-        qemu_thread_join(&mis->fault_thread);
+        postcopy_ram_fault_thread_stop(mis);
 
         if (postcopy_notify(POSTCOPY_NOTIFY_INBOUND_END, &local_err)) {
             error_report_err(local_err);
@@ -566,14 +583,7 @@ int postcopy_ram_incoming_cleanup(MigrationIncomingState *mis)
         }
     }
 
-    if (mis->postcopy_tmp_page) {
-        munmap(mis->postcopy_tmp_page, mis->largest_page_size);
-        mis->postcopy_tmp_page = NULL;
-    }
-    if (mis->postcopy_tmp_zero_page) {
-        munmap(mis->postcopy_tmp_zero_page, mis->largest_page_size);
-        mis->postcopy_tmp_zero_page = NULL;
-    }
+    postcopy_ram_free_tmp_pages(mis);
     trace_postcopy_ram_incoming_cleanup_blocktime(
             get_postcopy_total_blocktime());
 
@@ -902,7 +912,7 @@ static void *postcopy_ram_fault_thread(void *opaque)
             break;
         }
 
-        if (!mis->to_src_file) {
+        if (!mis->lazy_restore_active && !mis->to_src_file) {
             /*
              * Possibly someone tells us that the return path is
              * broken already using the event. We should hold until
@@ -979,24 +989,34 @@ static void *postcopy_ram_fault_thread(void *opaque)
                     (uintptr_t)(msg.arg.pagefault.address),
                                 msg.arg.pagefault.feat.ptid, rb);
 
-retry:
-            /*
-             * Send the request to the source - we want to request one
-             * of our host page sizes (which is >= TPS)
-             */
-            ret = migrate_send_rp_req_pages(mis, rb, rb_offset,
-                                            msg.arg.pagefault.address);
-            if (ret) {
-                /* May be network failure, try to wait for recovery */
-                if (ret == -EIO && postcopy_pause_fault_thread(mis)) {
-                    /* We got reconnected somehow, try to continue */
-                    goto retry;
-                } else {
-                    /* This is a unavoidable fault */
-                    error_report("%s: migrate_send_rp_req_pages() get %d",
+            if (mis->lazy_restore_active) {
+                /* No source to ask, the page is in the migration file */
+                ret = ram_lazy_restore_fault(mis, rb, rb_offset);
+                if (ret) {
+                    error_report("%s: ram_lazy_restore_fault() get %d",
                                  __func__, ret);
                     break;
                 }
+            } else {
+retry:
+                /*
+                 * Send the request to the source - we want to request one
+                 * of our host page sizes (which is >= TPS)
+                 */
+                ret = migrate_send_rp_req_pages(mis, rb, rb_offset,
+                                                msg.arg.pagefault.address);
+                if (ret) {
+                    /* May be network failure, try to wait for recovery */
+                    if (ret == -EIO && postcopy_pause_fault_thread(mis)) {
+                        /* We got reconnected somehow, try to continue */
+                        goto retry;
+                    } else {
+                        /* This is a unavoidable fault */
+                        error_report("%s: migrate_send_rp_req_pages() get %d",
+                                     __func__, ret);
+                        break;
+                    }
+                }
             }
         }
 
@@ -1062,7 +1082,11 @@ retry:
     return NULL;
 }
 
-int postcopy_ram_incoming_setup(MigrationIncomingState *mis)
+/*
+ * Open the userfaultfd and start the fault thread; no RAM is registered
+ * with the userfaultfd yet.
+ */
+static int postcopy_ram_fault_thread_setup(MigrationIncomingState *mis)
 {
     /* Open the fd for the kernel to give us userfaults */
     mis->userfault_fd = syscall(__NR_userfaultfd, O_CLOEXEC | O_NONBLOCK);
@@ -1096,12 +1120,6 @@ int postcopy_ram_incoming_setup(MigrationIncomingState *mis)
     qemu_sem_destroy(&mis->fault_thread_sem);
     mis->have_fault_thread = true;
 
-    /* Mark so that we get notified of accesses to unwritten areas */
-    if (foreach_not_ignored_block(ram_block_enable_notify, mis)) {
-        error_report("ram_block_enable_notify failed");
-        return -1;
-    }
-
     mis->postcopy_tmp_page = mmap(NULL, mis->largest_page_size,
                                   PROT_READ | PROT_WRITE, MAP_PRIVATE |
                                   MAP_ANONYMOUS, -1, 0);
@@ -1128,11 +1146,79 @@ int postcopy_ram_incoming_setup(MigrationIncomingState *mis)
     }
     memset(mis->postcopy_tmp_zero_page, '\0', mis->largest_page_size);
 
+    return 0;
+}
+
+int postcopy_ram_incoming_setup(MigrationIncomingState *mis)
+{
+    int ret;
+
+    ret = postcopy_ram_fault_thread_setup(mis);
+    if (ret) {
+        return ret;
+    }
+
+    /* Mark so that we get notified of accesses to unwritten areas */
+    if (foreach_not_ignored_block(ram_block_enable_notify, mis)) {
+        error_report("ram_block_enable_notify failed");
+        return -1;
+    }
+
     trace_postcopy_ram_enable_notify();
 
     return 0;
 }
 
+/*
+ * Lazy restore (see ram.c) reuses the fault thread to load pages from
+ * the migration file on first access, with no source and no return path.
+ */
+int postcopy_ram_lazy_restore_setup(MigrationIncomingState *mis)
+{
+    if (mis->have_fault_thread) {
+        return 0;
+    }
+    return postcopy_ram_fault_thread_setup(mis);
+}
+
+/*
+ * Empty @rb and register it with the userfaultfd, so that every page is
+ * faulted in from the migration file.  rb->postcopy_length must be set.
+ */
+int postcopy_ram_lazy_restore_register(MigrationIncomingState *mis,
+                                       RAMBlock *rb)
+{
+    /* As in nhp_range() and init_range() */
+    qemu_madvise(qemu_ram_get_host_addr(rb), rb->postcopy_length,
+                 QEMU_MADV_NOHUGEPAGE);
+    if (ram_discard_range(qemu_ram_get_idstr(rb), 0, rb->postcopy_length)) {
+        return -1;
+    }
+
+    return ram_block_enable_notify(rb, mis);
+}
+
+int postcopy_ram_lazy_restore_cleanup(MigrationIncomingState *mis)
+{
+    int ret = 0;
+
+    if (mis->have_fault_thread) {
+        postcopy_ram_fault_thread_stop(mis);
+
+        if (foreach_not_ignored_block(cleanup_range, mis)) {
+            ret = -1;
+        }
+
+        trace_postcopy_ram_incoming_cleanup_closeuf();
+        close(mis->userfault_fd);
+        close(mis->userfault_event_fd);
+        mis->have_fault_thread = false;
+    }
+
+    postcopy_ram_free_tmp_pages(mis);
+    return ret;
+}
+
 static int qemu_ufd_copy_ioctl(MigrationIncomingState *mis, void *host_addr,
                                void *from_addr, uint64_t pagesize, RAMBlock *rb)
 {
@@ -1308,6 +1394,25 @@ int postcopy_wake_shared(struct PostCopyFD *pcfd,
     assert(0);
     return -1;
 }
+
+int postcopy_ram_lazy_restore_setup(MigrationIncomingState *mis)
+{
+    error_report("%s: No OS support", __func__);
+    return -1;
+}
+
+int postcopy_ram_lazy_restore_register(MigrationIncomingState *mis,
+                                       RAMBlock *rb)
+{
+    assert(0);
+    return -1;
+}
+
+int postcopy_ram_lazy_restore_cleanup(MigrationIncomingState *mis)
+{
+    assert(0);
+    return -1;
+}
 #endif
 
 /* ------------------------------------------------------------------------- */
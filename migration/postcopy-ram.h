@@ -78,6 +78,14 @@ int postcopy_place_page(MigrationIncomingState *mis, void *host, void *from,
 int postcopy_place_page_zero(MigrationIncomingState *mis, void *host,
                              RAMBlock *rb);
 
+/*
+ * Lazy restore: serve userfaults from the migration file, see ram.c
+ */
+int postcopy_ram_lazy_restore_setup(MigrationIncomingState *mis);
+int postcopy_ram_lazy_restore_register(MigrationIncomingState *mis,
+                                       RAMBlock *rb);
+int postcopy_ram_lazy_restore_cleanup(MigrationIncomingState *mis);
+
 /* The current postcopy state is read/set by postcopy_state_get/set
  * which update it atomically.
  * The state is updated as postcopy messages are received, and
@@ -665,6 +665,70 @@ int64_t qemu_ftell(QEMUFile *f)
     return f->pos;
 }
 
+/*
+ * Get the offset in the underlying channel that the next byte put to
+ * (or got from) @f corresponds to.  The channel must support seeking.
+ *
+ * Returns the offset, or -1 on error (which is also set on @f)
+ */
+off_t qemu_get_offset(QEMUFile *f)
+{
+    QIOChannel *ioc = qemu_file_get_ioc(f);
+    Error *local_err = NULL;
+    off_t ret;
+
+    if (!ioc) {
+        qemu_file_set_error(f, -EINVAL);
+        return -1;
+    }
+
+    if (qemu_file_is_writable(f)) {
+        qemu_fflush(f);
+    }
+
+    ret = qio_channel_io_seek(ioc, 0, SEEK_CUR, &local_err);
+    if (ret < 0) {
+        qemu_file_set_error_obj(f, -EINVAL, local_err);
+        return -1;
+    }
+
+    if (!qemu_file_is_writable(f)) {
+        /* Account for data read ahead into the buffer but not consumed */
+        ret -= f->buf_size - f->buf_index;
+    }
+    return ret;
+}
+
+/*
+ * Move the position of the underlying channel of @f, flushing any
+ * pending output first or dropping any read-ahead data.  @whence is
+ * one of SEEK_SET or SEEK_CUR.
+ */
+void qemu_set_offset(QEMUFile *f, off_t off, int whence)
+{
+    QIOChannel *ioc = qemu_file_get_ioc(f);
+    Error *local_err = NULL;
+
+    if (!ioc) {
+        qemu_file_set_error(f, -EINVAL);
+        return;
+    }
+
+    if (qemu_file_is_writable(f)) {
+        qemu_fflush(f);
+    } else {
+        if (whence == SEEK_CUR) {
+            off -= f->buf_size - f->buf_index;
+        }
+        f->buf_index = 0;
+        f->buf_size = 0;
+    }
+
+    if (qio_channel_io_seek(ioc, off, whence, &local_err) < 0) {
+        qemu_file_set_error_obj(f, -EINVAL, local_err);
+    }
+}
+
 int qemu_file_rate_limit(QEMUFile *f)
 {
     if (f->shutdown) {
@@ -28,6 +28,7 @@
 
 #include "qemu/osdep.h"
 #include "qemu/cutils.h"
+#include "qemu/units.h"
 #include "qemu/bitops.h"
 #include "qemu/bitmap.h"
 #include "qemu/main-loop.h"
@@ -51,6 +52,7 @@
 #include "migration/colo.h"
 #include "block.h"
 #include "sysemu/cpu-throttle.h"
+#include "sysemu/dirtylimit.h"
 #include "savevm.h"
 #include "qemu/iov.h"
 #include "multifd.h"
@@ -79,6 +81,21 @@
 /* 0x80 is reserved in migration.h start with 0x100 next */
 #define RAM_SAVE_FLAG_COMPRESS_PAGE    0x100
 
+/*
+ * mapped-ram: every RAM block is followed in the stream by a header
+ * (version, target page size, bitmap offset, pages offset) and a hole
+ * in the file covering its dirty bitmap and its pages.  The pages
+ * region is aligned so that the file can be mapped or read with
+ * O_DIRECT-friendly offsets.
+ */
+#define MAPPED_RAM_HDR_VERSION 1
+#define MAPPED_RAM_HDR_SIZE    (4 + 3 * 8)
+#define MAPPED_RAM_FILE_OFFSET_ALIGNMENT 0x100000
+/* Don't bother spawning loader threads for blocks smaller than this */
+#define MAPPED_RAM_LOAD_MIN_CHUNK (64 * MiB)
+/* Amount of RAM read at once by the lazy restore background thread */
+#define LAZY_RESTORE_CHUNK (1 * MiB)
+
 static inline bool is_zero_range(uint8_t *p, uint64_t size)
 {
     return buffer_is_zero(p, size);
@@ -102,6 +119,14 @@ static struct {
     uint8_t *decoded_buf;
 } XBZRLE;
 
+/* Lazy restore of guest RAM from a mapped-ram file */
+static struct {
+    /* the migration file; outlives the incoming QEMUFile */
+    QIOChannel *ioc;
+    /* set by the background thread if loading a page failed */
+    bool failed;
+} lazy_restore;
+
 static void XBZRLE_cache_lock(void)
 {
     if (migrate_use_xbzrle()) {
@@ -961,7 +986,19 @@ static void migration_trigger_throttle(RAMState *rs)
     /* During block migration the auto-converge logic incorrectly detects
      * that ram migration makes no progress. Avoid this by disabling the
      * throttling logic during the bulk phase of block migration. */
-    if (migrate_auto_converge() && !blk_mig_bulk_active()) {
+    if (migrate_dirty_limit() && !blk_mig_bulk_active()) {
+        /*
+         * Same trigger as auto-converge, but only the vCPUs dirtying
+         * memory faster than vcpu-dirty-limit get throttled.  The limit
+         * is re-applied so that changes of the parameter take effect.
+         */
+        if ((bytes_dirty_period > bytes_dirty_threshold) &&
+            (dirtylimit_in_service() || ++rs->dirty_rate_high_cnt >= 2)) {
+            trace_migration_dirty_limit_guest(migrate_vcpu_dirty_limit());
+            rs->dirty_rate_high_cnt = 0;
+            dirtylimit_start(migrate_vcpu_dirty_limit());
+        }
+    } else if (migrate_auto_converge() && !blk_mig_bulk_active()) {
         /* The following detection logic can be refined later. For now:
            Check to see if the ratio between dirtied bytes and the approx.
            amount of bytes that just got transferred since the last time
@@ -978,10 +1015,207 @@ static void migration_trigger_throttle(RAMState *rs)
     }
 }
 
-static void migration_bitmap_sync(RAMState *rs)
+typedef struct BitmapSyncChunk {
+    RAMBlock *block;
+    ram_addr_t start;
+    ram_addr_t length;
+} BitmapSyncChunk;
+
+typedef struct BitmapSyncWorker {
+    QemuThread thread;
+    /* Posted to start a sync, or to quit */
+    QemuSemaphore sem;
+    bool quit;
+    uint64_t new_dirty_pages;
+} BitmapSyncWorker;
+
+/*
+ * Workers of the bitmap sync, started with the migration so that each
+ * iteration does not pay for creating threads.
+ */
+static struct {
+    BitmapSyncWorker *workers;
+    int nworkers;
+    /* Posted by each worker when it is done with a sync */
+    QemuSemaphore done;
+    /* Unit of work, see x-bitmap-sync-chunk-shift */
+    ram_addr_t chunk_size;
+    /* The sync in progress */
+    BitmapSyncChunk *chunks;
+    int nchunks;
+    /* Next chunk to synchronize, shared by all the threads */
+    int next;
+} bitmap_sync;
+
+/* Called with RCU critical section */
+static uint64_t bitmap_sync_chunks(void)
+{
+    uint64_t new_dirty_pages = 0;
+    int i;
+
+    while ((i = qatomic_fetch_inc(&bitmap_sync.next)) < bitmap_sync.nchunks) {
+        BitmapSyncChunk *c = &bitmap_sync.chunks[i];
+
+        new_dirty_pages +=
+            cpu_physical_memory_sync_dirty_bitmap(c->block, c->start,
+                                                  c->length);
+    }
+    return new_dirty_pages;
+}
+
+static void *bitmap_sync_thread(void *opaque)
+{
+    BitmapSyncWorker *w = opaque;
+
+    rcu_register_thread();
+    while (true) {
+        qemu_sem_wait(&w->sem);
+        if (qatomic_read(&w->quit)) {
+            break;
+        }
+        WITH_RCU_READ_LOCK_GUARD() {
+            w->new_dirty_pages = bitmap_sync_chunks();
+        }
+        qemu_sem_post(&bitmap_sync.done);
+    }
+    rcu_unregister_thread();
+
+    return NULL;
+}
+
+/*
+ * Start the workers of the bitmap sync.  The thread doing the sync
+ * takes its share of the chunks too, so bitmap-sync-threads - 1 workers
+ * are needed.
+ */
+static void bitmap_sync_setup(void)
+{
+    uint8_t shift = migrate_get_current()->bitmap_sync_chunk_shift;
+    int i;
+
+    if (shift > BITMAP_SYNC_CHUNK_SHIFT_MAX) {
+        error_report("bitmap_sync_chunk_shift (%u) too big, using "
+                     "max value (%u)", shift, BITMAP_SYNC_CHUNK_SHIFT_MAX);
+        shift = BITMAP_SYNC_CHUNK_SHIFT_MAX;
+    } else if (shift < BITMAP_SYNC_CHUNK_SHIFT_MIN) {
+        error_report("bitmap_sync_chunk_shift (%u) too small, using "
+                     "min value (%u)", shift, BITMAP_SYNC_CHUNK_SHIFT_MIN);
+        shift = BITMAP_SYNC_CHUNK_SHIFT_MIN;
+    }
+    bitmap_sync.chunk_size = (ram_addr_t)TARGET_PAGE_SIZE << shift;
+
+    bitmap_sync.nworkers = migrate_bitmap_sync_threads() - 1;
+    if (bitmap_sync.nworkers <= 0) {
+        bitmap_sync.nworkers = 0;
+        return;
+    }
+
+    qemu_sem_init(&bitmap_sync.done, 0);
+    bitmap_sync.workers = g_new0(BitmapSyncWorker, bitmap_sync.nworkers);
+    for (i = 0; i < bitmap_sync.nworkers; i++) {
+        BitmapSyncWorker *w = &bitmap_sync.workers[i];
+
+        qemu_sem_init(&w->sem, 0);
+        qemu_thread_create(&w->thread, "bitmap-sync", bitmap_sync_thread,
+                           w, QEMU_THREAD_JOINABLE);
+    }
+}
+
+static void bitmap_sync_cleanup(void)
+{
+    int i;
+
+    if (!bitmap_sync.workers) {
+        return;
+    }
+
+    for (i = 0; i < bitmap_sync.nworkers; i++) {
+        BitmapSyncWorker *w = &bitmap_sync.workers[i];
+
+        qatomic_set(&w->quit, true);
+        qemu_sem_post(&w->sem);
+        qemu_thread_join(&w->thread);
+        qemu_sem_destroy(&w->sem);
+    }
+    qemu_sem_destroy(&bitmap_sync.done);
+    g_free(bitmap_sync.workers);
+    bitmap_sync.workers = NULL;
+    bitmap_sync.nworkers = 0;
+}
+
+/*
+ * Split the RAM blocks in bitmap_sync.chunk_size pieces and synchronize them
+ * from up to bitmap-sync-threads threads; on large guests a serial walk
+ * of the bitmap dominates the time spent holding the BQL.  Without the
+ * workers, e.g. for COLO on the destination, the walk is serial.
+ *
+ * Called with RCU critical section and bitmap_mutex held; returns the
+ * number of threads used.
+ */
+static int migration_bitmap_sync_blocks(RAMState *rs)
 {
+    g_autofree BitmapSyncChunk *chunks = NULL;
+    uint64_t new_dirty_pages;
     RAMBlock *block;
-    int64_t end_time;
+    int nchunks = 0;
+    int i, nthreads;
+
+    if (bitmap_sync.nworkers) {
+        RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+            nchunks += DIV_ROUND_UP(block->used_length,
+                                    bitmap_sync.chunk_size);
+        }
+    }
+
+    nthreads = MIN(bitmap_sync.nworkers + 1, nchunks);
+    if (nthreads <= 1) {
+        RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+            ramblock_sync_dirty_bitmap(rs, block);
+        }
+        return 1;
+    }
+
+    chunks = g_new(BitmapSyncChunk, nchunks);
+    i = 0;
+    RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+        ram_addr_t start;
+
+        for (start = 0; start < block->used_length;
+             start += bitmap_sync.chunk_size) {
+            chunks[i].block = block;
+            chunks[i].start = start;
+            chunks[i].length = MIN(bitmap_sync.chunk_size,
+                                   block->used_length - start);
+            i++;
+        }
+    }
+
+    bitmap_sync.chunks = chunks;
+    bitmap_sync.nchunks = nchunks;
+    qatomic_set(&bitmap_sync.next, 0);
+    /* The semaphores order the setup above before the workers' reads */
+    for (i = 0; i < nthreads - 1; i++) {
+        qemu_sem_post(&bitmap_sync.workers[i].sem);
+    }
+    new_dirty_pages = bitmap_sync_chunks();
+
+    for (i = 0; i < nthreads - 1; i++) {
+        qemu_sem_wait(&bitmap_sync.done);
+    }
+    for (i = 0; i < nthreads - 1; i++) {
+        new_dirty_pages += bitmap_sync.workers[i].new_dirty_pages;
+    }
+    bitmap_sync.chunks = NULL;
+
+    rs->migration_dirty_pages += new_dirty_pages;
+    rs->num_dirty_pages_period += new_dirty_pages;
+    return nthreads;
+}
+
+static void migration_bitmap_sync(RAMState *rs)
+{
+    int64_t start_us, end_time;
+    int nthreads;
 
     ram_counters.dirty_sync_count++;
 
@@ -990,19 +1224,21 @@ static void migration_bitmap_sync(RAMState *rs)
     }
 
     trace_migration_bitmap_sync_start();
+    start_us = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
     memory_global_dirty_log_sync();
 
     qemu_mutex_lock(&rs->bitmap_mutex);
     WITH_RCU_READ_LOCK_GUARD() {
-        RAMBLOCK_FOREACH_NOT_IGNORED(block) {
-            ramblock_sync_dirty_bitmap(rs, block);
-        }
+        nthreads = migration_bitmap_sync_blocks(rs);
         ram_counters.remaining = ram_bytes_remaining();
     }
     qemu_mutex_unlock(&rs->bitmap_mutex);
 
     memory_global_after_dirty_log_sync();
-    trace_migration_bitmap_sync_end(rs->num_dirty_pages_period);
+    ram_counters.dirty_sync_duration =
+        qemu_clock_get_us(QEMU_CLOCK_REALTIME) - start_us;
+    trace_migration_bitmap_sync_end(rs->num_dirty_pages_period, nthreads,
+                                    ram_counters.dirty_sync_duration);
 
     end_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
 
@@ -1212,6 +1448,50 @@ static int ram_save_page(RAMState *rs, PageSearchStatus *pss, bool last_stage)
     return pages;
 }
 
+/**
+ * save_mapped_ram_page: write the page at its fixed offset in the file
+ *
+ * Returns the number of pages written (always 1) or negative on error.
+ * Zero pages are not written, their bit in the file bitmap is cleared
+ * instead so that a stale copy from a previous iteration is ignored.
+ *
+ * @rs: current RAM state
+ * @block: block that contains the page we want to send
+ * @offset: offset inside the block for the page
+ */
+static int save_mapped_ram_page(RAMState *rs, RAMBlock *block,
+                                ram_addr_t offset)
+{
+    QIOChannel *ioc = qemu_file_get_ioc(rs->f);
+    uint8_t *p = block->host + offset;
+    unsigned long page = offset >> TARGET_PAGE_BITS;
+    Error *local_err = NULL;
+    ssize_t ret;
+
+    if (is_zero_range(p, TARGET_PAGE_SIZE)) {
+        clear_bit(page, block->file_bmap);
+        ram_counters.duplicate++;
+        return 1;
+    }
+
+    ret = qio_channel_pwrite(ioc, (char *)p, TARGET_PAGE_SIZE,
+                             block->pages_offset + offset, &local_err);
+    if (ret != TARGET_PAGE_SIZE) {
+        if (!local_err) {
+            error_setg(&local_err, "Short write of page at offset "
+                       RAM_ADDR_FMT " in block %s", offset, block->idstr);
+        }
+        qemu_file_set_error_obj(rs->f, -EIO, local_err);
+        return -EIO;
+    }
+
+    set_bit(page, block->file_bmap);
+    qemu_file_update_transfer(rs->f, TARGET_PAGE_SIZE);
+    ram_counters.transferred += TARGET_PAGE_SIZE;
+    ram_counters.normal++;
+    return 1;
+}
+
 static int ram_save_multifd_page(RAMState *rs, RAMBlock *block,
                                  ram_addr_t offset)
 {
@@ -1985,6 +2265,10 @@ static int ram_save_target_page(RAMState *rs, PageSearchStatus *pss,
         return res;
     }
 
+    if (migrate_mapped_ram()) {
+        return save_mapped_ram_page(rs, block, offset);
+    }
+
     if (save_compress_page(rs, block, offset)) {
         return 1;
     }
@@ -2218,7 +2502,7 @@ static void ram_save_cleanup(void *opaque)
         /* caller have hold iothread lock or is in a bh, so there is
          * no writing race against the migration bitmap
          */
-        memory_global_dirty_log_stop();
+        memory_global_dirty_log_stop(GLOBAL_DIRTY_MIGRATION);
     }
 
     RAMBLOCK_FOREACH_NOT_IGNORED(block) {
@@ -2226,10 +2510,13 @@ static void ram_save_cleanup(void *opaque)
         block->clear_bmap = NULL;
         g_free(block->bmap);
         block->bmap = NULL;
+        g_free(block->file_bmap);
+        block->file_bmap = NULL;
     }
 
     xbzrle_cleanup();
     compress_threads_save_cleanup();
+    bitmap_sync_cleanup();
     ram_state_cleanup(rsp);
 }
 
@@ -2680,7 +2967,7 @@ static void ram_init_bitmaps(RAMState *rs)
         ram_list_init_bitmaps();
         /* We don't use dirty log with background snapshots */
         if (!migrate_background_snapshot()) {
-            memory_global_dirty_log_start();
+            memory_global_dirty_log_start(GLOBAL_DIRTY_MIGRATION);
             migration_bitmap_sync_precopy(rs);
         }
     }
@@ -2699,6 +2986,7 @@ static int ram_init_all(RAMState **rsp)
         return -1;
     }
 
+    bitmap_sync_setup();
     ram_init_bitmaps(*rsp);
 
     return 0;
@@ -2793,6 +3081,74 @@ void qemu_guest_free_page_hint(void *addr, size_t len)
  * granularity of these critical sections.
  */
 
+/**
+ * mapped_ram_setup_ramblock: reserve the file region of a RAM block
+ *
+ * Writes the mapped-ram header of @block and moves the file position
+ * past the space set aside for its bitmap and pages.
+ *
+ * @f: QEMUFile where to send the data
+ * @block: RAM block being described
+ */
+static void mapped_ram_setup_ramblock(QEMUFile *f, RAMBlock *block)
+{
+    unsigned long num_pages = block->used_length >> TARGET_PAGE_BITS;
+    size_t bitmap_size = BITS_TO_LONGS(num_pages) * sizeof(unsigned long);
+    off_t offset;
+
+    offset = qemu_get_offset(f);
+    if (offset < 0) {
+        return;
+    }
+
+    block->file_bmap = bitmap_new(num_pages);
+    block->bitmap_offset = offset + MAPPED_RAM_HDR_SIZE;
+    block->pages_offset = ROUND_UP(block->bitmap_offset + bitmap_size,
+                                   MAPPED_RAM_FILE_OFFSET_ALIGNMENT);
+
+    qemu_put_be32(f, MAPPED_RAM_HDR_VERSION);
+    qemu_put_be64(f, TARGET_PAGE_SIZE);
+    qemu_put_be64(f, block->bitmap_offset);
+    qemu_put_be64(f, block->pages_offset);
+
+    /* The bitmap and the pages are written with pwrite later */
+    qemu_set_offset(f, block->pages_offset + block->used_length, SEEK_SET);
+}
+
+/**
+ * mapped_ram_write_bitmaps: store the file bitmap of every RAM block
+ *
+ * Returns zero on success or negative on error
+ *
+ * @f: QEMUFile where to send the data
+ */
+static int mapped_ram_write_bitmaps(QEMUFile *f)
+{
+    QIOChannel *ioc = qemu_file_get_ioc(f);
+    RAMBlock *block;
+
+    RAMBLOCK_FOREACH_MIGRATABLE(block) {
+        unsigned long num_pages = block->used_length >> TARGET_PAGE_BITS;
+        size_t bitmap_size = BITS_TO_LONGS(num_pages) * sizeof(unsigned long);
+        g_autofree unsigned long *le_bitmap = bitmap_new(num_pages);
+        Error *local_err = NULL;
+
+        bitmap_to_le(le_bitmap, block->file_bmap, num_pages);
+        if (qio_channel_pwrite(ioc, (char *)le_bitmap, bitmap_size,
+                               block->bitmap_offset,
+                               &local_err) != bitmap_size) {
+            if (!local_err) {
+                error_setg(&local_err, "Short write of the bitmap of block %s",
+                           block->idstr);
+            }
+            qemu_file_set_error_obj(f, -EIO, local_err);
+            return -EIO;
+        }
+    }
+
+    return 0;
+}
+
 /**
  * ram_save_setup: Setup RAM for migration
  *
@@ -2806,6 +3162,16 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
     RAMState **rsp = opaque;
     RAMBlock *block;
 
+    if (migrate_mapped_ram()) {
+        QIOChannel *ioc = qemu_file_get_ioc(f);
+
+        if (!ioc ||
+            !qio_channel_has_feature(ioc, QIO_CHANNEL_FEATURE_SEEKABLE)) {
+            error_report("mapped-ram requires a seekable migration channel");
+            return -1;
+        }
+    }
+
     if (compress_threads_save_setup()) {
         return -1;
     }
@@ -2833,6 +3199,9 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
             if (migrate_ignore_shared()) {
                 qemu_put_be64(f, block->mr->addr);
             }
+            if (migrate_mapped_ram()) {
+                mapped_ram_setup_ramblock(f, block);
+            }
         }
     }
 
@@ -3004,6 +3373,10 @@ static int ram_save_complete(QEMUFile *f, void *opaque)
 
         flush_compressed_data(rs);
         ram_control_after_iterate(f, RAM_CONTROL_FINISH);
+
+        if (ret >= 0 && migrate_mapped_ram()) {
+            ret = mapped_ram_write_bitmaps(f);
+        }
     }
 
     if (ret >= 0) {
@@ -3185,6 +3558,447 @@ void ram_handle_compressed(void *host, uint8_t ch, uint64_t size)
     }
 }
 
+typedef struct MappedRamLoadParam {
+    QemuThread thread;
+    QIOChannel *ioc;
+    RAMBlock *block;
+    unsigned long *bitmap;
+    unsigned long start;
+    unsigned long end;
+    off_t pages_offset;
+    Error *err;
+} MappedRamLoadParam;
+
+/*
+ * Load pages [start, end) of a RAM block from a mapped-ram file: runs
+ * of pages present in the bitmap are read with a single pread, pages
+ * absent from it were zero on the source.
+ */
+static void *mapped_ram_load_pages(void *opaque)
+{
+    MappedRamLoadParam *p = opaque;
+    unsigned long page = p->start;
+
+    while (page < p->end) {
+        unsigned long next;
+        size_t offset = page << TARGET_PAGE_BITS;
+
+        if (!test_bit(page, p->bitmap)) {
+            next = find_next_bit(p->bitmap, p->end, page);
+            ram_handle_compressed(p->block->host + offset, 0,
+                                  (next - page) << TARGET_PAGE_BITS);
+            page = next;
+            continue;
+        }
+
+        next = find_next_zero_bit(p->bitmap, p->end, page);
+        while (page < next) {
+            size_t len = (next - page) << TARGET_PAGE_BITS;
+            ssize_t ret;
+
+            offset = page << TARGET_PAGE_BITS;
+            ret = qio_channel_pread(p->ioc, (char *)p->block->host + offset,
+                                    len, p->pages_offset + offset, &p->err);
+            if (ret <= 0) {
+                if (!p->err) {
+                    error_setg(&p->err, "Unexpected end of file reading "
+                               "block %s", p->block->idstr);
+                }
+                return NULL;
+            }
+            /* A regular file only returns a partial page at its end */
+            page += ret >> TARGET_PAGE_BITS;
+            if (ret & ~TARGET_PAGE_MASK) {
+                error_setg(&p->err, "Truncated migration file reading "
+                           "block %s", p->block->idstr);
+                return NULL;
+            }
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Read [offset, offset + len) of a lazily restored RAM block into @buf;
+ * pages absent from the file bitmap are zeroed.
+ */
+static int ram_lazy_restore_read(RAMBlock *rb, ram_addr_t offset, size_t len,
+                                 uint8_t *buf, Error **errp)
+{
+    unsigned long start = offset >> TARGET_PAGE_BITS;
+    unsigned long end = (offset + len) >> TARGET_PAGE_BITS;
+    unsigned long page = start;
+
+    while (page < end) {
+        unsigned long next = find_next_bit(rb->file_bmap, end, page);
+        size_t size;
+        ssize_t ret;
+
+        memset(buf + ((page - start) << TARGET_PAGE_BITS), 0,
+               (next - page) << TARGET_PAGE_BITS);
+        if (next >= end) {
+            break;
+        }
+
+        page = next;
+        next = find_next_zero_bit(rb->file_bmap, end, page);
+        size = (next - page) << TARGET_PAGE_BITS;
+        ret = qio_channel_pread(lazy_restore.ioc,
+                                (char *)buf + ((page - start) << TARGET_PAGE_BITS),
+                                size,
+                                rb->pages_offset + (page << TARGET_PAGE_BITS),
+                                errp);
+        if (ret < 0) {
+            return -EIO;
+        }
+        if (ret != size) {
+            error_setg(errp, "Truncated migration file reading block %s",
+                       rb->idstr);
+            return -EIO;
+        }
+        page = next;
+    }
+
+    return 0;
+}
+
+/*
+ * Place the host page at @offset of @rb, whose content is in @buf,
+ * unless it was loaded already.  Pages that were zero on the source
+ * are placed with UFFDIO_ZEROPAGE where possible.
+ */
+static int ram_lazy_restore_place(MigrationIncomingState *mis, RAMBlock *rb,
+                                  ram_addr_t offset, uint8_t *buf)
+{
+    unsigned long start = offset >> TARGET_PAGE_BITS;
+    unsigned long end = start + (qemu_ram_pagesize(rb) >> TARGET_PAGE_BITS);
+    void *host = rb->host + offset;
+
+    QEMU_LOCK_GUARD(&mis->lazy_restore_mutex);
+
+    if (ramblock_recv_bitmap_test_byte_offset(rb, offset)) {
+        return 0;
+    }
+
+    trace_ram_lazy_restore_place(rb->idstr, offset);
+    if (find_next_bit(rb->file_bmap, end, start) >= end) {
+        return postcopy_place_page_zero(mis, host, rb);
+    }
+    return postcopy_place_page(mis, host, buf, rb);
+}
+
+/**
+ * ram_lazy_restore_fault: serve a userfault from the migration file
+ *
+ * Returns zero on success or negative on error
+ *
+ * Called by the postcopy fault thread.
+ *
+ * @mis: current migration incoming state
+ * @rb: RAM block that faulted
+ * @offset: offset of the faulting host page in @rb
+ */
+int ram_lazy_restore_fault(MigrationIncomingState *mis, RAMBlock *rb,
+                           ram_addr_t offset)
+{
+    Error *local_err = NULL;
+    int ret;
+
+    trace_ram_lazy_restore_fault(rb->idstr, offset);
+
+    ret = ram_lazy_restore_read(rb, offset, qemu_ram_pagesize(rb),
+                                mis->postcopy_tmp_page, &local_err);
+    if (ret) {
+        error_report_err(local_err);
+        return ret;
+    }
+    return ram_lazy_restore_place(mis, rb, offset, mis->postcopy_tmp_page);
+}
+
+static void ram_lazy_restore_finish(void *opaque)
+{
+    MigrationIncomingState *mis = opaque;
+    RAMBlock *rb;
+
+    qemu_thread_join(&mis->lazy_restore_thread);
+    trace_ram_lazy_restore_finish(lazy_restore.failed);
+
+    if (lazy_restore.failed) {
+        /*
+         * Keep the fault thread serving the pages it can: once unregistered
+         * from the userfaultfd, missing pages would silently read as zero.
+         */
+        error_report("Lazy restore of guest RAM failed");
+        migrate_set_state(&mis->state, MIGRATION_STATUS_ACTIVE,
+                          MIGRATION_STATUS_FAILED);
+        /* The guest must not run with part of its RAM missing */
+        vm_stop(RUN_STATE_IO_ERROR);
+        return;
+    }
+
+    postcopy_ram_lazy_restore_cleanup(mis);
+
+    WITH_RCU_READ_LOCK_GUARD() {
+        RAMBLOCK_FOREACH_NOT_IGNORED(rb) {
+            g_free(rb->file_bmap);
+            rb->file_bmap = NULL;
+            g_free(rb->receivedmap);
+            rb->receivedmap = NULL;
+        }
+    }
+    object_unref(OBJECT(lazy_restore.ioc));
+    lazy_restore.ioc = NULL;
+    mis->lazy_restore_active = false;
+
+    migration_incoming_lazy_restore_done(mis);
+}
+
+/*
+ * Load the chunk of the block named @idstr at *@chunk_offset into @buf,
+ * place its pages and advance *@chunk_offset.  Sets *@done once past the
+ * end of the block, or if the block went away.
+ */
+static int ram_lazy_restore_chunk(MigrationIncomingState *mis,
+                                  const char *idstr, ram_addr_t *chunk_offset,
+                                  uint8_t *buf, bool *done, Error **errp)
+{
+    RAMBlock *rb;
+    size_t page_size, len;
+    ram_addr_t offset;
+    int ret;
+
+    RCU_READ_LOCK_GUARD();
+
+    rb = qemu_ram_block_by_name(idstr);
+    if (!rb || !rb->file_bmap || *chunk_offset >= rb->postcopy_length) {
+        *done = true;
+        return 0;
+    }
+
+    page_size = qemu_ram_pagesize(rb);
+    len = MIN(MAX(LAZY_RESTORE_CHUNK, page_size),
+              rb->postcopy_length - *chunk_offset);
+    ret = ram_lazy_restore_read(rb, *chunk_offset, len, buf, errp);
+    for (offset = 0; !ret && offset < len; offset += page_size) {
+        ret = ram_lazy_restore_place(mis, rb, *chunk_offset + offset,
+                                     buf + offset);
+    }
+    *chunk_offset += len;
+    *done = *chunk_offset >= rb->postcopy_length;
+    return ret;
+}
+
+/*
+ * Background thread of a lazy restore: load all pages that were not
+ * faulted in yet, a chunk at a time, then hand over to the main loop.
+ * The RCU read lock is only held for one chunk, so that the restore
+ * does not hold off synchronize_rcu() for its whole duration.
+ */
+static void *ram_lazy_restore_thread(void *opaque)
+{
+    MigrationIncomingState *mis = opaque;
+    size_t buf_size = MAX(LAZY_RESTORE_CHUNK, mis->largest_page_size);
+    uint8_t *buf = qemu_memalign(mis->largest_page_size, buf_size);
+    g_autoptr(GPtrArray) idstrs = g_ptr_array_new_with_free_func(g_free);
+    Error *local_err = NULL;
+    RAMBlock *rb;
+    guint i;
+    int ret = 0;
+
+    rcu_register_thread();
+
+    WITH_RCU_READ_LOCK_GUARD() {
+        RAMBLOCK_FOREACH_NOT_IGNORED(rb) {
+            if (rb->file_bmap) {
+                g_ptr_array_add(idstrs, g_strdup(rb->idstr));
+            }
+        }
+    }
+
+    for (i = 0; !ret && i < idstrs->len; i++) {
+        ram_addr_t chunk_offset = 0;
+        bool done = false;
+
+        while (!ret && !done) {
+            ret = ram_lazy_restore_chunk(mis, g_ptr_array_index(idstrs, i),
+                                         &chunk_offset, buf, &done,
+                                         &local_err);
+        }
+    }
+    if (ret) {
+        if (local_err) {
+            error_report_err(local_err);
+        }
+        lazy_restore.failed = true;
+    }
+
+    qemu_vfree(buf);
+    rcu_unregister_thread();
+    aio_bh_schedule_oneshot(qemu_get_aio_context(),
+                            ram_lazy_restore_finish, mis);
+    return NULL;
+}
+
+/*
+ * Empty @block and arrange for its content to be loaded from the
+ * migration file on demand.  Takes ownership of @bitmap.
+ */
+static int ram_lazy_restore_register(QIOChannel *ioc, RAMBlock *block,
+                                     unsigned long *bitmap,
+                                     off_t pages_offset, ram_addr_t length)
+{
+    MigrationIncomingState *mis = migration_incoming_get_current();
+
+    if (!mis->lazy_restore_active) {
+        lazy_restore.ioc = ioc;
+        object_ref(OBJECT(ioc));
+        lazy_restore.failed = false;
+        /* The fault thread checks this, set it before starting it */
+        mis->lazy_restore_active = true;
+        if (postcopy_ram_lazy_restore_setup(mis)) {
+            return -EINVAL;
+        }
+    }
+
+    block->file_bmap = bitmap;
+    block->pages_offset = pages_offset;
+    block->postcopy_length = length;
+    trace_ram_lazy_restore_register(block->idstr, length,
+                                    bitmap_count_one(bitmap,
+                                                     length >> TARGET_PAGE_BITS));
+
+    return postcopy_ram_lazy_restore_register(mis, block);
+}
+
+/* Start loading in the background whatever the guest does not touch */
+static void ram_lazy_restore_start(MigrationIncomingState *mis)
+{
+    qemu_thread_create(&mis->lazy_restore_thread, "lazy-restore",
+                       ram_lazy_restore_thread, mis, QEMU_THREAD_JOINABLE);
+}
+
+/**
+ * parse_ramblock_mapped_ram: load a RAM block from a mapped-ram file
+ *
+ * Returns zero on success or negative on error
+ *
+ * @f: QEMUFile positioned right after the block's description
+ * @block: RAM block to load
+ * @length: used length of the block on the source
+ */
+static int parse_ramblock_mapped_ram(QEMUFile *f, RAMBlock *block,
+                                     ram_addr_t length)
+{
+    QIOChannel *ioc = qemu_file_get_ioc(f);
+    unsigned long num_pages = length >> TARGET_PAGE_BITS;
+    size_t bitmap_size = BITS_TO_LONGS(num_pages) * sizeof(unsigned long);
+    g_autofree unsigned long *le_bitmap = NULL;
+    g_autofree unsigned long *bitmap = NULL;
+    g_autofree MappedRamLoadParam *params = NULL;
+    uint64_t page_size, bitmap_offset, pages_offset;
+    Error *local_err = NULL;
+    uint32_t version;
+    unsigned long chunk;
+    int i, nthreads;
+    int ret = 0;
+
+    version = qemu_get_be32(f);
+    page_size = qemu_get_be64(f);
+    bitmap_offset = qemu_get_be64(f);
+    pages_offset = qemu_get_be64(f);
+
+    if (version != MAPPED_RAM_HDR_VERSION) {
+        error_report("Unsupported mapped-ram header version %" PRIu32
+                     " for block %s", version, block->idstr);
+        return -EINVAL;
+    }
+    if (page_size != TARGET_PAGE_SIZE) {
+        error_report("Mismatched mapped-ram page size %" PRIu64
+                     " for block %s", page_size, block->idstr);
+        return -EINVAL;
+    }
+    if (!ioc || !qio_channel_has_feature(ioc, QIO_CHANNEL_FEATURE_SEEKABLE)) {
+        error_report("mapped-ram requires a seekable migration channel");
+        return -EINVAL;
+    }
+
+    le_bitmap = bitmap_new(num_pages);
+    if (qio_channel_pread(ioc, (char *)le_bitmap, bitmap_size, bitmap_offset,
+                          &local_err) != bitmap_size) {
+        if (local_err) {
+            error_report_err(local_err);
+        } else {
+            error_report("Short read of the bitmap of block %s", block->idstr);
+        }
+        return -EIO;
+    }
+    bitmap = bitmap_new(num_pages);
+    bitmap_from_le(bitmap, le_bitmap, num_pages);
+
+    if (migrate_lazy_restore()) {
+        ret = ram_lazy_restore_register(ioc, block, g_steal_pointer(&bitmap),
+                                        pages_offset, length);
+        if (ret) {
+            return ret;
+        }
+        /* Continue with the stream after the pages region */
+        qemu_set_offset(f, pages_offset + length, SEEK_SET);
+        return qemu_file_get_error(f);
+    }
+
+    nthreads = MAX(1, MIN(migrate_mapped_ram_threads(),
+                          length / MAPPED_RAM_LOAD_MIN_CHUNK));
+    chunk = DIV_ROUND_UP(num_pages, nthreads);
+    params = g_new0(MappedRamLoadParam, nthreads);
+
+    for (i = 0; i < nthreads; i++) {
+        MappedRamLoadParam *p = &params[i];
+
+        p->ioc = ioc;
+        p->block = block;
+        p->bitmap = bitmap;
+        p->start = i * chunk;
+        p->end = MIN(num_pages, p->start + chunk);
+        p->pages_offset = pages_offset;
+        if (nthreads > 1) {
+            qemu_thread_create(&p->thread, "mapped-ram-load",
+                               mapped_ram_load_pages, p,
+                               QEMU_THREAD_JOINABLE);
+        } else {
+            mapped_ram_load_pages(p);
+        }
+    }
+
+    for (i = 0; i < nthreads; i++) {
+        MappedRamLoadParam *p = &params[i];
+
+        if (nthreads > 1) {
+            qemu_thread_join(&p->thread);
+        }
+        if (p->err) {
+            if (!ret) {
+                error_report_err(p->err);
+                ret = -EIO;
+            } else {
+                error_free(p->err);
+            }
+        }
+    }
+
+    if (!ret) {
+        ramblock_recv_bitmap_set_range(block, block->host, num_pages);
+        trace_ram_load_mapped_ram(block->idstr, num_pages,
+                                  bitmap_count_one(bitmap, num_pages),
+                                  nthreads);
+        /* Continue with the stream after the pages region */
+        qemu_set_offset(f, pages_offset + length, SEEK_SET);
+        ret = qemu_file_get_error(f);
+    }
+
+    return ret;
+}
+
 /* return the size after decompression, or negative value on error */
 static int
 qemu_uncompress_data(z_stream *stream, uint8_t *dest, size_t dest_len,
@@ -3437,7 +4251,7 @@ void colo_incoming_start_dirty_log(void)
             /* Discard this dirty bitmap record */
             bitmap_zero(block->bmap, block->max_length >> TARGET_PAGE_BITS);
         }
-        memory_global_dirty_log_start();
+        memory_global_dirty_log_start(GLOBAL_DIRTY_MIGRATION);
     }
     ram_state->migration_dirty_pages = 0;
     qemu_mutex_unlock_ramlist();
@@ -3449,7 +4263,7 @@ void colo_release_ram_cache(void)
 {
     RAMBlock *block;
 
-    memory_global_dirty_log_stop();
+    memory_global_dirty_log_stop(GLOBAL_DIRTY_MIGRATION);
     RAMBLOCK_FOREACH_NOT_IGNORED(block) {
         g_free(block->bmap);
         block->bmap = NULL;
@@ -3497,6 +4311,11 @@ static int ram_load_cleanup(void *opaque)
     xbzrle_load_cleanup();
     compress_threads_load_cleanup();
 
+    if (migration_incoming_get_current()->lazy_restore_active) {
+        /* Still in use, freed by ram_lazy_restore_finish() */
+        return 0;
+    }
+
     RAMBLOCK_FOREACH_NOT_IGNORED(rb) {
         g_free(rb->receivedmap);
         rb->receivedmap = NULL;
@@ -3900,6 +4719,9 @@ static int ram_load_precopy(QEMUFile *f)
                     }
                     ram_control_load_hook(f, RAM_CONTROL_BLOCK_REG,
                                           block->idstr);
+                    if (!ret && migrate_mapped_ram()) {
+                        ret = parse_ramblock_mapped_ram(f, block, length);
+                    }
                 } else {
                     error_report("Unknown ramblock \"%s\", cannot "
                                  "accept migration", id);
@@ -3908,6 +4730,9 @@ static int ram_load_precopy(QEMUFile *f)
 
                 total_ram_bytes -= length;
             }
+            if (!ret && migration_incoming_get_current()->lazy_restore_active) {
+                ram_lazy_restore_start(migration_incoming_get_current());
+            }
             break;
 
         case RAM_SAVE_FLAG_ZERO:
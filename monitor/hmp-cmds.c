@@ -278,6 +278,8 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
                        info->ram->normal_bytes >> 10);
         monitor_printf(mon, "dirty sync count: %" PRIu64 "\n",
                        info->ram->dirty_sync_count);
+        monitor_printf(mon, "dirty sync duration: %" PRIu64 " us\n",
+                       info->ram->dirty_sync_duration);
         monitor_printf(mon, "page size: %" PRIu64 " kbytes\n",
                        info->ram->page_size >> 10);
         monitor_printf(mon, "multifd bytes: %" PRIu64 " kbytes\n",
@@ -339,6 +341,17 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
                        info->cpu_throttle_percentage);
     }
 
+    if (info->has_vcpu_dirty_rate) {
+        DirtyRateVcpuList *rate;
+
+        monitor_printf(mon, "vcpu dirty rate:");
+        for (rate = info->vcpu_dirty_rate; rate; rate = rate->next) {
+            monitor_printf(mon, " %" PRIi64 ":%" PRIi64 " MB/s",
+                           rate->value->id, rate->value->dirty_rate);
+        }
+        monitor_printf(mon, "\n");
+    }
+
     if (info->has_postcopy_blocktime) {
         monitor_printf(mon, "postcopy blocktime: %u\n",
                        info->postcopy_blocktime);
@@ -487,6 +500,15 @@ void hmp_info_migrate_parameters(Monitor *mon, const QDict *qdict)
         monitor_printf(mon, "%s: '%s'\n",
             MigrationParameter_str(MIGRATION_PARAMETER_TLS_AUTHZ),
             params->tls_authz);
+        monitor_printf(mon, "%s: %u\n",
+            MigrationParameter_str(MIGRATION_PARAMETER_MAPPED_RAM_THREADS),
+            params->mapped_ram_threads);
+        monitor_printf(mon, "%s: %" PRIu64 " MB/s\n",
+            MigrationParameter_str(MIGRATION_PARAMETER_VCPU_DIRTY_LIMIT),
+            params->vcpu_dirty_limit);
+        monitor_printf(mon, "%s: %u\n",
+            MigrationParameter_str(MIGRATION_PARAMETER_BITMAP_SYNC_THREADS),
+            params->bitmap_sync_threads);
 
         if (params->has_block_bitmap_mapping) {
             const BitmapMigrationNodeAliasList *bmnal;
@@ -1395,6 +1417,18 @@ void hmp_migrate_set_parameter(Monitor *mon, const QDict *qdict)
         p->has_announce_step = true;
         visit_type_size(v, param, &p->announce_step, &err);
         break;
+    case MIGRATION_PARAMETER_MAPPED_RAM_THREADS:
+        p->has_mapped_ram_threads = true;
+        visit_type_uint8(v, param, &p->mapped_ram_threads, &err);
+        break;
+    case MIGRATION_PARAMETER_VCPU_DIRTY_LIMIT:
+        p->has_vcpu_dirty_limit = true;
+        visit_type_uint64(v, param, &p->vcpu_dirty_limit, &err);
+        break;
+    case MIGRATION_PARAMETER_BITMAP_SYNC_THREADS:
+        p->has_bitmap_sync_threads = true;
+        visit_type_uint8(v, param, &p->bitmap_sync_threads, &err);
+        break;
     case MIGRATION_PARAMETER_BLOCK_BITMAP_MAPPING:
         error_setg(&err, "The block-bitmap-mapping parameter can only be set "
                    "through QMP");
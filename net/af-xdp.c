@@ -0,0 +1,566 @@
+/*
+ * AF_XDP network backend
+ *
+ * An XDP program attached to a host network interface redirects the
+ * packets of some of its queues to AF_XDP sockets, one per queue.  The
+ * driver and QEMU then exchange packets through rings of descriptors
+ * pointing into a buffer (UMEM) that they share, without going through
+ * the host network stack, and without copies if the driver supports
+ * zero-copy.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include <linux/if_link.h>
+#include <linux/if_xdp.h>
+#include <net/if.h>
+#include <xdp/xsk.h>
+
+#include "clients.h"
+#include "net/eth.h"
+#include "net/net.h"
+#include "qapi/error.h"
+#include "qemu/cutils.h"
+#include "qemu/error-report.h"
+#include "qemu/iov.h"
+#include "qemu/main-loop.h"
+#include "qemu/timer.h"
+
+#ifndef SOL_XDP
+#define SOL_XDP 283
+#endif
+
+/* Packets read from the rx ring every time the socket becomes readable */
+#define AF_XDP_BATCH_SIZE 64
+
+/* Frames of the UMEM: enough to fill the four rings of the socket */
+#define AF_XDP_NUM_FRAMES \
+    (2 * (XSK_RING_PROD__DEFAULT_NUM_DESCS + XSK_RING_CONS__DEFAULT_NUM_DESCS))
+
+#define AF_XDP_FRAME_SIZE XSK_UMEM__DEFAULT_FRAME_SIZE
+
+/* How often to look for completed sends while the UMEM has no free frame */
+#define AF_XDP_TX_RETRY_NS (50 * SCALE_US)
+
+typedef struct AFXDPState {
+    NetClientState       nc;
+    struct xsk_socket    *xsk;
+    struct xsk_umem      *umem;
+    struct xsk_ring_cons rx;
+    struct xsk_ring_prod tx;
+    struct xsk_ring_prod fq;    /* frames given to the driver for rx */
+    struct xsk_ring_cons cq;    /* frames the driver is done sending */
+    char                 ifname[IFNAMSIZ];
+    bool                 read_poll;
+    bool                 write_poll;
+    bool                 busy_poll;
+    uint8_t              *buffer;
+    /* Free frames of the UMEM, used as a stack */
+    uint64_t             *pool;
+    uint32_t             n_pool;
+    uint32_t             outstanding_tx;
+    /* Polls the completion ring, which does not wake up the socket */
+    QEMUTimer            *tx_timer;
+} AFXDPState;
+
+static void af_xdp_send(void *opaque);
+static void af_xdp_writable(void *opaque);
+static bool af_xdp_busy_poll(void *opaque);
+
+static void af_xdp_update_fd_handler(AFXDPState *s)
+{
+    int fd = xsk_socket__fd(s->xsk);
+    IOHandler *fd_read = s->read_poll ? af_xdp_send : NULL;
+    IOHandler *fd_write = s->write_poll ? af_xdp_writable : NULL;
+
+    /* Only IOThreads poll actively, the main loop always waits */
+    if (s->nc.aio_context) {
+        aio_set_fd_handler(s->nc.aio_context, fd, false, fd_read, fd_write,
+                           s->read_poll ? af_xdp_busy_poll : NULL, s);
+    } else {
+        qemu_set_fd_handler(fd, fd_read, fd_write, s);
+    }
+}
+
+static void af_xdp_read_poll(AFXDPState *s, bool enable)
+{
+    if (s->read_poll != enable) {
+        s->read_poll = enable;
+        af_xdp_update_fd_handler(s);
+    }
+}
+
+static void af_xdp_write_poll(AFXDPState *s, bool enable)
+{
+    if (s->write_poll != enable) {
+        s->write_poll = enable;
+        af_xdp_update_fd_handler(s);
+    }
+}
+
+static void af_xdp_poll(NetClientState *nc, bool enable)
+{
+    AFXDPState *s = DO_UPCAST(AFXDPState, nc, nc);
+
+    af_xdp_read_poll(s, enable);
+    af_xdp_write_poll(s, enable);
+}
+
+/* With XDP_USE_NEED_WAKEUP, the kernel only works on the rings when asked */
+static void af_xdp_wakeup(AFXDPState *s)
+{
+    recvfrom(xsk_socket__fd(s->xsk), NULL, 0, MSG_DONTWAIT, NULL, NULL);
+}
+
+static void af_xdp_kick_tx(AFXDPState *s)
+{
+    if (xsk_ring_prod__needs_wakeup(&s->tx)) {
+        /* EAGAIN and EBUSY only mean that the kernel is still busy */
+        sendto(xsk_socket__fd(s->xsk), NULL, 0, MSG_DONTWAIT, NULL, 0);
+    }
+}
+
+static uint64_t af_xdp_frame(uint64_t addr)
+{
+    /* Descriptors may point past the headroom of the frame */
+    return addr & ~(uint64_t)(AF_XDP_FRAME_SIZE - 1);
+}
+
+/* Give up to @n free frames to the driver for receiving */
+static void af_xdp_fq_refill(AFXDPState *s, uint32_t n)
+{
+    uint32_t i, idx = 0;
+
+    n = MIN(n, s->n_pool);
+    if (!n || xsk_ring_prod__reserve(&s->fq, n, &idx) != n) {
+        return;
+    }
+    for (i = 0; i < n; i++) {
+        *xsk_ring_prod__fill_addr(&s->fq, idx++) = s->pool[--s->n_pool];
+    }
+    xsk_ring_prod__submit(&s->fq, n);
+
+    if (xsk_ring_prod__needs_wakeup(&s->fq)) {
+        af_xdp_wakeup(s);
+    }
+}
+
+/* Take back the frames of the packets that the driver has sent */
+static void af_xdp_complete_tx(AFXDPState *s)
+{
+    uint32_t i, done, idx = 0;
+
+    if (!s->outstanding_tx) {
+        return;
+    }
+
+    af_xdp_kick_tx(s);
+    done = xsk_ring_cons__peek(&s->cq, XSK_RING_CONS__DEFAULT_NUM_DESCS, &idx);
+    for (i = 0; i < done; i++) {
+        s->pool[s->n_pool++] = af_xdp_frame(*xsk_ring_cons__comp_addr(&s->cq,
+                                                                      idx++));
+    }
+    xsk_ring_cons__release(&s->cq, done);
+    s->outstanding_tx -= done;
+}
+
+/*
+ * Put the packets on the tx ring.  Packets larger than a frame are
+ * dropped; stops at the first packet that does not fit in the ring or
+ * in the UMEM.
+ */
+static int af_xdp_receive_iov_batch(NetClientState *nc,
+                                    const NetPacketIOV *pkts, int npkts)
+{
+    AFXDPState *s = DO_UPCAST(AFXDPState, nc, nc);
+    uint32_t sent = 0, idx = 0;
+    int i;
+
+    af_xdp_complete_tx(s);
+
+    for (i = 0; i < npkts; i++) {
+        struct xdp_desc *desc;
+        uint64_t addr;
+
+        if (iov_size(pkts[i].iov, pkts[i].iovcnt) > AF_XDP_FRAME_SIZE) {
+            continue;
+        }
+        if (!s->n_pool) {
+            /*
+             * All frames are in flight.  The socket stays writable while
+             * the tx ring has room, so wait for completions on a timer
+             * rather than on POLLOUT.
+             */
+            timer_mod(s->tx_timer, qemu_clock_get_ns(QEMU_CLOCK_REALTIME) +
+                                   AF_XDP_TX_RETRY_NS);
+            break;
+        }
+        if (xsk_ring_prod__reserve(&s->tx, 1, &idx) != 1) {
+            /* Wait for the driver to make room on the ring */
+            af_xdp_write_poll(s, true);
+            break;
+        }
+
+        addr = s->pool[--s->n_pool];
+        desc = xsk_ring_prod__tx_desc(&s->tx, idx);
+        desc->addr = addr;
+        desc->len = iov_to_buf(pkts[i].iov, pkts[i].iovcnt, 0,
+                               xsk_umem__get_data(s->buffer, addr),
+                               AF_XDP_FRAME_SIZE);
+        sent++;
+    }
+
+    if (sent) {
+        xsk_ring_prod__submit(&s->tx, sent);
+        s->outstanding_tx += sent;
+        af_xdp_kick_tx(s);
+    }
+    return i;
+}
+
+static ssize_t af_xdp_receive_iov(NetClientState *nc,
+                                  const struct iovec *iov, int iovcnt)
+{
+    NetPacketIOV pkt = { .iov = iov, .iovcnt = iovcnt };
+
+    if (!af_xdp_receive_iov_batch(nc, &pkt, 1)) {
+        return 0;
+    }
+    return iov_size(iov, iovcnt);
+}
+
+static ssize_t af_xdp_receive(NetClientState *nc,
+                              const uint8_t *buf, size_t size)
+{
+    struct iovec iov = {
+        .iov_base = (void *)buf,
+        .iov_len = size,
+    };
+
+    return af_xdp_receive_iov(nc, &iov, 1);
+}
+
+static void af_xdp_writable(void *opaque)
+{
+    AFXDPState *s = opaque;
+
+    qemu_net_acquire(&s->nc);
+    af_xdp_write_poll(s, false);
+    af_xdp_complete_tx(s);
+    qemu_flush_queued_packets(&s->nc);
+    qemu_net_release(&s->nc);
+}
+
+static void af_xdp_tx_retry(void *opaque)
+{
+    AFXDPState *s = opaque;
+
+    qemu_net_acquire(&s->nc);
+    af_xdp_complete_tx(s);
+    qemu_flush_queued_packets(&s->nc);
+    qemu_net_release(&s->nc);
+}
+
+static void af_xdp_tx_timer_new(AFXDPState *s)
+{
+    if (s->nc.aio_context) {
+        s->tx_timer = aio_timer_new(s->nc.aio_context, QEMU_CLOCK_REALTIME,
+                                    SCALE_NS, af_xdp_tx_retry, s);
+    } else {
+        s->tx_timer = timer_new_ns(QEMU_CLOCK_REALTIME, af_xdp_tx_retry, s);
+    }
+}
+
+static void af_xdp_send_completed(NetClientState *nc, ssize_t len)
+{
+    AFXDPState *s = DO_UPCAST(AFXDPState, nc, nc);
+
+    af_xdp_read_poll(s, true);
+}
+
+/*
+ * Pass the packets of the rx ring to the peer.  They are read straight
+ * from the UMEM; the peer copies them, even when it has to queue them,
+ * so their frames go back to the driver right away.
+ *
+ * Returns the number of packets passed.
+ */
+static uint32_t af_xdp_rx(AFXDPState *s)
+{
+    uint32_t i, n_rx, idx = 0;
+
+    n_rx = xsk_ring_cons__peek(&s->rx, AF_XDP_BATCH_SIZE, &idx);
+    for (i = 0; i < n_rx; i++) {
+        const struct xdp_desc *desc = xsk_ring_cons__rx_desc(&s->rx, idx++);
+        uint8_t *buf = xsk_umem__get_data(s->buffer, desc->addr);
+        size_t size = desc->len;
+        uint8_t min_pkt[ETH_ZLEN];
+        size_t min_pktsz = sizeof(min_pkt);
+        ssize_t ret;
+
+        if (net_peer_needs_padding(&s->nc) &&
+            eth_pad_short_frame(min_pkt, &min_pktsz, buf, size)) {
+            buf = min_pkt;
+            size = min_pktsz;
+        }
+
+        ret = qemu_send_packet_async(&s->nc, buf, size, af_xdp_send_completed);
+        s->pool[s->n_pool++] = af_xdp_frame(desc->addr);
+        if (ret == 0) {
+            /* Queued: wait for the peer to drain its queue */
+            af_xdp_read_poll(s, false);
+            i++;
+            break;
+        }
+    }
+
+    xsk_ring_cons__cancel(&s->rx, n_rx - i);
+    xsk_ring_cons__release(&s->rx, i);
+    af_xdp_fq_refill(s, i);
+    return i;
+}
+
+static void af_xdp_send(void *opaque)
+{
+    AFXDPState *s = opaque;
+
+    qemu_net_acquire(&s->nc);
+    af_xdp_rx(s);
+    qemu_net_release(&s->nc);
+}
+
+/*
+ * Polling handler of the IOThread.  With busy-poll=, the kernel also
+ * polls the interface queue on our behalf instead of waiting for its
+ * interrupt.
+ */
+static bool af_xdp_busy_poll(void *opaque)
+{
+    AFXDPState *s = opaque;
+    bool progress;
+
+    qemu_net_acquire(&s->nc);
+    if (s->busy_poll) {
+        af_xdp_wakeup(s);
+    }
+    progress = af_xdp_rx(s) > 0;
+    qemu_net_release(&s->nc);
+    return progress;
+}
+
+static int af_xdp_set_aio_context(NetClientState *nc, AioContext *ctx)
+{
+    AFXDPState *s = DO_UPCAST(AFXDPState, nc, nc);
+    bool read_poll = s->read_poll;
+    bool write_poll = s->write_poll;
+    bool tx_retry = timer_pending(s->tx_timer);
+    uint64_t expire = timer_expire_time_ns(s->tx_timer);
+
+    /* Unregister the fd from the old context before adding it to the new */
+    af_xdp_poll(nc, false);
+    timer_free(s->tx_timer);
+    nc->aio_context = ctx;
+    af_xdp_tx_timer_new(s);
+    if (tx_retry) {
+        timer_mod(s->tx_timer, expire);
+    }
+    af_xdp_read_poll(s, read_poll);
+    af_xdp_write_poll(s, write_poll);
+    return 0;
+}
+
+static void af_xdp_cleanup(NetClientState *nc)
+{
+    AFXDPState *s = DO_UPCAST(AFXDPState, nc, nc);
+
+    qemu_purge_queued_packets(nc);
+    timer_free(s->tx_timer);
+    s->tx_timer = NULL;
+
+    if (s->xsk) {
+        af_xdp_poll(nc, false);
+        /* Detaches the XDP program along with the last socket */
+        xsk_socket__delete(s->xsk);
+        s->xsk = NULL;
+    }
+    if (s->umem) {
+        xsk_umem__delete(s->umem);
+        s->umem = NULL;
+    }
+    g_free(s->pool);
+    s->pool = NULL;
+    qemu_vfree(s->buffer);
+    s->buffer = NULL;
+}
+
+static int af_xdp_umem_create(AFXDPState *s, Error **errp)
+{
+    struct xsk_umem_config cfg = {
+        .fill_size = XSK_RING_PROD__DEFAULT_NUM_DESCS,
+        .comp_size = XSK_RING_CONS__DEFAULT_NUM_DESCS,
+        .frame_size = AF_XDP_FRAME_SIZE,
+        .frame_headroom = 0,
+    };
+    size_t size = (size_t)AF_XDP_NUM_FRAMES * AF_XDP_FRAME_SIZE;
+    int i, ret;
+
+    s->buffer = qemu_memalign(qemu_real_host_page_size, size);
+    memset(s->buffer, 0, size);
+
+    ret = xsk_umem__create(&s->umem, s->buffer, size, &s->fq, &s->cq, &cfg);
+    if (ret) {
+        error_setg_errno(errp, -ret, "failed to create AF_XDP UMEM");
+        return -1;
+    }
+
+    /* Stacked so that the frames at the start of the UMEM go out first */
+    s->pool = g_new(uint64_t, AF_XDP_NUM_FRAMES);
+    for (i = AF_XDP_NUM_FRAMES - 1; i >= 0; i--) {
+        s->pool[s->n_pool++] = (uint64_t)i * AF_XDP_FRAME_SIZE;
+    }
+
+    af_xdp_fq_refill(s, XSK_RING_PROD__DEFAULT_NUM_DESCS);
+    return 0;
+}
+
+static bool af_xdp_zerocopy(AFXDPState *s)
+{
+    struct xdp_options opts;
+    socklen_t len = sizeof(opts);
+
+    return !getsockopt(xsk_socket__fd(s->xsk), SOL_XDP, XDP_OPTIONS,
+                       &opts, &len) &&
+           (opts.flags & XDP_OPTIONS_ZEROCOPY);
+}
+
+static int af_xdp_socket_create(AFXDPState *s, const NetdevAFXDPOptions *opts,
+                                uint32_t queue_id, Error **errp)
+{
+    struct xsk_socket_config cfg = {
+        .rx_size = XSK_RING_CONS__DEFAULT_NUM_DESCS,
+        .tx_size = XSK_RING_PROD__DEFAULT_NUM_DESCS,
+        /* Without XDP_COPY, the kernel falls back to it if needed */
+        .bind_flags = XDP_USE_NEED_WAKEUP,
+    };
+    AFXDPMode modes[] = { AFXDP_MODE_NATIVE, AFXDP_MODE_SKB };
+    int i, ret = -EINVAL;
+
+    if (opts->has_force_copy && opts->force_copy) {
+        cfg.bind_flags |= XDP_COPY;
+    }
+
+    for (i = 0; i < ARRAY_SIZE(modes); i++) {
+        if (opts->has_mode && opts->mode != modes[i]) {
+            continue;
+        }
+        cfg.xdp_flags = XDP_FLAGS_UPDATE_IF_NOEXIST |
+            (modes[i] == AFXDP_MODE_NATIVE ? XDP_FLAGS_DRV_MODE
+                                           : XDP_FLAGS_SKB_MODE);
+        ret = xsk_socket__create(&s->xsk, s->ifname, queue_id, s->umem,
+                                 &s->rx, &s->tx, &cfg);
+        if (!ret) {
+            break;
+        }
+        s->xsk = NULL;
+    }
+    if (ret) {
+        error_setg_errno(errp, -ret,
+                         "failed to create AF_XDP socket for queue %u of '%s'",
+                         queue_id, s->ifname);
+        return -1;
+    }
+
+    if (opts->has_busy_poll && opts->busy_poll) {
+#ifdef SO_PREFER_BUSY_POLL
+        int fd = xsk_socket__fd(s->xsk);
+        int usecs = opts->busy_poll;
+        int budget = AF_XDP_BATCH_SIZE;
+        int prefer = 1;
+
+        if (setsockopt(fd, SOL_SOCKET, SO_PREFER_BUSY_POLL,
+                       &prefer, sizeof(prefer)) < 0 ||
+            setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL,
+                       &usecs, sizeof(usecs)) < 0 ||
+            setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL_BUDGET,
+                       &budget, sizeof(budget)) < 0) {
+            error_setg_errno(errp, errno, "failed to enable busy polling");
+            return -1;
+        }
+        s->busy_poll = true;
+#else
+        error_setg(errp, "busy polling is not supported on this host");
+        return -1;
+#endif
+    }
+
+    snprintf(s->nc.info_str, sizeof(s->nc.info_str),
+             "af-xdp: ifname=%s,queue=%u,mode=%s%s", s->ifname, queue_id,
+             modes[i] == AFXDP_MODE_NATIVE ? "native" : "skb",
+             af_xdp_zerocopy(s) ? ",zero-copy" : "");
+    return 0;
+}
+
+static NetClientInfo net_af_xdp_info = {
+    .type = NET_CLIENT_DRIVER_AF_XDP,
+    .size = sizeof(AFXDPState),
+    .receive = af_xdp_receive,
+    .receive_iov = af_xdp_receive_iov,
+    .receive_iov_batch = af_xdp_receive_iov_batch,
+    .poll = af_xdp_poll,
+    .cleanup = af_xdp_cleanup,
+    .set_aio_context = af_xdp_set_aio_context,
+};
+
+int net_init_af_xdp(const Netdev *netdev,
+                    const char *name, NetClientState *peer, Error **errp)
+{
+    const NetdevAFXDPOptions *opts = &netdev->u.af_xdp;
+    NetClientState *nc, *nc0 = NULL;
+    uint32_t queues = opts->has_queues ? opts->queues : 1;
+    uint32_t start_queue = opts->has_start_queue ? opts->start_queue : 0;
+    AFXDPState *s;
+    int i;
+
+    if (!if_nametoindex(opts->ifname)) {
+        error_setg_errno(errp, errno, "no network interface '%s'",
+                         opts->ifname);
+        return -1;
+    }
+    if (queues < 1 || queues > MAX_QUEUE_NUM) {
+        error_setg(errp, "'queues' must be between 1 and %d", MAX_QUEUE_NUM);
+        return -1;
+    }
+    if ((uint64_t)start_queue + queues > UINT32_MAX) {
+        error_setg(errp, "invalid 'start-queue'");
+        return -1;
+    }
+    if (queues > 1 && peer) {
+        error_setg(errp, "Multiqueue AF_XDP cannot be used with hubs");
+        return -1;
+    }
+
+    for (i = 0; i < queues; i++) {
+        nc = qemu_new_net_client(&net_af_xdp_info, peer, "af-xdp", name);
+        nc->queue_index = i;
+        if (!nc0) {
+            nc0 = nc;
+        }
+
+        s = DO_UPCAST(AFXDPState, nc, nc);
+        pstrcpy(s->ifname, sizeof(s->ifname), opts->ifname);
+        af_xdp_tx_timer_new(s);
+
+        if (af_xdp_umem_create(s, errp) ||
+            af_xdp_socket_create(s, opts, start_queue + i, errp)) {
+            /* Also deletes the queues created so far */
+            qemu_del_net_client(nc0);
+            return -1;
+        }
+
+        af_xdp_read_poll(s, true);
+    }
+
+    return 0;
+}
@@ -19,24 +19,333 @@
 #include "net/checksum.h"
 #include "net/eth.h"
 
-uint32_t net_checksum_add_cont(int len, uint8_t *buf, int seq)
+/*
+ * The sums below add 16-bit words as the host loads them.  The one's
+ * complement sum does not depend on the byte order, so on little-endian
+ * hosts the folded result only needs a byte swap at the end (RFC 1071).
+ * Wider loads work the same way, because 2^16 == 1 modulo 0xffff.
+ */
+
+static inline uint16_t net_checksum_fold(uint64_t sum)
+{
+    sum = (sum & 0xffffffff) + (sum >> 32);
+    sum = (sum & 0xffffffff) + (sum >> 32);
+    sum = (sum & 0xffff) + (sum >> 16);
+    sum = (sum & 0xffff) + (sum >> 16);
+    sum = (sum & 0xffff) + (sum >> 16);
+    return sum;
+}
+
+static inline uint64_t net_checksum_add_tail(const uint8_t *buf, int len,
+                                             uint64_t sum)
+{
+    if (len & 4) {
+        sum += (uint32_t)ldl_he_p(buf);
+        buf += 4;
+    }
+    if (len & 2) {
+        sum += lduw_he_p(buf);
+        buf += 2;
+    }
+    if (len & 1) {
+#ifdef HOST_WORDS_BIGENDIAN
+        sum += (uint32_t)*buf << 8;
+#else
+        sum += *buf;
+#endif
+    }
+    return sum;
+}
+
+static uint64_t net_checksum_add_int(const uint8_t *buf, int len)
+{
+    uint64_t sum = 0;
+
+    for (; len >= 32; buf += 32, len -= 32) {
+        uint64_t w0 = ldq_he_p(buf);
+        uint64_t w1 = ldq_he_p(buf + 8);
+        uint64_t w2 = ldq_he_p(buf + 16);
+        uint64_t w3 = ldq_he_p(buf + 24);
+
+        sum += (uint32_t)w0 + (w0 >> 32) + (uint32_t)w1 + (w1 >> 32) +
+               (uint32_t)w2 + (w2 >> 32) + (uint32_t)w3 + (w3 >> 32);
+    }
+    for (; len >= 8; buf += 8, len -= 8) {
+        uint64_t w = ldq_he_p(buf);
+
+        sum += (uint32_t)w + (w >> 32);
+    }
+    return net_checksum_add_tail(buf, len, sum);
+}
+
+/*
+ * The vector versions add 16-bit words into 32-bit lanes, which cannot
+ * overflow within a chunk of this size; each chunk is then added to a
+ * 64-bit sum.  All of them need len >= 64.
+ */
+#define NET_CHECKSUM_CHUNK  (16 * 1024)
+
+#if defined(CONFIG_AVX2_OPT) || defined(__SSE2__)
+#ifdef CONFIG_AVX2_OPT
+#pragma GCC push_options
+#pragma GCC target("sse2")
+#endif
+#include <emmintrin.h>
+
+static uint64_t net_checksum_add_sse2(const uint8_t *buf, int len)
+{
+    __m128i zero = _mm_setzero_si128();
+    uint64_t sum = 0;
+
+    while (len >= 64) {
+        int n = MIN(len, NET_CHECKSUM_CHUNK) & -64;
+        __m128i acc = zero;
+        uint32_t lanes[4];
+        int i;
+
+        for (i = 0; i < n; i += 64) {
+            __m128i v0 = _mm_loadu_si128((const __m128i *)(buf + i));
+            __m128i v1 = _mm_loadu_si128((const __m128i *)(buf + i + 16));
+            __m128i v2 = _mm_loadu_si128((const __m128i *)(buf + i + 32));
+            __m128i v3 = _mm_loadu_si128((const __m128i *)(buf + i + 48));
+
+            acc = _mm_add_epi32(acc, _mm_unpacklo_epi16(v0, zero));
+            acc = _mm_add_epi32(acc, _mm_unpackhi_epi16(v0, zero));
+            acc = _mm_add_epi32(acc, _mm_unpacklo_epi16(v1, zero));
+            acc = _mm_add_epi32(acc, _mm_unpackhi_epi16(v1, zero));
+            acc = _mm_add_epi32(acc, _mm_unpacklo_epi16(v2, zero));
+            acc = _mm_add_epi32(acc, _mm_unpackhi_epi16(v2, zero));
+            acc = _mm_add_epi32(acc, _mm_unpacklo_epi16(v3, zero));
+            acc = _mm_add_epi32(acc, _mm_unpackhi_epi16(v3, zero));
+        }
+        _mm_storeu_si128((__m128i *)lanes, acc);
+        sum += (uint64_t)lanes[0] + lanes[1] + lanes[2] + lanes[3];
+        buf += n;
+        len -= n;
+    }
+    return sum + net_checksum_add_int(buf, len);
+}
+#ifdef CONFIG_AVX2_OPT
+#pragma GCC pop_options
+#endif
+#endif
+
+#ifdef CONFIG_AVX2_OPT
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#include <immintrin.h>
+
+static uint64_t net_checksum_add_avx2(const uint8_t *buf, int len)
+{
+    __m256i zero = _mm256_setzero_si256();
+    uint64_t sum = 0;
+
+    while (len >= 64) {
+        int n = MIN(len, NET_CHECKSUM_CHUNK) & -64;
+        __m256i acc = zero;
+        uint32_t lanes[8];
+        int i;
+
+        for (i = 0; i < n; i += 64) {
+            __m256i v0 = _mm256_loadu_si256((const __m256i *)(buf + i));
+            __m256i v1 = _mm256_loadu_si256((const __m256i *)(buf + i + 32));
+
+            acc = _mm256_add_epi32(acc, _mm256_unpacklo_epi16(v0, zero));
+            acc = _mm256_add_epi32(acc, _mm256_unpackhi_epi16(v0, zero));
+            acc = _mm256_add_epi32(acc, _mm256_unpacklo_epi16(v1, zero));
+            acc = _mm256_add_epi32(acc, _mm256_unpackhi_epi16(v1, zero));
+        }
+        _mm256_storeu_si256((__m256i *)lanes, acc);
+        sum += (uint64_t)lanes[0] + lanes[1] + lanes[2] + lanes[3] +
+               lanes[4] + lanes[5] + lanes[6] + lanes[7];
+        buf += n;
+        len -= n;
+    }
+    return sum + net_checksum_add_int(buf, len);
+}
+#pragma GCC pop_options
+#endif /* CONFIG_AVX2_OPT */
+
+#if defined(__aarch64__) && !defined(HOST_WORDS_BIGENDIAN)
+#include <arm_neon.h>
+
+static uint64_t net_checksum_add_neon(const uint8_t *buf, int len)
+{
+    uint64_t sum = 0;
+
+    while (len >= 64) {
+        int n = MIN(len, NET_CHECKSUM_CHUNK) & -64;
+        uint32x4_t acc = vdupq_n_u32(0);
+        int i;
+
+        for (i = 0; i < n; i += 64) {
+            acc = vpadalq_u16(acc, vreinterpretq_u16_u8(vld1q_u8(buf + i)));
+            acc = vpadalq_u16(acc,
+                              vreinterpretq_u16_u8(vld1q_u8(buf + i + 16)));
+            acc = vpadalq_u16(acc,
+                              vreinterpretq_u16_u8(vld1q_u8(buf + i + 32)));
+            acc = vpadalq_u16(acc,
+                              vreinterpretq_u16_u8(vld1q_u8(buf + i + 48)));
+        }
+        sum += vaddlvq_u32(acc);
+        buf += n;
+        len -= n;
+    }
+    return sum + net_checksum_add_int(buf, len);
+}
+#endif
+
+/*
+ * Note that for test_net_checksum_next_accel, the most preferred
+ * ISA must have the least significant bit.
+ */
+#define CACHE_AVX2    1
+#define CACHE_SSE2    2
+#define CACHE_NEON    4
+
+#if defined(CONFIG_AVX2_OPT)
+# define INIT_CACHE 0
+# define INIT_ACCEL net_checksum_add_int
+#elif defined(__SSE2__)
+# define INIT_CACHE CACHE_SSE2
+# define INIT_ACCEL net_checksum_add_sse2
+#elif defined(__aarch64__) && !defined(HOST_WORDS_BIGENDIAN)
+# define INIT_CACHE CACHE_NEON
+# define INIT_ACCEL net_checksum_add_neon
+#else
+# define INIT_CACHE 0
+# define INIT_ACCEL net_checksum_add_int
+#endif
+
+static unsigned cpuid_cache = INIT_CACHE;
+static uint64_t (*checksum_accel)(const uint8_t *, int) = INIT_ACCEL;
+
+static void init_accel(unsigned cache)
+{
+    uint64_t (*fn)(const uint8_t *, int) = net_checksum_add_int;
+
+#if defined(CONFIG_AVX2_OPT) || defined(__SSE2__)
+    if (cache & CACHE_SSE2) {
+        fn = net_checksum_add_sse2;
+    }
+#endif
+#ifdef CONFIG_AVX2_OPT
+    if (cache & CACHE_AVX2) {
+        fn = net_checksum_add_avx2;
+    }
+#endif
+#if defined(__aarch64__) && !defined(HOST_WORDS_BIGENDIAN)
+    if (cache & CACHE_NEON) {
+        fn = net_checksum_add_neon;
+    }
+#endif
+    checksum_accel = fn;
+}
+
+#ifdef CONFIG_AVX2_OPT
+#include "qemu/cpuid.h"
+
+static void __attribute__((constructor)) init_cpuid_cache(void)
 {
-    uint32_t sum1 = 0, sum2 = 0;
-    int i;
+    int max = __get_cpuid_max(0, NULL);
+    int a, b, c, d;
+    unsigned cache = 0;
+
+    if (max >= 1) {
+        __cpuid(1, a, b, c, d);
+        if (d & bit_SSE2) {
+            cache |= CACHE_SSE2;
+        }
 
-    for (i = 0; i < len - 1; i += 2) {
-        sum1 += (uint32_t)buf[i];
-        sum2 += (uint32_t)buf[i + 1];
+        /* We must check that AVX is not just available, but usable.  */
+        if ((c & bit_OSXSAVE) && (c & bit_AVX) && max >= 7) {
+            int bv;
+            __asm("xgetbv" : "=a"(bv), "=d"(d) : "c"(0));
+            __cpuid_count(7, 0, a, b, c, d);
+            if ((bv & 0x6) == 0x6 && (b & bit_AVX2)) {
+                cache |= CACHE_AVX2;
+            }
+        }
     }
-    if (i < len) {
-        sum1 += (uint32_t)buf[i];
+    cpuid_cache = cache;
+    init_accel(cache);
+}
+#endif /* CONFIG_AVX2_OPT */
+
+bool test_net_checksum_next_accel(void)
+{
+    /* If no bits set, we just tested net_checksum_add_int.  */
+    if (cpuid_cache == 0) {
+        return false;
+    }
+    /* Disable the accelerator we used before and select a new one.  */
+    cpuid_cache &= cpuid_cache - 1;
+    init_accel(cpuid_cache);
+    return true;
+}
+
+const char *net_checksum_accel_name(void)
+{
+    if (cpuid_cache & CACHE_AVX2) {
+        return "avx2";
+    } else if (cpuid_cache & CACHE_SSE2) {
+        return "sse2";
+    } else if (cpuid_cache & CACHE_NEON) {
+        return "neon";
     }
+    return "int";
+}
 
-    if (seq & 1) {
-        return sum1 + (sum2 << 8);
+/* Turn a folded sum of host-order words into the sum at offset @seq */
+static inline uint32_t net_checksum_fixup(uint16_t sum, int seq)
+{
+#ifndef HOST_WORDS_BIGENDIAN
+    sum = bswap16(sum);
+#endif
+    return seq & 1 ? bswap16(sum) : sum;
+}
+
+uint32_t net_checksum_add_cont(int len, uint8_t *buf, int seq)
+{
+    uint64_t sum;
+
+    if (len <= 0) {
+        return 0;
+    }
+    if (likely(len >= 64)) {
+        sum = checksum_accel(buf, len);
     } else {
-        return sum2 + (sum1 << 8);
+        sum = net_checksum_add_int(buf, len);
     }
+    return net_checksum_fixup(net_checksum_fold(sum), seq);
+}
+
+uint32_t net_checksum_copy_cont(uint8_t *dst, const uint8_t *src, int len,
+                                int seq)
+{
+    uint64_t sum = 0;
+
+    if (len <= 0) {
+        return 0;
+    }
+
+    for (; len >= 32; src += 32, dst += 32, len -= 32) {
+        uint64_t w0 = ldq_he_p(src);
+        uint64_t w1 = ldq_he_p(src + 8);
+        uint64_t w2 = ldq_he_p(src + 16);
+        uint64_t w3 = ldq_he_p(src + 24);
+
+        stq_he_p(dst, w0);
+        stq_he_p(dst + 8, w1);
+        stq_he_p(dst + 16, w2);
+        stq_he_p(dst + 24, w3);
+        sum += (uint32_t)w0 + (w0 >> 32) + (uint32_t)w1 + (w1 >> 32) +
+               (uint32_t)w2 + (w2 >> 32) + (uint32_t)w3 + (w3 >> 32);
+    }
+    memcpy(dst, src, len);
+    sum += net_checksum_add_int(dst, len);
+
+    return net_checksum_fixup(net_checksum_fold(sum), seq);
 }
 
 uint16_t net_checksum_finish(uint32_t sum)
@@ -206,3 +515,30 @@ net_checksum_add_iov(const struct iovec *iov, const unsigned int iov_cnt,
     }
     return res;
 }
+
+uint32_t
+net_checksum_iov_to_buf(const struct iovec *iov, const unsigned int iov_cnt,
+                        uint32_t iov_off, uint8_t *buf, uint32_t size,
+                        uint32_t csum_offset)
+{
+    size_t iovec_off;
+    unsigned int i;
+    uint32_t res = 0;
+
+    iovec_off = 0;
+    for (i = 0; i < iov_cnt && size; i++) {
+        if (iov_off < (iovec_off + iov[i].iov_len)) {
+            size_t len = MIN((iovec_off + iov[i].iov_len) - iov_off, size);
+            void *chunk_buf = iov[i].iov_base + (iov_off - iovec_off);
+
+            res += net_checksum_copy_cont(buf, chunk_buf, len, csum_offset);
+            csum_offset += len;
+            buf += len;
+
+            iov_off += len;
+            size -= len;
+        }
+        iovec_off += iov[i].iov_len;
+    }
+    return res;
+}
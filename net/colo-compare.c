@@ -25,6 +25,7 @@
 #include "net/queue.h"
 #include "chardev/char-fe.h"
 #include "qemu/sockets.h"
+#include "qemu/stats64.h"
 #include "colo.h"
 #include "sysemu/iothread.h"
 #include "net/colo-compare.h"
@@ -54,6 +55,7 @@ static NotifierList colo_compare_notifiers =
 
 #define REGULAR_PACKET_CHECK_MS 1000
 #define DEFAULT_TIME_OUT_MS 3000
+#define MAX_COMPARE_THREADS 64
 
 /* #define DEBUG_COLO_PACKETS */
 
@@ -103,6 +105,46 @@ typedef struct SendEntry {
     uint8_t *buf;
 } SendEntry;
 
+enum {
+    PRIMARY_IN = 0,
+    SECONDARY_IN,
+};
+
+static const char *colo_mode[] = {
+    [PRIMARY_IN] = "primary",
+    [SECONDARY_IN] = "secondary",
+};
+
+/*
+ * Connections are spread over the shards by the hash of their key, and
+ * each shard compares its own connections in its own thread.  Without
+ * compare_threads there is a single shard, running in the iothread that
+ * reads the packets.
+ */
+typedef struct CompareShard {
+    CompareState *s;
+    IOThread *iothread;
+    QEMUBH *input_bh;
+    QEMUBH *event_bh;
+    QEMUTimer *packet_check_timer;
+
+    /*
+     * Packets parsed by the input thread and not yet queued to their
+     * connection, indexed by PRIMARY_IN/SECONDARY_IN
+     * Element type: Packet
+     */
+    QemuMutex input_lock;
+    GQueue input[2];
+
+    /*
+     * Record the connection that through the NIC
+     * Element type: Connection
+     */
+    GQueue conn_list;
+    /* Record the connection without repetition */
+    GHashTable *connection_track_table;
+} CompareShard;
+
 struct CompareState {
     Object parent;
 
@@ -122,20 +164,31 @@ struct CompareState {
     bool vnet_hdr;
     uint64_t compare_timeout;
     uint32_t expired_scan_cycle;
+    uint32_t compare_threads;
+
+    CompareShard *shards;
+    uint32_t nr_shards;
 
     /*
-     * Record the connection that through the NIC
-     * Element type: Connection
+     * Primary packets released by the compare threads, sent to outdev
+     * by the iothread
+     * Element type: Packet
      */
-    GQueue conn_list;
-    /* Record the connection without repetition */
-    GHashTable *connection_track_table;
+    QemuMutex out_lock;
+    GQueue out_list;
+    QEMUBH *out_bh;
+    QEMUBH *notify_bh;
+
+    /* Packets released after comparison and how long they were held */
+    Stat64 compared_packets;
+    Stat64 compare_latency_total;
+    Stat64 compare_latency_max;
+    /* Checkpoints requested because of a miscompare or a timeout */
+    Stat64 checkpoint_requests;
 
     IOThread *iothread;
     GMainContext *worker_context;
-    QEMUTimer *packet_check_timer;
 
-    QEMUBH *event_bh;
     enum colo_event event;
 
     QTAILQ_ENTRY(CompareState) next;
@@ -145,16 +198,6 @@ typedef struct CompareClass {
     ObjectClass parent_class;
 } CompareClass;
 
-enum {
-    PRIMARY_IN = 0,
-    SECONDARY_IN,
-};
-
-static const char *colo_mode[] = {
-    [PRIMARY_IN] = "primary",
-    [SECONDARY_IN] = "secondary",
-};
-
 static int compare_chr_send(CompareState *s,
                             uint8_t *buf,
                             uint32_t size,
@@ -184,20 +227,30 @@ static void notify_remote_frame(CompareState *s)
     }
 }
 
-static void colo_compare_inconsistency_notify(CompareState *s)
+/* The chardevs can only be used from the iothread reading the packets */
+static bool colo_compare_in_input_thread(CompareShard *sh)
 {
-    if (s->notify_dev) {
-        notify_remote_frame(s);
-    } else {
-        notifier_list_notify(&colo_compare_notifiers,
-                             migrate_get_current());
-    }
+    return sh->iothread == sh->s->iothread;
 }
 
-/* Use restricted to colo_insert_packet() */
-static gint seq_sorter(Packet *a, Packet *b, gpointer data)
+static void colo_compare_notify_bh(void *opaque)
 {
-    return a->tcp_seq - b->tcp_seq;
+    notify_remote_frame(opaque);
+}
+
+static void colo_compare_inconsistency_notify(CompareShard *sh)
+{
+    CompareState *s = sh->s;
+
+    stat64_add(&s->checkpoint_requests, 1);
+    if (!s->notify_dev) {
+        notifier_list_notify(&colo_compare_notifiers,
+                             migrate_get_current());
+    } else if (colo_compare_in_input_thread(sh)) {
+        notify_remote_frame(s);
+    } else {
+        qemu_bh_schedule(s->notify_bh);
+    }
 }
 
 static void fill_pkt_tcp_info(void *data, uint32_t *max_ack)
@@ -217,6 +270,25 @@ static void fill_pkt_tcp_info(void *data, uint32_t *max_ack)
     pkt->flags = tcphd->th_flags;
 }
 
+/*
+ * Keep the queue sorted by sequence number.  Segments mostly arrive in
+ * order, so the insertion point is searched from the tail.
+ */
+static void colo_insert_sorted(GQueue *queue, Packet *pkt)
+{
+    GList *l;
+
+    for (l = queue->tail; l; l = l->prev) {
+        Packet *p = l->data;
+
+        if ((int32_t)(pkt->tcp_seq - p->tcp_seq) >= 0) {
+            g_queue_insert_after(queue, l, pkt);
+            return;
+        }
+    }
+    g_queue_push_head(queue, pkt);
+}
+
 /*
  * Return 1 on success, if return 0 means the
  * packet will be dropped
@@ -226,10 +298,7 @@ static int colo_insert_packet(GQueue *queue, Packet *pkt, uint32_t *max_ack)
     if (g_queue_get_length(queue) <= max_queue_size) {
         if (pkt->ip->ip_p == IPPROTO_TCP) {
             fill_pkt_tcp_info(pkt, max_ack);
-            g_queue_insert_sorted(queue,
-                                  pkt,
-                                  (GCompareDataFunc)seq_sorter,
-                                  NULL);
+            colo_insert_sorted(queue, pkt);
         } else {
             g_queue_push_tail(queue, pkt);
         }
@@ -238,16 +307,80 @@ static int colo_insert_packet(GQueue *queue, Packet *pkt, uint32_t *max_ack)
     return 0;
 }
 
+static void colo_compare_connection(void *opaque, void *user_data);
+
+/*
+ * Called from the compare thread of the shard to queue a packet
+ * to its connection, and compare the connection
+ */
+static void colo_compare_enqueue(CompareShard *sh, int mode, Packet *pkt,
+                                 ConnectionKey *key)
+{
+    Connection *conn;
+    int ret;
+
+    conn = connection_get(sh->connection_track_table,
+                          key,
+                          &sh->conn_list);
+
+    if (!conn->processing) {
+        g_queue_push_tail(&sh->conn_list, conn);
+        conn->processing = true;
+    }
+
+    if (mode == PRIMARY_IN) {
+        ret = colo_insert_packet(&conn->primary_list, pkt, &conn->pack);
+    } else {
+        ret = colo_insert_packet(&conn->secondary_list, pkt, &conn->sack);
+    }
+
+    if (!ret) {
+        trace_colo_compare_drop_packet(colo_mode[mode],
+            "queue size too big, drop packet");
+        packet_destroy(pkt, NULL);
+        pkt = NULL;
+    }
+
+    /* compare packet in the specified connection */
+    colo_compare_connection(conn, sh);
+}
+
+/*
+ * Called from the compare thread of the shard for the packets
+ * that the input thread handed over to it.
+ */
+static void colo_compare_input(void *opaque)
+{
+    CompareShard *sh = opaque;
+    GQueue input[2];
+    ConnectionKey key;
+    Packet *pkt;
+    int mode;
+
+    qemu_mutex_lock(&sh->input_lock);
+    for (mode = PRIMARY_IN; mode <= SECONDARY_IN; mode++) {
+        input[mode] = sh->input[mode];
+        g_queue_init(&sh->input[mode]);
+    }
+    qemu_mutex_unlock(&sh->input_lock);
+
+    for (mode = PRIMARY_IN; mode <= SECONDARY_IN; mode++) {
+        while ((pkt = g_queue_pop_head(&input[mode]))) {
+            fill_connection_key(pkt, &key);
+            colo_compare_enqueue(sh, mode, pkt, &key);
+        }
+    }
+}
+
 /*
  * Return 0 on success, if return -1 means the pkt
  * is unsupported(arp and ipv6) and will be sent later
  */
-static int packet_enqueue(CompareState *s, int mode, Connection **con)
+static int packet_enqueue(CompareState *s, int mode)
 {
     ConnectionKey key;
     Packet *pkt = NULL;
-    Connection *conn;
-    int ret;
+    CompareShard *sh;
 
     if (mode == PRIMARY_IN) {
         pkt = packet_new(s->pri_rs.buf,
@@ -266,30 +399,17 @@ static int packet_enqueue(CompareState *s, int mode, Connection **con)
     }
     fill_connection_key(pkt, &key);
 
-    conn = connection_get(s->connection_track_table,
-                          &key,
-                          &s->conn_list);
-
-    if (!conn->processing) {
-        g_queue_push_tail(&s->conn_list, conn);
-        conn->processing = true;
-    }
-
-    if (mode == PRIMARY_IN) {
-        ret = colo_insert_packet(&conn->primary_list, pkt, &conn->pack);
+    /* Both directions of a connection have the same key */
+    sh = &s->shards[connection_key_hash(&key) % s->nr_shards];
+    if (colo_compare_in_input_thread(sh)) {
+        colo_compare_enqueue(sh, mode, pkt, &key);
     } else {
-        ret = colo_insert_packet(&conn->secondary_list, pkt, &conn->sack);
-    }
-
-    if (!ret) {
-        trace_colo_compare_drop_packet(colo_mode[mode],
-            "queue size too big, drop packet");
-        packet_destroy(pkt, NULL);
-        pkt = NULL;
+        qemu_mutex_lock(&sh->input_lock);
+        g_queue_push_tail(&sh->input[mode], pkt);
+        qemu_mutex_unlock(&sh->input_lock);
+        qemu_bh_schedule(sh->input_bh);
     }
 
-    *con = conn;
-
     return 0;
 }
 
@@ -298,7 +418,7 @@ static inline bool after(uint32_t seq1, uint32_t seq2)
         return (int32_t)(seq1 - seq2) > 0;
 }
 
-static void colo_release_primary_pkt(CompareState *s, Packet *pkt)
+static void colo_send_primary_pkt(CompareState *s, Packet *pkt)
 {
     int ret;
     ret = compare_chr_send(s,
@@ -310,10 +430,53 @@ static void colo_release_primary_pkt(CompareState *s, Packet *pkt)
     if (ret < 0) {
         error_report("colo send primary packet failed");
     }
-    trace_colo_compare_main("packet same and release packet");
     packet_destroy_partial(pkt, NULL);
 }
 
+/* Called from the iothread for the packets released by the shards */
+static void colo_compare_output(void *opaque)
+{
+    CompareState *s = opaque;
+    GQueue out_list;
+    Packet *pkt;
+
+    qemu_mutex_lock(&s->out_lock);
+    out_list = s->out_list;
+    g_queue_init(&s->out_list);
+    qemu_mutex_unlock(&s->out_lock);
+
+    while ((pkt = g_queue_pop_head(&out_list))) {
+        colo_send_primary_pkt(s, pkt);
+    }
+}
+
+static void colo_compare_output_pkt(CompareShard *sh, Packet *pkt)
+{
+    CompareState *s = sh->s;
+
+    if (colo_compare_in_input_thread(sh)) {
+        colo_send_primary_pkt(s, pkt);
+    } else {
+        qemu_mutex_lock(&s->out_lock);
+        g_queue_push_tail(&s->out_list, pkt);
+        qemu_mutex_unlock(&s->out_lock);
+        qemu_bh_schedule(s->out_bh);
+    }
+}
+
+static void colo_release_primary_pkt(CompareShard *sh, Packet *pkt)
+{
+    CompareState *s = sh->s;
+    uint64_t latency = qemu_clock_get_ns(QEMU_CLOCK_HOST) - pkt->creation_ns;
+
+    stat64_add(&s->compared_packets, 1);
+    stat64_add(&s->compare_latency_total, latency);
+    stat64_max(&s->compare_latency_max, latency);
+
+    trace_colo_compare_main("packet same and release packet");
+    colo_compare_output_pkt(sh, pkt);
+}
+
 /*
  * The IP packets sent by primary and secondary
  * will be compared in here
@@ -397,7 +560,7 @@ static bool colo_mark_tcp_pkt(Packet *ppkt, Packet *spkt,
     return false;
 }
 
-static void colo_compare_tcp(CompareState *s, Connection *conn)
+static void colo_compare_tcp(CompareShard *sh, Connection *conn)
 {
     Packet *ppkt = NULL, *spkt = NULL;
     int8_t mark;
@@ -428,13 +591,13 @@ sec:
     spkt = g_queue_pop_head(&conn->secondary_list);
 
     if (ppkt->tcp_seq == ppkt->seq_end) {
-        colo_release_primary_pkt(s, ppkt);
+        colo_release_primary_pkt(sh, ppkt);
         ppkt = NULL;
     }
 
     if (ppkt && conn->compare_seq && !after(ppkt->seq_end, conn->compare_seq)) {
         trace_colo_compare_main("pri: this packet has compared");
-        colo_release_primary_pkt(s, ppkt);
+        colo_release_primary_pkt(sh, ppkt);
         ppkt = NULL;
     }
 
@@ -474,7 +637,7 @@ sec:
 
         if (mark == COLO_COMPARE_FREE_PRIMARY) {
             conn->compare_seq = ppkt->seq_end;
-            colo_release_primary_pkt(s, ppkt);
+            colo_release_primary_pkt(sh, ppkt);
             g_queue_push_head(&conn->secondary_list, spkt);
             goto pri;
         } else if (mark == COLO_COMPARE_FREE_SECONDARY) {
@@ -483,7 +646,7 @@ sec:
             goto sec;
         } else if (mark == (COLO_COMPARE_FREE_PRIMARY | COLO_COMPARE_FREE_SECONDARY)) {
             conn->compare_seq = ppkt->seq_end;
-            colo_release_primary_pkt(s, ppkt);
+            colo_release_primary_pkt(sh, ppkt);
             packet_destroy(spkt, NULL);
             goto pri;
         }
@@ -496,7 +659,7 @@ sec:
         qemu_hexdump(stderr, "colo-compare spkt", spkt->data, spkt->size);
 #endif
 
-        colo_compare_inconsistency_notify(s);
+        colo_compare_inconsistency_notify(sh);
     }
 }
 
@@ -600,10 +763,10 @@ static int colo_packet_compare_other(Packet *spkt, Packet *ppkt)
 
 static int colo_old_packet_check_one(Packet *pkt, int64_t *check_time)
 {
-    int64_t now = qemu_clock_get_ms(QEMU_CLOCK_HOST);
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_HOST);
 
-    if ((now - pkt->creation_ms) > (*check_time)) {
-        trace_colo_old_packet_check_found(pkt->creation_ms);
+    if ((now - pkt->creation_ns) / SCALE_MS > (*check_time)) {
+        trace_colo_old_packet_check_found(pkt->creation_ns / SCALE_MS);
         return 0;
     } else {
         return 1;
@@ -621,8 +784,10 @@ void colo_compare_unregister_notifier(Notifier *notify)
 }
 
 static int colo_old_packet_check_one_conn(Connection *conn,
-                                          CompareState *s)
+                                          CompareShard *sh)
 {
+    CompareState *s = sh->s;
+
     if (!g_queue_is_empty(&conn->primary_list)) {
         if (g_queue_find_custom(&conn->primary_list,
                                 &s->compare_timeout,
@@ -641,7 +806,7 @@ static int colo_old_packet_check_one_conn(Connection *conn,
 
 out:
     /* Do checkpoint will flush old packet */
-    colo_compare_inconsistency_notify(s);
+    colo_compare_inconsistency_notify(sh);
     return 0;
 }
 
@@ -652,17 +817,17 @@ out:
  */
 static void colo_old_packet_check(void *opaque)
 {
-    CompareState *s = opaque;
+    CompareShard *sh = opaque;
 
     /*
      * If we find one old packet, stop finding job and notify
      * COLO frame do checkpoint.
      */
-    g_queue_find_custom(&s->conn_list, s,
+    g_queue_find_custom(&sh->conn_list, sh,
                         (GCompareFunc)colo_old_packet_check_one_conn);
 }
 
-static void colo_compare_packet(CompareState *s, Connection *conn,
+static void colo_compare_packet(CompareShard *sh, Connection *conn,
                                 int (*HandlePacket)(Packet *spkt,
                                 Packet *ppkt))
 {
@@ -676,7 +841,7 @@ static void colo_compare_packet(CompareState *s, Connection *conn,
                  pkt, (GCompareFunc)HandlePacket);
 
         if (result) {
-            colo_release_primary_pkt(s, pkt);
+            colo_release_primary_pkt(sh, pkt);
             packet_destroy(result->data, NULL);
             g_queue_delete_link(&conn->secondary_list, result);
         } else {
@@ -689,7 +854,7 @@ static void colo_compare_packet(CompareState *s, Connection *conn,
             trace_colo_compare_main("packet different");
             g_queue_push_head(&conn->primary_list, pkt);
 
-            colo_compare_inconsistency_notify(s);
+            colo_compare_inconsistency_notify(sh);
             break;
         }
     }
@@ -703,21 +868,21 @@ static void colo_compare_packet(CompareState *s, Connection *conn,
  */
 static void colo_compare_connection(void *opaque, void *user_data)
 {
-    CompareState *s = user_data;
+    CompareShard *sh = user_data;
     Connection *conn = opaque;
 
     switch (conn->ip_proto) {
     case IPPROTO_TCP:
-        colo_compare_tcp(s, conn);
+        colo_compare_tcp(sh, conn);
         break;
     case IPPROTO_UDP:
-        colo_compare_packet(s, conn, colo_packet_compare_udp);
+        colo_compare_packet(sh, conn, colo_packet_compare_udp);
         break;
     case IPPROTO_ICMP:
-        colo_compare_packet(s, conn, colo_packet_compare_icmp);
+        colo_compare_packet(sh, conn, colo_packet_compare_icmp);
         break;
     default:
-        colo_compare_packet(s, conn, colo_packet_compare_other);
+        colo_compare_packet(sh, conn, colo_packet_compare_other);
         break;
     }
 }
@@ -891,12 +1056,12 @@ static void compare_notify_chr(void *opaque, const uint8_t *buf, int size)
  */
 static void check_old_packet_regular(void *opaque)
 {
-    CompareState *s = opaque;
+    CompareShard *sh = opaque;
 
     /* if have old packet we will notify checkpoint */
-    colo_old_packet_check(s);
-    timer_mod(s->packet_check_timer, qemu_clock_get_ms(QEMU_CLOCK_HOST) +
-              s->expired_scan_cycle);
+    colo_old_packet_check(sh);
+    timer_mod(sh->packet_check_timer, qemu_clock_get_ms(QEMU_CLOCK_HOST) +
+              sh->s->expired_scan_cycle);
 }
 
 /* Public API, Used for COLO frame to notify compare event */
@@ -912,9 +1077,13 @@ void colo_notify_compares_event(void *opaque, int event, Error **errp)
 
     qemu_mutex_lock(&event_mtx);
     QTAILQ_FOREACH(s, &net_compares, next) {
+        uint32_t i;
+
         s->event = event;
-        qemu_bh_schedule(s->event_bh);
-        event_unhandled_count++;
+        for (i = 0; i < s->nr_shards; i++) {
+            qemu_bh_schedule(s->shards[i].event_bh);
+            event_unhandled_count++;
+        }
     }
     /* Wait all compare threads to finish handling this event */
     while (event_unhandled_count > 0) {
@@ -925,34 +1094,65 @@ void colo_notify_compares_event(void *opaque, int event, Error **errp)
     qemu_mutex_unlock(&colo_compare_mutex);
 }
 
-static void colo_compare_timer_init(CompareState *s)
+static void colo_compare_timer_init(CompareShard *sh)
 {
-    AioContext *ctx = iothread_get_aio_context(s->iothread);
+    AioContext *ctx = iothread_get_aio_context(sh->iothread);
 
-    s->packet_check_timer = aio_timer_new(ctx, QEMU_CLOCK_HOST,
+    sh->packet_check_timer = aio_timer_new(ctx, QEMU_CLOCK_HOST,
                                 SCALE_MS, check_old_packet_regular,
-                                s);
-    timer_mod(s->packet_check_timer, qemu_clock_get_ms(QEMU_CLOCK_HOST) +
-              s->expired_scan_cycle);
+                                sh);
+    timer_mod(sh->packet_check_timer, qemu_clock_get_ms(QEMU_CLOCK_HOST) +
+              sh->s->expired_scan_cycle);
 }
 
-static void colo_compare_timer_del(CompareState *s)
+static void colo_compare_timer_del(CompareShard *sh)
 {
-    if (s->packet_check_timer) {
-        timer_free(s->packet_check_timer);
-        s->packet_check_timer = NULL;
+    if (sh->packet_check_timer) {
+        timer_free(sh->packet_check_timer);
+        sh->packet_check_timer = NULL;
     }
  }
 
 static void colo_flush_packets(void *opaque, void *user_data);
 
+/*
+ * Called from the compare thread of the shard to release the primary
+ * packets and drop the secondary ones, including those still waiting
+ * to be queued to their connection.
+ */
+static void colo_compare_flush_shard(void *opaque)
+{
+    CompareShard *sh = opaque;
+
+    colo_compare_input(sh);
+    g_queue_foreach(&sh->conn_list, colo_flush_packets, sh);
+}
+
+/* Called from the iothread reading the packets */
+static void colo_compare_flush(CompareState *s)
+{
+    uint32_t i;
+
+    for (i = 0; i < s->nr_shards; i++) {
+        CompareShard *sh = &s->shards[i];
+
+        if (colo_compare_in_input_thread(sh)) {
+            colo_compare_flush_shard(sh);
+        } else {
+            aio_bh_schedule_oneshot(iothread_get_aio_context(sh->iothread),
+                                    colo_compare_flush_shard, sh);
+        }
+    }
+}
+
 static void colo_compare_handle_event(void *opaque)
 {
-    CompareState *s = opaque;
+    CompareShard *sh = opaque;
+    CompareState *s = sh->s;
 
     switch (s->event) {
     case COLO_EVENT_CHECKPOINT:
-        g_queue_foreach(&s->conn_list, colo_flush_packets, s);
+        colo_compare_flush_shard(sh);
         break;
     case COLO_EVENT_FAILOVER:
         break;
@@ -970,6 +1170,8 @@ static void colo_compare_handle_event(void *opaque)
 static void colo_compare_iothread(CompareState *s)
 {
     AioContext *ctx = iothread_get_aio_context(s->iothread);
+    uint32_t i;
+
     object_ref(OBJECT(s->iothread));
     s->worker_context = iothread_get_g_main_context(s->iothread);
 
@@ -985,8 +1187,29 @@ static void colo_compare_iothread(CompareState *s)
                                  s, s->worker_context, true);
     }
 
-    colo_compare_timer_init(s);
-    s->event_bh = aio_bh_new(ctx, colo_compare_handle_event, s);
+    s->out_bh = aio_bh_new(ctx, colo_compare_output, s);
+    s->notify_bh = aio_bh_new(ctx, colo_compare_notify_bh, s);
+
+    for (i = 0; i < s->nr_shards; i++) {
+        CompareShard *sh = &s->shards[i];
+        AioContext *sh_ctx = iothread_get_aio_context(sh->iothread);
+
+        colo_compare_timer_init(sh);
+        sh->input_bh = aio_bh_new(sh_ctx, colo_compare_input, sh);
+        sh->event_bh = aio_bh_new(sh_ctx, colo_compare_handle_event, sh);
+    }
+}
+
+/* Called from the compare thread of the shard, which owns its BHs and timer */
+static void colo_compare_shard_stop(void *opaque)
+{
+    CompareShard *sh = opaque;
+
+    colo_compare_timer_del(sh);
+    qemu_bh_delete(sh->input_bh);
+    qemu_bh_delete(sh->event_bh);
+    sh->input_bh = NULL;
+    sh->event_bh = NULL;
 }
 
 static char *compare_get_pri_indev(Object *obj, Error **errp)
@@ -1121,6 +1344,57 @@ static void compare_set_expired_scan_cycle(Object *obj, Visitor *v,
     s->expired_scan_cycle = value;
 }
 
+static void compare_get_compare_threads(Object *obj, Visitor *v,
+                                        const char *name, void *opaque,
+                                        Error **errp)
+{
+    CompareState *s = COLO_COMPARE(obj);
+    uint32_t value = s->compare_threads;
+
+    visit_type_uint32(v, name, &value, errp);
+}
+
+static void compare_set_compare_threads(Object *obj, Visitor *v,
+                                        const char *name, void *opaque,
+                                        Error **errp)
+{
+    CompareState *s = COLO_COMPARE(obj);
+    uint32_t value;
+
+    if (!visit_type_uint32(v, name, &value, errp)) {
+        return;
+    }
+    if (value > MAX_COMPARE_THREADS) {
+        error_setg(errp, "Property '%s.%s' must be at most %d",
+                   object_get_typename(obj), name, MAX_COMPARE_THREADS);
+        return;
+    }
+    s->compare_threads = value;
+}
+
+static void compare_get_stat(Object *obj, Visitor *v,
+                             const char *name, void *opaque,
+                             Error **errp)
+{
+    uint64_t value = stat64_get(opaque);
+
+    visit_type_uint64(v, name, &value, errp);
+}
+
+static void compare_get_latency_avg(Object *obj, Visitor *v,
+                                    const char *name, void *opaque,
+                                    Error **errp)
+{
+    CompareState *s = COLO_COMPARE(obj);
+    uint64_t packets = stat64_get(&s->compared_packets);
+    uint64_t value = 0;
+
+    if (packets) {
+        value = stat64_get(&s->compare_latency_total) / packets;
+    }
+    visit_type_uint64(v, name, &value, errp);
+}
+
 static void get_max_queue_size(Object *obj, Visitor *v,
                                const char *name, void *opaque,
                                Error **errp)
@@ -1155,9 +1429,8 @@ out:
 static void compare_pri_rs_finalize(SocketReadState *pri_rs)
 {
     CompareState *s = container_of(pri_rs, CompareState, pri_rs);
-    Connection *conn = NULL;
 
-    if (packet_enqueue(s, PRIMARY_IN, &conn)) {
+    if (packet_enqueue(s, PRIMARY_IN)) {
         trace_colo_compare_main("primary: unsupported packet in");
         compare_chr_send(s,
                          pri_rs->buf,
@@ -1165,22 +1438,15 @@ static void compare_pri_rs_finalize(SocketReadState *pri_rs)
                          pri_rs->vnet_hdr_len,
                          false,
                          false);
-    } else {
-        /* compare packet in the specified connection */
-        colo_compare_connection(conn, s);
     }
 }
 
 static void compare_sec_rs_finalize(SocketReadState *sec_rs)
 {
     CompareState *s = container_of(sec_rs, CompareState, sec_rs);
-    Connection *conn = NULL;
 
-    if (packet_enqueue(s, SECONDARY_IN, &conn)) {
+    if (packet_enqueue(s, SECONDARY_IN)) {
         trace_colo_compare_main("secondary: unsupported packet in");
-    } else {
-        /* compare packet in the specified connection */
-        colo_compare_connection(conn, s);
     }
 }
 
@@ -1202,7 +1468,7 @@ static void compare_notify_rs_finalize(SocketReadState *notify_rs)
                                   notify_rs->buf,
                                   notify_rs->packet_len)) {
         /* colo-compare do checkpoint, flush pri packet and remove sec packet */
-        g_queue_foreach(&s->conn_list, colo_flush_packets, s);
+        colo_compare_flush(s);
     } else {
         error_report("COLO compare got unsupported instruction");
     }
@@ -1238,6 +1504,50 @@ static int find_and_check_chardev(Chardev **chr,
     return 0;
 }
 
+/*
+ * Return 0 is success.
+ * Return 1 is failed.
+ */
+static int colo_compare_shards_init(CompareState *s, Error **errp)
+{
+    const char *id = object_get_canonical_path_component(OBJECT(s));
+    uint32_t i;
+
+    qemu_mutex_init(&s->out_lock);
+    g_queue_init(&s->out_list);
+
+    s->nr_shards = MAX(s->compare_threads, 1);
+    s->shards = g_new0(CompareShard, s->nr_shards);
+
+    for (i = 0; i < s->nr_shards; i++) {
+        CompareShard *sh = &s->shards[i];
+
+        sh->s = s;
+        if (s->compare_threads) {
+            g_autofree char *name = g_strdup_printf("colo-compare-%s-%u",
+                                                    id, i);
+
+            sh->iothread = iothread_create(name, errp);
+            if (!sh->iothread) {
+                return 1;
+            }
+        } else {
+            sh->iothread = s->iothread;
+        }
+
+        qemu_mutex_init(&sh->input_lock);
+        g_queue_init(&sh->input[PRIMARY_IN]);
+        g_queue_init(&sh->input[SECONDARY_IN]);
+        g_queue_init(&sh->conn_list);
+        sh->connection_track_table = g_hash_table_new_full(connection_key_hash,
+                                                           connection_key_equal,
+                                                           g_free,
+                                                           connection_destroy);
+    }
+
+    return 0;
+}
+
 /*
  * Called from the main thread on the primary
  * to setup colo-compare.
@@ -1274,6 +1584,10 @@ static void colo_compare_complete(UserCreatable *uc, Error **errp)
         max_queue_size = MAX_QUEUE_SIZE;
     }
 
+    if (colo_compare_shards_init(s, errp)) {
+        return;
+    }
+
     if (find_and_check_chardev(&chr, s->pri_indev, errp) ||
         !qemu_chr_fe_init(&s->chr_pri_in, chr, errp)) {
         return;
@@ -1317,13 +1631,6 @@ static void colo_compare_complete(UserCreatable *uc, Error **errp)
         g_queue_init(&s->notify_sendco.send_list);
     }
 
-    g_queue_init(&s->conn_list);
-
-    s->connection_track_table = g_hash_table_new_full(connection_key_hash,
-                                                      connection_key_equal,
-                                                      g_free,
-                                                      connection_destroy);
-
     colo_compare_iothread(s);
 
     qemu_mutex_lock(&colo_compare_mutex);
@@ -1340,19 +1647,13 @@ static void colo_compare_complete(UserCreatable *uc, Error **errp)
 
 static void colo_flush_packets(void *opaque, void *user_data)
 {
-    CompareState *s = user_data;
+    CompareShard *sh = user_data;
     Connection *conn = opaque;
     Packet *pkt = NULL;
 
     while (!g_queue_is_empty(&conn->primary_list)) {
         pkt = g_queue_pop_head(&conn->primary_list);
-        compare_chr_send(s,
-                         pkt->data,
-                         pkt->size,
-                         pkt->vnet_hdr_len,
-                         false,
-                         true);
-        packet_destroy_partial(pkt, NULL);
+        colo_compare_output_pkt(sh, pkt);
     }
     while (!g_queue_is_empty(&conn->secondary_list)) {
         pkt = g_queue_pop_head(&conn->secondary_list);
@@ -1397,6 +1698,23 @@ static void colo_compare_init(Object *obj)
                         get_max_queue_size,
                         set_max_queue_size, NULL, NULL);
 
+    object_property_add(obj, "compare_threads", "uint32",
+                        compare_get_compare_threads,
+                        compare_set_compare_threads, NULL, NULL);
+
+    /* Statistics, latencies are in nanoseconds */
+    object_property_add(obj, "compared_packets", "uint64",
+                        compare_get_stat, NULL, NULL,
+                        &s->compared_packets);
+    object_property_add(obj, "checkpoint_requests", "uint64",
+                        compare_get_stat, NULL, NULL,
+                        &s->checkpoint_requests);
+    object_property_add(obj, "compare_latency_max", "uint64",
+                        compare_get_stat, NULL, NULL,
+                        &s->compare_latency_max);
+    object_property_add(obj, "compare_latency_avg", "uint64",
+                        compare_get_latency_avg, NULL, NULL, NULL);
+
     s->vnet_hdr = false;
     object_property_add_bool(obj, "vnet_hdr_support", compare_get_vnet_hdr,
                              compare_set_vnet_hdr);
@@ -1416,6 +1734,7 @@ static void colo_compare_finalize(Object *obj)
 {
     CompareState *s = COLO_COMPARE(obj);
     CompareState *tmp = NULL;
+    uint32_t i;
 
     qemu_mutex_lock(&colo_compare_mutex);
     QTAILQ_FOREACH(tmp, &net_compares, next) {
@@ -1438,9 +1757,31 @@ static void colo_compare_finalize(Object *obj)
         qemu_chr_fe_deinit(&s->chr_notify_dev, false);
     }
 
-    colo_compare_timer_del(s);
+    for (i = 0; i < s->nr_shards; i++) {
+        CompareShard *sh = &s->shards[i];
 
-    qemu_bh_delete(s->event_bh);
+        if (!sh->iothread) {
+            break;
+        }
+        if (sh->input_bh) {
+            AioContext *sh_ctx = iothread_get_aio_context(sh->iothread);
+
+            /* The compare thread may be running the timer or the BHs */
+            aio_context_acquire(sh_ctx);
+            aio_wait_bh_oneshot(sh_ctx, colo_compare_shard_stop, sh);
+            aio_context_release(sh_ctx);
+        }
+        if (!colo_compare_in_input_thread(sh)) {
+            /* Stop the compare thread, the shard is ours from now on */
+            iothread_destroy(sh->iothread);
+            sh->iothread = NULL;
+        }
+    }
+
+    if (s->out_bh) {
+        qemu_bh_delete(s->out_bh);
+        qemu_bh_delete(s->notify_bh);
+    }
 
     AioContext *ctx = iothread_get_aio_context(s->iothread);
     aio_context_acquire(ctx);
@@ -1451,17 +1792,27 @@ static void colo_compare_finalize(Object *obj)
     aio_context_release(ctx);
 
     /* Release all unhandled packets after compare thead exited */
-    g_queue_foreach(&s->conn_list, colo_flush_packets, s);
+    for (i = 0; i < s->nr_shards && s->shards[i].connection_track_table; i++) {
+        CompareShard *sh = &s->shards[i];
+
+        /* Send directly, the output bottom half is gone */
+        sh->iothread = s->iothread;
+        colo_compare_flush_shard(sh);
+        colo_compare_output(s);
+
+        g_queue_clear(&sh->conn_list);
+        g_hash_table_destroy(sh->connection_track_table);
+        qemu_mutex_destroy(&sh->input_lock);
+    }
     AIO_WAIT_WHILE(NULL, !s->out_sendco.done);
 
-    g_queue_clear(&s->conn_list);
     g_queue_clear(&s->out_sendco.send_list);
     if (s->notify_dev) {
         g_queue_clear(&s->notify_sendco.send_list);
     }
-
-    if (s->connection_track_table) {
-        g_hash_table_destroy(s->connection_track_table);
+    if (s->shards) {
+        qemu_mutex_destroy(&s->out_lock);
+        g_free(s->shards);
     }
 
     object_unref(OBJECT(s->iothread));
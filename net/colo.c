@@ -161,7 +161,7 @@ Packet *packet_new(const void *data, int size, int vnet_hdr_len)
 
     pkt->data = g_memdup(data, size);
     pkt->size = size;
-    pkt->creation_ms = qemu_clock_get_ms(QEMU_CLOCK_HOST);
+    pkt->creation_ns = qemu_clock_get_ns(QEMU_CLOCK_HOST);
     pkt->vnet_hdr_len = vnet_hdr_len;
 
     return pkt;
@@ -177,7 +177,7 @@ Packet *packet_new_nocopy(void *data, int size, int vnet_hdr_len)
 
     pkt->data = data;
     pkt->size = size;
-    pkt->creation_ms = qemu_clock_get_ms(QEMU_CLOCK_HOST);
+    pkt->creation_ns = qemu_clock_get_ns(QEMU_CLOCK_HOST);
     pkt->vnet_hdr_len = vnet_hdr_len;
 
     return pkt;
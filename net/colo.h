@@ -41,8 +41,8 @@ typedef struct Packet {
     };
     uint8_t *transport_header;
     int size;
-    /* Time of packet creation, in wall clock ms */
-    int64_t creation_ms;
+    /* Time of packet creation, in wall clock ns */
+    int64_t creation_ns;
     /* Get vnet_hdr_len from filter */
     uint32_t vnet_hdr_len;
     uint32_t tcp_seq; /* sequence number */
@@ -8,6 +8,7 @@
 
 #include "qemu/osdep.h"
 #include "net/filter.h"
+#include "net/net.h"
 #include "net/queue.h"
 #include "qapi/error.h"
 #include "qemu/timer.h"
@@ -49,7 +50,9 @@ static void filter_buffer_release_timer(void *opaque)
      * for the next filter or receiver to notify us that it can receive
      * more packets.
      */
+    qemu_net_acquire(nf->netdev);
     filter_buffer_flush(nf);
+    qemu_net_release(nf->netdev);
     /* Timer rearmed to fire again in s->interval microseconds. */
     timer_mod(&s->release_timer,
               qemu_clock_get_us(QEMU_CLOCK_VIRTUAL) + s->interval);
@@ -95,7 +98,7 @@ static void filter_buffer_cleanup(NetFilterState *nf)
     /* flush packets */
     if (s->incoming_queue) {
         filter_buffer_flush(nf);
-        g_free(s->incoming_queue);
+        qemu_del_net_queue(s->incoming_queue);
     }
 }
 
@@ -0,0 +1,204 @@
+/*
+ * Drop the packets that match a rule
+ *
+ * When only offloadable filters are in front of it, a tap netdev drops
+ * the matching packets in the kernel, before QEMU reads them.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * later.  See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "net/eth.h"
+#include "net/filter.h"
+#include "net/net.h"
+#include "qapi/error.h"
+#include "qapi/visitor.h"
+#include "qemu/iov.h"
+#include "qom/object.h"
+#include "ebpf/ebpf_filter.h"
+
+#define TYPE_FILTER_DROP "filter-drop"
+
+OBJECT_DECLARE_SIMPLE_TYPE(FilterDropState, FILTER_DROP)
+
+struct FilterDropState {
+    NetFilterState parent_obj;
+
+    struct EBPFFilterRule rule;
+};
+
+/*
+ * Same parsing as the eBPF program, see ebpf/ebpf_filter.c.  A field
+ * past the end of a truncated frame is 0, so the frame only matches the
+ * rule if the rule does not look at it.  The program sees the frame
+ * without the vnet header that QEMU gets.
+ */
+static bool filter_drop_match(FilterDropState *s, size_t offset,
+                              const struct iovec *iov, int iovcnt)
+{
+    const struct EBPFFilterRule *rule = &s->rule;
+    uint8_t buf[ETH_HLEN + 60 + 4];
+    size_t size = iov_to_buf(iov, iovcnt, offset, buf, sizeof(buf));
+    uint16_t ethertype, dst_port = 0;
+    uint8_t ip_proto = 0;
+    size_t l4 = 0;
+
+    if (size >= ETH_HLEN) {
+        ethertype = lduw_be_p(buf + 12);
+    }
+    if (ethertype == ETH_P_IP && size >= ETH_HLEN + 10) {
+        ip_proto = buf[ETH_HLEN + 9];
+        if (!(lduw_be_p(buf + ETH_HLEN + 6) & IP_OFFMASK)) {
+            l4 = ETH_HLEN + (buf[ETH_HLEN] & 0xf) * 4;
+        }
+    } else if (ethertype == ETH_P_IPV6 && size >= ETH_HLEN + 7) {
+        ip_proto = buf[ETH_HLEN + 6];
+        l4 = ETH_HLEN + sizeof(struct ip6_header);
+    }
+    if (l4 && (ip_proto == IP_PROTO_TCP || ip_proto == IP_PROTO_UDP) &&
+        size >= l4 + 4) {
+        dst_port = lduw_be_p(buf + l4 + 2);
+    }
+
+    return (!rule->ethertype || rule->ethertype == ethertype) &&
+           (!rule->ip_proto || rule->ip_proto == ip_proto) &&
+           (!rule->dst_port || rule->dst_port == dst_port);
+}
+
+static ssize_t filter_drop_receive_iov(NetFilterState *nf,
+                                       NetClientState *sender,
+                                       unsigned flags,
+                                       const struct iovec *iov,
+                                       int iovcnt,
+                                       NetPacketSent *sent_cb)
+{
+    FilterDropState *s = FILTER_DROP(nf);
+
+    if (filter_drop_match(s, nf->netdev->vnet_hdr_len, iov, iovcnt)) {
+        return iov_size(iov, iovcnt);
+    }
+    return 0;
+}
+
+static bool filter_drop_ebpf_rule(NetFilterState *nf,
+                                  struct EBPFFilterRule *rule)
+{
+    FilterDropState *s = FILTER_DROP(nf);
+
+    *rule = s->rule;
+    return true;
+}
+
+static void filter_drop_rule_changed(Object *obj)
+{
+    NetFilterState *nf = NETFILTER(obj);
+
+    if (nf->netdev) {
+        netfilter_update_ebpf(nf->netdev);
+    }
+}
+
+static void filter_drop_get_ethertype(Object *obj, Visitor *v,
+                                      const char *name, void *opaque,
+                                      Error **errp)
+{
+    FilterDropState *s = FILTER_DROP(obj);
+    uint16_t value = s->rule.ethertype;
+
+    visit_type_uint16(v, name, &value, errp);
+}
+
+static void filter_drop_set_ethertype(Object *obj, Visitor *v,
+                                      const char *name, void *opaque,
+                                      Error **errp)
+{
+    FilterDropState *s = FILTER_DROP(obj);
+    uint16_t value;
+
+    if (!visit_type_uint16(v, name, &value, errp)) {
+        return;
+    }
+    s->rule.ethertype = value;
+    filter_drop_rule_changed(obj);
+}
+
+static void filter_drop_get_ip_proto(Object *obj, Visitor *v,
+                                     const char *name, void *opaque,
+                                     Error **errp)
+{
+    FilterDropState *s = FILTER_DROP(obj);
+    uint8_t value = s->rule.ip_proto;
+
+    visit_type_uint8(v, name, &value, errp);
+}
+
+static void filter_drop_set_ip_proto(Object *obj, Visitor *v,
+                                     const char *name, void *opaque,
+                                     Error **errp)
+{
+    FilterDropState *s = FILTER_DROP(obj);
+    uint8_t value;
+
+    if (!visit_type_uint8(v, name, &value, errp)) {
+        return;
+    }
+    s->rule.ip_proto = value;
+    filter_drop_rule_changed(obj);
+}
+
+static void filter_drop_get_port(Object *obj, Visitor *v,
+                                 const char *name, void *opaque,
+                                 Error **errp)
+{
+    FilterDropState *s = FILTER_DROP(obj);
+    uint16_t value = s->rule.dst_port;
+
+    visit_type_uint16(v, name, &value, errp);
+}
+
+static void filter_drop_set_port(Object *obj, Visitor *v,
+                                 const char *name, void *opaque,
+                                 Error **errp)
+{
+    FilterDropState *s = FILTER_DROP(obj);
+    uint16_t value;
+
+    if (!visit_type_uint16(v, name, &value, errp)) {
+        return;
+    }
+    s->rule.dst_port = value;
+    filter_drop_rule_changed(obj);
+}
+
+static void filter_drop_class_init(ObjectClass *oc, void *data)
+{
+    NetFilterClass *nfc = NETFILTER_CLASS(oc);
+
+    object_class_property_add(oc, "ethertype", "uint16",
+                              filter_drop_get_ethertype,
+                              filter_drop_set_ethertype, NULL, NULL);
+    object_class_property_add(oc, "ip_proto", "uint8",
+                              filter_drop_get_ip_proto,
+                              filter_drop_set_ip_proto, NULL, NULL);
+    object_class_property_add(oc, "port", "uint16",
+                              filter_drop_get_port,
+                              filter_drop_set_port, NULL, NULL);
+
+    nfc->receive_iov = filter_drop_receive_iov;
+    nfc->ebpf_rule = filter_drop_ebpf_rule;
+}
+
+static const TypeInfo filter_drop_info = {
+    .name = TYPE_FILTER_DROP,
+    .parent = TYPE_NETFILTER,
+    .class_init = filter_drop_class_init,
+    .instance_size = sizeof(FilterDropState),
+};
+
+static void register_types(void)
+{
+    type_register_static(&filter_drop_info);
+}
+
+type_init(register_types);
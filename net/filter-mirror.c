@@ -103,6 +103,7 @@ static void redirector_to_filter(NetFilterState *nf,
         .iov_len = len,
     };
 
+    qemu_net_acquire(nf->netdev);
     if (nf->direction == NET_FILTER_DIRECTION_ALL ||
         nf->direction == NET_FILTER_DIRECTION_TX) {
         qemu_netfilter_pass_to_next(nf->netdev, 0, &iov, 1, nf);
@@ -112,6 +113,7 @@ static void redirector_to_filter(NetFilterState *nf,
         nf->direction == NET_FILTER_DIRECTION_RX) {
         qemu_netfilter_pass_to_next(nf->netdev->peer, 0, &iov, 1, nf);
      }
+    qemu_net_release(nf->netdev);
 }
 
 static int redirector_chr_can_read(void *opaque)
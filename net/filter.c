@@ -19,6 +19,7 @@
 #include "qemu/module.h"
 #include "net/colo.h"
 #include "migration/colo.h"
+#include "ebpf/ebpf_filter.h"
 
 static inline bool qemu_can_skip_netfilter(NetFilterState *nf)
 {
@@ -119,6 +120,69 @@ out:
     return iov_size(iov, iovcnt);
 }
 
+/*
+ * Let the netdev drop in the kernel, before QEMU reads them, the packets
+ * that the filters at the head of its chain would drop anyway.  Filters
+ * behind any other filter cannot be offloaded, since the latter must
+ * still see every packet.
+ */
+void netfilter_update_ebpf(NetClientState *netdev)
+{
+    struct EBPFFilterRule rules[EBPF_FILTER_MAX_RULES];
+    NetFilterState *offload[EBPF_FILTER_MAX_RULES];
+    NetClientState *ncs[MAX_QUEUE_NUM];
+    NetFilterState *nf;
+    int nr_rules = 0;
+    int prog_fd = -1;
+    int i;
+
+    if (!netdev->info->set_filter_ebpf) {
+        return;
+    }
+    /*
+     * The program is only attached to @netdev.  netfilter_complete()
+     * refuses multiqueue netdevs already, so the other queues never need
+     * it; do not offload should that change.
+     */
+    if (qemu_find_net_clients_except(netdev->name, ncs, NET_CLIENT_DRIVER_NIC,
+                                     MAX_QUEUE_NUM) > 1) {
+        return;
+    }
+
+    /* Packets sent by the netdev walk the filters forward */
+    QTAILQ_FOREACH(nf, &netdev->filters, next) {
+        NetFilterClass *nfc = NETFILTER_GET_CLASS(OBJECT(nf));
+
+        if (!nf->on || nf->direction == NET_FILTER_DIRECTION_RX) {
+            continue;
+        }
+        if (nr_rules == EBPF_FILTER_MAX_RULES || !nfc->ebpf_rule ||
+            !nfc->ebpf_rule(nf, &rules[nr_rules])) {
+            break;
+        }
+        offload[nr_rules++] = nf;
+    }
+
+    if (nr_rules) {
+        prog_fd = ebpf_filter_load(rules, nr_rules);
+    }
+    if (prog_fd >= 0 || netdev->filter_ebpf) {
+        /* The filters still drop the packets if this fails */
+        netdev->filter_ebpf = netdev->info->set_filter_ebpf(netdev, prog_fd) &&
+                              prog_fd >= 0;
+    }
+    if (prog_fd >= 0) {
+        close(prog_fd);
+    }
+
+    QTAILQ_FOREACH(nf, &netdev->filters, next) {
+        nf->offloaded = false;
+    }
+    for (i = 0; i < nr_rules && netdev->filter_ebpf; i++) {
+        offload[i]->offloaded = true;
+    }
+}
+
 static char *netfilter_get_netdev_id(Object *obj, Error **errp)
 {
     NetFilterState *nf = NETFILTER(obj);
@@ -169,6 +233,9 @@ static void netfilter_set_status(Object *obj, const char *str, Error **errp)
     if (nf->netdev && nfc->status_changed) {
         nfc->status_changed(nf, errp);
     }
+    if (nf->netdev) {
+        netfilter_update_ebpf(nf->netdev);
+    }
 }
 
 static char *netfilter_get_position(Object *obj, Error **errp)
@@ -301,6 +368,8 @@ static void netfilter_complete(UserCreatable *uc, Error **errp)
     } else if (!strcmp(nf->position, "tail")) {
         QTAILQ_INSERT_TAIL(&nf->netdev->filters, nf, next);
     }
+
+    netfilter_update_ebpf(nf->netdev);
 }
 
 static void netfilter_finalize(Object *obj)
@@ -315,6 +384,7 @@ static void netfilter_finalize(Object *obj)
     if (nf->netdev && !QTAILQ_EMPTY(&nf->netdev->filters) &&
         QTAILQ_IN_USE(nf, next)) {
         QTAILQ_REMOVE(&nf->netdev->filters, nf, next);
+        netfilter_update_ebpf(nf->netdev);
     }
     g_free(nf->netdev_id);
     g_free(nf->position);
@@ -333,6 +403,13 @@ static void default_handle_event(NetFilterState *nf, int event, Error **errp)
     }
 }
 
+static bool netfilter_get_offloaded(Object *obj, Error **errp)
+{
+    NetFilterState *nf = NETFILTER(obj);
+
+    return nf->offloaded;
+}
+
 static void netfilter_class_init(ObjectClass *oc, void *data)
 {
     UserCreatableClass *ucc = USER_CREATABLE_CLASS(oc);
@@ -349,6 +426,8 @@ static void netfilter_class_init(ObjectClass *oc, void *data)
                                   netfilter_get_position, netfilter_set_position);
     object_class_property_add_str(oc, "insert",
                                   netfilter_get_insert, netfilter_set_insert);
+    object_class_property_add_bool(oc, "offloaded",
+                                   netfilter_get_offloaded, NULL);
 
     ucc->complete = netfilter_complete;
     nfc->handle_event = default_handle_event;
@@ -0,0 +1,638 @@
+/*
+ * Software segmentation and coalescing of TCP/UDP super-packets
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/iov.h"
+#include "net/checksum.h"
+#include "net/gso.h"
+
+/* TCP flows net_gro_receive() holds packets for at once */
+#define NET_GRO_FLOWS       8
+
+#define IP4_HDR_LEN         sizeof(struct ip_header)
+#define IP6_HDR_LEN         sizeof(struct ip6_header)
+#define TCP_HDR_LEN         sizeof(struct tcp_header)
+#define UDP_HDR_LEN         sizeof(struct udp_header)
+
+/* Field offsets, packet headers are not aligned */
+#define IP4_LEN             offsetof(struct ip_header, ip_len)
+#define IP4_ID              offsetof(struct ip_header, ip_id)
+#define IP4_OFF             offsetof(struct ip_header, ip_off)
+#define IP4_SUM             offsetof(struct ip_header, ip_sum)
+#define IP4_SRC             offsetof(struct ip_header, ip_src)
+#define IP6_PLEN            4
+#define IP6_SRC             offsetof(struct ip6_header, ip6_src)
+#define TCP_SEQ             offsetof(struct tcp_header, th_seq)
+#define TCP_ACK             offsetof(struct tcp_header, th_ack)
+#define TCP_FLAGS           13
+#define TCP_WIN             offsetof(struct tcp_header, th_win)
+#define TCP_SUM             offsetof(struct tcp_header, th_sum)
+
+typedef struct NetGsoHdr {
+    size_t l3_off;
+    size_t l4_off;
+    size_t hdr_len;         /* up to the L4 payload */
+    bool is_v6;
+    uint8_t l4proto;
+} NetGsoHdr;
+
+/* Parse the headers at the start of @buf, which holds @len bytes */
+static bool net_gso_parse(const uint8_t *buf, size_t len, NetGsoHdr *h)
+{
+    uint16_t proto;
+    size_t off;
+
+    if (len < ETH_HLEN + sizeof(struct vlan_header)) {
+        return false;
+    }
+    h->l3_off = eth_get_l2_hdr_length(buf);
+    proto = lduw_be_p(buf + h->l3_off - 2);
+    off = h->l3_off;
+
+    switch (proto) {
+    case ETH_P_IP:
+        if (len < off + IP4_HDR_LEN || (buf[off] >> 4) != IP_HEADER_VERSION_4) {
+            return false;
+        }
+        h->is_v6 = false;
+        h->l4proto = buf[off + offsetof(struct ip_header, ip_p)];
+        off += (buf[off] & 0xf) << 2;
+        if (off < h->l3_off + IP4_HDR_LEN) {
+            return false;
+        }
+        break;
+    case ETH_P_IPV6:
+        if (len < off + IP6_HDR_LEN || (buf[off] >> 4) != IP_HEADER_VERSION_6) {
+            return false;
+        }
+        h->is_v6 = true;
+        h->l4proto = buf[off + 6];
+        off += IP6_HDR_LEN;
+        while (h->l4proto == IP6_HOP_BY_HOP || h->l4proto == IP6_ROUTING ||
+               h->l4proto == IP6_DESTINATON) {
+            if (len < off + sizeof(struct ip6_ext_hdr)) {
+                return false;
+            }
+            h->l4proto = buf[off];
+            off += (buf[off + 1] + 1) * IP6_EXT_GRANULARITY;
+        }
+        break;
+    default:
+        return false;
+    }
+
+    h->l4_off = off;
+    switch (h->l4proto) {
+    case IP_PROTO_TCP:
+        if (len < off + TCP_HDR_LEN) {
+            return false;
+        }
+        off += (buf[off + TCP_FLAGS - 1] >> 4) << 2;
+        if (off < h->l4_off + TCP_HDR_LEN) {
+            return false;
+        }
+        break;
+    case IP_PROTO_UDP:
+        off += UDP_HDR_LEN;
+        break;
+    default:
+        return false;
+    }
+
+    h->hdr_len = off;
+    return h->hdr_len <= len;
+}
+
+/* Partial checksum of the TCP/UDP pseudo header */
+static uint32_t net_gso_pseudo_sum(uint8_t *l3, const NetGsoHdr *h,
+                                   size_t l4_len)
+{
+    if (h->is_v6) {
+        return net_checksum_add(32, l3 + IP6_SRC) + h->l4proto + l4_len;
+    }
+    return net_checksum_add(8, l3 + IP4_SRC) + h->l4proto + l4_len;
+}
+
+static void net_gso_fix_ip_len(uint8_t *l3, const NetGsoHdr *h,
+                               size_t l3_len)
+{
+    if (h->is_v6) {
+        stw_be_p(l3 + IP6_PLEN, l3_len - IP6_HDR_LEN);
+    } else {
+        stw_be_p(l3 + IP4_LEN, l3_len);
+        stw_be_p(l3 + IP4_SUM, 0);
+        stw_be_p(l3 + IP4_SUM,
+                 net_raw_checksum(l3, h->l4_off - h->l3_off));
+    }
+}
+
+static NetPacketIOV *net_gso_next(NetGsoBatch *batch, NetGsoFlush *flush,
+                                  void *opaque)
+{
+    if (batch->npkts == NET_GSO_BATCH) {
+        flush(batch, false, opaque);
+        batch->npkts = 0;
+    }
+    return &batch->pkts[batch->npkts];
+}
+
+static void net_gso_finish(NetGsoBatch *batch, NetGsoFlush *flush,
+                           void *opaque)
+{
+    flush(batch, true, opaque);
+    batch->npkts = 0;
+}
+
+/*
+ * Complete the checksum of a packet that needs no segmentation: sum from
+ * csum_start to the end and store it csum_offset bytes further.  The
+ * bytes up to the checksum field are copied, the rest is left in place.
+ */
+static int net_gso_csum(NetGsoBatch *batch, const struct virtio_net_hdr *vhdr,
+                        const struct iovec *iov, int iovcnt, size_t size,
+                        NetGsoFlush *flush, void *opaque)
+{
+    size_t start = vhdr->csum_start;
+    size_t field = start + vhdr->csum_offset;
+    size_t hlen = field + 2;
+    struct iovec *sg = batch->iov[0];
+    uint8_t *hdr = batch->hdr[0];
+    struct iovec linear;
+    uint32_t sum;
+    int cnt;
+
+    if (hlen > size || hlen > NET_GSO_MAX_HDR) {
+        return -EINVAL;
+    }
+    if (iovcnt > NET_GSO_MAX_IOV) {
+        if (size > NET_GSO_MAX_SIZE) {
+            return -EINVAL;
+        }
+        linear.iov_base = batch->linear;
+        linear.iov_len = iov_to_buf(iov, iovcnt, 0, batch->linear, size);
+        iov = &linear;
+        iovcnt = 1;
+    }
+
+    iov_to_buf(iov, iovcnt, 0, hdr, hlen);
+    sum = net_checksum_add(hlen - start, hdr + start);
+    sum += net_checksum_add_iov(iov, iovcnt, hlen, size - hlen, hlen - start);
+    stw_be_p(hdr + field, net_checksum_finish(sum));
+
+    sg[0].iov_base = hdr;
+    sg[0].iov_len = hlen;
+    cnt = iov_copy(sg + 1, NET_GSO_MAX_IOV, iov, iovcnt, hlen, size - hlen);
+    batch->pkts[0].iov = sg;
+    batch->pkts[0].iovcnt = cnt + 1;
+    batch->npkts = 1;
+    net_gso_finish(batch, flush, opaque);
+    return 1;
+}
+
+static int net_gso_tcp(NetGsoBatch *batch, const NetGsoHdr *h, size_t mss,
+                       const struct iovec *iov, int iovcnt, size_t size,
+                       NetGsoFlush *flush, void *opaque)
+{
+    uint8_t *tmpl = batch->linear;
+    size_t off = h->hdr_len;
+    uint32_t seq = ldl_be_p(tmpl + h->l4_off + TCP_SEQ);
+    uint16_t id = lduw_be_p(tmpl + h->l3_off + IP4_ID);
+    int nsegs = 0;
+
+    do {
+        size_t len = MIN(mss, size - off);
+        bool last = off + len == size;
+        NetPacketIOV *pkt = net_gso_next(batch, flush, opaque);
+        struct iovec *sg = batch->iov[batch->npkts];
+        uint8_t *hdr = batch->hdr[batch->npkts];
+        uint8_t *l3 = hdr + h->l3_off;
+        uint8_t *l4 = hdr + h->l4_off;
+        size_t l4_len = h->hdr_len - h->l4_off + len;
+        uint32_t sum;
+        int cnt;
+
+        memcpy(hdr, tmpl, h->hdr_len);
+        if (!h->is_v6) {
+            stw_be_p(l3 + IP4_ID, id + nsegs);
+        }
+        net_gso_fix_ip_len(l3, h, h->l4_off - h->l3_off + l4_len);
+
+        stl_be_p(l4 + TCP_SEQ, seq + (off - h->hdr_len));
+        if (!last) {
+            l4[TCP_FLAGS] &= ~(TH_FIN | TH_PUSH);
+        }
+        if (nsegs) {
+            l4[TCP_FLAGS] &= ~TH_CWR;
+        }
+        stw_be_p(l4 + TCP_SUM, 0);
+
+        sg[0].iov_base = hdr;
+        sg[0].iov_len = h->hdr_len;
+        cnt = iov_copy(sg + 1, NET_GSO_MAX_IOV, iov, iovcnt, off, len);
+
+        sum = net_gso_pseudo_sum(l3, h, l4_len);
+        sum += net_checksum_add(h->hdr_len - h->l4_off, l4);
+        sum += net_checksum_add_iov(sg + 1, cnt, 0, len, 0);
+        stw_be_p(l4 + TCP_SUM, net_checksum_finish(sum));
+
+        pkt->iov = sg;
+        pkt->iovcnt = cnt + 1;
+        batch->npkts++;
+        nsegs++;
+        off += len;
+    } while (off < size);
+
+    net_gso_finish(batch, flush, opaque);
+    return nsegs;
+}
+
+/* UDP datagrams cannot be split, send them as IPv4 fragments instead */
+static int net_gso_udp4(NetGsoBatch *batch, const NetGsoHdr *h, size_t mss,
+                        size_t size, NetGsoFlush *flush, void *opaque)
+{
+    uint8_t *data = batch->linear;
+    size_t frag = MAX(IP_FRAG_ALIGN_SIZE(mss), IP_FRAG_UNIT_SIZE);
+    size_t off = h->l4_off;
+    int nsegs = 0;
+
+    do {
+        size_t len = MIN(frag, size - off);
+        bool last = off + len == size;
+        NetPacketIOV *pkt = net_gso_next(batch, flush, opaque);
+        struct iovec *sg = batch->iov[batch->npkts];
+        uint8_t *hdr = batch->hdr[batch->npkts];
+        uint8_t *l3 = hdr + h->l3_off;
+
+        memcpy(hdr, data, h->l4_off);
+        stw_be_p(l3 + IP4_OFF, ((off - h->l4_off) / IP_FRAG_UNIT_SIZE) |
+                               (last ? 0 : IP_MF));
+        net_gso_fix_ip_len(l3, h, h->l4_off - h->l3_off + len);
+
+        sg[0].iov_base = hdr;
+        sg[0].iov_len = h->l4_off;
+        sg[1].iov_base = data + off;
+        sg[1].iov_len = len;
+
+        pkt->iov = sg;
+        pkt->iovcnt = 2;
+        batch->npkts++;
+        nsegs++;
+        off += len;
+    } while (off < size);
+
+    net_gso_finish(batch, flush, opaque);
+    return nsegs;
+}
+
+int net_gso_segment(NetGsoBatch *batch, const struct virtio_net_hdr *vhdr,
+                    const struct iovec *iov, int iovcnt,
+                    NetGsoFlush *flush, void *opaque)
+{
+    struct iovec linear;
+    size_t size = iov_size(iov, iovcnt);
+    size_t mss = vhdr->gso_size;
+    NetGsoHdr h;
+
+    batch->npkts = 0;
+
+    if (vhdr->gso_type == VIRTIO_NET_HDR_GSO_NONE) {
+        if (vhdr->flags & VIRTIO_NET_HDR_F_NEEDS_CSUM) {
+            return net_gso_csum(batch, vhdr, iov, iovcnt, size, flush, opaque);
+        }
+        batch->pkts[0].iov = iov;
+        batch->pkts[0].iovcnt = iovcnt;
+        batch->npkts = 1;
+        net_gso_finish(batch, flush, opaque);
+        return 1;
+    }
+
+    /* The headers are parsed from a copy, which is also the template */
+    if (!mss ||
+        !net_gso_parse(batch->linear,
+                       iov_to_buf(iov, iovcnt, 0, batch->linear,
+                                  NET_GSO_MAX_HDR), &h) ||
+        h.hdr_len > size) {
+        return -EINVAL;
+    }
+
+    switch (vhdr->gso_type & ~VIRTIO_NET_HDR_GSO_ECN) {
+    case VIRTIO_NET_HDR_GSO_TCPV4:
+    case VIRTIO_NET_HDR_GSO_TCPV6:
+        if (h.l4proto != IP_PROTO_TCP) {
+            return -EINVAL;
+        }
+        if (iovcnt > NET_GSO_MAX_IOV) {
+            if (size > NET_GSO_MAX_SIZE) {
+                return -EINVAL;
+            }
+            linear.iov_base = batch->linear;
+            linear.iov_len = iov_to_buf(iov, iovcnt, 0, batch->linear, size);
+            iov = &linear;
+            iovcnt = 1;
+        }
+        return net_gso_tcp(batch, &h, mss, iov, iovcnt, size, flush, opaque);
+
+    case VIRTIO_NET_HDR_GSO_UDP:
+        if (h.is_v6 || h.l4proto != IP_PROTO_UDP || size > NET_GSO_MAX_SIZE) {
+            return -EINVAL;
+        }
+        iov_to_buf(iov, iovcnt, 0, batch->linear, size);
+        if (vhdr->flags & VIRTIO_NET_HDR_F_NEEDS_CSUM) {
+            size_t start = vhdr->csum_start;
+            size_t field = start + vhdr->csum_offset;
+
+            if (field + 2 > size) {
+                return -EINVAL;
+            }
+            stw_be_p(batch->linear + field,
+                     net_raw_checksum(batch->linear + start, size - start));
+        }
+        return net_gso_udp4(batch, &h, mss, size, flush, opaque);
+
+    default:
+        return -EINVAL;
+    }
+}
+
+typedef struct NetGroFlow {
+    uint8_t *buf;           /* the packet being built */
+    size_t size;            /* 0 if the flow is not in use */
+    NetGsoHdr h;
+    size_t mss;             /* payload of the first segment */
+    uint32_t next_seq;
+    int nsegs;
+} NetGroFlow;
+
+struct NetGro {
+    NetGroDeliver *deliver;
+    void *opaque;
+    unsigned evict;
+    NetGroFlow flows[NET_GRO_FLOWS];
+};
+
+NetGro *net_gro_new(NetGroDeliver *deliver, void *opaque)
+{
+    NetGro *gro = g_new0(NetGro, 1);
+
+    gro->deliver = deliver;
+    gro->opaque = opaque;
+    return gro;
+}
+
+void net_gro_free(NetGro *gro)
+{
+    int i;
+
+    if (!gro) {
+        return;
+    }
+    for (i = 0; i < NET_GRO_FLOWS; i++) {
+        g_free(gro->flows[i].buf);
+    }
+    g_free(gro);
+}
+
+/* Returns false, and keeps the flow, if the receiver has no room */
+static bool net_gro_deliver(NetGro *gro, NetGroFlow *f)
+{
+    struct virtio_net_hdr vhdr = { 0 };
+    uint8_t *l3 = f->buf + f->h.l3_off;
+    uint8_t *l4 = f->buf + f->h.l4_off;
+    size_t size = f->size;
+
+    if (f->nsegs > 1) {
+        /*
+         * Leave the TCP checksum to the receiver: the field holds the sum
+         * of the pseudo header, as for a packet sent with NEEDS_CSUM.
+         */
+        net_gso_fix_ip_len(l3, &f->h, size - f->h.l3_off);
+        stw_be_p(l4 + TCP_SUM,
+                 (uint16_t)~net_checksum_finish(
+                     net_gso_pseudo_sum(l3, &f->h, size - f->h.l4_off)));
+        vhdr.flags = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+        vhdr.gso_type = f->h.is_v6 ? VIRTIO_NET_HDR_GSO_TCPV6 :
+                                     VIRTIO_NET_HDR_GSO_TCPV4;
+        vhdr.hdr_len = f->h.hdr_len;
+        vhdr.gso_size = f->mss;
+        vhdr.csum_start = f->h.l4_off;
+        vhdr.csum_offset = TCP_SUM;
+    }
+
+    if (!gro->deliver(&vhdr, f->buf, size, gro->opaque)) {
+        return false;
+    }
+    f->size = 0;
+    return true;
+}
+
+/* Whether @buf can be part of a coalesced packet at all */
+static bool net_gro_candidate(uint8_t *buf, size_t size, const NetGsoHdr *h)
+{
+    uint8_t *l3 = buf + h->l3_off;
+    uint8_t *l4 = buf + h->l4_off;
+    uint8_t flags = l4[TCP_FLAGS];
+    uint32_t sum;
+
+    if (h->l4proto != IP_PROTO_TCP || size == h->hdr_len ||
+        (flags & ~TH_PUSH) != TH_ACK) {
+        return false;
+    }
+
+    if (h->is_v6) {
+        if (h->l4_off != h->l3_off + IP6_HDR_LEN) {
+            return false;
+        }
+    } else {
+        if (h->l4_off != h->l3_off + IP4_HDR_LEN ||
+            (lduw_be_p(l3 + IP4_OFF) & (IP_OFFMASK | IP_MF)) ||
+            net_raw_checksum(l3, IP4_HDR_LEN)) {
+            return false;
+        }
+    }
+
+    sum = net_gso_pseudo_sum(l3, h, size - h->l4_off);
+    sum += net_checksum_add(size - h->l4_off, l4);
+    return net_checksum_finish(sum) == 0;
+}
+
+/* Whether @buf has the same addresses and ports as the flow */
+static bool net_gro_same_flow(NetGroFlow *f, uint8_t *buf, const NetGsoHdr *h)
+{
+    size_t addr = h->l3_off + (h->is_v6 ? IP6_SRC : IP4_SRC);
+    size_t addr_len = h->is_v6 ? 32 : 8;
+
+    return f->size && f->h.is_v6 == h->is_v6 && f->h.l3_off == h->l3_off &&
+           f->h.l4_off == h->l4_off &&
+           !memcmp(f->buf, buf, h->l3_off) &&
+           !memcmp(f->buf + addr, buf + addr, addr_len) &&
+           !memcmp(f->buf + h->l4_off, buf + h->l4_off, 4);
+}
+
+/* Whether @buf continues the flow */
+static bool net_gro_can_merge(NetGroFlow *f, uint8_t *buf, size_t size,
+                              const NetGsoHdr *h)
+{
+    uint8_t *l3 = buf + h->l3_off;
+    uint8_t *l4 = buf + h->l4_off;
+    uint8_t *fl3 = f->buf + h->l3_off;
+    uint8_t *fl4 = f->buf + h->l4_off;
+    size_t len = size - h->hdr_len;
+
+    if (f->h.hdr_len != h->hdr_len || len > f->mss ||
+        f->size + len > NET_GSO_MAX_SIZE ||
+        f->size + len - h->l3_off > ETH_MAX_IP_DGRAM_LEN ||
+        ldl_be_p(l4 + TCP_SEQ) != f->next_seq ||
+        ldl_be_p(l4 + TCP_ACK) != ldl_be_p(fl4 + TCP_ACK) ||
+        memcmp(l4 + TCP_HDR_LEN, fl4 + TCP_HDR_LEN,
+               h->hdr_len - h->l4_off - TCP_HDR_LEN)) {
+        return false;
+    }
+
+    if (h->is_v6) {
+        /* Version, traffic class, flow label; hop limit */
+        return !memcmp(l3, fl3, 4) && l3[7] == fl3[7];
+    }
+    /* TOS; DF and TTL */
+    return l3[1] == fl3[1] && !memcmp(l3 + IP4_OFF, fl3 + IP4_OFF, 3);
+}
+
+/* Returns NULL if a flow has to be evicted, and cannot be delivered */
+static NetGroFlow *net_gro_alloc(NetGro *gro)
+{
+    NetGroFlow *f;
+    int i;
+
+    for (i = 0; i < NET_GRO_FLOWS; i++) {
+        if (!gro->flows[i].size) {
+            f = &gro->flows[i];
+            goto found;
+        }
+    }
+    f = &gro->flows[gro->evict];
+    if (!net_gro_deliver(gro, f)) {
+        return NULL;
+    }
+    gro->evict = (gro->evict + 1) % NET_GRO_FLOWS;
+
+found:
+    if (!f->buf) {
+        f->buf = g_malloc(NET_GSO_MAX_SIZE);
+    }
+    return f;
+}
+
+bool net_gro_receive(NetGro *gro, const uint8_t *buf, size_t size)
+{
+    uint8_t *pkt = (uint8_t *)buf;
+    NetGroFlow *f = NULL;
+    NetGsoHdr h;
+    size_t len;
+    int i;
+
+    if (!net_gso_parse(pkt, size, &h) || h.l4proto != IP_PROTO_TCP) {
+        return false;
+    }
+
+    /* Drop the Ethernet padding */
+    if (h.is_v6) {
+        len = h.l3_off + IP6_HDR_LEN + lduw_be_p(pkt + h.l3_off + IP6_PLEN);
+    } else {
+        len = h.l3_off + lduw_be_p(pkt + h.l3_off + IP4_LEN);
+    }
+    if (len > size || len < h.hdr_len) {
+        return false;
+    }
+    size = len;
+
+    for (i = 0; i < NET_GRO_FLOWS; i++) {
+        if (net_gro_same_flow(&gro->flows[i], pkt, &h)) {
+            f = &gro->flows[i];
+            break;
+        }
+    }
+
+    if (!net_gro_candidate(pkt, size, &h)) {
+        if (f) {
+            net_gro_deliver(gro, f);
+        }
+        return false;
+    }
+
+    len = size - h.hdr_len;
+    if (f && net_gro_can_merge(f, pkt, size, &h)) {
+        uint8_t *l4 = f->buf + h.l4_off;
+
+        memcpy(f->buf + f->size, pkt + h.hdr_len, len);
+        f->size += len;
+        f->next_seq += len;
+        f->nsegs++;
+        /* The latest window and PSH apply to the whole packet */
+        memcpy(l4 + TCP_WIN, pkt + h.l4_off + TCP_WIN, 2);
+        l4[TCP_FLAGS] |= pkt[h.l4_off + TCP_FLAGS];
+    } else {
+        if (f) {
+            if (!net_gro_deliver(gro, f)) {
+                return false;
+            }
+        } else if (pkt[h.l4_off + TCP_FLAGS] & TH_PUSH) {
+            /* Nothing to coalesce with */
+            return false;
+        } else {
+            f = net_gro_alloc(gro);
+            if (!f) {
+                return false;
+            }
+        }
+        memcpy(f->buf, pkt, size);
+        f->size = size;
+        f->h = h;
+        f->mss = len;
+        f->next_seq = ldl_be_p(pkt + h.l4_off + TCP_SEQ) + len;
+        f->nsegs = 1;
+    }
+
+    /*
+     * A short segment or PSH ends the burst.  Without room in the
+     * receiver, the flow waits for net_gro_flush() with @buf in it.
+     */
+    if (len < f->mss || (f->buf[h.l4_off + TCP_FLAGS] & TH_PUSH)) {
+        net_gro_deliver(gro, f);
+    }
+    return true;
+}
+
+void net_gro_flush(NetGro *gro)
+{
+    int i;
+
+    for (i = 0; i < NET_GRO_FLOWS; i++) {
+        if (gro->flows[i].size) {
+            net_gro_deliver(gro, &gro->flows[i]);
+        }
+    }
+}
+
+void net_gro_drop(NetGro *gro)
+{
+    int i;
+
+    for (i = 0; i < NET_GRO_FLOWS; i++) {
+        gro->flows[i].size = 0;
+    }
+}
+
+bool net_gro_pending(NetGro *gro)
+{
+    int i;
+
+    for (i = 0; i < NET_GRO_FLOWS; i++) {
+        if (gro->flows[i].size) {
+            return true;
+        }
+    }
+    return false;
+}
@@ -239,7 +239,8 @@ static void qemu_net_client_setup(NetClientState *nc,
                                   NetClientState *peer,
                                   const char *model,
                                   const char *name,
-                                  NetClientDestructor *destructor)
+                                  NetClientDestructor *destructor,
+                                  bool is_datapath)
 {
     nc->info = info;
     nc->model = g_strdup(model);
@@ -258,6 +259,7 @@ static void qemu_net_client_setup(NetClientState *nc,
 
     nc->incoming_queue = qemu_new_net_queue(qemu_deliver_packet_iov, nc);
     nc->destructor = destructor;
+    nc->is_datapath = is_datapath;
     QTAILQ_INIT(&nc->filters);
 }
 
@@ -272,7 +274,23 @@ NetClientState *qemu_new_net_client(NetClientInfo *info,
 
     nc = g_malloc0(info->size);
     qemu_net_client_setup(nc, info, peer, model, name,
-                          qemu_net_client_destructor);
+                          qemu_net_client_destructor, true);
+
+    return nc;
+}
+
+NetClientState *qemu_new_net_control_client(NetClientInfo *info,
+                                            NetClientState *peer,
+                                            const char *model,
+                                            const char *name)
+{
+    NetClientState *nc;
+
+    assert(info->size >= sizeof(NetClientState));
+
+    nc = g_malloc0(info->size);
+    qemu_net_client_setup(nc, info, peer, model, name,
+                          qemu_net_client_destructor, false);
 
     return nc;
 }
@@ -297,7 +315,7 @@ NICState *qemu_new_nic(NetClientInfo *info,
 
     for (i = 0; i < queues; i++) {
         qemu_net_client_setup(&nic->ncs[i], info, peers[i], model, name,
-                              NULL);
+                              NULL, true);
         nic->ncs[i].queue_index = i;
     }
 
@@ -530,6 +548,53 @@ int qemu_set_vnet_be(NetClientState *nc, bool is_be)
 #endif
 }
 
+bool qemu_net_can_set_aio_context(NetClientState *nc)
+{
+    return nc->info->type == NET_CLIENT_DRIVER_NIC ||
+           nc->info->set_aio_context;
+}
+
+/*
+ * Run the datapath of @nc in @ctx, or in the main loop if @ctx is NULL.
+ * The file descriptors of a netdev are moved there, and everything else
+ * that touches @nc then has to hold @ctx: see qemu_net_acquire().
+ *
+ * Returns 0, or a negative errno if @nc cannot leave the main loop.
+ */
+int qemu_net_set_aio_context(NetClientState *nc, AioContext *ctx)
+{
+    if (nc->aio_context == ctx) {
+        return 0;
+    }
+    if (nc->info->type == NET_CLIENT_DRIVER_NIC) {
+        nc->aio_context = ctx;
+        return 0;
+    }
+    if (!nc->info->set_aio_context) {
+        return -ENOTSUP;
+    }
+
+    return nc->info->set_aio_context(nc, ctx);
+}
+
+/*
+ * Lock out the datapath of @nc, when it runs in an IOThread, from code
+ * that runs in the main loop.
+ */
+void qemu_net_acquire(NetClientState *nc)
+{
+    if (nc->aio_context) {
+        aio_context_acquire(nc->aio_context);
+    }
+}
+
+void qemu_net_release(NetClientState *nc)
+{
+    if (nc->aio_context) {
+        aio_context_release(nc->aio_context);
+    }
+}
+
 int qemu_can_receive_packet(NetClientState *nc)
 {
     if (nc->receive_disabled) {
@@ -626,7 +691,11 @@ void qemu_flush_or_purge_queued_packets(NetClientState *nc, bool purge)
         /* We emptied the queue successfully, signal to the IO thread to repoll
          * the file descriptor (for tap, for example).
          */
-        qemu_notify_event();
+        if (nc->aio_context) {
+            aio_notify(nc->aio_context);
+        } else {
+            qemu_notify_event();
+        }
     } else if (purge) {
         /* Unable to empty the queue, purge remaining packets */
         qemu_net_queue_purge(nc->incoming_queue, nc->peer);
@@ -681,6 +750,51 @@ ssize_t qemu_send_packet_async(NetClientState *sender,
                                              buf, size, sent_cb);
 }
 
+/*
+ * Borrow a receive buffer of the peer of @nc, so that @nc can read a
+ * packet straight into it.  Filters need to see every packet and packets
+ * already queued for the peer must go first, so this is only possible
+ * when none of them is in the way.
+ *
+ * Returns the number of @iov entries filled, or 0 if the packet has to
+ * be sent with qemu_send_packet_async() instead.
+ */
+int qemu_net_rx_buf_get(NetClientState *nc, struct iovec *iov, int iovcnt)
+{
+    NetClientState *peer = nc->peer;
+
+    if (nc->link_down || !peer || !peer->info->rx_buf_get ||
+        peer->receive_disabled || net_peer_needs_padding(nc) ||
+        !QTAILQ_EMPTY(&nc->filters) || !QTAILQ_EMPTY(&peer->filters) ||
+        !qemu_net_queue_empty(peer->incoming_queue)) {
+        return 0;
+    }
+
+    return peer->info->rx_buf_get(peer, iov, iovcnt);
+}
+
+/*
+ * Hand back the buffer borrowed with qemu_net_rx_buf_get(): @size bytes
+ * were written to it, and the @tail_len bytes that did not fit are at
+ * @tail.  A zero @size returns the buffer unused.
+ *
+ * Returns the number of bytes the peer consumed, which includes
+ * packets it dropped.
+ */
+ssize_t qemu_net_rx_buf_put(NetClientState *nc, size_t size,
+                            const uint8_t *tail, size_t tail_len)
+{
+    ssize_t ret;
+
+    ret = nc->peer->info->rx_buf_put(nc->peer, size, tail, tail_len);
+    if (ret > 0) {
+        nc->rx_zerocopy_bytes += size;
+        nc->rx_copied_bytes += tail_len;
+    }
+
+    return ret;
+}
+
 ssize_t qemu_send_packet(NetClientState *nc, const uint8_t *buf, int size)
 {
     return qemu_send_packet_async(nc, buf, size, NULL);
@@ -809,6 +923,42 @@ ssize_t qemu_sendv_packet_async(NetClientState *sender,
                                    iov, iovcnt, sent_cb);
 }
 
+/*
+ * Hand several packets to the peer of @sender in a single call, so that
+ * a backend can write them with one system call.  Like
+ * qemu_net_rx_buf_get(), this bypasses the filters and the queue of the
+ * peer, so it is only possible when neither is in the way.
+ *
+ * Returns the number of packets at the head of @pkts that the peer took,
+ * which includes packets it dropped.  The caller sends the others with
+ * qemu_sendv_packet_async(), which queues them if the peer is full.
+ */
+int qemu_sendv_packet_batch(NetClientState *sender, const NetPacketIOV *pkts,
+                            int npkts)
+{
+    NetClientState *peer = sender->peer;
+    int i;
+
+    if (sender->link_down || !peer || !peer->info->receive_iov_batch ||
+        peer->link_down || peer->receive_disabled ||
+        !QTAILQ_EMPTY(&sender->filters) || !QTAILQ_EMPTY(&peer->filters) ||
+        !qemu_net_queue_empty(peer->incoming_queue)) {
+        return 0;
+    }
+
+    /* Oversized packets are dropped by qemu_sendv_packet_async() */
+    for (i = 0; i < npkts; i++) {
+        if (iov_size(pkts[i].iov, pkts[i].iovcnt) > NET_BUFSIZE) {
+            break;
+        }
+    }
+    if (!i) {
+        return 0;
+    }
+
+    return peer->info->receive_iov_batch(peer, pkts, i);
+}
+
 ssize_t
 qemu_sendv_packet(NetClientState *nc, const struct iovec *iov, int iovcnt)
 {
@@ -990,6 +1140,9 @@ static int (* const net_client_init_fun[NET_CLIENT_DRIVER__MAX])(
 #ifdef CONFIG_NETMAP
         [NET_CLIENT_DRIVER_NETMAP]    = net_init_netmap,
 #endif
+#ifdef CONFIG_AF_XDP
+        [NET_CLIENT_DRIVER_AF_XDP]    = net_init_af_xdp,
+#endif
 #ifdef CONFIG_NET_BRIDGE
         [NET_CLIENT_DRIVER_BRIDGE]    = net_init_bridge,
 #endif
@@ -1083,6 +1236,9 @@ void show_netdevs(void)
 #ifdef CONFIG_NETMAP
         "netmap",
 #endif
+#ifdef CONFIG_AF_XDP
+        "af-xdp",
+#endif
 #ifdef CONFIG_POSIX
         "vhost-user",
 #endif
@@ -1223,11 +1379,23 @@ static void netfilter_print_info(Monitor *mon, NetFilterState *nf)
 void print_net_client(Monitor *mon, NetClientState *nc)
 {
     NetFilterState *nf;
+    NetQueueStats qs;
 
     monitor_printf(mon, "%s: index=%d,type=%s,%s\n", nc->name,
                    nc->queue_index,
                    NetClientDriver_str(nc->info->type),
                    nc->info_str);
+    if (nc->rx_copied_bytes || nc->rx_zerocopy_bytes) {
+        monitor_printf(mon, "rx bytes: copied=%" PRIu64 ",zero-copy=%" PRIu64
+                       "\n", nc->rx_copied_bytes, nc->rx_zerocopy_bytes);
+    }
+    qemu_net_queue_get_stats(nc->incoming_queue, &qs);
+    if (qs.queued || qs.dropped) {
+        monitor_printf(mon, "incoming queue: len=%" PRIu32 ",peak=%" PRIu32
+                       ",queued=%" PRIu64 ",dropped=%" PRIu64
+                       ",allocated=%" PRIu64 "\n", qs.len, qs.peak,
+                       qs.queued, qs.dropped, qs.allocated);
+    }
     if (!QTAILQ_EMPTY(&nc->filters)) {
         monitor_printf(mon, "filters:\n");
     }
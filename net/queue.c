@@ -40,12 +40,25 @@
  * unbounded queueing.
  */
 
+/*
+ * Packets up to NET_QUEUE_SLOT_SIZE bytes are copied into a pool of
+ * buffers that is allocated the first time the queue is used, so that a
+ * peer that stops receiving for a while does not make every packet go
+ * through the allocator.  Larger packets, and packets that arrive when
+ * the pool is exhausted, are allocated on their own.
+ */
+#define NET_QUEUE_POOL_SIZE   256
+#define NET_QUEUE_SLOT_SIZE   2048
+#define NET_QUEUE_SLOT_STRIDE \
+    QEMU_ALIGN_UP(sizeof(NetPacket) + NET_QUEUE_SLOT_SIZE, 64)
+
 struct NetPacket {
     QTAILQ_ENTRY(NetPacket) entry;
     NetClientState *sender;
     unsigned flags;
     int size;
     NetPacketSent *sent_cb;
+    bool pooled;
     uint8_t data[];
 };
 
@@ -57,6 +70,13 @@ struct NetQueue {
 
     QTAILQ_HEAD(, NetPacket) packets;
 
+    /* Free buffers of the pool, used last-in first-out */
+    uint8_t *pool;
+    NetPacket *pool_free[NET_QUEUE_POOL_SIZE];
+    unsigned pool_nr_free;
+
+    NetQueueStats stats;
+
     unsigned delivering : 1;
 };
 
@@ -78,18 +98,77 @@ NetQueue *qemu_new_net_queue(NetQueueDeliverFunc *deliver, void *opaque)
     return queue;
 }
 
+static void qemu_net_queue_pool_init(NetQueue *queue)
+{
+    int i;
+
+    queue->pool = qemu_memalign(64, NET_QUEUE_POOL_SIZE *
+                                    NET_QUEUE_SLOT_STRIDE);
+    for (i = 0; i < NET_QUEUE_POOL_SIZE; i++) {
+        NetPacket *packet = (NetPacket *)(queue->pool +
+                                          i * NET_QUEUE_SLOT_STRIDE);
+
+        packet->pooled = true;
+        queue->pool_free[NET_QUEUE_POOL_SIZE - 1 - i] = packet;
+    }
+    queue->pool_nr_free = NET_QUEUE_POOL_SIZE;
+}
+
+static NetPacket *qemu_net_packet_alloc(NetQueue *queue, size_t size)
+{
+    NetPacket *packet;
+
+    if (size <= NET_QUEUE_SLOT_SIZE) {
+        if (!queue->pool) {
+            qemu_net_queue_pool_init(queue);
+        }
+        if (queue->pool_nr_free) {
+            return queue->pool_free[--queue->pool_nr_free];
+        }
+    }
+
+    queue->stats.allocated++;
+    packet = g_malloc(sizeof(NetPacket) + size);
+    packet->pooled = false;
+    return packet;
+}
+
+static void qemu_net_packet_free(NetQueue *queue, NetPacket *packet)
+{
+    if (packet->pooled) {
+        queue->pool_free[queue->pool_nr_free++] = packet;
+    } else {
+        g_free(packet);
+    }
+}
+
+static void qemu_net_queue_insert(NetQueue *queue, NetPacket *packet)
+{
+    queue->nq_count++;
+    queue->stats.queued++;
+    queue->stats.peak = MAX(queue->stats.peak, queue->nq_count);
+    QTAILQ_INSERT_TAIL(&queue->packets, packet, entry);
+}
+
 void qemu_del_net_queue(NetQueue *queue)
 {
     NetPacket *packet, *next;
 
     QTAILQ_FOREACH_SAFE(packet, &queue->packets, entry, next) {
         QTAILQ_REMOVE(&queue->packets, packet, entry);
-        g_free(packet);
+        qemu_net_packet_free(queue, packet);
     }
 
+    qemu_vfree(queue->pool);
     g_free(queue);
 }
 
+void qemu_net_queue_get_stats(NetQueue *queue, NetQueueStats *stats)
+{
+    *stats = queue->stats;
+    stats->len = queue->nq_count;
+}
+
 static void qemu_net_queue_append(NetQueue *queue,
                                   NetClientState *sender,
                                   unsigned flags,
@@ -100,17 +179,17 @@ static void qemu_net_queue_append(NetQueue *queue,
     NetPacket *packet;
 
     if (queue->nq_count >= queue->nq_maxlen && !sent_cb) {
+        queue->stats.dropped++;
         return; /* drop if queue full and no callback */
     }
-    packet = g_malloc(sizeof(NetPacket) + size);
+    packet = qemu_net_packet_alloc(queue, size);
     packet->sender = sender;
     packet->flags = flags;
     packet->size = size;
     packet->sent_cb = sent_cb;
     memcpy(packet->data, buf, size);
 
-    queue->nq_count++;
-    QTAILQ_INSERT_TAIL(&queue->packets, packet, entry);
+    qemu_net_queue_insert(queue, packet);
 }
 
 void qemu_net_queue_append_iov(NetQueue *queue,
@@ -125,13 +204,14 @@ void qemu_net_queue_append_iov(NetQueue *queue,
     int i;
 
     if (queue->nq_count >= queue->nq_maxlen && !sent_cb) {
+        queue->stats.dropped++;
         return; /* drop if queue full and no callback */
     }
     for (i = 0; i < iovcnt; i++) {
         max_len += iov[i].iov_len;
     }
 
-    packet = g_malloc(sizeof(NetPacket) + max_len);
+    packet = qemu_net_packet_alloc(queue, max_len);
     packet->sender = sender;
     packet->sent_cb = sent_cb;
     packet->flags = flags;
@@ -144,8 +224,7 @@ void qemu_net_queue_append_iov(NetQueue *queue,
         packet->size += len;
     }
 
-    queue->nq_count++;
-    QTAILQ_INSERT_TAIL(&queue->packets, packet, entry);
+    qemu_net_queue_insert(queue, packet);
 }
 
 static ssize_t qemu_net_queue_deliver(NetQueue *queue,
@@ -265,7 +344,7 @@ void qemu_net_queue_purge(NetQueue *queue, NetClientState *from)
             if (packet->sent_cb) {
                 packet->sent_cb(packet->sender, 0);
             }
-            g_free(packet);
+            qemu_net_packet_free(queue, packet);
         }
     }
 }
@@ -298,7 +377,12 @@ bool qemu_net_queue_flush(NetQueue *queue)
             packet->sent_cb(packet->sender, ret);
         }
 
-        g_free(packet);
+        qemu_net_packet_free(queue, packet);
     }
     return true;
 }
+
+bool qemu_net_queue_empty(NetQueue *queue)
+{
+    return !queue->delivering && QTAILQ_EMPTY(&queue->packets);
+}
@@ -43,11 +43,46 @@
 #include "qemu/error-report.h"
 #include "qemu/main-loop.h"
 #include "qemu/sockets.h"
+#include "qemu/iov.h"
 
 #include "net/tap.h"
+#ifdef CONFIG_LINUX_IO_URING
+#include <liburing.h>
+#endif
 
 #include "net/vhost_net.h"
 
+/* Most guest receive buffers have a handful of segments */
+#define TAP_ZEROCOPY_MAX_IOV 64
+
+/* Packets read every time the tap becomes readable, unless rx-budget= */
+#define TAP_RX_BUDGET_DEFAULT 50
+
+/* Packets written with a single io_uring submission */
+#define TAP_TX_BATCH_MAX 64
+
+#ifdef CONFIG_LINUX_IO_URING
+/*
+ * The ring writes copies of the packets, so that the caller can complete
+ * them as soon as tap_receive_iov_batch() returns even if the tap is full
+ * and the kernel only writes them later.
+ */
+typedef struct TapTxSlot {
+    struct iovec iov;
+    size_t size;            /* allocated size of iov.iov_base */
+    bool pending;           /* not written yet */
+} TapTxSlot;
+
+typedef struct TapTxRing {
+    struct io_uring ring;
+    TapTxSlot slots[TAP_TX_BATCH_MAX];
+    int nslots;             /* size of the batch, 0 once it is all written */
+    int unsubmitted;        /* prepared writes that the kernel did not take */
+    int inflight;           /* submitted writes that are not reaped yet */
+    bool blocked;           /* a write returned EAGAIN, wait for the tap */
+} TapTxRing;
+#endif
+
 typedef struct TAPState {
     NetClientState nc;
     int fd;
@@ -61,6 +96,11 @@ typedef struct TAPState {
     bool enabled;
     VHostNetState *vhost_net;
     unsigned host_vnet_hdr_len;
+    unsigned rx_budget;
+#ifdef CONFIG_LINUX_IO_URING
+    bool tx_uring;          /* tx-uring=, cleared if the ring cannot be used */
+    TapTxRing *tx_ring;     /* set up on the first batch */
+#endif
     Notifier exit;
 } TAPState;
 
@@ -69,13 +109,35 @@ static void launch_script(const char *setup_script, const char *ifname,
 
 static void tap_send(void *opaque);
 static void tap_writable(void *opaque);
+#ifdef CONFIG_LINUX_IO_URING
+static void tap_tx_ring_complete(void *opaque);
+#endif
+
+static void tap_set_fd_handler(TAPState *s, int fd, IOHandler *fd_read,
+                               IOHandler *fd_write)
+{
+    if (s->nc.aio_context) {
+        aio_set_fd_handler(s->nc.aio_context, fd, false,
+                           fd_read, fd_write, NULL, s);
+    } else {
+        qemu_set_fd_handler(fd, fd_read, fd_write, s);
+    }
+}
 
 static void tap_update_fd_handler(TAPState *s)
 {
-    qemu_set_fd_handler(s->fd,
-                        s->read_poll && s->enabled ? tap_send : NULL,
-                        s->write_poll && s->enabled ? tap_writable : NULL,
-                        s);
+    IOHandler *fd_read = s->read_poll && s->enabled ? tap_send : NULL;
+    IOHandler *fd_write = s->write_poll && s->enabled ? tap_writable : NULL;
+
+    tap_set_fd_handler(s, s->fd, fd_read, fd_write);
+#ifdef CONFIG_LINUX_IO_URING
+    if (s->tx_ring) {
+        /* The ring fd is readable when completions are ready */
+        fd_read = s->tx_ring->inflight && s->enabled ?
+                  tap_tx_ring_complete : NULL;
+        tap_set_fd_handler(s, s->tx_ring->ring.ring_fd, fd_read, NULL);
+    }
+#endif
 }
 
 static void tap_read_poll(TAPState *s, bool enable)
@@ -90,19 +152,229 @@ static void tap_write_poll(TAPState *s, bool enable)
     tap_update_fd_handler(s);
 }
 
+#ifdef CONFIG_LINUX_IO_URING
+/* Packets that come after the batch wait in the queue until it is written */
+static bool tap_tx_ring_busy(TAPState *s)
+{
+    return s->tx_ring && s->tx_ring->nslots;
+}
+
+static TapTxRing *tap_tx_ring_get(TAPState *s)
+{
+    int ret;
+
+    if (!s->tx_ring && s->tx_uring) {
+        s->tx_ring = g_new0(TapTxRing, 1);
+        ret = io_uring_queue_init(TAP_TX_BATCH_MAX, &s->tx_ring->ring, 0);
+        if (ret < 0) {
+            warn_report("tap: cannot set up io_uring, using writev(): %s",
+                        strerror(-ret));
+            g_free(s->tx_ring);
+            s->tx_ring = NULL;
+            s->tx_uring = false;
+        }
+    }
+    return s->tx_ring;
+}
+
+/*
+ * Hand the prepared writes to the kernel.  io_uring_submit() may take only
+ * some of them, e.g. when it runs out of memory for the requests; the
+ * others stay in the submission queue and go with the next submission.
+ * Entries queued after the writes, i.e. cancellations, are not counted.
+ *
+ * Returns what io_uring_submit() returned.
+ */
+static int tap_tx_ring_enter(TapTxRing *r)
+{
+    int ret;
+
+    do {
+        ret = io_uring_submit(&r->ring);
+    } while (ret == -EINTR);
+    if (ret > 0) {
+        r->inflight += MIN(ret, r->unsubmitted);
+        r->unsubmitted -= MIN(ret, r->unsubmitted);
+    }
+    return ret;
+}
+
+static void tap_tx_ring_free(TAPState *s)
+{
+    TapTxRing *r = s->tx_ring;
+    struct io_uring_cqe *cqe;
+    struct io_uring_sqe *sqe;
+    int i;
+
+    /*
+     * The kernel may read the copies until the writes are cancelled.  The
+     * writes that it has not taken yet are dropped with the ring.
+     */
+    if (r->inflight) {
+        for (i = 0; i < r->nslots; i++) {
+            if (!r->slots[i].pending) {
+                continue;
+            }
+            sqe = io_uring_get_sqe(&r->ring);
+            if (!sqe) {
+                /* Writes to the non-blocking tap complete anyway */
+                break;
+            }
+            io_uring_prep_cancel(sqe, &r->slots[i], 0);
+            /* Tell its completion apart from those of the writes */
+            io_uring_sqe_set_data(sqe, NULL);
+        }
+        tap_tx_ring_enter(r);
+    }
+    while (r->inflight && io_uring_wait_cqe(&r->ring, &cqe) == 0) {
+        if (io_uring_cqe_get_data(cqe)) {
+            r->inflight--;
+        }
+        io_uring_cqe_seen(&r->ring, cqe);
+    }
+    r->nslots = 0;
+    tap_update_fd_handler(s);
+
+    io_uring_queue_exit(&r->ring);
+    for (i = 0; i < TAP_TX_BATCH_MAX; i++) {
+        g_free(r->slots[i].iov.iov_base);
+    }
+    g_free(r);
+    s->tx_ring = NULL;
+}
+
+/*
+ * Reap the writes that are done.  Once all of them are, write again those
+ * that were cancelled because an earlier write failed, unless the tap is
+ * full.
+ */
+static void tap_tx_ring_reap(TAPState *s)
+{
+    TapTxRing *r = s->tx_ring;
+    struct io_uring_cqe *cqe;
+
+    while (r->inflight && io_uring_peek_cqe(&r->ring, &cqe) == 0) {
+        TapTxSlot *slot = io_uring_cqe_get_data(cqe);
+
+        /* Packets that fail to be written are dropped */
+        slot->pending = cqe->res == -EAGAIN || cqe->res == -ECANCELED;
+        r->blocked |= cqe->res == -EAGAIN;
+        io_uring_cqe_seen(&r->ring, cqe);
+        r->inflight--;
+    }
+}
+
+/* Queue linked writes for the pending packets of the batch, in order */
+static void tap_tx_ring_prep(TAPState *s)
+{
+    TapTxRing *r = s->tx_ring;
+    struct io_uring_sqe *sqe = NULL;
+    int i;
+
+    for (i = 0; i < r->nslots; i++) {
+        if (!r->slots[i].pending) {
+            continue;
+        }
+        if (sqe) {
+            sqe->flags |= IOSQE_IO_LINK;
+        }
+        sqe = io_uring_get_sqe(&r->ring);
+        io_uring_prep_writev(sqe, s->fd, &r->slots[i].iov, 1, 0);
+        io_uring_sqe_set_data(sqe, &r->slots[i]);
+        r->unsubmitted++;
+    }
+}
+
+/*
+ * Write the pending packets of the batch in order, and reap those that
+ * the kernel could write right away.  The ring fd handler reaps the
+ * others, and submits what a short submission left behind.
+ */
+static void tap_tx_ring_submit(TAPState *s)
+{
+    TapTxRing *r = s->tx_ring;
+    int ret;
+
+    while (!r->blocked) {
+        if (!r->inflight && !r->unsubmitted) {
+            tap_tx_ring_prep(s);
+            if (!r->unsubmitted) {
+                r->nslots = 0;
+                break;
+            }
+        }
+        if (!r->unsubmitted) {
+            /* Wait for the completions */
+            break;
+        }
+
+        ret = tap_tx_ring_enter(r);
+        if (!r->inflight) {
+            /* Nothing to wait for would retry: drop the batch */
+            error_report("tap: io_uring submission failed: %s",
+                         ret < 0 ? strerror(-ret) : "no progress");
+            tap_tx_ring_free(s);
+            s->tx_uring = false;
+            return;
+        }
+        tap_tx_ring_reap(s);
+        if (ret <= 0) {
+            /* Retry once some writes complete, rather than spin */
+            break;
+        }
+    }
+
+    if (r->blocked) {
+        tap_write_poll(s, true);
+    }
+    tap_update_fd_handler(s);
+}
+
+static void tap_tx_ring_complete(void *opaque)
+{
+    TAPState *s = opaque;
+
+    qemu_net_acquire(&s->nc);
+    tap_tx_ring_reap(s);
+    tap_tx_ring_submit(s);
+    if (!tap_tx_ring_busy(s)) {
+        qemu_flush_queued_packets(&s->nc);
+    }
+    qemu_net_release(&s->nc);
+}
+#endif
+
 static void tap_writable(void *opaque)
 {
     TAPState *s = opaque;
 
+    qemu_net_acquire(&s->nc);
     tap_write_poll(s, false);
 
+#ifdef CONFIG_LINUX_IO_URING
+    if (tap_tx_ring_busy(s) && s->tx_ring->blocked) {
+        s->tx_ring->blocked = false;
+        tap_tx_ring_submit(s);
+    }
+    if (tap_tx_ring_busy(s)) {
+        qemu_net_release(&s->nc);
+        return;
+    }
+#endif
     qemu_flush_queued_packets(&s->nc);
+    qemu_net_release(&s->nc);
 }
 
 static ssize_t tap_write_packet(TAPState *s, const struct iovec *iov, int iovcnt)
 {
     ssize_t len;
 
+#ifdef CONFIG_LINUX_IO_URING
+    if (tap_tx_ring_busy(s)) {
+        return 0;
+    }
+#endif
+
     do {
         len = writev(s->fd, iov, iovcnt);
     } while (len == -1 && errno == EINTR);
@@ -134,6 +406,54 @@ static ssize_t tap_receive_iov(NetClientState *nc, const struct iovec *iov,
     return tap_write_packet(s, iovp, iovcnt);
 }
 
+/*
+ * Packets that fail to be written are dropped, like in tap_receive_iov().
+ * Without io_uring, stops at the first packet that does not fit in the
+ * tap.  The ring takes up to TAP_TX_BATCH_MAX packets at once and writes
+ * them in the background; the packets sent meanwhile are queued.
+ */
+static int tap_receive_iov_batch(NetClientState *nc, const NetPacketIOV *pkts,
+                                 int npkts)
+{
+    TAPState *s = DO_UPCAST(TAPState, nc, nc);
+    int done = 0;
+
+#ifdef CONFIG_LINUX_IO_URING
+    if (tap_tx_ring_busy(s)) {
+        return 0;
+    }
+    /* The vnet header of tap_receive_iov() is only added packet by packet */
+    if (!(s->host_vnet_hdr_len && !s->using_vnet_hdr) && tap_tx_ring_get(s)) {
+        TapTxRing *r = s->tx_ring;
+
+        r->nslots = MIN(npkts, TAP_TX_BATCH_MAX);
+        for (done = 0; done < r->nslots; done++) {
+            TapTxSlot *slot = &r->slots[done];
+            size_t size = iov_size(pkts[done].iov, pkts[done].iovcnt);
+
+            if (slot->size < size) {
+                g_free(slot->iov.iov_base);
+                slot->iov.iov_base = g_malloc(size);
+                slot->size = size;
+            }
+            slot->iov.iov_len = iov_to_buf(pkts[done].iov, pkts[done].iovcnt,
+                                           0, slot->iov.iov_base, size);
+            slot->pending = true;
+        }
+        r->blocked = false;
+        tap_tx_ring_submit(s);
+        return done;
+    }
+#endif
+
+    for (; done < npkts; done++) {
+        if (tap_receive_iov(nc, pkts[done].iov, pkts[done].iovcnt) == 0) {
+            break;
+        }
+    }
+    return done;
+}
+
 static ssize_t tap_receive_raw(NetClientState *nc, const uint8_t *buf, size_t size)
 {
     TAPState *s = DO_UPCAST(TAPState, nc, nc);
@@ -182,39 +502,110 @@ static void tap_send_completed(NetClientState *nc, ssize_t len)
     tap_read_poll(s, true);
 }
 
-static void tap_send(void *opaque)
+/*
+ * Read a packet straight into a receive buffer of the peer, vnet header
+ * included.  What does not fit lands in s->buf and is copied by the peer.
+ *
+ * Returns the size of the packet, 0 if there is nothing to read, or -1 if
+ * the packet has to go through s->buf.
+ */
+static ssize_t tap_send_zerocopy(TAPState *s)
 {
-    TAPState *s = opaque;
-    int size;
-    int packets = 0;
+#ifndef __sun__
+    struct iovec iov[TAP_ZEROCOPY_MAX_IOV + 1];
+    size_t size;
+    ssize_t len;
+    int iovcnt;
 
-    while (true) {
-        uint8_t *buf = s->buf;
-        uint8_t min_pkt[ETH_ZLEN];
-        size_t min_pktsz = sizeof(min_pkt);
+    /* The peer must take the vnet header as the tap writes it */
+    if (s->host_vnet_hdr_len && !s->using_vnet_hdr) {
+        return -1;
+    }
 
-        size = tap_read_packet(s->fd, s->buf, sizeof(s->buf));
-        if (size <= 0) {
-            break;
-        }
+    iovcnt = qemu_net_rx_buf_get(&s->nc, iov, TAP_ZEROCOPY_MAX_IOV);
+    if (!iovcnt) {
+        return -1;
+    }
+    size = iov_size(iov, iovcnt);
+    iov[iovcnt].iov_base = s->buf;
+    iov[iovcnt].iov_len = sizeof(s->buf);
 
-        if (s->host_vnet_hdr_len && !s->using_vnet_hdr) {
-            buf  += s->host_vnet_hdr_len;
-            size -= s->host_vnet_hdr_len;
-        }
+    do {
+        len = readv(s->fd, iov, iovcnt + 1);
+    } while (len == -1 && errno == EINTR);
 
-        if (net_peer_needs_padding(&s->nc)) {
-            if (eth_pad_short_frame(min_pkt, &min_pktsz, buf, size)) {
-                buf = min_pkt;
-                size = min_pktsz;
-            }
+    if (len <= 0) {
+        qemu_net_rx_buf_put(&s->nc, 0, NULL, 0);
+        return 0;
+    }
+
+    if (len > size) {
+        qemu_net_rx_buf_put(&s->nc, size, s->buf, len - size);
+    } else {
+        qemu_net_rx_buf_put(&s->nc, len, NULL, 0);
+    }
+    return len;
+#else
+    return -1;
+#endif
+}
+
+/*
+ * Read a packet into s->buf and send it to the peer, which copies it.
+ * Returns what qemu_send_packet_async() returned, or -1 if there is
+ * nothing to read.
+ */
+static ssize_t tap_send_copy(TAPState *s)
+{
+    uint8_t *buf = s->buf;
+    uint8_t min_pkt[ETH_ZLEN];
+    size_t min_pktsz = sizeof(min_pkt);
+    ssize_t size;
+
+    size = tap_read_packet(s->fd, s->buf, sizeof(s->buf));
+    if (size <= 0) {
+        return -1;
+    }
+    s->nc.rx_copied_bytes += size;
+
+    if (s->host_vnet_hdr_len && !s->using_vnet_hdr) {
+        buf  += s->host_vnet_hdr_len;
+        size -= s->host_vnet_hdr_len;
+    }
+
+    if (net_peer_needs_padding(&s->nc)) {
+        if (eth_pad_short_frame(min_pkt, &min_pktsz, buf, size)) {
+            buf = min_pkt;
+            size = min_pktsz;
         }
+    }
 
-        size = qemu_send_packet_async(&s->nc, buf, size, tap_send_completed);
-        if (size == 0) {
-            tap_read_poll(s, false);
-            break;
-        } else if (size < 0) {
+    size = qemu_send_packet_async(&s->nc, buf, size, tap_send_completed);
+    if (size == 0) {
+        tap_read_poll(s, false);
+    }
+    return size;
+}
+
+/*
+ * Receive is not batched: tun has no multi-packet read, and batching the
+ * reads through io_uring would need buffers of our own, i.e. giving up
+ * the zero-copy path.  Each packet is one readv(), and rx_budget bounds
+ * how many of them one wakeup does.
+ */
+static void tap_send(void *opaque)
+{
+    TAPState *s = opaque;
+    ssize_t size;
+    unsigned packets = 0;
+
+    qemu_net_acquire(&s->nc);
+    while (true) {
+        size = tap_send_zerocopy(s);
+        if (size < 0) {
+            size = tap_send_copy(s);
+        }
+        if (size <= 0) {
             break;
         }
 
@@ -225,10 +616,11 @@ static void tap_send(void *opaque)
          * stalling the guest.
          */
         packets++;
-        if (packets >= 50) {
+        if (packets >= s->rx_budget) {
             break;
         }
     }
+    qemu_net_release(&s->nc);
 }
 
 static bool tap_has_ufo(NetClientState *nc)
@@ -336,6 +728,11 @@ static void tap_cleanup(NetClientState *nc)
 
     tap_read_poll(s, false);
     tap_write_poll(s, false);
+#ifdef CONFIG_LINUX_IO_URING
+    if (s->tx_ring) {
+        tap_tx_ring_free(s);
+    }
+#endif
     close(s->fd);
     s->fd = -1;
 }
@@ -355,6 +752,32 @@ static bool tap_set_steering_ebpf(NetClientState *nc, int prog_fd)
     return tap_fd_set_steering_ebpf(s->fd, prog_fd) == 0;
 }
 
+static bool tap_set_filter_ebpf(NetClientState *nc, int prog_fd)
+{
+    TAPState *s = DO_UPCAST(TAPState, nc, nc);
+    assert(nc->info->type == NET_CLIENT_DRIVER_TAP);
+
+    return tap_fd_set_filter_ebpf(s->fd, prog_fd) == 0;
+}
+
+static int tap_set_aio_context(NetClientState *nc, AioContext *ctx)
+{
+    TAPState *s = DO_UPCAST(TAPState, nc, nc);
+    bool enabled = s->enabled;
+
+    if (s->vhost_net) {
+        return -ENOTSUP;
+    }
+
+    /* Unregister the fd from the old context before adding it to the new */
+    s->enabled = false;
+    tap_update_fd_handler(s);
+    nc->aio_context = ctx;
+    s->enabled = enabled;
+    tap_update_fd_handler(s);
+    return 0;
+}
+
 int tap_get_fd(NetClientState *nc)
 {
     TAPState *s = DO_UPCAST(TAPState, nc, nc);
@@ -370,6 +793,7 @@ static NetClientInfo net_tap_info = {
     .receive = tap_receive,
     .receive_raw = tap_receive_raw,
     .receive_iov = tap_receive_iov,
+    .receive_iov_batch = tap_receive_iov_batch,
     .poll = tap_poll,
     .cleanup = tap_cleanup,
     .has_ufo = tap_has_ufo,
@@ -381,6 +805,8 @@ static NetClientInfo net_tap_info = {
     .set_vnet_le = tap_set_vnet_le,
     .set_vnet_be = tap_set_vnet_be,
     .set_steering_ebpf = tap_set_steering_ebpf,
+    .set_filter_ebpf = tap_set_filter_ebpf,
+    .set_aio_context = tap_set_aio_context,
 };
 
 static TAPState *net_tap_fd_init(NetClientState *peer,
@@ -401,6 +827,10 @@ static TAPState *net_tap_fd_init(NetClientState *peer,
     s->using_vnet_hdr = false;
     s->has_ufo = tap_probe_has_ufo(s->fd);
     s->enabled = true;
+    s->rx_budget = TAP_RX_BUDGET_DEFAULT;
+#ifdef CONFIG_LINUX_IO_URING
+    s->tx_uring = true;
+#endif
     tap_set_offload(&s->nc, 0, 0, 0, 0, 0);
     /*
      * Make sure host header length is set correctly in tap:
@@ -687,6 +1117,15 @@ static void net_init_tap_one(const NetdevTapOptions *tap, NetClientState *peer,
         return;
     }
 
+    if (tap->has_rx_budget) {
+        s->rx_budget = tap->rx_budget;
+    }
+#ifdef CONFIG_LINUX_IO_URING
+    if (tap->has_tx_uring) {
+        s->tx_uring = tap->tx_uring;
+    }
+#endif
+
     if (tap->has_fd || tap->has_fds) {
         snprintf(s->nc.info_str, sizeof(s->nc.info_str), "fd=%d", fd);
     } else if (tap->has_helper) {
@@ -818,6 +1257,11 @@ int net_init_tap(const Netdev *netdev, const char *name,
         return -1;
     }
 
+    if (tap->has_rx_budget && !tap->rx_budget) {
+        error_setg(errp, "rx-budget must be greater than 0");
+        return -1;
+    }
+
     if (tap->has_fd) {
         if (tap->has_ifname || tap->has_script || tap->has_downscript ||
             tap->has_vnet_hdr || tap->has_helper || tap->has_queues ||
@@ -45,5 +45,6 @@ int tap_fd_enable(int fd);
 int tap_fd_disable(int fd);
 int tap_fd_get_ifname(int fd, char *ifname);
 int tap_fd_set_steering_ebpf(int fd, int prog_fd);
+int tap_fd_set_filter_ebpf(int fd, int prog_fd);
 
 #endif /* NET_TAP_INT_H */
@@ -11,24 +11,46 @@
 
 #include "qemu/osdep.h"
 #include "clients.h"
+#include "hw/virtio/virtio-net.h"
 #include "net/vhost_net.h"
 #include "net/vhost-vdpa.h"
 #include "hw/virtio/vhost-vdpa.h"
 #include "qemu/config-file.h"
 #include "qemu/error-report.h"
+#include "qemu/iov.h"
+#include "qemu/log.h"
 #include "qemu/option.h"
 #include "qapi/error.h"
+#include <linux/vhost.h>
 #include <sys/ioctl.h>
 #include <err.h>
 #include "standard-headers/linux/virtio_net.h"
 #include "monitor/monitor.h"
+#include "migration/migration.h"
+#include "migration/misc.h"
 #include "hw/virtio/vhost.h"
 
-/* Todo:need to add the multiqueue support here */
+/* Resources shared by all the net clients of a vhost-vdpa device */
+typedef struct VhostVDPAShared {
+    int device_fd;
+    IOVATree *iova_tree;
+    unsigned int refcnt;
+} VhostVDPAShared;
+
 typedef struct VhostVDPAState {
     NetClientState nc;
     struct vhost_vdpa vhost_vdpa;
+    VhostVDPAShared *shared;
+    /* Only registered by the first queue pair */
+    Notifier migration_state;
     VHostNetState *vhost_net;
+
+    /* Control commands shadow buffers */
+    void *cvq_cmd_out_buffer;
+    virtio_net_ctrl_ack *status;
+
+    /* Shadow the virtqueues all the time, not only while migrating */
+    bool always_svq;
     bool started;
 } VhostVDPAState;
 
@@ -40,6 +62,7 @@ const int vdpa_feature_bits[] = {
     VIRTIO_F_VERSION_1,
     VIRTIO_NET_F_CSUM,
     VIRTIO_NET_F_GUEST_CSUM,
+    VIRTIO_NET_F_CTRL_GUEST_OFFLOADS,
     VIRTIO_NET_F_GSO,
     VIRTIO_NET_F_GUEST_TSO4,
     VIRTIO_NET_F_GUEST_TSO6,
@@ -51,6 +74,12 @@ const int vdpa_feature_bits[] = {
     VIRTIO_NET_F_HOST_UFO,
     VIRTIO_NET_F_MRG_RXBUF,
     VIRTIO_NET_F_MTU,
+    VIRTIO_NET_F_CTRL_VQ,
+    VIRTIO_NET_F_CTRL_RX,
+    VIRTIO_NET_F_CTRL_VLAN,
+    VIRTIO_NET_F_CTRL_RX_EXTRA,
+    VIRTIO_NET_F_CTRL_MAC_ADDR,
+    VIRTIO_NET_F_MQ,
     VIRTIO_F_IOMMU_PLATFORM,
     VIRTIO_F_RING_PACKED,
     VIRTIO_NET_F_RSS,
@@ -67,6 +96,15 @@ VHostNetState *vhost_vdpa_get_vhost_net(NetClientState *nc)
     return s->vhost_net;
 }
 
+/* Size of each of the control virtqueue bounce buffers */
+static size_t vhost_vdpa_net_cvq_cmd_page_len(void)
+{
+    return ROUND_UP(sizeof(struct virtio_net_ctrl_hdr) +
+                    2 * sizeof(struct virtio_net_ctrl_mac) +
+                    2 * (MAC_TABLE_ENTRIES + 1) * ETH_ALEN,
+                    qemu_real_host_page_size);
+}
+
 static int vhost_vdpa_net_check_device_id(struct vhost_net *net)
 {
     uint32_t device_id;
@@ -81,7 +119,7 @@ static int vhost_vdpa_net_check_device_id(struct vhost_net *net)
     return ret;
 }
 
-static int vhost_vdpa_add(NetClientState *ncs, void *be)
+static int vhost_vdpa_add(NetClientState *ncs, void *be, int nvqs)
 {
     VhostNetOptions options;
     struct vhost_net *net = NULL;
@@ -94,18 +132,18 @@ static int vhost_vdpa_add(NetClientState *ncs, void *be)
     options.net_backend = ncs;
     options.opaque      = be;
     options.busyloop_timeout = 0;
-    options.nvqs = 2;
+    options.nvqs = nvqs;
 
     net = vhost_net_init(&options);
     if (!net) {
         error_report("failed to init vhost_net for queue");
         goto err_init;
     }
-    s->vhost_net = net;
     ret = vhost_vdpa_net_check_device_id(net);
     if (ret) {
         goto err_check;
     }
+    s->vhost_net = net;
     return 0;
 err_check:
     vhost_net_cleanup(net);
@@ -118,15 +156,25 @@ static void vhost_vdpa_cleanup(NetClientState *nc)
 {
     VhostVDPAState *s = DO_UPCAST(VhostVDPAState, nc, nc);
 
+    if (s->migration_state.notify) {
+        remove_migration_state_change_notifier(&s->migration_state);
+    }
+    qemu_vfree(s->cvq_cmd_out_buffer);
+    qemu_vfree(s->status);
     if (s->vhost_net) {
         vhost_net_cleanup(s->vhost_net);
         g_free(s->vhost_net);
         s->vhost_net = NULL;
     }
-     if (s->vhost_vdpa.device_fd >= 0) {
-        qemu_close(s->vhost_vdpa.device_fd);
-        s->vhost_vdpa.device_fd = -1;
+    if (s->shared && --s->shared->refcnt == 0) {
+        qemu_close(s->shared->device_fd);
+        if (s->shared->iova_tree) {
+            iova_tree_destroy(s->shared->iova_tree);
+        }
+        g_free(s->shared);
     }
+    s->shared = NULL;
+    s->vhost_vdpa.device_fd = -1;
 }
 
 static bool vhost_vdpa_has_vnet_hdr(NetClientState *nc)
@@ -147,36 +195,687 @@ static bool vhost_vdpa_has_ufo(NetClientState *nc)
 
 }
 
+/*
+ * The datapath goes through shadow virtqueues while migrating, so that
+ * QEMU sees the memory that the device writes.
+ */
+static bool vhost_vdpa_net_want_svq(const VhostVDPAState *s)
+{
+    return s->always_svq ||
+           migration_is_setup_or_active(migrate_get_current()->state);
+}
+
+static int vhost_vdpa_net_data_start(NetClientState *nc)
+{
+    VhostVDPAState *s = DO_UPCAST(VhostVDPAState, nc, nc);
+    struct vhost_vdpa *v = &s->vhost_vdpa;
+
+    assert(nc->info->type == NET_CLIENT_DRIVER_VHOST_VDPA);
+
+    if (v->shadow_vqs_capable) {
+        v->shadow_vqs_enabled = vhost_vdpa_net_want_svq(s);
+        v->shadow_data = v->shadow_vqs_enabled;
+    }
+    return 0;
+}
+
 static NetClientInfo net_vhost_vdpa_info = {
         .type = NET_CLIENT_DRIVER_VHOST_VDPA,
         .size = sizeof(VhostVDPAState),
         .cleanup = vhost_vdpa_cleanup,
         .has_vnet_hdr = vhost_vdpa_has_vnet_hdr,
         .has_ufo = vhost_vdpa_has_ufo,
+        .start = vhost_vdpa_net_data_start,
+};
+
+/*
+ * Restart the device so that the start hooks pick the shadow virtqueue
+ * mode that fits the migration state.
+ */
+static void vhost_vdpa_net_restart(VhostVDPAState *s)
+{
+    VirtIONet *n;
+    VirtIODevice *vdev;
+    int data_queue_pairs, cvq, r;
+
+    if (!s->nc.peer ||
+        s->vhost_vdpa.shadow_vqs_enabled == vhost_vdpa_net_want_svq(s)) {
+        return;
+    }
+
+    n = VIRTIO_NET(qemu_get_nic_opaque(s->nc.peer));
+    vdev = VIRTIO_DEVICE(n);
+    if (!n->vhost_started) {
+        return;
+    }
+
+    data_queue_pairs = n->multiqueue ? n->max_queues : 1;
+    cvq = virtio_vdev_has_feature(vdev, VIRTIO_NET_F_CTRL_VQ) ?
+          n->max_ncs - n->max_queues : 0;
+    vhost_net_stop(vdev, n->nic->ncs, data_queue_pairs, cvq);
+    r = vhost_net_start(vdev, n->nic->ncs, data_queue_pairs, cvq);
+    if (r < 0) {
+        error_report("unable to start vhost net: %s(%d)", g_strerror(-r), -r);
+    }
+}
+
+static void vdpa_net_migration_state_notifier(Notifier *notifier, void *data)
+{
+    MigrationState *migration = data;
+    VhostVDPAState *s = container_of(notifier, VhostVDPAState,
+                                     migration_state);
+
+    if (migration_in_setup(migration) || migration_has_failed(migration)) {
+        vhost_vdpa_net_restart(s);
+    }
+}
+
+static int vhost_vdpa_net_cvq_start(NetClientState *nc)
+{
+    VhostVDPAState *s = DO_UPCAST(VhostVDPAState, nc, nc);
+    struct vhost_vdpa *v = &s->vhost_vdpa;
+    int r;
+
+    assert(nc->info->type == NET_CLIENT_DRIVER_VHOST_VDPA);
+
+    if (!v->shadow_vqs_capable) {
+        /* The guest drives the control virtqueue of the device directly */
+        return 0;
+    }
+
+    /* Otherwise the control virtqueue is always shadowed */
+    v->shadow_vqs_enabled = true;
+    v->shadow_data = vhost_vdpa_net_want_svq(s);
+
+    r = vhost_vdpa_svq_map_buf(v, s->cvq_cmd_out_buffer,
+                               vhost_vdpa_net_cvq_cmd_page_len(), false);
+    if (r < 0) {
+        return r;
+    }
+
+    r = vhost_vdpa_svq_map_buf(v, s->status,
+                               vhost_vdpa_net_cvq_cmd_page_len(), true);
+    if (r < 0) {
+        vhost_vdpa_svq_unmap_buf(v, s->cvq_cmd_out_buffer);
+    }
+    return r;
+}
+
+static void vhost_vdpa_net_cvq_stop(NetClientState *nc)
+{
+    VhostVDPAState *s = DO_UPCAST(VhostVDPAState, nc, nc);
+
+    assert(nc->info->type == NET_CLIENT_DRIVER_VHOST_VDPA);
+
+    if (!s->vhost_vdpa.shadow_vqs_capable) {
+        return;
+    }
+
+    vhost_vdpa_svq_unmap_buf(&s->vhost_vdpa, s->cvq_cmd_out_buffer);
+    vhost_vdpa_svq_unmap_buf(&s->vhost_vdpa, s->status);
+}
+
+/*
+ * Send the command already in cvq_cmd_out_buffer to the device, and wait
+ * for its answer in status.  Returns the length that the device wrote, or
+ * a negative errno.
+ */
+static ssize_t vhost_vdpa_net_cvq_add(VhostVDPAState *s, size_t out_len)
+{
+    const struct iovec out = {
+        .iov_base = s->cvq_cmd_out_buffer,
+        .iov_len = out_len,
+    };
+    const struct iovec in = {
+        .iov_base = s->status,
+        .iov_len = sizeof(virtio_net_ctrl_ack),
+    };
+    VhostShadowVirtqueue *svq = g_ptr_array_index(s->vhost_vdpa.shadow_vqs, 0);
+    int r;
+
+    r = vhost_svq_add(svq, &out, 1, &in, 1, NULL);
+    if (unlikely(r != 0)) {
+        if (unlikely(r == -ENOSPC)) {
+            qemu_log_mask(LOG_GUEST_ERROR, "%s: No space on device queue\n",
+                          __func__);
+        }
+        return r;
+    }
+
+    /*
+     * We can poll here since we've had BQL from the time we sent the
+     * descriptor.
+     */
+    return vhost_svq_poll(svq);
+}
+
+static int vhost_vdpa_net_load_cmd(VhostVDPAState *s, uint8_t class,
+                                   uint8_t cmd, const struct iovec *data_sg,
+                                   size_t data_num)
+{
+    const struct virtio_net_ctrl_hdr ctrl = {
+        .class = class,
+        .cmd = cmd,
+    };
+    size_t data_size = iov_size(data_sg, data_num);
+    ssize_t dev_written;
+
+    assert(data_size <= vhost_vdpa_net_cvq_cmd_page_len() - sizeof(ctrl));
+
+    memcpy(s->cvq_cmd_out_buffer, &ctrl, sizeof(ctrl));
+    iov_to_buf(data_sg, data_num, 0, s->cvq_cmd_out_buffer + sizeof(ctrl),
+               data_size);
+
+    dev_written = vhost_vdpa_net_cvq_add(s, sizeof(ctrl) + data_size);
+    if (dev_written < 0) {
+        return dev_written;
+    }
+    if (dev_written < sizeof(virtio_net_ctrl_ack) ||
+        *s->status != VIRTIO_NET_OK) {
+        return -EIO;
+    }
+    return 0;
+}
+
+static int vhost_vdpa_net_load_mac(VhostVDPAState *s, VirtIONet *n)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(n);
+    int r;
+
+    if (virtio_vdev_has_feature(vdev, VIRTIO_NET_F_CTRL_MAC_ADDR)) {
+        const struct iovec data = {
+            .iov_base = n->mac,
+            .iov_len = sizeof(n->mac),
+        };
+
+        r = vhost_vdpa_net_load_cmd(s, VIRTIO_NET_CTRL_MAC,
+                                    VIRTIO_NET_CTRL_MAC_ADDR_SET, &data, 1);
+        if (r < 0) {
+            return r;
+        }
+    }
+
+    if (virtio_vdev_has_feature(vdev, VIRTIO_NET_F_CTRL_RX)) {
+        /* An overflowing table makes the device overflow as well */
+        static const uint8_t overflow[(MAC_TABLE_ENTRIES + 1) * ETH_ALEN];
+        uint32_t uni_entries = n->mac_table.first_multi;
+        uint32_t multi_entries = n->mac_table.in_use - uni_entries;
+        const uint8_t *uni_macs = n->mac_table.macs;
+        const uint8_t *multi_macs = n->mac_table.macs + uni_entries * ETH_ALEN;
+        struct virtio_net_ctrl_mac uni, multi;
+
+        if (n->mac_table.uni_overflow) {
+            uni_entries = MAC_TABLE_ENTRIES + 1;
+            uni_macs = overflow;
+        }
+        if (n->mac_table.multi_overflow) {
+            multi_entries = MAC_TABLE_ENTRIES + 1;
+            multi_macs = overflow;
+        }
+        if (!uni_entries && !multi_entries) {
+            /* The device starts with an empty table */
+            return 0;
+        }
+
+        uni.entries = cpu_to_le32(uni_entries);
+        multi.entries = cpu_to_le32(multi_entries);
+        const struct iovec data[] = {
+            { .iov_base = &uni, .iov_len = sizeof(uni) },
+            {
+                .iov_base = (void *)uni_macs,
+                .iov_len = uni_entries * ETH_ALEN,
+            },
+            { .iov_base = &multi, .iov_len = sizeof(multi) },
+            {
+                .iov_base = (void *)multi_macs,
+                .iov_len = multi_entries * ETH_ALEN,
+            },
+        };
+
+        r = vhost_vdpa_net_load_cmd(s, VIRTIO_NET_CTRL_MAC,
+                                    VIRTIO_NET_CTRL_MAC_TABLE_SET,
+                                    data, ARRAY_SIZE(data));
+        if (r < 0) {
+            return r;
+        }
+    }
+
+    return 0;
+}
+
+static int vhost_vdpa_net_load_rss(VhostVDPAState *s, VirtIONet *n,
+                                   bool do_rss)
+{
+    struct virtio_net_rss_config cfg = {};
+    uint16_t table[VIRTIO_NET_RSS_MAX_TABLE_LEN] = {};
+    uint16_t table_len = 1;
+    int i;
+
+    cfg.hash_types = cpu_to_le32(n->rss_data.hash_types);
+    if (do_rss) {
+        table_len = n->rss_data.indirections_len;
+        for (i = 0; i < table_len; ++i) {
+            table[i] = cpu_to_le16(n->rss_data.indirections_table[i]);
+        }
+        cfg.indirection_table_mask = cpu_to_le16(table_len - 1);
+        cfg.unclassified_queue = cpu_to_le16(n->rss_data.default_queue);
+        cfg.max_tx_vq = cpu_to_le16(n->curr_queues);
+    }
+    /* The model keeps no key length, it uses all of the key */
+    cfg.hash_key_length = sizeof(n->rss_data.key);
+
+    const struct iovec data[] = {
+        {
+            .iov_base = &cfg,
+            .iov_len = offsetof(struct virtio_net_rss_config,
+                                indirection_table),
+        }, {
+            .iov_base = table,
+            .iov_len = table_len * sizeof(table[0]),
+        }, {
+            .iov_base = &cfg.max_tx_vq,
+            .iov_len = offsetof(struct virtio_net_rss_config, hash_key_data) -
+                       offsetof(struct virtio_net_rss_config, max_tx_vq),
+        }, {
+            .iov_base = n->rss_data.key,
+            .iov_len = sizeof(n->rss_data.key),
+        }
+    };
+
+    return vhost_vdpa_net_load_cmd(s, VIRTIO_NET_CTRL_MQ,
+                                   do_rss ? VIRTIO_NET_CTRL_MQ_RSS_CONFIG :
+                                            VIRTIO_NET_CTRL_MQ_HASH_CONFIG,
+                                   data, ARRAY_SIZE(data));
+}
+
+static int vhost_vdpa_net_load_mq(VhostVDPAState *s, VirtIONet *n)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(n);
+    bool do_rss = n->rss_data.enabled && n->rss_data.redirect;
+    int r;
+
+    if (virtio_vdev_has_feature(vdev, VIRTIO_NET_F_MQ) &&
+        n->curr_queues > 1 && !do_rss) {
+        struct virtio_net_ctrl_mq mq = {
+            .virtqueue_pairs = cpu_to_le16(n->curr_queues),
+        };
+        const struct iovec data = {
+            .iov_base = &mq,
+            .iov_len = sizeof(mq),
+        };
+
+        r = vhost_vdpa_net_load_cmd(s, VIRTIO_NET_CTRL_MQ,
+                                    VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET, &data, 1);
+        if (r < 0) {
+            return r;
+        }
+    }
+
+    if (n->rss_data.enabled) {
+        return vhost_vdpa_net_load_rss(s, n, do_rss);
+    }
+    return 0;
+}
+
+static int vhost_vdpa_net_load_offloads(VhostVDPAState *s, VirtIONet *n)
+{
+    uint64_t offloads;
+    const struct iovec data = {
+        .iov_base = &offloads,
+        .iov_len = sizeof(offloads),
+    };
+
+    if (!virtio_vdev_has_feature(VIRTIO_DEVICE(n),
+                                 VIRTIO_NET_F_CTRL_GUEST_OFFLOADS)) {
+        return 0;
+    }
+
+    offloads = cpu_to_le64(n->curr_guest_offloads);
+    return vhost_vdpa_net_load_cmd(s, VIRTIO_NET_CTRL_GUEST_OFFLOADS,
+                                   VIRTIO_NET_CTRL_GUEST_OFFLOADS_SET,
+                                   &data, 1);
+}
+
+static int vhost_vdpa_net_load_rx_mode(VhostVDPAState *s, uint8_t cmd,
+                                       uint8_t on)
+{
+    const struct iovec data = {
+        .iov_base = &on,
+        .iov_len = sizeof(on),
+    };
+
+    return vhost_vdpa_net_load_cmd(s, VIRTIO_NET_CTRL_RX, cmd, &data, 1);
+}
+
+static int vhost_vdpa_net_load_rx(VhostVDPAState *s, VirtIONet *n)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(n);
+    const struct {
+        uint8_t cmd;
+        uint8_t on;
+        bool extra;
+    } modes[] = {
+        { VIRTIO_NET_CTRL_RX_PROMISC, n->promisc, false },
+        { VIRTIO_NET_CTRL_RX_ALLMULTI, n->allmulti, false },
+        { VIRTIO_NET_CTRL_RX_ALLUNI, n->alluni, true },
+        { VIRTIO_NET_CTRL_RX_NOMULTI, n->nomulti, true },
+        { VIRTIO_NET_CTRL_RX_NOUNI, n->nouni, true },
+        { VIRTIO_NET_CTRL_RX_NOBCAST, n->nobcast, true },
+    };
+    int i, r;
+
+    if (!virtio_vdev_has_feature(vdev, VIRTIO_NET_F_CTRL_RX)) {
+        return 0;
+    }
+
+    for (i = 0; i < ARRAY_SIZE(modes); i++) {
+        if (modes[i].extra &&
+            !virtio_vdev_has_feature(vdev, VIRTIO_NET_F_CTRL_RX_EXTRA)) {
+            continue;
+        }
+        r = vhost_vdpa_net_load_rx_mode(s, modes[i].cmd, modes[i].on);
+        if (r < 0) {
+            return r;
+        }
+    }
+    return 0;
+}
+
+static int vhost_vdpa_net_load_vlan(VhostVDPAState *s, VirtIONet *n)
+{
+    uint16_t vid, vid_le;
+    const struct iovec data = {
+        .iov_base = &vid_le,
+        .iov_len = sizeof(vid_le),
+    };
+    int r;
+
+    if (!virtio_vdev_has_feature(VIRTIO_DEVICE(n), VIRTIO_NET_F_CTRL_VLAN)) {
+        return 0;
+    }
+
+    for (vid = 0; vid < MAX_VLAN; vid++) {
+        if (!(n->vlans[vid >> 5] & (1U << (vid & 0x1f)))) {
+            continue;
+        }
+        vid_le = cpu_to_le16(vid);
+        r = vhost_vdpa_net_load_cmd(s, VIRTIO_NET_CTRL_VLAN,
+                                    VIRTIO_NET_CTRL_VLAN_ADD, &data, 1);
+        if (r < 0) {
+            return r;
+        }
+    }
+    return 0;
+}
+
+/*
+ * The device lost its control state when it was reset: replay the state of
+ * the device model through the control virtqueue, before the guest can use
+ * it again.
+ */
+static int vhost_vdpa_net_cvq_load(NetClientState *nc)
+{
+    VhostVDPAState *s = DO_UPCAST(VhostVDPAState, nc, nc);
+    VirtIONet *n = VIRTIO_NET(s->vhost_vdpa.dev->vdev);
+    VhostShadowVirtqueue *svq;
+    int r;
+
+    assert(nc->info->type == NET_CLIENT_DRIVER_VHOST_VDPA);
+
+    /* Without shadowing, the guest sets the state up again itself */
+    if (!s->vhost_vdpa.shadow_vqs_enabled ||
+        !virtio_vdev_has_feature(VIRTIO_DEVICE(n), VIRTIO_NET_F_CTRL_VQ)) {
+        return 0;
+    }
+    svq = g_ptr_array_index(s->vhost_vdpa.shadow_vqs, 0);
+    if (!svq->vq) {
+        return 0;
+    }
+
+    r = vhost_vdpa_net_load_mac(s, n);
+    if (r < 0) {
+        goto err;
+    }
+    r = vhost_vdpa_net_load_mq(s, n);
+    if (r < 0) {
+        goto err;
+    }
+    r = vhost_vdpa_net_load_offloads(s, n);
+    if (r < 0) {
+        goto err;
+    }
+    r = vhost_vdpa_net_load_rx(s, n);
+    if (r < 0) {
+        goto err;
+    }
+    r = vhost_vdpa_net_load_vlan(s, n);
+    if (r < 0) {
+        goto err;
+    }
+    return 0;
+
+err:
+    error_report("vhost-vdpa: failed to restore the control state: %s",
+                 strerror(-r));
+    return r;
+}
+
+/* Only forward the commands that vhost_vdpa_net_cvq_load can replay */
+static bool vhost_vdpa_net_cvq_validate_cmd(const void *out_buf, size_t len)
+{
+    struct virtio_net_ctrl_hdr ctrl;
+
+    if (unlikely(len < sizeof(ctrl))) {
+        qemu_log_mask(LOG_GUEST_ERROR,
+                      "%s: invalid length of out buffer %zu\n", __func__, len);
+        return false;
+    }
+
+    memcpy(&ctrl, out_buf, sizeof(ctrl));
+    switch (ctrl.class) {
+    case VIRTIO_NET_CTRL_RX:
+        return ctrl.cmd <= VIRTIO_NET_CTRL_RX_NOBCAST;
+    case VIRTIO_NET_CTRL_MAC:
+        return ctrl.cmd == VIRTIO_NET_CTRL_MAC_TABLE_SET ||
+               ctrl.cmd == VIRTIO_NET_CTRL_MAC_ADDR_SET;
+    case VIRTIO_NET_CTRL_VLAN:
+        return ctrl.cmd == VIRTIO_NET_CTRL_VLAN_ADD ||
+               ctrl.cmd == VIRTIO_NET_CTRL_VLAN_DEL;
+    case VIRTIO_NET_CTRL_ANNOUNCE:
+        return ctrl.cmd == VIRTIO_NET_CTRL_ANNOUNCE_ACK;
+    case VIRTIO_NET_CTRL_MQ:
+        return ctrl.cmd == VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET ||
+               ctrl.cmd == VIRTIO_NET_CTRL_MQ_RSS_CONFIG ||
+               ctrl.cmd == VIRTIO_NET_CTRL_MQ_HASH_CONFIG;
+    case VIRTIO_NET_CTRL_GUEST_OFFLOADS:
+        return ctrl.cmd == VIRTIO_NET_CTRL_GUEST_OFFLOADS_SET;
+    default:
+        qemu_log_mask(LOG_GUEST_ERROR, "%s: invalid control class %u\n",
+                      __func__, ctrl.class);
+        return false;
+    }
+}
+
+/*
+ * Forward a guest control command to the device, and apply it to the
+ * device model too if the device accepted it, so the model always knows
+ * the state to restore after a reset.
+ */
+static int vhost_vdpa_net_handle_ctrl_avail(VhostShadowVirtqueue *svq,
+                                            VirtQueueElement *elem,
+                                            void *opaque)
+{
+    VhostVDPAState *s = opaque;
+    size_t in_len;
+    virtio_net_ctrl_ack status = VIRTIO_NET_ERR;
+    /* Out buffer sent to both the vdpa device and the device model */
+    struct iovec out = {
+        .iov_base = s->cvq_cmd_out_buffer,
+    };
+    /* in buffer used for device model */
+    const struct iovec in = {
+        .iov_base = &status,
+        .iov_len = sizeof(status),
+    };
+    ssize_t dev_written = -EINVAL;
+
+    out.iov_len = iov_to_buf(elem->out_sg, elem->out_num, 0,
+                             s->cvq_cmd_out_buffer,
+                             vhost_vdpa_net_cvq_cmd_page_len());
+    if (out.iov_len < iov_size(elem->out_sg, elem->out_num)) {
+        qemu_log_mask(LOG_GUEST_ERROR, "%s: control command too long\n",
+                      __func__);
+        goto out;
+    }
+    if (!vhost_vdpa_net_cvq_validate_cmd(s->cvq_cmd_out_buffer,
+                                         out.iov_len)) {
+        goto out;
+    }
+
+    dev_written = vhost_vdpa_net_cvq_add(s, out.iov_len);
+    if (unlikely(dev_written < 0)) {
+        goto out;
+    }
+    if (unlikely(dev_written < sizeof(status))) {
+        error_report("Insufficient written data (%zu)", dev_written);
+        goto out;
+    }
+
+    memcpy(&status, s->status, sizeof(status));
+    if (status != VIRTIO_NET_OK) {
+        goto out;
+    }
+
+    status = VIRTIO_NET_ERR;
+    virtio_net_handle_ctrl_iov(svq->vdev, &in, 1, &out, 1);
+    if (status != VIRTIO_NET_OK) {
+        error_report("Bad CVQ processing in model");
+    }
+
+out:
+    in_len = iov_from_buf(elem->in_sg, elem->in_num, 0, &status,
+                          sizeof(status));
+    if (unlikely(in_len < sizeof(status))) {
+        error_report("Bad device CVQ written length");
+    }
+    vhost_svq_push_elem(svq, elem, MIN(in_len, sizeof(status)));
+    g_free(elem);
+    return dev_written < 0 ? dev_written : 0;
+}
+
+static const VhostShadowVirtqueueOps vhost_vdpa_net_svq_ops = {
+    .avail_handler = vhost_vdpa_net_handle_ctrl_avail,
+};
+
+static NetClientInfo net_vhost_vdpa_cvq_info = {
+    .type = NET_CLIENT_DRIVER_VHOST_VDPA,
+    .size = sizeof(VhostVDPAState),
+    .cleanup = vhost_vdpa_cleanup,
+    .has_vnet_hdr = vhost_vdpa_has_vnet_hdr,
+    .has_ufo = vhost_vdpa_has_ufo,
+    .start = vhost_vdpa_net_cvq_start,
+    .load = vhost_vdpa_net_cvq_load,
+    .stop = vhost_vdpa_net_cvq_stop,
 };
 
-static int net_vhost_vdpa_init(NetClientState *peer, const char *device,
-                               const char *name, const char *vhostdev)
+static NetClientState *net_vhost_vdpa_init(NetClientState *peer,
+                                           const char *device,
+                                           const char *name,
+                                           VhostVDPAShared *shared,
+                                           const struct vhost_vdpa_iova_range
+                                           *iova_range,
+                                           int queue_pair_index,
+                                           int nvqs,
+                                           bool is_datapath,
+                                           bool svq)
 {
     NetClientState *nc = NULL;
     VhostVDPAState *s;
-    int vdpa_device_fd = -1;
     int ret = 0;
     assert(name);
-    nc = qemu_new_net_client(&net_vhost_vdpa_info, peer, device, name);
+    if (is_datapath) {
+        nc = qemu_new_net_client(&net_vhost_vdpa_info, peer, device,
+                                 name);
+    } else {
+        nc = qemu_new_net_control_client(&net_vhost_vdpa_cvq_info, peer,
+                                         device, name);
+    }
     snprintf(nc->info_str, sizeof(nc->info_str), TYPE_VHOST_VDPA);
     s = DO_UPCAST(VhostVDPAState, nc, nc);
-    vdpa_device_fd = qemu_open_old(vhostdev, O_RDWR);
-    if (vdpa_device_fd == -1) {
-        return -errno;
+
+    s->shared = shared;
+    shared->refcnt++;
+    s->vhost_vdpa.device_fd = shared->device_fd;
+    s->vhost_vdpa.index = queue_pair_index;
+    s->vhost_vdpa.iova_range = *iova_range;
+    s->vhost_vdpa.iova_tree = shared->iova_tree;
+    s->vhost_vdpa.shadow_vqs_capable = shared->iova_tree != NULL;
+    s->always_svq = svq;
+    if (!is_datapath) {
+        s->cvq_cmd_out_buffer = qemu_memalign(qemu_real_host_page_size,
+                                            vhost_vdpa_net_cvq_cmd_page_len());
+        memset(s->cvq_cmd_out_buffer, 0, vhost_vdpa_net_cvq_cmd_page_len());
+        s->status = qemu_memalign(qemu_real_host_page_size,
+                                  vhost_vdpa_net_cvq_cmd_page_len());
+        memset(s->status, 0, vhost_vdpa_net_cvq_cmd_page_len());
+
+        s->vhost_vdpa.shadow_vq_ops = &vhost_vdpa_net_svq_ops;
+        s->vhost_vdpa.shadow_vq_ops_opaque = s;
+    } else if (queue_pair_index == 0 && s->vhost_vdpa.shadow_vqs_capable &&
+               !svq) {
+        s->migration_state.notify = vdpa_net_migration_state_notifier;
+        add_migration_state_change_notifier(&s->migration_state);
     }
-    s->vhost_vdpa.device_fd = vdpa_device_fd;
-    ret = vhost_vdpa_add(nc, (void *)&s->vhost_vdpa);
+
+    ret = vhost_vdpa_add(nc, (void *)&s->vhost_vdpa, nvqs);
     if (ret) {
-        qemu_close(vdpa_device_fd);
+        /* This deletes the net clients of the previous queue pairs too */
         qemu_del_net_client(nc);
+        return NULL;
     }
-    return ret;
+    return nc;
+}
+
+static int vhost_vdpa_get_iova_range(int fd,
+                                     struct vhost_vdpa_iova_range *iova_range)
+{
+    int ret = ioctl(fd, VHOST_VDPA_GET_IOVA_RANGE, iova_range);
+
+    return ret < 0 ? -errno : 0;
+}
+
+static int vhost_vdpa_get_max_queue_pairs(int fd, uint64_t features,
+                                          int *has_cvq, Error **errp)
+{
+    unsigned long config_size = offsetof(struct vhost_vdpa_config, buf);
+    g_autofree struct vhost_vdpa_config *config = NULL;
+    __virtio16 *max_queue_pairs;
+    int ret;
+
+    if (features & (1ULL << VIRTIO_NET_F_CTRL_VQ)) {
+        *has_cvq = 1;
+    } else {
+        *has_cvq = 0;
+    }
+
+    if (features & (1ULL << VIRTIO_NET_F_MQ)) {
+        config = g_malloc0(config_size + sizeof(*max_queue_pairs));
+        config->off = offsetof(struct virtio_net_config, max_virtqueue_pairs);
+        config->len = sizeof(*max_queue_pairs);
+
+        ret = ioctl(fd, VHOST_VDPA_GET_CONFIG, config);
+        if (ret) {
+            error_setg_errno(errp, errno,
+                             "Fail to get config from vhost-vDPA device");
+            return -errno;
+        }
+
+        max_queue_pairs = (__virtio16 *)&config->buf;
+
+        return lduw_le_p(max_queue_pairs);
+    }
+
+    return 1;
 }
 
 static int net_vhost_check_net(void *opaque, QemuOpts *opts, Error **errp)
@@ -201,6 +900,13 @@ int net_init_vhost_vdpa(const Netdev *netdev, const char *name,
                         NetClientState *peer, Error **errp)
 {
     const NetdevVhostVDPAOptions *opts;
+    VhostVDPAShared *shared;
+    struct vhost_vdpa_iova_range iova_range;
+    uint64_t features;
+    int vdpa_device_fd;
+    NetClientState *nc;
+    int queue_pairs, r, i, has_cvq = 0;
+    bool svq;
 
     assert(netdev->type == NET_CLIENT_DRIVER_VHOST_VDPA);
     opts = &netdev->u.vhost_vdpa;
@@ -209,5 +915,64 @@ int net_init_vhost_vdpa(const Netdev *netdev, const char *name,
                           (char *)name, errp)) {
         return -1;
     }
-    return net_vhost_vdpa_init(peer, TYPE_VHOST_VDPA, name, opts->vhostdev);
+
+    vdpa_device_fd = qemu_open(opts->vhostdev, O_RDWR, errp);
+    if (vdpa_device_fd == -1) {
+        return -1;
+    }
+
+    r = ioctl(vdpa_device_fd, VHOST_GET_FEATURES, &features);
+    if (r < 0) {
+        error_setg_errno(errp, errno, "Fail to query features from vhost-vDPA "
+                         "device");
+        qemu_close(vdpa_device_fd);
+        return -1;
+    }
+
+    queue_pairs = vhost_vdpa_get_max_queue_pairs(vdpa_device_fd, features,
+                                                 &has_cvq, errp);
+    if (queue_pairs < 0) {
+        qemu_close(vdpa_device_fd);
+        return queue_pairs;
+    }
+
+    if (vhost_vdpa_get_iova_range(vdpa_device_fd, &iova_range) < 0) {
+        /* Older kernels accept any IOVA */
+        iova_range.first = 0;
+        iova_range.last = UINT64_MAX;
+    }
+
+    shared = g_new0(VhostVDPAShared, 1);
+    shared->device_fd = vdpa_device_fd;
+    /*
+     * Devices that cannot be shadowed can neither migrate nor have their
+     * control virtqueue shadowed, which the guest then drives directly.
+     */
+    svq = opts->has_x_svq && opts->x_svq;
+    if (vhost_svq_valid_features(features, svq ? errp : NULL)) {
+        shared->iova_tree = iova_tree_new();
+    } else if (svq) {
+        g_free(shared);
+        qemu_close(vdpa_device_fd);
+        return -1;
+    }
+
+    for (i = 0; i < queue_pairs; i++) {
+        nc = net_vhost_vdpa_init(peer, TYPE_VHOST_VDPA, name, shared,
+                                 &iova_range, i, 2, true, svq);
+        if (!nc) {
+            /* The last net client to go freed the shared state */
+            return -1;
+        }
+    }
+
+    if (has_cvq) {
+        nc = net_vhost_vdpa_init(peer, TYPE_VHOST_VDPA, name, shared,
+                                 &iova_range, i, 1, false, svq);
+        if (!nc) {
+            return -1;
+        }
+    }
+
+    return 0;
 }
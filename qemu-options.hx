@@ -2579,7 +2579,7 @@ DEF("netdev", HAS_ARG, QEMU_OPTION_netdev,
     "-netdev tap,id=str[,fd=h][,fds=x:y:...:z][,ifname=name][,script=file][,downscript=dfile]\n"
     "         [,br=bridge][,helper=helper][,sndbuf=nbytes][,vnet_hdr=on|off][,vhost=on|off]\n"
     "         [,vhostfd=h][,vhostfds=x:y:...:z][,vhostforce=on|off][,queues=n]\n"
-    "         [,poll-us=n]\n"
+    "         [,poll-us=n][,rx-budget=n][,tx-uring=on|off]\n"
     "                configure a host TAP network backend with ID 'str'\n"
     "                connected to a bridge (default=" DEFAULT_BRIDGE_INTERFACE ")\n"
     "                use network scripts 'file' (default=" DEFAULT_NETWORK_SCRIPT ")\n"
@@ -2602,6 +2602,9 @@ DEF("netdev", HAS_ARG, QEMU_OPTION_netdev,
     "                use 'queues=n' to specify the number of queues to be created for multiqueue TAP\n"
     "                use 'poll-us=n' to specify the maximum number of microseconds that could be\n"
     "                spent on busy polling for vhost net\n"
+    "                use 'rx-budget=n' to limit the number of packets read from the TAP\n"
+    "                interface per wakeup (default=50)\n"
+    "                use 'tx-uring=off' to write packets with writev() instead of io_uring\n"
     "-netdev bridge,id=str[,br=bridge][,helper=helper]\n"
     "                configure a host TAP network backend with ID 'str' that is\n"
     "                connected to a bridge (default=" DEFAULT_BRIDGE_INTERFACE ")\n"
@@ -2656,13 +2659,20 @@ DEF("netdev", HAS_ARG, QEMU_OPTION_netdev,
     "                VALE port (created on the fly) called 'name' ('nmname' is name of the \n"
     "                netmap device, defaults to '/dev/netmap')\n"
 #endif
+#ifdef CONFIG_AF_XDP
+    "-netdev af-xdp,id=str,ifname=name[,mode=native|skb][,force-copy=on|off]\n"
+    "         [,queues=n][,start-queue=m][,busy-poll=usec]\n"
+    "                attach to queues m..m+n-1 of the existing network interface 'name'\n"
+    "                through AF_XDP sockets, zero-copy unless 'force-copy=on'\n"
+#endif
 #ifdef CONFIG_POSIX
     "-netdev vhost-user,id=str,chardev=dev[,vhostforce=on|off]\n"
     "                configure a vhost-user network, backed by a chardev 'dev'\n"
 #endif
 #ifdef __linux__
-    "-netdev vhost-vdpa,id=str,vhostdev=/path/to/dev\n"
+    "-netdev vhost-vdpa,id=str,vhostdev=/path/to/dev[,x-svq=on|off]\n"
     "                configure a vhost-vdpa network,Establish a vhost-vdpa netdev\n"
+    "                use 'x-svq=on' to go through shadow virtqueues all the time\n"
 #endif
     "-netdev hubport,id=str,hubid=n[,netdev=nd]\n"
     "                configure a hub port on the hub with ID 'n'\n", QEMU_ARCH_ALL)
@@ -2680,6 +2690,9 @@ DEF("nic", HAS_ARG, QEMU_OPTION_nic,
 #ifdef CONFIG_NETMAP
     "netmap|"
 #endif
+#ifdef CONFIG_AF_XDP
+    "af-xdp|"
+#endif
 #ifdef CONFIG_POSIX
     "vhost-user|"
 #endif
@@ -2704,12 +2717,15 @@ DEF("net", HAS_ARG, QEMU_OPTION_net,
 #endif
 #ifdef CONFIG_NETMAP
     "netmap|"
+#endif
+#ifdef CONFIG_AF_XDP
+    "af-xdp|"
 #endif
     "socket][,option][,option][,...]\n"
     "                old way to initialize a host network interface\n"
     "                (use the -netdev option if possible instead)\n", QEMU_ARCH_ALL)
 SRST
-``-nic [tap|bridge|user|l2tpv3|vde|netmap|vhost-user|socket][,...][,mac=macaddr][,model=mn]``
+``-nic [tap|bridge|user|l2tpv3|vde|netmap|af-xdp|vhost-user|socket][,...][,mac=macaddr][,model=mn]``
     This option is a shortcut for configuring both the on-board
     (default) guest NIC hardware and the host network backend in one go.
     The host backend options are the same as with the corresponding
@@ -2924,6 +2940,16 @@ SRST
     ``fd``\ =h can be used to specify the handle of an already opened
     host TAP interface.
 
+    ``rx-budget``\ =n limits the number of packets read from the TAP
+    interface each time it becomes readable, so that a busy interface
+    does not hold the main loop for too long. The default is 50. Packets
+    are still read one at a time; only transmit is batched.
+
+    ``tx-uring``\ =on|off selects whether batches of packets sent by the
+    guest are written with io_uring, if QEMU was built with it. The ring
+    is set up on the first batch. If that fails, or with ``tx-uring=off``,
+    packets are written one ``writev()`` at a time. The default is on.
+
     Examples:
 
     .. parsed-literal::
@@ -3123,6 +3149,32 @@ SRST
         # launch QEMU instance
         |qemu_system| linux.img -nic vde,sock=/tmp/myswitch
 
+``-netdev af-xdp,id=id,ifname=name[,mode=native|skb][,force-copy=on|off][,queues=n][,start-queue=m][,busy-poll=usec]``
+    Connect to queues m to m+n-1 of the host network interface ifname
+    through AF_XDP sockets. An XDP program that redirects the packets
+    of these queues to the sockets is attached to the interface, in
+    ``native`` (driver) mode if possible, otherwise in ``skb`` mode.
+    Packets are exchanged with the driver without copies when it
+    supports zero-copy, unless ``force-copy=on``. ``busy-poll`` lets
+    the kernel poll the interface queues instead of waiting for their
+    interrupts; it works best when the guest NIC queues are serviced
+    by IOThreads, which then poll the sockets too. Other traffic of the
+    interface still goes to the host network stack, so ethtool can be
+    used to steer the guest's traffic to the selected queues. This
+    option is only available if QEMU has been compiled with AF_XDP
+    support, and needs the CAP_NET_ADMIN and CAP_SYS_ADMIN (or
+    CAP_BPF) capabilities.
+
+    Example:
+
+    .. parsed-literal::
+
+        # create a veth pair and give the guest one end of it
+        ip link add dev vm-end type veth peer name host-end
+        ip link set dev vm-end up
+        ip link set dev host-end up
+        |qemu_system| linux.img -netdev af-xdp,id=n0,ifname=vm-end -device virtio-net-pci,netdev=n0
+
 ``-netdev vhost-user,chardev=id[,vhostforce=on|off][,queues=n]``
     Establish a vhost-user netdev, backed by a chardev id. The chardev
     should be a unix domain socket backed one. The vhost-user uses a
@@ -3142,7 +3194,7 @@ SRST
              -netdev type=vhost-user,id=net0,chardev=chr0 \
              -device virtio-net-pci,netdev=net0
 
-``-netdev vhost-vdpa,vhostdev=/path/to/dev``
+``-netdev vhost-vdpa,vhostdev=/path/to/dev[,x-svq=on|off]``
     Establish a vhost-vdpa netdev.
 
     vDPA device is a device that uses a datapath which complies with
@@ -3150,6 +3202,21 @@ SRST
     vDPA devices can be both physically located on the hardware or
     emulated by software.
 
+    One net client is created per queue pair of the device, plus one for
+    its control virtqueue.  QEMU goes through shadow virtqueues for the
+    control virtqueue, so it tracks the MAC, multiqueue and RSS state of
+    the device, and for all the virtqueues while the VM migrates.
+    ``x-svq=on`` shadows the virtqueues all the time.  This is
+    experimental.
+
+    Example (with the ``vdpa_sim_net`` kernel module):
+
+    .. parsed-literal::
+
+        # vdpa dev add mgmtdev vdpasim_net name vdpa0 max_vqp 2
+        |qemu_system| -netdev type=vhost-vdpa,vhostdev=/dev/vhost-vdpa-0,id=vdpa0 \
+                      -device virtio-net-pci,netdev=vdpa0,mq=on
+
 ``-netdev hubport,id=id,hubid=hubid[,netdev=nd]``
     Create a hub port on the emulated hub with ID hubid.
 
@@ -4325,6 +4392,8 @@ DEF("incoming", HAS_ARG, QEMU_OPTION_incoming, \
     "-incoming exec:cmdline\n" \
     "                accept incoming migration on given file descriptor\n" \
     "                or from given external command\n" \
+    "-incoming file:filename\n" \
+    "                accept incoming migration from given file\n" \
     "-incoming defer\n" \
     "                wait for the URI to be specified via migrate_incoming\n",
     QEMU_ARCH_ALL)
@@ -4344,6 +4413,10 @@ SRST
     Accept incoming migration as an output from specified external
     command.
 
+``-incoming file:filename``
+    Accept incoming migration from a file previously written with
+    ``migrate file:filename``.
+
 ``-incoming defer``
     Wait for the URI to be specified via migrate\_incoming. The monitor
     can be used to change settings (such as migration parameters) prior
@@ -4932,6 +5005,18 @@ SRST
 
         ``behind``: insert behind the specified filter (default).
 
+    ``-object filter-drop,id=id,netdev=netdevid[,ethertype=type][,ip_proto=proto][,port=port][,queue=all|rx|tx][,status=on|off][,position=head|tail|id=<id>][,insert=behind|before]``
+        Drop the packets on netdev netdevid that match all the given
+        rules: EtherType ``ethertype``, IPv4 or IPv6 protocol
+        ``ip_proto``, and TCP or UDP destination port ``port``. A
+        packet too short to have one of the fields that the rules look
+        at is not dropped.
+
+        On Linux, as long as only filter-drop filters come before it in
+        the filter list, a tap netdev drops the matching packets it
+        receives with an eBPF program, before QEMU even reads them. The
+        read-only ``offloaded`` property tells whether it does.
+
     ``-object filter-mirror,id=id,netdev=netdevid,outdev=chardevid,queue=all|rx|tx[,vnet_hdr_support][,position=head|tail|id=<id>][,insert=behind|before]``
         filter-mirror on netdev netdevid,mirror net packet to
         chardevchardevid, if it has the vnet\_hdr\_support flag,
@@ -4964,7 +5049,7 @@ SRST
         stored. The file format is libpcap, so it can be analyzed with
         tools such as tcpdump or Wireshark.
 
-    ``-object colo-compare,id=id,primary_in=chardevid,secondary_in=chardevid,outdev=chardevid,iothread=id[,vnet_hdr_support][,notify_dev=id][,compare_timeout=@var{ms}][,expired_scan_cycle=@var{ms}][,max_queue_size=@var{size}]``
+    ``-object colo-compare,id=id,primary_in=chardevid,secondary_in=chardevid,outdev=chardevid,iothread=id[,vnet_hdr_support][,notify_dev=id][,compare_timeout=@var{ms}][,expired_scan_cycle=@var{ms}][,max_queue_size=@var{size}][,compare_threads=@var{n}]``
         Colo-compare gets packet from primary\_in chardevid and
         secondary\_in, then compare whether the payload of primary packet
         and secondary packet are the same. If same, it will output
@@ -4978,6 +5063,13 @@ SRST
         is to set the period of scanning expired primary node network packets.
         The max\_queue\_size=@var{size} is to set the max compare queue
         size depend on user environment.
+        The compare\_threads=@var{n} spreads the connections over @var{n}
+        additional threads that compare their packets, while the iothread
+        only reads and sends them; by default everything runs in the
+        iothread. The number of compared packets and the time they were
+        held (in nanoseconds) can be read with ``qom-get`` from the
+        compared\_packets, compare\_latency\_avg, compare\_latency\_max
+        and checkpoint\_requests properties.
         If user want to use Xen COLO, need to add the notify\_dev to
         notify Xen colo-frame to do checkpoint.
 
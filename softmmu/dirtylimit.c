@@ -0,0 +1,263 @@
+/*
+ * Per-vCPU dirty page rate limit
+ *
+ * The KVM dirty ring tells which vCPU dirtied which page, so the dirty
+ * page rate of each vCPU can be measured and only the vCPUs that dirty
+ * memory faster than the limit get throttled.  A throttled vCPU sleeps
+ * every time its dirty ring gets full; the sleep is recomputed after
+ * every measurement period.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/main-loop.h"
+#include "qemu/lockable.h"
+#include "qemu/rcu.h"
+#include "qemu/units.h"
+#include "exec/memory.h"
+#include "exec/target_page.h"
+#include "hw/boards.h"
+#include "hw/core/cpu.h"
+#include "sysemu/kvm.h"
+#include "sysemu/dirtylimit.h"
+#include "trace.h"
+
+/* Longest sleep of a throttled vCPU for each full dirty ring */
+#define DIRTYLIMIT_THROTTLE_MAX_US      (1 * G_USEC_PER_SEC)
+/* The sleep is split so that a vCPU being stopped does not wait for it */
+#define DIRTYLIMIT_THROTTLE_SLICE_US    (10 * 1000)
+
+typedef struct DirtyPageRecord {
+    uint64_t start_pages;
+    uint64_t end_pages;
+} DirtyPageRecord;
+
+static struct {
+    /* Protects quota and stat */
+    QemuMutex lock;
+    bool in_service;
+    bool quit;
+    /* dirty page rate limit of each vCPU, in MB/s */
+    uint64_t quota;
+    /* dirty rates measured during the last period */
+    VcpuStat stat;
+    QemuThread thread;
+} dirtylimit_state;
+
+static void __attribute__((constructor)) dirtylimit_init(void)
+{
+    qemu_mutex_init(&dirtylimit_state.lock);
+}
+
+static void record_dirtypages(DirtyPageRecord *records, int nvcpu, bool start)
+{
+    CPUState *cpu;
+
+    CPU_FOREACH(cpu) {
+        if (cpu->cpu_index >= nvcpu) {
+            continue;
+        }
+        if (start) {
+            records[cpu->cpu_index].start_pages = cpu->dirty_pages;
+        } else {
+            records[cpu->cpu_index].end_pages = cpu->dirty_pages;
+        }
+    }
+}
+
+void vcpu_calculate_dirtyrate(int64_t calc_time_ms, VcpuStat *stat,
+                              unsigned int flag, bool one_shot)
+{
+    MachineState *ms = MACHINE(qdev_get_machine());
+    int nvcpu = ms->smp.max_cpus;
+    g_autofree DirtyPageRecord *records = g_new0(DirtyPageRecord, nvcpu);
+    int64_t start_time, duration;
+    CPUState *cpu;
+
+    qemu_mutex_lock_iothread();
+    if (one_shot) {
+        memory_global_dirty_log_start(flag);
+    }
+    /* Reap the dirty rings so that only the coming period is counted */
+    memory_global_dirty_log_sync();
+    record_dirtypages(records, nvcpu, true);
+    start_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+    qemu_mutex_unlock_iothread();
+
+    g_usleep(calc_time_ms * 1000);
+
+    qemu_mutex_lock_iothread();
+    memory_global_dirty_log_sync();
+    record_dirtypages(records, nvcpu, false);
+    duration = MAX(1, qemu_clock_get_ms(QEMU_CLOCK_REALTIME) - start_time);
+    if (one_shot) {
+        memory_global_dirty_log_stop(flag);
+    }
+
+    stat->nvcpu = 0;
+    stat->rates = g_new0(DirtyRateVcpu, nvcpu);
+    CPU_FOREACH(cpu) {
+        DirtyPageRecord *record;
+        uint64_t bytes;
+
+        if (cpu->cpu_index >= nvcpu) {
+            continue;
+        }
+        record = &records[cpu->cpu_index];
+        bytes = (record->end_pages - record->start_pages) *
+                qemu_target_page_size();
+        stat->rates[stat->nvcpu].id = cpu->cpu_index;
+        stat->rates[stat->nvcpu].dirty_rate = bytes * 1000 / duration / MiB;
+        stat->nvcpu++;
+    }
+    qemu_mutex_unlock_iothread();
+}
+
+/* Time, in microseconds, a vCPU takes to fill its dirty ring */
+static int64_t dirtylimit_ring_full_time(uint64_t dirty_rate)
+{
+    uint64_t ring_bytes = (uint64_t)kvm_dirty_ring_size() *
+                          qemu_target_page_size();
+
+    return ring_bytes * G_USEC_PER_SEC / (dirty_rate * MiB);
+}
+
+static void dirtylimit_set_throttle(CPUState *cpu, uint64_t quota,
+                                    uint64_t current)
+{
+    int64_t throttle = qatomic_read(&cpu->throttle_us_per_full);
+
+    if (current) {
+        /*
+         * The measured rate already accounts for the current sleep: a full
+         * ring now takes dirtylimit_ring_full_time(current) and should take
+         * dirtylimit_ring_full_time(quota), so sleep the difference more.
+         * vCPUs below the quota converge to not sleeping at all.
+         */
+        throttle += dirtylimit_ring_full_time(quota) -
+                    dirtylimit_ring_full_time(current);
+        throttle = MIN(MAX(throttle, 0), DIRTYLIMIT_THROTTLE_MAX_US);
+    } else {
+        /* Less than 1 MB/s, back off progressively */
+        throttle /= 2;
+    }
+
+    trace_dirtylimit_set_throttle(cpu->cpu_index, quota, current, throttle);
+    qatomic_set(&cpu->throttle_us_per_full, throttle);
+}
+
+static void *dirtylimit_thread(void *opaque)
+{
+    rcu_register_thread();
+
+    while (!qatomic_read(&dirtylimit_state.quit)) {
+        VcpuStat stat;
+        int i;
+
+        vcpu_calculate_dirtyrate(DIRTYLIMIT_CALC_TIME_MS, &stat,
+                                 GLOBAL_DIRTY_LIMIT, false);
+
+        QEMU_LOCK_GUARD(&dirtylimit_state.lock);
+        WITH_RCU_READ_LOCK_GUARD() {
+            for (i = 0; i < stat.nvcpu; i++) {
+                CPUState *cpu = qemu_get_cpu(stat.rates[i].id);
+
+                if (cpu) {
+                    dirtylimit_set_throttle(cpu, dirtylimit_state.quota,
+                                            stat.rates[i].dirty_rate);
+                }
+            }
+        }
+        g_free(dirtylimit_state.stat.rates);
+        dirtylimit_state.stat = stat;
+    }
+
+    rcu_unregister_thread();
+    return NULL;
+}
+
+bool dirtylimit_in_service(void)
+{
+    return qatomic_read(&dirtylimit_state.in_service);
+}
+
+void dirtylimit_start(uint64_t quota)
+{
+    assert(kvm_enabled() && kvm_dirty_ring_enabled() && quota);
+
+    trace_dirtylimit_start(quota);
+    WITH_QEMU_LOCK_GUARD(&dirtylimit_state.lock) {
+        dirtylimit_state.quota = quota;
+    }
+    if (dirtylimit_state.in_service) {
+        return;
+    }
+
+    memory_global_dirty_log_start(GLOBAL_DIRTY_LIMIT);
+    dirtylimit_state.quit = false;
+    qatomic_set(&dirtylimit_state.in_service, true);
+    qemu_thread_create(&dirtylimit_state.thread, "dirtylimit",
+                       dirtylimit_thread, NULL, QEMU_THREAD_JOINABLE);
+}
+
+void dirtylimit_stop(void)
+{
+    CPUState *cpu;
+
+    if (!dirtylimit_in_service()) {
+        return;
+    }
+
+    trace_dirtylimit_stop();
+    /* The thread takes the iothread lock, don't hold it here */
+    qatomic_set(&dirtylimit_state.quit, true);
+    qemu_thread_join(&dirtylimit_state.thread);
+
+    qemu_mutex_lock_iothread();
+    qatomic_set(&dirtylimit_state.in_service, false);
+    CPU_FOREACH(cpu) {
+        qatomic_set(&cpu->throttle_us_per_full, 0);
+    }
+    memory_global_dirty_log_stop(GLOBAL_DIRTY_LIMIT);
+    qemu_mutex_unlock_iothread();
+
+    WITH_QEMU_LOCK_GUARD(&dirtylimit_state.lock) {
+        g_free(dirtylimit_state.stat.rates);
+        dirtylimit_state.stat.rates = NULL;
+        dirtylimit_state.stat.nvcpu = 0;
+    }
+}
+
+DirtyRateVcpuList *dirtylimit_query_vcpu_rates(void)
+{
+    DirtyRateVcpuList *head = NULL, **tail = &head;
+    int i;
+
+    QEMU_LOCK_GUARD(&dirtylimit_state.lock);
+    for (i = 0; i < dirtylimit_state.stat.nvcpu; i++) {
+        DirtyRateVcpu *rate = g_new(DirtyRateVcpu, 1);
+
+        *rate = dirtylimit_state.stat.rates[i];
+        QAPI_LIST_APPEND(tail, rate);
+    }
+
+    return head;
+}
+
+void dirtylimit_vcpu_execute(CPUState *cpu)
+{
+    int64_t sleep_us = qatomic_read(&cpu->throttle_us_per_full);
+
+    if (!sleep_us || !dirtylimit_in_service()) {
+        return;
+    }
+
+    trace_dirtylimit_vcpu_execute(cpu->cpu_index, sleep_us);
+    while (sleep_us > 0 && !qatomic_read(&cpu->exit_request) &&
+           !qatomic_read(&cpu->stop)) {
+        g_usleep(MIN(sleep_us, DIRTYLIMIT_THROTTLE_SLICE_US));
+        sleep_us -= DIRTYLIMIT_THROTTLE_SLICE_US;
+    }
+}
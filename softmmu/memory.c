@@ -22,6 +22,7 @@
 #include "qemu/error-report.h"
 #include "qemu/main-loop.h"
 #include "qemu/qemu-print.h"
+#include "qemu/timer.h"
 #include "qom/object.h"
 #include "trace.h"
 
@@ -39,7 +40,13 @@
 static unsigned memory_region_transaction_depth;
 static bool memory_region_update_pending;
 static bool ioeventfd_update_pending;
-bool global_dirty_log;
+/* Every FlatView has to be rendered again, e.g. for the global dirty log */
+static bool flatviews_stale;
+/* Last stamp handed out by memory_region_stamp_users() */
+static uint64_t memory_region_stamp;
+/* Changes stamped up to this one were applied by a commit */
+static uint64_t memory_region_committed_stamp;
+unsigned int global_dirty_tracking;
 
 static QTAILQ_HEAD(, MemoryListener) memory_listeners
     = QTAILQ_HEAD_INITIALIZER(memory_listeners);
@@ -49,6 +56,63 @@ static QTAILQ_HEAD(, AddressSpace) address_spaces
 
 static GHashTable *flat_views;
 
+/* Statistics of the commits that updated the topology, for "info mtree" */
+static struct {
+    uint64_t commits;
+    uint64_t rendered;
+    uint64_t updated;
+    int64_t last_ns;
+    int64_t max_ns;
+    int64_t total_ns;
+} commit_stats;
+
+/*
+ * A change below a MemoryRegion only affects the address spaces that reach
+ * it through containers and aliases.  Stamp the regions on the way up to
+ * their roots, so that the commit only renders the FlatViews and computes
+ * the ioeventfds of the address spaces that changed.
+ */
+static void memory_region_stamp_users(MemoryRegion *mr, uint64_t stamp,
+                                      bool ioeventfd)
+{
+    MemoryRegion *alias;
+
+    for (; mr; mr = mr->container) {
+        uint64_t *s = ioeventfd ? &mr->ioeventfd_stamp : &mr->topology_stamp;
+
+        if (*s == stamp) {
+            return;
+        }
+        *s = stamp;
+        QTAILQ_FOREACH(alias, &mr->alias_users, alias_users_link) {
+            memory_region_stamp_users(alias, stamp, ioeventfd);
+        }
+    }
+}
+
+static void memory_region_update_topology(MemoryRegion *mr)
+{
+    memory_region_stamp_users(mr, ++memory_region_stamp, false);
+    memory_region_update_pending = true;
+}
+
+static void memory_region_update_ioeventfds(MemoryRegion *mr)
+{
+    memory_region_stamp_users(mr, ++memory_region_stamp, true);
+    ioeventfd_update_pending = true;
+}
+
+static bool memory_region_topology_changed(MemoryRegion *mr)
+{
+    return flatviews_stale ||
+           mr->topology_stamp > memory_region_committed_stamp;
+}
+
+static bool memory_region_ioeventfds_changed(MemoryRegion *mr)
+{
+    return mr->ioeventfd_stamp > memory_region_committed_stamp;
+}
+
 typedef struct AddrRange AddrRange;
 
 /*
@@ -298,7 +362,7 @@ static void flatview_destroy(FlatView *view)
     g_free(view);
 }
 
-static bool flatview_ref(FlatView *view)
+bool flatview_ref(FlatView *view)
 {
     return qatomic_fetch_inc_nonzero(&view->ref) > 0;
 }
@@ -1001,26 +1065,66 @@ static void flatviews_init(void)
     }
 }
 
-static void flatviews_reset(void)
+static gboolean flatview_changed(gpointer key, gpointer value,
+                                 gpointer user_data)
+{
+    MemoryRegion *physmr = key;
+
+    return physmr && memory_region_topology_changed(physmr);
+}
+
+/* Render again the FlatViews of the address spaces that changed */
+static void flatviews_update(void)
 {
     AddressSpace *as;
 
-    if (flat_views) {
+    if (flatviews_stale && flat_views) {
         g_hash_table_unref(flat_views);
         flat_views = NULL;
     }
     flatviews_init();
+    g_hash_table_foreach_remove(flat_views, flatview_changed, NULL);
 
     /* Render unique FVs */
     QTAILQ_FOREACH(as, &address_spaces, address_spaces_link) {
-        MemoryRegion *physmr = memory_region_get_flatview_root(as->root);
+        MemoryRegion *physmr;
+
+        if (!memory_region_topology_changed(as->root)) {
+            continue;
+        }
 
+        physmr = memory_region_get_flatview_root(as->root);
         if (g_hash_table_lookup(flat_views, physmr)) {
             continue;
         }
 
         generate_memory_topology(physmr);
+        commit_stats.rendered++;
+    }
+}
+
+static gboolean flatview_unused(gpointer key, gpointer value,
+                                gpointer user_data)
+{
+    GHashTable *used = user_data;
+
+    return key && !g_hash_table_contains(used, value);
+}
+
+/*
+ * Drop the FlatViews that no address space uses anymore, together with
+ * their references to the memory regions.
+ */
+static void flatviews_prune(void)
+{
+    GHashTable *used = g_hash_table_new(g_direct_hash, g_direct_equal);
+    AddressSpace *as;
+
+    QTAILQ_FOREACH(as, &address_spaces, address_spaces_link) {
+        g_hash_table_add(used, address_space_to_flatview(as));
     }
+    g_hash_table_foreach_remove(flat_views, flatview_unused, used);
+    g_hash_table_unref(used);
 }
 
 static void address_space_set_flatview(AddressSpace *as)
@@ -1095,22 +1199,42 @@ void memory_region_transaction_commit(void)
     --memory_region_transaction_depth;
     if (!memory_region_transaction_depth) {
         if (memory_region_update_pending) {
-            flatviews_reset();
+            int64_t start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+            int64_t elapsed;
+
+            flatviews_update();
 
             MEMORY_LISTENER_CALL_GLOBAL(begin, Forward);
 
             QTAILQ_FOREACH(as, &address_spaces, address_spaces_link) {
-                address_space_set_flatview(as);
-                address_space_update_ioeventfds(as);
+                if (memory_region_topology_changed(as->root)) {
+                    address_space_set_flatview(as);
+                    address_space_update_ioeventfds(as);
+                    commit_stats.updated++;
+                } else if (memory_region_ioeventfds_changed(as->root)) {
+                    address_space_update_ioeventfds(as);
+                }
             }
+            flatviews_prune();
             memory_region_update_pending = false;
             ioeventfd_update_pending = false;
+            flatviews_stale = false;
+            memory_region_committed_stamp = memory_region_stamp;
             MEMORY_LISTENER_CALL_GLOBAL(commit, Forward);
+
+            elapsed = qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - start;
+            commit_stats.commits++;
+            commit_stats.last_ns = elapsed;
+            commit_stats.max_ns = MAX(commit_stats.max_ns, elapsed);
+            commit_stats.total_ns += elapsed;
         } else if (ioeventfd_update_pending) {
             QTAILQ_FOREACH(as, &address_spaces, address_spaces_link) {
-                address_space_update_ioeventfds(as);
+                if (memory_region_ioeventfds_changed(as->root)) {
+                    address_space_update_ioeventfds(as);
+                }
             }
             ioeventfd_update_pending = false;
+            memory_region_committed_stamp = memory_region_stamp;
         }
    }
 }
@@ -1246,9 +1370,11 @@ static void memory_region_initfn(Object *obj)
     mr->ops = &unassigned_mem_ops;
     mr->enabled = true;
     mr->romd_mode = true;
+    mr->global_locking = true;
     mr->destructor = memory_region_destructor_none;
     QTAILQ_INIT(&mr->subregions);
     QTAILQ_INIT(&mr->coalesced);
+    QTAILQ_INIT(&mr->alias_users);
 
     op = object_property_add(OBJECT(mr), "container",
                              "link<" TYPE_MEMORY_REGION ">",
@@ -1435,6 +1561,20 @@ static MemTxResult memory_region_dispatch_read1(MemoryRegion *mr,
     }
 }
 
+/*
+ * Regions without global locking may take the BQL in their slow paths,
+ * but must not leave it taken (or dropped) behind the caller's back.
+ */
+static void memory_region_check_lockless(MemoryRegion *mr, bool locked)
+{
+    if (qemu_mutex_iothread_locked() != locked) {
+        error_report("memory region %s %s the BQL in its MMIO handler",
+                     memory_region_name(mr),
+                     locked ? "released" : "did not release");
+        abort();
+    }
+}
+
 MemTxResult memory_region_dispatch_read(MemoryRegion *mr,
                                         hwaddr addr,
                                         uint64_t *pval,
@@ -1449,7 +1589,14 @@ MemTxResult memory_region_dispatch_read(MemoryRegion *mr,
         return MEMTX_DECODE_ERROR;
     }
 
-    r = memory_region_dispatch_read1(mr, addr, pval, size, attrs);
+    if (mr->global_locking) {
+        r = memory_region_dispatch_read1(mr, addr, pval, size, attrs);
+    } else {
+        bool locked = qemu_mutex_iothread_locked();
+
+        r = memory_region_dispatch_read1(mr, addr, pval, size, attrs);
+        memory_region_check_lockless(mr, locked);
+    }
     adjust_endianness(mr, pval, op);
     return r;
 }
@@ -1480,6 +1627,28 @@ static bool memory_region_dispatch_write_eventfds(MemoryRegion *mr,
     return false;
 }
 
+static MemTxResult memory_region_dispatch_write1(MemoryRegion *mr,
+                                                 hwaddr addr,
+                                                 uint64_t data,
+                                                 unsigned size,
+                                                 MemTxAttrs attrs)
+{
+    if (mr->ops->write) {
+        return access_with_adjusted_size(addr, &data, size,
+                                         mr->ops->impl.min_access_size,
+                                         mr->ops->impl.max_access_size,
+                                         memory_region_write_accessor, mr,
+                                         attrs);
+    } else {
+        return
+            access_with_adjusted_size(addr, &data, size,
+                                      mr->ops->impl.min_access_size,
+                                      mr->ops->impl.max_access_size,
+                                      memory_region_write_with_attrs_accessor,
+                                      mr, attrs);
+    }
+}
+
 MemTxResult memory_region_dispatch_write(MemoryRegion *mr,
                                          hwaddr addr,
                                          uint64_t data,
@@ -1487,6 +1656,7 @@ MemTxResult memory_region_dispatch_write(MemoryRegion *mr,
                                          MemTxAttrs attrs)
 {
     unsigned size = memop_size(op);
+    MemTxResult r;
 
     if (!memory_region_access_valid(mr, addr, size, true, attrs)) {
         unassigned_mem_write(mr, addr, data, size);
@@ -1495,25 +1665,20 @@ MemTxResult memory_region_dispatch_write(MemoryRegion *mr,
 
     adjust_endianness(mr, &data, op);
 
+    if (!mr->global_locking) {
+        bool locked = qemu_mutex_iothread_locked();
+
+        r = memory_region_dispatch_write1(mr, addr, data, size, attrs);
+        memory_region_check_lockless(mr, locked);
+        return r;
+    }
+
     if ((!kvm_eventfds_enabled()) &&
         memory_region_dispatch_write_eventfds(mr, addr, data, size, attrs)) {
         return MEMTX_OK;
     }
 
-    if (mr->ops->write) {
-        return access_with_adjusted_size(addr, &data, size,
-                                         mr->ops->impl.min_access_size,
-                                         mr->ops->impl.max_access_size,
-                                         memory_region_write_accessor, mr,
-                                         attrs);
-    } else {
-        return
-            access_with_adjusted_size(addr, &data, size,
-                                      mr->ops->impl.min_access_size,
-                                      mr->ops->impl.max_access_size,
-                                      memory_region_write_with_attrs_accessor,
-                                      mr, attrs);
-    }
+    return memory_region_dispatch_write1(mr, addr, data, size, attrs);
 }
 
 void memory_region_init_io(MemoryRegion *mr,
@@ -1678,6 +1843,7 @@ void memory_region_init_alias(MemoryRegion *mr,
     memory_region_init(mr, owner, name, size);
     mr->alias = orig;
     mr->alias_offset = offset;
+    QTAILQ_INSERT_TAIL(&orig->alias_users, mr, alias_users_link);
 }
 
 void memory_region_init_rom_nomigrate(MemoryRegion *mr,
@@ -1753,6 +1919,15 @@ static void memory_region_finalize(Object *obj)
     }
     memory_region_transaction_commit();
 
+    if (mr->alias && QTAILQ_IN_USE(mr, alias_users_link)) {
+        QTAILQ_REMOVE(&mr->alias->alias_users, mr, alias_users_link);
+    }
+    /* Aliases that outlive their target are not visible either */
+    while (!QTAILQ_EMPTY(&mr->alias_users)) {
+        MemoryRegion *alias = QTAILQ_FIRST(&mr->alias_users);
+        QTAILQ_REMOVE(&mr->alias_users, alias, alias_users_link);
+    }
+
     mr->destructor(mr);
     memory_region_clear_coalescing(mr);
     g_free((char *)mr->name);
@@ -1816,8 +1991,8 @@ uint8_t memory_region_get_dirty_log_mask(MemoryRegion *mr)
     uint8_t mask = mr->dirty_log_mask;
     RAMBlock *rb = mr->ram_block;
 
-    if (global_dirty_log && ((rb && qemu_ram_is_migratable(rb)) ||
-                             memory_region_is_iommu(mr))) {
+    if (global_dirty_tracking && ((rb && qemu_ram_is_migratable(rb)) ||
+                                  memory_region_is_iommu(mr))) {
         mask |= (1 << DIRTY_MEMORY_MIGRATION);
     }
 
@@ -2031,6 +2206,200 @@ int memory_region_iommu_num_indexes(IOMMUMemoryRegion *iommu_mr)
     return imrc->num_indexes(iommu_mr);
 }
 
+/* Must be a power of 2 */
+#define IOMMU_TLB_CACHE_SIZE        64
+#define IOMMU_TLB_CACHE_PAGE_BITS   12
+
+typedef struct IOMMUTLBCacheEntry {
+    hwaddr iova;
+    hwaddr translated_addr;
+    hwaddr addr_mask;
+    AddressSpace *target_as;
+    /* IOMMU_NONE for unused entries */
+    IOMMUAccessFlags perm;
+    int iommu_idx;
+} IOMMUTLBCacheEntry;
+
+typedef struct IOMMUTLBCacheNotifier {
+    IOMMUNotifier n;
+    IOMMUTLBCache *cache;
+} IOMMUTLBCacheNotifier;
+
+struct IOMMUTLBCache {
+    /* Lookups run without the BQL, e.g. for dataplane devices */
+    QemuSpin lock;
+    /*
+     * Bumped by every invalidation, so that a translation that raced
+     * with one is not inserted.
+     */
+    uint64_t gen;
+    int num_notifiers;
+    IOMMUTLBCacheNotifier *notifiers;
+    IOMMUTLBCacheEntry entries[IOMMU_TLB_CACHE_SIZE];
+};
+
+static inline IOMMUTLBCacheEntry *iommu_tlb_cache_entry(IOMMUTLBCache *cache,
+                                                        hwaddr addr)
+{
+    return &cache->entries[(addr >> IOMMU_TLB_CACHE_PAGE_BITS) &
+                           (IOMMU_TLB_CACHE_SIZE - 1)];
+}
+
+static void iommu_tlb_cache_unmap_notify(IOMMUNotifier *n,
+                                         IOMMUTLBEntry *iotlb)
+{
+    IOMMUTLBCacheNotifier *cn = container_of(n, IOMMUTLBCacheNotifier, n);
+    IOMMUTLBCache *cache = cn->cache;
+    hwaddr end = iotlb->iova + iotlb->addr_mask;
+    int i;
+
+    qemu_spin_lock(&cache->lock);
+    cache->gen++;
+    for (i = 0; i < IOMMU_TLB_CACHE_SIZE; i++) {
+        IOMMUTLBCacheEntry *e = &cache->entries[i];
+
+        if (e->perm != IOMMU_NONE && e->iommu_idx == n->iommu_idx &&
+            e->iova <= end && e->iova + e->addr_mask >= iotlb->iova) {
+            e->perm = IOMMU_NONE;
+        }
+    }
+    qemu_spin_unlock(&cache->lock);
+}
+
+int memory_region_iommu_enable_iotlb_cache(IOMMUMemoryRegion *iommu_mr,
+                                           Error **errp)
+{
+    MemoryRegion *mr = MEMORY_REGION(iommu_mr);
+    IOMMUTLBCache *cache;
+    int i, ret;
+
+    assert(!iommu_mr->iotlb_cache);
+
+    cache = g_new0(IOMMUTLBCache, 1);
+    qemu_spin_init(&cache->lock);
+    cache->num_notifiers = memory_region_iommu_num_indexes(iommu_mr);
+    cache->notifiers = g_new0(IOMMUTLBCacheNotifier, cache->num_notifiers);
+
+    for (i = 0; i < cache->num_notifiers; i++) {
+        IOMMUTLBCacheNotifier *cn = &cache->notifiers[i];
+
+        cn->cache = cache;
+        iommu_notifier_init(&cn->n, iommu_tlb_cache_unmap_notify,
+                            IOMMU_NOTIFIER_UNMAP, 0, HWADDR_MAX, i);
+        ret = memory_region_register_iommu_notifier(mr, &cn->n, errp);
+        if (ret) {
+            while (i-- > 0) {
+                memory_region_unregister_iommu_notifier(mr,
+                                                        &cache->notifiers[i].n);
+            }
+            g_free(cache->notifiers);
+            g_free(cache);
+            return ret;
+        }
+    }
+
+    qatomic_set(&iommu_mr->iotlb_cache, cache);
+    return 0;
+}
+
+void memory_region_iommu_flush_iotlb_cache(IOMMUMemoryRegion *iommu_mr)
+{
+    IOMMUTLBCache *cache = iommu_mr->iotlb_cache;
+    int i;
+
+    if (!cache) {
+        return;
+    }
+
+    qemu_spin_lock(&cache->lock);
+    cache->gen++;
+    for (i = 0; i < IOMMU_TLB_CACHE_SIZE; i++) {
+        cache->entries[i].perm = IOMMU_NONE;
+    }
+    qemu_spin_unlock(&cache->lock);
+}
+
+/*
+ * Look up the translation of @addr.  On a miss, @gen is set to the value
+ * that memory_region_iommu_insert_iotlb() expects for the result of the
+ * translate() callback.
+ */
+bool memory_region_iommu_lookup_iotlb(IOMMUMemoryRegion *iommu_mr,
+                                      hwaddr addr, int iommu_idx,
+                                      bool is_write, IOMMUTLBEntry *iotlb,
+                                      uint64_t *gen)
+{
+    IOMMUTLBCache *cache = qatomic_read(&iommu_mr->iotlb_cache);
+    IOMMUTLBCacheEntry *e;
+    bool hit;
+
+    if (!cache) {
+        return false;
+    }
+
+    e = iommu_tlb_cache_entry(cache, addr);
+    qemu_spin_lock(&cache->lock);
+    hit = (e->perm & (1 << is_write)) && e->iommu_idx == iommu_idx &&
+          (addr & ~e->addr_mask) == e->iova;
+    if (hit) {
+        *iotlb = (IOMMUTLBEntry) {
+            .target_as = e->target_as,
+            .iova = e->iova,
+            .translated_addr = e->translated_addr,
+            .addr_mask = e->addr_mask,
+            .perm = e->perm,
+        };
+    } else {
+        *gen = cache->gen;
+    }
+    qemu_spin_unlock(&cache->lock);
+    return hit;
+}
+
+void memory_region_iommu_insert_iotlb(IOMMUMemoryRegion *iommu_mr,
+                                      hwaddr addr, int iommu_idx,
+                                      const IOMMUTLBEntry *iotlb,
+                                      uint64_t gen)
+{
+    IOMMUTLBCache *cache = qatomic_read(&iommu_mr->iotlb_cache);
+    IOMMUTLBCacheEntry *e;
+
+    if (!cache || iotlb->perm == IOMMU_NONE) {
+        return;
+    }
+
+    e = iommu_tlb_cache_entry(cache, addr);
+    qemu_spin_lock(&cache->lock);
+    /* Do not resurrect a translation that was invalidated meanwhile */
+    if (cache->gen == gen) {
+        e->iova = addr & ~iotlb->addr_mask;
+        e->translated_addr = iotlb->translated_addr & ~iotlb->addr_mask;
+        e->addr_mask = iotlb->addr_mask;
+        e->target_as = iotlb->target_as;
+        e->perm = iotlb->perm;
+        e->iommu_idx = iommu_idx;
+    }
+    qemu_spin_unlock(&cache->lock);
+}
+
+static void iommu_memory_region_finalize(Object *obj)
+{
+    IOMMUMemoryRegion *iommu_mr = IOMMU_MEMORY_REGION(obj);
+    IOMMUTLBCache *cache = iommu_mr->iotlb_cache;
+    int i;
+
+    if (!cache) {
+        return;
+    }
+
+    for (i = 0; i < cache->num_notifiers; i++) {
+        memory_region_unregister_iommu_notifier(MEMORY_REGION(iommu_mr),
+                                                &cache->notifiers[i].n);
+    }
+    g_free(cache->notifiers);
+    g_free(cache);
+}
+
 RamDiscardManager *memory_region_get_ram_discard_manager(MemoryRegion *mr)
 {
     if (!memory_region_is_mapped(mr) || !memory_region_is_ram(mr)) {
@@ -2109,7 +2478,9 @@ void memory_region_set_log(MemoryRegion *mr, bool log, unsigned client)
 
     memory_region_transaction_begin();
     mr->dirty_log_mask = (mr->dirty_log_mask & ~mask) | (log * mask);
-    memory_region_update_pending |= mr->enabled;
+    if (mr->enabled) {
+        memory_region_update_topology(mr);
+    }
     memory_region_transaction_commit();
 }
 
@@ -2237,7 +2608,9 @@ void memory_region_set_readonly(MemoryRegion *mr, bool readonly)
     if (mr->readonly != readonly) {
         memory_region_transaction_begin();
         mr->readonly = readonly;
-        memory_region_update_pending |= mr->enabled;
+        if (mr->enabled) {
+            memory_region_update_topology(mr);
+        }
         memory_region_transaction_commit();
     }
 }
@@ -2247,7 +2620,9 @@ void memory_region_set_nonvolatile(MemoryRegion *mr, bool nonvolatile)
     if (mr->nonvolatile != nonvolatile) {
         memory_region_transaction_begin();
         mr->nonvolatile = nonvolatile;
-        memory_region_update_pending |= mr->enabled;
+        if (mr->enabled) {
+            memory_region_update_topology(mr);
+        }
         memory_region_transaction_commit();
     }
 }
@@ -2257,7 +2632,9 @@ void memory_region_rom_device_set_romd(MemoryRegion *mr, bool romd_mode)
     if (mr->romd_mode != romd_mode) {
         memory_region_transaction_begin();
         mr->romd_mode = romd_mode;
-        memory_region_update_pending |= mr->enabled;
+        if (mr->enabled) {
+            memory_region_update_topology(mr);
+        }
         memory_region_transaction_commit();
     }
 }
@@ -2414,6 +2791,11 @@ void memory_region_clear_flush_coalesced(MemoryRegion *mr)
     }
 }
 
+void memory_region_clear_global_locking(MemoryRegion *mr)
+{
+    mr->global_locking = false;
+}
+
 static bool userspace_eventfd_warning;
 
 void memory_region_add_eventfd(MemoryRegion *mr,
@@ -2454,7 +2836,9 @@ void memory_region_add_eventfd(MemoryRegion *mr,
     memmove(&mr->ioeventfds[i+1], &mr->ioeventfds[i],
             sizeof(*mr->ioeventfds) * (mr->ioeventfd_nb-1 - i));
     mr->ioeventfds[i] = mrfd;
-    ioeventfd_update_pending |= mr->enabled;
+    if (mr->enabled) {
+        memory_region_update_ioeventfds(mr);
+    }
     memory_region_transaction_commit();
 }
 
@@ -2489,7 +2873,9 @@ void memory_region_del_eventfd(MemoryRegion *mr,
     --mr->ioeventfd_nb;
     mr->ioeventfds = g_realloc(mr->ioeventfds,
                                   sizeof(*mr->ioeventfds)*mr->ioeventfd_nb + 1);
-    ioeventfd_update_pending |= mr->enabled;
+    if (mr->enabled) {
+        memory_region_update_ioeventfds(mr);
+    }
     memory_region_transaction_commit();
 }
 
@@ -2509,7 +2895,9 @@ static void memory_region_update_container_subregions(MemoryRegion *subregion)
     }
     QTAILQ_INSERT_TAIL(&mr->subregions, subregion, subregions_link);
 done:
-    memory_region_update_pending |= mr->enabled && subregion->enabled;
+    if (mr->enabled && subregion->enabled) {
+        memory_region_update_topology(mr);
+    }
     memory_region_transaction_commit();
 }
 
@@ -2548,7 +2936,9 @@ void memory_region_del_subregion(MemoryRegion *mr,
     subregion->container = NULL;
     QTAILQ_REMOVE(&mr->subregions, subregion, subregions_link);
     memory_region_unref(subregion);
-    memory_region_update_pending |= mr->enabled && subregion->enabled;
+    if (mr->enabled && subregion->enabled) {
+        memory_region_update_topology(mr);
+    }
     memory_region_transaction_commit();
 }
 
@@ -2559,7 +2949,7 @@ void memory_region_set_enabled(MemoryRegion *mr, bool enabled)
     }
     memory_region_transaction_begin();
     mr->enabled = enabled;
-    memory_region_update_pending = true;
+    memory_region_update_topology(mr);
     memory_region_transaction_commit();
 }
 
@@ -2575,7 +2965,7 @@ void memory_region_set_size(MemoryRegion *mr, uint64_t size)
     }
     memory_region_transaction_begin();
     mr->size = s;
-    memory_region_update_pending = true;
+    memory_region_update_topology(mr);
     memory_region_transaction_commit();
 }
 
@@ -2612,7 +3002,9 @@ void memory_region_set_alias_offset(MemoryRegion *mr, hwaddr offset)
 
     memory_region_transaction_begin();
     mr->alias_offset = offset;
-    memory_region_update_pending |= mr->enabled;
+    if (mr->enabled) {
+        memory_region_update_topology(mr);
+    }
     memory_region_transaction_commit();
 }
 
@@ -2752,61 +3144,97 @@ void memory_global_after_dirty_log_sync(void)
 }
 
 static VMChangeStateEntry *vmstate_change;
+/* Flags whose stop was postponed until the VM runs again */
+static unsigned int postponed_stop_flags;
 
-void memory_global_dirty_log_start(void)
+static void memory_global_dirty_log_do_stop(unsigned int flags)
 {
-    if (vmstate_change) {
-        qemu_del_vm_change_state_handler(vmstate_change);
-        vmstate_change = NULL;
+    assert(flags && !(flags & (~GLOBAL_DIRTY_MASK)));
+    assert((global_dirty_tracking & flags) == flags);
+    global_dirty_tracking &= ~flags;
+
+    trace_global_dirty_changed(global_dirty_tracking);
+
+    if (!global_dirty_tracking) {
+        /* Refresh DIRTY_MEMORY_MIGRATION bit.  */
+        memory_region_transaction_begin();
+        flatviews_stale = true;
+        memory_region_update_pending = true;
+        memory_region_transaction_commit();
+
+        MEMORY_LISTENER_CALL_GLOBAL(log_global_stop, Reverse);
     }
+}
 
-    global_dirty_log = true;
+static void memory_global_dirty_log_stop_postponed_run(void)
+{
+    assert(vmstate_change);
 
-    MEMORY_LISTENER_CALL_GLOBAL(log_global_start, Forward);
+    if (postponed_stop_flags) {
+        memory_global_dirty_log_do_stop(postponed_stop_flags);
+        postponed_stop_flags = 0;
+    }
 
-    /* Refresh DIRTY_MEMORY_MIGRATION bit.  */
-    memory_region_transaction_begin();
-    memory_region_update_pending = true;
-    memory_region_transaction_commit();
+    qemu_del_vm_change_state_handler(vmstate_change);
+    vmstate_change = NULL;
 }
 
-static void memory_global_dirty_log_do_stop(void)
+void memory_global_dirty_log_start(unsigned int flags)
 {
-    global_dirty_log = false;
+    unsigned int old_flags;
 
-    /* Refresh DIRTY_MEMORY_MIGRATION bit.  */
-    memory_region_transaction_begin();
-    memory_region_update_pending = true;
-    memory_region_transaction_commit();
+    assert(flags && !(flags & (~GLOBAL_DIRTY_MASK)));
+
+    if (vmstate_change) {
+        /* A postponed stop of these flags is simply cancelled */
+        postponed_stop_flags &= ~flags;
+        memory_global_dirty_log_stop_postponed_run();
+    }
+
+    flags &= ~global_dirty_tracking;
+    if (!flags) {
+        return;
+    }
+
+    old_flags = global_dirty_tracking;
+    global_dirty_tracking |= flags;
+    trace_global_dirty_changed(global_dirty_tracking);
 
-    MEMORY_LISTENER_CALL_GLOBAL(log_global_stop, Reverse);
+    if (!old_flags) {
+        MEMORY_LISTENER_CALL_GLOBAL(log_global_start, Forward);
+
+        /* Refresh DIRTY_MEMORY_MIGRATION bit.  */
+        memory_region_transaction_begin();
+        flatviews_stale = true;
+        memory_region_update_pending = true;
+        memory_region_transaction_commit();
+    }
 }
 
 static void memory_vm_change_state_handler(void *opaque, bool running,
                                            RunState state)
 {
     if (running) {
-        memory_global_dirty_log_do_stop();
-
-        if (vmstate_change) {
-            qemu_del_vm_change_state_handler(vmstate_change);
-            vmstate_change = NULL;
-        }
+        memory_global_dirty_log_stop_postponed_run();
     }
 }
 
-void memory_global_dirty_log_stop(void)
+void memory_global_dirty_log_stop(unsigned int flags)
 {
     if (!runstate_is_running()) {
+        /* Postpone the dirty log stop, e.g., to when VM starts again */
         if (vmstate_change) {
-            return;
+            /* Batch with previous postponed flags */
+            postponed_stop_flags |= flags;
+        } else {
+            postponed_stop_flags = flags;
+            vmstate_change = qemu_add_vm_change_state_handler(
+                                    memory_vm_change_state_handler, NULL);
         }
-        vmstate_change = qemu_add_vm_change_state_handler(
-                                memory_vm_change_state_handler, NULL);
         return;
     }
 
-    memory_global_dirty_log_do_stop();
+    memory_global_dirty_log_do_stop(flags);
 }
 
 static void listener_add_address_space(MemoryListener *listener,
@@ -2818,7 +3246,7 @@ static void listener_add_address_space(MemoryListener *listener,
     if (listener->begin) {
         listener->begin(listener);
     }
-    if (global_dirty_log) {
+    if (global_dirty_tracking) {
         if (listener->log_global_start) {
             listener->log_global_start(listener);
         }
@@ -3246,6 +3674,19 @@ static gboolean mtree_info_flatview_free(gpointer key, gpointer value,
     return true;
 }
 
+static void mtree_print_commit_stats(void)
+{
+    qemu_printf("topology commits: %" PRIu64 ", FlatViews rendered: %" PRIu64
+                ", address spaces updated: %" PRIu64 "\n",
+                commit_stats.commits, commit_stats.rendered,
+                commit_stats.updated);
+    qemu_printf("commit latency: last %" PRId64 " ns, avg %" PRId64
+                " ns, max %" PRId64 " ns\n", commit_stats.last_ns,
+                commit_stats.commits ?
+                commit_stats.total_ns / (int64_t)commit_stats.commits : 0,
+                commit_stats.max_ns);
+}
+
 void mtree_info(bool flatview, bool dispatch_tree, bool owner, bool disabled)
 {
     MemoryRegionListHead ml_head;
@@ -3287,6 +3728,7 @@ void mtree_info(bool flatview, bool dispatch_tree, bool owner, bool disabled)
         g_hash_table_foreach_remove(views, mtree_info_flatview_free, 0);
         g_hash_table_unref(views);
 
+        mtree_print_commit_stats();
         return;
     }
 
@@ -3308,6 +3750,8 @@ void mtree_info(bool flatview, bool dispatch_tree, bool owner, bool disabled)
     QTAILQ_FOREACH_SAFE(ml, &ml_head, mrqueue, ml2) {
         g_free(ml);
     }
+
+    mtree_print_commit_stats();
 }
 
 void memory_region_init_ram(MemoryRegion *mr,
@@ -3412,6 +3856,7 @@ static const TypeInfo iommu_memory_region_info = {
     .class_size         = sizeof(IOMMUMemoryRegionClass),
     .instance_size      = sizeof(IOMMUMemoryRegion),
     .instance_init      = iommu_memory_region_initfn,
+    .instance_finalize  = iommu_memory_region_finalize,
     .abstract           = true,
 };
 
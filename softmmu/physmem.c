@@ -424,13 +424,19 @@ static MemoryRegionSection address_space_translate_iommu(IOMMUMemoryRegion *iomm
         IOMMUMemoryRegionClass *imrc = memory_region_get_iommu_class_nocheck(iommu_mr);
         int iommu_idx = 0;
         IOMMUTLBEntry iotlb;
+        uint64_t gen = 0;
 
         if (imrc->attrs_to_index) {
             iommu_idx = imrc->attrs_to_index(iommu_mr, attrs);
         }
 
-        iotlb = imrc->translate(iommu_mr, addr, is_write ?
-                                IOMMU_WO : IOMMU_RO, iommu_idx);
+        if (!memory_region_iommu_lookup_iotlb(iommu_mr, addr, iommu_idx,
+                                              is_write, &iotlb, &gen)) {
+            iotlb = imrc->translate(iommu_mr, addr, is_write ?
+                                    IOMMU_WO : IOMMU_RO, iommu_idx);
+            memory_region_iommu_insert_iotlb(iommu_mr, addr, iommu_idx,
+                                             &iotlb, gen);
+        }
 
         if (!(iotlb.perm & (1 << is_write))) {
             goto unassigned;
@@ -1020,18 +1026,22 @@ static void tlb_reset_dirty_range_all(ram_addr_t start, ram_addr_t length)
 }
 
 /* Note: start and end must be within the same ram block.  */
-bool cpu_physical_memory_test_and_clear_dirty(ram_addr_t start,
-                                              ram_addr_t length,
-                                              unsigned client)
+/*
+ * Clear the dirty bits of a range; returns the number of dirty pages if
+ * @count, otherwise non-zero if any page was dirty.
+ */
+static uint64_t physical_memory_clear_dirty(ram_addr_t start,
+                                            ram_addr_t length,
+                                            unsigned client, bool count)
 {
     DirtyMemoryBlocks *blocks;
     unsigned long end, page, start_page;
-    bool dirty = false;
+    uint64_t dirty = 0;
     RAMBlock *ramblock;
     uint64_t mr_offset, mr_size;
 
     if (length == 0) {
-        return false;
+        return 0;
     }
 
     end = TARGET_PAGE_ALIGN(start + length) >> TARGET_PAGE_BITS;
@@ -1051,8 +1061,13 @@ bool cpu_physical_memory_test_and_clear_dirty(ram_addr_t start,
             unsigned long num = MIN(end - page,
                                     DIRTY_MEMORY_BLOCK_SIZE - offset);
 
-            dirty |= bitmap_test_and_clear_atomic(blocks->blocks[idx],
-                                                  offset, num);
+            if (count) {
+                dirty += bitmap_count_and_clear_atomic(blocks->blocks[idx],
+                                                       offset, num);
+            } else {
+                dirty |= bitmap_test_and_clear_atomic(blocks->blocks[idx],
+                                                      offset, num);
+            }
             page += num;
         }
 
@@ -1068,6 +1083,20 @@ bool cpu_physical_memory_test_and_clear_dirty(ram_addr_t start,
     return dirty;
 }
 
+bool cpu_physical_memory_test_and_clear_dirty(ram_addr_t start,
+                                              ram_addr_t length,
+                                              unsigned client)
+{
+    return physical_memory_clear_dirty(start, length, client, false) != 0;
+}
+
+uint64_t cpu_physical_memory_count_and_clear_dirty(ram_addr_t start,
+                                                   ram_addr_t length,
+                                                   unsigned client)
+{
+    return physical_memory_clear_dirty(start, length, client, true);
+}
+
 DirtyBitmapSnapshot *cpu_physical_memory_snapshot_and_clear_dirty
     (MemoryRegion *mr, hwaddr offset, hwaddr length, unsigned client)
 {
@@ -2746,7 +2775,9 @@ static bool prepare_mmio_access(MemoryRegion *mr)
 {
     bool release_lock = false;
 
-    if (!qemu_mutex_iothread_locked()) {
+    /* Regions without global locking protect themselves */
+    if (!qemu_mutex_iothread_locked() &&
+        (mr->global_locking || mr->flush_coalesced_mmio)) {
         qemu_mutex_lock_iothread();
         release_lock = true;
     }
@@ -3324,6 +3355,40 @@ void address_space_cache_invalidate(MemoryRegionCache *cache,
     }
 }
 
+bool address_space_cache_slice(MemoryRegionCache *slice,
+                               MemoryRegionCache *cache,
+                               hwaddr addr,
+                               hwaddr len)
+{
+    if (!cache->ptr || xen_enabled() ||
+        addr >= cache->len || len > cache->len - addr) {
+        return false;
+    }
+
+    *slice = *cache;
+    slice->ptr += addr;
+    slice->xlat += addr;
+    slice->len = len;
+    memory_region_ref(slice->mrs.mr);
+    flatview_ref(slice->fv);
+    return true;
+}
+
+void *address_space_map_cached(MemoryRegionCache *cache,
+                               hwaddr addr,
+                               hwaddr len,
+                               bool is_write)
+{
+    if (!cache->ptr || xen_enabled() || (is_write && !cache->is_write) ||
+        addr >= cache->len || len > cache->len - addr) {
+        return NULL;
+    }
+
+    /* Dropped by address_space_unmap() */
+    memory_region_ref(cache->mrs.mr);
+    return cache->ptr + addr;
+}
+
 void address_space_cache_destroy(MemoryRegionCache *cache)
 {
     if (!cache->mrs.mr) {
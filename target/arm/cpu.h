@@ -1321,6 +1321,8 @@ void pmu_init(ARMCPU *cpu);
 #define TTBCR_SH1    (1U << 28)
 #define TTBCR_EAE    (1U << 31)
 
+#define TCR_AS       (1ULL << 36) /* AArch64 only: 16 bit ASIDs */
+
 /* Bit definitions for ARMv8 SPSR (PSTATE) format.
  * Only these are valid when in AArch64 mode; in
  * AArch32 mode SPSRs are basically CPSR-format.
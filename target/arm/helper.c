@@ -4001,6 +4001,27 @@ static void vmsa_ttbcr_reset(CPUARMState *env, const ARMCPRegInfo *ri)
     tcr->base_mask = 0xffffc000u;
 }
 
+/*
+ * Tell the TLB which ASID the EL1&0 regime of an AArch64 EL1 uses, so
+ * that a context switch keeps the TLB entries of the other ASIDs.  The
+ * registers are shared by the Secure and Non-secure EL1&0 regimes.
+ */
+static void vmsa_el10_set_asid(CPUARMState *env)
+{
+    uint64_t tcr = env->cp15.tcr_el[1].raw_tcr;
+    uint64_t ttbr = tcr & TTBCR_A1 ? env->cp15.ttbr1_el[1]
+                                   : env->cp15.ttbr0_el[1];
+    uint16_t asid = extract64(ttbr, 48, tcr & TCR_AS ? 16 : 8);
+
+    tlb_set_asid_by_mmuidx(env_cpu(env),
+                           ARMMMUIdxBit_E10_1 |
+                           ARMMMUIdxBit_E10_1_PAN |
+                           ARMMMUIdxBit_E10_0 |
+                           ARMMMUIdxBit_SE10_1 |
+                           ARMMMUIdxBit_SE10_1_PAN |
+                           ARMMMUIdxBit_SE10_0, asid);
+}
+
 static void vmsa_tcr_el12_write(CPUARMState *env, const ARMCPRegInfo *ri,
                                uint64_t value)
 {
@@ -4010,11 +4031,22 @@ static void vmsa_tcr_el12_write(CPUARMState *env, const ARMCPRegInfo *ri,
     /* For AArch64 the A1 bit could result in a change of ASID, so TLB flush. */
     tlb_flush(CPU(cpu));
     tcr->raw_tcr = value;
+    if (tcg_enabled() && arm_el_is_aa64(env, 1)) {
+        vmsa_el10_set_asid(env);
+    }
 }
 
 static void vmsa_ttbr_write(CPUARMState *env, const ARMCPRegInfo *ri,
                             uint64_t value)
 {
+    /* The TCG TLB entries of AArch64 EL1 are tagged with the ASID. */
+    if (tcg_enabled() && ri->state == ARM_CP_STATE_AA64 &&
+        arm_el_is_aa64(env, 1)) {
+        raw_write(env, ri, value);
+        vmsa_el10_set_asid(env);
+        return;
+    }
+
     /* If the ASID changes (with a 64-bit write), we must flush the TLB.  */
     if (cpreg_field_is_64bit(ri) &&
         extract64(raw_read(env, ri) ^ value, 48, 16) != 0) {
@@ -4101,13 +4133,15 @@ static const ARMCPRegInfo vmsa_cp_reginfo[] = {
     { .name = "TTBR0_EL1", .state = ARM_CP_STATE_BOTH,
       .opc0 = 3, .opc1 = 0, .crn = 2, .crm = 0, .opc2 = 0,
       .access = PL1_RW, .accessfn = access_tvm_trvm,
-      .writefn = vmsa_ttbr_write, .resetvalue = 0,
+      .writefn = vmsa_ttbr_write, .raw_writefn = raw_write,
+      .resetvalue = 0,
       .bank_fieldoffsets = { offsetof(CPUARMState, cp15.ttbr0_s),
                              offsetof(CPUARMState, cp15.ttbr0_ns) } },
     { .name = "TTBR1_EL1", .state = ARM_CP_STATE_BOTH,
       .opc0 = 3, .opc1 = 0, .crn = 2, .crm = 0, .opc2 = 1,
       .access = PL1_RW, .accessfn = access_tvm_trvm,
-      .writefn = vmsa_ttbr_write, .resetvalue = 0,
+      .writefn = vmsa_ttbr_write, .raw_writefn = raw_write,
+      .resetvalue = 0,
       .bank_fieldoffsets = { offsetof(CPUARMState, cp15.ttbr1_s),
                              offsetof(CPUARMState, cp15.ttbr1_ns) } },
     { .name = "TCR_EL1", .state = ARM_CP_STATE_AA64,
@@ -4607,6 +4641,34 @@ static void tlbi_aa64_vmalle1_write(CPUARMState *env, const ARMCPRegInfo *ri,
     }
 }
 
+static void tlbi_aa64_aside1_write(CPUARMState *env, const ARMCPRegInfo *ri,
+                                   uint64_t value)
+{
+    /*
+     * Invalidate by ASID, EL1&0.  The global entries stay, and so do
+     * those of other ASIDs.
+     */
+    CPUState *cs = env_cpu(env);
+    int mask = vae1_tlbmask(env);
+    uint16_t asid = extract64(value, 48, 16);
+
+    if (tlb_force_broadcast(env)) {
+        tlb_flush_asid_by_mmuidx_all_cpus_synced(cs, mask, asid);
+    } else {
+        tlb_flush_asid_by_mmuidx(cs, mask, asid);
+    }
+}
+
+static void tlbi_aa64_aside1is_write(CPUARMState *env, const ARMCPRegInfo *ri,
+                                     uint64_t value)
+{
+    CPUState *cs = env_cpu(env);
+    int mask = vae1_tlbmask(env);
+    uint16_t asid = extract64(value, 48, 16);
+
+    tlb_flush_asid_by_mmuidx_all_cpus_synced(cs, mask, asid);
+}
+
 static int alle1_tlbmask(CPUARMState *env)
 {
     /*
@@ -5152,7 +5214,7 @@ static const ARMCPRegInfo v8_cp_reginfo[] = {
     { .name = "TLBI_ASIDE1IS", .state = ARM_CP_STATE_AA64,
       .opc0 = 1, .opc1 = 0, .crn = 8, .crm = 3, .opc2 = 2,
       .access = PL1_W, .accessfn = access_ttlb, .type = ARM_CP_NO_RAW,
-      .writefn = tlbi_aa64_vmalle1is_write },
+      .writefn = tlbi_aa64_aside1is_write },
     { .name = "TLBI_VAAE1IS", .state = ARM_CP_STATE_AA64,
       .opc0 = 1, .opc1 = 0, .crn = 8, .crm = 3, .opc2 = 3,
       .access = PL1_W, .accessfn = access_ttlb, .type = ARM_CP_NO_RAW,
@@ -5176,7 +5238,7 @@ static const ARMCPRegInfo v8_cp_reginfo[] = {
     { .name = "TLBI_ASIDE1", .state = ARM_CP_STATE_AA64,
       .opc0 = 1, .opc1 = 0, .crn = 8, .crm = 7, .opc2 = 2,
       .access = PL1_W, .accessfn = access_ttlb, .type = ARM_CP_NO_RAW,
-      .writefn = tlbi_aa64_vmalle1_write },
+      .writefn = tlbi_aa64_aside1_write },
     { .name = "TLBI_VAAE1", .state = ARM_CP_STATE_AA64,
       .opc0 = 1, .opc1 = 0, .crn = 8, .crm = 7, .opc2 = 3,
       .access = PL1_W, .accessfn = access_ttlb, .type = ARM_CP_NO_RAW,
@@ -7235,7 +7297,7 @@ static const ARMCPRegInfo tlbios_reginfo[] = {
     { .name = "TLBI_ASIDE1OS", .state = ARM_CP_STATE_AA64,
       .opc0 = 1, .opc1 = 0, .crn = 8, .crm = 1, .opc2 = 2,
       .access = PL1_W, .type = ARM_CP_NO_RAW,
-      .writefn = tlbi_aa64_vmalle1is_write },
+      .writefn = tlbi_aa64_aside1is_write },
     { .name = "TLBI_ALLE2OS", .state = ARM_CP_STATE_AA64,
       .opc0 = 1, .opc1 = 4, .crn = 8, .crm = 1, .opc2 = 0,
       .access = PL2_W, .type = ARM_CP_NO_RAW,
@@ -11563,6 +11625,39 @@ static ARMVAParameters aa32_va_parameters(CPUARMState *env, uint32_t va,
     };
 }
 
+/*
+ * Return the core MMU index whose TLB holds the page walk cache for
+ * @mmu_idx, or -1 if the walk must not use the cache.  Stage 2 is not
+ * allocated a TLB.  Like the TLB, the cache belongs to the vCPU thread,
+ * so debug walks from the gdbstub or the monitor do not use it.
+ */
+static int ptw_cache_mmu_idx(CPUState *cs, ARMMMUIdx mmu_idx)
+{
+    if (!cs->created || !qemu_cpu_is_self(cs)) {
+        return -1;
+    }
+
+    switch (mmu_idx) {
+    case ARMMMUIdx_Stage1_E0:
+        return arm_to_core_mmu_idx(ARMMMUIdx_E10_0);
+    case ARMMMUIdx_Stage1_E1:
+        return arm_to_core_mmu_idx(ARMMMUIdx_E10_1);
+    case ARMMMUIdx_Stage1_E1_PAN:
+        return arm_to_core_mmu_idx(ARMMMUIdx_E10_1_PAN);
+    case ARMMMUIdx_Stage1_SE0:
+        return arm_to_core_mmu_idx(ARMMMUIdx_SE10_0);
+    case ARMMMUIdx_Stage1_SE1:
+        return arm_to_core_mmu_idx(ARMMMUIdx_SE10_1);
+    case ARMMMUIdx_Stage1_SE1_PAN:
+        return arm_to_core_mmu_idx(ARMMMUIdx_SE10_1_PAN);
+    case ARMMMUIdx_Stage2:
+    case ARMMMUIdx_Stage2_S:
+        return -1;
+    default:
+        return arm_to_core_mmu_idx(mmu_idx);
+    }
+}
+
 /**
  * get_phys_addr_lpae: perform one stage of page table walk, LPAE format
  *
@@ -11612,6 +11707,8 @@ static bool get_phys_addr_lpae(CPUARMState *env, uint64_t address,
     uint64_t descaddrmask;
     bool aarch64 = arm_el_is_aa64(env, el);
     bool guarded = false;
+    int cache_idx = ptw_cache_mmu_idx(cs, mmu_idx);
+    uint64_t cached_table, cached_attrs;
 
     /* TODO: This code does not support shareability levels. */
     if (aarch64) {
@@ -11742,6 +11839,20 @@ static bool get_phys_addr_lpae(CPUARMState *env, uint64_t address,
      * bits at each step.
      */
     tableattrs = regime_is_secure(env, mmu_idx) ? 0 : (1 << 4);
+
+    /*
+     * The page walk cache holds the level 3 tables, together with the
+     * attributes of the table descriptors that lead to them.
+     */
+    if (cache_idx >= 0 &&
+        tlb_walk_cache_lookup(cs, address, cache_idx,
+                              &cached_table, &cached_attrs)) {
+        descaddr = cached_table;
+        tableattrs = cached_attrs;
+        level = 3;
+        indexmask = indexmask_grainsize;
+    }
+
     for (;;) {
         uint64_t descriptor;
         bool nstable;
@@ -11770,6 +11881,11 @@ static bool get_phys_addr_lpae(CPUARMState *env, uint64_t address,
             tableattrs |= extract64(descriptor, 59, 5);
             level++;
             indexmask = indexmask_grainsize;
+            if (level == 3 && cache_idx >= 0) {
+                tlb_walk_cache_insert(cs, address, cache_idx,
+                                      1ULL << (stride * 2 + 3),
+                                      descaddr, tableattrs);
+            }
             continue;
         }
         /* Block entry at level 1 or 2, or page entry at level 3.
@@ -11821,6 +11937,10 @@ static bool get_phys_addr_lpae(CPUARMState *env, uint64_t address,
         xn = extract32(attrs, 12, 1);
         pxn = extract32(attrs, 11, 1);
         *prot = get_S1prot(env, mmu_idx, aarch64, ap, ns, xn, pxn);
+        if (!extract32(attrs, 9, 1)) {
+            /* nG clear: the mapping is the same for all ASIDs */
+            *prot |= PAGE_GLOBAL;
+        }
     }
 
     fault_type = ARMFault_Permission;
@@ -12690,6 +12810,7 @@ bool get_phys_addr(CPUARMState *env, target_ulong address,
             hwaddr ipa;
             int s2_prot;
             int ret;
+            target_ulong s1_page_size;
             ARMCacheAttrs cacheattrs2 = {};
             ARMMMUIdx s2_mmu_idx;
             bool is_el0;
@@ -12705,14 +12826,20 @@ bool get_phys_addr(CPUARMState *env, target_ulong address,
 
             s2_mmu_idx = attrs->secure ? ARMMMUIdx_Stage2_S : ARMMMUIdx_Stage2;
             is_el0 = mmu_idx == ARMMMUIdx_E10_0 || mmu_idx == ARMMMUIdx_SE10_0;
+            s1_page_size = *page_size;
 
             /* S1 is done. Now do S2 translation.  */
             ret = get_phys_addr_lpae(env, ipa, access_type, s2_mmu_idx, is_el0,
                                      phys_ptr, attrs, &s2_prot,
                                      page_size, fi, &cacheattrs2);
             fi->s2addr = ipa;
-            /* Combine the S1 and S2 perms.  */
-            *prot &= s2_prot;
+            /*
+             * Combine the S1 and S2 perms.  S1 global mappings stay
+             * global, a VMID change flushes them.
+             */
+            *prot &= s2_prot | PAGE_GLOBAL;
+            /* The combined mapping is contiguous over the smaller page */
+            *page_size = MIN(*page_size, s1_page_size);
 
             /* If S2 fails, return early.  */
             if (ret) {
@@ -1,5 +1,6 @@
 #include "qemu/osdep.h"
 #include "cpu.h"
+#include "exec/exec-all.h"
 #include "qemu/error-report.h"
 #include "sysemu/kvm.h"
 #include "kvm_arm.h"
@@ -783,6 +784,11 @@ static int cpu_post_load(void *opaque, int version_id)
 
     if (!kvm_enabled()) {
         pmu_op_finish(&cpu->env);
+        /*
+         * The TTBRs may have been loaded before the TCR, and told the
+         * TLB a stale ASID.  Start over with an empty TLB.
+         */
+        tlb_flush(CPU(cpu));
     }
     arm_rebuild_hflags(&cpu->env);
 
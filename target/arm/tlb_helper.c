@@ -200,8 +200,9 @@ bool arm_cpu_tlb_fill(CPUState *cs, vaddr address, int size,
             arm_tlb_mte_tagged(&attrs) = true;
         }
 
-        tlb_set_page_with_attrs(cs, address, phys_addr, attrs,
-                                prot, mmu_idx, page_size);
+        /* Blocks and sections map the misses around them without a walk */
+        tlb_set_large_page_with_attrs(cs, address, phys_addr, attrs,
+                                      prot, mmu_idx, page_size);
         return true;
     } else if (probe) {
         return false;
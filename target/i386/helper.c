@@ -148,15 +148,35 @@ void cpu_x86_update_cr0(CPUX86State *env, uint32_t new_cr0)
         ((new_cr0 << (HF_MP_SHIFT - 1)) & (HF_MP_MASK | HF_EM_MASK | HF_TS_MASK));
 }
 
+/* The MMU indexes whose TLB entries are tagged with the PCID */
+#define X86_PCID_MMUIDX_BITS \
+    ((1 << MMU_KSMAP_IDX) | (1 << MMU_USER_IDX) | (1 << MMU_KNOSMAP_IDX))
+
 /* XXX: in legacy PAE mode, generate a GPF if reserved bits are set in
    the PDPT */
 void cpu_x86_update_cr3(CPUX86State *env, target_ulong new_cr3)
 {
+    CPUState *cs = env_cpu(env);
+    uint16_t pcid = 0;
+    bool flush = true;
+
+    /*
+     * Without PCIDs, all address spaces use PCID 0 and every CR3 write
+     * flushes the non-global TLB entries.
+     */
+    if (env->cr[4] & CR4_PCIDE_MASK) {
+        pcid = new_cr3 & CR3_PCID_MASK;
+        flush = !(new_cr3 & CR3_NOFLUSH_MASK);
+        new_cr3 &= ~CR3_NOFLUSH_MASK;
+    }
     env->cr[3] = new_cr3;
     if (env->cr[0] & CR0_PG_MASK) {
         qemu_log_mask(CPU_LOG_MMU,
                         "CR3 update: CR3=" TARGET_FMT_lx "\n", new_cr3);
-        tlb_flush(env_cpu(env));
+        if (flush) {
+            tlb_flush_asid_by_mmuidx(cs, X86_PCID_MMUIDX_BITS, pcid);
+        }
+        tlb_set_asid_by_mmuidx(cs, X86_PCID_MMUIDX_BITS, pcid);
     }
 }
 
@@ -169,7 +189,7 @@ void cpu_x86_update_cr4(CPUX86State *env, uint32_t new_cr4)
 #endif
     if ((new_cr4 ^ env->cr[4]) &
         (CR4_PGE_MASK | CR4_PAE_MASK | CR4_PSE_MASK |
-         CR4_SMEP_MASK | CR4_SMAP_MASK | CR4_LA57_MASK)) {
+         CR4_SMEP_MASK | CR4_SMAP_MASK | CR4_LA57_MASK | CR4_PCIDE_MASK)) {
         tlb_flush(env_cpu(env));
     }
 
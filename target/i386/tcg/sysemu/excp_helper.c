@@ -45,6 +45,9 @@ int get_pg_mode(CPUX86State *env)
     if (env->cr[4] & CR4_LA57_MASK) {
         pg_mode |= PG_MODE_LA57;
     }
+    if (env->cr[4] & CR4_PGE_MASK) {
+        pg_mode |= PG_MODE_PGE;
+    }
     if (env->hflags & HF_LMA_MASK) {
         pg_mode |= PG_MODE_LMA;
     }
@@ -68,7 +71,7 @@ static int mmu_translate(CPUState *cs, hwaddr addr, MMUTranslateFunc get_hphys_f
 {
     X86CPU *cpu = X86_CPU(cs);
     CPUX86State *env = &cpu->env;
-    uint64_t ptep, pte;
+    uint64_t ptep, pte, pt_addr;
     int32_t a20_mask;
     target_ulong pde_addr, pte_addr;
     int error_code = 0;
@@ -76,6 +79,12 @@ static int mmu_translate(CPUState *cs, hwaddr addr, MMUTranslateFunc get_hphys_f
     uint64_t rsvd_mask = PG_ADDRESS_MASK & ~MAKE_64BIT_MASK(0, cpu->phys_bits);
     uint32_t page_offset;
     uint32_t pkr;
+    bool global;
+    /*
+     * Walks of the nested page tables are not cached.  Like the TLB, the
+     * cache belongs to the vCPU thread.
+     */
+    bool walk_cache = get_hphys_func != NULL && qemu_cpu_is_self(cs);
 
     is_user = (mmu_idx == MMU_USER_IDX);
     is_write = is_write1 & 1;
@@ -89,6 +98,14 @@ static int mmu_translate(CPUState *cs, hwaddr addr, MMUTranslateFunc get_hphys_f
         uint64_t pde, pdpe;
         target_ulong pdpe_addr;
 
+        if (walk_cache &&
+            tlb_walk_cache_lookup(cs, addr, mmu_idx, &pt_addr, &ptep)) {
+            if (!(pg_mode & PG_MODE_LMA)) {
+                rsvd_mask |= PG_HI_USER_MASK;
+            }
+            goto do_pte_pae;
+        }
+
 #ifdef TARGET_X86_64
         if (env->hflags & HF_LMA_MASK) {
             bool la57 = pg_mode & PG_MODE_LA57;
@@ -203,8 +220,13 @@ static int mmu_translate(CPUState *cs, hwaddr addr, MMUTranslateFunc get_hphys_f
             pde |= PG_ACCESSED_MASK;
             x86_stl_phys_notdirty(cs, pde_addr, pde);
         }
-        pte_addr = ((pde & PG_ADDRESS_MASK) + (((addr >> 12) & 0x1ff) << 3)) &
-            a20_mask;
+        pt_addr = pde & PG_ADDRESS_MASK;
+        if (walk_cache) {
+            tlb_walk_cache_insert(cs, addr, mmu_idx, 2048 * 1024,
+                                  pt_addr, ptep);
+        }
+    do_pte_pae:
+        pte_addr = (pt_addr + (((addr >> 12) & 0x1ff) << 3)) & a20_mask;
         pte_addr = GET_HPHYS(cs, pte_addr, MMU_DATA_STORE, NULL);
         pte = x86_ldq_phys(cs, pte_addr);
         if (!(pte & PG_PRESENT_MASK)) {
@@ -219,6 +241,11 @@ static int mmu_translate(CPUState *cs, hwaddr addr, MMUTranslateFunc get_hphys_f
     } else {
         uint32_t pde;
 
+        if (walk_cache &&
+            tlb_walk_cache_lookup(cs, addr, mmu_idx, &pt_addr, &ptep)) {
+            goto do_pte_legacy;
+        }
+
         /* page directory entry */
         pde_addr = ((cr3 & ~0xfff) + ((addr >> 20) & 0xffc)) &
             a20_mask;
@@ -247,9 +274,14 @@ static int mmu_translate(CPUState *cs, hwaddr addr, MMUTranslateFunc get_hphys_f
             x86_stl_phys_notdirty(cs, pde_addr, pde);
         }
 
-        /* page directory entry */
-        pte_addr = ((pde & ~0xfff) + ((addr >> 10) & 0xffc)) &
-            a20_mask;
+        pt_addr = pde & ~0xfff;
+        if (walk_cache) {
+            tlb_walk_cache_insert(cs, addr, mmu_idx, 4096 * 1024,
+                                  pt_addr, ptep);
+        }
+    do_pte_legacy:
+        /* page table entry */
+        pte_addr = (pt_addr + ((addr >> 10) & 0xffc)) & a20_mask;
         pte_addr = GET_HPHYS(cs, pte_addr, MMU_DATA_STORE, NULL);
         pte = x86_ldl_phys(cs, pte_addr);
         if (!(pte & PG_PRESENT_MASK)) {
@@ -335,12 +367,17 @@ do_check_protect_pse36:
         *prot &= ~PAGE_WRITE;
     }
 
+    global = (pte & PG_GLOBAL_MASK) && (pg_mode & PG_MODE_PGE);
     pte = pte & a20_mask;
 
     /* align to page_size */
     pte &= PG_ADDRESS_MASK & ~(*page_size - 1);
     page_offset = addr & (*page_size - 1);
     *xlat = GET_HPHYS(cs, pte + page_offset, is_write1, prot);
+    if (global) {
+        /* Global pages survive CR3 writes, keep them across PCIDs */
+        *prot |= PAGE_GLOBAL;
+    }
     return PG_ERROR_OK;
 
  do_fault_rsvd:
@@ -429,14 +466,27 @@ static int handle_mmu_fault(CPUState *cs, vaddr addr, int size,
     }
 
     if (error_code == PG_ERROR_OK) {
-        /* Even if 4MB pages, we map only one 4KB page in the cache to
-           avoid filling it too fast */
+        /*
+         * Even if 4MB pages, we map only one 4KB page in the cache to
+         * avoid filling it too fast; the rest of a large page is filled
+         * on a miss from the large page table, without a walk.
+         */
         vaddr = addr & TARGET_PAGE_MASK;
         paddr &= TARGET_PAGE_MASK;
 
         assert(prot & (1 << is_write1));
-        tlb_set_page_with_attrs(cs, vaddr, paddr, cpu_get_mem_attrs(env),
-                                prot, mmu_idx, page_size);
+        if (env->hflags2 & HF2_NPT_MASK || x86_get_a20_mask(env) != -1) {
+            /*
+             * The nested page tables and the A20 mask can split a large
+             * page into discontiguous host pages.
+             */
+            tlb_set_page_with_attrs(cs, vaddr, paddr, cpu_get_mem_attrs(env),
+                                    prot, mmu_idx, page_size);
+        } else {
+            tlb_set_large_page_with_attrs(cs, vaddr, paddr,
+                                          cpu_get_mem_attrs(env),
+                                          prot, mmu_idx, page_size);
+        }
         return 0;
     } else {
         if (env->intercept_exceptions & (1 << EXCP0E_PAGE)) {
@@ -82,6 +82,8 @@ target_ulong helper_read_crN(CPUX86State *env, int reg)
 
 void helper_write_crN(CPUX86State *env, int reg, target_ulong t0)
 {
+    uint64_t reserved;
+
     switch (reg) {
     case 0:
         /*
@@ -96,8 +98,12 @@ void helper_write_crN(CPUX86State *env, int reg, target_ulong t0)
         cpu_x86_update_cr0(env, t0);
         break;
     case 3:
-        if ((env->efer & MSR_EFER_LMA) &&
-                (t0 & ((~0ULL) << env_archcpu(env)->phys_bits))) {
+        reserved = (~0ULL) << env_archcpu(env)->phys_bits;
+        if (env->cr[4] & CR4_PCIDE_MASK) {
+            /* Bit 63 skips the flush, see cpu_x86_update_cr3() */
+            reserved &= ~CR3_NOFLUSH_MASK;
+        }
+        if ((env->efer & MSR_EFER_LMA) && (t0 & reserved)) {
             cpu_vmexit(env, SVM_EXIT_ERR, 0, GETPC());
         }
         if (!(env->efer & MSR_EFER_LMA)) {
@@ -113,6 +119,10 @@ void helper_write_crN(CPUX86State *env, int reg, target_ulong t0)
             (env->hflags & HF_CS64_MASK)) {
             raise_exception_ra(env, EXCP0D_GPF, GETPC());
         }
+        if ((t0 & ~env->cr[4] & CR4_PCIDE_MASK) &&
+            (!(env->efer & MSR_EFER_LMA) || (env->cr[3] & CR3_PCID_MASK))) {
+            raise_exception_ra(env, EXCP0D_GPF, GETPC());
+        }
         cpu_x86_update_cr4(env, t0);
         break;
     case 8:
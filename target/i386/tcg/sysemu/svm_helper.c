@@ -275,6 +275,11 @@ void helper_vmrun(CPUX86State *env, int aflag, int next_eip_addend)
     x86_stq_phys(cs,
              env->vm_vmcb + offsetof(struct vmcb, control.exit_info_2), 0);
 
+    /*
+     * The TLB entries are not tagged with the guest ASID or the nested
+     * page table, so the PCIDs of the host and the guest cannot share it.
+     */
+    tlb_flush(cs);
     cpu_x86_update_cr0(env, new_cr0);
     cpu_x86_update_cr4(env, new_cr4);
     cpu_x86_update_cr3(env, new_cr3);
@@ -741,6 +746,8 @@ void do_vmexit(CPUX86State *env)
     env->idt.limit = x86_ldl_phys(cs, env->vm_hsave + offsetof(struct vmcb,
                                                        save.idtr.limit));
 
+    /* Like on VMRUN, drop the guest's TLB entries */
+    tlb_flush(cs);
     cpu_x86_update_cr0(env, x86_ldq_phys(cs,
                                      env->vm_hsave + offsetof(struct vmcb,
                                                               save.cr0)) |
@@ -24,8 +24,10 @@
 
 #include "qemu/osdep.h"
 #include "qemu/units.h"
+#include "qemu/rcu.h"
 #include "qapi/error.h"
 #include "exec/exec-all.h"
+#include "hw/core/cpu.h"
 #include "tcg/tcg.h"
 #include "tcg-internal.h"
 
@@ -36,11 +38,29 @@ struct tcg_region_tree {
     /* padding to avoid false sharing is computed at run-time */
 };
 
+enum {
+    TCG_REGION_FREE,    /* not assigned to any TCG context */
+    TCG_REGION_IN_USE,  /* assigned to a TCG context */
+    TCG_REGION_FULL,    /* filled up by a TCG context */
+    TCG_REGION_RETIRED, /* TBs invalidated, waiting for a grace period */
+};
+
+struct tcg_region_info {
+    int state;
+    uint64_t seq; /* order in which the regions were assigned */
+    size_t full_size; /* size of the code, once full */
+};
+
 /*
  * We divide code_gen_buffer into equally-sized "regions" that TCG threads
  * dynamically allocate from as demand dictates. Given appropriate region
  * sizing, this minimizes flushes even when some TCG threads generate a lot
  * more code than others.
+ *
+ * Once all regions have been assigned, the oldest full regions are
+ * recycled instead of flushing the whole buffer: their TBs are
+ * invalidated, and the regions are reused when no vCPU can be running
+ * them anymore.  See tcg_region_retire().
  */
 struct tcg_region_state {
     QemuMutex lock;
@@ -56,6 +76,19 @@ struct tcg_region_state {
     /* fields protected by the lock */
     size_t current; /* current region index */
     size_t agg_size_full; /* aggregate size of full regions */
+    struct tcg_region_info *info; /* per-region state */
+    uint64_t seq; /* number of region assignments */
+    size_t n_free; /* recycled regions below .current */
+    size_t n_retired; /* regions waiting for a grace period */
+    unsigned int flush_gen; /* number of tcg_region_reset_all calls */
+    size_t n_recycled; /* regions recycled since init */
+};
+
+/* A region on its way from TCG_REGION_RETIRED to TCG_REGION_FREE */
+struct tcg_region_retired {
+    struct rcu_head rcu;
+    size_t idx;
+    unsigned int flush_gen;
 };
 
 static struct tcg_region_state region;
@@ -163,10 +196,23 @@ static void tcg_region_trees_init(void)
     }
 }
 
-static struct tcg_region_tree *tc_ptr_to_region_tree(const void *p)
+/* Return the index of the region of @p, a pointer into the rw buffer */
+static size_t tcg_region_index(const void *p)
 {
-    size_t region_idx;
+    ptrdiff_t offset;
 
+    if (p < region.start_aligned) {
+        return 0;
+    }
+    offset = p - region.start_aligned;
+    if (offset > region.stride * (region.n - 1)) {
+        return region.n - 1;
+    }
+    return offset / region.stride;
+}
+
+static struct tcg_region_tree *tc_ptr_to_region_tree(const void *p)
+{
     /*
      * Like tcg_splitwx_to_rw, with no assert.  The pc may come from
      * a signal handler over which the caller has no control.
@@ -177,19 +223,7 @@ static struct tcg_region_tree *tc_ptr_to_region_tree(const void *p)
             return NULL;
         }
     }
-
-    if (p < region.start_aligned) {
-        region_idx = 0;
-    } else {
-        ptrdiff_t offset = p - region.start_aligned;
-
-        if (offset > region.stride * (region.n - 1)) {
-            region_idx = region.n - 1;
-        } else {
-            region_idx = offset / region.stride;
-        }
-    }
-    return region_trees + region_idx * tree_size;
+    return region_trees + tcg_region_index(p) * tree_size;
 }
 
 void tcg_tb_insert(TranslationBlock *tb)
@@ -283,6 +317,14 @@ size_t tcg_nb_tbs(void)
     return nb_tbs;
 }
 
+/* Call with the region tree's lock held */
+static void tcg_region_tree_reset(struct tcg_region_tree *rt)
+{
+    /* Increment the refcount first so that destroy acts as a reset */
+    g_tree_ref(rt->tree);
+    g_tree_destroy(rt->tree);
+}
+
 static void tcg_region_tree_reset_all(void)
 {
     size_t i;
@@ -291,9 +333,7 @@ static void tcg_region_tree_reset_all(void)
     for (i = 0; i < region.n; i++) {
         struct tcg_region_tree *rt = region_trees + i * tree_size;
 
-        /* Increment the refcount first so that destroy acts as a reset */
-        g_tree_ref(rt->tree);
-        g_tree_destroy(rt->tree);
+        tcg_region_tree_reset(rt);
     }
     tcg_region_tree_unlock_all();
 }
@@ -331,14 +371,147 @@ static void tcg_region_assign(TCGContext *s, size_t curr_region)
 
 static bool tcg_region_alloc__locked(TCGContext *s)
 {
-    if (region.current == region.n) {
-        return true;
+    size_t i;
+
+    if (region.current < region.n) {
+        i = region.current++;
+    } else {
+        /* Fall back to the regions that have been recycled */
+        for (i = 0; i < region.n; i++) {
+            if (region.info[i].state == TCG_REGION_FREE) {
+                break;
+            }
+        }
+        if (i == region.n) {
+            return true;
+        }
+        region.n_free--;
+    }
+    region.info[i].state = TCG_REGION_IN_USE;
+    region.info[i].seq = region.seq++;
+    tcg_region_assign(s, i);
+    return false;
+}
+
+/*
+ * Pick the oldest full region for recycling if the regions that are free,
+ * or will be soon, are running low.  Keeping an eighth of the buffer in
+ * reserve leaves time for the grace period before the TCG threads run out
+ * of regions and have to flush.
+ */
+static struct tcg_region_retired *tcg_region_retire__locked(void)
+{
+    size_t reserve = MAX(region.n / 8, 1);
+    struct tcg_region_retired *r;
+    size_t i, oldest = region.n;
+
+    if (region.n - region.current + region.n_free + region.n_retired
+        >= reserve) {
+        return NULL;
+    }
+    for (i = 0; i < region.n; i++) {
+        if (region.info[i].state == TCG_REGION_FULL &&
+            (oldest == region.n ||
+             region.info[i].seq < region.info[oldest].seq)) {
+            oldest = i;
+        }
+    }
+    if (oldest == region.n) {
+        return NULL;
+    }
+
+    region.info[oldest].state = TCG_REGION_RETIRED;
+    region.agg_size_full -= region.info[oldest].full_size;
+    region.n_retired++;
+
+    r = g_new(struct tcg_region_retired, 1);
+    r->idx = oldest;
+    r->flush_gen = region.flush_gen;
+    return r;
+}
+
+/* Second grace period over: nothing can refer to the region anymore */
+static void tcg_region_retired_free(struct tcg_region_retired *r)
+{
+    struct tcg_region_tree *rt = region_trees + r->idx * tree_size;
+
+    qemu_mutex_lock(&region.lock);
+    /* A flush in the meantime has already reset the region */
+    if (r->flush_gen == region.flush_gen) {
+        qemu_mutex_lock(&rt->lock);
+        tcg_region_tree_reset(rt);
+        qemu_mutex_unlock(&rt->lock);
+
+        region.info[r->idx].state = TCG_REGION_FREE;
+        region.n_retired--;
+        region.n_free++;
+        region.n_recycled++;
+    }
+    qemu_mutex_unlock(&region.lock);
+    g_free(r);
+}
+
+/*
+ * First grace period over: no vCPU is running the TBs of the region.
+ * A vCPU that raced with their invalidation may still have added one of
+ * them to its tb_jmp_cache, though; drop those, and wait for the vCPUs
+ * that may have read them from there.
+ */
+static void tcg_region_retired_rcu(struct tcg_region_retired *r)
+{
+    void *start, *end;
+    CPUState *cpu;
+    size_t i;
+
+    tcg_region_bounds(r->idx, &start, &end);
+    CPU_FOREACH(cpu) {
+        for (i = 0; i < TB_JMP_CACHE_SIZE; i++) {
+            TranslationBlock *tb = qatomic_read(&cpu->tb_jmp_cache[i]);
+
+            if ((void *)tb >= start && (void *)tb < end) {
+                qatomic_cmpxchg(&cpu->tb_jmp_cache[i], tb, NULL);
+            }
+        }
     }
-    tcg_region_assign(s, region.current);
-    region.current++;
+    call_rcu(r, tcg_region_retired_free, rcu);
+}
+
+static gboolean tcg_region_collect_tb(gpointer key, gpointer value,
+                                      gpointer data)
+{
+    g_ptr_array_add(data, value);
     return false;
 }
 
+/*
+ * Recycle a region without stopping the other vCPUs.  Invalidating its
+ * TBs removes them from the hash table, from the page lists and from all
+ * the jump caches and chains, so that vCPUs cannot enter them again.  The
+ * vCPUs run TBs only within the RCU read-side critical section of
+ * cpu_exec(), so a grace period later none of them is running the region
+ * anymore.  The grace period ends once every vCPU has left cpu_exec() for
+ * the main loop, which interrupts, I/O and exits do often enough; the
+ * regions that tcg_region_retire__locked() keeps free leave it that long.
+ */
+static void tcg_region_retire(struct tcg_region_retired *r)
+{
+    struct tcg_region_tree *rt = region_trees + r->idx * tree_size;
+    GPtrArray *tbs = g_ptr_array_new();
+    guint i;
+
+    /* Nobody inserts TBs into a full region; do not hold the lock below */
+    qemu_mutex_lock(&rt->lock);
+    g_tree_foreach(rt->tree, tcg_region_collect_tb, tbs);
+    qemu_mutex_unlock(&rt->lock);
+
+    for (i = 0; i < tbs->len; i++) {
+        tb_phys_invalidate(g_ptr_array_index(tbs, i), -1);
+    }
+    g_ptr_array_free(tbs, true);
+
+    call_rcu(r, tcg_region_retired_rcu, rcu);
+}
+
 /*
  * Request a new region once the one in use has filled up.
  * Returns true on error.
@@ -348,13 +521,22 @@ bool tcg_region_alloc(TCGContext *s)
     bool err;
     /* read the region size now; alloc__locked will overwrite it on success */
     size_t size_full = s->code_gen_buffer_size;
+    size_t full = tcg_region_index(s->code_gen_buffer);
+    struct tcg_region_retired *r = NULL;
 
     qemu_mutex_lock(&region.lock);
     err = tcg_region_alloc__locked(s);
     if (!err) {
         region.agg_size_full += size_full - TCG_HIGHWATER;
+        region.info[full].state = TCG_REGION_FULL;
+        region.info[full].full_size = size_full - TCG_HIGHWATER;
+        r = tcg_region_retire__locked();
     }
     qemu_mutex_unlock(&region.lock);
+
+    if (r) {
+        tcg_region_retire(r);
+    }
     return err;
 }
 
@@ -384,6 +566,13 @@ void tcg_region_reset_all(void)
     qemu_mutex_lock(&region.lock);
     region.current = 0;
     region.agg_size_full = 0;
+    region.n_free = 0;
+    region.n_retired = 0;
+    /* Regions still waiting for their grace period are reset here */
+    region.flush_gen++;
+    for (i = 0; i < region.n; i++) {
+        region.info[i].state = TCG_REGION_FREE;
+    }
 
     for (i = 0; i < n_ctxs; i++) {
         TCGContext *s = qatomic_read(&tcg_ctxs[i]);
@@ -873,6 +1062,7 @@ void tcg_region_init(size_t tb_size, int splitwx, unsigned max_cpus)
 
     /* init the region struct */
     qemu_mutex_init(&region.lock);
+    region.info = g_new0(struct tcg_region_info, region.n);
 
     /*
      * Set guard pages in the rw buffer, as that's the one into which
@@ -963,6 +1153,12 @@ size_t tcg_code_size(void)
     return total;
 }
 
+/* Returns the number of regions recycled without a flush. */
+size_t tcg_region_recycle_count(void)
+{
+    return qatomic_read(&region.n_recycled);
+}
+
 /*
  * Returns the code capacity (in bytes) of the entire cache, i.e. including all
  * regions.
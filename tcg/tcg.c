@@ -4154,6 +4154,22 @@ int64_t tcg_cpu_exec_time(void)
 }
 #endif
 
+/*
+ * Call @func with the name of the helper of each call op left in @s,
+ * e.g. after tcg_gen_code for the statistics of the translation.
+ */
+void tcg_foreach_helper_call(TCGContext *s,
+                             void (*func)(const char *name, void *opaque),
+                             void *opaque)
+{
+    TCGOp *op;
+
+    QTAILQ_FOREACH(op, &s->ops, link) {
+        if (op->opc == INDEX_op_call) {
+            func(tcg_call_info(op)->name, opaque);
+        }
+    }
+}
 
 int tcg_gen_code(TCGContext *s, TranslationBlock *tb)
 {
@@ -0,0 +1,61 @@
+/*
+ * Internet checksum speed benchmark
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "qemu/units.h"
+#include "net/checksum.h"
+
+static const size_t chunk_sizes[] = { 64, 1500, 9000, 65536 };
+
+static void test_checksum_speed(void)
+{
+    const size_t total = 1 * GiB;
+    size_t max_size = chunk_sizes[ARRAY_SIZE(chunk_sizes) - 1];
+    g_autofree uint8_t *in = g_malloc(max_size);
+    g_autofree uint8_t *out = g_malloc(max_size);
+    volatile uint32_t sum = 0;
+    size_t remain, i;
+
+    for (i = 0; i < max_size; i++) {
+        in[i] = g_test_rand_int();
+    }
+
+    for (i = 0; i < ARRAY_SIZE(chunk_sizes); i++) {
+        g_test_timer_start();
+        for (remain = total; remain >= chunk_sizes[i];
+             remain -= chunk_sizes[i]) {
+            sum += net_checksum_copy_cont(out, in, chunk_sizes[i], 0);
+        }
+        g_test_timer_elapsed();
+
+        g_test_message("copy and checksum: chunk %zu bytes %.2f ms/GB",
+                       chunk_sizes[i], g_test_timer_last() * 1000);
+    }
+
+    /* The implementations are tried from the fastest one down */
+    do {
+        for (i = 0; i < ARRAY_SIZE(chunk_sizes); i++) {
+            g_test_timer_start();
+            for (remain = total; remain >= chunk_sizes[i];
+                 remain -= chunk_sizes[i]) {
+                sum += net_checksum_add_cont(chunk_sizes[i], in, 0);
+            }
+            g_test_timer_elapsed();
+
+            g_test_message("checksum(%s): chunk %zu bytes %.2f ms/GB",
+                           net_checksum_accel_name(), chunk_sizes[i],
+                           g_test_timer_last() * 1000);
+        }
+    } while (test_net_checksum_next_accel());
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/net/benchmark/checksum", test_checksum_speed);
+
+    return g_test_run();
+}
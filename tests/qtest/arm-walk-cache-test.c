@@ -0,0 +1,123 @@
+/*
+ * QTest testcase for debug translations with the TCG page walk cache
+ *
+ * The guest changes a table descriptor without invalidating the TLB.
+ * The vCPU may keep using the old table from its walk cache, as hardware
+ * may, but a debug translation from the monitor must walk the tables as
+ * they are in memory, and must not touch the vCPU's cache at all.
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/bswap.h"
+#include "libqos/libqtest.h"
+
+/* Below the DTB, which the virt machine loads at 64 MiB into RAM */
+#define L1_TABLE        0x42000000ULL
+#define L2_TABLE        0x42001000ULL
+#define L3_TABLE_A      0x42002000ULL
+#define L3_TABLE_B      0x42003000ULL
+#define FRAME_A         0x42010000ULL
+#define FRAME_B         0x42020000ULL
+#define FLAG            0x42030000ULL
+
+#define TEST_VA         0x80000000ULL
+
+#define DESC_BLOCK      0x401ULL    /* AF, block */
+#define DESC_TABLE      3ULL
+#define DESC_PAGE       0x403ULL    /* AF, page */
+
+#define GUEST_TIMEOUT_US    (10 * G_USEC_PER_SEC)
+
+/*
+ * Enable the MMU, with RAM mapped one to one and TEST_VA mapped through
+ * L3_TABLE_A.  Read TEST_VA, which caches L3_TABLE_A in the page walk
+ * cache, then switch to L3_TABLE_B without a TLBI, raise FLAG and spin.
+ */
+static const uint8_t kernel[] = {
+    0x40, 0x02, 0x00, 0x58,     /* ldr x0, tcr */
+    0x40, 0x20, 0x18, 0xd5,     /* msr tcr_el1, x0 */
+    0x40, 0x02, 0x00, 0x58,     /* ldr x0, mair */
+    0x00, 0xa2, 0x18, 0xd5,     /* msr mair_el1, x0 */
+    0x40, 0x02, 0x00, 0x58,     /* ldr x0, ttbr0 */
+    0x00, 0x20, 0x18, 0xd5,     /* msr ttbr0_el1, x0 */
+    0xdf, 0x3f, 0x03, 0xd5,     /* isb */
+    0x20, 0x02, 0x00, 0x58,     /* ldr x0, sctlr */
+    0x00, 0x10, 0x18, 0xd5,     /* msr sctlr_el1, x0 */
+    0xdf, 0x3f, 0x03, 0xd5,     /* isb */
+    0x01, 0x02, 0x00, 0x58,     /* ldr x1, test_va */
+    0x22, 0x00, 0x40, 0xf9,     /* ldr x2, [x1] */
+    0x03, 0x02, 0x00, 0x58,     /* ldr x3, l2_entry */
+    0x24, 0x02, 0x00, 0x58,     /* ldr x4, l3_desc */
+    0x64, 0x00, 0x00, 0xf9,     /* str x4, [x3] */
+    0x25, 0x02, 0x00, 0x58,     /* ldr x5, flag */
+    0xa1, 0x00, 0x00, 0xf9,     /* str x1, [x5] */
+    0x00, 0x00, 0x00, 0x14,     /* b . */
+};
+
+/* The literals that follow the code, in order */
+static const uint64_t kernel_literals[] = {
+    (2ULL << 32) | 25,          /* tcr: 40-bit PA, 4 KiB granule, T0SZ 25 */
+    0xff,                       /* mair: attribute 0 is Normal memory */
+    L1_TABLE,                   /* ttbr0 */
+    0x30d00801,                 /* sctlr: RES1 bits and M */
+    TEST_VA,                    /* test_va */
+    L2_TABLE,                   /* l2_entry */
+    L3_TABLE_B | DESC_TABLE,    /* l3_desc */
+    FLAG,                       /* flag */
+};
+
+static void test_debug_walk(void)
+{
+    char kernel_path[] = "/tmp/qtest-arm-walk-cache-XXXXXX";
+    QTestState *qts;
+    gint64 deadline;
+    char *resp;
+    ssize_t wlen;
+    int fd, i;
+
+    fd = mkstemp(kernel_path);
+    g_assert(fd != -1);
+    wlen = write(fd, kernel, sizeof(kernel));
+    g_assert(wlen == sizeof(kernel));
+    for (i = 0; i < ARRAY_SIZE(kernel_literals); i++) {
+        uint64_t lit = cpu_to_le64(kernel_literals[i]);
+
+        wlen = write(fd, &lit, sizeof(lit));
+        g_assert(wlen == sizeof(lit));
+    }
+    close(fd);
+
+    qts = qtest_initf("-machine virt -cpu max -accel tcg -S -kernel %s",
+                      kernel_path);
+    unlink(kernel_path);
+
+    qtest_writeq(qts, L1_TABLE + 1 * 8, 0x40000000ULL | DESC_BLOCK);
+    qtest_writeq(qts, L1_TABLE + 2 * 8, L2_TABLE | DESC_TABLE);
+    qtest_writeq(qts, L2_TABLE, L3_TABLE_A | DESC_TABLE);
+    qtest_writeq(qts, L3_TABLE_A, FRAME_A | DESC_PAGE);
+    qtest_writeq(qts, L3_TABLE_B, FRAME_B | DESC_PAGE);
+    qtest_qmp_assert_success(qts, "{ 'execute': 'cont' }");
+
+    deadline = g_get_monotonic_time() + GUEST_TIMEOUT_US;
+    while (!qtest_readq(qts, FLAG)) {
+        g_assert_cmpint(g_get_monotonic_time(), <, deadline);
+        g_usleep(1000);
+    }
+
+    resp = qtest_hmp(qts, "gva2gpa 0x%" PRIx64, TEST_VA);
+    g_assert(strstr(resp, "gpa: 0x42020000"));
+    g_free(resp);
+
+    qtest_quit(qts);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+
+    qtest_add_func("/arm/walk-cache/debug-walk", test_debug_walk);
+
+    return g_test_run();
+}
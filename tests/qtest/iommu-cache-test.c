@@ -0,0 +1,458 @@
+/*
+ * QTest testcase for the translations cached for vIOMMUs
+ *
+ * The edu device DMAs through the vIOMMU.  Each test remaps the IOVA
+ * that edu writes to, invalidates it the way a guest driver would, and
+ * checks that the next DMA goes to the new page.  A translation left in
+ * the IOMMU region cache would send it to the old page instead.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/bswap.h"
+#include "libqos/libqtest.h"
+#include "hw/pci/pci_regs.h"
+#include "standard-headers/linux/virtio_config.h"
+#include "standard-headers/linux/virtio_iommu.h"
+#include "standard-headers/linux/virtio_pci.h"
+#include "standard-headers/linux/virtio_ring.h"
+
+#define TEST_PAGE_SIZE      0x1000
+#define TEST_IOVA           0x100000
+#define TEST_DMA_LEN        0x100
+
+/* edu registers, see hw/misc/edu.c */
+#define EDU_DEVFN           ((4 << 3) | 0)
+#define EDU_DMA_SRC         0x80
+#define EDU_DMA_DST         0x88
+#define EDU_DMA_CNT         0x90
+#define EDU_DMA_CMD         0x98
+#define EDU_DMA_RUN         0x1
+#define EDU_DMA_TO_PCI      0x2
+#define EDU_DMA_BUF         0x40000
+#define EDU_DMA_DELAY_NS    (100 * 1000 * 1000)
+
+/* q35 */
+#define PC_RAM              0x1000000
+#define PC_PCI_MMIO         0xe0000000
+
+#define VTD_BASE            0xfed90000
+#define VTD_GCMD            0x18
+#define VTD_GSTS            0x1c
+#define VTD_RTADDR          0x20
+#define VTD_IVA             0xf0
+#define VTD_IOTLB           0xf8
+#define VTD_GCMD_TE         (1u << 31)
+#define VTD_GCMD_SRTP       (1u << 30)
+#define VTD_GSTS_TES        (1u << 31)
+#define VTD_IOTLB_IVT       (1ULL << 63)
+#define VTD_IOTLB_GLOBAL    (1ULL << 60)
+#define VTD_IOTLB_PSI       (3ULL << 60)
+#define VTD_IOTLB_DID(did)  ((uint64_t)(did) << 32)
+#define VTD_PRESENT         1
+#define VTD_CONTEXT_AW_39   1           /* 3-level page table */
+#define VTD_CONTEXT_DID(d)  ((uint64_t)(d) << 8)
+#define VTD_PTE_RW          3
+#define VTD_DOMAIN          1
+
+/* arm virt, with highmem=off */
+#define VIRT_RAM            0x44000000
+#define VIRT_PCI_MMIO       0x10000000
+#define VIRT_PCI_ECAM       0x3f000000
+
+#define SMMU_BASE           0x09050000
+#define SMMU_CR0            0x20
+#define SMMU_STRTAB_BASE    0x80
+#define SMMU_STRTAB_CFG     0x88
+#define SMMU_CMDQ_BASE      0x90
+#define SMMU_CMDQ_PROD      0x98
+#define SMMU_CMDQ_CONS      0x9c
+#define SMMU_CR0_SMMUEN     (1 << 0)
+#define SMMU_CR0_CMDQEN     (1 << 3)
+#define SMMU_STRTAB_LOG2    8
+#define SMMU_CMDQ_LOG2      4
+#define SMMU_STE_V          1
+#define SMMU_STE_CFG_S1     (5 << 1)
+#define SMMU_CD_T0SZ        (64 - 39)   /* 3-level page table */
+#define SMMU_CD_EPD1        (1u << 30)
+#define SMMU_CD_V           (1u << 31)
+#define SMMU_CD_IPS_48      5
+#define SMMU_CD_AA64        (1 << 9)
+#define SMMU_CD_A           (1 << 14)
+#define SMMU_CD_ASID(asid)  ((asid) << 16)
+#define SMMU_PTE_TABLE      3
+#define SMMU_PTE_PAGE       (3 | (1 << 10))
+#define SMMU_CMD_TLBI_NH_ALL 0x10
+#define SMMU_CMD_TLBI_NH_VA 0x12
+#define SMMU_CMD_ASID(asid) ((uint64_t)(asid) << 48)
+#define SMMU_ASID           1
+
+#define VIRTIO_IOMMU_DEVFN  ((3 << 3) | 0)
+/* Layout of the modern BAR, see virtio_pci_realize() */
+#define VIRTIO_PCI_BAR      4
+#define VIRTIO_PCI_NOTIFY   0x3000
+#define VIRTIO_IOMMU_QSIZE  16
+#define VIRTIO_IOMMU_DOMAIN 1
+
+typedef struct IOMMUTest {
+    QTestState *qts;
+    /* PCI configuration space, or 0 for the PC configuration ports */
+    uint64_t ecam;
+    /* Guest RAM for the target pages and the IOMMU structures */
+    uint64_t ram;
+    uint64_t edu_bar;
+    uint64_t virtio_bar;
+    uint16_t virtio_avail_idx;
+    uint32_t smmu_cmdq_prod;
+} IOMMUTest;
+
+static uint64_t test_page(IOMMUTest *t, int n)
+{
+    return t->ram + n * TEST_PAGE_SIZE;
+}
+
+static void pci_config_writel(IOMMUTest *t, int devfn, uint8_t offset,
+                              uint32_t val)
+{
+    if (t->ecam) {
+        qtest_writel(t->qts, t->ecam + (devfn << 12) + offset, val);
+    } else {
+        qtest_outl(t->qts, 0xcf8, 0x80000000 | (devfn << 8) | offset);
+        qtest_outl(t->qts, 0xcfc, val);
+    }
+}
+
+/* Map @bar of the device at @devfn, and let the device DMA */
+static void pci_enable(IOMMUTest *t, int devfn, int bar, uint64_t addr)
+{
+    uint8_t offset = PCI_BASE_ADDRESS_0 + bar * 4;
+
+    pci_config_writel(t, devfn, offset, addr);
+    /* Ignored unless the BAR is 64-bit */
+    pci_config_writel(t, devfn, offset + 4, addr >> 32);
+    pci_config_writel(t, devfn, PCI_COMMAND,
+                      PCI_COMMAND_MEMORY | PCI_COMMAND_MASTER);
+}
+
+/* Have edu write TEST_DMA_LEN bytes of its zeroed buffer to @iova */
+static void edu_dma_write(IOMMUTest *t, uint64_t iova)
+{
+    qtest_writeq(t->qts, t->edu_bar + EDU_DMA_SRC, EDU_DMA_BUF);
+    qtest_writeq(t->qts, t->edu_bar + EDU_DMA_DST, iova);
+    qtest_writeq(t->qts, t->edu_bar + EDU_DMA_CNT, TEST_DMA_LEN);
+    qtest_writeq(t->qts, t->edu_bar + EDU_DMA_CMD,
+                 EDU_DMA_RUN | EDU_DMA_TO_PCI);
+
+    qtest_clock_step(t->qts, EDU_DMA_DELAY_NS);
+    g_assert_false(qtest_readq(t->qts, t->edu_bar + EDU_DMA_CMD) &
+                   EDU_DMA_RUN);
+}
+
+/* Check that a DMA to @iova goes to page @to, and not to page @from */
+static void check_dma(IOMMUTest *t, uint64_t iova, uint64_t to, uint64_t from)
+{
+    uint8_t zeroes[TEST_DMA_LEN] = {};
+    uint8_t ones[TEST_DMA_LEN];
+    uint8_t buf[TEST_DMA_LEN];
+
+    memset(ones, 0xff, sizeof(ones));
+    qtest_memwrite(t->qts, to, ones, sizeof(ones));
+    qtest_memwrite(t->qts, from, ones, sizeof(ones));
+
+    edu_dma_write(t, iova);
+
+    qtest_memread(t->qts, to, buf, sizeof(buf));
+    g_assert(!memcmp(buf, zeroes, sizeof(buf)));
+    qtest_memread(t->qts, from, buf, sizeof(buf));
+    g_assert(!memcmp(buf, ones, sizeof(buf)));
+}
+
+static uint64_t pte_index(uint64_t iova, int level)
+{
+    return (iova >> (12 + 9 * (level - 1))) & 511;
+}
+
+/*
+ * Fill the 3-level page table at pages @first to @first + 2 to map
+ * @iova, and return the address of the last level entry.
+ */
+static uint64_t build_page_table(IOMMUTest *t, int first, uint64_t iova,
+                                 uint64_t table_flags)
+{
+    uint64_t table = test_page(t, first);
+    int level;
+
+    for (level = 3; level > 1; level--) {
+        uint64_t next = table + TEST_PAGE_SIZE;
+
+        qtest_writeq(t->qts, table + pte_index(iova, level) * 8,
+                     next | table_flags);
+        table = next;
+    }
+    return table + pte_index(iova, 1) * 8;
+}
+
+static void test_intel_iommu(void)
+{
+    IOMMUTest t = { .ram = PC_RAM };
+    uint64_t x = test_page(&t, 0);
+    uint64_t y = test_page(&t, 1);
+    uint64_t root = test_page(&t, 16);
+    uint64_t context = test_page(&t, 17);
+    uint64_t pte;
+
+    t.qts = qtest_init("-machine q35 -device intel-iommu "
+                       "-device edu,addr=04.0");
+    t.edu_bar = PC_PCI_MMIO;
+    pci_enable(&t, EDU_DEVFN, 0, t.edu_bar);
+
+    /* Bus 0, then edu's devfn */
+    qtest_writeq(t.qts, root, context | VTD_PRESENT);
+    qtest_writeq(t.qts, context + EDU_DEVFN * 16,
+                 test_page(&t, 18) | VTD_PRESENT);
+    qtest_writeq(t.qts, context + EDU_DEVFN * 16 + 8,
+                 VTD_CONTEXT_AW_39 | VTD_CONTEXT_DID(VTD_DOMAIN));
+    pte = build_page_table(&t, 18, TEST_IOVA, VTD_PTE_RW);
+    qtest_writeq(t.qts, pte, x | VTD_PTE_RW);
+
+    qtest_writeq(t.qts, VTD_BASE + VTD_RTADDR, root);
+    qtest_writel(t.qts, VTD_BASE + VTD_GCMD, VTD_GCMD_SRTP);
+    qtest_writel(t.qts, VTD_BASE + VTD_GCMD, VTD_GCMD_TE);
+    g_assert(qtest_readl(t.qts, VTD_BASE + VTD_GSTS) & VTD_GSTS_TES);
+    check_dma(&t, TEST_IOVA, x, y);
+
+    /* Page-selective IOTLB invalidation */
+    qtest_writeq(t.qts, pte, y | VTD_PTE_RW);
+    qtest_writeq(t.qts, VTD_BASE + VTD_IVA, TEST_IOVA);
+    qtest_writeq(t.qts, VTD_BASE + VTD_IOTLB,
+                 VTD_IOTLB_IVT | VTD_IOTLB_PSI | VTD_IOTLB_DID(VTD_DOMAIN));
+    check_dma(&t, TEST_IOVA, y, x);
+
+    /* Global IOTLB invalidation */
+    qtest_writeq(t.qts, pte, x | VTD_PTE_RW);
+    qtest_writeq(t.qts, VTD_BASE + VTD_IOTLB,
+                 VTD_IOTLB_IVT | VTD_IOTLB_GLOBAL);
+    check_dma(&t, TEST_IOVA, x, y);
+
+    qtest_quit(t.qts);
+}
+
+static void smmu_cmd(IOMMUTest *t, uint64_t cmd0, uint64_t cmd1)
+{
+    uint64_t entry = test_page(t, 17) +
+                     (t->smmu_cmdq_prod & ((1 << SMMU_CMDQ_LOG2) - 1)) * 16;
+
+    qtest_writeq(t->qts, entry, cmd0);
+    qtest_writeq(t->qts, entry + 8, cmd1);
+
+    /* The index, then the wrap bit */
+    t->smmu_cmdq_prod = (t->smmu_cmdq_prod + 1) &
+                        ((2 << SMMU_CMDQ_LOG2) - 1);
+    qtest_writel(t->qts, SMMU_BASE + SMMU_CMDQ_PROD, t->smmu_cmdq_prod);
+    /* Consumed right away, without any error */
+    g_assert_cmphex(qtest_readl(t->qts, SMMU_BASE + SMMU_CMDQ_CONS), ==,
+                    t->smmu_cmdq_prod);
+}
+
+static void test_smmuv3(void)
+{
+    IOMMUTest t = { .ecam = VIRT_PCI_ECAM, .ram = VIRT_RAM };
+    uint64_t x = test_page(&t, 0);
+    uint64_t y = test_page(&t, 1);
+    uint64_t cd = test_page(&t, 16);
+    uint64_t cmdq = test_page(&t, 17);
+    /* Aligned to the size of the stream table */
+    uint64_t strtab = test_page(&t, 24);
+    uint64_t pte;
+
+    t.qts = qtest_init("-machine virt,iommu=smmuv3,highmem=off "
+                       "-device edu,addr=04.0");
+    t.edu_bar = VIRT_PCI_MMIO;
+    pci_enable(&t, EDU_DEVFN, 0, t.edu_bar);
+
+    /* The stream ID of edu is its requester ID */
+    qtest_writeq(t.qts, strtab + EDU_DEVFN * 64,
+                 cd | SMMU_STE_CFG_S1 | SMMU_STE_V);
+    qtest_writeq(t.qts, cd,
+                 SMMU_CD_T0SZ | SMMU_CD_EPD1 | SMMU_CD_V |
+                 (uint64_t)(SMMU_CD_IPS_48 | SMMU_CD_AA64 | SMMU_CD_A |
+                            SMMU_CD_ASID(SMMU_ASID)) << 32);
+    qtest_writeq(t.qts, cd + 8, test_page(&t, 18));
+    pte = build_page_table(&t, 18, TEST_IOVA, SMMU_PTE_TABLE);
+    qtest_writeq(t.qts, pte, x | SMMU_PTE_PAGE);
+
+    qtest_writeq(t.qts, SMMU_BASE + SMMU_STRTAB_BASE, strtab);
+    qtest_writel(t.qts, SMMU_BASE + SMMU_STRTAB_CFG, SMMU_STRTAB_LOG2);
+    qtest_writeq(t.qts, SMMU_BASE + SMMU_CMDQ_BASE, cmdq | SMMU_CMDQ_LOG2);
+    qtest_writel(t.qts, SMMU_BASE + SMMU_CR0,
+                 SMMU_CR0_SMMUEN | SMMU_CR0_CMDQEN);
+    check_dma(&t, TEST_IOVA, x, y);
+
+    /* Invalidation by address */
+    qtest_writeq(t.qts, pte, y | SMMU_PTE_PAGE);
+    smmu_cmd(&t, SMMU_CMD_TLBI_NH_VA | SMMU_CMD_ASID(SMMU_ASID), TEST_IOVA);
+    check_dma(&t, TEST_IOVA, y, x);
+
+    /* Invalidation of everything */
+    qtest_writeq(t.qts, pte, x | SMMU_PTE_PAGE);
+    smmu_cmd(&t, SMMU_CMD_TLBI_NH_ALL, 0);
+    check_dma(&t, TEST_IOVA, x, y);
+
+    qtest_quit(t.qts);
+}
+
+/* Send @req over the request queue, and return the status of the tail */
+static uint8_t virtio_iommu_send(IOMMUTest *t, const void *req, size_t len)
+{
+    uint64_t desc = test_page(t, 16);
+    uint64_t avail = test_page(t, 17);
+    uint64_t used = test_page(t, 18);
+    uint64_t buf = test_page(t, 19);
+    size_t tail = len - sizeof(struct virtio_iommu_req_tail);
+    uint16_t idx = t->virtio_avail_idx++;
+    struct vring_desc descs[2] = {
+        {
+            .addr = cpu_to_le64(buf),
+            .len = cpu_to_le32(tail),
+            .flags = cpu_to_le16(VRING_DESC_F_NEXT),
+            .next = cpu_to_le16(1),
+        }, {
+            .addr = cpu_to_le64(buf + tail),
+            .len = cpu_to_le32(sizeof(struct virtio_iommu_req_tail)),
+            .flags = cpu_to_le16(VRING_DESC_F_WRITE),
+        },
+    };
+
+    qtest_memwrite(t->qts, buf, req, len);
+    qtest_memwrite(t->qts, desc, descs, sizeof(descs));
+    qtest_writew(t->qts, avail + offsetof(struct vring_avail, ring) +
+                 (idx % VIRTIO_IOMMU_QSIZE) * 2, 0);
+    qtest_writew(t->qts, avail + offsetof(struct vring_avail, idx), idx + 1);
+
+    /* Handled right away, there is no ioeventfd without KVM */
+    qtest_writew(t->qts, t->virtio_bar + VIRTIO_PCI_NOTIFY, 0);
+    g_assert_cmpint(qtest_readw(t->qts,
+                                used + offsetof(struct vring_used, idx)),
+                    ==, idx + 1);
+    return qtest_readb(t->qts, buf + tail);
+}
+
+static void virtio_pci_write_addr(IOMMUTest *t, int offset, uint64_t addr)
+{
+    qtest_writel(t->qts, t->virtio_bar + offset, addr);
+    qtest_writel(t->qts, t->virtio_bar + offset + 4, addr >> 32);
+}
+
+static void virtio_iommu_start(IOMMUTest *t)
+{
+    uint64_t common = t->virtio_bar;
+    uint8_t status = VIRTIO_CONFIG_S_ACKNOWLEDGE | VIRTIO_CONFIG_S_DRIVER;
+
+    qtest_writeb(t->qts, common + VIRTIO_PCI_COMMON_STATUS, 0);
+    qtest_writeb(t->qts, common + VIRTIO_PCI_COMMON_STATUS, status);
+
+    qtest_writel(t->qts, common + VIRTIO_PCI_COMMON_GFSELECT, 0);
+    qtest_writel(t->qts, common + VIRTIO_PCI_COMMON_GF,
+                 1u << VIRTIO_IOMMU_F_MAP_UNMAP);
+    qtest_writel(t->qts, common + VIRTIO_PCI_COMMON_GFSELECT, 1);
+    qtest_writel(t->qts, common + VIRTIO_PCI_COMMON_GF,
+                 1u << (VIRTIO_F_VERSION_1 - 32));
+    status |= VIRTIO_CONFIG_S_FEATURES_OK;
+    qtest_writeb(t->qts, common + VIRTIO_PCI_COMMON_STATUS, status);
+    g_assert_cmpint(qtest_readb(t->qts, common + VIRTIO_PCI_COMMON_STATUS),
+                    ==, status);
+
+    /* The request queue */
+    qtest_writew(t->qts, common + VIRTIO_PCI_COMMON_Q_SELECT, 0);
+    qtest_writew(t->qts, common + VIRTIO_PCI_COMMON_Q_SIZE,
+                 VIRTIO_IOMMU_QSIZE);
+    virtio_pci_write_addr(t, VIRTIO_PCI_COMMON_Q_DESCLO, test_page(t, 16));
+    virtio_pci_write_addr(t, VIRTIO_PCI_COMMON_Q_AVAILLO, test_page(t, 17));
+    virtio_pci_write_addr(t, VIRTIO_PCI_COMMON_Q_USEDLO, test_page(t, 18));
+    g_assert_cmpint(qtest_readw(t->qts, common + VIRTIO_PCI_COMMON_Q_NOFF),
+                    ==, 0);
+    qtest_writew(t->qts, common + VIRTIO_PCI_COMMON_Q_ENABLE, 1);
+
+    status |= VIRTIO_CONFIG_S_DRIVER_OK;
+    qtest_writeb(t->qts, common + VIRTIO_PCI_COMMON_STATUS, status);
+}
+
+static void virtio_iommu_map(IOMMUTest *t, uint64_t iova, uint64_t addr)
+{
+    struct virtio_iommu_req_map req = {
+        .head.type = VIRTIO_IOMMU_T_MAP,
+        .domain = cpu_to_le32(VIRTIO_IOMMU_DOMAIN),
+        .virt_start = cpu_to_le64(iova),
+        .virt_end = cpu_to_le64(iova + TEST_PAGE_SIZE - 1),
+        .phys_start = cpu_to_le64(addr),
+        .flags = cpu_to_le32(VIRTIO_IOMMU_MAP_F_READ |
+                             VIRTIO_IOMMU_MAP_F_WRITE),
+    };
+
+    g_assert_cmpint(virtio_iommu_send(t, &req, sizeof(req)), ==,
+                    VIRTIO_IOMMU_S_OK);
+}
+
+static void virtio_iommu_unmap(IOMMUTest *t, uint64_t iova)
+{
+    struct virtio_iommu_req_unmap req = {
+        .head.type = VIRTIO_IOMMU_T_UNMAP,
+        .domain = cpu_to_le32(VIRTIO_IOMMU_DOMAIN),
+        .virt_start = cpu_to_le64(iova),
+        .virt_end = cpu_to_le64(iova + TEST_PAGE_SIZE - 1),
+    };
+
+    g_assert_cmpint(virtio_iommu_send(t, &req, sizeof(req)), ==,
+                    VIRTIO_IOMMU_S_OK);
+}
+
+static void test_virtio_iommu(void)
+{
+    IOMMUTest t = { .ecam = VIRT_PCI_ECAM, .ram = VIRT_RAM };
+    uint64_t x = test_page(&t, 0);
+    uint64_t y = test_page(&t, 1);
+    struct virtio_iommu_req_attach attach = {
+        .head.type = VIRTIO_IOMMU_T_ATTACH,
+        .domain = cpu_to_le32(VIRTIO_IOMMU_DOMAIN),
+        /* The endpoint ID of edu is its requester ID */
+        .endpoint = cpu_to_le32(EDU_DEVFN),
+    };
+
+    t.qts = qtest_init("-machine virt,highmem=off "
+                       "-device virtio-iommu-pci,addr=03.0 "
+                       "-device edu,addr=04.0");
+    t.edu_bar = VIRT_PCI_MMIO;
+    pci_enable(&t, EDU_DEVFN, 0, t.edu_bar);
+    t.virtio_bar = VIRT_PCI_MMIO + 0x100000;
+    pci_enable(&t, VIRTIO_IOMMU_DEVFN, VIRTIO_PCI_BAR, t.virtio_bar);
+    virtio_iommu_start(&t);
+
+    g_assert_cmpint(virtio_iommu_send(&t, &attach, sizeof(attach)), ==,
+                    VIRTIO_IOMMU_S_OK);
+    virtio_iommu_map(&t, TEST_IOVA, x);
+    check_dma(&t, TEST_IOVA, x, y);
+
+    virtio_iommu_unmap(&t, TEST_IOVA);
+    virtio_iommu_map(&t, TEST_IOVA, y);
+    check_dma(&t, TEST_IOVA, y, x);
+
+    qtest_quit(t.qts);
+}
+
+int main(int argc, char **argv)
+{
+    const char *arch = qtest_get_arch();
+
+    g_test_init(&argc, &argv, NULL);
+
+    if (!strcmp(arch, "i386") || !strcmp(arch, "x86_64")) {
+        qtest_add_func("/iommu-cache/intel-iommu", test_intel_iommu);
+    } else if (!strcmp(arch, "aarch64")) {
+        qtest_add_func("/iommu-cache/smmuv3", test_smmuv3);
+        qtest_add_func("/iommu-cache/virtio-iommu", test_virtio_iommu);
+    }
+
+    return g_test_run();
+}
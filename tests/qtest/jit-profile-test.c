@@ -0,0 +1,140 @@
+/*
+ * QTest testcase for the JIT statistics of the TCG accelerator
+ *
+ * The guest spins in a one-block loop.  The translation statistics must
+ * always be collected, the helper call sites and the execution counts
+ * only while x-jit-set-tb-exec-count is enabled, and the loop must then
+ * be the hottest block.
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+#include "qemu/osdep.h"
+#include "libqos/libqtest.h"
+#include "qapi/qmp/qdict.h"
+#include "qapi/qmp/qlist.h"
+
+/* Where the virt machine loads a raw aarch64 kernel */
+#define KERNEL_ADDR         0x40080000ULL
+
+#define GUEST_TIMEOUT_US    (10 * G_USEC_PER_SEC)
+
+static const uint8_t kernel[] = {
+    0x00, 0x04, 0x00, 0x91,     /* 1: add x0, x0, #1 */
+    0xff, 0xff, 0xff, 0x17,     /* b 1b */
+};
+
+static QDict *query_jit_profile(QTestState *qts)
+{
+    QDict *resp, *ret;
+
+    resp = qtest_qmp(qts, "{ 'execute': 'x-query-jit-profile',"
+                     " 'arguments': { 'top': 1 } }");
+    g_assert(qdict_haskey(resp, "return"));
+    ret = qdict_get_qdict(resp, "return");
+    qobject_ref(ret);
+    qobject_unref(resp);
+    return ret;
+}
+
+static void set_tb_exec_count(QTestState *qts, bool enable)
+{
+    qtest_qmp_assert_success(qts, "{ 'execute': 'x-jit-set-tb-exec-count',"
+                             " 'arguments': { 'enable': %i } }", enable);
+}
+
+static QDict *first_vcpu(QDict *profile)
+{
+    QList *vcpus = qdict_get_qlist(profile, "vcpus");
+    QDict *vcpu;
+
+    g_assert(!qlist_empty(vcpus));
+    vcpu = qobject_to(QDict, qlist_entry_obj(qlist_first(vcpus)));
+    g_assert_cmpint(qdict_get_int(vcpu, "cpu-index"), ==, 0);
+    return vcpu;
+}
+
+static void test_jit_profile(void)
+{
+    char kernel_path[] = "/tmp/qtest-jit-profile-XXXXXX";
+    QTestState *qts;
+    QDict *profile, *vcpu, *hot_tb;
+    QList *hot_tbs;
+    gint64 deadline;
+    ssize_t wlen;
+    int fd;
+
+    fd = mkstemp(kernel_path);
+    g_assert(fd != -1);
+    wlen = write(fd, kernel, sizeof(kernel));
+    g_assert(wlen == sizeof(kernel));
+    close(fd);
+
+    qts = qtest_initf("-machine virt -cpu max -accel tcg -kernel %s",
+                      kernel_path);
+    unlink(kernel_path);
+
+    /* Off by default, but the translations and exits are still counted */
+    deadline = g_get_monotonic_time() + GUEST_TIMEOUT_US;
+    for (;;) {
+        profile = query_jit_profile(qts);
+        g_assert(!qdict_get_bool(profile, "tb-exec-count"));
+        g_assert(qlist_empty(qdict_get_qlist(profile, "hot-tbs")));
+        vcpu = first_vcpu(profile);
+        g_assert(qlist_empty(qdict_get_qlist(vcpu, "helpers")));
+        if (qdict_get_int(vcpu, "translations") > 0 &&
+            qdict_get_int(vcpu, "exit-goto-tb") > 0) {
+            break;
+        }
+        qobject_unref(profile);
+        g_assert_cmpint(g_get_monotonic_time(), <, deadline);
+        g_usleep(1000);
+    }
+    g_assert_cmpint(qdict_get_int(vcpu, "guest-insns"), >=, 2);
+    g_assert_cmpint(qdict_get_int(vcpu, "host-bytes"), >, 0);
+    qobject_unref(profile);
+
+    qmp_expect_error_and_unref(
+        qtest_qmp(qts, "{ 'execute': 'x-query-jit-profile',"
+                  " 'arguments': { 'top': -1 } }"), "GenericError");
+
+    /* The flush makes the loop count its executions once retranslated */
+    set_tb_exec_count(qts, true);
+    deadline = g_get_monotonic_time() + GUEST_TIMEOUT_US;
+    for (;;) {
+        profile = query_jit_profile(qts);
+        g_assert(qdict_get_bool(profile, "tb-exec-count"));
+        hot_tbs = qdict_get_qlist(profile, "hot-tbs");
+        if (!qlist_empty(hot_tbs)) {
+            break;
+        }
+        qobject_unref(profile);
+        g_assert_cmpint(g_get_monotonic_time(), <, deadline);
+        g_usleep(1000);
+    }
+    g_assert_cmpint(qdict_get_int(first_vcpu(profile), "translations"), >, 1);
+    hot_tb = qobject_to(QDict, qlist_entry_obj(qlist_first(hot_tbs)));
+    g_assert_cmphex(qdict_get_int(hot_tb, "pc"), ==, KERNEL_ADDR);
+    g_assert_cmpint(qdict_get_int(hot_tb, "guest-insns"), ==, 2);
+    g_assert_cmpint(qdict_get_int(hot_tb, "exec-count"), >, 0);
+    g_assert(!qlist_next(qlist_first(hot_tbs)));
+    qobject_unref(profile);
+
+    /* Disabling drops the counts */
+    set_tb_exec_count(qts, false);
+    profile = query_jit_profile(qts);
+    g_assert(!qdict_get_bool(profile, "tb-exec-count"));
+    g_assert(qlist_empty(qdict_get_qlist(profile, "hot-tbs")));
+    qobject_unref(profile);
+
+    qtest_quit(qts);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+
+    qtest_add_func("/jit-profile/tb-exec-count", test_jit_profile);
+
+    return g_test_run();
+}
@@ -0,0 +1,272 @@
+/*
+ * QTest testcase for MMIO regions dispatched without the BQL
+ *
+ * Four vCPUs hammer the admin submission queue doorbell of an NVMe
+ * controller and the notification region of a virtio device, while the
+ * test resets and enables both devices again and again.  This races the
+ * lockless doorbells with the creation and deletion of the queues they
+ * point to.  Afterwards, the controller must still process commands.
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/bswap.h"
+#include "libqos/libqtest.h"
+#include "hw/pci/pci_regs.h"
+#include "standard-headers/linux/virtio_config.h"
+#include "standard-headers/linux/virtio_pci.h"
+
+#define NCPUS               4
+
+/* The virt machine without highmem */
+#define ECAM_BASE           0x3f000000ULL
+#define NVME_DEVFN          (1 << 3)
+#define VIRTIO_DEVFN        (2 << 3)
+
+#define NVME_BAR            0x10000000ULL
+#define VIRTIO_BAR          0x11000000ULL
+
+/* The modern virtio-pci layout of the BAR */
+#define VIRTIO_COMMON       (VIRTIO_BAR + 0x0)
+#define VIRTIO_NOTIFY       (VIRTIO_BAR + 0x3000)
+
+#define NVME_REG_CC         0x14
+#define NVME_REG_CSTS       0x1c
+#define NVME_REG_AQA        0x24
+#define NVME_REG_ASQ        0x28
+#define NVME_REG_ACQ        0x30
+#define NVME_SQ0_DOORBELL   0x1000
+
+/* Below the DTB, which the virt machine loads at 64 MiB into RAM */
+#define STOP                0x42000000ULL
+#define PROGRESS            0x42000100ULL
+#define PARKED              0x42000200ULL
+#define ADMIN_SQ            0x42010000ULL
+#define ADMIN_CQ            0x42020000ULL
+#define IDENTIFY_BUF        0x42030000ULL
+#define VRING               0x42040000ULL
+
+#define ADMIN_QUEUE_SIZE    32
+#define ITERATIONS          20
+
+#define GUEST_TIMEOUT_US    (10 * G_USEC_PER_SEC)
+
+/*
+ * Start the other vCPUs through PSCI.  Each vCPU then writes tails, half
+ * of them beyond the size of the queue, to the doorbell and kicks the
+ * virtqueue, until STOP is raised.  PROGRESS and PARKED hold the number
+ * of iterations of each vCPU.
+ */
+static const uint8_t kernel[] = {
+    0x21, 0x00, 0x80, 0xd2,     /* mov x1, #1 */
+    0xe2, 0x00, 0x00, 0x10,     /* adr x2, 2f */
+    0x03, 0x00, 0x80, 0xd2,     /* mov x3, #0 */
+    0xe0, 0x02, 0x00, 0x58,     /* 1: ldr x0, psci_cpu_on */
+    0x02, 0x00, 0x00, 0xd4,     /* hvc #0 */
+    0x21, 0x04, 0x00, 0x91,     /* add x1, x1, #1 */
+    0x3f, 0x10, 0x00, 0xf1,     /* cmp x1, #NCPUS */
+    0x81, 0xff, 0xff, 0x54,     /* b.ne 1b */
+    0x84, 0x02, 0x00, 0x58,     /* 2: ldr x4, sq_doorbell */
+    0xad, 0x02, 0x00, 0x58,     /* ldr x13, vq_notify */
+    0xc8, 0x02, 0x00, 0x58,     /* ldr x8, stop */
+    0xea, 0x02, 0x00, 0x58,     /* ldr x10, progress */
+    0x0c, 0x03, 0x00, 0x58,     /* ldr x12, parked */
+    0xab, 0x00, 0x38, 0xd5,     /* mrs x11, mpidr_el1 */
+    0x6b, 0x1d, 0x40, 0x92,     /* and x11, x11, #0xff */
+    0x05, 0x00, 0x80, 0x52,     /* mov w5, #0 */
+    0xa6, 0x14, 0x00, 0x12,     /* 3: and w6, w5, #0x3f */
+    0x86, 0x00, 0x00, 0xb9,     /* str w6, [x4] */
+    0xbf, 0x01, 0x00, 0xb9,     /* str wzr, [x13] */
+    0xa5, 0x04, 0x00, 0x11,     /* add w5, w5, #1 */
+    0x45, 0x79, 0x2b, 0xb8,     /* str w5, [x10, x11, lsl #2] */
+    0x07, 0x01, 0x40, 0xb9,     /* ldr w7, [x8] */
+    0x47, 0xff, 0xff, 0x34,     /* cbz w7, 3b */
+    0x85, 0x79, 0x2b, 0xb8,     /* str w5, [x12, x11, lsl #2] */
+    0x7f, 0x20, 0x03, 0xd5,     /* 4: wfi */
+    0xff, 0xff, 0xff, 0x17,     /* b 4b */
+};
+
+/* The literals that follow the code, in order */
+static const uint64_t kernel_literals[] = {
+    0xc4000003,                         /* psci_cpu_on: CPU_ON, SMC64 */
+    NVME_BAR + NVME_SQ0_DOORBELL,       /* sq_doorbell */
+    VIRTIO_NOTIFY,                      /* vq_notify */
+    STOP,                               /* stop */
+    PROGRESS,                           /* progress */
+    PARKED,                             /* parked */
+};
+
+static char *write_kernel(void)
+{
+    char *path = g_strdup("/tmp/qtest-lockless-mmio-XXXXXX");
+    ssize_t wlen;
+    int fd, i;
+
+    fd = mkstemp(path);
+    g_assert(fd != -1);
+    wlen = write(fd, kernel, sizeof(kernel));
+    g_assert(wlen == sizeof(kernel));
+    for (i = 0; i < ARRAY_SIZE(kernel_literals); i++) {
+        uint64_t lit = cpu_to_le64(kernel_literals[i]);
+
+        wlen = write(fd, &lit, sizeof(lit));
+        g_assert(wlen == sizeof(lit));
+    }
+    close(fd);
+    return path;
+}
+
+static void map_bar(QTestState *qts, int devfn, int bar, uint64_t addr)
+{
+    uint64_t cfg = ECAM_BASE + (devfn << 12);
+
+    qtest_writel(qts, cfg + PCI_BASE_ADDRESS_0 + bar * 4, addr);
+    qtest_writel(qts, cfg + PCI_BASE_ADDRESS_0 + bar * 4 + 4, addr >> 32);
+    qtest_writew(qts, cfg + PCI_COMMAND,
+                 PCI_COMMAND_MEMORY | PCI_COMMAND_MASTER);
+}
+
+static void wait_csts_rdy(QTestState *qts, bool rdy)
+{
+    gint64 deadline = g_get_monotonic_time() + GUEST_TIMEOUT_US;
+
+    while ((qtest_readl(qts, NVME_BAR + NVME_REG_CSTS) & 1) != rdy) {
+        g_assert_cmpint(g_get_monotonic_time(), <, deadline);
+        g_usleep(100);
+    }
+}
+
+static void nvme_enable(QTestState *qts)
+{
+    /* 64-byte submission and 16-byte completion queue entries */
+    qtest_writel(qts, NVME_BAR + NVME_REG_CC, (6 << 16) | (4 << 20) | 1);
+    wait_csts_rdy(qts, true);
+}
+
+static void nvme_disable(QTestState *qts)
+{
+    qtest_writel(qts, NVME_BAR + NVME_REG_CC, 0);
+    wait_csts_rdy(qts, false);
+}
+
+static void virtio_enable(QTestState *qts)
+{
+    uint8_t status = VIRTIO_CONFIG_S_ACKNOWLEDGE | VIRTIO_CONFIG_S_DRIVER;
+
+    qtest_writeb(qts, VIRTIO_COMMON + VIRTIO_PCI_COMMON_STATUS, status);
+    qtest_writel(qts, VIRTIO_COMMON + VIRTIO_PCI_COMMON_GFSELECT, 1);
+    qtest_writel(qts, VIRTIO_COMMON + VIRTIO_PCI_COMMON_GF,
+                 1u << (VIRTIO_F_VERSION_1 - 32));
+    status |= VIRTIO_CONFIG_S_FEATURES_OK;
+    qtest_writeb(qts, VIRTIO_COMMON + VIRTIO_PCI_COMMON_STATUS, status);
+
+    /* An empty ring: the kicks find nothing to do */
+    qtest_writew(qts, VIRTIO_COMMON + VIRTIO_PCI_COMMON_Q_SELECT, 0);
+    qtest_writel(qts, VIRTIO_COMMON + VIRTIO_PCI_COMMON_Q_DESCLO, VRING);
+    qtest_writel(qts, VIRTIO_COMMON + VIRTIO_PCI_COMMON_Q_AVAILLO,
+                 VRING + 0x1000);
+    qtest_writel(qts, VIRTIO_COMMON + VIRTIO_PCI_COMMON_Q_USEDLO,
+                 VRING + 0x2000);
+    qtest_writew(qts, VIRTIO_COMMON + VIRTIO_PCI_COMMON_Q_ENABLE, 1);
+
+    /* This assigns the ioeventfd that the kicks signal without the BQL */
+    status |= VIRTIO_CONFIG_S_DRIVER_OK;
+    qtest_writeb(qts, VIRTIO_COMMON + VIRTIO_PCI_COMMON_STATUS, status);
+}
+
+static void virtio_reset(QTestState *qts)
+{
+    qtest_writeb(qts, VIRTIO_COMMON + VIRTIO_PCI_COMMON_STATUS, 0);
+}
+
+static void wait_vcpus(QTestState *qts, uint64_t array, uint32_t min)
+{
+    gint64 deadline = g_get_monotonic_time() + GUEST_TIMEOUT_US;
+    int i;
+
+    for (i = 0; i < NCPUS; i++) {
+        while (qtest_readl(qts, array + i * 4) < min) {
+            g_assert_cmpint(g_get_monotonic_time(), <, deadline);
+            g_usleep(1000);
+        }
+    }
+}
+
+/* Identify the controller through the admin queue, which must be empty */
+static void nvme_identify(QTestState *qts)
+{
+    gint64 deadline = g_get_monotonic_time() + GUEST_TIMEOUT_US;
+    uint32_t dw3;
+
+    qtest_memset(qts, ADMIN_SQ, 0, 64);
+    qtest_writel(qts, ADMIN_SQ, 0x06 | (0x1234 << 16));  /* Identify */
+    qtest_writeq(qts, ADMIN_SQ + 24, IDENTIFY_BUF);     /* PRP1 */
+    qtest_writel(qts, ADMIN_SQ + 40, 1);                /* CNS: controller */
+    qtest_writel(qts, NVME_BAR + NVME_SQ0_DOORBELL, 1);
+
+    /* Wait for the phase tag of the first completion */
+    while (!((dw3 = qtest_readl(qts, ADMIN_CQ + 12)) & (1 << 16))) {
+        g_assert_cmpint(g_get_monotonic_time(), <, deadline);
+        g_usleep(1000);
+    }
+    g_assert_cmphex(dw3 & 0xffff, ==, 0x1234);
+    g_assert_cmphex(dw3 >> 17, ==, 0);
+    g_assert_cmphex(qtest_readw(qts, IDENTIFY_BUF), ==, 0x1b36);
+}
+
+static void test_doorbells(void)
+{
+    g_autofree char *kernel_path = write_kernel();
+    QTestState *qts;
+    int i;
+
+    qts = qtest_initf("-machine virt,highmem=off -cpu max"
+                      " -accel tcg,thread=multi -smp %d -S -kernel %s"
+                      " -device nvme,serial=lockless,addr=%d.0"
+                      " -device virtio-rng-pci,disable-legacy=on,addr=%d.0",
+                      NCPUS, kernel_path, NVME_DEVFN >> 3, VIRTIO_DEVFN >> 3);
+    unlink(kernel_path);
+
+    map_bar(qts, NVME_DEVFN, 0, NVME_BAR);
+    map_bar(qts, VIRTIO_DEVFN, 4, VIRTIO_BAR);
+
+    qtest_writel(qts, NVME_BAR + NVME_REG_AQA,
+                 ((ADMIN_QUEUE_SIZE - 1) << 16) | (ADMIN_QUEUE_SIZE - 1));
+    qtest_writeq(qts, NVME_BAR + NVME_REG_ASQ, ADMIN_SQ);
+    qtest_writeq(qts, NVME_BAR + NVME_REG_ACQ, ADMIN_CQ);
+    nvme_enable(qts);
+    virtio_enable(qts);
+
+    qtest_qmp_assert_success(qts, "{ 'execute': 'cont' }");
+    wait_vcpus(qts, PROGRESS, 1000);
+
+    for (i = 0; i < ITERATIONS; i++) {
+        nvme_disable(qts);
+        virtio_reset(qts);
+        g_usleep(1000);
+        nvme_enable(qts);
+        virtio_enable(qts);
+        g_usleep(1000);
+    }
+
+    qtest_writel(qts, STOP, 1);
+    wait_vcpus(qts, PARKED, 1);
+
+    /* Start over with empty queues */
+    nvme_disable(qts);
+    qtest_memset(qts, ADMIN_CQ, 0, ADMIN_QUEUE_SIZE * 16);
+    nvme_enable(qts);
+    nvme_identify(qts);
+
+    qtest_quit(qts);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+
+    qtest_add_func("/lockless-mmio/doorbells", test_doorbells);
+
+    return g_test_run();
+}
@@ -0,0 +1,240 @@
+/*
+ * QTest testcase for the incremental update of the FlatViews
+ *
+ * The topology of a PCI device is changed step by step.  After each step,
+ * what every address space sees must not change when all the FlatViews
+ * are rendered again from scratch, and only the address spaces whose
+ * memory regions changed may have been updated.
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+#include "qemu/osdep.h"
+#include "libqos/libqtest.h"
+#include "libqos/pci-pc.h"
+#include "qapi/qmp/qdict.h"
+#include "hw/pci/pci_regs.h"
+
+#define TESTDEV_SLOT        4
+#define HOTPLUG_SLOT        5
+
+#define DIRTY_RATE_TIMEOUT_US   (10 * G_USEC_PER_SEC)
+
+typedef struct CommitStats {
+    uint64_t commits;
+    uint64_t rendered;
+    uint64_t updated;
+} CommitStats;
+
+typedef struct FlatViewDump {
+    /* One "AS" line and the ranges it sees per address space, sorted */
+    GPtrArray *as;
+    CommitStats stats;
+} FlatViewDump;
+
+static gint compare_strings(gconstpointer a, gconstpointer b)
+{
+    return strcmp(*(const char **)a, *(const char **)b);
+}
+
+/*
+ * Split "info mtree -f" by address space, so that the dump does not
+ * depend on the order of the FlatViews or on which address spaces
+ * happen to share one.
+ */
+static void get_flatviews(QTestState *qts, FlatViewDump *dump)
+{
+    g_autofree char *out = qtest_hmp(qts, "info mtree -f");
+    g_auto(GStrv) lines = g_strsplit(out, "\n", -1);
+    g_autoptr(GPtrArray) names = g_ptr_array_new();
+    GString *view = NULL;
+    char **line;
+    guint i;
+
+    dump->as = g_ptr_array_new_with_free_func(g_free);
+    memset(&dump->stats, 0, sizeof(dump->stats));
+
+    for (line = lines; *line; line++) {
+        g_strchomp(*line);
+        if (g_str_has_prefix(*line, "FlatView #")) {
+            g_ptr_array_set_size(names, 0);
+            view = g_string_new("");
+        } else if (g_str_has_prefix(*line, " AS ")) {
+            g_ptr_array_add(names, *line);
+        } else if (g_str_has_prefix(*line, "topology commits:")) {
+            g_assert_cmpint(sscanf(*line, "topology commits: %" SCNu64
+                                   ", FlatViews rendered: %" SCNu64
+                                   ", address spaces updated: %" SCNu64,
+                                   &dump->stats.commits,
+                                   &dump->stats.rendered,
+                                   &dump->stats.updated), ==, 3);
+        } else if (!view) {
+            continue;
+        } else if (**line) {
+            g_string_append_printf(view, "%s\n", *line);
+        } else {
+            /* The blank line that ends a FlatView */
+            for (i = 0; i < names->len; i++) {
+                g_ptr_array_add(dump->as,
+                                g_strdup_printf("%s\n%s",
+                                                (char *)names->pdata[i],
+                                                view->str));
+            }
+            g_string_free(view, true);
+            view = NULL;
+        }
+    }
+    g_assert(!view);
+    g_assert_cmpint(dump->stats.commits, >, 0);
+    g_assert_cmpint(dump->as->len, >, 0);
+
+    g_ptr_array_sort(dump->as, compare_strings);
+}
+
+static void free_flatviews(FlatViewDump *dump)
+{
+    g_ptr_array_free(dump->as, true);
+}
+
+/*
+ * Stopping the global dirty log marks all the FlatViews stale, so that
+ * the next commit renders them all again.  A dirty rate measurement in
+ * dirty-bitmap mode starts and stops it.
+ */
+static void render_all(QTestState *qts)
+{
+    gint64 deadline = g_get_monotonic_time() + DIRTY_RATE_TIMEOUT_US;
+    QDict *resp;
+    bool measured;
+
+    qtest_qmp_assert_success(qts, "{ 'execute': 'calc-dirty-rate',"
+                             " 'arguments': { 'calc-time': 1,"
+                             " 'mode': 'dirty-bitmap' } }");
+    for (;;) {
+        resp = qtest_qmp(qts, "{ 'execute': 'query-dirty-rate' }");
+        g_assert(qdict_haskey(resp, "return"));
+        measured = !strcmp(qdict_get_str(qdict_get_qdict(resp, "return"),
+                                         "status"), "measured");
+        qobject_unref(resp);
+        if (measured) {
+            break;
+        }
+        g_assert_cmpint(g_get_monotonic_time(), <, deadline);
+        g_usleep(10000);
+    }
+}
+
+/*
+ * Check the FlatViews against a full render, and return the stats of the
+ * incremental updates since the previous check.
+ */
+static CommitStats check_flatviews(QTestState *qts, CommitStats *last)
+{
+    FlatViewDump before, after;
+    CommitStats delta;
+    guint i;
+
+    get_flatviews(qts, &before);
+    delta.commits = before.stats.commits - last->commits;
+    delta.rendered = before.stats.rendered - last->rendered;
+    delta.updated = before.stats.updated - last->updated;
+
+    render_all(qts);
+    get_flatviews(qts, &after);
+
+    g_assert_cmpint(before.as->len, ==, after.as->len);
+    for (i = 0; i < before.as->len; i++) {
+        g_assert_cmpstr(before.as->pdata[i], ==, after.as->pdata[i]);
+    }
+
+    /* Both the start and the stop of the dirty log update everything */
+    g_assert_cmpint(after.stats.commits - before.stats.commits, ==, 2);
+    g_assert_cmpint(after.stats.updated - before.stats.updated, ==,
+                    2 * after.as->len);
+    g_assert_cmpint(after.stats.rendered - before.stats.rendered, >=, 2);
+
+    *last = after.stats;
+    free_flatviews(&before);
+    free_flatviews(&after);
+    return delta;
+}
+
+static void set_command(QPCIDevice *dev, uint16_t bits, bool on)
+{
+    uint16_t cmd = qpci_config_readw(dev, PCI_COMMAND);
+
+    cmd = on ? cmd | bits : cmd & ~bits;
+    qpci_config_writew(dev, PCI_COMMAND, cmd);
+}
+
+static void test_flatview_update(void)
+{
+    QTestState *qts;
+    QPCIBus *pcibus;
+    QPCIDevice *dev;
+    CommitStats last = { 0 }, delta;
+    QPCIBar bar0;
+    uint64_t size;
+
+    qts = qtest_initf("-machine pc -device pci-testdev,addr=%d.0",
+                      TESTDEV_SLOT);
+    pcibus = qpci_new_pc(qts, NULL);
+    dev = qpci_device_find(pcibus, QPCI_DEVFN(TESTDEV_SLOT, 0));
+    g_assert(dev);
+
+    check_flatviews(qts, &last);
+
+    /* Map the BARs */
+    qpci_device_enable(dev);
+    bar0 = qpci_iomap(dev, 0, &size);
+    qpci_iomap(dev, 1, NULL);
+    delta = check_flatviews(qts, &last);
+    g_assert_cmpint(delta.commits, >, 0);
+    g_assert_cmpint(delta.updated, >, 0);
+
+    /* Move the MMIO BAR */
+    qpci_config_writel(dev, PCI_BASE_ADDRESS_0,
+                       bar0.addr + MAX(size, 0x10000));
+    check_flatviews(qts, &last);
+
+    /* Unmap and map again the MMIO BAR */
+    set_command(dev, PCI_COMMAND_MEMORY, false);
+    check_flatviews(qts, &last);
+    set_command(dev, PCI_COMMAND_MEMORY, true);
+    check_flatviews(qts, &last);
+
+    /*
+     * Bus mastering only enables the alias in the device's own address
+     * space, so nothing else may be updated.
+     */
+    set_command(dev, PCI_COMMAND_MASTER, false);
+    delta = check_flatviews(qts, &last);
+    g_assert_cmpint(delta.commits, ==, 1);
+    g_assert_cmpint(delta.updated, ==, 1);
+    g_assert_cmpint(delta.rendered, <=, 1);
+    set_command(dev, PCI_COMMAND_MASTER, true);
+    delta = check_flatviews(qts, &last);
+    g_assert_cmpint(delta.commits, ==, 1);
+    g_assert_cmpint(delta.updated, ==, 1);
+    g_assert_cmpint(delta.rendered, <=, 1);
+
+    /* Add and remove a whole device with its address space */
+    qtest_qmp_device_add(qts, "pci-testdev", "dev1", "{'addr': %s}",
+                         stringify(HOTPLUG_SLOT));
+    check_flatviews(qts, &last);
+    qpci_unplug_acpi_device_test(qts, "dev1", HOTPLUG_SLOT);
+    check_flatviews(qts, &last);
+
+    g_free(dev);
+    qpci_free_pc(pcibus);
+    qtest_quit(qts);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+
+    qtest_add_func("/memory/flatview-update", test_flatview_update);
+
+    return g_test_run();
+}
@@ -801,6 +801,7 @@ static void test_precopy_unix_common(bool dirty_ring)
     g_autofree char *uri = g_strdup_printf("unix:%s/migsocket", tmpfs);
     MigrateStart *args = migrate_start_new();
     QTestState *from, *to;
+    QDict *rsp_return;
 
     args->use_dirty_ring = dirty_ring;
 
@@ -816,6 +817,7 @@ static void test_precopy_unix_common(bool dirty_ring)
     migrate_set_parameter_int(from, "downtime-limit", 1);
     /* 1GB/s */
     migrate_set_parameter_int(from, "max-bandwidth", 1000000000);
+    migrate_set_parameter_int(from, "bitmap-sync-threads", 2);
 
     /* Wait for the first serial output from the source */
     wait_for_serial("src_serial");
@@ -824,6 +826,12 @@ static void test_precopy_unix_common(bool dirty_ring)
 
     wait_for_migration_pass(from);
 
+    /* Every iteration reports how long its bitmap sync took */
+    rsp_return = migrate_query(from);
+    g_assert(qdict_haskey(qdict_get_qdict(rsp_return, "ram"),
+                          "dirty-sync-duration"));
+    qobject_unref(rsp_return);
+
     migrate_set_parameter_int(from, "downtime-limit", CONVERGE_DOWNTIME);
 
     if (!got_stop) {
@@ -850,6 +858,82 @@ static void test_precopy_unix_dirty_ring(void)
     test_precopy_unix_common(true);
 }
 
+/*
+ * Compare the byte that the guest increments in each page; both sides
+ * must be stopped.
+ */
+static void check_guests_ram_equal(QTestState *from, QTestState *to)
+{
+    unsigned address;
+    int bad = 0;
+
+    for (address = start_address; address < end_address;
+         address += TEST_MEM_PAGE_SIZE) {
+        uint8_t src_byte, dest_byte;
+
+        qtest_memread(from, address, &src_byte, 1);
+        qtest_memread(to, address, &dest_byte, 1);
+        if (src_byte != dest_byte) {
+            if (++bad <= 10) {
+                fprintf(stderr, "Memory differs at %x: source %x"
+                        " destination %x\n", address, src_byte, dest_byte);
+            }
+        }
+    }
+    g_assert_cmpint(bad, ==, 0);
+}
+
+/*
+ * Let the guest dirty its memory during the first iterations, so that
+ * the bitmap syncs have work to do, then stop it and let the migration
+ * converge.  A page dirtied by the guest that a sync missed would be
+ * stale on the destination, whatever the number of sync threads.
+ *
+ * The guest RAM is much smaller than the default sync chunk, so shrink
+ * the chunks to 64 pages: the RAM then spans hundreds of chunks, which
+ * the threads share.
+ */
+static void test_precopy_sync_threads(gconstpointer opaque)
+{
+    int threads = GPOINTER_TO_INT(opaque);
+    g_autofree char *uri = g_strdup_printf("unix:%s/migsocket", tmpfs);
+    MigrateStart *args = migrate_start_new();
+    QTestState *from, *to;
+
+    g_free(args->opts_source);
+    args->opts_source =
+        g_strdup("-global migration.x-bitmap-sync-chunk-shift=6");
+    if (test_migrate_start(&from, &to, uri, args)) {
+        return;
+    }
+
+    migrate_set_parameter_int(from, "downtime-limit", 1);
+    migrate_set_parameter_int(from, "max-bandwidth", 100000000);
+    migrate_set_parameter_int(from, "bitmap-sync-threads", threads);
+
+    wait_for_serial("src_serial");
+
+    migrate_qmp(from, uri, "{}");
+
+    wait_for_migration_pass(from);
+    wait_for_migration_pass(from);
+
+    qtest_qmp_discard_response(from, "{ 'execute' : 'stop'}");
+    if (!got_stop) {
+        qtest_qmp_eventwait(from, "STOP");
+    }
+    migrate_set_parameter_int(from, "max-bandwidth", 1000000000);
+    migrate_set_parameter_int(from, "downtime-limit", CONVERGE_DOWNTIME);
+
+    wait_for_migration_complete(from);
+
+    /* The source was stopped, so the destination stays stopped too */
+    check_guests_ram_equal(from, to);
+    check_guests_ram(to);
+
+    test_migrate_end(from, to, false);
+}
+
 #if 0
 /* Currently upset on aarch64 TCG */
 static void test_ignore_shared(void)
@@ -982,6 +1066,76 @@ static void test_precopy_tcp(void)
     test_migrate_end(from, to, true);
 }
 
+static void test_precopy_file_common(bool lazy_restore)
+{
+    g_autofree char *uri = g_strdup_printf("file:%s/migfile", tmpfs);
+    MigrateStart *args = migrate_start_new();
+    QTestState *from, *to;
+    QDict *rsp;
+
+    if (test_migrate_start(&from, &to, "defer", args)) {
+        return;
+    }
+
+    /*
+     * We want to pick a speed slow enough that the test completes
+     * quickly, but that it doesn't complete precopy even on a slow
+     * machine, so also set the downtime.
+     */
+    /* 1 ms should make it not converge*/
+    migrate_set_parameter_int(from, "downtime-limit", 1);
+    /* 1GB/s */
+    migrate_set_parameter_int(from, "max-bandwidth", 1000000000);
+
+    migrate_set_parameter_int(to, "mapped-ram-threads", 4);
+
+    migrate_set_capability(from, "mapped-ram", true);
+    migrate_set_capability(to, "mapped-ram", true);
+    if (lazy_restore) {
+        migrate_set_capability(to, "lazy-restore", true);
+    }
+
+    /* Wait for the first serial output from the source */
+    wait_for_serial("src_serial");
+
+    migrate_qmp(from, uri, "{}");
+
+    /* Pages dirtied after the first pass get rewritten in place */
+    wait_for_migration_pass(from);
+
+    migrate_set_parameter_int(from, "downtime-limit", CONVERGE_DOWNTIME);
+
+    if (!got_stop) {
+        qtest_qmp_eventwait(from, "STOP");
+    }
+    wait_for_migration_complete(from);
+
+    /* The file is only complete once the source is done */
+    rsp = wait_command(to, "{ 'execute': 'migrate-incoming',"
+                           "  'arguments': { 'uri': %s }}", uri);
+    qobject_unref(rsp);
+    qtest_qmp_eventwait(to, "RESUME");
+
+    wait_for_serial("dest_serial");
+    if (lazy_restore) {
+        /* Completes once the remaining RAM is loaded in the background */
+        wait_for_migration_complete(to);
+    }
+
+    test_migrate_end(from, to, true);
+    cleanup("migfile");
+}
+
+static void test_precopy_file_mapped_ram(void)
+{
+    test_precopy_file_common(false);
+}
+
+static void test_precopy_file_lazy_restore(void)
+{
+    test_precopy_file_common(true);
+}
+
 static void test_migrate_fd_proto(void)
 {
     MigrateStart *args = migrate_start_new();
@@ -1225,6 +1379,66 @@ static void test_migrate_auto_converge(void)
     test_migrate_end(from, to, true);
 }
 
+static bool migrate_has_vcpu_dirty_rate(QTestState *who)
+{
+    QDict *rsp_return;
+    bool result;
+
+    rsp_return = migrate_query(who);
+    result = qdict_haskey(rsp_return, "vcpu-dirty-rate");
+    qobject_unref(rsp_return);
+    return result;
+}
+
+static void test_migrate_dirty_limit(void)
+{
+    g_autofree char *uri = g_strdup_printf("unix:%s/migsocket", tmpfs);
+    MigrateStart *args = migrate_start_new();
+    QTestState *from, *to;
+
+    args->use_dirty_ring = true;
+
+    if (test_migrate_start(&from, &to, uri, args)) {
+        return;
+    }
+
+    migrate_set_capability(from, "dirty-limit", true);
+    migrate_set_parameter_int(from, "vcpu-dirty-limit", 1);
+
+    /*
+     * Set the initial parameters so that the migration could not converge
+     * without throttling.
+     */
+    migrate_set_parameter_int(from, "downtime-limit", 1);
+    migrate_set_parameter_int(from, "max-bandwidth", 100000000); /* ~100Mb/s */
+
+    /* Wait for the first serial output from the source */
+    wait_for_serial("src_serial");
+
+    migrate_qmp(from, uri, "{}");
+
+    /* Wait for the dirty limit to kick in and report vCPU dirty rates */
+    while (!migrate_has_vcpu_dirty_rate(from)) {
+        usleep(1000);
+        g_assert_false(got_stop);
+    }
+
+    /* Now, when we tested that throttling works, let it converge */
+    migrate_set_parameter_int(from, "downtime-limit", CONVERGE_DOWNTIME);
+    migrate_set_parameter_int(from, "max-bandwidth", 1000000000);
+
+    if (!got_stop) {
+        qtest_qmp_eventwait(from, "STOP");
+    }
+
+    qtest_qmp_eventwait(to, "RESUME");
+
+    wait_for_serial("dest_serial");
+    wait_for_migration_complete(from);
+
+    test_migrate_end(from, to, true);
+}
+
 static void test_multifd_tcp(const char *method)
 {
     MigrateStart *args = migrate_start_new();
@@ -1468,10 +1682,18 @@ int main(int argc, char **argv)
     qtest_add_func("/migration/postcopy/recovery", test_postcopy_recovery);
     qtest_add_func("/migration/bad_dest", test_baddest);
     qtest_add_func("/migration/precopy/unix", test_precopy_unix);
+    qtest_add_data_func("/migration/precopy/sync-threads/1",
+                        GINT_TO_POINTER(1), test_precopy_sync_threads);
+    qtest_add_data_func("/migration/precopy/sync-threads/4",
+                        GINT_TO_POINTER(4), test_precopy_sync_threads);
     qtest_add_func("/migration/precopy/tcp", test_precopy_tcp);
     /* qtest_add_func("/migration/ignore_shared", test_ignore_shared); */
     qtest_add_func("/migration/xbzrle/unix", test_xbzrle_unix);
     qtest_add_func("/migration/fd_proto", test_migrate_fd_proto);
+    qtest_add_func("/migration/precopy/file/mapped-ram",
+                   test_precopy_file_mapped_ram);
+    qtest_add_func("/migration/precopy/file/lazy-restore",
+                   test_precopy_file_lazy_restore);
     qtest_add_func("/migration/validate_uuid", test_validate_uuid);
     qtest_add_func("/migration/validate_uuid_error", test_validate_uuid_error);
     qtest_add_func("/migration/validate_uuid_src_not_set",
@@ -1490,6 +1712,8 @@ int main(int argc, char **argv)
     if (kvm_dirty_ring_supported()) {
         qtest_add_func("/migration/dirty_ring",
                        test_precopy_unix_dirty_ring);
+        qtest_add_func("/migration/dirty_limit",
+                       test_migrate_dirty_limit);
     }
 
     ret = g_test_run();
@@ -174,10 +174,47 @@ static void remove_netdev_with_multi_netfilter(void)
     qobject_unref(response);
 }
 
+/*
+ * add a colo-compare with its own compare threads and then remove it,
+ * twice so that the threads of the second one reuse the same names
+ */
+static void add_colo_compare_threads(void)
+{
+    QDict *response;
+    int i;
+
+    for (i = 0; i < 2; i++) {
+        response = qmp("{'execute': 'object-add',"
+                       " 'arguments': {"
+                       "   'qom-type': 'colo-compare',"
+                       "   'id': 'qtest-cc0',"
+                       "   'primary_in': 'qtest-pri0',"
+                       "   'secondary_in': 'qtest-sec0',"
+                       "   'outdev': 'qtest-out0',"
+                       "   'iothread': 'qtest-io0',"
+                       "   'compare_threads': 2"
+                       "}}");
+        g_assert(response);
+        g_assert(!qdict_haskey(response, "error"));
+        qobject_unref(response);
+
+        response = qmp("{'execute': 'object-del',"
+                       " 'arguments': {"
+                       "   'id': 'qtest-cc0'"
+                       "}}");
+        g_assert(response);
+        g_assert(!qdict_haskey(response, "error"));
+        qobject_unref(response);
+    }
+}
+
 int main(int argc, char **argv)
 {
     int ret;
     char *args;
+    char *tmpdir;
+    static const char *const socks[] = { "pri", "sec", "out" };
+    int i;
     const char *devstr = "e1000";
 
     if (g_str_equal(qtest_get_arch(), "s390x")) {
@@ -191,14 +228,36 @@ int main(int argc, char **argv)
     qtest_add_func("/netfilter/addremove_multi", add_multi_netfilter);
     qtest_add_func("/netfilter/remove_netdev_multi",
                    remove_netdev_with_multi_netfilter);
+    qtest_add_func("/netfilter/colo_compare_threads",
+                   add_colo_compare_threads);
+
+    /* colo-compare needs reconnectable chardevs */
+    tmpdir = g_dir_make_tmp("qtest-netfilter-XXXXXX", NULL);
+    g_assert(tmpdir);
 
     args = g_strdup_printf("-netdev user,id=qtest-bn0 "
-                           "-device %s,netdev=qtest-bn0", devstr);
+                           "-device %s,netdev=qtest-bn0 "
+                           "-chardev socket,id=qtest-pri0,path=%s/pri,"
+                           "server=on,wait=off "
+                           "-chardev socket,id=qtest-sec0,path=%s/sec,"
+                           "server=on,wait=off "
+                           "-chardev socket,id=qtest-out0,path=%s/out,"
+                           "server=on,wait=off "
+                           "-object iothread,id=qtest-io0",
+                           devstr, tmpdir, tmpdir, tmpdir);
     qtest_start(args);
     ret = g_test_run();
 
     qtest_end();
     g_free(args);
 
+    for (i = 0; i < ARRAY_SIZE(socks); i++) {
+        g_autofree char *path = g_strdup_printf("%s/%s", tmpdir, socks[i]);
+
+        unlink(path);
+    }
+    g_rmdir(tmpdir);
+    g_free(tmpdir);
+
     return ret;
 }
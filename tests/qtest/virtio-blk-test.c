@@ -433,6 +433,124 @@ static void indirect(void *obj, void *u_data, QGuestAllocator *t_alloc)
     qvirtqueue_cleanup(dev->bus, vq, t_alloc);
 }
 
+/* The legacy VGA and BIOS hole of PC machines */
+#define PC_RAM_HOLE_START       0xa0000
+
+static void indirect_desc_init(QTestState *qts, QVirtioDevice *dev,
+                               QVRingIndirectDesc *indirect, uint64_t addr)
+{
+    int i;
+
+    *indirect = (QVRingIndirectDesc) { .desc = addr, .elem = 3 };
+    for (i = 0; i < indirect->elem; i++) {
+        qvirtio_writew(dev, qts, addr + (16 * i) + 12,
+                       i < indirect->elem - 1 ? VRING_DESC_F_NEXT : 0);
+        qvirtio_writew(dev, qts, addr + (16 * i) + 14, i + 1);
+    }
+}
+
+/*
+ * Split requests between the RAM just below the hole at 640 KiB and the
+ * RAM above it, so that the device maps buffers on both sides of the
+ * hole in turn.
+ */
+static void ram_hole(void *obj, void *u_data, QGuestAllocator *t_alloc)
+{
+    QVirtQueue *vq;
+    QVirtioBlk *blk_if = obj;
+    QVirtioDevice *dev = blk_if->vdev;
+    QVirtioBlkReq req;
+    QVRingIndirectDesc indirect;
+    uint64_t low_table = PC_RAM_HOLE_START - 3 * 16;
+    uint64_t low_hdr = PC_RAM_HOLE_START - 0x1000;
+    uint64_t low_data = PC_RAM_HOLE_START - 512 - 3 * 16;
+    uint64_t low_status = PC_RAM_HOLE_START - 0x800;
+    uint64_t high_table, high_hdr, high_data, high_status;
+    uint64_t features;
+    uint32_t free_head;
+    char *data;
+    QTestState *qts = global_qtest;
+
+    if (strcmp(qtest_get_arch(), "i386") &&
+        strcmp(qtest_get_arch(), "x86_64")) {
+        g_test_skip("No RAM hole at 640 KiB on this machine");
+        return;
+    }
+
+    features = qvirtio_get_features(dev);
+    features = features & ~(QVIRTIO_F_BAD_FEATURE |
+                            (1u << VIRTIO_RING_F_EVENT_IDX) |
+                            (1u << VIRTIO_BLK_F_SCSI));
+    qvirtio_set_features(dev, features);
+
+    vq = qvirtqueue_setup(dev, t_alloc, 0);
+    qvirtio_set_driver_ok(dev);
+
+    /* Above the hole, as the allocator starts at 1 MiB */
+    high_table = guest_alloc(t_alloc, 3 * 16);
+    high_hdr = guest_alloc(t_alloc, 16);
+    high_data = guest_alloc(t_alloc, 512);
+    high_status = guest_alloc(t_alloc, 1);
+    g_assert_cmphex(high_table, >=, 0x100000);
+
+    /* Write request: table and header below the hole, data above it */
+    req = (QVirtioBlkReq) {
+        .type = VIRTIO_BLK_T_OUT,
+        .ioprio = 1,
+        .sector = 0,
+    };
+    virtio_blk_fix_request(dev, &req);
+    memwrite(low_hdr, &req, 16);
+    data = g_malloc0(512);
+    strcpy(data, "TEST");
+    memwrite(high_data, data, 512);
+    writeb(low_status, 0xff);
+
+    indirect_desc_init(qts, dev, &indirect, low_table);
+    qvring_indirect_desc_add(dev, qts, &indirect, low_hdr, 16, false);
+    qvring_indirect_desc_add(dev, qts, &indirect, high_data, 512, false);
+    qvring_indirect_desc_add(dev, qts, &indirect, low_status, 1, true);
+    free_head = qvirtqueue_add_indirect(qts, vq, &indirect);
+    qvirtqueue_kick(qts, dev, vq, free_head);
+
+    qvirtio_wait_used_elem(qts, dev, vq, free_head, NULL,
+                           QVIRTIO_BLK_TIMEOUT_US);
+    g_assert_cmpint(readb(low_status), ==, 0);
+
+    /* Read request: table and header above the hole, data right below it */
+    req = (QVirtioBlkReq) {
+        .type = VIRTIO_BLK_T_IN,
+        .ioprio = 1,
+        .sector = 0,
+    };
+    virtio_blk_fix_request(dev, &req);
+    memwrite(high_hdr, &req, 16);
+    memset(data, 0, 512);
+    memwrite(low_data, data, 512);
+    writeb(high_status, 0xff);
+
+    indirect_desc_init(qts, dev, &indirect, high_table);
+    qvring_indirect_desc_add(dev, qts, &indirect, high_hdr, 16, false);
+    qvring_indirect_desc_add(dev, qts, &indirect, low_data, 512, true);
+    qvring_indirect_desc_add(dev, qts, &indirect, high_status, 1, true);
+    free_head = qvirtqueue_add_indirect(qts, vq, &indirect);
+    qvirtqueue_kick(qts, dev, vq, free_head);
+
+    qvirtio_wait_used_elem(qts, dev, vq, free_head, NULL,
+                           QVIRTIO_BLK_TIMEOUT_US);
+    g_assert_cmpint(readb(high_status), ==, 0);
+
+    memread(low_data, data, 512);
+    g_assert_cmpstr(data, ==, "TEST");
+    g_free(data);
+
+    guest_free(t_alloc, high_status);
+    guest_free(t_alloc, high_data);
+    guest_free(t_alloc, high_hdr);
+    guest_free(t_alloc, high_table);
+    qvirtqueue_cleanup(dev->bus, vq, t_alloc);
+}
+
 static void config(void *obj, void *data, QGuestAllocator *t_alloc)
 {
     QVirtioBlk *blk_if = obj;
@@ -797,6 +915,7 @@ static void register_virtio_blk_test(void)
     qos_add_test("nxvirtq", "virtio-blk-pci",
                       test_nonexistent_virtqueue, &opts);
     qos_add_test("hotplug", "virtio-blk-pci", pci_hotplug, &opts);
+    qos_add_test("ram-hole", "virtio-blk-pci", ram_hole, &opts);
 }
 
 libqos_init(register_virtio_blk_test);
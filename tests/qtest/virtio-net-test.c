@@ -10,13 +10,23 @@
 #include "qemu/osdep.h"
 #include "qemu-common.h"
 #include "libqtest-single.h"
+#include "qemu/bswap.h"
 #include "qemu/iov.h"
 #include "qemu/module.h"
 #include "qapi/qmp/qdict.h"
+#include "qapi/qmp/qlist.h"
 #include "hw/virtio/virtio-net.h"
 #include "libqos/qgraph.h"
 #include "libqos/virtio-net.h"
 
+#ifdef CONFIG_LINUX
+#include <linux/if_packet.h>
+#include <linux/if_tun.h>
+#include <net/if.h>
+#include <sys/ioctl.h>
+#include "net/eth.h"
+#endif
+
 #ifndef ETH_P_RARP
 #define ETH_P_RARP 0x8035
 #endif
@@ -144,6 +154,65 @@ static void rx_stop_cont_test(QVirtioDevice *dev,
     guest_free(alloc, req_addr);
 }
 
+/* Wait until the "incoming queue" counters of "info network" are @stats */
+static void wait_incoming_queue(QTestState *qts, const char *stats)
+{
+    gint64 deadline = g_get_monotonic_time() + QVIRTIO_NET_TIMEOUT_US;
+    g_autofree char *line = g_strdup_printf("incoming queue: %s\n", stats);
+
+    for (;;) {
+        g_autofree char *info = qtest_hmp(qts, "info network");
+
+        if (strstr(info, line)) {
+            return;
+        }
+        g_assert_cmpint(g_get_monotonic_time(), <, deadline);
+        g_usleep(1000);
+    }
+}
+
+/*
+ * Without rx buffers, the device queues the packet of the backend, which
+ * then stops sending until the packet is delivered.
+ */
+static void rx_queue_stats_test(QVirtioDevice *dev,
+                                QGuestAllocator *alloc, QVirtQueue *vq,
+                                int socket)
+{
+    QTestState *qts = global_qtest;
+    uint64_t req_addr;
+    uint32_t free_head;
+    char test[] = "TEST";
+    char buffer[64];
+    int len = htonl(sizeof(test));
+    struct iovec iov[] = {
+        {
+            .iov_base = &len,
+            .iov_len = sizeof(len),
+        }, {
+            .iov_base = test,
+            .iov_len = sizeof(test),
+        },
+    };
+    int ret;
+
+    ret = iov_send(socket, iov, 2, 0, sizeof(len) + sizeof(test));
+    g_assert_cmpint(ret, ==, sizeof(test) + sizeof(len));
+    wait_incoming_queue(qts, "len=1,peak=1,queued=1,dropped=0,allocated=0");
+
+    req_addr = guest_alloc(alloc, 64);
+    free_head = qvirtqueue_add(qts, vq, req_addr, 64, true, false);
+    qvirtqueue_kick(qts, dev, vq, free_head);
+
+    qvirtio_wait_used_elem(qts, dev, vq, free_head, NULL,
+                           QVIRTIO_NET_TIMEOUT_US);
+    memread(req_addr + VNET_HDR_SIZE, buffer, sizeof(test));
+    g_assert_cmpstr(buffer, ==, "TEST");
+    wait_incoming_queue(qts, "len=0,peak=1,queued=1,dropped=0,allocated=0");
+
+    guest_free(alloc, req_addr);
+}
+
 static void send_recv_test(void *obj, void *data, QGuestAllocator *t_alloc)
 {
     QVirtioNet *net_if = obj;
@@ -166,6 +235,718 @@ static void stop_cont_test(void *obj, void *data, QGuestAllocator *t_alloc)
     rx_stop_cont_test(dev, t_alloc, rx, sv[0]);
 }
 
+static void queue_stats_test(void *obj, void *data, QGuestAllocator *t_alloc)
+{
+    QVirtioNet *net_if = obj;
+    QVirtioDevice *dev = net_if->vdev;
+    QVirtQueue *rx = net_if->queues[0];
+    int *sv = data;
+
+    rx_queue_stats_test(dev, t_alloc, rx, sv[0]);
+}
+
+#endif
+
+#ifdef CONFIG_LINUX
+
+typedef struct TapTestData {
+    int tap_fd;
+    /* Packet socket sending frames out of the tap, i.e. to QEMU */
+    int pkt_fd;
+    /* Zero if the tap could not be set up */
+    int ifindex;
+    /* The veth pair of af-xdp tests is named after its QEMU end */
+    char veth[IFNAMSIZ];
+    /* filter-drop tests expect the tap to run the filter with eBPF */
+    bool filter_ebpf;
+} TapTestData;
+
+static void send_frame(TapTestData *t, const uint8_t *frame, size_t len)
+{
+    struct sockaddr_ll sll = {
+        .sll_family = AF_PACKET,
+        .sll_ifindex = t->ifindex,
+        .sll_halen = ETH_ALEN,
+    };
+    ssize_t ret;
+
+    memcpy(sll.sll_addr, frame, ETH_ALEN);
+    ret = sendto(t->pkt_fd, frame, len, 0, (struct sockaddr *)&sll,
+                 sizeof(sll));
+    g_assert_cmpint(ret, ==, len);
+}
+
+/* Returns the ack of the device */
+static uint8_t ctrl_cmd(QVirtioNet *net_if, QGuestAllocator *alloc,
+                        const uint8_t *cmd, size_t len)
+{
+    QTestState *qts = global_qtest;
+    QVirtioDevice *dev = net_if->vdev;
+    QVirtQueue *ctrl = net_if->queues[net_if->n_queues - 1];
+    uint64_t req_addr;
+    uint32_t free_head;
+    uint8_t ack;
+
+    req_addr = guest_alloc(alloc, len + 1);
+    memwrite(req_addr, cmd, len);
+    writeb(req_addr + len, VIRTIO_NET_ERR);
+
+    free_head = qvirtqueue_add(qts, ctrl, req_addr, len, false, true);
+    qvirtqueue_add(qts, ctrl, req_addr + len, 1, true, false);
+    qvirtqueue_kick(qts, dev, ctrl, free_head);
+    qvirtio_wait_used_elem(qts, dev, ctrl, free_head, NULL,
+                           QVIRTIO_NET_TIMEOUT_US);
+    ack = readb(req_addr + len);
+
+    guest_free(alloc, req_addr);
+    return ack;
+}
+
+static void ctrl_rx_promisc(QVirtioNet *net_if, QGuestAllocator *alloc,
+                            bool on)
+{
+    uint8_t cmd[] = { VIRTIO_NET_CTRL_RX, VIRTIO_NET_CTRL_RX_PROMISC, on };
+
+    g_assert_cmpint(ctrl_cmd(net_if, alloc, cmd, sizeof(cmd)), ==,
+                    VIRTIO_NET_OK);
+}
+
+/*
+ * With promiscuous mode off, a frame for another MAC address must not
+ * reach the guest, not even transiently: the tap must not read it into
+ * a guest rx buffer before the rx filter has run.
+ */
+static void rx_filter_test(void *obj, void *data, QGuestAllocator *t_alloc)
+{
+    QVirtioNet *net_if = obj;
+    QVirtioDevice *dev = net_if->vdev;
+    QVirtQueue *rx = net_if->queues[0];
+    QTestState *qts = global_qtest;
+    TapTestData *t = data;
+    static const uint8_t other_mac[] = { 0x52, 0x54, 0x00, 0xab, 0xcd, 0xef };
+    uint8_t drop[200], pass[64], buffer[256];
+    uint64_t req_addr;
+    uint32_t free_head, len;
+    int i;
+
+    if (!t->ifindex) {
+        g_test_skip("Could not set up a tap device");
+        return;
+    }
+
+    ctrl_rx_promisc(net_if, t_alloc, false);
+
+    memset(drop, 0xdd, sizeof(drop));
+    memcpy(drop, other_mac, ETH_ALEN);
+    memset(pass, 0xaa, sizeof(pass));
+    for (i = 0; i < ETH_ALEN; i++) {
+        pass[i] = qvirtio_config_readb(dev, i);
+    }
+
+    req_addr = guest_alloc(t_alloc, sizeof(buffer));
+    qtest_memset(qts, req_addr, 0, sizeof(buffer));
+    free_head = qvirtqueue_add(qts, rx, req_addr, sizeof(buffer), true, false);
+    qvirtqueue_kick(qts, dev, rx, free_head);
+
+    /* Frames are received in order, so the first one was dropped */
+    send_frame(t, drop, sizeof(drop));
+    send_frame(t, pass, sizeof(pass));
+
+    qvirtio_wait_used_elem(qts, dev, rx, free_head, &len,
+                           QVIRTIO_NET_TIMEOUT_US);
+    g_assert_cmpint(len, ==, VNET_HDR_SIZE + sizeof(pass));
+
+    memread(req_addr, buffer, sizeof(buffer));
+    g_assert(!memcmp(buffer + VNET_HDR_SIZE, pass, sizeof(pass)));
+    for (i = VNET_HDR_SIZE + sizeof(pass); i < sizeof(buffer); i++) {
+        g_assert_cmphex(buffer[i], ==, 0);
+    }
+
+    guest_free(t_alloc, req_addr);
+}
+
+/* Packet socket receiving the frames of type @proto that QEMU writes */
+static int tap_packet_socket(TapTestData *t, uint16_t proto)
+{
+    struct sockaddr_ll sll = {
+        .sll_family = AF_PACKET,
+        .sll_protocol = htons(proto),
+        .sll_ifindex = t->ifindex,
+    };
+    struct timeval tv = { .tv_sec = 30 };
+    int fd;
+
+    fd = socket(AF_PACKET, SOCK_RAW, htons(proto));
+    g_assert_cmpint(fd, >=, 0);
+    g_assert_cmpint(bind(fd, (struct sockaddr *)&sll, sizeof(sll)), ==, 0);
+    g_assert_cmpint(setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)),
+                    ==, 0);
+    return fd;
+}
+
+#define TX_BATCH_PACKETS 32
+#define TX_BATCH_ETH_P 0x88b5   /* local experimental */
+
+static void tx_batch_frame(uint8_t *frame, size_t len, int seq)
+{
+    static const uint8_t src_mac[] = { 0x52, 0x54, 0x00, 0x12, 0x34, 0x56 };
+
+    memset(frame, 0xff, ETH_ALEN);
+    memcpy(frame + ETH_ALEN, src_mac, ETH_ALEN);
+    stw_be_p(frame + 2 * ETH_ALEN, TX_BATCH_ETH_P);
+    memset(frame + ETH_HLEN, seq, len - ETH_HLEN);
+}
+
+/*
+ * Packets that the guest sends in one go are written to the tap as a
+ * batch, with io_uring unless tx-uring=off.  The latter is also the
+ * fallback when the ring cannot be set up.  Either way, all the packets
+ * must come out of the tap, in order.
+ */
+static void tx_batch_test(void *obj, void *data, QGuestAllocator *t_alloc)
+{
+    QVirtioNet *net_if = obj;
+    QVirtioDevice *dev = net_if->vdev;
+    QVirtQueue *tx = net_if->queues[1];
+    QTestState *qts = global_qtest;
+    TapTestData *t = data;
+    uint8_t frame[128], buffer[sizeof(frame)];
+    uint64_t req_addr[TX_BATCH_PACKETS];
+    uint32_t free_head[TX_BATCH_PACKETS];
+    QDict *rsp;
+    ssize_t len;
+    int fd, i;
+
+    if (!t->ifindex) {
+        g_test_skip("Could not set up a tap device");
+        return;
+    }
+
+    fd = tap_packet_socket(t, TX_BATCH_ETH_P);
+
+    /* While the VM is stopped the device does not transmit */
+    rsp = qmp("{ 'execute' : 'stop'}");
+    qobject_unref(rsp);
+
+    for (i = 0; i < TX_BATCH_PACKETS; i++) {
+        req_addr[i] = guest_alloc(t_alloc, VNET_HDR_SIZE + sizeof(frame));
+        qtest_memset(qts, req_addr[i], 0, VNET_HDR_SIZE);
+        tx_batch_frame(frame, sizeof(frame), i);
+        memwrite(req_addr[i] + VNET_HDR_SIZE, frame, sizeof(frame));
+        free_head[i] = qvirtqueue_add(qts, tx, req_addr[i],
+                                      VNET_HDR_SIZE + sizeof(frame),
+                                      false, false);
+        qvirtqueue_kick(qts, dev, tx, free_head[i]);
+    }
+
+    rsp = qmp("{ 'execute' : 'cont'}");
+    qobject_unref(rsp);
+
+    for (i = 0; i < TX_BATCH_PACKETS; i++) {
+        qvirtio_wait_used_elem(qts, dev, tx, free_head[i], NULL,
+                               QVIRTIO_NET_TIMEOUT_US);
+        guest_free(t_alloc, req_addr[i]);
+    }
+
+    for (i = 0; i < TX_BATCH_PACKETS; i++) {
+        len = recv(fd, buffer, sizeof(buffer), 0);
+        g_assert_cmpint(len, ==, sizeof(frame));
+        tx_batch_frame(frame, sizeof(frame), i);
+        g_assert(!memcmp(buffer, frame, sizeof(frame)));
+    }
+
+    close(fd);
+}
+
+/*
+ * With the queue pair serviced by an IOThread, the main loop sends self
+ * announcements while the guest transmits and receives.
+ */
+static void iothread_test(void *obj, void *data, QGuestAllocator *t_alloc)
+{
+    QVirtioNet *net_if = obj;
+    QVirtioDevice *dev = net_if->vdev;
+    QVirtQueue *rx = net_if->queues[0];
+    QVirtQueue *tx = net_if->queues[1];
+    QTestState *qts = global_qtest;
+    TapTestData *t = data;
+    uint8_t frame[128], buffer[VNET_HDR_SIZE + sizeof(frame)];
+    uint64_t rx_addr, tx_addr;
+    uint32_t rx_head, tx_head, len;
+    int rarp_fd, tx_fd, i;
+    QDict *rsp;
+
+    if (!t->ifindex) {
+        g_test_skip("Could not set up a tap device");
+        return;
+    }
+
+    rarp_fd = tap_packet_socket(t, ETH_P_RARP);
+    tx_fd = tap_packet_socket(t, TX_BATCH_ETH_P);
+
+    rsp = qmp("{ 'execute' : 'announce-self', "
+                  " 'arguments': {"
+                      " 'initial': 10, 'max': 50,"
+                      " 'rounds': 20, 'step': 10 } }");
+    g_assert(!qdict_haskey(rsp, "error"));
+    qobject_unref(rsp);
+
+    rx_addr = guest_alloc(t_alloc, sizeof(buffer));
+    rx_head = qvirtqueue_add(qts, rx, rx_addr, sizeof(buffer), true, false);
+    qvirtqueue_kick(qts, dev, rx, rx_head);
+
+    tx_addr = guest_alloc(t_alloc, sizeof(buffer));
+    qtest_memset(qts, tx_addr, 0, VNET_HDR_SIZE);
+    tx_batch_frame(frame, sizeof(frame), 1);
+    memwrite(tx_addr + VNET_HDR_SIZE, frame, sizeof(frame));
+    tx_head = qvirtqueue_add(qts, tx, tx_addr, sizeof(buffer), false, false);
+    qvirtqueue_kick(qts, dev, tx, tx_head);
+
+    /*
+     * The device is promiscuous until the guest says otherwise.  Use
+     * another type, so that tx_fd does not see the frame go out.
+     */
+    tx_batch_frame(frame, sizeof(frame), 2);
+    for (i = 0; i < ETH_ALEN; i++) {
+        frame[i] = qvirtio_config_readb(dev, i);
+    }
+    stw_be_p(frame + 2 * ETH_ALEN, TX_BATCH_ETH_P + 1);
+    send_frame(t, frame, sizeof(frame));
+
+    qvirtio_wait_used_elem(qts, dev, tx, tx_head, NULL,
+                           QVIRTIO_NET_TIMEOUT_US);
+    g_assert_cmpint(recv(tx_fd, buffer, sizeof(buffer), 0), ==,
+                    sizeof(frame));
+    g_assert_cmphex(buffer[ETH_HLEN], ==, 1);
+
+    qvirtio_wait_used_elem(qts, dev, rx, rx_head, &len,
+                           QVIRTIO_NET_TIMEOUT_US);
+    g_assert_cmpint(len, ==, VNET_HDR_SIZE + sizeof(frame));
+    memread(rx_addr + VNET_HDR_SIZE, buffer, sizeof(frame));
+    g_assert(!memcmp(buffer, frame, sizeof(frame)));
+
+    g_assert_cmpint(recv(rarp_fd, buffer, sizeof(buffer), 0), >=, ETH_HLEN);
+    g_assert_cmphex(lduw_be_p(buffer + 2 * ETH_ALEN), ==, ETH_P_RARP);
+
+    guest_free(t_alloc, tx_addr);
+    guest_free(t_alloc, rx_addr);
+    close(tx_fd);
+    close(rarp_fd);
+}
+
+/* filter-drop,ip_proto=17,port=5353 drops the frames with !pass */
+static const struct {
+    uint16_t ethertype;
+    uint8_t ihl;            /* IPv4 header length, in words */
+    uint16_t frag;          /* IPv4 fragment offset */
+    uint8_t ip_proto;
+    uint16_t port;
+    size_t len;             /* truncated length, or 0 */
+    bool pass;
+} filter_drop_frames[] = {
+    { ETH_P_IP, 5, 0, IP_PROTO_UDP, 5353, 0, false },
+    { ETH_P_IP, 5, 0, IP_PROTO_UDP, 53, 0, true },
+    { ETH_P_IP, 5, 0, IP_PROTO_TCP, 5353, 0, true },
+    /* IP options */
+    { ETH_P_IP, 6, 0, IP_PROTO_UDP, 5353, 0, false },
+    /* The ports are in the first fragment only */
+    { ETH_P_IP, 5, 100, IP_PROTO_UDP, 5353, 0, true },
+    { ETH_P_IPV6, 0, 0, IP_PROTO_UDP, 5353, 0, false },
+    { ETH_P_IPV6, 0, 0, IP_PROTO_UDP, 80, 0, true },
+    { ETH_P_ARP, 0, 0, 0, 0, 0, true },
+    /* Frames too short for the fields that the rule looks at */
+    { ETH_P_IP, 5, 0, IP_PROTO_UDP, 5353, ETH_HLEN + 8, true },
+    { ETH_P_IP, 5, 0, IP_PROTO_UDP, 5353, ETH_HLEN + 22, true },
+    { ETH_P_IPV6, 0, 0, IP_PROTO_UDP, 5353, ETH_HLEN + 42, true },
+};
+
+/* The index of the frame is the last byte of the source address */
+static size_t filter_drop_frame(uint8_t *frame, int index)
+{
+    uint8_t *l3 = frame + ETH_HLEN;
+    size_t l4 = 0, len = 28;
+
+    memset(frame, 0, 128);
+    memset(frame, 0xff, ETH_ALEN);
+    frame[ETH_ALEN] = 0x52;
+    frame[ETH_ALEN + 1] = 0x54;
+    frame[ETH_ALEN + 5] = index;
+
+    if (index == ARRAY_SIZE(filter_drop_frames)) {
+        /* The last frame, which always passes */
+        stw_be_p(frame + 2 * ETH_ALEN, TX_BATCH_ETH_P);
+        return ETH_HLEN + len;
+    }
+
+    stw_be_p(frame + 2 * ETH_ALEN, filter_drop_frames[index].ethertype);
+    if (filter_drop_frames[index].ethertype == ETH_P_IP) {
+        l4 = filter_drop_frames[index].ihl * 4;
+        l3[0] = 0x40 | filter_drop_frames[index].ihl;
+        stw_be_p(l3 + 6, filter_drop_frames[index].frag);
+        l3[8] = 64;
+        l3[9] = filter_drop_frames[index].ip_proto;
+    } else if (filter_drop_frames[index].ethertype == ETH_P_IPV6) {
+        l4 = 40;
+        l3[0] = 0x60;
+        l3[6] = filter_drop_frames[index].ip_proto;
+        l3[7] = 64;
+    }
+    if (l4) {
+        stw_be_p(l3 + l4 + 2, filter_drop_frames[index].port);
+        len = l4 + 8 + 16;
+    }
+
+    if (filter_drop_frames[index].len) {
+        return filter_drop_frames[index].len;
+    }
+    return ETH_HLEN + len;
+}
+
+/*
+ * filter-drop runs in the kernel when only offloadable filters are in
+ * front of it, and in QEMU otherwise.  Both must let the same frames
+ * through.  The offloaded property tells which one runs; without eBPF
+ * support, it is always QEMU.
+ */
+static void filter_drop_test(void *obj, void *data, QGuestAllocator *t_alloc)
+{
+    QVirtioNet *net_if = obj;
+    QVirtioDevice *dev = net_if->vdev;
+    QVirtQueue *rx = net_if->queues[0];
+    QTestState *qts = global_qtest;
+    TapTestData *t = data;
+    const int nr_frames = ARRAY_SIZE(filter_drop_frames) + 1;
+    uint64_t req_addr[ARRAY_SIZE(filter_drop_frames) + 1];
+    uint32_t free_head[ARRAY_SIZE(filter_drop_frames) + 1];
+    uint8_t frame[128], buffer[VNET_HDR_SIZE + sizeof(frame)];
+    uint32_t len;
+    size_t frame_len;
+    bool offloaded = false;
+    QDict *rsp;
+    int i, n;
+
+    if (!t->ifindex) {
+        g_test_skip("Could not set up a tap device");
+        return;
+    }
+
+#ifdef CONFIG_EBPF
+    offloaded = t->filter_ebpf;
+#endif
+    rsp = qmp("{ 'execute': 'qom-get',"
+              " 'arguments': { 'path': '/objects/fdrop0',"
+              " 'property': 'offloaded' } }");
+    g_assert_cmpint(qdict_get_bool(rsp, "return"), ==, offloaded);
+    qobject_unref(rsp);
+
+    for (i = 0; i < nr_frames; i++) {
+        req_addr[i] = guest_alloc(t_alloc, sizeof(buffer));
+        free_head[i] = qvirtqueue_add(qts, rx, req_addr[i], sizeof(buffer),
+                                      true, false);
+        qvirtqueue_kick(qts, dev, rx, free_head[i]);
+    }
+
+    for (i = 0; i < nr_frames; i++) {
+        send_frame(t, frame, filter_drop_frame(frame, i));
+    }
+
+    /* The frames that pass fill the buffers in order */
+    for (i = 0, n = 0; i < nr_frames; i++) {
+        if (i < ARRAY_SIZE(filter_drop_frames) && !filter_drop_frames[i].pass) {
+            continue;
+        }
+        frame_len = filter_drop_frame(frame, i);
+        qvirtio_wait_used_elem(qts, dev, rx, free_head[n], &len,
+                               QVIRTIO_NET_TIMEOUT_US);
+        g_assert_cmpint(len, >=, VNET_HDR_SIZE + frame_len);
+        memread(req_addr[n] + VNET_HDR_SIZE, buffer, frame_len);
+        g_assert_cmpint(buffer[ETH_ALEN + 5], ==, i);
+        g_assert(!memcmp(buffer, frame, frame_len));
+        n++;
+    }
+
+    for (i = 0; i < nr_frames; i++) {
+        guest_free(t_alloc, req_addr[i]);
+    }
+}
+
+#ifdef CONFIG_AF_XDP
+/*
+ * The af-xdp backend sends and receives through the other end of a veth
+ * pair, which the test sees like a tap.  The stack of the peer may send
+ * frames of its own, so the guest skips those.
+ */
+static void af_xdp_test(void *obj, void *data, QGuestAllocator *t_alloc)
+{
+    QVirtioNet *net_if = obj;
+    QVirtioDevice *dev = net_if->vdev;
+    QVirtQueue *rx = net_if->queues[0];
+    QTestState *qts = global_qtest;
+    TapTestData *t = data;
+    uint8_t frame[128], buffer[VNET_HDR_SIZE + sizeof(frame)];
+    uint64_t req_addr;
+    uint32_t free_head, len;
+    int i;
+
+    if (!t->ifindex) {
+        g_test_skip("Could not set up a veth pair");
+        return;
+    }
+
+    req_addr = guest_alloc(t_alloc, sizeof(buffer));
+    tx_batch_frame(frame, sizeof(frame), 1);
+    for (i = 0; i < ETH_ALEN; i++) {
+        frame[i] = qvirtio_config_readb(dev, i);
+    }
+    send_frame(t, frame, sizeof(frame));
+
+    do {
+        free_head = qvirtqueue_add(qts, rx, req_addr, sizeof(buffer),
+                                   true, false);
+        qvirtqueue_kick(qts, dev, rx, free_head);
+        qvirtio_wait_used_elem(qts, dev, rx, free_head, &len,
+                               QVIRTIO_NET_TIMEOUT_US);
+        g_assert_cmpint(len, >=, VNET_HDR_SIZE + ETH_HLEN);
+        g_assert_cmpint(len, <=, sizeof(buffer));
+        memread(req_addr + VNET_HDR_SIZE, buffer, len - VNET_HDR_SIZE);
+    } while (lduw_be_p(buffer + 2 * ETH_ALEN) != TX_BATCH_ETH_P);
+    g_assert_cmpint(len, ==, VNET_HDR_SIZE + sizeof(frame));
+    g_assert(!memcmp(buffer, frame, sizeof(frame)));
+
+    guest_free(t_alloc, req_addr);
+
+    /* Many packets at once also fill the tx ring of the socket */
+    tx_batch_test(obj, data, t_alloc);
+}
+#endif
+
+#ifdef CONFIG_VHOST_NET_VDPA
+/*
+ * With x-svq=on, QEMU relays both the data and the control virtqueues.
+ * The vdpa_sim_net device loops the frames that the guest sends back
+ * to it, and the MAC address set through the control virtqueue must
+ * reach the device model as well as the device.
+ */
+static void vdpa_svq_test(void *obj, void *data, QGuestAllocator *t_alloc)
+{
+    QVirtioNet *net_if = obj;
+    QVirtioDevice *dev = net_if->vdev;
+    QVirtQueue *rx = net_if->queues[0];
+    QVirtQueue *tx = net_if->queues[1];
+    QTestState *qts = global_qtest;
+    static const uint8_t mac[] = { 0x52, 0x54, 0x00, 0x12, 0x34, 0x99 };
+    uint8_t cmd[2 + ETH_ALEN] = {
+        VIRTIO_NET_CTRL_MAC, VIRTIO_NET_CTRL_MAC_ADDR_SET,
+    };
+    uint8_t frame[128], buffer[VNET_HDR_SIZE + sizeof(frame)];
+    uint64_t rx_addr, tx_addr;
+    uint32_t rx_head, tx_head, len;
+    QDict *rsp, *filter;
+    int i;
+
+    if (!data) {
+        g_test_skip("No vhost-vdpa device");
+        return;
+    }
+
+    if (qvirtio_get_features(dev) & (1ull << VIRTIO_NET_F_CTRL_VQ)) {
+        memcpy(cmd + 2, mac, ETH_ALEN);
+        g_assert_cmpint(ctrl_cmd(net_if, t_alloc, cmd, sizeof(cmd)), ==,
+                        VIRTIO_NET_OK);
+        for (i = 0; i < ETH_ALEN; i++) {
+            g_assert_cmphex(qvirtio_config_readb(dev, i), ==, mac[i]);
+        }
+
+        rsp = qmp("{ 'execute': 'query-rx-filter' }");
+        filter = qobject_to(QDict,
+                            qlist_peek(qdict_get_qlist(rsp, "return")));
+        g_assert_cmpstr(qdict_get_str(filter, "main-mac"), ==,
+                        "52:54:00:12:34:99");
+        qobject_unref(rsp);
+    }
+
+    rx_addr = guest_alloc(t_alloc, sizeof(buffer));
+    rx_head = qvirtqueue_add(qts, rx, rx_addr, sizeof(buffer), true, false);
+    qvirtqueue_kick(qts, dev, rx, rx_head);
+
+    tx_addr = guest_alloc(t_alloc, sizeof(buffer));
+    qtest_memset(qts, tx_addr, 0, VNET_HDR_SIZE);
+    tx_batch_frame(frame, sizeof(frame), 1);
+    memwrite(tx_addr + VNET_HDR_SIZE, frame, sizeof(frame));
+    tx_head = qvirtqueue_add(qts, tx, tx_addr, VNET_HDR_SIZE + sizeof(frame),
+                             false, false);
+    qvirtqueue_kick(qts, dev, tx, tx_head);
+
+    qvirtio_wait_used_elem(qts, dev, tx, tx_head, NULL,
+                           QVIRTIO_NET_TIMEOUT_US);
+    qvirtio_wait_used_elem(qts, dev, rx, rx_head, &len,
+                           QVIRTIO_NET_TIMEOUT_US);
+    g_assert_cmpint(len, ==, VNET_HDR_SIZE + sizeof(frame));
+    memread(rx_addr + VNET_HDR_SIZE, buffer, sizeof(frame));
+    g_assert(!memcmp(buffer, frame, sizeof(frame)));
+
+    guest_free(t_alloc, tx_addr);
+    guest_free(t_alloc, rx_addr);
+}
+#endif
+
+static void virtio_net_test_cleanup_tap(void *opaque)
+{
+    TapTestData *t = opaque;
+
+    qos_invalidate_command_line();
+    if (t->pkt_fd >= 0) {
+        close(t->pkt_fd);
+    }
+    if (t->tap_fd >= 0) {
+        close(t->tap_fd);
+    }
+    if (t->veth[0]) {
+        g_autofree char *cmd = g_strdup_printf("ip link del %s", t->veth);
+
+        g_spawn_command_line_sync(cmd, NULL, NULL, NULL, NULL);
+    }
+    g_free(t);
+}
+
+/*
+ * Creating a tap needs CAP_NET_ADMIN, fall back to a hub port without.
+ * @arg are extra tap options, or NULL.
+ */
+static void *virtio_net_test_setup_tap(GString *cmd_line, void *arg)
+{
+    TapTestData *t = g_new0(TapTestData, 1);
+    struct ifreq ifr = {
+        .ifr_flags = IFF_TAP | IFF_NO_PI | IFF_VNET_HDR,
+    };
+
+    t->pkt_fd = -1;
+    t->tap_fd = open("/dev/net/tun", O_RDWR);
+    if (t->tap_fd >= 0 && ioctl(t->tap_fd, TUNSETIFF, &ifr) == 0) {
+        t->pkt_fd = socket(AF_PACKET, SOCK_RAW, 0);
+    }
+    if (t->pkt_fd >= 0 && ioctl(t->pkt_fd, SIOCGIFFLAGS, &ifr) == 0) {
+        ifr.ifr_flags |= IFF_UP;
+        if (ioctl(t->pkt_fd, SIOCSIFFLAGS, &ifr) == 0) {
+            t->ifindex = if_nametoindex(ifr.ifr_name);
+        }
+    }
+
+    if (t->ifindex) {
+        g_string_append_printf(cmd_line,
+                               " -netdev tap,id=hs0,fd=%d,vhost=off%s%s ",
+                               t->tap_fd, arg ? "," : "",
+                               arg ? (char *)arg : "");
+    } else {
+        g_string_append(cmd_line, " -netdev hubport,hubid=0,id=hs0 ");
+    }
+
+    g_test_queue_destroy(virtio_net_test_cleanup_tap, t);
+    return t;
+}
+
+#ifdef CONFIG_AF_XDP
+/* Runs "ip link @args", which needs CAP_NET_ADMIN */
+static bool ip_link(const char *args)
+{
+    g_autofree char *cmd = g_strdup_printf("ip link %s", args);
+    int status;
+
+    return g_spawn_command_line_sync(cmd, NULL, NULL, &status, NULL) &&
+           g_spawn_check_exit_status(status, NULL);
+}
+
+/* Falls back to a hub port when the veth pair cannot be created */
+static void *virtio_net_test_setup_af_xdp(GString *cmd_line, void *arg)
+{
+    TapTestData *t = g_new0(TapTestData, 1);
+    g_autofree char *add = NULL, *up = NULL, *peer_up = NULL;
+    char peer[IFNAMSIZ];
+
+    t->tap_fd = -1;
+    t->pkt_fd = -1;
+    snprintf(peer, sizeof(peer), "qxdp%dp", getpid());
+    snprintf(t->veth, sizeof(t->veth), "qxdp%d", getpid());
+    add = g_strdup_printf("add %s type veth peer name %s", t->veth, peer);
+    up = g_strdup_printf("set dev %s up", t->veth);
+    peer_up = g_strdup_printf("set dev %s up", peer);
+
+    if (!ip_link(add)) {
+        t->veth[0] = 0;
+    } else if (ip_link(up) && ip_link(peer_up)) {
+        t->pkt_fd = socket(AF_PACKET, SOCK_RAW, 0);
+        if (t->pkt_fd >= 0) {
+            t->ifindex = if_nametoindex(peer);
+        }
+    }
+
+    if (t->ifindex) {
+        g_string_append_printf(cmd_line,
+                               " -netdev af-xdp,id=hs0,ifname=%s,mode=skb ",
+                               t->veth);
+    } else {
+        g_string_append(cmd_line, " -netdev hubport,hubid=0,id=hs0 ");
+    }
+
+    g_test_queue_destroy(virtio_net_test_cleanup_tap, t);
+    return t;
+}
+#endif
+
+#ifdef CONFIG_VHOST_NET_VDPA
+#define VDPA_SIM_DEV "/dev/vhost-vdpa-0"
+
+/*
+ * Needs a vhost-vdpa device, for example from the vdpa_sim_net module,
+ * and falls back to a hub port without.  The device only accepts
+ * drivers that use the DMA API.
+ */
+static void *virtio_net_test_setup_vdpa(GString *cmd_line, void *arg)
+{
+    if (access(VDPA_SIM_DEV, R_OK | W_OK)) {
+        g_string_append(cmd_line, " -netdev hubport,hubid=0,id=hs0 ");
+        return NULL;
+    }
+
+    g_string_append(cmd_line, " -netdev vhost-vdpa,id=hs0,"
+                    "vhostdev=" VDPA_SIM_DEV ",x-svq=on"
+                    " -global virtio-device.iommu_platform=on ");
+    return (void *)VDPA_SIM_DEV;
+}
+#endif
+
+/* iothreads= only takes taps, so the device is left alone without one */
+static void *virtio_net_test_setup_iothread(GString *cmd_line, void *arg)
+{
+    TapTestData *t = virtio_net_test_setup_tap(cmd_line, NULL);
+
+    if (t->ifindex) {
+        g_string_append(cmd_line,
+                        " -object iothread,id=net-io0"
+                        " -global virtio-net-device.len-iothreads=1"
+                        " -global virtio-net-device.iothreads[0]=net-io0 ");
+    }
+    return t;
+}
+
+/*
+ * @arg is "userspace" to put filter-dump, which cannot be offloaded, in
+ * front of filter-drop.
+ */
+static void *virtio_net_test_setup_filter_drop(GString *cmd_line, void *arg)
+{
+    TapTestData *t = virtio_net_test_setup_tap(cmd_line, NULL);
+
+    t->filter_ebpf = !arg;
+    if (arg) {
+        g_string_append(cmd_line, " -object filter-dump,id=fdump0,netdev=hs0,"
+                        "file=/dev/null ");
+    }
+    g_string_append(cmd_line, " -object filter-drop,id=fdrop0,netdev=hs0,"
+                    "ip_proto=17,port=5353 ");
+    return t;
+}
+
 #endif
 
 static void hotplug(void *obj, void *data, QGuestAllocator *t_alloc)
@@ -323,9 +1104,37 @@ static void register_virtio_net_test(void)
 #ifndef _WIN32
     qos_add_test("basic", "virtio-net", send_recv_test, &opts);
     qos_add_test("rx_stop_cont", "virtio-net", stop_cont_test, &opts);
+    qos_add_test("rx_queue_stats", "virtio-net", queue_stats_test, &opts);
 #endif
     qos_add_test("announce-self", "virtio-net", announce_self, &opts);
 
+#ifdef CONFIG_LINUX
+    opts.before = virtio_net_test_setup_tap;
+    qos_add_test("rx_filter", "virtio-net", rx_filter_test, &opts);
+    opts.arg = (gpointer)"tx-uring=on";
+    qos_add_test("tx_batch/uring", "virtio-net", tx_batch_test, &opts);
+    opts.arg = (gpointer)"tx-uring=off";
+    qos_add_test("tx_batch/writev", "virtio-net", tx_batch_test, &opts);
+    opts.before = virtio_net_test_setup_iothread;
+    opts.arg = NULL;
+    qos_add_test("iothread", "virtio-net", iothread_test, &opts);
+    opts.before = virtio_net_test_setup_filter_drop;
+    qos_add_test("filter_drop/ebpf", "virtio-net", filter_drop_test, &opts);
+    opts.arg = (gpointer)"userspace";
+    qos_add_test("filter_drop/userspace", "virtio-net", filter_drop_test,
+                 &opts);
+#ifdef CONFIG_VHOST_NET_VDPA
+    opts.before = virtio_net_test_setup_vdpa;
+    opts.arg = NULL;
+    qos_add_test("vhost_vdpa/svq", "virtio-net", vdpa_svq_test, &opts);
+#endif
+#ifdef CONFIG_AF_XDP
+    opts.before = virtio_net_test_setup_af_xdp;
+    opts.arg = NULL;
+    qos_add_test("af_xdp", "virtio-net", af_xdp_test, &opts);
+#endif
+#endif
+
     /* These tests do not need a loopback backend.  */
     opts.before = virtio_net_test_setup_nosocket;
     opts.arg = (gpointer)UINT_MAX;
@@ -0,0 +1,41 @@
+#!/bin/sh
+#
+# Run the tb-recycle system test with the monitor on stdin.  Once the
+# guest has passed, check that "info jit" reports recycled TB regions.
+#
+# Usage: run-tb-recycle.sh OUTPUT QEMU [ARGS...]
+#
+# OUTPUT is the file that the semihosting output of the guest goes to.
+#
+# SPDX-License-Identifier: GPL-2.0-or-later
+
+out=$1
+shift
+fifo=$out.fifo
+mon=$out.mon
+
+rm -f "$out" "$fifo"
+mkfifo "$fifo" || exit 1
+
+"$@" -monitor stdio < "$fifo" > "$mon" &
+qemu=$!
+exec 3> "$fifo"
+rm -f "$fifo"
+
+# The guest exits on failure, and spins once it has printed OK
+while kill -0 $qemu 2> /dev/null && ! grep -q '^OK' "$out" 2> /dev/null; do
+    sleep 1
+done
+if kill -0 $qemu 2> /dev/null; then
+    echo "info jit" >&3
+    echo "quit" >&3
+fi
+exec 3>&-
+
+wait $qemu || exit $?
+
+recycled=$(sed -n 's/^TB regions recycled *\([0-9]*\).*/\1/p' "$mon")
+if [ -z "$recycled" ] || [ "$recycled" -eq 0 ]; then
+    echo "FAIL: no TB region was recycled"
+    exit 1
+fi
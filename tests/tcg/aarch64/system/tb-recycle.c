@@ -0,0 +1,229 @@
+/*
+ * Code buffer stress test
+ *
+ * Generate far more distinct translation blocks than the code buffer
+ * holds, so that TCG keeps reusing its regions, and check that every
+ * block still computes what the guest wrote last.  Two vCPUs run the
+ * code, through two different mappings so that each translates its own
+ * blocks.  Run it with MTTCG and a code buffer of more regions than
+ * vCPUs; run-tb-recycle.sh then checks that regions were recycled.
+ *
+ * On success the test does not exit, so that the monitor can look at
+ * the statistics.
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+#include <inttypes.h>
+#include <minilib.h>
+
+#define PAGE_SHIFT      12
+#define PAGE_SIZE       (1ull << PAGE_SHIFT)
+#define PTES_PER_TABLE  512
+
+/*
+ * The code is executed from the 1 GiB at 2 GiB, away from RAM, by the
+ * boot vCPU, and from the one at 3 GiB by the second vCPU
+ */
+#define CODE_VA         (2ull << 30)
+#define CODE_L1_INDEX   (CODE_VA >> 30)
+#define NR_VCPUS        2
+
+/* Each function is "add x0, x0, #imm; ret" */
+#define NR_FUNCS        65536
+#define FUNC_INSNS      2
+#define CODE_PAGES      (NR_FUNCS * FUNC_INSNS * 4 / PAGE_SIZE)
+#define NR_PASSES       4
+
+#define DESC_TABLE      3ull
+#define DESC_PAGE       3ull
+#define DESC_AF         (1ull << 10)
+
+#define INSN_ADD_X0_X0  0x91000000u
+#define INSN_RET        0xd65f03c0u
+
+static uint64_t l2_table[PTES_PER_TABLE]
+    __attribute__((aligned(PAGE_SIZE)));
+static uint64_t l3_table[PTES_PER_TABLE]
+    __attribute__((aligned(PAGE_SIZE)));
+
+/* Written through the one to one mapping of boot.S, which is not executable */
+static uint32_t code[NR_FUNCS * FUNC_INSNS]
+    __attribute__((aligned(PAGE_SIZE)));
+
+typedef uint64_t func_t(uint64_t);
+
+/* The second vCPU takes the MMU setup of the boot vCPU */
+static uint64_t secondary_regs[6] __attribute__((used));
+static uint64_t secondary_stack[1024] __attribute__((aligned(16)));
+
+/*
+ * The last pass that the boot vCPU generated, and the second one ran.
+ * Volatile, as each vCPU spins until the other one writes them.
+ */
+static volatile unsigned int pass_ready, pass_done;
+static volatile int secondary_failures;    /* read after the last pass */
+
+static void setup(void)
+{
+    uint64_t *l1_table;
+    unsigned int i;
+
+    for (i = 0; i < CODE_PAGES; i++) {
+        l3_table[i] = ((uintptr_t)code + i * PAGE_SIZE) | DESC_AF | DESC_PAGE;
+    }
+    l2_table[0] = (uintptr_t)l3_table | DESC_TABLE;
+
+    asm("mrs %0, ttbr0_el1" : "=r" (l1_table));
+    for (i = 0; i < NR_VCPUS; i++) {
+        l1_table[CODE_L1_INDEX + i] = (uintptr_t)l2_table | DESC_TABLE;
+    }
+    asm volatile("dsb ishst\n\t"
+                 "tlbi vmalle1\n\t"
+                 "dsb ish\n\t"
+                 "isb" : : : "memory");
+}
+
+static inline unsigned int func_imm(unsigned int func, unsigned int pass)
+{
+    return (func * 7 + pass) & 0xfff;
+}
+
+/* Rewrite every function, so that their old translations are stale */
+static void gen_code(unsigned int pass)
+{
+    unsigned int i;
+
+    for (i = 0; i < NR_FUNCS; i++) {
+        code[i * FUNC_INSNS] = INSN_ADD_X0_X0 | func_imm(i, pass) << 10;
+        code[i * FUNC_INSNS + 1] = INSN_RET;
+    }
+    asm volatile("dsb ish\n\t"
+                 "ic ialluis\n\t"
+                 "dsb ish\n\t"
+                 "isb" : : : "memory");
+}
+
+/* Run all the functions of @pass through the mapping of @vcpu */
+static int run_code(unsigned int vcpu, unsigned int pass)
+{
+    uint64_t va = CODE_VA + ((uint64_t)vcpu << 30);
+    uint64_t expected = 0, sum = 0;
+    unsigned int i;
+
+    for (i = 0; i < NR_FUNCS; i++) {
+        func_t *func = (func_t *)(va + i * FUNC_INSNS * 4);
+
+        sum = func(sum);
+        expected += func_imm(i, pass);
+    }
+    if (sum != expected) {
+        ml_printf("FAIL: vCPU %d pass %d: sum 0x%lx, not 0x%lx\n",
+                  vcpu, pass, sum, expected);
+        return 1;
+    }
+    return 0;
+}
+
+static void __attribute__((used)) secondary_main(void)
+{
+    unsigned int pass;
+
+    for (pass = 0; pass < NR_PASSES; pass++) {
+        while (pass_ready != pass + 1) {
+            /* wait for the boot vCPU to write the code */
+        }
+        secondary_failures += run_code(1, pass);
+        asm volatile("dsb ish" : : : "memory");
+        pass_done = pass + 1;
+    }
+}
+
+/* Entered with the MMU off and the stack pointer in x0 */
+asm(".pushsection .text\n"
+    "secondary_entry:\n"
+    "\tadrp x1, secondary_regs\n"
+    "\tadd x1, x1, :lo12:secondary_regs\n"
+    "\tldp x2, x3, [x1]\n"
+    "\tmsr mair_el1, x2\n"
+    "\tmsr tcr_el1, x3\n"
+    "\tldp x2, x3, [x1, #16]\n"
+    "\tmsr ttbr0_el1, x2\n"
+    "\tmsr vbar_el1, x3\n"
+    "\tldp x2, x3, [x1, #32]\n"
+    "\tmsr cpacr_el1, x2\n"
+    "\tisb\n"
+    "\tmsr sctlr_el1, x3\n"
+    "\tisb\n"
+    "\tmov sp, x0\n"
+    "\tbl secondary_main\n"
+    "1:\twfi\n"
+    "\tb 1b\n"
+    ".popsection\n");
+
+/* PSCI CPU_ON, through HVC as the virt machine has no EL2 or EL3 */
+static int64_t cpu_on(uint64_t mpidr, uint64_t entry, uint64_t arg)
+{
+    register uint64_t x0 asm("x0") = 0xc4000003;
+    register uint64_t x1 asm("x1") = mpidr;
+    register uint64_t x2 asm("x2") = entry;
+    register uint64_t x3 asm("x3") = arg;
+
+    asm volatile("hvc #0" : "+r" (x0) : "r" (x1), "r" (x2), "r" (x3)
+                 : "memory");
+    return x0;
+}
+
+static int start_secondary(void)
+{
+    uint64_t entry;
+    int64_t ret;
+
+    asm("adr %0, secondary_entry" : "=r" (entry));
+    asm("mrs %0, mair_el1" : "=r" (secondary_regs[0]));
+    asm("mrs %0, tcr_el1" : "=r" (secondary_regs[1]));
+    asm("mrs %0, ttbr0_el1" : "=r" (secondary_regs[2]));
+    asm("mrs %0, vbar_el1" : "=r" (secondary_regs[3]));
+    asm("mrs %0, cpacr_el1" : "=r" (secondary_regs[4]));
+    asm("mrs %0, sctlr_el1" : "=r" (secondary_regs[5]));
+    asm volatile("dsb ish" : : : "memory");
+
+    ret = cpu_on(1, entry,
+                 (uintptr_t)secondary_stack + sizeof(secondary_stack));
+    if (ret) {
+        ml_printf("FAIL: CPU_ON returned %ld\n", ret);
+        return 1;
+    }
+    return 0;
+}
+
+int main(void)
+{
+    unsigned int pass;
+    int failures = 0;
+
+    setup();
+    if (start_secondary()) {
+        return 1;
+    }
+
+    for (pass = 0; pass < NR_PASSES; pass++) {
+        gen_code(pass);
+        pass_ready = pass + 1;
+        failures += run_code(0, pass);
+        while (pass_done != pass + 1) {
+            /* the next pass rewrites the code that the second vCPU runs */
+        }
+    }
+    failures += secondary_failures;
+
+    if (failures) {
+        return 1;
+    }
+    ml_printf("OK\n");
+
+    /* Leave the statistics to the monitor */
+    for (;;) {
+        asm volatile("wfi");
+    }
+}
@@ -0,0 +1,564 @@
+/*
+ * TLB maintenance tests
+ *
+ * Map more pages than the softmmu TLBs hold, the same pages in two
+ * address spaces, blocks, or a level 3 table, change the mappings and
+ * check that the TLB invalidations and ASID switches never leave a stale
+ * translation or page table.
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <minilib.h>
+
+#define PAGE_SHIFT      12
+#define PAGE_SIZE       (1ull << PAGE_SHIFT)
+#define PTES_PER_TABLE  512
+
+/* Test pages live in the 1 GiB at 2 GiB, away from RAM and boot.S */
+#define TEST_VA         (2ull << 30)
+#define TEST_L1_INDEX   (TEST_VA >> 30)
+
+#define NR_PAGES        8192
+#define NR_FRAMES       64
+
+/* 2 MiB blocks follow the level 3 tables, and map RAM at 64 MiB */
+#define BLOCK_SHIFT     21
+#define BLOCK_SIZE      (1ull << BLOCK_SHIFT)
+#define FIRST_BLOCK     (NR_PAGES / PTES_PER_TABLE)
+#define NR_BLOCKS       12
+#define NR_BLOCK_FRAMES 4
+#define BLOCK_FRAMES_PA ((1ull << 30) + (64ull << 20))
+
+#define DESC_BLOCK      1ull
+#define DESC_TABLE      3ull
+#define DESC_PAGE       3ull
+#define DESC_AF         (1ull << 10)
+#define DESC_NG         (1ull << 11)
+#define DESC_XN         (3ull << 53)
+
+static uint64_t l2_table[PTES_PER_TABLE]
+    __attribute__((aligned(PAGE_SIZE)));
+static uint64_t l3_tables[NR_PAGES / PTES_PER_TABLE][PTES_PER_TABLE]
+    __attribute__((aligned(PAGE_SIZE)));
+static uint64_t frames[NR_FRAMES][PTES_PER_TABLE]
+    __attribute__((aligned(PAGE_SIZE)));
+
+/*
+ * A level 3 table at 128 MiB into the test pages, replaced by another
+ * one, for the page walk cache tests
+ */
+#define WC_L2_INDEX     64
+
+static uint64_t wc_tables[2][PTES_PER_TABLE]
+    __attribute__((aligned(PAGE_SIZE)));
+
+/* Two address spaces of one level 3 table each, for the ASID tests */
+#define NR_AS_PAGES     PTES_PER_TABLE
+
+static uint64_t as_l1_tables[2][PTES_PER_TABLE]
+    __attribute__((aligned(PAGE_SIZE)));
+static uint64_t as_l2_tables[2][PTES_PER_TABLE]
+    __attribute__((aligned(PAGE_SIZE)));
+static uint64_t as_l3_tables[2][PTES_PER_TABLE]
+    __attribute__((aligned(PAGE_SIZE)));
+
+static inline uint64_t page_va(unsigned int page)
+{
+    return TEST_VA + ((uint64_t)page << PAGE_SHIFT);
+}
+
+static inline uint64_t *page_pte(unsigned int page)
+{
+    return &l3_tables[page / PTES_PER_TABLE][page % PTES_PER_TABLE];
+}
+
+static inline uint64_t block_va(unsigned int block)
+{
+    return TEST_VA + ((uint64_t)(FIRST_BLOCK + block) << BLOCK_SHIFT);
+}
+
+static inline uint64_t read_va(uint64_t va)
+{
+    /* volatile: the compiler does not know that the mappings change */
+    return *(volatile uint64_t *)va;
+}
+
+static inline uint64_t read_page(unsigned int page)
+{
+    return read_va(page_va(page));
+}
+
+/* The frame that a page maps to in generation @gen */
+static inline unsigned int page_frame(unsigned int page, unsigned int gen)
+{
+    return (page + gen) % NR_FRAMES;
+}
+
+static uint64_t frame_desc(unsigned int frame)
+{
+    return (uintptr_t)frames[frame] | DESC_XN | DESC_AF | DESC_PAGE;
+}
+
+static void map_page(unsigned int page, unsigned int frame)
+{
+    *page_pte(page) = frame_desc(frame);
+}
+
+static void map_pages(unsigned int gen)
+{
+    unsigned int i;
+
+    for (i = 0; i < NR_PAGES; i++) {
+        map_page(i, page_frame(i, gen));
+    }
+    asm volatile("dsb ishst" : : : "memory");
+}
+
+static void map_block(unsigned int block, unsigned int frame)
+{
+    l2_table[FIRST_BLOCK + block] = (BLOCK_FRAMES_PA + frame * BLOCK_SIZE) |
+                                    DESC_XN | DESC_AF | DESC_BLOCK;
+}
+
+static void map_blocks(unsigned int gen)
+{
+    unsigned int i;
+
+    for (i = 0; i < NR_BLOCKS; i++) {
+        map_block(i, (i + gen) % NR_BLOCK_FRAMES);
+    }
+    asm volatile("dsb ishst" : : : "memory");
+}
+
+/* Map the pages of address space @as, not global */
+static void map_as_pages(unsigned int as, unsigned int gen)
+{
+    unsigned int i;
+
+    for (i = 0; i < NR_AS_PAGES; i++) {
+        as_l3_tables[as][i] = frame_desc(page_frame(i, gen)) | DESC_NG;
+    }
+    asm volatile("dsb ishst" : : : "memory");
+}
+
+static void set_ttbr0(uint64_t *l1_table, unsigned int asid)
+{
+    asm volatile("msr ttbr0_el1, %0\n\t"
+                 "isb" : : "r" ((uintptr_t)l1_table | (uint64_t)asid << 48)
+                 : "memory");
+}
+
+static void tlbi_vmalle1(void)
+{
+    asm volatile("dsb ishst\n\t"
+                 "tlbi vmalle1\n\t"
+                 "dsb ish\n\t"
+                 "isb" : : : "memory");
+}
+
+static void tlbi_vae1(uint64_t va)
+{
+    asm volatile("dsb ishst\n\t"
+                 "tlbi vae1, %0\n\t"
+                 "dsb ish\n\t"
+                 "isb" : : "r" (va >> PAGE_SHIFT) : "memory");
+}
+
+/* By VA for all ASIDs */
+static void tlbi_vaae1(uint64_t va)
+{
+    asm volatile("dsb ishst\n\t"
+                 "tlbi vaae1, %0\n\t"
+                 "dsb ish\n\t"
+                 "isb" : : "r" (va >> PAGE_SHIFT) : "memory");
+}
+
+static void tlbi_aside1(unsigned int asid)
+{
+    asm volatile("dsb ishst\n\t"
+                 "tlbi aside1, %0\n\t"
+                 "dsb ish\n\t"
+                 "isb" : : "r" ((uint64_t)asid << 48) : "memory");
+}
+
+/*
+ * TLBI RVAE1 for (@num + 1) << (5 * @scale + 1) pages from @va, with a
+ * 4 KiB granule.  Spelled as SYS so that no ARMv8.4 assembler is needed.
+ */
+static void tlbi_rvae1(uint64_t va, unsigned int scale, unsigned int num)
+{
+    uint64_t arg = (1ull << 46) | ((uint64_t)scale << 44) |
+                   ((uint64_t)num << 39) | (va >> PAGE_SHIFT);
+
+    asm volatile("dsb ishst\n\t"
+                 "sys #0, c8, c6, #1, %0\n\t"
+                 "dsb ish\n\t"
+                 "isb" : : "r" (arg) : "memory");
+}
+
+/* AT S1E1R, which reports a translation fault in PAR_EL1 instead */
+static bool at_s1e1r(uint64_t va)
+{
+    uint64_t par;
+
+    asm volatile("at s1e1r, %1\n\t"
+                 "isb\n\t"
+                 "mrs %0, par_el1" : "=r" (par) : "r" (va) : "memory");
+    return !(par & 1);
+}
+
+/*
+ * Read the first @nr_pages test pages, in an order that strides across
+ * the TLB sets, and check that they map to their frame in generation @gen.
+ */
+static int check_pages(const char *what, unsigned int nr_pages,
+                       unsigned int gen)
+{
+    unsigned int i, page, failures = 0;
+
+    for (i = 0; i < nr_pages; i++) {
+        uint64_t val;
+
+        page = (i * 97) % nr_pages;
+        val = read_page(page);
+        if (val != page_frame(page, gen) + 1) {
+            if (failures++ < 8) {
+                ml_printf("FAIL: %s: page %d reads 0x%lx, not 0x%x\n",
+                          what, page, val, page_frame(page, gen) + 1);
+            }
+        }
+    }
+    return failures;
+}
+
+/* What each page of the block frames holds */
+static inline uint64_t block_tag(unsigned int frame, unsigned int page)
+{
+    return (uint64_t)frame << 32 | page;
+}
+
+/* Check that every page of the blocks maps to the right frame and page */
+static int check_blocks(const char *what, unsigned int gen)
+{
+    unsigned int block, i, page, frame, failures = 0;
+
+    for (block = 0; block < NR_BLOCKS; block++) {
+        frame = (block + gen) % NR_BLOCK_FRAMES;
+        for (i = 0; i < PTES_PER_TABLE; i++) {
+            uint64_t val;
+
+            page = (i * 97) % PTES_PER_TABLE;
+            val = read_va(block_va(block) + page * PAGE_SIZE);
+            if (val != block_tag(frame, page)) {
+                if (failures++ < 8) {
+                    ml_printf("FAIL: %s: block %d page %d reads 0x%lx, "
+                              "not 0x%lx\n", what, block, page, val,
+                              block_tag(frame, page));
+                }
+            }
+        }
+    }
+    return failures;
+}
+
+static void setup(void)
+{
+    uint64_t *l1_table;
+    unsigned int i;
+
+    for (i = 0; i < NR_FRAMES; i++) {
+        frames[i][0] = i + 1;
+    }
+    for (i = 0; i < NR_PAGES / PTES_PER_TABLE; i++) {
+        l2_table[i] = (uintptr_t)l3_tables[i] | DESC_TABLE;
+    }
+    map_pages(0);
+
+    /* boot.S maps RAM one to one, including its level 1 table */
+    asm("mrs %0, ttbr0_el1" : "=r" (l1_table));
+    l1_table[TEST_L1_INDEX] = (uintptr_t)l2_table | DESC_TABLE;
+    tlbi_vmalle1();
+}
+
+/*
+ * The working set is far larger than the main TLB, so most pages are
+ * only found in the victim or second-level TLB.  Stale entries there
+ * must go on each kind of invalidation, and across resizes.
+ */
+static int test_eviction(void)
+{
+    int failures = 0;
+    unsigned int i, gen = 0;
+
+    for (i = 0; i < 3; i++) {
+        failures += check_pages("fill", NR_PAGES, gen);
+    }
+
+    /* By page */
+    gen++;
+    for (i = 0; i < NR_PAGES; i++) {
+        map_page(i, page_frame(i, gen));
+        tlbi_vae1(page_va(i));
+    }
+    failures += check_pages("TLBI VAE1", NR_PAGES, gen);
+
+    /* By range: 512 pages at a time, then 32 pages at a time */
+    failures += check_pages("refill", NR_PAGES, gen);
+    map_pages(++gen);
+    for (i = 0; i < NR_PAGES / 2; i += 512) {
+        tlbi_rvae1(page_va(i), 1, 7);
+    }
+    for (; i < NR_PAGES; i += 32) {
+        tlbi_rvae1(page_va(i), 0, 15);
+    }
+    failures += check_pages("TLBI RVAE1", NR_PAGES, gen);
+
+    /* Full flushes with a large working set grow the second-level TLB */
+    for (i = 0; i < 4; i++) {
+        tlbi_vmalle1();
+        failures += check_pages("grow", NR_PAGES, gen);
+    }
+    gen++;
+    for (i = 0; i < NR_PAGES; i++) {
+        map_page(i, page_frame(i, gen));
+        tlbi_vae1(page_va(i));
+    }
+    failures += check_pages("TLBI VAE1 after growing", NR_PAGES, gen);
+
+    /* ... and a small one lets it shrink back once the window expires */
+    for (i = 0; i < 1000; i++) {
+        read_page(i % 16);
+        tlbi_vmalle1();
+    }
+    failures += check_pages("refill after shrinking", NR_PAGES, gen);
+    map_pages(++gen);
+    for (i = 0; i < NR_PAGES; i += 512) {
+        tlbi_rvae1(page_va(i), 1, 7);
+    }
+    failures += check_pages("TLBI RVAE1 after shrinking", NR_PAGES, gen);
+
+    return failures;
+}
+
+/*
+ * Two address spaces map the same pages to different frames, with nG
+ * set.  Switching ASIDs must never hit the other ASID's entries, and
+ * TLBI ASIDE1 must drop those of its ASID even when it is not current.
+ */
+static int test_asid(void)
+{
+    uint64_t *boot_l1_table;
+    unsigned int as, i;
+    int failures = 0;
+
+    asm("mrs %0, ttbr0_el1" : "=r" (boot_l1_table));
+    for (as = 0; as < 2; as++) {
+        for (i = 0; i < PTES_PER_TABLE; i++) {
+            as_l1_tables[as][i] = boot_l1_table[i];
+        }
+        as_l1_tables[as][TEST_L1_INDEX] =
+            (uintptr_t)as_l2_tables[as] | DESC_TABLE;
+        as_l2_tables[as][0] = (uintptr_t)as_l3_tables[as] | DESC_TABLE;
+    }
+    map_as_pages(0, 10);
+    map_as_pages(1, 20);
+    tlbi_vmalle1();
+
+    for (i = 0; i < 2; i++) {
+        set_ttbr0(as_l1_tables[0], 1);
+        failures += check_pages("ASID 1", NR_AS_PAGES, 10);
+        set_ttbr0(as_l1_tables[1], 2);
+        failures += check_pages("ASID 2", NR_AS_PAGES, 20);
+    }
+
+    /* Remap ASID 2 while ASID 1 is current */
+    set_ttbr0(as_l1_tables[0], 1);
+    map_as_pages(1, 21);
+    tlbi_aside1(2);
+    failures += check_pages("ASID 1 after TLBI ASIDE1 2",
+                            NR_AS_PAGES, 10);
+    set_ttbr0(as_l1_tables[1], 2);
+    failures += check_pages("TLBI ASIDE1 of another ASID", NR_AS_PAGES, 21);
+
+    /* Remap the current ASID */
+    map_as_pages(1, 22);
+    tlbi_aside1(2);
+    failures += check_pages("TLBI ASIDE1 of the current ASID",
+                            NR_AS_PAGES, 22);
+
+    /* Give ASID 1 to the other tables, as an OS does on ASID rollover */
+    set_ttbr0(as_l1_tables[0], 1);
+    failures += check_pages("ASID 1 before reuse", NR_AS_PAGES, 10);
+    tlbi_aside1(1);
+    set_ttbr0(as_l1_tables[1], 1);
+    failures += check_pages("reused ASID", NR_AS_PAGES, 22);
+
+    /* Global entries are shared by all ASIDs */
+    for (as = 0; as < 2; as++) {
+        as_l3_tables[as][0] = frame_desc(5);
+    }
+    tlbi_vaae1(page_va(0));
+    set_ttbr0(as_l1_tables[0], 2);
+    failures += read_page(0) != 5 + 1;
+    for (as = 0; as < 2; as++) {
+        as_l3_tables[as][0] = frame_desc(6);
+    }
+    tlbi_vaae1(page_va(0));
+    set_ttbr0(as_l1_tables[1], 1);
+    failures += read_page(0) != 6 + 1;
+
+    set_ttbr0(boot_l1_table, 0);
+    tlbi_vmalle1();
+    return failures;
+}
+
+/*
+ * Misses within a block are filled from the large page that an earlier
+ * walk found, more blocks than the TLB keeps in rotation.  Invalidating
+ * any part of a block must drop all of it.
+ */
+static int test_large_pages(void)
+{
+    unsigned int frame, page, block;
+    int failures = 0;
+
+    /* Blocks 0 to NR_BLOCK_FRAMES - 1 map each frame once */
+    map_blocks(0);
+    tlbi_vmalle1();
+    for (frame = 0; frame < NR_BLOCK_FRAMES; frame++) {
+        for (page = 0; page < PTES_PER_TABLE; page++) {
+            *(uint64_t *)(block_va(frame) + page * PAGE_SIZE) =
+                block_tag(frame, page);
+        }
+    }
+    failures += check_blocks("fill", 0);
+    failures += check_blocks("refill", 0);
+
+    /* By a page in the middle of the block */
+    map_blocks(1);
+    for (block = 0; block < NR_BLOCKS; block++) {
+        tlbi_vae1(block_va(block) + 37 * PAGE_SIZE);
+    }
+    failures += check_blocks("TLBI VAE1 within a block", 1);
+
+    /* By a range of 32 pages in the middle of the block */
+    map_blocks(2);
+    for (block = 0; block < NR_BLOCKS; block++) {
+        tlbi_rvae1(block_va(block) + 256 * PAGE_SIZE, 0, 15);
+    }
+    failures += check_blocks("TLBI RVAE1 within a block", 2);
+
+    return failures;
+}
+
+static inline uint64_t wc_va(unsigned int page)
+{
+    return TEST_VA + ((uint64_t)WC_L2_INDEX << BLOCK_SHIFT) +
+           page * PAGE_SIZE;
+}
+
+enum {
+    WC_TLBI_VAE1,
+    WC_TLBI_ASIDE1,
+    WC_TLBI_VMALLE1,
+};
+
+static const char *const wc_tlbi_names[] = {
+    [WC_TLBI_VAE1] = "TLBI VAE1",
+    [WC_TLBI_ASIDE1] = "TLBI ASIDE1",
+    [WC_TLBI_VMALLE1] = "TLBI VMALLE1",
+};
+
+/*
+ * Walk to page 0 through table 0, whose entry for page 0 is invalid if
+ * @fault, replace table 0 with table 1 in the level 2 table and
+ * invalidate with @tlbi.  Page 1, which no walk has translated yet,
+ * must then map through table 1.
+ */
+static int check_walk_cache(int tlbi, bool fault)
+{
+    unsigned int i;
+    uint64_t val;
+    int failures = 0;
+
+    for (i = 0; i < PTES_PER_TABLE; i++) {
+        wc_tables[0][i] = frame_desc(30);
+        wc_tables[1][i] = frame_desc(31);
+    }
+    if (fault) {
+        wc_tables[0][0] = 0;
+    }
+    l2_table[WC_L2_INDEX] = (uintptr_t)wc_tables[0] | DESC_TABLE;
+    tlbi_vmalle1();
+
+    if (fault) {
+        if (at_s1e1r(wc_va(0))) {
+            ml_printf("FAIL: %s: page 0 translates\n", wc_tlbi_names[tlbi]);
+            failures++;
+        }
+    } else {
+        failures += read_va(wc_va(0)) != 30 + 1;
+    }
+
+    l2_table[WC_L2_INDEX] = (uintptr_t)wc_tables[1] | DESC_TABLE;
+    switch (tlbi) {
+    case WC_TLBI_VAE1:
+        tlbi_vae1(wc_va(0));
+        break;
+    case WC_TLBI_ASIDE1:
+        /* boot.S runs with ASID 0 */
+        tlbi_aside1(0);
+        break;
+    case WC_TLBI_VMALLE1:
+        tlbi_vmalle1();
+        break;
+    }
+
+    val = read_va(wc_va(1));
+    if (val != 31 + 1) {
+        ml_printf("FAIL: %s%s: page 1 reads 0x%lx from the old table\n",
+                  wc_tlbi_names[tlbi], fault ? " after a fault" : "", val);
+        failures++;
+    }
+    return failures;
+}
+
+/*
+ * Replacing a table descriptor and invalidating any page that it
+ * translates, or the whole ASID or TLB, must drop the table from the
+ * page walk cache, whether the walk that cached it faulted or not.
+ */
+static int test_walk_cache(void)
+{
+    int failures = 0;
+    int tlbi;
+
+    for (tlbi = WC_TLBI_VAE1; tlbi <= WC_TLBI_VMALLE1; tlbi++) {
+        failures += check_walk_cache(tlbi, false);
+        failures += check_walk_cache(tlbi, true);
+    }
+    l2_table[WC_L2_INDEX] = 0;
+    tlbi_vmalle1();
+    return failures;
+}
+
+int main(void)
+{
+    int failures = 0;
+
+    setup();
+    failures += test_eviction();
+    failures += test_asid();
+    failures += test_large_pages();
+    failures += test_walk_cache();
+
+    if (failures) {
+        ml_printf("FAIL: %d stale translations\n", failures);
+        return 1;
+    }
+    ml_printf("OK\n");
+    return 0;
+}
@@ -123,6 +123,39 @@ static void check_bitmap_set(void)
     bitmap_set_case(bitmap_set_atomic);
 }
 
+static void check_bitmap_count_and_clear(void)
+{
+    unsigned long *bmap;
+    int offset;
+
+    bmap = bitmap_new(BMAP_SIZE);
+
+    for (offset = 0; offset <= BITS_PER_LONG; offset++) {
+        /* Count bits [BITS_PER_LONG - offset, 3*BITS_PER_LONG + offset) */
+        bitmap_set(bmap, 0, BMAP_SIZE);
+        g_assert_cmpint(bitmap_count_and_clear_atomic(bmap,
+                                                      BITS_PER_LONG - offset,
+                                                      2 * BITS_PER_LONG +
+                                                      2 * offset),
+                        ==, 2 * BITS_PER_LONG + 2 * offset);
+        g_assert_cmpint(find_next_zero_bit(bmap, BMAP_SIZE, 0),
+                        ==, BITS_PER_LONG - offset);
+        g_assert_cmpint(find_next_bit(bmap, BMAP_SIZE, BITS_PER_LONG - offset),
+                        ==, 3 * BITS_PER_LONG + offset);
+        g_assert_cmpint(bitmap_count_one(bmap, BMAP_SIZE),
+                        ==, BMAP_SIZE - 2 * BITS_PER_LONG - 2 * offset);
+    }
+
+    /* Only set bits are counted, and nothing is left to count */
+    bitmap_clear(bmap, 0, BMAP_SIZE);
+    bitmap_set(bmap, 10, 3);
+    bitmap_set(bmap, BITS_PER_LONG + 5, 1);
+    g_assert_cmpint(bitmap_count_and_clear_atomic(bmap, 0, BMAP_SIZE), ==, 4);
+    g_assert_cmpint(bitmap_count_and_clear_atomic(bmap, 0, BMAP_SIZE), ==, 0);
+
+    g_free(bmap);
+}
+
 int main(int argc, char **argv)
 {
     g_test_init(&argc, &argv, NULL);
@@ -131,6 +164,8 @@ int main(int argc, char **argv)
                     check_bitmap_copy_with_offset);
     g_test_add_func("/bitmap/bitmap_set",
                     check_bitmap_set);
+    g_test_add_func("/bitmap/bitmap_count_and_clear",
+                    check_bitmap_count_and_clear);
 
     g_test_run();
 
@@ -0,0 +1,189 @@
+/*
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ *
+ * IOVA tree unit-tests: allocation of iova ranges and reverse lookups.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/iova-tree.h"
+
+#define PAGE 0x1000
+
+static int alloc_range(IOVATree *tree, hwaddr *iova, hwaddr size,
+                      hwaddr translated_addr, hwaddr begin, hwaddr last)
+{
+    DMAMap map = {
+        .translated_addr = translated_addr,
+        .size = size - 1,
+        .perm = IOMMU_RW,
+    };
+    int ret = iova_tree_alloc_map(tree, &map, begin, last);
+
+    *iova = map.iova;
+    return ret;
+}
+
+/* The lowest hole that is large enough is used */
+static void check_alloc_hole(void)
+{
+    IOVATree *tree = iova_tree_new();
+    DMAMap fixed = { .iova = 4 * PAGE, .size = PAGE - 1, .perm = IOMMU_RW };
+    DMAMap first = { .iova = PAGE, .size = PAGE - 1 };
+    hwaddr iova;
+
+    g_assert_cmpint(iova_tree_insert(tree, &fixed), ==, IOVA_OK);
+
+    g_assert_cmpint(alloc_range(tree, &iova, PAGE, 0, PAGE, 0xffff), ==,
+                    IOVA_OK);
+    g_assert_cmphex(iova, ==, PAGE);
+    g_assert_cmpint(alloc_range(tree, &iova, PAGE, 0, PAGE, 0xffff), ==,
+                    IOVA_OK);
+    g_assert_cmphex(iova, ==, 2 * PAGE);
+
+    /* A freed range is used again before anything above it */
+    iova_tree_remove(tree, &first);
+    g_assert_cmpint(alloc_range(tree, &iova, PAGE, 0, PAGE, 0xffff), ==,
+                    IOVA_OK);
+    g_assert_cmphex(iova, ==, PAGE);
+
+    /* The page at 3 * PAGE is too small, go past the fixed mapping */
+    g_assert_cmpint(alloc_range(tree, &iova, 2 * PAGE, 0, PAGE, 0xffff), ==,
+                    IOVA_OK);
+    g_assert_cmphex(iova, ==, 5 * PAGE);
+
+    /* A hole that fits exactly */
+    g_assert_cmpint(alloc_range(tree, &iova, PAGE, 0, PAGE, 0xffff), ==,
+                    IOVA_OK);
+    g_assert_cmphex(iova, ==, 3 * PAGE);
+
+    iova_tree_destroy(tree);
+}
+
+/* Nothing is allocated past iova_last, but iova_last itself can be */
+static void check_alloc_last(void)
+{
+    IOVATree *tree = iova_tree_new();
+    DMAMap low = { .iova = 0, .size = PAGE - 1, .perm = IOMMU_RW };
+    DMAMap top = {
+        .iova = HWADDR_MAX - PAGE + 1, .size = PAGE - 1, .perm = IOMMU_RW,
+    };
+    hwaddr iova;
+
+    g_assert_cmpint(alloc_range(tree, &iova, PAGE, 0, PAGE, 2 * PAGE - 1), ==,
+                    IOVA_OK);
+    g_assert_cmphex(iova, ==, PAGE);
+    g_assert_cmpint(alloc_range(tree, &iova, PAGE + 1, 0, 3 * PAGE,
+                               4 * PAGE - 1), ==, IOVA_ERR_INVALID);
+
+    /* The hole above the last mapping ends at iova_last */
+    iova_tree_insert(tree, &low);
+    g_assert_cmpint(alloc_range(tree, &iova, PAGE, 0, 0, 3 * PAGE - 2), ==,
+                    IOVA_ERR_NOMEM);
+    g_assert_cmpint(alloc_range(tree, &iova, PAGE, 0, 0, 3 * PAGE - 1), ==,
+                    IOVA_OK);
+    g_assert_cmphex(iova, ==, 2 * PAGE);
+
+    /* A mapping that ends at HWADDR_MAX leaves no hole after it */
+    iova_tree_insert(tree, &top);
+    g_assert_cmpint(alloc_range(tree, &iova, PAGE, 0, 3 * PAGE, HWADDR_MAX),
+                    ==, IOVA_OK);
+    g_assert_cmphex(iova, ==, 3 * PAGE);
+    g_assert_cmpint(alloc_range(tree, &iova, PAGE, 0, HWADDR_MAX - PAGE + 1,
+                               HWADDR_MAX), ==, IOVA_ERR_NOMEM);
+
+    iova_tree_destroy(tree);
+}
+
+static void check_alloc_full(void)
+{
+    IOVATree *tree = iova_tree_new();
+    DMAMap none = { .size = PAGE - 1, .perm = IOMMU_NONE };
+    hwaddr iova;
+    int i;
+
+    for (i = 0; i < 4; i++) {
+        g_assert_cmpint(alloc_range(tree, &iova, PAGE, 0, 0, 4 * PAGE - 1), ==,
+                        IOVA_OK);
+        g_assert_cmphex(iova, ==, i * PAGE);
+    }
+    g_assert_cmpint(alloc_range(tree, &iova, PAGE, 0, 0, 4 * PAGE - 1), ==,
+                    IOVA_ERR_NOMEM);
+    g_assert_cmpint(alloc_range(tree, &iova, 1, 0, 0, 4 * PAGE - 1), ==,
+                    IOVA_ERR_NOMEM);
+
+    /* Invalid requests fail before looking at the tree */
+    g_assert_cmpint(iova_tree_alloc_map(tree, &none, 8 * PAGE, 9 * PAGE), ==,
+                    IOVA_ERR_INVALID);
+    g_assert_cmpint(alloc_range(tree, &iova, PAGE, 0, 9 * PAGE, 8 * PAGE), ==,
+                    IOVA_ERR_INVALID);
+
+    iova_tree_destroy(tree);
+}
+
+static void check_find_iova(void)
+{
+    IOVATree *tree = iova_tree_new();
+    DMAMap needle = { .translated_addr = 0x10800, .size = 0 };
+    DMAMap *map;
+    hwaddr iova_a, iova_b;
+
+    alloc_range(tree, &iova_a, PAGE, 0x10000, 0, HWADDR_MAX);
+    alloc_range(tree, &iova_b, 2 * PAGE, 0x40000, 0, HWADDR_MAX);
+
+    map = iova_tree_find_iova(tree, &needle);
+    g_assert_nonnull(map);
+    g_assert_cmphex(map->iova, ==, iova_a);
+    g_assert_cmphex(map->translated_addr, ==, 0x10000);
+
+    /* Any overlap of the translated ranges is a match */
+    needle = (DMAMap) { .translated_addr = 0x3f000, .size = 0x1000 };
+    map = iova_tree_find_iova(tree, &needle);
+    g_assert_nonnull(map);
+    g_assert_cmphex(map->iova, ==, iova_b);
+
+    needle = (DMAMap) { .translated_addr = 0x20000, .size = PAGE - 1 };
+    g_assert_null(iova_tree_find_iova(tree, &needle));
+
+    iova_tree_destroy(tree);
+}
+
+/* Removal takes out every mapping that the range overlaps */
+static void check_remove_overlap(void)
+{
+    IOVATree *tree = iova_tree_new();
+    DMAMap range = { .iova = PAGE + PAGE / 2, .size = PAGE - 1 };
+    hwaddr iova;
+    int i;
+
+    for (i = 0; i < 4; i++) {
+        alloc_range(tree, &iova, PAGE, 0, 0, HWADDR_MAX);
+    }
+
+    iova_tree_remove(tree, &range);
+    g_assert_nonnull(iova_tree_find_address(tree, 0));
+    g_assert_null(iova_tree_find_address(tree, PAGE));
+    g_assert_null(iova_tree_find_address(tree, 2 * PAGE));
+    g_assert_nonnull(iova_tree_find_address(tree, 3 * PAGE));
+
+    /* Both pages are free again */
+    g_assert_cmpint(alloc_range(tree, &iova, 2 * PAGE, 0, 0, HWADDR_MAX), ==,
+                    IOVA_OK);
+    g_assert_cmphex(iova, ==, PAGE);
+
+    iova_tree_destroy(tree);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_func("/iova-tree/alloc_hole", check_alloc_hole);
+    g_test_add_func("/iova-tree/alloc_last", check_alloc_last);
+    g_test_add_func("/iova-tree/alloc_full", check_alloc_full);
+    g_test_add_func("/iova-tree/find_iova", check_find_iova);
+    g_test_add_func("/iova-tree/remove_overlap", check_remove_overlap);
+
+    g_test_run();
+
+    return 0;
+}
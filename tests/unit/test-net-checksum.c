@@ -0,0 +1,111 @@
+/*
+ * Internet checksum tests
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "net/checksum.h"
+
+static uint8_t buffer[70000];
+static uint8_t copy[70000];
+
+/* The byte at a time version the accelerated ones must agree with */
+static uint32_t checksum_ref(int len, const uint8_t *buf, int seq)
+{
+    uint32_t sum1 = 0, sum2 = 0;
+    int i;
+
+    for (i = 0; i < len - 1; i += 2) {
+        sum1 += buf[i];
+        sum2 += buf[i + 1];
+    }
+    if (i < len) {
+        sum1 += buf[i];
+    }
+
+    return seq & 1 ? sum1 + (sum2 << 8) : sum2 + (sum1 << 8);
+}
+
+static void check_checksum(int len, int align, int seq)
+{
+    uint16_t ref = net_checksum_finish(checksum_ref(len, buffer + align, seq));
+    uint32_t sum;
+
+    sum = net_checksum_add_cont(len, buffer + align, seq);
+    g_assert_cmphex(net_checksum_finish(sum), ==, ref);
+
+    memset(copy, 0x5a, len);
+    sum = net_checksum_copy_cont(copy, buffer + align, len, seq);
+    g_assert_cmphex(net_checksum_finish(sum), ==, ref);
+    g_assert(!memcmp(copy, buffer + align, len));
+}
+
+static void check_all_lengths(void)
+{
+    int len, align, seq;
+
+    for (align = 0; align < 16; align++) {
+        for (len = 0; len < 300; len++) {
+            for (seq = 0; seq < 2; seq++) {
+                check_checksum(len, align, seq);
+            }
+        }
+        for (len = 300; len < sizeof(buffer) - 16; len += 997) {
+            check_checksum(len, align, 0);
+        }
+    }
+}
+
+static void test_checksum(void)
+{
+    /* All zeroes, all ones, and random data */
+    static const int patterns[] = { 0, 0xff, -1 };
+    int i, j;
+
+    do {
+        g_test_message("checksum(%s)", net_checksum_accel_name());
+        for (i = 0; i < ARRAY_SIZE(patterns); i++) {
+            for (j = 0; j < sizeof(buffer); j++) {
+                buffer[j] = patterns[i] < 0 ? g_test_rand_int() : patterns[i];
+            }
+            check_all_lengths();
+        }
+    } while (test_net_checksum_next_accel());
+}
+
+static void test_checksum_iov(void)
+{
+    struct iovec iov[4];
+    uint32_t ref, sum;
+    int i;
+
+    for (i = 0; i < 1500; i++) {
+        buffer[i] = g_test_rand_int();
+    }
+
+    /* Odd sized elements, so that they start at odd checksum offsets */
+    iov[0] = (struct iovec) { .iov_base = buffer, .iov_len = 13 };
+    iov[1] = (struct iovec) { .iov_base = buffer + 13, .iov_len = 700 };
+    iov[2] = (struct iovec) { .iov_base = buffer + 713, .iov_len = 1 };
+    iov[3] = (struct iovec) { .iov_base = buffer + 714, .iov_len = 786 };
+
+    ref = net_checksum_add_iov(iov, 4, 5, 1490, 1);
+    memset(copy, 0, sizeof(copy));
+    sum = net_checksum_iov_to_buf(iov, 4, 5, copy, 1490, 1);
+
+    g_assert_cmphex(net_checksum_finish(sum), ==, net_checksum_finish(ref));
+    g_assert_cmphex(net_checksum_finish(sum), ==,
+                    net_checksum_finish(checksum_ref(1490, buffer + 5, 1)));
+    g_assert(!memcmp(copy, buffer + 5, 1490));
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/net/checksum/buffer", test_checksum);
+    g_test_add_func("/net/checksum/iov", test_checksum_iov);
+
+    return g_test_run();
+}
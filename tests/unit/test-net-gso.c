@@ -0,0 +1,373 @@
+/*
+ * Software GSO/GRO tests
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/iov.h"
+#include "net/checksum.h"
+#include "net/gso.h"
+
+#define MSS         1448
+#define PAYLOAD     40000
+
+/* Ethernet, IP, and TCP with a timestamp option */
+#define L3_OFF      ETH_HLEN
+#define TCP_OPTS    12
+
+static uint8_t packet[NET_GSO_MAX_SIZE];
+static uint8_t segment[NET_GSO_MAX_SIZE];
+static NetGsoBatch batch;
+
+typedef struct TestState {
+    NetGro *gro;
+    bool is_v6;
+    size_t l4_off;
+    uint32_t next_seq;
+    int nsegs;
+    int ndelivered;
+    /* deliver() refuses the packets */
+    bool full;
+    struct virtio_net_hdr vhdr;
+    uint8_t delivered[NET_GSO_MAX_SIZE];
+    size_t delivered_size;
+} TestState;
+
+static size_t build_tcp(bool is_v6, struct virtio_net_hdr *vhdr)
+{
+    size_t l4_off = L3_OFF + (is_v6 ? sizeof(struct ip6_header) :
+                                      sizeof(struct ip_header));
+    size_t hdr_len = l4_off + sizeof(struct tcp_header) + TCP_OPTS;
+    uint8_t *l3 = packet + L3_OFF;
+    uint8_t *l4 = packet + l4_off;
+    int i;
+
+    memset(packet, 0, hdr_len);
+    memset(packet, 0x52, 12);
+    stw_be_p(packet + 12, is_v6 ? ETH_P_IPV6 : ETH_P_IP);
+    if (is_v6) {
+        l3[0] = 0x60;
+        l3[6] = IP_PROTO_TCP;
+        l3[7] = 64;
+        for (i = 0; i < 32; i++) {
+            l3[8 + i] = i;
+        }
+    } else {
+        l3[0] = 0x45;
+        stw_be_p(l3 + 4, 0x1234);
+        stw_be_p(l3 + 6, IP_DF);
+        l3[8] = 64;
+        l3[9] = IP_PROTO_TCP;
+        stl_be_p(l3 + 12, 0x0a000001);
+        stl_be_p(l3 + 16, 0x0a000002);
+    }
+
+    stw_be_p(l4, 5001);
+    stw_be_p(l4 + 2, 40000);
+    stl_be_p(l4 + 4, 0xfffff000);
+    stl_be_p(l4 + 8, 0x12345678);
+    l4[12] = (sizeof(struct tcp_header) + TCP_OPTS) << 2;
+    l4[13] = TH_ACK | TH_PUSH;
+    stw_be_p(l4 + 14, 512);
+    l4[20] = 1;
+    l4[21] = 1;
+    l4[22] = 8;
+    l4[23] = 10;
+
+    for (i = 0; i < PAYLOAD; i++) {
+        packet[hdr_len + i] = g_test_rand_int();
+    }
+
+    *vhdr = (struct virtio_net_hdr) {
+        .flags = VIRTIO_NET_HDR_F_NEEDS_CSUM,
+        .gso_type = is_v6 ? VIRTIO_NET_HDR_GSO_TCPV6 :
+                            VIRTIO_NET_HDR_GSO_TCPV4,
+        .hdr_len = hdr_len,
+        .gso_size = MSS,
+        .csum_start = l4_off,
+        .csum_offset = offsetof(struct tcp_header, th_sum),
+    };
+    return hdr_len + PAYLOAD;
+}
+
+static uint16_t l4_checksum(uint8_t *buf, size_t size, bool is_v6,
+                            size_t l4_off)
+{
+    uint8_t *l3 = buf + L3_OFF;
+    uint32_t sum = net_checksum_add(size - l4_off, buf + l4_off);
+
+    if (is_v6) {
+        sum += net_checksum_add(32, l3 + 8) + l3[6];
+    } else {
+        sum += net_checksum_add(8, l3 + 12) + l3[9];
+    }
+    return net_checksum_finish(sum + size - l4_off);
+}
+
+static void check_segment(TestState *s, const NetPacketIOV *pkt)
+{
+    size_t size = iov_to_buf(pkt->iov, pkt->iovcnt, 0, segment,
+                             sizeof(segment));
+    size_t hdr_len = s->l4_off + sizeof(struct tcp_header) + TCP_OPTS;
+    uint8_t *l3 = segment + L3_OFF;
+    uint8_t *l4 = segment + s->l4_off;
+
+    g_assert_cmpint(size, <=, hdr_len + MSS);
+    g_assert_cmpint(size, >, hdr_len);
+    if (s->is_v6) {
+        g_assert_cmpint(lduw_be_p(l3 + 4), ==, size - s->l4_off);
+    } else {
+        g_assert_cmpint(lduw_be_p(l3 + 2), ==, size - L3_OFF);
+        g_assert_cmpint(lduw_be_p(l3 + 4), ==, 0x1234 + s->nsegs);
+        g_assert_cmphex(net_raw_checksum(l3, sizeof(struct ip_header)), ==, 0);
+    }
+    g_assert_cmphex((uint32_t)ldl_be_p(l4 + 4), ==, s->next_seq);
+    g_assert_cmphex(l4_checksum(segment, size, s->is_v6, s->l4_off), ==, 0);
+    g_assert(!memcmp(segment + hdr_len,
+                     packet + hdr_len + (s->next_seq - 0xfffff000),
+                     size - hdr_len));
+
+    s->next_seq += size - hdr_len;
+    s->nsegs++;
+    /* Only the last segment keeps PSH */
+    g_assert_cmpint(!!(l4[13] & TH_PUSH), ==,
+                    s->next_seq - 0xfffff000 == PAYLOAD);
+
+    if (s->gro) {
+        g_assert(net_gro_receive(s->gro, segment, size));
+    }
+}
+
+static void flush_segments(NetGsoBatch *b, bool last, void *opaque)
+{
+    TestState *s = opaque;
+    int i;
+
+    g_assert(b == &batch);
+    g_assert_cmpint(b->npkts, >, 0);
+    g_assert(last || b->npkts == NET_GSO_BATCH);
+    for (i = 0; i < b->npkts; i++) {
+        check_segment(s, &b->pkts[i]);
+    }
+}
+
+static bool deliver(const struct virtio_net_hdr *vhdr, const uint8_t *buf,
+                    size_t size, void *opaque)
+{
+    TestState *s = opaque;
+
+    if (s->full) {
+        return false;
+    }
+    s->vhdr = *vhdr;
+    memcpy(s->delivered, buf, size);
+    s->delivered_size = size;
+    s->ndelivered++;
+    return true;
+}
+
+static void test_gso_gro(bool is_v6)
+{
+    TestState s = {
+        .is_v6 = is_v6,
+        .next_seq = 0xfffff000,
+    };
+    struct virtio_net_hdr vhdr;
+    size_t size = build_tcp(is_v6, &vhdr);
+    size_t hdr_len = vhdr.hdr_len;
+    struct iovec iov[3];
+    uint8_t *l4;
+
+    s.l4_off = vhdr.csum_start;
+    s.gro = net_gro_new(deliver, &s);
+
+    /* Odd sized elements, the segments must straddle them */
+    iov[0] = (struct iovec) { .iov_base = packet, .iov_len = 61 };
+    iov[1] = (struct iovec) { .iov_base = packet + 61, .iov_len = 20001 };
+    iov[2] = (struct iovec) { .iov_base = packet + 20062,
+                              .iov_len = size - 20062 };
+
+    g_assert_cmpint(net_gso_segment(&batch, &vhdr, iov, 3,
+                                    flush_segments, &s),
+                    ==, DIV_ROUND_UP(PAYLOAD, MSS));
+    g_assert_cmpint(s.nsegs, ==, DIV_ROUND_UP(PAYLOAD, MSS));
+
+    /* The short last segment with PSH delivers the coalesced packet */
+    g_assert_cmpint(s.ndelivered, ==, 1);
+    g_assert(!net_gro_pending(s.gro));
+    g_assert_cmpint(s.delivered_size, ==, size);
+    g_assert_cmpint(s.vhdr.gso_type, ==, vhdr.gso_type);
+    g_assert_cmpint(s.vhdr.gso_size, ==, MSS);
+    g_assert_cmpint(s.vhdr.hdr_len, ==, hdr_len);
+    g_assert_cmpint(s.vhdr.csum_start, ==, s.l4_off);
+    g_assert_cmpint(s.vhdr.csum_offset, ==, vhdr.csum_offset);
+    g_assert(s.vhdr.flags & VIRTIO_NET_HDR_F_NEEDS_CSUM);
+    g_assert(!memcmp(s.delivered + hdr_len, packet + hdr_len, PAYLOAD));
+
+    /* Completing the checksum as the receiver would must give a valid one */
+    l4 = s.delivered + s.l4_off;
+    stw_be_p(l4 + vhdr.csum_offset,
+             net_raw_checksum(l4, size - s.l4_off));
+    g_assert_cmphex(l4_checksum(s.delivered, size, is_v6, s.l4_off), ==, 0);
+
+    net_gro_free(s.gro);
+}
+
+static void test_tcp4(void)
+{
+    test_gso_gro(false);
+}
+
+static void test_tcp6(void)
+{
+    test_gso_gro(true);
+}
+
+/* Build a full-sized TCPv4 segment with ACK in packet[] */
+static size_t build_gro_segment(TestState *s, size_t *hdr_len)
+{
+    struct virtio_net_hdr vhdr;
+    size_t size;
+
+    build_tcp(false, &vhdr);
+    *hdr_len = vhdr.hdr_len;
+    size = vhdr.hdr_len + MSS;
+    s->l4_off = vhdr.csum_start;
+    packet[s->l4_off + 13] = TH_ACK;
+    stw_be_p(packet + L3_OFF + 2, size - L3_OFF);
+    stw_be_p(packet + L3_OFF + 10, 0);
+    stw_be_p(packet + L3_OFF + 10,
+             net_raw_checksum(packet + L3_OFF, sizeof(struct ip_header)));
+    return size;
+}
+
+static void set_gro_segment_seq(TestState *s, size_t size, uint32_t seq)
+{
+    stl_be_p(packet + s->l4_off + 4, seq);
+    stw_be_p(packet + s->l4_off + 16, 0);
+    stw_be_p(packet + s->l4_off + 16,
+             l4_checksum(packet, size, false, s->l4_off));
+}
+
+static void test_gro_reorder(void)
+{
+    TestState s = { .is_v6 = false };
+    size_t hdr_len;
+    size_t size;
+    int i;
+
+    s.gro = net_gro_new(deliver, &s);
+    size = build_gro_segment(&s, &hdr_len);
+
+    /* Two in-order segments, then one from the future */
+    for (i = 0; i < 3; i++) {
+        set_gro_segment_seq(&s, size, 1000 + (i == 2 ? 3 : i) * MSS);
+        g_assert(net_gro_receive(s.gro, packet, size));
+    }
+    g_assert_cmpint(s.ndelivered, ==, 1);
+    g_assert_cmpint(s.delivered_size, ==, hdr_len + 2 * MSS);
+    g_assert_cmpint(s.vhdr.gso_type, ==, VIRTIO_NET_HDR_GSO_TCPV4);
+
+    /* A bad checksum is not coalesced, and delivers the flow first */
+    packet[size - 1] ^= 1;
+    g_assert(!net_gro_receive(s.gro, packet, size));
+    g_assert_cmpint(s.ndelivered, ==, 2);
+    g_assert_cmpint(s.delivered_size, ==, size);
+    g_assert_cmpint(s.vhdr.gso_type, ==, VIRTIO_NET_HDR_GSO_NONE);
+    g_assert(!net_gro_pending(s.gro));
+
+    net_gro_free(s.gro);
+}
+
+static void flush_csum(NetGsoBatch *b, bool last, void *opaque)
+{
+    size_t *size = opaque;
+
+    g_assert(last);
+    g_assert_cmpint(b->npkts, ==, 1);
+    *size = iov_to_buf(b->pkts[0].iov, b->pkts[0].iovcnt, 0, segment,
+                       sizeof(segment));
+}
+
+static void test_csum(void)
+{
+    struct virtio_net_hdr vhdr;
+    size_t size = build_tcp(false, &vhdr);
+    size_t l4_off = vhdr.csum_start;
+    struct iovec iov = { .iov_base = packet, .iov_len = size };
+    size_t out = 0;
+
+    /* The field holds the pseudo header sum, as guests send it */
+    vhdr.gso_type = VIRTIO_NET_HDR_GSO_NONE;
+    stw_be_p(packet + L3_OFF + 2, size - L3_OFF);
+    stw_be_p(packet + l4_off + 16,
+             (uint16_t)~net_checksum_finish(net_checksum_add(8,
+                                            packet + L3_OFF + 12) +
+                                            IP_PROTO_TCP + size - l4_off));
+
+    g_assert_cmpint(net_gso_segment(&batch, &vhdr, &iov, 1,
+                                    flush_csum, &out), ==, 1);
+    g_assert_cmpint(out, ==, size);
+    g_assert_cmphex(l4_checksum(segment, size, false, l4_off), ==, 0);
+    g_assert(!memcmp(segment + l4_off + 20, packet + l4_off + 20,
+                     size - l4_off - 20));
+}
+
+/*
+ * A flow that the receiver has no room for stays held, keeps coalescing,
+ * and is not overtaken by a frame of the same flow.
+ */
+static void test_gro_full(void)
+{
+    TestState s = { .is_v6 = false };
+    size_t hdr_len;
+    size_t size;
+    int i;
+
+    s.gro = net_gro_new(deliver, &s);
+    size = build_gro_segment(&s, &hdr_len);
+
+    for (i = 0; i < 2; i++) {
+        set_gro_segment_seq(&s, size, 1000 + i * MSS);
+        g_assert(net_gro_receive(s.gro, packet, size));
+    }
+    s.full = true;
+    net_gro_flush(s.gro);
+    g_assert_cmpint(s.ndelivered, ==, 0);
+    g_assert(net_gro_pending(s.gro));
+
+    set_gro_segment_seq(&s, size, 1000 + 2 * MSS);
+    g_assert(net_gro_receive(s.gro, packet, size));
+
+    /* Not coalesced, and the flow cannot be delivered before it */
+    set_gro_segment_seq(&s, size, 1000 + 3 * MSS);
+    packet[size - 1] ^= 1;
+    g_assert(!net_gro_receive(s.gro, packet, size));
+    g_assert_cmpint(s.ndelivered, ==, 0);
+    g_assert(net_gro_pending(s.gro));
+
+    s.full = false;
+    net_gro_flush(s.gro);
+    g_assert_cmpint(s.ndelivered, ==, 1);
+    g_assert_cmpint(s.delivered_size, ==, hdr_len + 3 * MSS);
+    g_assert_cmpint(lduw_be_p(s.delivered + L3_OFF + 2), ==,
+                    hdr_len + 3 * MSS - L3_OFF);
+    g_assert_cmpint(s.vhdr.gso_type, ==, VIRTIO_NET_HDR_GSO_TCPV4);
+    g_assert(!net_gro_pending(s.gro));
+
+    net_gro_free(s.gro);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/net/gso/tcp4", test_tcp4);
+    g_test_add_func("/net/gso/tcp6", test_tcp6);
+    g_test_add_func("/net/gso/csum", test_csum);
+    g_test_add_func("/net/gro/reorder", test_gro_reorder);
+    g_test_add_func("/net/gro/full", test_gro_full);
+
+    return g_test_run();
+}
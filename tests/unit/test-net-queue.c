@@ -0,0 +1,189 @@
+/*
+ * NetQueue tests
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "net/net.h"
+#include "net/queue.h"
+
+/* As in net/queue.c */
+#define POOL_SIZE   256
+#define SLOT_SIZE   2048
+
+typedef struct TestState {
+    NetQueue *queue;
+    /* deliver() refuses the packets */
+    bool busy;
+    int ndelivered;
+    int nsent;
+    uint8_t seq;
+    uint8_t next_seq;
+} TestState;
+
+static TestState ts;
+static NetClientState sender;
+
+/* Nothing but the peer decides here whether packets are queued */
+int qemu_can_send_packet(NetClientState *nc)
+{
+    return 1;
+}
+
+static ssize_t deliver(NetClientState *nc, unsigned flags,
+                       const struct iovec *iov, int iovcnt, void *opaque)
+{
+    TestState *t = opaque;
+    const uint8_t *data = iov[0].iov_base;
+
+    g_assert(nc == &sender);
+    g_assert_cmpint(iovcnt, ==, 1);
+    if (t->busy) {
+        return 0;
+    }
+
+    /* The first byte of each packet is its sequence number */
+    g_assert_cmpint(data[0], ==, t->next_seq);
+    t->next_seq++;
+    t->ndelivered++;
+    return iov[0].iov_len;
+}
+
+static void sent(NetClientState *nc, ssize_t ret)
+{
+    ts.nsent++;
+}
+
+static void send_packets(int n, size_t size, NetPacketSent *sent_cb)
+{
+    static uint8_t buf[SLOT_SIZE + 1];
+    int i;
+
+    g_assert(size <= sizeof(buf));
+    for (i = 0; i < n; i++) {
+        buf[0] = ts.seq++;
+        g_assert_cmpint(qemu_net_queue_send(ts.queue, &sender, 0, buf, size,
+                                            sent_cb), ==, 0);
+    }
+}
+
+static NetQueueStats get_stats(void)
+{
+    NetQueueStats stats;
+
+    qemu_net_queue_get_stats(ts.queue, &stats);
+    return stats;
+}
+
+static void setup(void)
+{
+    memset(&ts, 0, sizeof(ts));
+    ts.queue = qemu_new_net_queue(deliver, &ts);
+    ts.busy = true;
+}
+
+static void teardown(void)
+{
+    qemu_del_net_queue(ts.queue);
+}
+
+/*
+ * Packets that fit a slot of the pool are not allocated on their own,
+ * until the pool runs out.  Delivered and purged packets give their slot
+ * back.
+ */
+static void test_pool(void)
+{
+    NetQueueStats stats;
+
+    setup();
+
+    send_packets(POOL_SIZE, 64, sent);
+    stats = get_stats();
+    g_assert_cmpint(stats.len, ==, POOL_SIZE);
+    g_assert_cmpint(stats.queued, ==, POOL_SIZE);
+    g_assert_cmpint(stats.allocated, ==, 0);
+
+    /* The pool is exhausted */
+    send_packets(1, 64, sent);
+    g_assert_cmpint(get_stats().allocated, ==, 1);
+
+    ts.busy = false;
+    g_assert(qemu_net_queue_flush(ts.queue));
+    g_assert_cmpint(ts.ndelivered, ==, POOL_SIZE + 1);
+    g_assert_cmpint(ts.nsent, ==, POOL_SIZE + 1);
+
+    /* Every slot is back */
+    ts.busy = true;
+    send_packets(POOL_SIZE, SLOT_SIZE, sent);
+    stats = get_stats();
+    g_assert_cmpint(stats.len, ==, POOL_SIZE);
+    g_assert_cmpint(stats.peak, ==, POOL_SIZE + 1);
+    g_assert_cmpint(stats.queued, ==, 2 * POOL_SIZE + 1);
+    g_assert_cmpint(stats.allocated, ==, 1);
+
+    qemu_net_queue_purge(ts.queue, &sender);
+    g_assert_cmpint(get_stats().len, ==, 0);
+    g_assert_cmpint(ts.nsent, ==, 2 * POOL_SIZE + 1);
+    send_packets(POOL_SIZE, 64, sent);
+    g_assert_cmpint(get_stats().allocated, ==, 1);
+
+    teardown();
+}
+
+/* Packets larger than a slot are always allocated on their own */
+static void test_large(void)
+{
+    setup();
+
+    send_packets(1, SLOT_SIZE + 1, sent);
+    send_packets(1, 64, sent);
+    g_assert_cmpint(get_stats().allocated, ==, 1);
+
+    ts.busy = false;
+    g_assert(qemu_net_queue_flush(ts.queue));
+    g_assert_cmpint(ts.ndelivered, ==, 2);
+
+    teardown();
+}
+
+/* Without a sent callback, packets are dropped once the queue is full */
+static void test_drop(void)
+{
+    NetQueueStats stats;
+    int maxlen;
+
+    setup();
+
+    /* The queue takes up to 10000 packets */
+    for (maxlen = 0; !get_stats().dropped; maxlen++) {
+        g_assert_cmpint(maxlen, <=, 10000);
+        send_packets(1, 64, NULL);
+    }
+    maxlen--;
+
+    stats = get_stats();
+    g_assert_cmpint(maxlen, ==, 10000);
+    g_assert_cmpint(stats.len, ==, maxlen);
+    g_assert_cmpint(stats.peak, ==, maxlen);
+    g_assert_cmpint(stats.queued, ==, maxlen);
+    g_assert_cmpint(stats.dropped, ==, 1);
+    g_assert_cmpint(stats.allocated, ==, maxlen - POOL_SIZE);
+
+    /* A callback lets the packet in anyway */
+    send_packets(1, 64, sent);
+    g_assert_cmpint(get_stats().len, ==, maxlen + 1);
+
+    teardown();
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/net/queue/pool", test_pool);
+    g_test_add_func("/net/queue/large", test_large);
+    g_test_add_func("/net/queue/drop", test_drop);
+    return g_test_run();
+}
@@ -16,6 +16,22 @@ struct IOVATree {
     GTree *tree;
 };
 
+typedef struct IOVATreeFindIOVAArgs {
+    const DMAMap *needle;
+    DMAMap *result;
+} IOVATreeFindIOVAArgs;
+
+/* Walk state of iova_tree_alloc_map(), looking at the hole before @this */
+typedef struct IOVATreeAllocArgs {
+    hwaddr new_size;            /* Inclusive */
+    hwaddr iova_begin;
+    hwaddr iova_last;
+    const DMAMap *prev;         /* NULL if @this is the first mapping */
+    const DMAMap *this;         /* NULL past the last mapping */
+    hwaddr iova_result;
+    bool iova_found;
+} IOVATreeAllocArgs;
+
 static int iova_tree_compare(gconstpointer a, gconstpointer b, gpointer data)
 {
     const DMAMap *m1 = a, *m2 = b;
@@ -80,6 +96,115 @@ int iova_tree_insert(IOVATree *tree, DMAMap *map)
     return IOVA_OK;
 }
 
+static gboolean iova_tree_find_iova_iterator(gpointer key, gpointer value,
+                                             gpointer data)
+{
+    IOVATreeFindIOVAArgs *args = data;
+    const DMAMap *needle = args->needle;
+    DMAMap *map = key;
+
+    g_assert(key == value);
+
+    if (map->translated_addr + map->size < needle->translated_addr ||
+        needle->translated_addr + needle->size < map->translated_addr) {
+        return false;
+    }
+
+    args->result = map;
+    return true;
+}
+
+DMAMap *iova_tree_find_iova(IOVATree *tree, DMAMap *map)
+{
+    IOVATreeFindIOVAArgs args = {
+        .needle = map,
+    };
+
+    g_tree_foreach(tree->tree, iova_tree_find_iova_iterator, &args);
+    return args.result;
+}
+
+static bool iova_tree_alloc_map_in_hole(IOVATreeAllocArgs *args)
+{
+    const DMAMap *prev = args->prev, *this = args->this;
+    hwaddr hole_start, hole_last;
+
+    if (prev) {
+        if (prev->iova + prev->size == HWADDR_MAX) {
+            return false;
+        }
+        hole_start = MAX(prev->iova + prev->size + 1, args->iova_begin);
+    } else {
+        hole_start = args->iova_begin;
+    }
+
+    if (this) {
+        if (this->iova == 0) {
+            return false;
+        }
+        hole_last = MIN(this->iova - 1, args->iova_last);
+    } else {
+        hole_last = args->iova_last;
+    }
+
+    if (hole_start > hole_last || hole_last - hole_start < args->new_size) {
+        return false;
+    }
+
+    args->iova_result = hole_start;
+    args->iova_found = true;
+    return true;
+}
+
+static gboolean iova_tree_alloc_traverse(gpointer key, gpointer value,
+                                         gpointer data)
+{
+    IOVATreeAllocArgs *args = data;
+    DMAMap *map = key;
+
+    g_assert(key == value);
+
+    args->prev = args->this;
+    args->this = map;
+
+    /* Stop once the holes are past the allowed range */
+    if (args->prev && args->prev->iova > args->iova_last) {
+        return true;
+    }
+    return iova_tree_alloc_map_in_hole(args);
+}
+
+int iova_tree_alloc_map(IOVATree *tree, DMAMap *map, hwaddr iova_begin,
+                        hwaddr iova_last)
+{
+    IOVATreeAllocArgs args = {
+        .new_size = map->size,
+        .iova_begin = iova_begin,
+        .iova_last = iova_last,
+    };
+
+    if (iova_begin > iova_last || map->size > iova_last - iova_begin ||
+        map->perm == IOMMU_NONE) {
+        return IOVA_ERR_INVALID;
+    }
+
+    g_tree_foreach(tree->tree, iova_tree_alloc_traverse, &args);
+    if (!args.iova_found) {
+        /* The hole after the last mapping */
+        args.prev = args.this;
+        args.this = NULL;
+        if (!args.prev || args.prev->iova <= iova_last) {
+            iova_tree_alloc_map_in_hole(&args);
+        }
+    }
+    if (!args.iova_found) {
+        return IOVA_ERR_NOMEM;
+    }
+
+    map->iova = args.iova_result;
+    return iova_tree_insert(tree, map);
+}
+
 static gboolean iova_tree_traverse(gpointer key, gpointer value,
                                 gpointer data)
 {